@@ -0,0 +1,150 @@
+#include "allocStats.h"
+
+#ifndef WITH_ALLOC_STATS
+
+bool allocStats::isEnabled() { return false; }
+allocCounts allocStats::process() { return allocCounts(); }
+allocCounts allocStats::thread() { return allocCounts(); }
+long long allocStats::liveBytes() { return 0; }
+long long allocStats::peakBytes() { return 0; }
+
+#else
+
+#include "opencv2/core/core.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// The counters are plain integers, so that operator new can update them before anything is constructed
+std::atomic<long long> totalAllocations(0), totalBytes(0), totalMatAllocations(0), totalMatBytes(0);
+std::atomic<long long> live(0), peak(0);
+thread_local long long threadAllocations = 0, threadBytes = 0, threadMatAllocations = 0, threadMatBytes = 0;
+
+void countAllocation(size_t size, bool mat)
+{
+    totalAllocations.fetch_add(1, std::memory_order_relaxed);
+    totalBytes.fetch_add(size, std::memory_order_relaxed);
+    threadAllocations++;
+    threadBytes += size;
+    if (mat)
+    {
+        totalMatAllocations.fetch_add(1, std::memory_order_relaxed);
+        totalMatBytes.fetch_add(size, std::memory_order_relaxed);
+        threadMatAllocations++;
+        threadMatBytes += size;
+    }
+    long long now = live.fetch_add(size, std::memory_order_relaxed) + size;
+    long long p = peak.load(std::memory_order_relaxed);
+    while (now > p && !peak.compare_exchange_weak(p, now, std::memory_order_relaxed)) {}
+}
+
+void countFree(size_t size)
+{
+    live.fetch_sub(size, std::memory_order_relaxed);
+}
+
+// The size of each block is kept in front of it, in a header that keeps the alignment of malloc
+const size_t headerSize = 16;
+
+void *countedAlloc(size_t size)
+{
+    char *p = (char *)malloc(size + headerSize);
+    if (!p)
+        return NULL;
+    *(size_t *)p = size;
+    countAllocation(size, false);
+    return p + headerSize;
+}
+
+void countedFree(void *ptr)
+{
+    if (!ptr)
+        return;
+    char *p = (char *)ptr - headerSize;
+    countFree(*(size_t *)p);
+    free(p);
+}
+
+#if CV_MAJOR_VERSION >= 3
+// The default allocator of the Mat data, forwarding to the standard one. The Mats it allocates are freed by it too
+class countingMatAllocator : public cv::MatAllocator
+{
+public:
+    countingMatAllocator() : base(cv::Mat::getStdAllocator()) { cv::Mat::setDefaultAllocator(this); }
+
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, int flags,
+                           cv::UMatUsageFlags usageFlags) const
+    {
+        cv::UMatData *u = base->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        if (u)
+        {
+            u->prevAllocator = u->currAllocator = this;
+            if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+                countAllocation(u->size, true);
+        }
+        return u;
+    }
+    bool allocate(cv::UMatData *u, int accessFlags, cv::UMatUsageFlags usageFlags) const
+    {
+        return base->allocate(u, accessFlags, usageFlags);
+    }
+    void deallocate(cv::UMatData *u) const
+    {
+        if (u && !(u->flags & cv::UMatData::USER_ALLOCATED))
+            countFree(u->size);
+        base->deallocate(u);
+    }
+
+private:
+    cv::MatAllocator *base;
+};
+
+// Never freed, as Mats of static objects may be released after the other static objects are destroyed
+cv::MatAllocator *matAllocator = new countingMatAllocator;
+#endif
+
+}
+
+void *operator new(size_t size)
+{
+    void *p = countedAlloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+void operator delete(void *p) noexcept { countedFree(p); }
+void operator delete[](void *p) noexcept { countedFree(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { countedFree(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { countedFree(p); }
+
+bool allocStats::isEnabled() { return true; }
+
+allocCounts allocStats::process()
+{
+    allocCounts c;
+    c.allocations = totalAllocations.load(std::memory_order_relaxed);
+    c.bytes = totalBytes.load(std::memory_order_relaxed);
+    c.matAllocations = totalMatAllocations.load(std::memory_order_relaxed);
+    c.matBytes = totalMatBytes.load(std::memory_order_relaxed);
+    return c;
+}
+
+allocCounts allocStats::thread()
+{
+    allocCounts c;
+    c.allocations = threadAllocations;
+    c.bytes = threadBytes;
+    c.matAllocations = threadMatAllocations;
+    c.matBytes = threadMatBytes;
+    return c;
+}
+
+long long allocStats::liveBytes() { return live.load(std::memory_order_relaxed); }
+long long allocStats::peakBytes() { return peak.load(std::memory_order_relaxed); }
+
+#endif
@@ -0,0 +1,53 @@
+/*
+Allocation counters of the builds with ALLOC_STATS=1 (see the Makefile).
+
+Those builds replace the global operator new and delete, and with OpenCV 3 and later the default allocator
+of the Mat data, by versions that count the allocations and their bytes. The counts of the whole process are
+kept, to measure the stages of a run on every thread, and the counts of each thread, to measure an image on
+the thread that detects it. The bytes still allocated and their peak give the heap footprint.
+
+Without the flag nothing is replaced, the counts stay at 0 and isEnabled() is false, so the callers only
+report them when it is true.
+*/
+
+#ifndef _allocStats_H
+#define _allocStats_H
+
+struct allocCounts {
+    long long allocations = 0;      // Allocations, of operator new and of Mat data
+    long long bytes = 0;            // Bytes of those allocations
+    long long matAllocations = 0;   // Of them, the Mat data
+    long long matBytes = 0;
+
+    allocCounts operator-(const allocCounts &b) const
+    {
+        allocCounts d;
+        d.allocations = allocations - b.allocations;
+        d.bytes = bytes - b.bytes;
+        d.matAllocations = matAllocations - b.matAllocations;
+        d.matBytes = matBytes - b.matBytes;
+        return d;
+    }
+    allocCounts &operator+=(const allocCounts &b)
+    {
+        allocations += b.allocations;
+        bytes += b.bytes;
+        matAllocations += b.matAllocations;
+        matBytes += b.matBytes;
+        return *this;
+    }
+};
+
+class allocStats
+{
+public:
+    static bool isEnabled();
+    // Counts since the start of the process, and those of the calling thread since it started
+    static allocCounts process();
+    static allocCounts thread();
+    // Bytes allocated and not freed yet, and their peak since the start of the process
+    static long long liveBytes();
+    static long long peakBytes();
+};
+
+#endif
@@ -149,3 +149,4 @@ information on how to run the examples.
 #include "markerdetector.h"
 #include "posetracker.h"
 #include "cvdrawingutils.h"
+#include "projectionkernel.h"
@@ -26,6 +26,7 @@ authors and should not be interpreted as representing official policies, either
 or implied, of Rafael Muñoz Salinas.
 ********************************/
 #include "cameraparameters.h"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <opencv2/core/core.hpp>
@@ -35,6 +36,7 @@ namespace aruco {
 
 
 CameraParameters::CameraParameters() {
+    _type = defaultPrecision();
     CameraMatrix = cv::Mat();
     Distorsion = cv::Mat();
     CamSize = cv::Size(-1, -1);
@@ -44,12 +46,16 @@ CameraParameters::CameraParameters() {
  * @param distorsionCoeff 4x1 matrix (k1,k2,p1,p2)
  * @param size image size
  */
-CameraParameters::CameraParameters(cv::Mat cameraMatrix, cv::Mat distorsionCoeff, cv::Size size) throw(cv::Exception) {
+CameraParameters::CameraParameters(cv::Mat cameraMatrix, cv::Mat distorsionCoeff, cv::Size size, int type) throw(cv::Exception) {
+    _type = type == -1 ? defaultPrecision() : type;
+    if (_type != CV_32F && _type != CV_64F)
+        throw cv::Exception(9000, "invalid precision", "CameraParameters::CameraParameters", __FILE__, __LINE__);
     setParams(cameraMatrix, distorsionCoeff, size);
 }
 /**
  */
 CameraParameters::CameraParameters(const CameraParameters &CI) {
+    _type = CI._type;
     CI.CameraMatrix.copyTo(CameraMatrix);
     CI.Distorsion.copyTo(Distorsion);
     CamSize = CI.CamSize;
@@ -58,6 +64,7 @@ CameraParameters::CameraParameters(const CameraParameters &CI) {
 /**
 */
 CameraParameters &CameraParameters::operator=(const CameraParameters &CI) {
+    _type = CI._type;
     CI.CameraMatrix.copyTo(CameraMatrix);
     CI.Distorsion.copyTo(Distorsion);
     CamSize = CI.CamSize;
@@ -68,12 +75,12 @@ CameraParameters &CameraParameters::operator=(const CameraParameters &CI) {
 void CameraParameters::setParams(cv::Mat cameraMatrix, cv::Mat distorsionCoeff, cv::Size size) throw(cv::Exception) {
     if (cameraMatrix.rows != 3 || cameraMatrix.cols != 3)
         throw cv::Exception(9000, "invalid input cameraMatrix", "CameraParameters::setParams", __FILE__, __LINE__);
-    cameraMatrix.convertTo(CameraMatrix, CV_32FC1);
+    cameraMatrix.convertTo(CameraMatrix, _type);
     if (distorsionCoeff.total() < 4 || distorsionCoeff.total() >= 7)
         throw cv::Exception(9000, "invalid input distorsionCoeff", "CameraParameters::setParams", __FILE__, __LINE__);
     cv::Mat auxD;
 
-    distorsionCoeff.convertTo(Distorsion, CV_32FC1);
+    distorsionCoeff.convertTo(Distorsion, _type);
 
     //     Distorsion.create(1,4,CV_32FC1);
     //     for (int i=0;i<4;i++)
@@ -82,6 +89,28 @@ void CameraParameters::setParams(cv::Mat cameraMatrix, cv::Mat distorsionCoeff,
     CamSize = size;
 }
 
+/**
+*/
+void CameraParameters::setPrecision(int type) {
+    if (type != CV_32F && type != CV_64F)
+        throw cv::Exception(9000, "invalid precision", "CameraParameters::setPrecision", __FILE__, __LINE__);
+    _type = type;
+    if (!CameraMatrix.empty() && CameraMatrix.depth() != type)
+        CameraMatrix.convertTo(CameraMatrix, type);
+    if (!Distorsion.empty() && Distorsion.depth() != type)
+        Distorsion.convertTo(Distorsion, type);
+}
+
+/**
+*/
+int CameraParameters::defaultPrecision() {
+#ifdef DOUBLE_PRECISION_PNP
+    return CV_64F;
+#else
+    return CV_32F;
+#endif
+}
+
 /**
 */
 cv::Point3f CameraParameters::getCameraLocation(cv::Mat Rvec, cv::Mat Tvec) {
@@ -112,14 +141,14 @@ void CameraParameters::saveToFile(string path, bool inXML) throw(cv::Exception)
         if (!file)
             throw cv::Exception(9006, "could not open file:" + path, "CameraParameters::saveToFile", __FILE__, __LINE__);
         file << "# Aruco 1.0 CameraParameters" << endl;
-        file << "fx = " << CameraMatrix.at< float >(0, 0) << endl;
-        file << "cx = " << CameraMatrix.at< float >(0, 2) << endl;
-        file << "fy = " << CameraMatrix.at< float >(1, 1) << endl;
-        file << "cy = " << CameraMatrix.at< float >(1, 2) << endl;
-        file << "k1 = " << Distorsion.at< float >(0, 0) << endl;
-        file << "k2 = " << Distorsion.at< float >(1, 0) << endl;
-        file << "p1 = " << Distorsion.at< float >(2, 0) << endl;
-        file << "p2 = " << Distorsion.at< float >(3, 0) << endl;
+        file << "fx = " << value(CameraMatrix, 0) << endl;
+        file << "cx = " << value(CameraMatrix, 2) << endl;
+        file << "fy = " << value(CameraMatrix, 4) << endl;
+        file << "cy = " << value(CameraMatrix, 5) << endl;
+        file << "k1 = " << value(Distorsion, 0) << endl;
+        file << "k2 = " << value(Distorsion, 1) << endl;
+        file << "p1 = " << value(Distorsion, 2) << endl;
+        file << "p2 = " << value(Distorsion, 3) << endl;
         file << "width = " << CamSize.width << endl;
         file << "height = " << CamSize.height << endl;
     } else {
@@ -140,12 +169,19 @@ void CameraParameters::resize(cv::Size size) throw(cv::Exception) {
         return;
     // now, read the camera size
     // resize the camera parameters to fit this image size
-    float AxFactor = float(size.width) / float(CamSize.width);
-    float AyFactor = float(size.height) / float(CamSize.height);
-    CameraMatrix.at< float >(0, 0) *= AxFactor;
-    CameraMatrix.at< float >(0, 2) *= AxFactor;
-    CameraMatrix.at< float >(1, 1) *= AyFactor;
-    CameraMatrix.at< float >(1, 2) *= AyFactor;
+    double AxFactor = double(size.width) / double(CamSize.width);
+    double AyFactor = double(size.height) / double(CamSize.height);
+    if (CameraMatrix.depth() == CV_64F) {
+        CameraMatrix.at< double >(0, 0) *= AxFactor;
+        CameraMatrix.at< double >(0, 2) *= AxFactor;
+        CameraMatrix.at< double >(1, 1) *= AyFactor;
+        CameraMatrix.at< double >(1, 2) *= AyFactor;
+    } else {
+        CameraMatrix.at< float >(0, 0) *= AxFactor;
+        CameraMatrix.at< float >(0, 2) *= AxFactor;
+        CameraMatrix.at< float >(1, 1) *= AyFactor;
+        CameraMatrix.at< float >(1, 2) *= AyFactor;
+    }
     CamSize=size;
 }
 
@@ -170,24 +206,23 @@ void CameraParameters::readFromXMLFile(string filePath) throw(cv::Exception) {
     if (w == -1 || h == 0)
         throw cv::Exception(9007, "File :" + filePath + " does not contains valid camera dimensions", "CameraParameters::readFromXML", __FILE__, __LINE__);
 
-    if (MCamera.type() != CV_32FC1)
-        MCamera.convertTo(CameraMatrix, CV_32FC1);
+    if (MCamera.type() != _type)
+        MCamera.convertTo(CameraMatrix, _type);
     else
         CameraMatrix = MCamera;
 
     if (MDist.total() < 4)
         throw cv::Exception(9007, "File :" + filePath + " does not contains valid distortion_coefficients", "CameraParameters::readFromXML", __FILE__,
                             __LINE__);
-    // convert to 32 and get the 4 first elements only
-    cv::Mat mdist32;
-    MDist.convertTo(mdist32, CV_32FC1);
+    // convert to the precision and get the 5 first elements only
+    cv::Mat mdist;
+    MDist.reshape(1, 1).convertTo(mdist, _type);
     //     Distorsion.create(1,4,CV_32FC1);
     //     for (int i=0;i<4;i++)
     //         Distorsion.ptr<float>(0)[i]=mdist32.ptr<float>(0)[i];
 
-    Distorsion.create(1, 5, CV_32FC1);
-    for (int i = 0; i < 5; i++)
-        Distorsion.ptr< float >(0)[i] = mdist32.ptr< float >(0)[i];
+    Distorsion = cv::Mat::zeros(1, 5, _type);
+    mdist.colRange(0, std::min(5, mdist.cols)).copyTo(Distorsion.colRange(0, std::min(5, mdist.cols)));
     CamSize.width = w;
     CamSize.height = h;
 }
@@ -205,10 +240,10 @@ void CameraParameters::glGetProjectionMatrix(cv::Size orgImgSize, cv::Size size,
     // Deterime the rsized info
     double Ax = double(size.width) / double(orgImgSize.width);
     double Ay = double(size.height) / double(orgImgSize.height);
-    double _fx = CameraMatrix.at< float >(0, 0) * Ax;
-    double _cx = CameraMatrix.at< float >(0, 2) * Ax;
-    double _fy = CameraMatrix.at< float >(1, 1) * Ay;
-    double _cy = CameraMatrix.at< float >(1, 2) * Ay;
+    double _fx = value(CameraMatrix, 0) * Ax;
+    double _cx = value(CameraMatrix, 2) * Ax;
+    double _fy = value(CameraMatrix, 4) * Ay;
+    double _cy = value(CameraMatrix, 5) * Ay;
     double cparam[3][4] = {{_fx, 0, _cx, 0}, {0, _fy, _cy, 0}, {0, 0, 1, 0}};
 
     argConvGLcpara2(cparam, size.width, size.height, gnear, gfar, proj_matrix, invert);
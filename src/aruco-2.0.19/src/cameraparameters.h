@@ -37,9 +37,9 @@ namespace aruco {
 
 class ARUCO_EXPORTS CameraParameters {
   public:
-    // 3x3 matrix (fx 0 cx, 0 fy cy, 0 0 1)
+    // 3x3 matrix (fx 0 cx, 0 fy cy, 0 0 1), of the precision of the parameters (see setPrecision)
     cv::Mat CameraMatrix;
-    // 4x1 matrix (k1,k2,p1,p2)
+    // 4x1 matrix (k1,k2,p1,p2), of the precision of the parameters
     cv::Mat Distorsion;
     // size of the image
     cv::Size CamSize;
@@ -51,14 +51,29 @@ class ARUCO_EXPORTS CameraParameters {
      * @param cameraMatrix 3x3 matrix (fx 0 cx, 0 fy cy, 0 0 1)
      * @param distorsionCoeff 4x1 matrix (k1,k2,p1,p2)
      * @param size image size
+     * @param type precision of the parameters, CV_32F or CV_64F (-1 for defaultPrecision)
      */
-    CameraParameters(cv::Mat cameraMatrix, cv::Mat distorsionCoeff, cv::Size size) throw(cv::Exception);
-    /**Sets the parameters
+    CameraParameters(cv::Mat cameraMatrix, cv::Mat distorsionCoeff, cv::Size size, int type = -1) throw(cv::Exception);
+    /**Sets the parameters, converted to the precision of this object
      * @param cameraMatrix 3x3 matrix (fx 0 cx, 0 fy cy, 0 0 1)
      * @param distorsionCoeff 4x1 matrix (k1,k2,p1,p2)
      * @param size image size
      */
     void setParams(cv::Mat cameraMatrix, cv::Mat distorsionCoeff, cv::Size size) throw(cv::Exception);
+
+    /**Precision of the camera model, CV_32F or CV_64F: the type of CameraMatrix and Distorsion. The matrices are
+     * converted when they are set or read, never when they are used, so the detector, the pose trackers and the
+     * calibration share them as they are. Changing it converts the current matrices
+     */
+    void setPrecision(int type);
+    int getPrecision() const { return _type; }
+    /**Precision of the parameters and of the poses of the trackers unless they are set: CV_64F if the library is
+     * built with DOUBLE_PRECISION_PNP, CV_32F otherwise
+     */
+    static int defaultPrecision();
+    /**i-th element of a continuous matrix of either precision, such as CameraMatrix (fx is 0, cx 2, fy 4, cy 5)
+     */
+    static double value(const cv::Mat &M, int i) { return M.depth() == CV_64F ? M.ptr< double >(0)[i] : M.ptr< float >(0)[i]; }
     /**Copy constructor
      */
     CameraParameters(const CameraParameters &CI);
@@ -121,6 +136,8 @@ class ARUCO_EXPORTS CameraParameters {
     static cv::Mat getRTMatrix(const cv::Mat &R_, const cv::Mat &T_, int forceType);
 
   private:
+    int _type;
+
     // GL routines
 
     static void argConvGLcpara2(double cparam[3][4], int width, int height, double gnear, double gfar, double m[16], bool invert) throw(cv::Exception);
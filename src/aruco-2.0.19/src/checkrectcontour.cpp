@@ -1,154 +1,64 @@
 #include <iostream>
+#include <cmath>
 #include "checkrectcontour.h"
 using namespace std;
 namespace aruco{
 
+//line through two points, as a x + b y + c = 0 with (a, b) of unit length, so the value at a point is its signed distance
 struct Line
 {
-public:
-
     Line(const cv::Point p1,const cv::Point p2){
         _a=(p1.y - p2.y);
         _b=(p2.x - p1.x);
-        _c=(p1.x * (-(p1.y - p2.y)) + p1.y * (-(p2.x - p1.x)));
-        inv_den=1./ pow( _a * _a + _b * _b, 0.5);
-    }
-    //Calcula la distancia de un punto a una recta
-    float dist(const cv::Point p)const{    return fabs( _a * p.x + _b * p.y + _c) *inv_den;}
-    int sign(cv::Point p){
-        float valor = _a * p.x + _b * p.y + _c;
-        if (valor > 0.0) return 1;
-        else if (valor < 0.0) return -1;
-        return 0;
+        float len=std::sqrt(_a*_a+_b*_b);
+        if (len>0){ _a/=len; _b/=len; }
+        _c=-(_a*p1.x+_b*p1.y);
     }
-
+    float signedDist(const cv::Point p)const{ return _a*p.x+_b*p.y+_c; }
 private:
-    float _a,_b,_c,inv_den;
+    float _a,_b,_c;
 };
 
-//Calcula el Emax en el segmento entre inicial y final
-void CheckRectContour::calculate_emax_between_points(const vector<cv::Point> &contorno, unsigned int inicial, unsigned int final,
-                                float &errorMaximo, unsigned int &posicion)
-{
-    assert (inicial != final);
-    assert(  (inicial <  contorno.size()));
-    assert((final >  0) && (final <  contorno.size()));
+static inline int dist2(const cv::Point &a,const cv::Point &b){ cv::Point d=a-b; return d.x*d.x+d.y*d.y; }
 
-    errorMaximo = -1;
-    posicion = inicial;
-    float error = 0.0;
-    unsigned int begin  = (inicial + 1) %  contorno.size();
-
-    Line recta(contorno[inicial] , contorno[final] );
-    for (unsigned int i = begin; i != final;)
-    {
-        error = recta.dist(contorno[i]);
-        if (error > errorMaximo)
-        {
-            errorMaximo = error;
-            posicion = i;
-        }
-        i = (i + 1);//do notuse % so many times, it is slow
-        if(i>=contorno.size()) i=0;//if exceed the limits, go back to 0
-    }
-}
-
-
-bool CheckRectContour::check_rect_contour(const vector<cv::Point> & contorno, const float &umbral,
-                                   vector<cv::Point> &aproximacion)
+bool CheckRectContour::fitQuad(const vector<cv::Point> &contour, float thres, int cornerIdx[4])
 {
-    //primero seleccionamos dos puntos aleatorios que van a ser el inicial y el central
-    unsigned int inicial=0, central= contorno.size() / 2;
-
-    //Ahora se calculan los puntos más distantes a la recta que une esos puntos
-    //uno en el recorrido inicial, central y otro en el recorrido central inicial
-
-    //se supone que si es un cuadrilátero, estos dos puntos más distantes son vértices opuestos del cuadrilátero
-
-    float eMax1, eMax3;
-    unsigned int posicionMax1, posicionMax3;
-  //  cout <<"CALCULO P1 \n";
-    calculate_emax_between_points(contorno, inicial, central, eMax1, posicionMax1);
-  //  cout << "posicion max 1 = " << posicionMax1 << endl;
-    //cout <<"CALCULO P3 \n";
-    calculate_emax_between_points(contorno, central, contorno.size() - 1, eMax3, posicionMax3);
-    //cout << "posicion max 3 = " << posicionMax3 << endl;
-
-
-    //Ahora comprobamos si es un triángulo. Para ello se comprueba el emax entre los vértices recién obtenidos
-    float error1, error2;
-    unsigned int pos1, pos2;
-
-//    cout <<"CALCULO error entre P1 y P3 \n";
-    calculate_emax_between_points(contorno, posicionMax1, posicionMax3, error1, pos1);
-  //  cout <<"CALCULO error entre P3 y P1 \n";
-    calculate_emax_between_points(contorno, posicionMax3, posicionMax1, error2, pos2);
-
-    if (error1 <= umbral || error2 <= umbral)
-    {
-    //    cout << "ES UN TRIÁNGULO \n";
-        return false;
-    }
-    else //Calculamos los dos vértices que faltan
-    {
-        float eMax2, eMax4;
-        unsigned int posicionMax2, posicionMax4;
-        calculate_emax_between_points(contorno, posicionMax1, posicionMax3, eMax2, posicionMax2);
-        calculate_emax_between_points(contorno, posicionMax3, posicionMax1, eMax4, posicionMax4);
-        //Ahora comprobamos el error máximo del cuadrilátero, que será la aproxmación poligonal
-        float e1, e2, e3, e4; //Errores maximos
-        unsigned int p1, p2, p3, p4; //Puntos de error maximo en cada lado
-
-        calculate_emax_between_points(contorno, posicionMax1, posicionMax2, e1, p1);
-
-        if (e1 > umbral) //no es cuadrilatero
-            return false;
-        else
-        {
-            calculate_emax_between_points(contorno, posicionMax2, posicionMax3, e2, p2);
-            if (e2 > umbral) //no es cuadrilatero
-                return false;
-            else
-            {
-                calculate_emax_between_points(contorno, posicionMax3, posicionMax4, e3, p3);
-                if (e3 > umbral) //no es cuadrilatero
-                    return false;
-                else
-                {
-                    calculate_emax_between_points(contorno, posicionMax4, posicionMax1, e4, p4);
-                    if (e3 > umbral) //no es cuadrilatero
-                        return false;
-                    else //Es un cuadrilatero
-                    {
-
-                        //now, check if the signs of opposite points are different so that is convex
-                        Line l1(contorno[posicionMax1],contorno[posicionMax3]);
-                        if ( l1.sign(contorno[posicionMax2])==l1.sign(contorno[posicionMax4]))return false;
-                        Line l2(contorno[posicionMax2],contorno[posicionMax4]);
-                        if ( l2.sign(contorno[posicionMax1])==l2.sign(contorno[posicionMax3]))return false;
-
-                        //Guardamos los vertices del cuadrilátero en la aproximacion
-                        aproximacion.push_back(contorno[posicionMax1]);
-                        aproximacion.push_back(contorno[posicionMax2]);
-                        aproximacion.push_back(contorno[posicionMax3]);
-                        aproximacion.push_back(contorno[posicionMax4]);
-                        return true;
-                    }
-                }
-            }
-        }
+    int n=contour.size();
+    if (n<4) return false;
+    //the farthest point of a convex polygon from any point is a vertex: A from the first point, and C from A,
+    //which is the opposite vertex of a quadrilateral that is not too skewed
+    int a=0,c=0,best=-1;
+    for(int i=0;i<n;i++){ int e=dist2(contour[i],contour[0]); if (e>best){ best=e; a=i; } }
+    best=-1;
+    for(int i=0;i<n;i++){ int e=dist2(contour[i],contour[a]); if (e>best){ best=e; c=i; } }
+    if (best<=0) return false;
+    //B and D are the farthest points from the diagonal AC on each side of it: from A to C, and from C back to A
+    Line ac(contour[a],contour[c]);
+    int b=a,d=c;
+    float eb=0,ed=0;
+    for(int i=(a+1)%n;i!=c;i=(i+1==n?0:i+1)){ float e=ac.signedDist(contour[i]); if (std::fabs(e)>std::fabs(eb)){ eb=e; b=i; } }
+    for(int i=(c+1)%n;i!=a;i=(i+1==n?0:i+1)){ float e=ac.signedDist(contour[i]); if (std::fabs(e)>std::fabs(ed)){ ed=e; d=i; } }
+    //a triangle, or B and D on the same side: not convex
+    if (std::fabs(eb)<=thres || std::fabs(ed)<=thres || (eb>0)==(ed>0)) return false;
+    //A and C must be on either side of BD too
+    Line bd(contour[b],contour[d]);
+    float ea=bd.signedDist(contour[a]), ec=bd.signedDist(contour[c]);
+    if (std::fabs(ea)<=thres || std::fabs(ec)<=thres || (ea>0)==(ec>0)) return false;
+    //every point must be near the side it lies on, which stops at the first one that is not
+    int v[5]={a,b,c,d,a};
+    for(int s=0;s<4;s++){
+        Line side(contour[v[s]],contour[v[s+1]]);
+        for(int i=(v[s]+1)%n;i!=v[s+1];i=(i+1==n?0:i+1))
+            if (std::fabs(side.signedDist(contour[i]))>thres) return false;
     }
-    return false;
+    for(int s=0;s<4;s++) cornerIdx[s]=v[s];
+    return true;
 }
 
-
 vector<cv::Point> CheckRectContour::getConvexRect(vector<cv::Point> &points,float thres){
-
-    std::vector<cv::Point> pres;
-
-    if (check_rect_contour(points,thres,pres) )return pres;
-    else return {};
-
+    int idx[4];
+    if (!fitQuad(points,thres,idx)) return {};
+    return {points[idx[0]],points[idx[1]],points[idx[2]],points[idx[3]]};
 }
 
 }
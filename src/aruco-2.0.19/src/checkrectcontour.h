@@ -34,17 +34,21 @@
 
 namespace aruco {
 /**\brief Checks if a contour is a rectangle
+ *
+ * fitQuad is the specialized alternative to approxPolyDP and isContourConvex for the candidates of the detector:
+ * it only looks for four vertices, in a few linear passes over the contour that allocate nothing, and stops as soon
+ * as the contour is known not to be a convex quadrilateral
  */
 class ARUCO_EXPORTS CheckRectContour {
 public:
     //returns the approximation or empty if not a convex rectangle
     static std::vector<cv::Point> getConvexRect(std::vector<cv::Point> &points,float thres=2);
-private:
-    static void  calculate_emax_between_points(const std::vector<cv::Point> &contorno, unsigned int inicial, unsigned int final,
-                                               float &errorMaximo, unsigned int &posicion);
-
-    static  bool  check_rect_contour(const std::vector<cv::Point> & contorno, const float &umbral,
-                                     std::vector<cv::Point> &aproximacion);
+    /**Fits a convex quadrilateral to a closed contour. Every contour point must be within thres of the side between
+     * the vertices it lies between, and each vertex further than thres from the diagonal of the other two.
+     * @param cornerIdx indices in the contour of the four vertices, in contour order
+     * @return false if the contour is not a convex quadrilateral
+     */
+    static bool fitQuad(const std::vector<cv::Point> &contour, float thres, int cornerIdx[4]);
 };
 }
 #endif
@@ -65,7 +65,7 @@ void CvDrawingUtils::draw3dAxis(cv::Mat &Image, const CameraParameters &CP, cons
  *
  ****/
 void CvDrawingUtils::draw3dAxis(cv::Mat &Image, Marker &m, const CameraParameters &CP) {
-
+    if (!m.isPoseValid()) return;//the pose has not been calculated
     float size = m.ssize * 3;
     Mat objectPoints(4, 3, CV_32FC1);
     objectPoints.at< float >(0, 0) = 0;
@@ -98,6 +98,7 @@ void CvDrawingUtils::draw3dAxis(cv::Mat &Image, Marker &m, const CameraParameter
  *
  ****/
 void CvDrawingUtils::draw3dCube(cv::Mat &Image, Marker &m, const CameraParameters &CP, bool setYperpendicular) {
+    if (!m.isPoseValid()) return;//the pose has not been calculated
     Mat objectPoints(8, 3, CV_32FC1);
     double halfSize = m.ssize / 2;
 
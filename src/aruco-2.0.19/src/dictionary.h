@@ -4,6 +4,7 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <memory>
 #include <stdint.h>
 #include "exports.h"
 #include <opencv2/core/core.hpp>
@@ -33,7 +34,15 @@ public:
                      CUSTOM//for used defined dictionaries  (using loadFromfile).
                      };
     //indicates if a code is in the dictionary
-    bool is(uint64_t code)const{return _code_id.find(code)!=_code_id.end();}
+    bool is(uint64_t code)const{return find(code)!=-1;}
+    //returns the id of a given code or -1 if it is not in the dictionary. Single probe sequence in a flat table
+    inline int find(uint64_t code)const{
+        if (_tableIds.empty()) return -1;
+        for(size_t h=tableSlot(code);;h=(h+1)&_tableMask){
+            if (_tableIds[h]==-1) return -1;
+            if (_tableCodes[h]==code) return _tableIds[h];
+        }
+    }
 
     DICT_TYPES getType()const{return _type;}
 
@@ -48,8 +57,12 @@ public:
     //return the set of ids
     const std::map<uint64_t,uint16_t> & getMapCode()const{return _code_id;}
 
-    //returns the id of a given code.
-    int operator[](uint64_t code) { return _code_id[code];  }
+    //returns the id of a given code or -1 if it is not in the dictionary.
+    int operator[](uint64_t code)const { return find(code);  }
+
+    //dictionary with only the codes of the ids given, which keep their ids. The distance is that of the whole
+    //dictionary, so the error correction of a labeler does not grow, and the codes left out are rejected as non markers
+    Dictionary subset(const std::vector<int> &ids)const;
 
 
     //returns the image of the marker indicated by its id. It the id is not, returns empty matrix
@@ -64,6 +77,9 @@ public:
 
     static Dictionary loadPredefined(DICT_TYPES type) throw(cv::Exception);
     static Dictionary loadPredefined(std::string type) throw(cv::Exception);
+    //returns the process-wide instance of a predefined dictionary. It is built on first use and shared afterwards, so it is cheaper than loadPredefined
+    static std::shared_ptr<const Dictionary> getPredefined(DICT_TYPES type) throw(cv::Exception);
+    static std::shared_ptr<const Dictionary> getPredefined(std::string type) throw(cv::Exception);
 
     /** loads a dictionary defined in a file
     * Please note that the parsing is very basic and you must be very strict.
@@ -92,7 +108,6 @@ public:
 
 
 //    //io functions
-//    void saveToFile(std::string file)throw(cv::Exception);
 //    void readFromFile(std::string file)throw(cv::Exception);
 //    void saveToStream(std::ostream & str)throw(cv::Exception);
 //    void readFromStream(std::istream &str)throw(cv::Exception);
@@ -101,6 +116,22 @@ public:
 
     //returns the dictionary distance
     static uint64_t computeDictionaryDistance(const Dictionary &d);
+    //returns the dictionary distance saved in the file path, if it was saved for the same codes. Otherwise, computes it
+    //and saves it there. loadFromFile keeps the distance of each dictionary file next to it, with ".dist" appended
+    static uint64_t cachedDictionaryDistance(const Dictionary &d,const std::string &path);
+
+    /**Generates a CUSTOM dictionary of nMarkers codes of nbits bits (a square number up to 64) with a minimum distance, as
+     * computeDictionaryDistance measures it, as large as it can find. Random codes are accepted while they are at distance tau
+     * from the accepted ones and from their own rotations. The search starts with tau=maxTau (nbits/2 if 0), which is lowered each
+     * time maxMisses codes in a row are rejected, down to minTau. The codes are tested in parallel, and the result only depends
+     * on the seed. If tau goes below minTau, the dictionary has the codes found until then. Name it after the file it is saved to,
+     * as the marker maps created with it refer to the dictionary by its name
+     */
+    static Dictionary generate(std::string name,int nMarkers,int nbits,uint64_t seed=0,int maxTau=0,int minTau=1,
+                               int maxMisses=1<<16)throw(cv::Exception);
+    /**Saves the dictionary in the format read by loadFromFile
+     */
+    void saveToFile(std::string path)const throw(cv::Exception);
 
     //given a string,returns the type
     static DICT_TYPES getTypeFromString(std::string str)  throw(cv::Exception);
@@ -111,9 +142,20 @@ private:
 
     void insert(uint64_t code,int id){_code_id.insert(std::make_pair(code,id));}
     static void fromVector(const std::vector<uint64_t> &codes,std::map<uint64_t,uint16_t>  &code_id_map);
+    static void fromArray(const uint64_t *codes,size_t n,std::map<uint64_t,uint16_t>  &code_id_map);
+    //builds a predefined dictionary from its embedded table
+    static Dictionary buildPredefined(DICT_TYPES type) throw(cv::Exception);
 
     std::map<uint64_t,uint16_t> _code_id;//marker have and code (internal binary code), which correspond to an id.
 
+    //open addressing table (linear probing, power of two size, at most half full) built from _code_id for the lookups done per candidate
+    void buildTable();
+    inline size_t tableSlot(uint64_t code)const{return size_t((code*0x9E3779B97F4A7C15ULL)>>_tableShift);}
+    std::vector<uint64_t> _tableCodes;
+    std::vector<int32_t> _tableIds;//-1 marks an empty slot, since 0 is a valid code
+    size_t _tableMask=0;
+    uint32_t _tableShift=64;
+
     uint32_t _nbits;//total number of bits . So, there are sqrt(nbits) in each axis
     uint32_t _tau;//minimum distance between elements
 
@@ -42,5 +42,16 @@ or implied, of Rafael Muñoz Salinas.
 #define ARUCO_EXPORTS
 #endif
 
+//The hot pixel loops are built for several instruction sets, and the best one for the host is selected when the
+//library is loaded (GCC and clang function multiversioning, which needs the ifunc support of glibc on x86). On ARM,
+//NEON is part of the aarch64 baseline, so the default build already uses it. Define ARUCO_NO_DISPATCH to build a
+//single variant, for instance when the flags already select the instruction set of the hosts
+#if !defined ARUCO_NO_DISPATCH && defined __linux__ && (defined __x86_64__ || defined __i386__) && \
+    ((defined __clang__ && __clang_major__ >= 14) || (!defined __clang__ && defined __GNUC__ && __GNUC__ >= 6))
+#define ARUCO_DISPATCH __attribute__((target_clones("arch=skylake-avx512","avx2","sse4.2","default")))
+#else
+#define ARUCO_DISPATCH
+#endif
+
 
 #endif
@@ -1,4 +1,5 @@
 #include "ippe.h"
+#include "cameraparameters.h"
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 using namespace cv;
@@ -352,11 +353,9 @@ void IPPE::IPPComputeTranslation(InputArray _objectPoints, InputArray _imgPoints
 
 }
 
-void IPPE::IPPComputeRotations(double j00, double j01, double j10, double j11, double p, double q, OutputArray _R1, OutputArray _R2)
+static void computeRotations(double j00, double j01, double j10, double j11, double p, double q, double R1[9], double R2[9])
 {
     //Note that it is very hard to understand what is going on here from the code, so if you want to have a clear explanation then please refer to the IPPE paper (Algorithm 1 and its description).
-    _R1.create(3,3,CV_64FC1);
-    _R2.create(3,3,CV_64FC1);
 
 
     double a00, a01, a10,a11, ata00, ata01,ata11,b00, b01, b10,b11,binv00, binv01, binv10,binv11;
@@ -431,63 +430,189 @@ void IPPE::IPPComputeRotations(double j00, double j01, double j10, double j11, d
         b1 = -b1;
     }
 
-    //save results:
+    //save results (row major):
+
+    R1[0] = (rtilde00)*rv00 + (rtilde10)*rv01 + (b0)*rv02;
+    R1[1] = (rtilde01)*rv00 + (rtilde11)*rv01 + (b1)*rv02;
+    R1[2] = (b1*rtilde10 - b0*rtilde11)*rv00 + (b0*rtilde01 - b1*rtilde00)*rv01 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv02;
+    R1[3] = (rtilde00)*rv10 + (rtilde10)*rv11 + (b0)*rv12;
+    R1[4] = (rtilde01)*rv10 + (rtilde11)*rv11 + (b1)*rv12;
+    R1[5] = (b1*rtilde10 - b0*rtilde11)*rv10 + (b0*rtilde01 - b1*rtilde00)*rv11 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv12;
+    R1[6] = (rtilde00)*rv20 + (rtilde10)*rv21 + (b0)*rv22;
+    R1[7] = (rtilde01)*rv20 + (rtilde11)*rv21 + (b1)*rv22;
+    R1[8] = (b1*rtilde10 - b0*rtilde11)*rv20 + (b0*rtilde01 - b1*rtilde00)*rv21 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv22;
+
+    R2[0] = (rtilde00)*rv00 + (rtilde10)*rv01 + (-b0)*rv02;
+    R2[1] = (rtilde01)*rv00 + (rtilde11)*rv01 + (-b1)*rv02;
+    R2[2] = (b0*rtilde11 - b1*rtilde10)*rv00 + (b1*rtilde00 - b0*rtilde01)*rv01 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv02;
+    R2[3] = (rtilde00)*rv10 + (rtilde10)*rv11 + (-b0)*rv12;
+    R2[4] = (rtilde01)*rv10 + (rtilde11)*rv11 + (-b1)*rv12;
+    R2[5] = (b0*rtilde11 - b1*rtilde10)*rv10 + (b1*rtilde00 - b0*rtilde01)*rv11 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv12;
+    R2[6] = (rtilde00)*rv20 + (rtilde10)*rv21 + (-b0)*rv22;
+    R2[7] = (rtilde01)*rv20 + (rtilde11)*rv21 + (-b1)*rv22;
+    R2[8] = (b0*rtilde11 - b1*rtilde10)*rv20 + (b1*rtilde00 - b0*rtilde01)*rv21 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv22;
+
+}
+
+void IPPE::IPPComputeRotations(double j00, double j01, double j10, double j11, double p, double q, OutputArray _R1, OutputArray _R2)
+{
+    _R1.create(3,3,CV_64FC1);
+    _R2.create(3,3,CV_64FC1);
     Mat R1 = _R1.getMat();
     Mat R2 = _R2.getMat();
+    computeRotations(j00, j01, j10, j11, p, q, R1.ptr<double>(), R2.ptr<double>());
+}
+
+//pts are the four target points, x and y interleaved. H is row major
+static void homographyFromSquare(const double pts[8], double halfLength, double H[9])
+{
 
-    R1.at<double>(0,0) = (rtilde00)*rv00 + (rtilde10)*rv01 + (b0)*rv02;
-    R1.at<double>(0,1) = (rtilde01)*rv00 + (rtilde11)*rv01 + (b1)*rv02;
-    R1.at<double>(0,2) = (b1*rtilde10 - b0*rtilde11)*rv00 + (b0*rtilde01 - b1*rtilde00)*rv01 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv02;
-    R1.at<double>(1,0) = (rtilde00)*rv10 + (rtilde10)*rv11 + (b0)*rv12;
-    R1.at<double>(1,1) = (rtilde01)*rv10 + (rtilde11)*rv11 + (b1)*rv12;
-    R1.at<double>(1,2) = (b1*rtilde10 - b0*rtilde11)*rv10 + (b0*rtilde01 - b1*rtilde00)*rv11 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv12;
-    R1.at<double>(2,0) = (rtilde00)*rv20 + (rtilde10)*rv21 + (b0)*rv22;
-    R1.at<double>(2,1) = (rtilde01)*rv20 + (rtilde11)*rv21 + (b1)*rv22;
-    R1.at<double>(2,2) = (b1*rtilde10 - b0*rtilde11)*rv20 + (b0*rtilde01 - b1*rtilde00)*rv21 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv22;
-
-    R2.at<double>(0,0) = (rtilde00)*rv00 + (rtilde10)*rv01 + (-b0)*rv02;
-    R2.at<double>(0,1) = (rtilde01)*rv00 + (rtilde11)*rv01 + (-b1)*rv02;
-    R2.at<double>(0,2) = (b0*rtilde11 - b1*rtilde10)*rv00 + (b1*rtilde00 - b0*rtilde01)*rv01 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv02;
-    R2.at<double>(1,0) = (rtilde00)*rv10 + (rtilde10)*rv11 + (-b0)*rv12;
-    R2.at<double>(1,1) = (rtilde01)*rv10 + (rtilde11)*rv11 + (-b1)*rv12;
-    R2.at<double>(1,2) = (b0*rtilde11 - b1*rtilde10)*rv10 + (b1*rtilde00 - b0*rtilde01)*rv11 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv12;
-    R2.at<double>(2,0) = (rtilde00)*rv20 + (rtilde10)*rv21 + (-b0)*rv22;
-    R2.at<double>(2,1) = (rtilde01)*rv20 + (rtilde11)*rv21 + (-b1)*rv22;
-    R2.at<double>(2,2) = (b0*rtilde11 - b1*rtilde10)*rv20 + (b1*rtilde00 - b0*rtilde01)*rv21 + (rtilde00*rtilde11 - rtilde01*rtilde10)*rv22;
+    double p1x = -pts[0];
+    double p1y = -pts[1];
+
+    double p2x = -pts[2];
+    double p2y = -pts[3];
+
+    double p3x = -pts[4];
+    double p3y = -pts[5];
+
+    double p4x = -pts[6];
+    double p4y = -pts[7];
+
+
+    //analytic solution:
+    double detsInv = -1/(halfLength*(p1x*p2y - p2x*p1y - p1x*p4y + p2x*p3y - p3x*p2y + p4x*p1y + p3x*p4y - p4x*p3y));
+
+    H[0] =  detsInv*(p1x*p3x*p2y - p2x*p3x*p1y - p1x*p4x*p2y + p2x*p4x*p1y - p1x*p3x*p4y + p1x*p4x*p3y + p2x*p3x*p4y - p2x*p4x*p3y);
+    H[1] =  detsInv*(p1x*p2x*p3y - p1x*p3x*p2y - p1x*p2x*p4y + p2x*p4x*p1y + p1x*p3x*p4y - p3x*p4x*p1y - p2x*p4x*p3y + p3x*p4x*p2y);
+    H[2] =  detsInv*halfLength*(p1x*p2x*p3y - p2x*p3x*p1y - p1x*p2x*p4y + p1x*p4x*p2y - p1x*p4x*p3y + p3x*p4x*p1y + p2x*p3x*p4y - p3x*p4x*p2y);
+    H[3] =  detsInv*(p1x*p2y*p3y - p2x*p1y*p3y - p1x*p2y*p4y + p2x*p1y*p4y - p3x*p1y*p4y + p4x*p1y*p3y + p3x*p2y*p4y - p4x*p2y*p3y);
+    H[4] =  detsInv*(p2x*p1y*p3y - p3x*p1y*p2y - p1x*p2y*p4y + p4x*p1y*p2y + p1x*p3y*p4y - p4x*p1y*p3y - p2x*p3y*p4y + p3x*p2y*p4y);
+    H[5] =  detsInv*halfLength*(p1x*p2y*p3y - p3x*p1y*p2y - p2x*p1y*p4y + p4x*p1y*p2y - p1x*p3y*p4y + p3x*p1y*p4y + p2x*p3y*p4y - p4x*p2y*p3y);
+    H[6] =                                  -detsInv*(p1x*p3y - p3x*p1y - p1x*p4y - p2x*p3y + p3x*p2y + p4x*p1y + p2x*p4y - p4x*p2y);
+    H[7] =                                 detsInv*(p1x*p2y - p2x*p1y - p1x*p3y + p3x*p1y + p2x*p4y - p4x*p2y - p3x*p4y + p4x*p3y);
+    H[8] = 1.0;
 
 }
 
 void IPPE::homographyFromSquarePoints(InputArray _targetPts, double halfLength, OutputArray H_)
 {
-
     cv::Mat pts = _targetPts.getMat();
     H_.create(3,3,CV_64FC1);
     Mat H = H_.getMat();
+    double p[8];
+    for (int i=0;i<4;i++){
+        p[2*i] = pts.at<Vec2f>(i)(0);
+        p[2*i+1] = pts.at<Vec2f>(i)(1);
+    }
+    homographyFromSquare(p, halfLength, H.ptr<double>());
+}
 
-    double p1x = -pts.at<Vec2f>(0)(0);
-    double p1y = -pts.at<Vec2f>(0)(1);
-
-    double p2x = -pts.at<Vec2f>(1)(0);
-    double p2y = -pts.at<Vec2f>(1)(1);
-
-    double p3x = -pts.at<Vec2f>(2)(0);
-    double p3y = -pts.at<Vec2f>(2)(1);
-
-    double p4x = -pts.at<Vec2f>(3)(0);
-    double p4y = -pts.at<Vec2f>(3)(1);
+//translation of a rotation solution, as IPPComputeTranslation, for the four points of a centred square
+static void computeSquareTranslation(const double model[4][2], const double img[8], const double R[9], double t[3])
+{
+    double ATA02 = 0, ATA12 = 0, ATA22 = 0, ATb0 = 0, ATb1 = 0, ATb2 = 0;
+    for (int i=0;i<4;i++)
+    {
+        double rx = R[0]*model[i][0] + R[1]*model[i][1];
+        double ry = R[3]*model[i][0] + R[4]*model[i][1];
+        double rz = R[6]*model[i][0] + R[7]*model[i][1];
+        double a2 = -img[2*i], b2 = -img[2*i+1];
+        ATA02 += a2;
+        ATA12 += b2;
+        ATA22 += a2*a2 + b2*b2;
+        double bx = img[2*i]*rz - rx, by = img[2*i+1]*rz - ry;
+        ATb0 += bx;
+        ATb1 += by;
+        ATb2 += a2*bx + b2*by;
+    }
+    //ATA00=ATA11=4, ATA20=ATA02 and ATA21=ATA12
+    double detAInv = 1.0/(16*ATA22 - 4*ATA12*ATA12 - 4*ATA02*ATA02);
+    t[0] = detAInv*((4*ATA22 - ATA12*ATA12)*ATb0 + ATA02*ATA12*ATb1 - 4*ATA02*ATb2);
+    t[1] = detAInv*(ATA12*ATA02*ATb0 + (4*ATA22 - ATA02*ATA02)*ATb1 - 4*ATA12*ATb2);
+    t[2] = detAInv*(-4*ATA02*ATb0 - 4*ATA12*ATb1 + 16*ATb2);
+}
 
+//sum of the reprojection errors of the four corners, as IPPEvalReprojectionError
+static float squareReprojectionError(const double model[4][2], const double img[8], const double R[9], const double t[3])
+{
+    float err = 0;
+    for (int i=0;i<4;i++)
+    {
+        double px = R[0]*model[i][0] + R[1]*model[i][1] + t[0];
+        double py = R[3]*model[i][0] + R[4]*model[i][1] + t[1];
+        double pz = R[6]*model[i][0] + R[7]*model[i][1] + t[2];
+        float dx = px/pz - img[2*i], dy = py/pz - img[2*i+1];
+        err += sqrt(dx*dx + dy*dy);
+    }
+    return err;
+}
 
-    //analytic solution:
-    double detsInv = -1/(halfLength*(p1x*p2y - p2x*p1y - p1x*p4y + p2x*p3y - p3x*p2y + p4x*p1y + p3x*p4y - p4x*p3y));
+//rotation vector of a rotation matrix, as IPPERot2vec
+static void rot2vec(const double R[9], double r[3])
+{
+    double w_norm = acos((R[0] + R[4] + R[8] - 1.0)/2.0);
+    if (w_norm < std::numeric_limits<double>::epsilon()) //rotation is the identity
+    {
+        r[0] = r[1] = r[2] = 0;
+        return;
+    }
+    double d = 1/(2*sin(w_norm))*w_norm;
+    r[0] = d*(R[7]-R[5]);
+    r[1] = d*(R[2]-R[6]);
+    r[2] = d*(R[3]-R[1]);
+}
 
-    H.at<double>(0,0) =  detsInv*(p1x*p3x*p2y - p2x*p3x*p1y - p1x*p4x*p2y + p2x*p4x*p1y - p1x*p3x*p4y + p1x*p4x*p3y + p2x*p3x*p4y - p2x*p4x*p3y);
-    H.at<double>(0,1) =  detsInv*(p1x*p2x*p3y - p1x*p3x*p2y - p1x*p2x*p4y + p2x*p4x*p1y + p1x*p3x*p4y - p3x*p4x*p1y - p2x*p4x*p3y + p3x*p4x*p2y);
-    H.at<double>(0,2) =  detsInv*halfLength*(p1x*p2x*p3y - p2x*p3x*p1y - p1x*p2x*p4y + p1x*p4x*p2y - p1x*p4x*p3y + p3x*p4x*p1y + p2x*p3x*p4y - p3x*p4x*p2y);
-    H.at<double>(1,0) =  detsInv*(p1x*p2y*p3y - p2x*p1y*p3y - p1x*p2y*p4y + p2x*p1y*p4y - p3x*p1y*p4y + p4x*p1y*p3y + p3x*p2y*p4y - p4x*p2y*p3y);
-    H.at<double>(1,1) =  detsInv*(p2x*p1y*p3y - p3x*p1y*p2y - p1x*p2y*p4y + p4x*p1y*p2y + p1x*p3y*p4y - p4x*p1y*p3y - p2x*p3y*p4y + p3x*p2y*p4y);
-    H.at<double>(1,2) =  detsInv*halfLength*(p1x*p2y*p3y - p3x*p1y*p2y - p2x*p1y*p4y + p4x*p1y*p2y - p1x*p3y*p4y + p3x*p1y*p4y + p2x*p3y*p4y - p4x*p2y*p3y);
-    H.at<double>(2,0) =                                  -detsInv*(p1x*p3y - p3x*p1y - p1x*p4y - p2x*p3y + p3x*p2y + p4x*p1y + p2x*p4y - p4x*p2y);
-    H.at<double>(2,1) =                                 detsInv*(p1x*p2y - p2x*p1y - p1x*p3y + p3x*p1y + p2x*p4y - p4x*p2y - p3x*p4y + p4x*p3y);
-    H.at<double>(2,2) = 1.0;
+void IPPE::solvePosesOfCentredSquares(float squareLength, const cv::Point2f *imagePoints, int n, const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+                                     SquarePoses *poses)
+{
+    if (n <= 0) return;
+    //normalized image coordinates of the corners. The buffer is kept between calls of each thread
+    static thread_local std::vector<cv::Point2f> undistorted;
+    undistorted.resize(4*n);
+    bool distorted = !distCoeffs.empty() && cv::countNonZero(distCoeffs) > 0;
+    if (distorted)
+    {
+        cv::Mat src(4*n, 1, CV_32FC2, (void*)imagePoints), dst(4*n, 1, CV_32FC2, &undistorted[0]);
+        undistortPoints(src, dst, cameraMatrix, distCoeffs);
+    }
+    else
+    {
+        //read in the precision of the camera parameters, without converting them for each call
+        double fx = aruco::CameraParameters::value(cameraMatrix, 0), fy = aruco::CameraParameters::value(cameraMatrix, 4);
+        double cx = aruco::CameraParameters::value(cameraMatrix, 2), cy = aruco::CameraParameters::value(cameraMatrix, 5);
+        for (int i=0;i<4*n;i++)
+            undistorted[i] = cv::Point2f((imagePoints[i].x - cx)/fx, (imagePoints[i].y - cy)/fy);
+    }
 
+    double h = squareLength/2.0;
+    const double model[4][2] = {{-h, h}, {h, h}, {h, -h}, {-h, -h}};
+    for (int m=0;m<n;m++)
+    {
+        double img[8], H[9], R[2][9], t[2][3];
+        for (int i=0;i<4;i++)
+        {
+            img[2*i] = undistorted[4*m+i].x;
+            img[2*i+1] = undistorted[4*m+i].y;
+        }
+        homographyFromSquare(img, h, H);
+        //Jacobian of the homography at (0,0), and transformation of (0,0) into the image
+        double j00 = H[0]-H[6]*H[2], j01 = H[1]-H[7]*H[2], j10 = H[3]-H[6]*H[5], j11 = H[4]-H[7]*H[5];
+        computeRotations(j00, j01, j10, j11, H[2], H[5], R[0], R[1]);
+
+        float err[2];
+        for (int s=0;s<2;s++)
+        {
+            computeSquareTranslation(model, img, R[s], t[s]);
+            err[s] = squareReprojectionError(model, img, R[s], t[s]);
+        }
+        int best = err[0] < err[1] ? 0 : 1;
+        for (int s=0;s<2;s++)
+        {
+            int k = s==0 ? best : 1-best;
+            rot2vec(R[k], poses[m].rvec[s]);
+            for (int i=0;i<3;i++) poses[m].tvec[s][i] = t[k][i];
+            poses[m].reprojErr[s] = err[k];
+        }
+    }
 }
@@ -45,6 +45,23 @@ the model coordinate system to the camera coordinate system.
 void solvePoseOfCentredSquare(float squareLength, cv::InputArray imagePoints, cv::InputArray cameraMatrix, cv::InputArray distCoeffs,
                                     cv::OutputArray _rvec1, cv::OutputArray _tvec1, float & reprojErr1, cv::OutputArray _rvec2, cv::OutputArray _tvec2, float & reprojErr2);
 
+/** @brief The two poses of a square found by solvePosesOfCentredSquares, sorted like in solvePoseOfCentredSquare: index 0 is the one with the lowest reprojection error
+ */
+struct SquarePoses{
+    double rvec[2][3];
+    double tvec[2][3];
+    float reprojErr[2];
+};
+
+/** @brief Same as solvePoseOfCentredSquare for n squares of the same size at once, typically all the markers of an image.
+The image points of all squares are undistorted in a single call, and the rest of the computation works on plain arrays, without allocations.
+@param imagePoints 4*n image points, the four corners of each square in the order of solvePoseOfCentredSquare
+@param n number of squares
+@param poses output array of n elements
+ */
+void solvePosesOfCentredSquares(float squareLength, const cv::Point2f *imagePoints, int n, const cv::Mat &cameraMatrix, const cv::Mat &distCoeffs,
+                                SquarePoses *poses);
+
 
 
 /** @brief Determines which of the two pose solutions from IPPE has the lowest reprojection error.
@@ -300,6 +300,62 @@ double  LevMarq<T>::solve( eVector  &z, F_z_x  f_z_x, F_z_J f_J)throw (std::exce
 
 }
 
+
+/**Levenberg-Marquardt for problems with a fixed number N of parameters, such as a 6 DoF pose.
+ * There are no callbacks and nothing is allocated: the problem is a class, which is inlined, and the normal equations are
+ * fixed size matrices. The problem must provide
+ *  - typedef State: the parameters, which may be updated in any way, e.g., a rotation matrix and a translation
+ *  - double linearize(const State &s, Matrix &JtJ, Vector &Jtr) const: returns the squared error in s, and fills J^t*J and J^t*r
+ *  - double error(const State &s) const: returns the squared error in s
+ *  - State apply(const State &s, const Vector &delta) const: returns s moved by delta
+ */
+template<typename T,int N>
+class FixedLevMarq{
+public:
+    typedef Eigen::Matrix<T,N,1> Vector;
+    typedef Eigen::Matrix<T,N,N> Matrix;
+    //same params than LevMarq::setParams
+    FixedLevMarq(int maxIters=100,double minError=0.01,double min_step_error_diff=0.01,double tau=1):
+        _maxIters(maxIters),_minErrorAllowed(minError),_min_step_error_diff(min_step_error_diff),_tau(tau){}
+
+    //minimizes the error of the problem starting from s. Returns the final error
+    template<typename Problem>
+    double solve(const Problem &problem,typename Problem::State &s)const{
+        Matrix JtJ;
+        Vector Jtr;
+        double err=problem.linearize(s,JtJ,Jtr);
+        double mu=-1,v=2;
+        for(int it=0;it<_maxIters && err>=_minErrorAllowed;it++){
+            if (mu<0) mu=JtJ.diagonal().maxCoeff()*_tau;
+            bool accepted=false;
+            for(int tries=0;tries<6 && !accepted;tries++){
+                Matrix A=JtJ;
+                A.diagonal().array()+=mu;
+                Vector delta=A.ldlt().solve(-Jtr);
+                typename Problem::State next=problem.apply(s,delta);
+                double nextErr=problem.error(next);
+                //gain ratio between the actual and the predicted decrease
+                double predicted=delta.dot(mu*delta-Jtr);
+                double gain=predicted>0 ? (err-nextErr)/predicted : -1;
+                if (gain>0){
+                    mu*=std::max(1./3.,1.-pow(2*gain-1,3));
+                    v=2;
+                    s=next;
+                    double prevErr=err;
+                    err=problem.linearize(s,JtJ,Jtr);
+                    accepted=true;
+                    if (fabs(prevErr-err)<=_min_step_error_diff) return err;
+                }
+                else{ mu*=v; v*=2;}
+            }
+            if (!accepted) break;
+        }
+        return err;
+    }
+private:
+    int _maxIters;
+    double _minErrorAllowed,_min_step_error_diff,_tau;
+};
 }
 
 #endif
@@ -40,10 +40,6 @@ namespace aruco {
 Marker::Marker() {
     id = -1;
     ssize = -1;
-    Rvec.create(3, 1, CV_32FC1);
-    Tvec.create(3, 1, CV_32FC1);
-    for (int i = 0; i < 3; i++)
-        Tvec.at< float >(i, 0) = Rvec.at< float >(i, 0) = -999999;
 }
 /**
  *
@@ -51,31 +47,30 @@ Marker::Marker() {
 Marker::Marker(int _id) {
     id = _id;
     ssize = -1;
-    Rvec.create(3, 1, CV_32FC1);
-    Tvec.create(3, 1, CV_32FC1);
-    for (int i = 0; i < 3; i++)
-        Tvec.at< float >(i, 0) = Rvec.at< float >(i, 0) = -999999;
 }
 /**
  *
  */
 Marker::Marker(const Marker &M) : std::vector< cv::Point2f >(M) {
-    M.Rvec.copyTo(Rvec);
-    M.Tvec.copyTo(Tvec);
+    if (M.isPoseValid()) {
+        M.Rvec.copyTo(Rvec);
+        M.Tvec.copyTo(Tvec);
+    }
     id = M.id;
     ssize = M.ssize;
 }
 
+/**
+ *
+*/
+Marker::Marker(Marker &&M) : std::vector< cv::Point2f >(std::move(M)), id(M.id), ssize(M.ssize), Rvec(M.Rvec), Tvec(M.Tvec) {}
+
 /**
  *
 */
 Marker::Marker(const std::vector< cv::Point2f > &corners, int _id) : std::vector< cv::Point2f >(corners) {
     id = _id;
     ssize = -1;
-    Rvec.create(3, 1, CV_32FC1);
-    Tvec.create(3, 1, CV_32FC1);
-    for (int i = 0; i < 3; i++)
-        Tvec.at< float >(i, 0) = Rvec.at< float >(i, 0) = -999999;
 }
 
 /**
@@ -83,14 +78,7 @@ Marker::Marker(const std::vector< cv::Point2f > &corners, int _id) : std::vector
 */
 void Marker::glGetModelViewMatrix(double modelview_matrix[16]) throw(cv::Exception) {
     // check if paremeters are valid
-    bool invalid = false;
-    for (int i = 0; i < 3 && !invalid; i++) {
-        if (Tvec.at< float >(i, 0) != -999999)
-            invalid |= false;
-        if (Rvec.at< float >(i, 0) != -999999)
-            invalid |= false;
-    }
-    if (invalid)
+    if (!isPoseValid())
         throw cv::Exception(9003, "extrinsic parameters are not set", "Marker::getModelViewMatrix", __FILE__, __LINE__);
     Mat Rot(3, 3, CV_32FC1), Jacob;
     Rodrigues(Rvec, Rot, Jacob);
@@ -139,14 +127,7 @@ void Marker::glGetModelViewMatrix(double modelview_matrix[16]) throw(cv::Excepti
 void Marker::OgreGetPoseParameters(double position[3], double orientation[4]) throw(cv::Exception) {
 
     // check if paremeters are valid
-    bool invalid = false;
-    for (int i = 0; i < 3 && !invalid; i++) {
-        if (Tvec.at< float >(i, 0) != -999999)
-            invalid |= false;
-        if (Rvec.at< float >(i, 0) != -999999)
-            invalid |= false;
-    }
-    if (invalid)
+    if (!isPoseValid())
         throw cv::Exception(9003, "extrinsic parameters are not set", "Marker::getModelViewMatrix", __FILE__, __LINE__);
 
     // calculate position vector
@@ -277,13 +258,16 @@ void Marker::calculateExtrinsics(float markerSizeMeters, cv::Mat camMatrix, cv::
 
     cv::Mat raux, taux;
     cv::solvePnP(objpoints, *this, camMatrix, distCoeff, raux, taux);
-    raux.convertTo(Rvec, CV_32F);
-    taux.convertTo(Tvec, CV_32F);
+    setExtrinsics(markerSizeMeters, raux, taux, setYPerpendicular);
+    // cout<<(*this)<<endl;
+}
+void Marker::setExtrinsics(float markerSizeMeters, const cv::Mat &rvec, const cv::Mat &tvec, bool setYPerpendicular) {
+    rvec.convertTo(Rvec, CV_32F);
+    tvec.convertTo(Tvec, CV_32F);
      // rotate the X axis so that Y is perpendicular to the marker plane
     if (setYPerpendicular)
         rotateXAxis(Rvec);
     ssize = markerSizeMeters;
-    // cout<<(*this)<<endl;
 }
 vector<cv::Point3f> Marker::get3DPoints(float msize)
 {
@@ -350,11 +334,13 @@ float Marker::getPerimeter() const {
 }
 //saves to a binary stream
 void Marker::toStream(ostream &str)const{
-    assert(Rvec.type()==CV_32F && Tvec.type()==CV_32F);
+    assert(!isPoseValid() || (Rvec.type()==CV_32F && Tvec.type()==CV_32F));
     str.write((char*)&id,sizeof(int));
     str.write((char*)&ssize,sizeof(float));
-    str.write((char*)Rvec.ptr<float>(0),3*sizeof(float));
-    str.write((char*)Tvec.ptr<float>(0),3*sizeof(float));
+    //a marker without pose is written with the -999999 values of unset poses
+    float unset[3]={-999999,-999999,-999999};
+    str.write((char*)(isPoseValid()?Rvec.ptr<float>(0):unset),3*sizeof(float));
+    str.write((char*)(isPoseValid()?Tvec.ptr<float>(0):unset),3*sizeof(float));
     //write the 2d points
     uint32_t np=size();
     str.write((char*) &np, sizeof(np));
@@ -369,6 +355,10 @@ void Marker::fromStream(istream &str){
     str.read((char*)&ssize,sizeof(float));
     str.read((char*)Rvec.ptr<float>(0),3*sizeof(float));
     str.read((char*)Tvec.ptr<float>(0),3*sizeof(float));
+    if (Rvec.ptr<float>(0)[0]==-999999){
+        Rvec.release();
+        Tvec.release();
+    }
     uint32_t np;
     str.read((char*) &np, sizeof(np));
     resize(np);
@@ -45,7 +45,8 @@ class ARUCO_EXPORTS Marker : public std::vector< cv::Point2f > {
     int id;
     // size of the markers sides in meters
     float ssize;
-    // matrices of rotation and translation respect to the camera
+    // matrices of rotation and translation respect to the camera. They are empty until the pose is calculated, so
+    // that markers without a pose are copied and moved without allocations
     cv::Mat Rvec, Tvec;
 
     /**
@@ -57,6 +58,13 @@ class ARUCO_EXPORTS Marker : public std::vector< cv::Point2f > {
     /**
      */
     Marker(const Marker &M);
+    /**Takes the corners of M, and shares its Rvec and Tvec instead of copying them
+     */
+    Marker(Marker &&M);
+    /**
+     */
+    Marker &operator=(const Marker &M) = default;
+    Marker &operator=(Marker &&M) = default;
     /**
      */
     Marker(const std::vector< cv::Point2f > &corners, int _id = -1);
@@ -66,6 +74,9 @@ class ARUCO_EXPORTS Marker : public std::vector< cv::Point2f > {
     /**Indicates if this object is valid
      */
     bool isValid() const { return id != -1 && size() == 4; }
+    /**Indicates if the pose (Rvec and Tvec) has been calculated
+     */
+    bool isPoseValid() const { return !Rvec.empty() && !Tvec.empty(); }
 
     /**Draws this marker in the input image
      */
@@ -84,6 +95,12 @@ class ARUCO_EXPORTS Marker : public std::vector< cv::Point2f > {
      * @param setYPerpendicular If set the Y axis will be perpendicular to the surface. Otherwise, it will be the Z axis
      */
     void calculateExtrinsics(float markerSize, cv::Mat CameraMatrix, cv::Mat Distorsion = cv::Mat(), bool setYPerpendicular = true) throw(cv::Exception);
+    /**Sets the extrinsics from a pose of the points of get3DPoints, e.g., found by IPPE
+     * @param markerSize size of the marker side expressed in meters
+     * @param rvec,tvec pose (3 elements each, of any float type)
+     * @param setYPerpendicular If set the Y axis will be perpendicular to the surface. Otherwise, it will be the Z axis
+     */
+    void setExtrinsics(float markerSize, const cv::Mat &rvec, const cv::Mat &tvec, bool setYPerpendicular = true);
 
     /**Given the extrinsic camera parameters returns the GL_MODELVIEW matrix for opengl.
      * Setting this matrix, the reference coordinate system will be set in this marker
@@ -123,6 +140,8 @@ class ARUCO_EXPORTS Marker : public std::vector< cv::Point2f > {
         str << M.id << "=";
         for (int i = 0; i < 4; i++)
             str << "(" << M[i].x << "," << M[i].y << ") ";
+        if (!M.isPoseValid())
+            return str;
         str << "Txyz=";
         for (int i = 0; i < 3; i++)
             str << M.Tvec.ptr< float >(0)[i] << " ";
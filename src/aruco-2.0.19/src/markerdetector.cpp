@@ -34,24 +34,85 @@ or implied, of Rafael Muñoz Salinas.
 #include <iostream>
 #include <fstream>
 #include <valarray>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <cstdint>
 #include "ar_omp.h"
 #include "checkrectcontour.h"
 #include "markerlabeler.h"
 #include "cameraparameters.h"
+#include "ippe.h"
+#include "projectionkernel.h"
 using namespace std;
 using namespace cv;
 
 namespace aruco {
 
+//milliseconds since the tick count t, which is moved to the current one
+static double elapsedMs(int64 &t){
+    int64 now=cv::getTickCount();
+    double ms=1000.*(now-t)/cv::getTickFrequency();
+    t=now;
+    return ms;
+}
+
+void (*MarkerDetector::traceHook)(const char *, int, bool)=NULL;
+
+//a stage of a detect call, traced from its construction to its destruction (see MarkerDetector::traceHook)
+class TraceStage{
+    void (*hook)(const char *, int, bool);
+    const char *stage;
+public:
+    TraceStage(const char *s,int level=-1):hook(MarkerDetector::traceHook),stage(s){ if (hook) hook(stage,level,true);}
+    ~TraceStage(){ if (hook) hook(stage,-1,false);}
+};
+
+void MarkerDetector::Stats::clear(){
+    nCalls=0;
+    thresholdTime=rectanglesTime=identifyTime=refineTime=filterTime=totalTime=0;
+    contoursPerLevel.clear();
+    nCandidates=labelerHits=labelerMisses=0;
+    subpixCorners=subpixMaxIterations=0;
+    overBudget=0;
+}
+
+void MarkerDetector::Stats::add(const Stats &s){
+    nCalls+=s.nCalls;
+    thresholdTime+=s.thresholdTime;
+    rectanglesTime+=s.rectanglesTime;
+    identifyTime+=s.identifyTime;
+    refineTime+=s.refineTime;
+    filterTime+=s.filterTime;
+    totalTime+=s.totalTime;
+    if (contoursPerLevel.size()<s.contoursPerLevel.size()) contoursPerLevel.resize(s.contoursPerLevel.size(),0);
+    for(size_t i=0;i<s.contoursPerLevel.size();i++) contoursPerLevel[i]+=s.contoursPerLevel[i];
+    nCandidates+=s.nCandidates;
+    labelerHits+=s.labelerHits;
+    labelerMisses+=s.labelerMisses;
+    subpixCorners+=s.subpixCorners;
+    subpixMaxIterations+=s.subpixMaxIterations;
+    overBudget+=s.overBudget;
+}
+
 /************************************
  *
  *
  *
  *
  ************************************/
-MarkerDetector::MarkerDetector() {
+MarkerDetector::Workspace::Workspace() {
+    _candidateScale=1;
+    _useUndistortLookup=false;
+    _budgetEnd=0;
+    labelers=NULL;
+    _lastThresLevel=0;
+    _integralBorderSize=0;
+}
 
+MarkerDetector::MarkerDetector() {
     markerIdDetector = aruco::MarkerLabeler::create(Dictionary::ARUCO);
+    markerIdDetectors.push_back(markerIdDetector);
   //  markerIdDetector = aruco::MarkerLabeler::create("ARUCO");
     if (markerIdDetector->getBestInputSize()!=-1)setWarpSize(markerIdDetector->getBestInputSize());
 
@@ -118,149 +179,606 @@ void MarkerDetector::detect(const cv::Mat &input, std::vector< Marker > &detecte
  ************************************/
 void MarkerDetector::detect(const cv::Mat &input, vector< Marker > &detectedMarkers, Mat camMatrix, Mat distCoeff, float markerSizeMeters,
                             bool setYPerpendicular) throw(cv::Exception) {
-//omp_set_num_threads(1);
-    // it must be a 3 channel image
-    if (input.type() == CV_8UC3)
-        cv::cvtColor(input, grey, CV_BGR2GRAY);
-    else
-        grey = input;
+    //a single dictionary detection is a multiple one with only the current labeler
+    vector< cv::Ptr<MarkerLabeler> > labeler(1,markerIdDetector);
+    //the markers of the previous call are swapped into the buffer, so their vector is reused
+    vector< vector< Marker > > &detectedMarkersV = _ws.singleDictionaryBuffer;
+    detectedMarkersV.resize(1);
+    detectedMarkersV[0].swap(detectedMarkers);
+    detectLabelers(labeler, input, detectedMarkersV, _ws, camMatrix, distCoeff, markerSizeMeters, setYPerpendicular);
+    detectedMarkers.swap(detectedMarkersV[0]);
+}
 
-    imagePyramid.clear();
-    imagePyramid.push_back(grey);
-    while(imagePyramid.back().cols>120){
-      cv::Mat pyrd;
-      cv::pyrDown(imagePyramid.back(),pyrd);
-      imagePyramid.push_back(pyrd);
-    };
+/************************************
+ *
+ * Multiple dictionary detection. The candidates are found once and each one is
+ * labeled by the first labeler that identifies it
+ *
+ ************************************/
+void MarkerDetector::detect(const cv::Mat &input, vector< vector< Marker > > &detectedMarkersV, Mat camMatrix, Mat distCoeff, float markerSizeMeters,
+                            bool setYPerpendicular) throw(cv::Exception) {
+    detectLabelers(markerIdDetectors, input, detectedMarkersV, _ws, camMatrix, distCoeff, markerSizeMeters, setYPerpendicular);
+}
 
-     //     cv::cvtColor(grey,_ssImC ,CV_GRAY2BGR); //DELETE
+/************************************
+ *
+ * Reentrant detection: everything the call writes is in ws
+ *
+ ************************************/
+void MarkerDetector::detect(const cv::Mat &input, vector< vector< Marker > > &detectedMarkersV, Workspace &ws, const Mat &camMatrix,
+                            const Mat &distCoeff, float markerSizeMeters, bool setYPerpendicular) const throw(cv::Exception) {
+    detectLabelers(markerIdDetectors, input, detectedMarkersV, ws, camMatrix, distCoeff, markerSizeMeters, setYPerpendicular);
+}
 
-    // clear input data
-    detectedMarkers.clear();
+void MarkerDetector::detectLabelers(const vector< cv::Ptr<MarkerLabeler> > &labelers, const cv::Mat &input, vector< vector< Marker > > &detectedMarkersV,
+                                    Workspace &w, const Mat &camMatrix, const Mat &distCoeff, float markerSizeMeters, bool setYPerpendicular) const {
+    //the pointer is only read during the call
+    w.labelers=&labelers;
+    if (!_roi.empty() && detectInROI(input, detectedMarkersV, w, camMatrix, distCoeff, markerSizeMeters, setYPerpendicular))
+        return;
+    detectImage(input, detectedMarkersV, w, camMatrix, distCoeff, markerSizeMeters, setYPerpendicular);
+}
+
+/************************************
+ *
+ * Fused first pass of a color frame: the grey image, the first level of the pyramid and, if asked, the integral
+ * image of the threshold input are written in a single pass over blocks of rows, so the frame is read from memory
+ * once and the grey rows are still in the cache when the other two are computed from them
+ *
+ ************************************/
 
+//grey of a BGR row, with the fixed point weights of cv::cvtColor(CV_BGR2GRAY)
+ARUCO_DISPATCH static void greyRow(const uchar *bgr, uchar *grey, int cols) {
+    for (int x = 0; x < cols; x++, bgr += 3)
+        grey[x] = uchar((bgr[0] * 1868 + bgr[1] * 9617 + bgr[2] * 4899 + (1 << 13)) >> 14);
+}
+
+//row of cv::pyrDown: the 1 4 6 4 1 filter of the five rows r, then of the columns, with BORDER_REFLECT_101
+ARUCO_DISPATCH static void pyrDownRow(const uchar *const r[5], int *sum, uchar *out, int cols, int outCols) {
+    for (int x = 0; x < cols; x++)
+        sum[x] = r[0][x] + 4 * (r[1][x] + r[3][x]) + 6 * r[2][x] + r[4][x];
+    for (int x = 0; x < outCols; x++) {
+        int c = 2 * x;
+        int l2 = std::abs(c - 2), l1 = std::abs(c - 1);
+        int r1 = c + 1 < cols ? c + 1 : 2 * cols - 3 - c, r2 = c + 2 < cols ? c + 2 : 2 * cols - 4 - c;
+        out[x] = uchar((sum[l2] + 4 * (sum[l1] + sum[r1]) + 6 * sum[c] + sum[r2] + 128) >> 8);
+    }
+}
+
+//row of the integral image of prepareIntegral: the sums of prev plus those of the row, replicated border columns
+//wide on each side
+ARUCO_DISPATCH static void integralRow(const uchar *row, const unsigned *prev, unsigned *out, int cols, int border) {
+    unsigned s = 0;
+    out[0] = 0;
+    for (int x = 0; x < border; x++) {
+        s += row[0];
+        out[x + 1] = prev[x + 1] + s;
+    }
+    for (int x = 0; x < cols; x++) {
+        s += row[x];
+        out[border + x + 1] = prev[border + x + 1] + s;
+    }
+    for (int x = 0; x < border; x++) {
+        s += row[cols - 1];
+        out[border + cols + x + 1] = prev[border + cols + x + 1] + s;
+    }
+}
+
+//adds the rows of integral of image row y of img (0 or the last row give their border rows too). next is the next
+//integral row to write
+static void integralRows(const cv::Mat &img, int y, int border, cv::Mat &integral, int &next) {
+    int last = y == img.rows - 1 ? y + 2 * border : y + border;
+    for (; next <= last + 1; next++)
+        integralRow(img.ptr<uchar>(y), integral.ptr<unsigned>(next - 1), integral.ptr<unsigned>(next), img.cols, border);
+}
+
+//writes grey and half (the first pyramid level) of the BGR image bgr, and the integral image of level integralLevel
+//(0 or 1) with a border for windows of up to 2*border+1 pixels, if integral is given
+static void fusedFirstPass(const cv::Mat &bgr, cv::Mat &grey, cv::Mat &half, cv::Mat *integral, int integralLevel, int border) {
+    int rows = bgr.rows, cols = bgr.cols;
+    grey.create(rows, cols, CV_8UC1);
+    half.create((rows + 1) / 2, (cols + 1) / 2, CV_8UC1);
+    cv::Mat &intImg = integralLevel == 0 ? grey : half;
+    if (integral) {
+        integral->create(intImg.rows + 2 * border + 1, intImg.cols + 2 * border + 1, CV_32S);
+        std::fill(integral->ptr<unsigned>(0), integral->ptr<unsigned>(0) + integral->cols, 0u);
+    }
+    std::vector<int> sum(cols);
+    int nextIntegral = 1, nextHalf = 0;
+    //blocks of rows of about 128KB, whose grey rows stay in the cache
+    int blockRows = std::max(8, (128 << 10) / std::max(1, 3 * cols));
+    for (int y0 = 0; y0 < rows; y0 += blockRows) {
+        int y1 = std::min(rows, y0 + blockRows);
+        for (int y = y0; y < y1; y++) {
+            greyRow(bgr.ptr<uchar>(y), grey.ptr<uchar>(y), cols);
+            if (integral && integralLevel == 0)
+                integralRows(grey, y, border, *integral, nextIntegral);
+        }
+        //the rows of the first level whose five grey rows are done
+        for (; nextHalf < half.rows && (2 * nextHalf + 2 < y1 || y1 == rows); nextHalf++) {
+            const uchar *r[5];
+            for (int k = 0; k < 5; k++) {
+                int y = 2 * nextHalf - 2 + k;
+                y = y < 0 ? -y : y >= rows ? 2 * rows - 2 - y : y;
+                r[k] = grey.ptr<uchar>(std::max(0, std::min(rows - 1, y)));
+            }
+            pyrDownRow(r, sum.data(), half.ptr<uchar>(nextHalf), cols, half.cols);
+            if (integral && integralLevel == 1)
+                integralRows(half, nextHalf, border, *integral, nextIntegral);
+        }
+    }
+}
 
-    cv::Mat imgToBeThresHolded = grey;
+void MarkerDetector::detectImage(const cv::Mat &input, vector< vector< Marker > > &detectedMarkersV, Workspace &w, const Mat &camMatrix,
+                                 const Mat &distCoeff, float markerSizeMeters, bool setYPerpendicular) const {
+    TraceStage trace("detect");
+    int64 tStart=cv::getTickCount(),t=tStart;
+    const vector< cv::Ptr<MarkerLabeler> > &labelers=*w.labelers;
+    Stats &stats=w._lastStats;
+    stats.clear();
+    stats.nCalls=1;
+    w._budgetEnd= _params._timeBudgetMs>0 ? tStart+int64(_params._timeBudgetMs*cv::getTickFrequency()/1000.) : 0;
+
+    //the levels are reused if the image size does not change. Each level is half the previous one, rounded up
+    vector<int> levelCols(1,input.cols);
+    while(levelCols.back()>120) levelCols.push_back((levelCols.back()+1)/2);
+    size_t nPyrLevels=levelCols.size();
+
+    //coarse to fine search: candidates may be searched in a lower level of the pyramid, and their corners
+    //are refined afterwards in the full resolution image
+    int candLevel=std::max(0,std::min(_params._pyrCandidateLevel,int(nPyrLevels)-1));
+    while(candLevel>0 && levelCols[candLevel]<320) candLevel--;
+    w._candidateScale=float(1<<candLevel);
+    //or in the image reduced by any factor, whose candidates have their sides refined at full resolution
+    bool decimate=_params._quadDecimate>1 && input.cols/_params._quadDecimate>=320;
 
     /// Do threshold the image and detect contours
     // work simultaneouly in a range of values of the first threshold
     int n_param1 = 2 * _params._thresParam1_range + 1;
-    vector< cv::Mat > thres_images;
 
 
     //compute the different values of param1
 
     vector<int> p1_values;
     for(int i=std::max(3.,_params._thresParam1-2*_params._thresParam1_range);i<=_params._thresParam1+2*_params._thresParam1_range;i+=2)p1_values.push_back(i);
-    thres_images.resize(p1_values.size());
- #pragma omp parallel for
-    for (int i = 0; i < int(p1_values.size()); i++){
-        thresHold(_params._thresMethod, imgToBeThresHolded, thres_images[i], p1_values[i], _params._thresParam2);
-        //do a eroding?
-//        cv::erode(thres_images[i],aux, getStructuringElement( MORPH_ELLIPSE,cv::Size( 3, 3 ),cv::Point( 1, 1 ) ););
-//        thres_images[i]=aux;
+
+    // it must be a 3 channel image. A color one is read once for the grey image, the first level of the pyramid
+    // and the integral image of the threshold input if asked for (see fusedFirstPass)
+    cv::Mat &grey=w.grey;
+    bool fused=_params._fusedFirstPass && input.type() == CV_8UC3 && nPyrLevels>1 && !_params._useOpenCL;
+    bool fusedIntegral=fused && !decimate && candLevel<=1 && _params._thresMethod == ADPT_THRES_INTEGRAL;
+    if (fused){
+        TraceStage trace("firstPass");
+        w.imagePyramid.resize(nPyrLevels);
+        w._integralBorderSize=p1_values.back()/2;
+        fusedFirstPass(input, w.greyBuffer, w.imagePyramid[1], fusedIntegral ? &w.integralImage : NULL, candLevel, w._integralBorderSize);
+        grey = w.greyBuffer;
+    }
+    else if (input.type() == CV_8UC3){
+        cv::cvtColor(input, w.greyBuffer, CV_BGR2GRAY);
+        grey = w.greyBuffer;
     }
-    thres = thres_images[n_param1 / 2];
+    else
+        grey = input;
+
+    //the point undistortion tables of the LINES refinement are kept while the camera and the image size do not change
+    w._useUndistortLookup=_params._cornerMethod==LINES && _params._undistortLookupStep>0 && !camMatrix.empty() && !distCoeff.empty();
+    if (w._useUndistortLookup && !w._undistortLookup.matches(camMatrix,distCoeff,grey.size(),_params._undistortLookupStep)){
+        TraceStage trace("undistortLookup");
+        w._undistortLookup.create(camMatrix,distCoeff,grey.size(),_params._undistortLookupStep);
+    }
+
+    // clear input data, keeping the capacity of the output vectors
+    detectedMarkersV.resize(labelers.size());
+    for (size_t l = 0; l < detectedMarkersV.size(); l++)
+        detectedMarkersV[l].clear();
+
+    if (decimate){
+        candLevel=0;
+        cv::resize(grey,w.decimatedBuffer,cv::Size(cvRound(grey.cols/_params._quadDecimate),cvRound(grey.rows/_params._quadDecimate)),0,0,cv::INTER_AREA);
+        w._candidateScale=float(grey.cols)/float(w.decimatedBuffer.cols);
+    }
+
+    //the pyramid and the threshold images are computed on an OpenCL device if asked for and possible, and otherwise here
+    if (!(_params._useOpenCL && !decimate && deviceThreshold(w, grey, nPyrLevels, candLevel, p1_values))){
+    w.imagePyramid.resize(nPyrLevels);
+    w.imagePyramid[0]=grey;
+    {
+    TraceStage trace("pyramid");
+    for(size_t i=fused ? 2 : 1;i<nPyrLevels;i++)
+      cv::pyrDown(w.imagePyramid[i-1],w.imagePyramid[i]);
+    }
+    //the threshold images are not kept: each one is computed by the thread that extracts its contours right
+    //before, into a buffer of the thread (see thresholdLevel), so only a few of them are in memory at once
+    w._thresInput = decimate ? w.decimatedBuffer : w.imagePyramid[candLevel];
+    w._thresValues = p1_values;
+    w.thres_images.clear();
+    if (_params._thresMethod == ADPT_THRES_INTEGRAL && !fusedIntegral)//all the values from a single integral image
+        prepareIntegral(w, w._thresInput, p1_values.back());
+    thresholdLevel(w, n_param1 / 2, w.thres);
+    }
+    else//the middle threshold image is consumed by the contour extraction, so keep a copy of it
+        w.thres_images[n_param1 / 2].copyTo(w.thres);
+    int nThresLevels=w.thres_images.empty() ? w._thresValues.size() : w.thres_images.size();
+    stats.contoursPerLevel.assign(nThresLevels,0);
+    stats.thresholdTime=elapsedMs(t);
      //
 
 
-     // find all rectangles in the thresholdes image
-    vector< MarkerCandidate > MarkerCanditates;
-    detectRectangles(thres_images, MarkerCanditates);
+     // find all rectangles in the thresholdes image and identify them
+    vector< Marker > &detectedMarkers = w.detectedBuffer;
+    vector< int > &markerLabelers = w.labelerBuffer;
+    detectedMarkers.clear();
+    markerLabelers.clear();
+    w._candidates.clear();
+    if (w.outOfTime())
+        ;//no time left for the search
+    else if (_params._adaptiveThresLevels && nThresLevels>1)
+        detectAdaptiveLevels(w, nThresLevels, candLevel, camMatrix, distCoeff, detectedMarkers, markerLabelers);
+    else{
+        vector< MarkerCandidate > MarkerCanditates;
+        vector< int > levels;
+        for(int i=0;i<nThresLevels;i++) levels.push_back(i);
+        detectRectangles(w, levels, w.thres_images.empty() ? NULL : &w.thres_images, MarkerCanditates);
+        identifyCandidates(w, MarkerCanditates, candLevel, camMatrix, distCoeff, detectedMarkers, markerLabelers);
+    }
+    //the rectangle search and the identification are timed by themselves
+    t=cv::getTickCount();
+    stats.overBudget=w.outOfTime();
+
+    //the corners of a decimated search are off by up to the reduction factor, which the sides refinement recovers
+    if (decimate){
+#pragma omp parallel for num_threads(nThreads())
+        for (int i = 0; i < int(detectedMarkers.size()); i++)
+            refineEdges(grey, detectedMarkers[i], w._candidateScale+1);
+    }
+
+
+    /// refine the corner location if desired
+    //corners found in a lower level of the pyramid are always refined
+    if (detectedMarkers.size() > 0 && ((_params._cornerMethod != NONE && _params._cornerMethod != LINES) || candLevel>0)) {
+        TraceStage trace("subpix");
+
+        if (_params._cornerMethod == SUBPIX || candLevel>0) {
+            //the window must cover the error of the corners of a low resolution candidate
+            int wsize=std::max(_params._subpix_wsize,2*(1<<candLevel));
+            //each marker is refined independently in a tile of the image around it. The margin covers the
+            //search window of every iteration near the start point, so the tile border is not reached in practice
+            int margin=2*wsize+2;
+            const int maxIterations=std::max(1,_params._subpixMaxIterations);
+            stats.subpixCorners=4*detectedMarkers.size();
+            stats.subpixMaxIterations=maxIterations*stats.subpixCorners;
+            cv::Rect imageRect(0,0,grey.cols,grey.rows);
+#pragma omp parallel for num_threads(nThreads())
+            for (int i = 0; i < int(detectedMarkers.size()); i++) {
+                cv::Rect tile=cv::boundingRect(cv::Mat(detectedMarkers[i]));
+                tile=cv::Rect(tile.x-margin,tile.y-margin,tile.width+2*margin,tile.height+2*margin) & imageRect;
+                vector< Point2f > Corners(4);
+                for (int c = 0; c < 4; c++)
+                    Corners[c] = detectedMarkers[i][c] - Point2f(tile.x, tile.y);
+                cornerSubPix(grey(tile), Corners, cvSize(wsize, wsize), cvSize(-1, -1), cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, maxIterations, 0.005));
+                for (int c = 0; c < 4; c++)
+                    detectedMarkers[i][c] = Corners[c] + Point2f(tile.x, tile.y);
+            }
+        }
+        else if (_params._cornerMethod == HARRIS) {
+            vector< Point2f > Corners;
+            for (size_t i = 0; i < detectedMarkers.size(); i++)
+                Corners.insert(Corners.end(), detectedMarkers[i].begin(), detectedMarkers[i].end());
+            findCornerMaxima(Corners, grey, _params._subpix_wsize);
+            for (size_t i = 0; i < detectedMarkers.size(); i++)
+                for (int c = 0; c < 4; c++)
+                    detectedMarkers[i][c] = Corners[i*4 + c];
+        }
+    }
+
+
+    stats.refineTime=elapsedMs(t);
+
+    // split the markers by the labeler that identified them
+    for (size_t i = 0; i < detectedMarkers.size(); i++)
+        detectedMarkersV[markerLabelers[i]].push_back(std::move(detectedMarkers[i]));
+
+    {
+    TraceStage trace("filter");
+    for (size_t l = 0; l < detectedMarkersV.size(); l++)
+        filterDetectedMarkers(input.size(), detectedMarkersV[l], camMatrix, distCoeff, markerSizeMeters, setYPerpendicular);
+    }
+    stats.filterTime=elapsedMs(t);
+    stats.totalTime=elapsedMs(tStart);
+    w._totalStats.add(stats);
+}
+
+/************************************
+ *
+ * Detection restricted to a region of the image (setROI)
+ *
+ ************************************/
+cv::Rect MarkerDetector::roiBox(cv::Size imageSize)const{
+    cv::Rect image(0,0,imageSize.width,imageSize.height);
+    if (_roi.empty()) return image;
+    //a marker at the edge of the polygon needs the threshold window around it, which covers more pixels when the
+    //candidates are searched in a reduced image
+    float scale=std::max(float(1<<std::max(0,_params._pyrCandidateLevel)),std::max(1.f,_params._quadDecimate));
+    int pad=cvCeil((_params._thresParam1+2*_params._thresParam1_range)*scale)+std::max(0,_params._subpix_wsize);
+    cv::Rect box=cv::boundingRect(_roi);
+    return cv::Rect(box.x-pad,box.y-pad,box.width+2*pad,box.height+2*pad)&image;
+}
 
+bool MarkerDetector::detectInROI(const cv::Mat &input, vector< vector< Marker > > &detectedMarkersV, Workspace &w, const cv::Mat &camMatrix,
+                                 const cv::Mat &distCoeff, float markerSizeMeters, bool setYPerpendicular) const{
+    cv::Rect box=roiBox(input.size());
+    if (box.size()==input.size()) return false;
+    detectedMarkersV.resize(w.labelers->size());
+    for (size_t l = 0; l < detectedMarkersV.size(); l++)
+        detectedMarkersV[l].clear();
+    if (box.area()==0){//the polygon is out of the image
+        w._lastStats.clear();
+        w._lastStats.nCalls=1;
+        w._totalStats.add(w._lastStats);
+        return true;
+    }
+    //the principal point moves with the region, so that the poses do not change
+    cv::Mat boxCamMatrix;
+    if (!camMatrix.empty()){
+        boxCamMatrix=camMatrix.clone();
+        if (boxCamMatrix.depth()==CV_64F){
+            boxCamMatrix.at<double>(0,2)-=box.x;
+            boxCamMatrix.at<double>(1,2)-=box.y;
+        }else{
+            boxCamMatrix.at<float>(0,2)-=box.x;
+            boxCamMatrix.at<float>(1,2)-=box.y;
+        }
+    }
+    detectImage(input(box), detectedMarkersV, w, boxCamMatrix, distCoeff, markerSizeMeters, setYPerpendicular);
+    cv::Point2f offset((float)box.x,(float)box.y);
+    for (auto &markers:detectedMarkersV){
+        for (auto &m:markers)
+            for (auto &p:m) p+=offset;
+        markers.erase(std::remove_if(markers.begin(),markers.end(),[this](const Marker &m){
+            return cv::pointPolygonTest(_roi,m.getCenter(),false)<0;}),markers.end());
+    }
+    return true;
+}
+
+/************************************
+ *
+ * Warps the candidates and passes them to the labelers. The identified ones are appended to detectedMarkers,
+ * with the index of their labeler in markerLabelers, and the rest to _candidates
+ *
+ ************************************/
+void MarkerDetector::identifyCandidates(Workspace &w, vector< MarkerCandidate > &MarkerCanditates, int candLevel, const Mat &camMatrix,
+                                        const Mat &distCoeff, vector< Marker > &detectedMarkers, vector< int > &markerLabelers) const {
+    TraceStage trace("identify");
+    int64 t=cv::getTickCount();
+    const vector< cv::Ptr<MarkerLabeler> > &labelers=*w.labelers;
+    size_t first=detectedMarkers.size();
+    if (w._candidateScale>1){//move the candidates to the full resolution image. Contours are not valid there
+        for(auto &cand:MarkerCanditates) cand.scale(w._candidateScale);
+    }
 
     float desiredarea=_params._markerWarpSize*_params._markerWarpSize;
+    // the patches of all the candidates are warped into a single buffer, reused between calls
+    int ws=_params._markerWarpSize;
+    if (w.patchBuffer.rows < int(MarkerCanditates.size())*ws || w.patchBuffer.cols != ws)
+        w.patchBuffer.create(std::max(1,int(MarkerCanditates.size()))*ws, ws, CV_8UC1);
     /// identify the markers
-    vector< vector< Marker > > markers_omp(omp_get_max_threads());
-    vector< vector< std::vector< cv::Point2f > > > candidates_omp(omp_get_max_threads());
-//    for(int i=0;i<imagePyramid.size();i++){
+    //with the static schedule, each thread gets at most this many candidates
+    size_t perThread=MarkerCanditates.size()/nThreads()+1;
+    w.markers_omp.reset(nThreads());
+    w.labelers_omp.reset(nThreads());//index of the labeler that identified each marker
+    w.candidates_omp.reset(nThreads());
+    w.markers_omp.reserve(perThread);
+    w.labelers_omp.reserve(perThread);
+    w.candidates_omp.reserve(perThread);
+    // an identified candidate becomes a marker, with its points sorted so that they are always in the same order no
+    // matter the camera orientation
+    auto addMarker=[&](int i,int id,int nRotations,int labeler){
+        if (_params._cornerMethod == LINES && MarkerCanditates[i].hasContour()) // make LINES refinement before lose contour points
+            refineCandidateLines(w, MarkerCanditates[i], camMatrix, distCoeff);
+        vector<Marker> &markers=w.markers_omp[omp_get_thread_num()];
+        markers.push_back(std::move(static_cast< Marker & >(MarkerCanditates[i])));
+        markers.back().id = id;
+        w.labelers_omp[omp_get_thread_num()].push_back(labeler);
+        std::rotate(markers.back().begin(), markers.back().begin() + 4 - nRotations, markers.back().end());
+    };
+    // labelers that identify many patches at once (see MarkerLabeler::batched) are given all the patches once
+    // they are warped, and then every labeler is run on the patches the previous ones did not identify
+    int n=MarkerCanditates.size();
+    bool batch=false;
+    for(auto &l:labelers) batch|=l->batched();
+    vector<char> warped(n,0);
+    vector<int> ids(n,0),rotations(n,0),labelerOf(n,-1);
+
+    //warping is one of the most time consuming operations, especially when the region is large.
+    //To reduce computing time, each candidate is warped from the level of the image pyramid where it is
+    //the smallest that is still larger than the patch
+    vector<int> pyrLevel(n,0);
+    vector<uint64_t> warpKey(n);
+    for (int i = 0; i < n; i++) {
+        for(size_t p=1;p<w.imagePyramid.size() && !(_params._cylinderWarp && MarkerCanditates[i].hasContour());p++){
+            if (MarkerCanditates[i].metrics.area / pow(4,p) >= desiredarea ) pyrLevel[i]=p;
+            else break;
+        }
+        // tile of 64 pixels of its level holding the center of the candidate, in Morton order
+        cv::Point2f c(0,0);
+        for(auto &p:MarkerCanditates[i]) c+=p*0.25f;
+        uint32_t tx=std::max(0,int(c.x/(64<<pyrLevel[i]))), ty=std::max(0,int(c.y/(64<<pyrLevel[i]))), morton=0;
+        for(int b=0;b<16;b++) morton|=((tx>>b)&1)<<(2*b) | ((ty>>b)&1)<<(2*b+1);
+        warpKey[i]=uint64_t(pyrLevel[i])<<32 | morton;
+    }
+    // the candidates come in the order of the threshold levels and of the threads that found them. They are warped
+    // by level and tile instead, so the consecutive warps of a thread read nearby pixels of the same level, and their
+    // patches are written one after the other. The markers are then added in the order of the candidates, so the
+    // result does not depend on it
+    vector<int> order(n),slot(n);
+    for (int i = 0; i < n; i++) order[i]=i;
+    std::stable_sort(order.begin(),order.end(),[&](int a,int b){ return warpKey[a]<warpKey[b]; });
+    for (int k = 0; k < n; k++) slot[order[k]]=k;
+//    for(int i=0;i<w.imagePyramid.size();i++){
 //        string name="im"+std::to_string(i)+".jpg";
-//        cv::imwrite(name,imagePyramid[i]);
+//        cv::imwrite(name,w.imagePyramid[i]);
 //    }
-#pragma omp parallel for
-    for (int i = 0; i < int(MarkerCanditates.size()); i++) {
+#pragma omp parallel for schedule(static) num_threads(nThreads())
+    for (int k = 0; k < n; k++) {
+        if (w.outOfTime()) continue;//the candidates left are dropped
+        int i=order[k];
          // Find proyective homography
-        Mat canonicalMarker;
+        Mat canonicalMarker=w.patchBuffer.rowRange(k*ws,(k+1)*ws);
         bool resW = false;
-        //warping is one of the most time consuming operations, especially when the region is large.
-        //To reduce computing time, let us find in the image pyramid, the best configuration to save time
-        //indicates how much bigger observation is wrt to desired patch
-        int imgPyrIdx=0;
-        for(size_t p=1;p<imagePyramid.size();p++){
-            if (MarkerCanditates[i].getArea() / pow(4,p) >= desiredarea ) imgPyrIdx=p;
-            else break;
+        int imgPyrIdx=pyrLevel[i];
+        if (_params._cylinderWarp && MarkerCanditates[i].hasContour())//the contour is in the full resolution image
+            resW = warp_cylinder(w.imagePyramid[0], canonicalMarker, Size(ws, ws), MarkerCanditates[i]);
+        else {
+            vector<cv::Point2f> points2d_pyr=MarkerCanditates[i];
+            for(auto &p:points2d_pyr) p*=1./pow(2,imgPyrIdx);
+            resW = warp(w.imagePyramid[imgPyrIdx], canonicalMarker, Size(_params._markerWarpSize, _params._markerWarpSize), points2d_pyr);
         }
-
-        vector<cv::Point2f> points2d_pyr=MarkerCanditates[i];
-        for(auto &p:points2d_pyr) p*=1./pow(2,imgPyrIdx);
-        resW = warp(imagePyramid[imgPyrIdx], canonicalMarker, Size(_params._markerWarpSize, _params._markerWarpSize), points2d_pyr);
-        //go to a pyramid that minimizes the ratio
-
-        if (resW) {
+        warped[i]=resW;
+        if (!batch && resW) {
             int id,nRotations;
-            if (markerIdDetector->detect(canonicalMarker, id,nRotations)) {
-                 if (_params._cornerMethod == LINES) // make LINES refinement before lose contour points
-                    refineCandidateLines(MarkerCanditates[i], camMatrix, distCoeff);
-                markers_omp[omp_get_thread_num()].push_back(MarkerCanditates[i]);
-                markers_omp[omp_get_thread_num()].back().id = id;
-                // sort the points so that they are always in the same order no matter the camera orientation
-                std::rotate(markers_omp[omp_get_thread_num()].back().begin(), markers_omp[omp_get_thread_num()].back().begin() + 4 - nRotations, markers_omp[omp_get_thread_num()].back().end());
-              } else
-                candidates_omp[omp_get_thread_num()].push_back(MarkerCanditates[i]);
+            for(size_t l=0;l<labelers.size() && labelerOf[i]==-1;l++)
+                if (labelers[l]->detect(canonicalMarker, id,nRotations)){
+                    labelerOf[i]=l;
+                    ids[i]=id;
+                    rotations[i]=nRotations;
+                }
+        }
+    }
+    if (batch){
+        for(size_t l=0;l<labelers.size();l++){
+            vector<int> pending;
+            for(int i=0;i<n;i++)
+                if (warped[i] && labelerOf[i]==-1) pending.push_back(i);
+            if (pending.empty()) break;
+            vector<cv::Mat> patches(pending.size());
+            for(size_t k=0;k<pending.size();k++) patches[k]=w.patchBuffer.rowRange(slot[pending[k]]*ws,(slot[pending[k]]+1)*ws);
+            vector<int> pendingIds,pendingRotations;
+            vector<char> found;
+            labelers[l]->detectBatch(patches,pendingIds,pendingRotations,found);
+            for(size_t k=0;k<pending.size();k++)
+                if (found[k]){
+                    labelerOf[pending[k]]=l;
+                    ids[pending[k]]=pendingIds[k];
+                    rotations[pending[k]]=pendingRotations[k];
+                }
         }
+    }
+    // in the order of the candidates
+#pragma omp parallel for schedule(static) num_threads(nThreads())
+    for (int i = 0; i < n; i++) {
+        if (labelerOf[i]!=-1)
+            addMarker(i,ids[i],rotations[i],labelerOf[i]);
+        else if (warped[i])
+            w.candidates_omp[omp_get_thread_num()].push_back(std::move(MarkerCanditates[i]));
     }
      // unify parallel data
-    joinVectors(markers_omp, detectedMarkers, true);
-    joinVectors(candidates_omp, _candidates, true);
-
-
-
-    /// refine the corner location if desired
-    if (detectedMarkers.size() > 0 && _params._cornerMethod != NONE && _params._cornerMethod != LINES) {
-
-        vector< Point2f > Corners;
-        for (unsigned int i = 0; i < detectedMarkers.size(); i++)
-            for (int c = 0; c < 4; c++)
-                Corners.push_back(detectedMarkers[i][c]);
-
+    w.markers_omp.join(detectedMarkers, false, nThreads());
+    w.labelers_omp.join(markerLabelers, false, nThreads());
+    w.candidates_omp.join(w._candidates, false, nThreads());
+    int nHits=detectedMarkers.size()-first;
+    w._lastStats.nCandidates+=MarkerCanditates.size();
+    w._lastStats.labelerHits+=nHits;
+    w._lastStats.labelerMisses+=MarkerCanditates.size()-nHits;
+    w._lastStats.identifyTime+=elapsedMs(t);
+}
 
-          if (_params._cornerMethod == SUBPIX) {
-            cornerSubPix(grey, Corners, cvSize(_params._subpix_wsize, _params._subpix_wsize), cvSize(-1, -1), cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 12, 0.005));
+/************************************
+ *
+ * Processes the threshold images one at a time, starting by the ones that found more markers in previous calls.
+ * It stops when all the expected markers (see setExpectedMarkers) are found, or when a level adds no new marker
+ * after some have been found
+ *
+ ************************************/
+void MarkerDetector::detectAdaptiveLevels(Workspace &w, int nLevels, int candLevel, const Mat &camMatrix, const Mat &distCoeff,
+                                          vector< Marker > &detectedMarkers, vector< int > &markerLabelers) const {
+    if (int(w._thresLevelHits.size())!=nLevels){
+        w._thresLevelHits.assign(nLevels,0);
+        w._lastThresLevel=nLevels/2;
+    }
+    //the last successful level goes first, then the rest by their number of hits, the middle ones first on ties
+    vector<int> order;
+    for(int i=0;i<nLevels;i++) order.push_back(i);
+    std::stable_sort(order.begin(),order.end(),[&](int a,int b){
+        if ((a==w._lastThresLevel)!=(b==w._lastThresLevel)) return a==w._lastThresLevel;
+        if (w._thresLevelHits[a]!=w._thresLevelHits[b]) return w._thresLevelHits[a]>w._thresLevelHits[b];
+        return std::abs(a-nLevels/2)<std::abs(b-nLevels/2);
+    });
+
+    size_t nExpected=0;
+    for(size_t l=0;l<_expectedIds.size() && l<w.labelers->size();l++) nExpected+=_expectedIds[l].size();
+    std::set< std::pair<int,int> > found;//(labeler,id) of the markers found so far
+    size_t nExpectedFound=0;
+    int bestLevel=-1,bestNew=0;
+    //the levels that are not searched are not even thresholded
+    vector< int > level(1);
+    for(int li=0;li<nLevels && !w.outOfTime();li++){
+        int t=order[li];
+        level[0]=t;
+        vector< MarkerCandidate > MarkerCanditates;
+        detectRectangles(w, level, w.thres_images.empty() ? NULL : &w.thres_images, MarkerCanditates);
+        size_t first=detectedMarkers.size();
+        identifyCandidates(w, MarkerCanditates, candLevel, camMatrix, distCoeff, detectedMarkers, markerLabelers);
+
+        int nNew=0;
+        for(size_t i=first;i<detectedMarkers.size();i++){
+            if (!found.insert(std::make_pair(markerLabelers[i],detectedMarkers[i].id)).second) continue;
+            nNew++;
+            int l=markerLabelers[i];
+            if (l<int(_expectedIds.size()) && _expectedIds[l].count(detectedMarkers[i].id)) nExpectedFound++;
         }
-        // copy back
-        for (unsigned int i = 0; i < detectedMarkers.size(); i++)
-            for (int c = 0; c < 4; c++)
-                detectedMarkers[i][c] = Corners[i * 4 + c];
+        w._thresLevelHits[t]+=nNew;
+        if (nNew>bestNew){bestNew=nNew;bestLevel=t;}
+        if (nExpected>0 && nExpectedFound==nExpected) break;
+        if (nNew==0 && !found.empty()) break;
     }
+    if (bestLevel!=-1) w._lastThresLevel=bestLevel;
+}
 
+void MarkerDetector::setExpectedMarkers(const vector< vector< int > > &ids){
+    _expectedIds.resize(ids.size());
+    for(size_t l=0;l<ids.size();l++) _expectedIds[l]=std::set<int>(ids[l].begin(),ids[l].end());
+}
 
+/************************************
+ *
+ * Sorts the markers of a dictionary, removes the repeated ones and these too near the image borders,
+ * and computes their extrinsics if desired
+ *
+ ************************************/
+void MarkerDetector::filterDetectedMarkers(cv::Size imageSize, vector< Marker > &detectedMarkers, const Mat &camMatrix, const Mat &distCoeff,
+                                           float markerSizeMeters, bool setYPerpendicular) const {
     // sort by id
     std::sort(detectedMarkers.begin(), detectedMarkers.end());
      // there might be still the case that a marker is detected twice because of the double border indicated earlier,
     // detect and remove these cases
+    // the markers are sorted, so the repeated ones are consecutive. Only the one with largest perimeter is kept
     vector< bool > toRemove(detectedMarkers.size(), false);
 
-    for (int i = 0; i < int(detectedMarkers.size()) - 1; i++) {
-        for (int j = i+1; j < int(detectedMarkers.size()) && !toRemove[i] ; j++) {
-            if (detectedMarkers[i].id == detectedMarkers[j].id) {
-                // deletes the one with smaller perimeter
-                if (perimeter(detectedMarkers[i]) < perimeter(detectedMarkers[j]))
-                    toRemove[i  ] = true;
-                else
-                    toRemove[j  ] = true;
-
+    for (size_t first = 0; first < detectedMarkers.size(); ) {
+        size_t last = first + 1;
+        while (last < detectedMarkers.size() && detectedMarkers[last].id == detectedMarkers[first].id) last++;
+        if (last - first > 1) {
+            size_t best = first;
+            int bestPerimeter = perimeter(detectedMarkers[first]);
+            for (size_t j = first + 1; j < last; j++) {
+                int p = perimeter(detectedMarkers[j]);
+                if (p > bestPerimeter) { best = j; bestPerimeter = p; }
             }
+            for (size_t j = first; j < last; j++) toRemove[j] = (j != best);
         }
+        first = last;
     }
 
 
     // remove markers with corners too near the image limits
-    int borderDistThresX = _params._borderDistThres * float(input.cols);
-    int borderDistThresY = _params._borderDistThres * float(input.rows);
+    int borderDistThresX = _params._borderDistThres * float(imageSize.width);
+    int borderDistThresY = _params._borderDistThres * float(imageSize.height);
     for (size_t i = 0; i < detectedMarkers.size(); i++) {
         // delete if any of the corners is too near image border
         for (size_t c = 0; c < detectedMarkers[i].size(); c++) {
             if (detectedMarkers[i][c].x < borderDistThresX || detectedMarkers[i][c].y < borderDistThresY ||
-                detectedMarkers[i][c].x > input.cols - borderDistThresX || detectedMarkers[i][c].y > input.rows - borderDistThresY) {
+                detectedMarkers[i][c].x > imageSize.width - borderDistThresX || detectedMarkers[i][c].y > imageSize.height - borderDistThresY) {
                 toRemove[i] = true;
             }
         }
@@ -271,19 +789,89 @@ void MarkerDetector::detect(const cv::Mat &input, vector< Marker > &detectedMark
     removeElements(detectedMarkers, toRemove);
 
     /// detect the position of detected markers if desired
-    if (camMatrix.rows != 0 && markerSizeMeters > 0) {
-        for (unsigned int i = 0; i < detectedMarkers.size(); i++)
-            detectedMarkers[i].calculateExtrinsics(markerSizeMeters, camMatrix, distCoeff, setYPerpendicular);
+    if (camMatrix.rows != 0 && markerSizeMeters > 0 && !detectedMarkers.empty()) {
+        int n=detectedMarkers.size();
+        vector< IPPE::SquarePoses > poses;
+        if (_params._ippeErrorRatio>0){//all the poses at once, with the corners undistorted in a single call
+            vector< cv::Point2f > corners;
+            corners.reserve(4*n);
+            for(const auto &m:detectedMarkers) corners.insert(corners.end(),m.begin(),m.end());
+            poses.resize(n);
+            IPPE::solvePosesOfCentredSquares(markerSizeMeters,&corners[0],n,camMatrix,distCoeff,&poses[0]);
+        }
+#pragma omp parallel for schedule(dynamic) num_threads(nThreads())
+        for (int i = 0; i < n; i++){
+            if (poses.empty()){
+                detectedMarkers[i].calculateExtrinsics(markerSizeMeters, camMatrix, distCoeff, setYPerpendicular);
+                continue;
+            }
+            cv::Mat rv(3,1,CV_64F,poses[i].rvec[0]), tv(3,1,CV_64F,poses[i].tvec[0]);
+            //an ambiguous pose is refined from the best one
+            if (poses[i].reprojErr[1] < _params._ippeErrorRatio*poses[i].reprojErr[0])
+#if CV_VERSION_MAJOR >= 3
+                cv::solvePnP(Marker::get3DPoints(markerSizeMeters), detectedMarkers[i], camMatrix, distCoeff, rv, tv, true);
+#else //solvePnP from a guess does not work properly in OpenCV2
+                cv::solvePnP(Marker::get3DPoints(markerSizeMeters), detectedMarkers[i], camMatrix, distCoeff, rv, tv);
+#endif
+            detectedMarkers[i].setExtrinsics(markerSizeMeters, rv, tv, setYPerpendicular);
+        }
     }
+}
+
 
-//    cerr << "Threshold: " << 1000*(t2 - t1) / double(cv::getTickFrequency()) << endl;
-//    cerr << "Rectangles: " << 1000*(t3 - t2) / double(cv::getTickFrequency()) << endl;
-//    cerr << "Identify: " << 1000*(t4 - t3) / double(cv::getTickFrequency()) << endl;
-//    cerr << "Subpixel: " << 1000*(t5 - t4) / double(cv::getTickFrequency()) << endl;
-//    cerr << "Filtering: " << 1000*(t6 - t5) / double(cv::getTickFrequency()) << endl;
+//steps of the chain code of the candidate contours, and the code of each step indexed by (dy+1)*3+dx+1
+static const int chainDx[8]={1,1,0,-1,-1,-1,0,1};
+static const int chainDy[8]={0,-1,-1,-1,0,1,1,1};
+static const uchar chainCode[9]={3,2,1,4,255,0,5,6,7};
+
+bool MarkerDetector::MarkerCandidate::setContour(const vector< cv::Point > &contour){
+    contourChain.clear();
+    if (contour.size()<2) return false;
+    contourStart=contour[0];
+    contourChain.resize(contour.size()-1);
+    for(size_t i=1;i<contour.size();i++){
+        int dx=contour[i].x-contour[i-1].x, dy=contour[i].y-contour[i-1].y;
+        uchar code= std::abs(dx)<=1 && std::abs(dy)<=1 ? chainCode[(dy+1)*3+dx+1] : 255;
+        if (code==255){ contourChain.clear(); return false;}
+        contourChain[i-1]=code;
+    }
+    return true;
 }
 
+void MarkerDetector::MarkerCandidate::getContour(vector< cv::Point > &contour) const{
+    contour.resize(contourSize());
+    if (contour.empty()) return;
+    cv::Point p=contourStart;
+    contour[0]=p;
+    for(size_t i=0;i<contourChain.size();i++){
+        p.x+=chainDx[contourChain[i]];
+        p.y+=chainDy[contourChain[i]];
+        contour[i+1]=p;
+    }
+}
+
+void MarkerDetector::MarkerCandidate::setMetrics(float minSide){
+    metrics.area=getArea();
+    metrics.perimeter=getPerimeter();
+    metrics.minSide=minSide;
+    metrics.center=getCenter();
+}
 
+void MarkerDetector::MarkerCandidate::scale(float s){
+    for(auto &p:*this) p*=s;
+    metrics.area*=s*s;
+    metrics.perimeter*=s;
+    metrics.minSide*=s;
+    metrics.center*=s;
+    clearContour();
+}
+
+void MarkerDetector::MarkerCandidate::reverseContour(){
+    //the last point is the new start, and each step is walked backwards
+    for(auto c:contourChain){ contourStart.x+=chainDx[c]; contourStart.y+=chainDy[c];}
+    std::reverse(contourChain.begin(),contourChain.end());
+    for(auto &c:contourChain) c=(c+4)&7;
+}
 
 /************************************
  *
@@ -294,48 +882,78 @@ void MarkerDetector::detect(const cv::Mat &input, vector< Marker > &detectedMark
 void MarkerDetector::detectRectangles(const cv::Mat &thres, vector< std::vector< cv::Point2f > > &MarkerCanditates) {
     vector< MarkerCandidate > candidates;
     vector< cv::Mat > thres_v;
-    thres_v.push_back(thres);
-    detectRectangles(thres_v, candidates);
+    thres_v.push_back(thres.clone());//findContours modifies its input
+    _ws._candidateScale=1;
+    detectRectangles(_ws, vector< int >(1,0), &thres_v, candidates);
     // create the output
     MarkerCanditates.resize(candidates.size());
     for (size_t i = 0; i < MarkerCanditates.size(); i++)
         MarkerCanditates[i] = candidates[i];
 }
 
-void MarkerDetector::detectRectangles(vector< cv::Mat > &thresImgv, vector< MarkerCandidate > &OutMarkerCanditates) {
-            // omp_set_num_threads ( 1 );
-    vector< vector< MarkerCandidate > > MarkerCanditatesV(omp_get_max_threads());
+void MarkerDetector::detectRectangles(Workspace &w, const vector< int > &levels, vector< cv::Mat > *thresImgv, vector< MarkerCandidate > &OutMarkerCanditates) const {
+    int64 t=cv::getTickCount();
+    vector< int > &levelContours=w._lastStats.contoursPerLevel;
+    int maxLevel=*std::max_element(levels.begin(),levels.end());
+    if (int(levelContours.size())<=maxLevel) levelContours.resize(maxLevel+1,0);
+    w.MarkerCanditatesV.reset(nThreads());
+    if (int(w.thresBuffers.size())<nThreads()) w.thresBuffers.resize(nThreads());
+    cv::Size thresSize=thresImgv ? (*thresImgv)[levels[0]].size() : w._thresInput.size();
     // calcualte the min_max contour sizes
-    int maxSize =  _params._maxSize * std::max(thresImgv[0].cols, thresImgv[0].rows) * 4;
-    int minSize=  std::min ( float(_params._minSize_pix) , _params._minSize* std::max(thresImgv[0].cols, thresImgv[0].rows) * 4 );
+    int maxSize =  _params._maxSize * std::max(thresSize.width, thresSize.height) * 4;
+    //_minSize_pix is expressed in full resolution pixels, and the images may be a lower pyramid level
+    int minSize=  std::min ( float(_params._minSize_pix)/w._candidateScale , _params._minSize* std::max(thresSize.width, thresSize.height) * 4 );
+    //a side longer than the minimum distance between corners (see below) spans at least this in one axis
+    float minBoxSide = (10/w._candidateScale)/sqrt(2.);
 //#define _aruco_debug_detectrectangles
 #ifdef _aruco_debug_detectrectangles
          cv::Mat input;
-         cv::cvtColor ( thresImgv[0],input,CV_GRAY2BGR );
+         cv::cvtColor ( thresImgv ? (*thresImgv)[levels[0]] : w.thres,input,CV_GRAY2BGR );
 #endif
 
-#pragma omp parallel for
-    for (int img_idx = 0; img_idx < int(thresImgv.size()); img_idx++) {
+#pragma omp parallel for schedule(static) num_threads(nThreads())
+    for (int img_idx = 0; img_idx < int(levels.size()); img_idx++) {
         std::vector< cv::Vec4i > hierarchy2;
         std::vector< std::vector< cv::Point > > contours2;
-        cv::Mat thres2;
-        thresImgv[img_idx].copyTo(thres2);
-        cv::findContours(thres2, contours2, hierarchy2, CV_RETR_LIST, CV_CHAIN_APPROX_NONE);
+        //the threshold images are not needed afterwards, so the contours are extracted in place
+        cv::Mat &thresImg=thresImgv ? (*thresImgv)[levels[img_idx]] : w.thresBuffers[omp_get_thread_num()];
+        //the middle level was already computed by detect into w.thres
+        if (!thresImgv && levels[img_idx]==(2*_params._thresParam1_range+1)/2) w.thres.copyTo(thresImg);
+        else if (!thresImgv) thresholdLevel(w, levels[img_idx], thresImg);
+        TraceStage trace("contours",levels[img_idx]);
+        cv::findContours(thresImg, contours2, hierarchy2, CV_RETR_LIST, CV_CHAIN_APPROX_NONE);
+        levelContours[levels[img_idx]]+=contours2.size();
         vector< Point > approxCurve;
         /// for each contour, analyze if it is a paralelepiped likely to be the marker
         for (unsigned int i = 0; i < contours2.size(); i++) {
+            //the budget is checked every few contours, since textured images may give many thousands
+            if ((i&63)==63 && w.outOfTime()) break;
 
             // check it is a possible element by first checking is has enough points
             if (minSize < int(contours2[i].size()) && int(contours2[i].size()) < maxSize) {
-                // can approximate to a convex rect?
-                //specific method
-                //approxCurve=CheckRectContour::getConvexRect(contours2[i]);
-                //general one
-                // approximate to a poligon
-                 approxPolyDP(contours2[i], approxCurve, double(contours2[i].size()) * 0.05, true);
-
+                // cheap rejections before the polygon approximation: the bounding box must fit a side longer than
+                // the minimum distance, and the boundary of a convex region is not longer than the box perimeter,
+                // so much longer contours (textured regions) can not be markers
+                cv::Rect box=cv::boundingRect(contours2[i]);
+                if (std::max(box.width,box.height) < minBoxSide) continue;
+                if (int(contours2[i].size()) > 3*(box.width+box.height)) continue;
+                // can approximate to a convex rect? The specific method gives the contour index of each vertex
+                int quadIdx[4] = {-1, -1, -1, -1};
+                bool isQuad;
+                if (_params._fastQuadFit) {
+                    isQuad = CheckRectContour::fitQuad(contours2[i], float(contours2[i].size()) * 0.05f, quadIdx);
+                    if (isQuad) {
+                        approxCurve.resize(4);
+                        for (int j = 0; j < 4; j++) approxCurve[j] = contours2[i][quadIdx[j]];
+                    }
+                }
+                else {
+                    // approximate to a poligon
+                    approxPolyDP(contours2[i], approxCurve, double(contours2[i].size()) * 0.05, true);
+                    isQuad = approxCurve.size() == 4 && isContourConvex(approxCurve);
+                }
 
-                if (approxCurve.size() == 4 && isContourConvex(approxCurve))
+                if (isQuad)
                 {
 
 #ifdef _aruco_debug_detectrectangles
@@ -350,15 +968,28 @@ void MarkerDetector::detectRectangles(vector< cv::Mat > &thresImgv, vector< Mark
                         if (d < minDist) minDist = d;
                     }
                     // check that distance is not very small
-                    if (minDist > 10) {
+                    if (minDist > 10/w._candidateScale) {
                         // add the points
                         // 	      cout<<"ADDED"<<endl;
-                        MarkerCanditatesV[omp_get_thread_num()].push_back(MarkerCandidate());
-                        MarkerCanditatesV[omp_get_thread_num()].back().idx = i;
-                        if (_params._cornerMethod==LINES)//save all contour points if you need lines refinement method
-                            MarkerCanditatesV[omp_get_thread_num()].back().contour = contours2[i];
+                        w.MarkerCanditatesV[omp_get_thread_num()].push_back(MarkerCandidate());
+                        w.MarkerCanditatesV[omp_get_thread_num()].back().idx = i;
+                        if (_params._cornerMethod==LINES || _params._cylinderWarp){//save all contour points if you need lines refinement or cylinder warping
+                            MarkerCandidate &cand=w.MarkerCanditatesV[omp_get_thread_num()].back();
+                            const vector< cv::Point > &contour=contours2[i];
+                            cand.setContour(contour);
+                            // the vertices follow the contour, so each one is searched from the previous one,
+                            // unless the quad fit gave them
+                            int n=contour.size(), c=0;
+                            for (int j = 0; j < 4; j++) {
+                                if (quadIdx[j] >= 0) { cand.cornerIdx[j] = quadIdx[j]; continue; }
+                                int steps=0;
+                                while (steps < n && contour[c] != approxCurve[j]) { c=(c+1)%n; steps++; }
+                                cand.cornerIdx[j] = steps < n ? c : -1;
+                            }
+                        }
                         for (int j = 0; j < 4; j++)
-                            MarkerCanditatesV[omp_get_thread_num()].back().push_back(Point2f(approxCurve[j].x, approxCurve[j].y));
+                            w.MarkerCanditatesV[omp_get_thread_num()].back().push_back(Point2f(approxCurve[j].x, approxCurve[j].y));
+                        w.MarkerCanditatesV[omp_get_thread_num()].back().setMetrics(minDist);
                     }
                 }
             }
@@ -368,11 +999,7 @@ void MarkerDetector::detectRectangles(vector< cv::Mat > &thresImgv, vector< Mark
 
     // join all candidates
     vector< MarkerCandidate > MarkerCanditates;
-
-    for (size_t i = 0; i < MarkerCanditatesV.size(); i++)
-        for (size_t j = 0; j < MarkerCanditatesV[i].size(); j++) {
-            MarkerCanditates.push_back(MarkerCanditatesV[i][j]);
-        }
+    w.MarkerCanditatesV.join(MarkerCanditates, false, nThreads());
 
     /// sort the points in anti-clockwise order
     valarray< bool > swapped(false, MarkerCanditates.size()); // used later
@@ -388,38 +1015,46 @@ void MarkerDetector::detectRectangles(vector< cv::Mat > &thresImgv, vector< Mark
 
         if (o < 0.0) { // if the third point is in the left side, then sort in anti-clockwise order
             swap(MarkerCanditates[i][1], MarkerCanditates[i][3]);
+            swap(MarkerCanditates[i].cornerIdx[1], MarkerCanditates[i].cornerIdx[3]);
             swapped[i] = true;
             // sort the contour points
             //  	    reverse(MarkerCanditates[i].contour.begin(),MarkerCanditates[i].contour.end());//????
         }
     }
     /// remove these elements which corners are too close to each other
-    // first detect candidates to be removed
-    vector< vector< pair< int, int > > > TooNearCandidates_omp(omp_get_max_threads());
-#pragma omp parallel for
+    // The candidates are hashed in a grid of cells of nearDist size by their first corner, so each one is compared
+    // only with the candidates of its cell and the adjacent ones, instead of with all of them
+    float nearDist=6/w._candidateScale;
+    float nearDist2=nearDist*nearDist;
+    auto cellKey=[](int cx,int cy){return (int64_t(cx)<<32)^int64_t(uint32_t(cy));};
+    std::unordered_map< int64_t, vector< int > > grid;
+    grid.reserve(MarkerCanditates.size());
+    for (unsigned int i = 0; i < MarkerCanditates.size(); i++)
+        grid[cellKey(int(floor(MarkerCanditates[i][0].x/nearDist)),int(floor(MarkerCanditates[i][0].y/nearDist)))].push_back(i);
+    vector< pair< int, int > > TooNearCandidates;
     for (unsigned int i = 0; i < MarkerCanditates.size(); i++) {
-        // calculate the average distance of each corner to the nearest corner of the other marker candidate
-        for (unsigned int j = i + 1; j < MarkerCanditates.size(); j++) {
-            valarray< float > vdist(4);
-            for (int c = 0; c < 4; c++)
-                vdist[c] = sqrt((MarkerCanditates[i][c].x - MarkerCanditates[j][c].x) * (MarkerCanditates[i][c].x - MarkerCanditates[j][c].x) +
-                                (MarkerCanditates[i][c].y - MarkerCanditates[j][c].y) * (MarkerCanditates[i][c].y - MarkerCanditates[j][c].y));
-            //                 dist/=4;
-            // if distance is too small
-            if (vdist[0] < 6 && vdist[1] < 6 && vdist[2] < 6 && vdist[3] < 6) {
-                TooNearCandidates_omp[omp_get_thread_num()].push_back(pair< int, int >(i, j));
+        int cx=int(floor(MarkerCanditates[i][0].x/nearDist)),cy=int(floor(MarkerCanditates[i][0].y/nearDist));
+        for(int dy=-1;dy<=1;dy++)
+            for(int dx=-1;dx<=1;dx++){
+                auto cell=grid.find(cellKey(cx+dx,cy+dy));
+                if (cell==grid.end()) continue;
+                for(int j:cell->second){
+                    if (j<=int(i)) continue;
+                    // if the distance of every corner is too small
+                    bool near=true;
+                    for (int c = 0; c < 4 && near; c++){
+                        float ddx=MarkerCanditates[i][c].x - MarkerCanditates[j][c].x, ddy=MarkerCanditates[i][c].y - MarkerCanditates[j][c].y;
+                        near= ddx*ddx+ddy*ddy < nearDist2;
+                    }
+                    if (near) TooNearCandidates.push_back(pair< int, int >(i, j));
+                }
             }
-        }
     }
 
-
-    // join
-    vector< pair< int, int > > TooNearCandidates;
-    joinVectors(TooNearCandidates_omp, TooNearCandidates);
     // mark for removal the element of  the pair with smaller perimeter
     valarray< bool > toRemove(false, MarkerCanditates.size());
     for (unsigned int i = 0; i < TooNearCandidates.size(); i++) {
-        if (perimeter(MarkerCanditates[TooNearCandidates[i].first]) > perimeter(MarkerCanditates[TooNearCandidates[i].second]))
+        if (MarkerCanditates[TooNearCandidates[i].first].metrics.perimeter > MarkerCanditates[TooNearCandidates[i].second].metrics.perimeter)
             toRemove[TooNearCandidates[i].second] = true;
         else
             toRemove[TooNearCandidates[i].first] = true;
@@ -430,12 +1065,16 @@ void MarkerDetector::detectRectangles(vector< cv::Mat > &thresImgv, vector< Mark
     OutMarkerCanditates.reserve(MarkerCanditates.size());
     for (size_t i = 0; i < MarkerCanditates.size(); i++) {
         if (!toRemove[i]) {
-            OutMarkerCanditates.push_back(MarkerCanditates[i]);
-            //                 OutMarkerCanditates.back().contour=contours2[ MarkerCanditates[i].idx];
-            if (swapped[i] && OutMarkerCanditates.back().contour.size()>1) // if the corners where swapped, it is required to reverse here the points so that they are in the same order
-                reverse(OutMarkerCanditates.back().contour.begin(), OutMarkerCanditates.back().contour.end()); //????
+            OutMarkerCanditates.push_back(std::move(MarkerCanditates[i]));
+            if (swapped[i] && OutMarkerCanditates.back().contourSize()>1) {// if the corners where swapped, it is required to reverse here the points so that they are in the same order
+                MarkerCandidate &cand=OutMarkerCanditates.back();
+                cand.reverseContour();
+                for (int k = 0; k < 4; k++)
+                    if (cand.cornerIdx[k] >= 0) cand.cornerIdx[k] = int(cand.contourSize()) - 1 - cand.cornerIdx[k];
+            }
         }
     }
+    w._lastStats.rectanglesTime+=elapsedMs(t);
 
 #ifdef _aruco_debug_detectrectangles
 
@@ -450,53 +1089,81 @@ void MarkerDetector::detectRectangles(vector< cv::Mat > &thresImgv, vector< Mark
 
 /************************************
  *
- *
- * attempt to beat adaptiveThreshold by precomputing the integral image for all the possibilities
- * I did not make it yet
+ * Adaptive threshold of several window sizes at once. A single integral image of the
+ * (border replicated) image is shared by all the thresholded images, so each one costs a
+ * few additions per pixel, whatever its window size
  *
  ************************************/
 
+//one row of a threshold image of adpt_threshold_multi: y1 and y2 are the integral rows above and below the windows of
+//the row, shifted to the first window, and out=255 when the window sum is at least (grey+C)*area
+ARUCO_DISPATCH static void integralThresholdRow(const unsigned *y1, const unsigned *y2, const uchar *in, uchar *out,
+                                                int cols, int wsize, int C, int area) {
+    for (int x = 0; x < cols; x++) {
+        unsigned sum = y2[x + wsize] - y2[x] - y1[x + wsize] + y1[x];
+        out[x] = (int(sum) >= (int(in[x]) + C) * area) ? 255 : 0;
+    }
+}
+
 void  MarkerDetector::adpt_threshold_multi( const Mat &grey, std::vector<Mat> &outThresImages,double param1  ,double param1_range , double param2,double param2_range ){
+    adpt_threshold_multi(_ws, grey, outThresImages, param1, param1_range, param2, param2_range);
+}
+
+void MarkerDetector::adpt_threshold_multi(Workspace &w, const Mat &grey, std::vector<Mat> &outThresImages, double param1, double param1_range,
+                                          double param2, double param2_range) const {
 
-//    param2_range=2;
+    if (grey.type() != CV_8UC1)
+        throw cv::Exception(9001, "grey.type()!=CV_8UC1", "MarkerDetector::adpt_threshold_multi", __FILE__, __LINE__);
     int start_p1 = std::max(3.,param1-2*param1_range);
     int end_p1 = param1+2*param1_range;
-    int start_p2 = std::max(3.,param2-2*param2_range);
+    int start_p2 = param2-2*param2_range;
     int end_p2 = param2+2*param2_range;
     vector<std::pair<int,int> > p1_2_values;
     for(int i=start_p1;i<=end_p1;i+=2)
         for(int j=start_p2;j<=end_p2;j+=2)
             p1_2_values.push_back(std::pair<int,int>(i,j));
     outThresImages.resize(p1_2_values.size());
-
-    cv::Mat intimg;
-    cv::integral(grey,intimg);
+    prepareIntegral(w, grey, end_p1);
     //now, run in parallel creating the thresholded images
-#pragma omp parallel for
-    for(int i=0;i<int(p1_2_values.size());i++){
-      //  cout<<p1_2_values[i].first<<" "<<p1_2_values[i].second<<endl;
-        //now, for each image, apply the
-        float inv_area=1./(p1_2_values[i].first*p1_2_values[i].first);
-        int wsize_2=p1_2_values[i].first/2;
-        outThresImages[i].create(grey.size(),grey.type() );
-        //start moving accross the image
-        for(int y=wsize_2;y<grey.rows-wsize_2;y++){
-            int *_y1=intimg.ptr<int>(y-wsize_2);
-            int *_y2=intimg.ptr<int>(y+wsize_2+1);
-            uchar *out=      outThresImages[i].ptr<uchar>(y);
-            for(int x=wsize_2;x<grey.cols-wsize_2;x++){
-                int x2=x+wsize_2+1;
-                int x1=x-wsize_2;
-               // int sum=intimg.at<int>(y2,x2)-intimg.at<int>(y2,x1)-intimg.at<int>(y1,x2)+intimg.at<int>(y1,x1);
-                float mean=float( _y2[x2]-_y2[x1]-_y1[x2]+_y1[x1])* inv_area ;
-                if ( mean- grey.at<uchar>(y,x)>p1_2_values[i].second)
-                    out[x]=255;
-                else
-                    out[x]=0;
-            }
-        }
+#pragma omp parallel for num_threads(nThreads())
+    for(int i=0;i<int(p1_2_values.size());i++)
+        integralThreshold(w, grey, outThresImages[i], p1_2_values[i].first, p1_2_values[i].second);
+}
+
+//integral image of grey, with a border for windows of up to maxWindow pixels
+void MarkerDetector::prepareIntegral(Workspace &w, const Mat &grey, int maxWindow) const{
+    //border as in cv::adaptiveThreshold, so that every window is inside the integral image
+    w._integralBorderSize=maxWindow/2;
+    int border=w._integralBorderSize;
+    cv::copyMakeBorder(grey,w.integralBorder,border,border,border,border,cv::BORDER_REPLICATE);
+    //sums may exceed the int range in big images, but differences of sums do not. Operating in unsigned arithmetic
+    //makes the wrapping harmless
+    cv::integral(w.integralBorder,w.integralImage,CV_32S);
+}
+
+//adaptive threshold of grey with a window size and constant, from the integral image of prepareIntegral
+void MarkerDetector::integralThreshold(const Workspace &w, const Mat &grey, Mat &out, int wsize, int C) const{
+    int border=w._integralBorderSize;
+    //even window sizes are rounded up, as in thresHold()
+    int wsize_2=wsize/2;
+    int area=(2*wsize_2+1)*(2*wsize_2+1);
+    //out=255 when mean-grey>=C, that is, when sum>=(grey+C)*area
+    out.create(grey.size(),grey.type() );
+    //start moving accross the image
+    for(int y=0;y<grey.rows;y++){
+        const unsigned *_y1=w.integralImage.ptr<unsigned>(y+border-wsize_2)+border-wsize_2;
+        const unsigned *_y2=w.integralImage.ptr<unsigned>(y+border+wsize_2+1)+border-wsize_2;
+        integralThresholdRow(_y1,_y2,grey.ptr<uchar>(y),out.ptr<uchar>(y),grey.cols,2*wsize_2+1,C,area);
     }
+}
 
+//threshold image of a level of the current detection (see detect)
+void MarkerDetector::thresholdLevel(Workspace &w, int level, Mat &out) const{
+    TraceStage trace("threshold",level);
+    if (_params._thresMethod == ADPT_THRES_INTEGRAL)
+        integralThreshold(w, w._thresInput, out, w._thresValues[level], _params._thresParam2);
+    else
+        thresHold(w, _params._thresMethod, w._thresInput, out, w._thresValues[level], _params._thresParam2);
 }
 
 /************************************
@@ -506,6 +1173,10 @@ void  MarkerDetector::adpt_threshold_multi( const Mat &grey, std::vector<Mat> &o
  *
  ************************************/
 void MarkerDetector::thresHold(int method, const Mat &grey, Mat &out, double param1, double param2) throw(cv::Exception) {
+    thresHold(_ws, method, grey, out, param1, param2);
+}
+
+void MarkerDetector::thresHold(Workspace &w, int method, const Mat &grey, Mat &out, double param1, double param2) const {
 
     if (param1 == -1)
         param1 = _params._thresParam1;
@@ -527,6 +1198,12 @@ void MarkerDetector::thresHold(int method, const Mat &grey, Mat &out, double par
 
         cv::adaptiveThreshold(grey, out, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, param1, param2);
         break;
+    case ADPT_THRES_INTEGRAL: {
+        vector< cv::Mat > outv(1);
+        outv[0]=out;
+        adpt_threshold_multi(w, grey, outv, param1, 0, param2, 0);
+        out=outv[0];
+    } break;
     case CANNY: {
         // this should be the best method, and generally it is.
         // However, some times there are small holes in the marker contour that makes
@@ -547,7 +1224,7 @@ void MarkerDetector::thresHold(int method, const Mat &grey, Mat &out, double par
  *
  *
  ************************************/
-bool MarkerDetector::warp(Mat &in, Mat &out, Size size, vector< Point2f > points) throw(cv::Exception) {
+bool MarkerDetector::warp(Mat &in, Mat &out, Size size, vector< Point2f > points) const throw(cv::Exception) {
 
     if (points.size() != 4)
         throw cv::Exception(9001, "point.size()!=4", "MarkerDetector::warp", __FILE__, __LINE__);
@@ -559,258 +1236,47 @@ bool MarkerDetector::warp(Mat &in, Mat &out, Size size, vector< Point2f > points
     pointsRes[1] = Point2f(size.width - 1, 0);
     pointsRes[2] = Point2f(size.width - 1, size.height - 1);
     pointsRes[3] = Point2f(0, size.height - 1);
-    Mat M = getPerspectiveTransform(pointsIn, pointsRes);
-    cv::warpPerspective(in, out, M, size, cv::INTER_NEAREST);
+    if (in.type() != CV_8UC1) {
+        Mat M = getPerspectiveTransform(pointsIn, pointsRes);
+        cv::warpPerspective(in, out, M, size, cv::INTER_NEAREST);
+        return true;
+    }
+    // gray images (always the case in detect) are sampled directly. If out is already allocated with
+    // this size, as the patches of identifyCandidates, nothing is allocated
+    out.create(size, CV_8UC1);
+    warpNearest(in, out, getPerspectiveTransform(pointsRes, pointsIn));
     return true;
 }
 
-void findCornerPointsInContour(const vector< cv::Point2f > &points, const vector< cv::Point > &contour, vector< int > &idxs) {
-    assert(points.size() == 4);
-    int idxSegments[4] = {-1, -1, -1, -1};
-    // the first point coincides with one
-    cv::Point points2i[4];
-    for (int i = 0; i < 4; i++) {
-        points2i[i].x = points[i].x;
-        points2i[i].y = points[i].y;
-    }
-
-    for (size_t i = 0; i < contour.size(); i++) {
-        if (idxSegments[0] == -1)
-            if (contour[i] == points2i[0])
-                idxSegments[0] = i;
-        if (idxSegments[1] == -1)
-            if (contour[i] == points2i[1])
-                idxSegments[1] = i;
-        if (idxSegments[2] == -1)
-            if (contour[i] == points2i[2])
-                idxSegments[2] = i;
-        if (idxSegments[3] == -1)
-            if (contour[i] == points2i[3])
-                idxSegments[3] = i;
-    }
-    idxs.resize(4);
-    for (int i = 0; i < 4; i++)
-        idxs[i] = idxSegments[i];
-}
-
-int findDeformedSidesIdx(const vector< cv::Point > &contour, const vector< int > &idxSegments) {
-    float distSum[4] = {0, 0, 0, 0};
-    //cv::Scalar colors[4] = {cv::Scalar(0, 0, 255), cv::Scalar(255, 0, 0), cv::Scalar(0, 255, 0), cv::Scalar(111, 111, 0)};
-
-    for (int i = 0; i < 3; i++) {
-        cv::Point p1 = contour[idxSegments[i]];
-        cv::Point p2 = contour[idxSegments[i + 1]];
-        float inv_den = 1. / sqrt(float((p2.x - p1.x) * (p2.x - p1.x) + (p2.y - p1.y) * (p2.y - p1.y)));
-        //   d=|v^^·r|=(|(x_2-x_1)(y_1-y_0)-(x_1-x_0)(y_2-y_1)|)/(sqrt((x_2-x_1)^2+(y_2-y_1)^2)).
-        //         cerr<<"POSS="<<idxSegments[i]<<" "<<idxSegments[i+1]<<endl;
-        for (int j = idxSegments[i]; j < idxSegments[i + 1]; j++) {
-            float dist = std::fabs(float((p2.x - p1.x) * (p1.y - contour[j].y) - (p1.x - contour[j].x) * (p2.y - p1.y))) * inv_den;
-            distSum[i] += dist;
-            //             cerr<< dist<<" ";
-            //             cv::rectangle(_ssImC,contour[j],contour[j],colors[i],-1);
-        }
-        distSum[i] /= float(idxSegments[i + 1] - idxSegments[i]);
-        //         cout<<endl<<endl;
-    }
-
-
-    // for the last one
-    cv::Point p1 = contour[idxSegments[0]];
-    cv::Point p2 = contour[idxSegments[3]];
-    float inv_den = 1. / std::sqrt(float((p2.x - p1.x) * (p2.x - p1.x) + (p2.y - p1.y) * (p2.y - p1.y)));
-    //   d=|v^^·r|=(|(x_2-x_1)(y_1-y_0)-(x_1-x_0)(y_2-y_1)|)/(sqrt((x_2-x_1)^2+(y_2-y_1)^2)).
-    for (int j = 0; j < idxSegments[0]; j++)
-        distSum[3] += std::fabs(float((p2.x - p1.x) * (p1.y - contour[j].y) - (p1.x - contour[j].x) * (p2.y - p1.y))) * inv_den;
-    for (size_t j = size_t(idxSegments[3]); j < contour.size(); j++)
-        distSum[3] += std::fabs(float((p2.x - p1.x) * (p1.y - contour[j].y) - (p1.x - contour[j].x) * (p2.y - p1.y))) * inv_den;
-
-    distSum[3] /= float(idxSegments[0] + (contour.size() - idxSegments[3]));
-    // now, get the maximum
-    /*    for (int i=0;i<4;i++)
-            cout<<"DD="<<distSum[i]<<endl;*/
-    // check the two combinations to see the one with higher error
-    if (distSum[0] + distSum[2] > distSum[1] + distSum[3])
-        return 0;
-    else
-        return 1;
-}
-
-void setPointIntoImage(cv::Point2f &p, cv::Size s) {
-    if (p.x < 0)
-        p.x = 0;
-    else if (p.x >= s.width)
-        p.x = s.width - 1;
-    if (p.y < 0)
-        p.y = 0;
-    else if (p.y >= s.height)
-        p.y = s.height - 1;
-}
-
-void setPointIntoImage(cv::Point &p, cv::Size s) {
-    if (p.x < 0)
-        p.x = 0;
-    else if (p.x >= s.width)
-        p.x = s.width - 1;
-    if (p.y < 0)
-        p.y = 0;
-    else if (p.y >= s.height)
-        p.y = s.height - 1;
-}
 /************************************
  *
- *
- *
+ * Nearest neighbour perspective warp of a gray image, with the rounding and black border of
+ * cv::warpPerspective(INTER_NEAREST). Minv maps the pixels of out to the input image
  *
  ************************************/
-bool MarkerDetector::warp_cylinder(Mat &in, Mat &out, Size size, MarkerCandidate &mcand) throw(cv::Exception) {
-
-    if (mcand.size() != 4)
-        throw cv::Exception(9001, "point.size()!=4", "MarkerDetector::warp", __FILE__, __LINE__);
-
-    // check first the real need for cylinder warping
-    //     cout<<"im="<<mcand.contour.size()<<endl;
-
-    //     for (size_t i=0;i<mcand.contour.size();i++) {
-    //         cv::rectangle(_ssImC ,mcand.contour[i],mcand.contour[i],cv::Scalar(111,111,111),-1 );
-    //     }
-    //     mcand.draw(imC,cv::Scalar(0,255,0));
-    // find the 4 different segments of the contour
-    vector< int > idxSegments;
-    findCornerPointsInContour(mcand, mcand.contour, idxSegments);
-    // let us rearrange the points so that the first corner is the one whith smaller idx
-    int minIdx = 0;
-    for (int i = 1; i < 4; i++)
-        if (idxSegments[i] < idxSegments[minIdx])
-            minIdx = i;
-    // now, rotate the points to be in this order
-    std::rotate(idxSegments.begin(), idxSegments.begin() + minIdx, idxSegments.end());
-    std::rotate(mcand.begin(), mcand.begin() + minIdx, mcand.end());
-
-    //     cout<<"idxSegments="<<idxSegments[0]<< " "<<idxSegments[1]<< " "<<idxSegments[2]<<" "<<idxSegments[3]<<endl;
-    // now, determine the sides that are deformated by cylinder perspective
-    int defrmdSide = findDeformedSidesIdx(mcand.contour, idxSegments);
-    //     cout<<"Def="<<defrmdSide<<endl;
-
-    // instead of removing perspective distortion  of the rectangular region
-    // given by the rectangle, we enlarge it a bit to include the deformed parts
-    //cv::Point2f center = mcand.getCenter();
-    Point2f enlargedRegion[4];
-    for (int i = 0; i < 4; i++)
-        enlargedRegion[i] = mcand[i];
-    if (defrmdSide == 0) {
-        enlargedRegion[0] = mcand[0] + (mcand[3] - mcand[0]) * 1.2;
-        enlargedRegion[1] = mcand[1] + (mcand[2] - mcand[1]) * 1.2;
-        enlargedRegion[2] = mcand[2] + (mcand[1] - mcand[2]) * 1.2;
-        enlargedRegion[3] = mcand[3] + (mcand[0] - mcand[3]) * 1.2;
-    } else {
-        enlargedRegion[0] = mcand[0] + (mcand[1] - mcand[0]) * 1.2;
-        enlargedRegion[1] = mcand[1] + (mcand[0] - mcand[1]) * 1.2;
-        enlargedRegion[2] = mcand[2] + (mcand[3] - mcand[2]) * 1.2;
-        enlargedRegion[3] = mcand[3] + (mcand[2] - mcand[3]) * 1.2;
-    }
-    for (size_t i = 0; i < 4; i++)
-        setPointIntoImage(enlargedRegion[i], in.size());
-
-    /*
-        cv::Scalar colors[4]={cv::Scalar(0,0,255),cv::Scalar(255,0,0),cv::Scalar(0,255,0),cv::Scalar(111,111,0)};
-        for (int i=0;i<4;i++) {
-            cv::rectangle(_ssImC,mcand.contour[idxSegments[i]]-cv::Point(2,2),mcand.contour[idxSegments[i]]+cv::Point(2,2),colors[i],-1 );
-            cv::rectangle(_ssImC,enlargedRegion[i]-cv::Point2f(2,2),enlargedRegion[i]+cv::Point2f(2,2),colors[i],-1 );
-
-        }*/
-    //     cv::imshow("imC",_ssImC);
-
-
-    // calculate the max distance from each contour point the line of the corresponding segment it belongs to
-    //     calculate
-    //      cv::waitKey(0);
-    // check that the region is into image limits
-    // obtain the perspective transform
-    Point2f pointsRes[4], pointsIn[4];
-    for (int i = 0; i < 4; i++)
-        pointsIn[i] = mcand[i];
-
-    cv::Size enlargedSize = size;
-    enlargedSize.width += 2 * enlargedSize.width * 0.2;
-    pointsRes[0] = (Point2f(0, 0));
-    pointsRes[1] = Point2f(enlargedSize.width - 1, 0);
-    pointsRes[2] = Point2f(enlargedSize.width - 1, enlargedSize.height - 1);
-    pointsRes[3] = Point2f(0, enlargedSize.height - 1);
-    // rotate to ensure that deformed sides are in the horizontal axis when warping
-    if (defrmdSide == 0)
-        rotate(pointsRes, pointsRes + 1, pointsRes + 4);
-    cv::Mat imAux, imAux2(enlargedSize, CV_8UC1);
-    Mat M = cv::getPerspectiveTransform(enlargedRegion, pointsRes);
-    cv::warpPerspective(in, imAux, M, enlargedSize, cv::INTER_NEAREST);
-
-    // now, transform all points to the new image
-    vector< cv::Point > pointsCO(mcand.contour.size());
-    assert(M.type() == CV_64F);
-    assert(M.cols == 3 && M.rows == 3);
-    //     cout<<M<<endl;
-    double *mptr = M.ptr< double >(0);
-    imAux2.setTo(cv::Scalar::all(0));
-
-
-    for (size_t i = 0; i < mcand.contour.size(); i++) {
-        float inX = mcand.contour[i].x;
-        float inY = mcand.contour[i].y;
-        float w = inX * mptr[6] + inY * mptr[7] + mptr[8];
-        cv::Point2f pres;
-        pointsCO[i].x = ((inX * mptr[0] + inY * mptr[1] + mptr[2]) / w) + 0.5;
-        pointsCO[i].y = ((inX * mptr[3] + inY * mptr[4] + mptr[5]) / w) + 0.5;
-        // make integers
-        setPointIntoImage(pointsCO[i], imAux.size()); // ensure points are into image limits
-        // 	cout<<"p="<<pointsCO[i]<<" "<<imAux.size().width<<" "<<imAux.size().height<<endl;
-        imAux2.at< uchar >(pointsCO[i].y, pointsCO[i].x) = 255;
-        if (pointsCO[i].y > 0)
-            imAux2.at< uchar >(pointsCO[i].y - 1, pointsCO[i].x) = 255;
-        if (pointsCO[i].y < imAux2.rows - 1)
-            imAux2.at< uchar >(pointsCO[i].y + 1, pointsCO[i].x) = 255;
-    }
-
-    cv::Mat outIm(enlargedSize, CV_8UC1);
-    outIm.setTo(cv::Scalar::all(0));
-    // now, scan in lines to determine the required displacement
-    for (int y = 0; y < imAux2.rows; y++) {
-        uchar *_offInfo = imAux2.ptr< uchar >(y);
-        int start = -1, end = -1;
-        // determine the start and end of markerd regions
-        for (int x = 0; x < imAux.cols; x++) {
-            if (_offInfo[x]) {
-                if (start == -1)
-                    start = x;
-                else
-                    end = x;
-            }
+void MarkerDetector::warpNearest(const Mat &in, Mat &out, const Mat &Minv) {
+    const double *h = Minv.ptr< double >();
+    const uchar *src = in.ptr< uchar >();
+    size_t step = in.step;
+    for (int y = 0; y < out.rows; y++) {
+        double X0 = h[1] * y + h[2], Y0 = h[4] * y + h[5], W0 = h[7] * y + h[8];
+        uchar *o = out.ptr< uchar >(y);
+        for (int x = 0; x < out.cols; x++) {
+            double W = W0 + h[6] * x;
+            W = W ? 1. / W : 0;
+            int X = cvRound((X0 + h[0] * x) * W), Y = cvRound((Y0 + h[3] * x) * W);
+            o[x] = (unsigned(X) < unsigned(in.cols) && unsigned(Y) < unsigned(in.rows)) ? src[Y * step + X] : 0;
         }
-        //       cout<<"S="<<start<<" "<<end<<" "<<end-start<<" "<<(size.width>>1)<<endl;
-        // check that the size is big enough and
-        assert(start != -1 && end != -1 && (end - start) > size.width >> 1);
-        uchar *In_image = imAux.ptr< uchar >(y);
-        uchar *Out_image = outIm.ptr< uchar >(y);
-        memcpy(Out_image, In_image + start, imAux.cols - start);
     }
-
-
-    //     cout<<"SS="<<mcand.contour.size()<<" "<<pointsCO.size()<<endl;
-    // get the central region with the size specified
-    cv::Mat centerReg = outIm(cv::Range::all(), cv::Range(0, size.width));
-    out = centerReg.clone();
-    //     cv::perspectiveTransform(mcand.contour,pointsCO,M);
-    // draw them
-    //     cv::imshow("out2",out);
-    //     cv::imshow("imm",imAux2);
-    //     cv::waitKey(0);
-    return true;
 }
+
 /************************************
  *
  *
  *
  *
  ************************************/
-bool MarkerDetector::isInto(Mat &contour, vector< Point2f > &b) {
+bool MarkerDetector::isInto(Mat &contour, vector< Point2f > &b) const {
 
     for (unsigned int i = 0; i < b.size(); i++)
         if (pointPolygonTest(contour, b[i], false) > 0)
@@ -823,7 +1289,7 @@ bool MarkerDetector::isInto(Mat &contour, vector< Point2f > &b) {
  *
  *
  ************************************/
-int MarkerDetector::perimeter(vector< Point2f > &a) {
+int MarkerDetector::perimeter(const vector< Point2f > &a) const {
     int sum = 0;
     for (unsigned int i = 0; i < a.size(); i++) {
         int i2 = (i + 1) % a.size();
@@ -841,12 +1307,26 @@ int MarkerDetector::perimeter(vector< Point2f > &a) {
  *
  */
 void MarkerDetector::refineCandidateLines(MarkerDetector::MarkerCandidate &candidate, const cv::Mat &camMatrix, const cv::Mat &distCoeff) {
-    // search corners on the contour vector
-    vector< int > cornerIndex(4,-1);
-    for (unsigned int j = 0; j < candidate.contour.size(); j++) {
-        for (unsigned int k = 0; k < 4; k++) {
-            if (candidate.contour[j].x == candidate[k].x && candidate.contour[j].y == candidate[k].y) {
-                cornerIndex[k] = j;
+    refineCandidateLines(_ws, candidate, camMatrix, distCoeff);
+}
+
+void MarkerDetector::refineCandidateLines(Workspace &w, MarkerCandidate &candidate, const cv::Mat &camMatrix, const cv::Mat &distCoeff) const {
+    // corner indices on the contour vector, found by detectRectangles. They are searched if unknown
+    vector< cv::Point > contour;
+    candidate.getContour(contour);
+    int n = contour.size();
+    vector< int > cornerIndex(candidate.cornerIdx, candidate.cornerIdx + 4);
+    bool known = true;
+    for (unsigned int k = 0; k < 4 && known; k++)
+        known = cornerIndex[k] >= 0 && cornerIndex[k] < n && contour[cornerIndex[k]].x == candidate[k].x &&
+                contour[cornerIndex[k]].y == candidate[k].y;
+    if (!known) {
+        cornerIndex.assign(4, -1);
+        for (int j = 0; j < n; j++) {
+            for (unsigned int k = 0; k < 4; k++) {
+                if (contour[j].x == candidate[k].x && contour[j].y == candidate[k].y) {
+                    cornerIndex[k] = j;
+                }
             }
         }
     }
@@ -860,41 +1340,33 @@ void MarkerDetector::refineCandidateLines(MarkerDetector::MarkerCandidate &candi
     else
         inverse = true;
 
-
-    // get pixel vector for each line of the marker
-    int inc = 1;
-    if (inverse)
-        inc = -1;
-
-    // undistort contour
-    vector< Point2f > contour2f;
-    if(!camMatrix.empty() && !distCoeff.empty()){
-    for (unsigned int i = 0; i < candidate.contour.size(); i++)
-        contour2f.push_back(cv::Point2f(candidate.contour[i].x, candidate.contour[i].y));
-    if (!camMatrix.empty() && !distCoeff.empty())
-        cv::undistortPoints(contour2f, contour2f, camMatrix, distCoeff, cv::Mat(), camMatrix);
-
-    }
-    else {
-        contour2f.reserve(candidate.contour.size());
-        for(auto p:candidate.contour)
-            contour2f.push_back(cv::Point2f(p.x,p.y));
-    }
-
-    vector< std::vector< cv::Point2f > > contourLines;
-    contourLines.resize(4);
+    // get pixel vector for each line of the marker. Long sides are decimated to at most maxLineSamples points,
+    // which fit the line as well, so only these are undistorted
+    const int maxLineSamples = 64;
+    int inc = inverse ? -1 : 1;
+    vector< std::vector< cv::Point2f > > contourLines(4);
     for (unsigned int l = 0; l < 4; l++) {
-        for (int j = (int)cornerIndex[l]; j != (int)cornerIndex[(l + 1) % 4]; j += inc) {
-            if (j == (int)candidate.contour.size() && !inverse)
-                j = 0;
-            else if (j == 0 && inverse)
-                j = candidate.contour.size() - 1;
-            contourLines[l].push_back(contour2f[j]);
-            if (j == (int)cornerIndex[(l + 1) % 4])
-                break; // this has to be added because of the previous ifs
+        int from = cornerIndex[l], to = cornerIndex[(l + 1) % 4];
+        int len = ((to - from) * inc + n) % n + 1; // pixels of the side, both corners included
+        int step = std::max(1, (len + maxLineSamples - 1) / maxLineSamples);
+        contourLines[l].reserve(len / step + 2);
+        for (int s = 0; s < len; s += step) {
+            const cv::Point &p = contour[((from + s * inc) % n + n) % n];
+            contourLines[l].push_back(cv::Point2f(p.x, p.y));
         }
+        if ((len - 1) % step != 0) // the last corner is always kept
+            contourLines[l].push_back(cv::Point2f(contour[to].x, contour[to].y));
     }
 
+    // undistort the samples, by table lookup if the tables of the camera are computed
+    bool undistort = !camMatrix.empty() && !distCoeff.empty();
+    if (undistort)
+        for (unsigned int l = 0; l < 4; l++)
+            if (w._useUndistortLookup)
+                w._undistortLookup.undistort(contourLines[l], contourLines[l]);
+            else
+                cv::undistortPoints(contourLines[l], contourLines[l], camMatrix, distCoeff, cv::Mat(), camMatrix);
+
     // interpolate marker lines
     vector< Point3f > lines;
     lines.resize(4);
@@ -905,11 +1377,15 @@ void MarkerDetector::refineCandidateLines(MarkerDetector::MarkerCandidate &candi
     vector< Point2f > crossPoints;
     crossPoints.resize(4);
     for (unsigned int i = 0; i < 4; i++)
-        crossPoints[i] = getCrossPoint(lines[(i - 1) % 4], lines[i]);
+        crossPoints[i] = getCrossPoint(lines[(i + 3) % 4], lines[i]);
 
     // distort corners again if undistortion was performed
-    if (!camMatrix.empty() && !distCoeff.empty())
-        distortPoints(crossPoints, crossPoints, camMatrix, distCoeff);
+    if (undistort) {
+        if (w._useUndistortLookup)
+            w._undistortLookup.distort(crossPoints, crossPoints);
+        else
+            distortPoints(crossPoints, crossPoints, camMatrix, distCoeff);
+    }
 
     // reassing points
     for (unsigned int j = 0; j < 4; j++)
@@ -918,95 +1394,70 @@ void MarkerDetector::refineCandidateLines(MarkerDetector::MarkerCandidate &candi
 
 
 /**
+ * Least squares line through the points, as y = Ax + C or x = By + C, whichever axis the points spread along.
+ * The normal equations are 2x2, so they are solved in closed form, with the points centered for precision
  */
-void MarkerDetector::interpolate2Dline(const std::vector< Point2f > &inPoints, Point3f &outLine) {
+void MarkerDetector::interpolate2Dline(const std::vector< Point2f > &inPoints, Point3f &outLine) const {
 
     float minX, maxX, minY, maxY;
     minX = maxX = inPoints[0].x;
     minY = maxY = inPoints[0].y;
-    for (unsigned int i = 1; i < inPoints.size(); i++) {
-        if (inPoints[i].x < minX)
-            minX = inPoints[i].x;
-        if (inPoints[i].x > maxX)
-            maxX = inPoints[i].x;
-        if (inPoints[i].y < minY)
-            minY = inPoints[i].y;
-        if (inPoints[i].y > maxY)
-            maxY = inPoints[i].y;
+    double sx = 0, sy = 0;
+    for (unsigned int i = 0; i < inPoints.size(); i++) {
+        minX = std::min(minX, inPoints[i].x);
+        maxX = std::max(maxX, inPoints[i].x);
+        minY = std::min(minY, inPoints[i].y);
+        maxY = std::max(maxY, inPoints[i].y);
+        sx += inPoints[i].x;
+        sy += inPoints[i].y;
+    }
+    double mx = sx / inPoints.size(), my = sy / inPoints.size();
+    double sxx = 0, syy = 0, sxy = 0;
+    for (unsigned int i = 0; i < inPoints.size(); i++) {
+        double dx = inPoints[i].x - mx, dy = inPoints[i].y - my;
+        sxx += dx * dx;
+        syy += dy * dy;
+        sxy += dx * dy;
     }
-
-    // create matrices of equation system
-    Mat A(inPoints.size(), 2, CV_32FC1, Scalar(0));
-    Mat B(inPoints.size(), 1, CV_32FC1, Scalar(0));
-    Mat X;
-
-
 
     if (maxX - minX > maxY - minY) {
         // Ax + C = y
-        for (size_t i = 0; i < inPoints.size(); i++) {
-
-            A.at< float >(i, 0) = inPoints[i].x;
-            A.at< float >(i, 1) = 1.;
-            B.at< float >(i, 0) = inPoints[i].y;
-        }
-
-        // solve system
-        solve(A, B, X, DECOMP_SVD);
+        double a = sxx > 0 ? sxy / sxx : 0;
         // return Ax + By + C
-        outLine = Point3f(X.at< float >(0, 0), -1., X.at< float >(1, 0));
+        outLine = Point3f(a, -1., my - a * mx);
     } else {
         // By + C = x
-        for (size_t i = 0; i < inPoints.size(); i++) {
-
-            A.at< float >(i, 0) = inPoints[i].y;
-            A.at< float >(i, 1) = 1.;
-            B.at< float >(i, 0) = inPoints[i].x;
-        }
-
-        // solve system
-        solve(A, B, X, DECOMP_SVD);
+        double b = syy > 0 ? sxy / syy : 0;
         // return Ax + By + C
-        outLine = Point3f(-1., X.at< float >(0, 0), X.at< float >(1, 0));
+        outLine = Point3f(-1., b, mx - b * my);
     }
 }
 
 /**
  */
-Point2f MarkerDetector::getCrossPoint(const cv::Point3f &line1, const cv::Point3f &line2) {
-
-    // create matrices of equation system
-    Mat A(2, 2, CV_32FC1, Scalar(0));
-    Mat B(2, 1, CV_32FC1, Scalar(0));
-    Mat X;
-
-    A.at< float >(0, 0) = line1.x;
-    A.at< float >(0, 1) = line1.y;
-    B.at< float >(0, 0) = -line1.z;
-
-    A.at< float >(1, 0) = line2.x;
-    A.at< float >(1, 1) = line2.y;
-    B.at< float >(1, 0) = -line2.z;
-
-    // solve system
-    solve(A, B, X, DECOMP_SVD);
-    return Point2f(X.at< float >(0, 0), X.at< float >(1, 0));
+Point2f MarkerDetector::getCrossPoint(const cv::Point3f &line1, const cv::Point3f &line2) const {
+
+    // Cramer's rule on the lines a x + b y = -c
+    double det = double(line1.x) * line2.y - double(line1.y) * line2.x;
+    if (std::fabs(det) < 1e-12)
+        return Point2f(0, 0);
+    return Point2f((-double(line1.z) * line2.y + double(line1.y) * line2.z) / det,
+                   (-double(line1.x) * line2.z + double(line1.z) * line2.x) / det);
 }
 
 
 /**
  */
-void MarkerDetector::distortPoints(vector< cv::Point2f > in, vector< cv::Point2f > &out, const Mat &camMatrix, const Mat &distCoeff) {
-    // trivial extrinsics
-    cv::Mat Rvec = cv::Mat(3, 1, CV_32FC1, cv::Scalar::all(0));
-    cv::Mat Tvec = Rvec.clone();
-    // calculate 3d points and then reproject, so opencv makes the distortion internally
+void MarkerDetector::distortPoints(const vector< cv::Point2f > &in, vector< cv::Point2f > &out, const Mat &camMatrix, const Mat &distCoeff) const {
+    // calculate 3d points and then reproject, so the kernel makes the distortion internally
     vector< cv::Point3f > cornersPoints3d;
+    double fx = CameraParameters::value(camMatrix, 0), cx = CameraParameters::value(camMatrix, 2);
+    double fy = CameraParameters::value(camMatrix, 4), cy = CameraParameters::value(camMatrix, 5);
     for (unsigned int i = 0; i < in.size(); i++)
-        cornersPoints3d.push_back(cv::Point3f((in[i].x - camMatrix.at< float >(0, 2)) / camMatrix.at< float >(0, 0), // x
-                                              (in[i].y - camMatrix.at< float >(1, 2)) / camMatrix.at< float >(1, 1), // y
+        cornersPoints3d.push_back(cv::Point3f((in[i].x - cx) / fx, // x
+                                              (in[i].y - cy) / fy, // y
                                               1)); // z
-    cv::projectPoints(cornersPoints3d, Rvec, Tvec, camMatrix, distCoeff, out);
+    ProjectionKernel(camMatrix, distCoeff).project(cornersPoints3d, out);
 }
 
 
@@ -1078,66 +1529,201 @@ void MarkerDetector::warpPerspective(const cv::Mat &in,cv::Mat & out, const cv::
 
 
 
-void MarkerDetector::findCornerMaxima(vector< cv::Point2f > &Corners, const cv::Mat &grey, int wsize) {
-
-// for each element, search in a region around
-#pragma omp parallel for
+//one row of the block sums of findCornerMaxima: the sum of the a x a block starting at each pixel, from the integral
+//rows i0 and i1 of the block top and bottom
+ARUCO_DISPATCH static void blockSumRow(const double *i0, const double *i1, float *b, int n, int a) {
+    for (int x = 0; x < n; x++)
+        b[x] = float(i1[x + a] - i1[x] - i0[x + a] + i0[x]);
+}
 
+void MarkerDetector::findCornerMaxima(vector< cv::Point2f > &Corners, const cv::Mat &grey, int wsize) const {
+    // the corners are grouped in square tiles of the image. Each tile computes the Harris response once, in a
+    // region that covers the search window of all its corners, so adjacent markers do not compute it again
+    const int bls_a = 4; // side of the block sum
+    int tileSize = std::max(64, 8 * wsize);
+    int tileCols = (grey.cols + tileSize - 1) / tileSize;
+    std::unordered_map< int, vector< int > > tiles;
     for (size_t i = 0; i < Corners.size(); i++) {
-        cv::Point2f minLimit(std::max(0, int(Corners[i].x - wsize)), std::max(0, int(Corners[i].y - wsize)));
-        cv::Point2f maxLimit(std::min(grey.cols, int(Corners[i].x + wsize)), std::min(grey.rows, int(Corners[i].y + wsize)));
-
-        cv::Mat reg = grey(cv::Range(minLimit.y, maxLimit.y), cv::Range(minLimit.x, maxLimit.x));
+        int tx = std::min(std::max(int(Corners[i].x), 0), grey.cols - 1) / tileSize;
+        int ty = std::min(std::max(int(Corners[i].y), 0), grey.rows - 1) / tileSize;
+        tiles[ty * tileCols + tx].push_back(i);
+    }
+    vector< vector< int > > tileCorners;
+    tileCorners.reserve(tiles.size());
+    for (auto &tile : tiles) tileCorners.push_back(tile.second);
+    cv::Rect imageRect(0, 0, grey.cols, grey.rows);
+
+#pragma omp parallel for schedule(dynamic) num_threads(nThreads())
+    for (int t = 0; t < int(tileCorners.size()); t++) {
+        // search window of each corner, and their union
+        vector< cv::Rect > windows;
+        cv::Rect region;
+        for (int i : tileCorners[t]) {
+            cv::Point minLimit(std::max(0, int(Corners[i].x - wsize)), std::max(0, int(Corners[i].y - wsize)));
+            cv::Point maxLimit(std::min(grey.cols, int(Corners[i].x + wsize)), std::min(grey.rows, int(Corners[i].y + wsize)));
+            windows.push_back(cv::Rect(minLimit, maxLimit));
+            region = windows.size() == 1 ? windows.back() : (region | windows.back());
+        }
+        if (region.area() == 0) continue;
+        // the block sum looks bls_a pixels ahead, so the response is also computed there
+        cv::Rect ext = cv::Rect(region.x, region.y, region.width + bls_a, region.height + bls_a) & imageRect;
         cv::Mat harr, harrint;
-        cv::cornerHarris(reg, harr, 3, 3, 0.04);
-
-        // now, do a sum block operation
-        cv::integral(harr, harrint);
-        int bls_a = 4;
-        for (int y = bls_a; y < harr.rows - bls_a; y++) {
-            float *h = harr.ptr< float >(y);
-            for (int x = bls_a; x < harr.cols - bls_a; x++)
-                h[x] = harrint.at< double >(y + bls_a, x + bls_a) - harrint.at< double >(y + bls_a, x) - harrint.at< double >(y, x + bls_a) +
-                       harrint.at< double >(y, x);
+        cv::cornerHarris(grey(ext), harr, 3, 3, 0.04);
+
+        // now, do a sum block operation: the sum of the bls_a x bls_a block starting at each pixel
+        cv::integral(harr, harrint, CV_64F);
+        cv::Mat blocks(harr.size(), CV_32F, cv::Scalar(0));
+        for (int y = 0; y + bls_a <= harr.rows; y++)
+            blockSumRow(harrint.ptr< double >(y), harrint.ptr< double >(y + bls_a), blocks.ptr< float >(y),
+                        harr.cols - bls_a + 1, bls_a);
+
+        for (size_t k = 0; k < windows.size(); k++) {
+            const cv::Rect &win = windows[k];
+            if (win.area() == 0) continue;
+            // the pixels of the window closer than bls_a to its border keep their Harris value, as the window
+            // was refined on its own
+            cv::Point2f best(-1, -1);
+            cv::Point2f center(win.width / 2, win.height / 2);
+            double maxv = 0;
+            for (int i = 0; i < win.height; i++) {
+                const float *har = harr.ptr< float >(win.y - ext.y + i) + (win.x - ext.x);
+                const float *blk = blocks.ptr< float >(win.y - ext.y + i) + (win.x - ext.x);
+                bool inner = i >= bls_a && i < win.height - bls_a;
+                for (int x = 0; x < win.width; x++) {
+                    // L1 dist to center
+                    float d = float(fabs(center.x - x) + fabs(center.y - i)) / float(win.width / 2 + win.height / 2);
+                    float w = 1. - d;
+                    float v = inner && x >= bls_a && x < win.width - bls_a ? blk[x] : har[x];
+                    if (w * v > maxv) {
+                        maxv = w * v;
+                        best = cv::Point2f(x, i);
+                    }
+                }
+            }
+            // without a positive response, the corner is left where it was
+            if (best.x >= 0) Corners[tileCorners[t][k]] = best + cv::Point2f(win.x, win.y);
         }
+    }
+}
 
 
+//grey level of a point, bilinearly interpolated. Returns false outside the image
+static inline bool sampleGrey(const cv::Mat &grey, cv::Point2f p, float &v) {
+    int x = cvFloor(p.x), y = cvFloor(p.y);
+    if (x < 0 || y < 0 || x + 1 >= grey.cols || y + 1 >= grey.rows) return false;
+    float ax = p.x - x, ay = p.y - y;
+    const uchar *r0 = grey.ptr< uchar >(y) + x, *r1 = grey.ptr< uchar >(y + 1) + x;
+    v = (1 - ay) * ((1 - ax) * r0[0] + ax * r0[1]) + ay * ((1 - ax) * r1[0] + ax * r1[1]);
+    return true;
+}
 
-        cv::Point2f best(-1, -1);
-        cv::Point2f center(reg.cols / 2, reg.rows / 2);
-        ;
-        double maxv = 0;
-        for (int i = 0; i < harr.rows; i++) {
-            // L1 dist to center
-            float *har = harr.ptr< float >(i);
-            for (int x = 0; x < harr.cols; x++) {
-                float d = float(fabs(center.x - x) + fabs(center.y - i)) / float(reg.cols / 2 + reg.rows / 2);
-                float w = 1. - d;
-                if (w * har[x] > maxv) {
-                    maxv = w * har[x];
-                    best = cv::Point2f(x, i);
-                }
+void MarkerDetector::refineEdges(const cv::Mat &grey, vector< cv::Point2f > &corners, float range) {
+    //as AprilTag's refine_edges: points along each side are moved along its normal to the mean position of the
+    //gradient, weighted by its square, and a line is fitted to them
+    cv::Vec4f lines[4];
+    for (int i = 0; i < 4; i++) {
+        cv::Point2f a = corners[i], d = corners[(i + 1) % 4] - a;
+        float len = std::sqrt(d.dot(d));
+        if (len < 4) return;
+        cv::Point2f n(d.y / len, -d.x / len);
+        int nSamples = std::max(8, int(len / 4));
+        vector< cv::Point2f > points;
+        for (int k = 0; k < nSamples; k++) {
+            //the ends of the side are avoided, as the other sides are near
+            cv::Point2f p0 = a + d * ((k + 1.f) / (nSamples + 1.f));
+            float sumT = 0, sumW = 0;
+            for (float t = -range; t <= range; t += 0.25f) {
+                float g1, g2;
+                if (!sampleGrey(grey, p0 + n * (t + 1), g1) || !sampleGrey(grey, p0 + n * (t - 1), g2)) continue;
+                float w = (g1 - g2) * (g1 - g2);
+                sumT += w * t;
+                sumW += w;
             }
+            if (sumW > 0) points.push_back(p0 + n * (sumT / sumW));
         }
-        Corners[i] = best + minLimit;
+        if (points.size() < 4) return;
+        cv::fitLine(points, lines[i], CV_DIST_HUBER, 0, 0.01, 0.01);
+    }
+    //corner i is the intersection of the sides i-1 and i
+    cv::Point2f refined[4];
+    for (int i = 0; i < 4; i++) {
+        const cv::Vec4f &l1 = lines[(i + 3) % 4], &l2 = lines[i];
+        float det = l1[0] * l2[1] - l1[1] * l2[0];
+        if (std::fabs(det) < 1e-3) return;
+        float s = ((l2[2] - l1[2]) * l2[1] - (l2[3] - l1[3]) * l2[0]) / det;
+        refined[i] = cv::Point2f(l1[2] + s * l1[0], l1[3] + s * l1[1]);
+        cv::Point2f moved = refined[i] - corners[i];
+        if (moved.dot(moved) > 4 * range * range) return;
     }
+    for (int i = 0; i < 4; i++) corners[i] = refined[i];
+}
+
+
+int MarkerDetector::_sharedThreads=0;
+
+int MarkerDetector::nThreads()const{
+    if (_params._nThreads>0) return _params._nThreads;
+    return _sharedThreads>0 ? _sharedThreads : omp_get_max_threads();
+}
+
+void MarkerDetector::setParams(Params p){
+    _params=p;
+    setLabelersCellThreshold();
 }
 
+void MarkerDetector::setLabelersCellThreshold(){
+    for(auto &l:markerIdDetectors) l->setCellThreshold(_params._cellThreshold);
+}
 
 void MarkerDetector::setMarkerLabeler(cv::Ptr<MarkerLabeler> detector)throw(cv::Exception){
     markerIdDetector=detector;
+    markerIdDetectors.assign(1,markerIdDetector);
     if (markerIdDetector->getBestInputSize()!=-1)setWarpSize(markerIdDetector->getBestInputSize());
+    setLabelersCellThreshold();
+}
 
+cv::Ptr<MarkerLabeler> MarkerDetector::getLabeler(const string &dict_type,float error_correction_rate,const vector<int> &ids)throw(cv::Exception){
+    string key=dict_type;
+    if (!ids.empty()){
+        std::set<int> sorted(ids.begin(),ids.end());
+        key+=" ids";
+        for(int id:sorted) key+=" "+std::to_string(id);
+    }
+    cv::Ptr<MarkerLabeler> &labeler=labelerCache[std::make_pair(key,error_correction_rate)];
+    if (labeler.empty())
+        labeler=ids.empty() ? MarkerLabeler::create( dict_type,std::to_string(error_correction_rate)) :
+                              MarkerLabeler::create( dict_type,error_correction_rate,ids);
+    return labeler;
 }
 
 void MarkerDetector::setDictionary(Dictionary::DICT_TYPES dict_type,float error_correction_rate)throw(cv::Exception){
-    markerIdDetector= MarkerLabeler::create(dict_type,error_correction_rate);
+    markerIdDetector= getLabeler(Dictionary::getTypeString(dict_type),error_correction_rate);
+    markerIdDetectors.assign(1,markerIdDetector);
     if (markerIdDetector->getBestInputSize()!=-1)setWarpSize(markerIdDetector->getBestInputSize());
+    setLabelersCellThreshold();
 }
 
 void MarkerDetector::setDictionary(string dict_type,float error_correction_rate)throw(cv::Exception){
-    markerIdDetector= MarkerLabeler::create( dict_type,std::to_string(error_correction_rate));
+    markerIdDetector= getLabeler( dict_type,error_correction_rate);
+    markerIdDetectors.assign(1,markerIdDetector);
+    if (markerIdDetector->getBestInputSize()!=-1)setWarpSize(markerIdDetector->getBestInputSize());
+    setLabelersCellThreshold();
+}
+
+void MarkerDetector::setDictionaries(const vector<string> &dict_types,float error_correction_rate,const vector< vector<int> > &ids)throw(cv::Exception){
+    if (dict_types.empty())
+        throw cv::Exception(9001, "no dictionaries given", "MarkerDetector::setDictionaries", __FILE__, __LINE__);
+    vector< cv::Ptr<MarkerLabeler> > labelers;
+    for(size_t i=0;i<dict_types.size();i++){
+        labelers.push_back(getLabeler( dict_types[i],error_correction_rate,i<ids.size() ? ids[i] : vector<int>()));
+        //all the labelers share the warped image, so they must agree in its size
+        if (labelers.back()->getBestInputSize()!=labelers[0]->getBestInputSize())
+            throw cv::Exception(9001, "labelers with different input sizes", "MarkerDetector::setDictionaries", __FILE__, __LINE__);
+    }
+    markerIdDetectors.swap(labelers);
+    markerIdDetector=markerIdDetectors[0];
     if (markerIdDetector->getBestInputSize()!=-1)setWarpSize(markerIdDetector->getBestInputSize());
+    setLabelersCellThreshold();
 }
 
 
@@ -30,10 +30,14 @@ or implied, of Rafael Muñoz Salinas.
 #include <opencv2/core/core.hpp>
 #include <cstdio>
 #include <iostream>
+#include <map>
+#include <set>
 #include "exports.h"
 #include "dictionary.h"
 #include "marker.h"
 #include "markerlabeler.h"
+#include "threadaccumulator.h"
+#include "undistortlookup.h"
 using namespace std;
 
 namespace aruco {
@@ -46,13 +50,16 @@ class ARUCO_EXPORTS MarkerDetector {
 public:
 
     /**Methods for corner refinement
+     * HARRIS moves each corner to the maximum of the Harris response around it (pixel accuracy, see findCornerMaxima)
      */
-    enum CornerRefinementMethod { NONE,   SUBPIX, LINES };
+    enum CornerRefinementMethod { NONE,   SUBPIX, LINES, HARRIS };
 
     /**This set the type of thresholding methods available
      */
 
-    enum ThresholdMethods { FIXED_THRES, ADPT_THRES, CANNY };
+    //ADPT_THRES_INTEGRAL is equivalent to ADPT_THRES, but all the values of _thresParam1 in the range
+    //are computed from a single integral image, which is much faster when _thresParam1_range>0
+    enum ThresholdMethods { FIXED_THRES, ADPT_THRES, CANNY, ADPT_THRES_INTEGRAL };
 
     /**Operating params
      */
@@ -66,6 +73,8 @@ public:
         CornerRefinementMethod _cornerMethod;
         //when using subpix, this indicates the search range for optimization (in pixels)
         int _subpix_wsize;
+        //maximum iterations of the cornerSubPix refinement of each corner
+        int _subpixMaxIterations;
         //size of the image passed to the MarkerLabeler
         int _markerWarpSize;
         // border around image limits in which corners are not allowed to be detected. (0,1)
@@ -81,6 +90,55 @@ public:
         // The marker is visible, but relatively small, so, we set a minimum size expressed in pixels to avoid discarding it
         float _minSize, _maxSize;
         int _minSize_pix ;
+        //pyramid level in which the candidates are searched (coarse to fine detection). 0 means the full resolution image.
+        //Each level halves the image size, and levels narrower than 320 pixels are not employed.
+        //Candidates found in a level >0 are refined with cornerSubPix in the full resolution image, whatever the _cornerMethod
+        int _pyrCandidateLevel;
+        //if >1, the candidates are searched in the image reduced by this factor, which need not be a power of two, instead
+        //of a pyramid level (as AprilTag's quad_decimate). Searches narrower than 320 pixels are not employed.
+        //The sides of the markers are then moved to the edges of the full resolution image (see refineEdges), before the
+        //_cornerMethod refinement
+        float _quadDecimate;
+        //if true, the threshold images of the range (_thresParam1_range) are searched one at a time, the ones that found
+        //more markers in previous calls first, until the expected markers are found (see setExpectedMarkers) or
+        //an image adds no new marker. Otherwise, all of them are searched
+        bool _adaptiveThresLevels;
+        //threads of the parallel regions of a detect call. 0 uses the count shared by all detectors (see setSharedThreads),
+        //and 1 runs the detection on the calling thread only, which is best when several detectors run at once.
+        //The detected markers do not depend on the number of threads
+        int _nThreads;
+        //if true, the candidates are warped as markers printed on a cylinder, whose two opposite sides are bent
+        //(see markerdetector_cylinder.cpp). Only the candidates of a full resolution search (_pyrCandidateLevel 0) can be,
+        //and the contours of the candidates are kept for it. Planar markers need it not
+        bool _cylinderWarp;
+        //if true, the image pyramid and the FIXED_THRES, ADPT_THRES or CANNY threshold images are computed on the OpenCL
+        //device of cv::ocl (OpenCV 3 or later, see markerdetector_ocl.cpp). The contours, labeling and refinement stay on
+        //the CPU, and so does everything when there is no device
+        bool _useOpenCL;
+        //if true, the dictionary labelers read the bits from the mean grey of each cell of the warped patch: candidates
+        //whose border is not darker than their brightest inner cell are rejected at once, and the means are split at
+        //their largest gap, instead of thresholding every patch with Otsu. Markers whose inner cells are all black
+        //are not found
+        bool _cellThreshold;
+        //when detect computes the extrinsics, if >0, the poses of all the markers are found at once with IPPE, and only
+        //those whose error ratio (error of the second IPPE pose over the first) is below this are refined with solvePnP.
+        //0 finds each pose with solvePnP from scratch. Either way, the markers are solved in parallel
+        float _ippeErrorRatio;
+        //if >0, time (milliseconds) of a detect call after which the search of candidates stops: no more contours,
+        //levels or candidates are processed, and only the markers identified so far are refined and returned.
+        //Stats::overBudget tells the calls that ran out of it
+        double _timeBudgetMs;
+        //if >0, and the LINES refinement is given the camera parameters, the contour points are undistorted and the
+        //refined corners distorted again by interpolation in tables of this step (pixels, see UndistortLookup), computed
+        //once per camera and image size. 0 maps every point with the distortion model
+        int _undistortLookupStep;
+        //if true, the contours are fitted with CheckRectContour::fitQuad, which only looks for convex quadrilaterals and
+        //gives up on the others early, instead of the general approxPolyDP and isContourConvex. The tolerance is the same
+        bool _fastQuadFit;
+        //if true, a color image is read once for the grey image, the first pyramid level and, when the threshold input is
+        //one of them and _thresMethod is ADPT_THRES_INTEGRAL, its integral image, in a single pass over blocks of rows
+        //instead of cvtColor, pyrDown and integral one after the other. Not employed with _useOpenCL
+        bool _fusedFirstPass;
         Params(){
             _thresMethod = ADPT_THRES;
             _thresParam1 = _thresParam2 = 7;
@@ -92,8 +150,57 @@ public:
             _minSize = 0.04;_maxSize = 0.95;_minSize_pix=25;
             _borderDistThres = 0.005; // corners at a distance from image boundary nearer than 2.5% of image are ignored
             _subpix_wsize=5;//window size employed for subpixel search (in vase you use _cornerMethod=SUBPIX
+            _subpixMaxIterations=12;
+            _pyrCandidateLevel=0;
+            _quadDecimate=1;
+            _adaptiveThresLevels=false;
+            _nThreads=0;
+            _cylinderWarp=false;
+            _useOpenCL=false;
+            _cellThreshold=false;
+            _ippeErrorRatio=0;
+            _timeBudgetMs=0;
+            _undistortLookupStep=0;
+            _fastQuadFit=false;
+            _fusedFirstPass=false;
         }
+        //low power profile, for the live detection of embedded boards (ARM capture nodes): a single threshold window,
+        //computed with integer arithmetic from the integral image, candidates searched in the first pyramid level,
+        //the quadrilateral fit, the labeling from the cell means and the fused first pass. The corners are still
+        //refined in the full resolution image, so they are as accurate as with the _cornerMethod alone. Markers whose
+        //inner cells are all black are not found (see _cellThreshold)
+        void setLowPower(){
+            _thresMethod=ADPT_THRES_INTEGRAL;
+            _thresParam1_range=0;
+            _adaptiveThresLevels=false;
+            _pyrCandidateLevel=std::max(_pyrCandidateLevel,1);
+            _fastQuadFit=true;
+            _cellThreshold=true;
+            _fusedFirstPass=true;
+        }
+
+    };
 
+    /**Work done by the detection. Times are in milliseconds, measured with cv::getTickCount
+     */
+    struct Stats{
+        int nCalls;//detect calls added up
+        double thresholdTime;//grey conversion, pyramid and threshold images
+        double rectanglesTime;//contour extraction and rectangle search
+        double identifyTime;//warping and labeling of the candidates
+        double refineTime;//corner refinement
+        double filterTime;//sorting, removal of repeated markers and extrinsics
+        double totalTime;
+        //contours extracted from each threshold image, in the order of the _thresParam1 range
+        std::vector<int> contoursPerLevel;
+        int nCandidates;//rectangles passed to the labelers
+        int labelerHits, labelerMisses;//candidates identified, and candidates that no labeler identified
+        //corners refined with cornerSubPix. It does not report its iterations, which are at most subpixMaxIterations per corner
+        int subpixCorners, subpixMaxIterations;
+        int overBudget;//calls whose search was stopped by Params::_timeBudgetMs
+        Stats(){clear();}
+        void clear();
+        void add(const Stats &s);
     };
 
     /**
@@ -147,9 +254,35 @@ public:
     void detect(const cv::Mat &input, std::vector< Marker > &detectedMarkers, cv::Mat camMatrix = cv::Mat(), cv::Mat distCoeff = cv::Mat(),
                 float markerSizeMeters = -1, bool setYPerperdicular = false) throw(cv::Exception);
 
+    /**Detects the markers of all the labelers set with setDictionaries() in a single pass
+     *
+     * Thresholding, rectangle search and warping are done only once, and each candidate is passed to the labelers in order
+     * until one of them identifies it. Use it instead of calling setDictionary()+detect() once per dictionary.
+     *
+     * @param input input color image
+     * @param detectedMarkers output vector. detectedMarkers[i] has the markers identified by the i-th dictionary
+     * @param camMatrix intrinsic camera information.
+     * @param distCoeff camera distorsion coefficient. If set Mat() if is assumed no camera distorion
+     * @param markerSizeMeters size of the marker sides expressed in meters
+     * @param setYPerperdicular If set the Y axis will be perpendicular to the surface. Otherwise, it will be the Z axis
+     */
+    void detect(const cv::Mat &input, std::vector< std::vector< Marker > > &detectedMarkers, cv::Mat camMatrix = cv::Mat(), cv::Mat distCoeff = cv::Mat(),
+                float markerSizeMeters = -1, bool setYPerperdicular = false) throw(cv::Exception);
+
+    class Workspace;
+    /**Reentrant version of the detection above: the images, buffers, threshold history and statistics of the call are
+     * those of ws instead of the detector's, which is not modified. Several threads may then detect with the same
+     * detector, its params and labelers, at once, each one with its own workspace. The params, dictionaries, ROI and
+     * expected markers must not be changed meanwhile
+     *
+     * @param ws state of the call, kept between the calls of a thread so that its buffers are reused
+     */
+    void detect(const cv::Mat &input, std::vector< std::vector< Marker > > &detectedMarkers, Workspace &ws, const cv::Mat &camMatrix = cv::Mat(),
+                const cv::Mat &distCoeff = cv::Mat(), float markerSizeMeters = -1, bool setYPerperdicular = false) const throw(cv::Exception);
+
     /**Sets operating params
      */
-    void setParams(Params p){_params =p;}
+    void setParams(Params p);
     /**Returns operating params
      */
     Params getParams()const {return _params;}
@@ -178,12 +311,67 @@ public:
      */
     void setDictionary(Dictionary::DICT_TYPES dict_type,float error_correction_rate=0)throw(cv::Exception);
 
+    /**
+     * @brief setDictionaries Specifies several dictionaries to be decoded simultaneously by detect(). Candidates are
+     * tested against the dictionaries in the order given, so repeated names should be avoided
+     * @param dict_types names of the dictionaries (see setDictionary)
+     * @param error_correction_rate value indicating the correction error allowed. @see setDictionary
+     * @param ids if not empty, ids[i] are the only markers identified with the i-th dictionary (all of them if ids[i] is
+     * empty). The codes of the other ids are neither looked up nor corrected to (see Dictionary::subset)
+     */
+    void setDictionaries(const std::vector<std::string> &dict_types,float error_correction_rate=0,
+                         const std::vector< std::vector<int> > &ids=std::vector< std::vector<int> >())throw(cv::Exception);
+
+    /**
+     * @brief setExpectedMarkers Sets the ids that may be found in the images, used to stop the search early when
+     * Params::_adaptiveThresLevels is set
+     * @param ids ids[i] are the ids expected from the i-th dictionary of setDictionaries
+     */
+    void setExpectedMarkers(const std::vector< std::vector<int> > &ids);
+
+    /**
+     * @brief setROI Restricts the detection to a polygon of the input images. Thresholding and the contour search run
+     * in its bounding box, grown by the largest threshold window, and the markers whose center is out of the polygon
+     * are dropped. The output corners are in input image coordinates. An empty polygon uses the whole image
+     */
+    void setROI(const std::vector<cv::Point> &polygon){_roi=polygon;}
+    const std::vector<cv::Point> &getROI()const{return _roi;}
+    /**
+     * @brief roiBox Region of an image of the size given in which a detection with the ROI set runs: the bounding
+     * box of the polygon, grown by the largest threshold window and clipped to the image. The whole image without ROI
+     */
+    cv::Rect roiBox(cv::Size imageSize)const;
+
 
     /**
      * Returns a reference to the internal image thresholded. It is for visualization purposes and to adjust manually
      * the parameters
      */
-    const cv::Mat &getThresholdedImage() { return thres; }
+    const cv::Mat &getThresholdedImage() { return _ws.thres; }
+
+    /**Returns the work done by the last detect call
+     */
+    const Stats &getStats()const {return _ws._lastStats;}
+    /**Returns the work done by the detect calls since the detector was created or resetStats() was called
+     */
+    const Stats &getTotalStats()const {return _ws._totalStats;}
+    void resetStats(){_ws.resetStats();}
+    /**Forgets the threshold levels that found markers in the previous calls, so the adaptive search (see
+     * Params::_adaptiveThresLevels) of the next call starts from the middle level, as in the first call. A set of images
+     * each detected after it gives the same markers whatever the order they are detected in, and on whichever detector
+     */
+    void resetHistory(){_ws.resetHistory();}
+    /**If set, called at the begin (true) and at the end (false) of each stage of the detect calls of every detector, to
+     * trace them: detect, pyramid, threshold and contours (with their level, from any of the threads of the call),
+     * identify, subpix and filter. The level is -1 for the other stages and at the end
+     */
+    static void (*traceHook)(const char *stage, int level, bool begin);
+
+    /**Sets the threads of the detectors whose Params::_nThreads is 0, so that they share a single thread count.
+     * 0 (the default) uses omp_get_max_threads(). It must not be changed while a detection is running
+     */
+    static void setSharedThreads(int n){_sharedThreads=std::max(0,n);}
+    static int getSharedThreads(){return _sharedThreads;}
 
 
     //Below this point, you are most probably not interested
@@ -306,28 +494,128 @@ public:
     // Represent a candidate to be a maker
     class MarkerCandidate : public Marker {
       public:
-        MarkerCandidate() {}
-        MarkerCandidate(const Marker &M) : Marker(M) {}
+        MarkerCandidate() { for (int k = 0; k < 4; k++) cornerIdx[k] = -1; }
+        MarkerCandidate(const Marker &M) : Marker(M) { for (int k = 0; k < 4; k++) cornerIdx[k] = -1; }
         MarkerCandidate(const MarkerCandidate &M) : Marker(M) {
-            contour = M.contour;
+            contourStart = M.contourStart;
+            contourChain = M.contourChain;
+            metrics = M.metrics;
             idx = M.idx;
+            for (int k = 0; k < 4; k++) cornerIdx[k] = M.cornerIdx[k];
         }
         MarkerCandidate &operator=(const MarkerCandidate &M) {
             (*(Marker *)this) = (*(Marker *)&M);
-            contour = M.contour;
+            contourStart = M.contourStart;
+            contourChain = M.contourChain;
+            metrics = M.metrics;
+            idx = M.idx;
+            for (int k = 0; k < 4; k++) cornerIdx[k] = M.cornerIdx[k];
+            return *this;
+        }
+        MarkerCandidate(MarkerCandidate &&M) : Marker(std::move(M)), contourStart(M.contourStart), contourChain(std::move(M.contourChain)), metrics(M.metrics), idx(M.idx) {
+            for (int k = 0; k < 4; k++) cornerIdx[k] = M.cornerIdx[k];
+        }
+        MarkerCandidate &operator=(MarkerCandidate &&M) {
+            (*(Marker *)this) = std::move(*(Marker *)&M);
+            contourStart = M.contourStart;
+            contourChain = std::move(M.contourChain);
+            metrics = M.metrics;
             idx = M.idx;
+            for (int k = 0; k < 4; k++) cornerIdx[k] = M.cornerIdx[k];
             return *this;
         }
 
-        vector< cv::Point > contour; // all the points of its contour
+        // the contour is kept as its first point and the 8-connected chain code of the steps to the next ones, a byte
+        // per point instead of a cv::Point. It is only expanded by getContour when the points are needed
+        // sets the contour from the points of a CV_CHAIN_APPROX_NONE contour. Returns false (and keeps none) if two
+        // consecutive points are not neighbours
+        bool setContour(const vector< cv::Point > &contour);
+        void getContour(vector< cv::Point > &contour) const;
+        // reverses the order of the points, so that the last one becomes the first
+        void reverseContour();
+        bool hasContour() const { return !contourChain.empty(); }
+        size_t contourSize() const { return contourChain.empty() ? 0 : contourChain.size() + 1; }
+        void clearContour() { contourChain.clear(); }
+        // computes the metrics of the corners. They do not change when the corners are reordered
+        void setMetrics(float minSide);
+        // moves the corners to an image scaled by s, with their metrics. The contour is not valid there, and is cleared
+        void scale(float s);
+
+        // geometry of the corners, computed once when the candidate is created and read by the later filters
+        struct Metrics {
+            float area = 0, perimeter = 0; // of the quadrilateral of the corners
+            float minSide = 0; // length of its shortest side
+            cv::Point2f center; // mean of the corners
+        };
+
+        cv::Point contourStart; // first point of its contour
+        vector< uchar > contourChain; // direction (0-7) from each point of its contour to the next one
+        Metrics metrics;
+        int cornerIdx[4]; // index of each corner in contour (-1 if unknown, then they are searched)
         int idx; // index position in the global contour list
     };
 
+    /**State of the detect calls: the images, buffers, threshold history and statistics that a call writes. The detector
+     * has its own, used by all the detect methods but the one given a workspace. A workspace must not be used by two
+     * calls at once
+     */
+    class Workspace {
+      public:
+        Workspace();
+        //threshold image of the last call (see MarkerDetector::getThresholdedImage)
+        const cv::Mat &getThresholdedImage()const { return thres; }
+        //rectangles of the last call for which no valid id was found
+        const vector< std::vector< cv::Point2f > > &getCandidates()const { return _candidates; }
+        //work of the last call, and of the calls since the workspace was created or resetStats() was called
+        const Stats &getStats()const {return _lastStats;}
+        const Stats &getTotalStats()const {return _totalStats;}
+        void resetStats(){_totalStats.clear();}
+        //forgets the threshold levels that found markers in the previous calls (see MarkerDetector::resetHistory)
+        void resetHistory(){_thresLevelHits.clear();}
+
+      private:
+        friend class MarkerDetector;
+        // vectr of candidates to be markers. This is a vector with a set of rectangles that have no valid id
+        vector< std::vector< cv::Point2f > > _candidates;
+        // Images
+        cv::Mat grey, thres;
+        vector<cv::Mat > imagePyramid;
+        // Buffers kept between calls, so that detecting in images of the same size does not allocate them again
+        cv::Mat greyBuffer;//grey conversion of color inputs. Gray inputs are used directly
+        cv::Mat decimatedBuffer;//image reduced by Params::_quadDecimate
+        cv::Mat integralBorder,integralImage;//employed by adpt_threshold_multi and thresholdLevel
+        int _integralBorderSize;
+        cv::Mat _thresInput;//image thresholded by thresholdLevel, with the window sizes of each level
+        vector< int > _thresValues;
+        vector< cv::Mat > thresBuffers;//threshold image of each thread
+        cv::Mat patchBuffer;//warped patches of the candidates, one below the other
+        float _candidateScale;//scale of the image in which candidates are being searched wrt the input one
+        UndistortLookup _undistortLookup;//tables of the camera of the current call (Params::_undistortLookupStep)
+        bool _useUndistortLookup;//true if they are those of the current call
+        int64 _budgetEnd;//tick count at which the search of the current call stops (Params::_timeBudgetMs), 0 for none
+        bool outOfTime()const{return _budgetEnd>0 && cv::getTickCount()>_budgetEnd;}
+        const std::vector< cv::Ptr<MarkerLabeler> > *labelers;//labelers of the current call
+        vector< cv::Mat > thres_images;//threshold images computed on the OpenCL device. Empty otherwise
+        ThreadAccumulator< MarkerCandidate > MarkerCanditatesV;
+        ThreadAccumulator< Marker > markers_omp;
+        ThreadAccumulator< int > labelers_omp;
+        ThreadAccumulator< std::vector< cv::Point2f > > candidates_omp;
+        vector< Marker > detectedBuffer;//markers of all the labelers, before they are split
+        vector< int > labelerBuffer;//labeler of each marker of detectedBuffer
+        vector< vector< Marker > > singleDictionaryBuffer;//output of the single dictionary detection, split by labeler
+        //adaptive threshold levels: markers found by each level so far and the best level of the last call
+        vector< int > _thresLevelHits;
+        int _lastThresLevel;
+        //work of the last call, and of all the calls
+        Stats _lastStats, _totalStats;
+    };
+
     /**
      * Thesholds the passed image with the specified method.
      */
     void thresHold(int method, const cv::Mat &grey, cv::Mat &thresImg, double param1 = -1, double param2 = -1) throw(cv::Exception);
-    /**A
+    /**Adaptive mean thresholding (like ADPT_THRES) for all the windows sizes in [param1-2*param1_range,param1+2*param1_range]
+     * and constants in [param2-2*param2_range,param2+2*param2_range] using a single integral image
      * */
     void  adpt_threshold_multi(const cv::Mat &grey, std::vector<cv::Mat> &out, double param1  , double param1_range , double param2,double param2_range=0 );
     /**
@@ -338,7 +626,7 @@ public:
 
     /**Returns a list candidates to be markers (rectangles), for which no valid id was found after calling detectRectangles
      */
-    const vector< std::vector< cv::Point2f > > &getCandidates() { return _candidates; }
+    const vector< std::vector< cv::Point2f > > &getCandidates() { return _ws._candidates; }
 
     /**
      * Given the iput image with markers, creates an output image with it in the canonical position
@@ -348,7 +636,7 @@ public:
      * @param points 4 corners of the marker in the image in
      * @return true if the operation succeed
      */
-    bool warp(cv::Mat &in, cv::Mat &out, cv::Size size, std::vector< cv::Point2f > points) throw(cv::Exception);
+    bool warp(cv::Mat &in, cv::Mat &out, cv::Size size, std::vector< cv::Point2f > points) const throw(cv::Exception);
 
 
 
@@ -361,32 +649,82 @@ public:
 
 
   private:
-    bool warp_cylinder(cv::Mat &in, cv::Mat &out, cv::Size size, MarkerCandidate &mc) throw(cv::Exception);
+    // detection with the labelers given, into w. The ROI, if any, is applied by detectInROI
+    void detectLabelers(const std::vector< cv::Ptr<MarkerLabeler> > &labelers, const cv::Mat &input, std::vector< std::vector< Marker > > &detectedMarkers,
+                        Workspace &w, const cv::Mat &camMatrix, const cv::Mat &distCoeff, float markerSizeMeters, bool setYPerpendicular) const;
+    // detection in the whole input, with the labelers of w
+    void detectImage(const cv::Mat &input, std::vector< std::vector< Marker > > &detectedMarkers, Workspace &w, const cv::Mat &camMatrix,
+                     const cv::Mat &distCoeff, float markerSizeMeters, bool setYPerpendicular) const;
+    // detection in the region of roiBox, with the corners moved to input coordinates and the markers out of the
+    // polygon removed. Returns false, with nothing done, if the region is the whole image
+    bool detectInROI(const cv::Mat &input, std::vector< std::vector< Marker > > &detectedMarkers, Workspace &w, const cv::Mat &camMatrix,
+                     const cv::Mat &distCoeff, float markerSizeMeters, bool setYPerpendicular) const;
+    // pyramid of nLevels levels and threshold images of the level candLevel, computed on the OpenCL device.
+    // Returns false, with nothing computed, if there is no device or the threshold method has no device version
+    bool deviceThreshold(Workspace &w, const cv::Mat &grey, size_t nLevels, int candLevel, const std::vector<int> &p1_values) const;
+    // warp of a candidate printed on a cylinder (Params::_cylinderWarp), with its contour. The corners may be rotated
+    bool warp_cylinder(cv::Mat &in, cv::Mat &out, cv::Size size, MarkerCandidate &mc) const throw(cv::Exception);
+    // nearest neighbour warp of a gray image into an allocated out. Minv maps out to in
+    static void warpNearest(const cv::Mat &in, cv::Mat &out, const cv::Mat &Minv);
+    // thresHold, adpt_threshold_multi and refineCandidateLines with the buffers and tables of w
+    void thresHold(Workspace &w, int method, const cv::Mat &grey, cv::Mat &thresImg, double param1, double param2) const;
+    void adpt_threshold_multi(Workspace &w, const cv::Mat &grey, std::vector<cv::Mat> &out, double param1, double param1_range, double param2,
+                              double param2_range) const;
+    void refineCandidateLines(Workspace &w, MarkerCandidate &candidate, const cv::Mat &camMatrix, const cv::Mat &distCoeff) const;
     /**
     * Detection of candidates to be markers, i.e., rectangles.
-    * This function returns in candidates all the rectangles found in a thresolded image
+    * This function returns in candidates all the rectangles found in the threshold images of the levels given.
+    * The images are (*vimages)[level], which are modified, or, without vimages, they are computed with thresholdLevel
+    * into a buffer of each thread
     */
-    void detectRectangles(vector< cv::Mat > &vimages, vector< MarkerCandidate > &candidates);
+    void detectRectangles(Workspace &w, const vector< int > &levels, vector< cv::Mat > *vimages, vector< MarkerCandidate > &candidates) const;
+    // integral image of grey for windows of up to maxWindow pixels, and threshold of grey using it
+    void prepareIntegral(Workspace &w, const cv::Mat &grey, int maxWindow) const;
+    void integralThreshold(const Workspace &w, const cv::Mat &grey, cv::Mat &out, int wsize, int C) const;
+    // threshold image of a level of the current detection, from the input and the values stored by detect
+    void thresholdLevel(Workspace &w, int level, cv::Mat &out) const;
+    /**
+     * Warps the candidates and identifies them with the labelers. Appends the markers and the index of their labeler
+     */
+    void identifyCandidates(Workspace &w, vector< MarkerCandidate > &candidates, int candLevel, const cv::Mat &camMatrix, const cv::Mat &distCoeff,
+                            vector< Marker > &detectedMarkers, vector< int > &markerLabelers) const;
+    /**
+     * Detection for Params::_adaptiveThresLevels. Searches the threshold images in order of past success
+     */
+    void detectAdaptiveLevels(Workspace &w, int nLevels, int candLevel, const cv::Mat &camMatrix, const cv::Mat &distCoeff,
+                              vector< Marker > &detectedMarkers, vector< int > &markerLabelers) const;
+    /**
+     * Final filtering of the markers identified by a labeler: sorting, removal of repeated markers and markers near the image borders,
+     * and extrinsics calculation
+     */
+    void filterDetectedMarkers(cv::Size imageSize, vector< Marker > &detectedMarkers, const cv::Mat &camMatrix, const cv::Mat &distCoeff,
+                               float markerSizeMeters, bool setYPerpendicular) const;
     //operating params
     Params _params;
-    // vectr of candidates to be markers. This is a vector with a set of rectangles that have no valid id
-    vector< std::vector< cv::Point2f > > _candidates;
-    // Images
-    cv::Mat grey, thres;
     // pointer to the function that analizes a rectangular region so as to detect its internal marker
     cv::Ptr<MarkerLabeler> markerIdDetector;
+    // labelers employed in a multiple dictionary detection. markerIdDetectors[0] is always markerIdDetector
+    std::vector< cv::Ptr<MarkerLabeler> > markerIdDetectors;
+    // labelers already created by this detector, keyed by dictionary (with the ids it is restricted to, if any) and error
+    // correction rate, so switching dictionaries does not rebuild them. Their detection keeps no state, so the reentrant
+    // detect calls share them
+    std::map< std::pair<std::string,float>, cv::Ptr<MarkerLabeler> > labelerCache;
+    cv::Ptr<MarkerLabeler> getLabeler(const std::string &dict_type,float error_correction_rate,
+                                      const std::vector<int> &ids=std::vector<int>())throw(cv::Exception);
+    // passes Params::_cellThreshold to the current labelers. It is done when they or the params change, not by detect
+    void setLabelersCellThreshold();
 
     /**
      */
-    bool isInto(cv::Mat &contour, std::vector< cv::Point2f > &b);
+    bool isInto(cv::Mat &contour, std::vector< cv::Point2f > &b) const;
     /**
      */
-    int perimeter(std::vector< cv::Point2f > &a);
+    int perimeter(const std::vector< cv::Point2f > &a) const;
 
      // auxiliar functions to perform LINES refinement
-    void interpolate2Dline(const vector< cv::Point2f > &inPoints, cv::Point3f &outLine);
-    cv::Point2f getCrossPoint(const cv::Point3f &line1, const cv::Point3f &line2);
-    void distortPoints(vector< cv::Point2f > in, vector< cv::Point2f > &out, const cv::Mat &camMatrix, const cv::Mat &distCoeff);
+    void interpolate2Dline(const vector< cv::Point2f > &inPoints, cv::Point3f &outLine) const;
+    cv::Point2f getCrossPoint(const cv::Point3f &line1, const cv::Point3f &line2) const;
+    void distortPoints(const vector< cv::Point2f > &in, vector< cv::Point2f > &out, const cv::Mat &camMatrix, const cv::Mat &distCoeff) const;
 
 
     /**Given a vector vinout with elements and a boolean vector indicating the lements from it to remove,
@@ -394,13 +732,13 @@ public:
      * @param vinout
      * @param toRemove
      */
-    template < typename T > void removeElements(vector< T > &vinout, const vector< bool > &toRemove) {
+    template < typename T > void removeElements(vector< T > &vinout, const vector< bool > &toRemove) const {
         // remove the invalid ones by setting the valid in the positions left by the invalids
         size_t indexValid = 0;
         for (size_t i = 0; i < toRemove.size(); i++) {
             if (!toRemove[i]) {
                 if (indexValid != i)
-                    vinout[indexValid] = vinout[i];
+                    vinout[indexValid] = std::move(vinout[i]);
                 indexValid++;
             }
         }
@@ -414,19 +752,24 @@ public:
     void draw(cv::Mat out, const std::vector< Marker > &markers);
     // method to refine corner detection in case the internal border after threshold is found
     // This was tested in the context of chessboard methods
-    void findCornerMaxima(vector< cv::Point2f > &Corners, const cv::Mat &grey, int wsize);
+    // The Harris response is computed once per tile of the image, and shared by all the corners of the tile
+    void findCornerMaxima(vector< cv::Point2f > &Corners, const cv::Mat &grey, int wsize) const;
+    // moves each side of a marker to the strongest edge of grey within range pixels along its normal, and the corners
+    // to the intersections of the sides. The corners are kept if a side is not found
+    static void refineEdges(const cv::Mat &grey, vector< cv::Point2f > &corners, float range);
 
 
 
-    template < typename T > void joinVectors(vector< vector< T > > &vv, vector< T > &v, bool clearv = false) {
-        if (clearv)
-            v.clear();
-        for (size_t i = 0; i < vv.size(); i++)
-            for (size_t j = 0; j < vv[i].size(); j++)
-                v.push_back(vv[i][j]);
-    }
+    //threads of the parallel regions (see Params::_nThreads). The regions whose results are joined from the
+    //thread accumulators are statically scheduled, so the joined results are in index order whatever the count
+    int nThreads()const;
+    static int _sharedThreads;
 
-    vector<cv::Mat > imagePyramid;
+    std::vector<cv::Point> _roi;//polygon to which the detection is restricted (setROI). Empty for the whole image
+    //ids expected per labeler by the adaptive threshold levels (see setExpectedMarkers)
+    vector< std::set<int> > _expectedIds;
+    //state of the calls of the detect methods without a workspace
+    Workspace _ws;
 };
 };
 #endif
@@ -0,0 +1,167 @@
+/*****************************
+Copyright 2011 Rafael Muñoz Salinas. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY Rafael Muñoz Salinas ''AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Rafael Muñoz Salinas OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Rafael Muñoz Salinas.
+********************************/
+//warping of markers printed on a cylinder (Params::_cylinderWarp). Kept apart from markerdetector.cpp so that the
+//planar path does not carry it
+#include "markerdetector.h"
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <cstring>
+using namespace std;
+using namespace cv;
+
+namespace aruco {
+
+//index in the contour of each corner. The indices found by detectRectangles are used, and the others are searched
+static bool findCornerPointsInContour(const MarkerDetector::MarkerCandidate &cand, const vector< cv::Point > &contour, int idxs[4]) {
+    for (int i = 0; i < 4; i++) {
+        idxs[i] = cand.cornerIdx[i];
+        if (idxs[i] >= 0) continue;
+        cv::Point p(cand[i].x, cand[i].y);
+        for (size_t k = 0; k < contour.size() && idxs[i] < 0; k++)
+            if (contour[k] == p) idxs[i] = k;
+        if (idxs[i] < 0) return false;
+    }
+    return true;
+}
+
+//mean distance of the contour points from index a to b (excluded) to the line p1-p2
+static float meanSideDistance(const vector< cv::Point > &contour, size_t a, size_t b, cv::Point p1, cv::Point p2) {
+    //   d=|v^^·r|=(|(x_2-x_1)(y_1-y_0)-(x_1-x_0)(y_2-y_1)|)/(sqrt((x_2-x_1)^2+(y_2-y_1)^2)).
+    float dx = p2.x - p1.x, dy = p2.y - p1.y, sum = 0;
+    for (size_t j = a; j < b; j++)
+        sum += std::fabs(dx * (p1.y - contour[j].y) - (p1.x - contour[j].x) * dy);
+    return sum / std::sqrt(dx * dx + dy * dy);
+}
+
+//0 if the sides 0-1 and 2-3 are the ones deformed by the cylinder, 1 if they are 1-2 and 3-0
+static int findDeformedSidesIdx(const vector< cv::Point > &contour, const int idxSegments[4]) {
+    float distSum[4];
+    for (int i = 0; i < 3; i++)
+        distSum[i] = meanSideDistance(contour, idxSegments[i], idxSegments[i + 1], contour[idxSegments[i]], contour[idxSegments[i + 1]]) /
+                     float(idxSegments[i + 1] - idxSegments[i]);
+    // for the last one, which wraps around the end of the contour
+    cv::Point p1 = contour[idxSegments[0]], p2 = contour[idxSegments[3]];
+    distSum[3] = (meanSideDistance(contour, 0, idxSegments[0], p1, p2) + meanSideDistance(contour, idxSegments[3], contour.size(), p1, p2)) /
+                 float(idxSegments[0] + (contour.size() - idxSegments[3]));
+    // check the two combinations to see the one with higher error
+    return distSum[0] + distSum[2] > distSum[1] + distSum[3] ? 0 : 1;
+}
+
+static void setPointIntoImage(cv::Point2f &p, cv::Size s) {
+    p.x = std::min(std::max(p.x, 0.f), float(s.width - 1));
+    p.y = std::min(std::max(p.y, 0.f), float(s.height - 1));
+}
+
+/************************************
+ *
+ * Warps a candidate whose two opposite sides are bent by a cylinder into out, allocated with size if it is not
+ * already. The enlarged region of the candidate is warped, and each row is then shifted so that the marker starts
+ * where the contour crosses it. Only candidates of the full resolution image with their contour can be warped
+ *
+ ************************************/
+bool MarkerDetector::warp_cylinder(Mat &in, Mat &out, Size size, MarkerCandidate &mcand) const throw(cv::Exception) {
+
+    if (mcand.size() != 4)
+        throw cv::Exception(9001, "point.size()!=4", "MarkerDetector::warp_cylinder", __FILE__, __LINE__);
+    if (in.type() != CV_8UC1 || !mcand.hasContour())
+        return false;
+    vector< cv::Point > contour;
+    mcand.getContour(contour);
+
+    // find the 4 different segments of the contour
+    int idxSegments[4];
+    if (!findCornerPointsInContour(mcand, contour, idxSegments))
+        return false;
+    // let us rearrange the points so that the first corner is the one whith smaller idx
+    int minIdx = std::min_element(idxSegments, idxSegments + 4) - idxSegments;
+    std::rotate(idxSegments, idxSegments + minIdx, idxSegments + 4);
+    std::rotate(mcand.begin(), mcand.begin() + minIdx, mcand.end());
+    std::rotate(mcand.cornerIdx, mcand.cornerIdx + minIdx, mcand.cornerIdx + 4);
+    if (!std::is_sorted(idxSegments, idxSegments + 4))
+        return false;
+
+    // now, determine the sides that are deformated by cylinder perspective
+    int defrmdSide = findDeformedSidesIdx(contour, idxSegments);
+
+    // instead of removing perspective distortion  of the rectangular region
+    // given by the rectangle, we enlarge it a bit to include the deformed parts
+    Point2f enlargedRegion[4];
+    for (int i = 0; i < 4; i++) {
+        int other = defrmdSide == 0 ? 3 - i : i ^ 1;
+        enlargedRegion[i] = mcand[i] + (mcand[other] - mcand[i]) * 1.2;
+        setPointIntoImage(enlargedRegion[i], in.size());
+    }
+
+    // obtain the perspective transform
+    cv::Size enlargedSize = size;
+    enlargedSize.width += 2 * enlargedSize.width * 0.2;
+    Point2f pointsRes[4];
+    pointsRes[0] = (Point2f(0, 0));
+    pointsRes[1] = Point2f(enlargedSize.width - 1, 0);
+    pointsRes[2] = Point2f(enlargedSize.width - 1, enlargedSize.height - 1);
+    pointsRes[3] = Point2f(0, enlargedSize.height - 1);
+    // rotate to ensure that deformed sides are in the horizontal axis when warping
+    if (defrmdSide == 0)
+        rotate(pointsRes, pointsRes + 1, pointsRes + 4);
+    Mat M = cv::getPerspectiveTransform(enlargedRegion, pointsRes);
+    cv::Mat imAux(enlargedSize, CV_8UC1);
+    warpNearest(in, imAux, M.inv());
+
+    // the contour crosses each row of the warped image at its first and last columns. A contour point marks its row
+    // and the ones above and below, so that the rows between two distant points are covered
+    vector< int > rowStart(imAux.rows, imAux.cols), rowEnd(imAux.rows, -1);
+    const double *mptr = M.ptr< double >(0);
+    for (size_t i = 0; i < contour.size(); i++) {
+        float inX = contour[i].x;
+        float inY = contour[i].y;
+        float w = inX * mptr[6] + inY * mptr[7] + mptr[8];
+        int x = ((inX * mptr[0] + inY * mptr[1] + mptr[2]) / w) + 0.5;
+        int y = ((inX * mptr[3] + inY * mptr[4] + mptr[5]) / w) + 0.5;
+        x = std::min(std::max(x, 0), imAux.cols - 1);
+        y = std::min(std::max(y, 0), imAux.rows - 1);
+        for (int r = std::max(0, y - 1); r <= std::min(imAux.rows - 1, y + 1); r++) {
+            rowStart[r] = std::min(rowStart[r], x);
+            rowEnd[r] = std::max(rowEnd[r], x);
+        }
+    }
+
+    // shift the rows, and keep the central region with the size specified. The marker must cross at least half of each row
+    out.create(size, CV_8UC1);
+    for (int y = 0; y < out.rows; y++) {
+        int start = rowStart[y], end = rowEnd[y];
+        if (end <= start || (end - start) <= size.width >> 1)
+            return false;
+        int n = std::min(size.width, imAux.cols - start);
+        uchar *o = out.ptr< uchar >(y);
+        memcpy(o, imAux.ptr< uchar >(y) + start, n);
+        memset(o + n, 0, size.width - n);
+    }
+    return true;
+}
+};
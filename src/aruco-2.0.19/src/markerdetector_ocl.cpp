@@ -0,0 +1,89 @@
+/*****************************
+Copyright 2011 Rafael Muñoz Salinas. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY Rafael Muñoz Salinas ''AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Rafael Muñoz Salinas OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Rafael Muñoz Salinas.
+********************************/
+//OpenCL version of the image stages of the detection (Params::_useOpenCL), with the transparent API of OpenCV 3. Kept
+//apart from markerdetector.cpp, so that OpenCV 2 builds and the CPU path do not depend on it
+#include "markerdetector.h"
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#if CV_MAJOR_VERSION >= 3
+#include <opencv2/core/ocl.hpp>
+#endif
+using namespace std;
+using namespace cv;
+
+namespace aruco {
+
+/************************************
+ *
+ * Builds the pyramid and the threshold images of the candidate level on the device. Only the results are
+ * downloaded: every level of the pyramid, which the warps and the corner refinement sample on the CPU, and the
+ * threshold images, whose contours are extracted on the CPU
+ *
+ ************************************/
+bool MarkerDetector::deviceThreshold(Workspace &w, const Mat &grey, size_t nLevels, int candLevel, const vector<int> &p1_values) const {
+#if CV_MAJOR_VERSION >= 3
+    //the integral threshold of several window sizes has no device version
+    if (_params._thresMethod == ADPT_THRES_INTEGRAL || !cv::ocl::useOpenCL())
+        return false;
+    try {
+        vector< cv::UMat > levels(nLevels), thres(p1_values.size());
+        grey.copyTo(levels[0]);
+        for (size_t i = 1; i < nLevels; i++)
+            cv::pyrDown(levels[i - 1], levels[i]);
+        for (size_t i = 0; i < p1_values.size(); i++) {
+            double param1 = p1_values[i];
+            switch (_params._thresMethod) {
+            case FIXED_THRES:
+                cv::threshold(levels[candLevel], thres[i], param1, 255, THRESH_BINARY_INV);
+                break;
+            case ADPT_THRES: // ensure that param1%2==1, as in thresHold()
+                if (int(param1) % 2 != 1) param1 = int(param1 + 1);
+                cv::adaptiveThreshold(levels[candLevel], thres[i], 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, param1, _params._thresParam2);
+                break;
+            default: //CANNY
+                cv::Canny(levels[candLevel], thres[i], 10, 220);
+                break;
+            }
+        }
+        w.imagePyramid.resize(nLevels);
+        w.imagePyramid[0] = grey;
+        for (size_t i = 1; i < nLevels; i++)
+            levels[i].copyTo(w.imagePyramid[i]);
+        w.thres_images.resize(thres.size());
+        for (size_t i = 0; i < thres.size(); i++)
+            thres[i].copyTo(w.thres_images[i]);
+    } catch (cv::Exception &) { //the device failed: the CPU computes everything again
+        return false;
+    }
+    return true;
+#else
+    (void)w; (void)grey; (void)nLevels; (void)candLevel; (void)p1_values;
+    return false;
+#endif
+}
+};
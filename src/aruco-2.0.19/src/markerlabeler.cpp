@@ -6,9 +6,8 @@
 namespace aruco{
 cv::Ptr<MarkerLabeler> MarkerLabeler::create(Dictionary::DICT_TYPES dict_type,float error_correction_rate)throw (cv::Exception)
 {
-    Dictionary dict=Dictionary::loadPredefined(dict_type);
     DictionaryBased *db=new DictionaryBased();
-    db->setParams(dict,error_correction_rate);
+    db->setParams(Dictionary::getPredefined(dict_type),error_correction_rate);
     return db;
 
 }
@@ -28,10 +27,11 @@ cv::Ptr<MarkerLabeler> MarkerLabeler::create(std::string detector,std::string pa
 #endif
     }
     else{
-        Dictionary dict=Dictionary::load( detector);
-        //try with one from file
         DictionaryBased *db=new DictionaryBased();
-        db->setParams(dict,std::stof(params));
+        if (Dictionary::isPredefinedDictinaryString(detector))
+            db->setParams(Dictionary::getPredefined(detector),std::stof(params));
+        else//try with one from file
+            db->setParams(Dictionary::loadFromFile(detector),std::stof(params));
         return db;
     }
 
@@ -39,5 +39,14 @@ cv::Ptr<MarkerLabeler> MarkerLabeler::create(std::string detector,std::string pa
 
 }
 
+cv::Ptr<MarkerLabeler> MarkerLabeler::create(std::string dict_type,float error_correction_rate,const std::vector<int> &ids)throw (cv::Exception){
+    if (ids.empty()) return create(dict_type,std::to_string(error_correction_rate));
+    std::shared_ptr<const Dictionary> dict=Dictionary::isPredefinedDictinaryString(dict_type) ?
+                Dictionary::getPredefined(dict_type) : std::make_shared<const Dictionary>(Dictionary::loadFromFile(dict_type));
+    DictionaryBased *db=new DictionaryBased();
+    db->setParams(dict->subset(ids),error_correction_rate);
+    return db;
+}
+
 
 }
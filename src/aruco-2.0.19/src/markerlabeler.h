@@ -29,6 +29,7 @@ or implied, of Rafael Muñoz Salinas.
 #define _aruco_detector_
 #include "exports.h"
 #include <opencv2/core/core.hpp>
+#include <vector>
 #include "dictionary.h"
 namespace aruco {
 
@@ -65,6 +66,12 @@ public:
      */
     static cv::Ptr<MarkerLabeler> create(std::string detector,std::string params="")throw (cv::Exception);
 
+    /** Factory function that returns a labeler of the dictionary dict_type (predefined or a file, see create) that only
+     * identifies the markers of the ids given (see Dictionary::subset). The lookups and the error correction only
+     * consider their codes, so a marker of another id is rejected as any non marker. An empty ids keeps all of them
+     */
+    static cv::Ptr<MarkerLabeler> create(std::string dict_type,float error_correction_rate,const std::vector<int> &ids)throw (cv::Exception);
+
     /** function that identifies a marker.
      * @param in input image to analyze
      * @param marker_id id of the marker (if valid)
@@ -74,12 +81,36 @@ public:
      */
      virtual bool detect(const cv::Mat &in, int & marker_id,int &nRotations)=0;
 
+    /** identifies several patches at once. found[i] tells if in[i] is a valid marker, and marker_ids[i] and nRotations[i]
+     * are then as in detect. The default calls detect on each patch. Labelers that classify all the patches together
+     * override it, and return true in batched
+     */
+    virtual void detectBatch(const std::vector<cv::Mat> &in, std::vector<int> &marker_ids, std::vector<int> &nRotations,
+                             std::vector<char> &found){
+        marker_ids.assign(in.size(),-1);
+        nRotations.assign(in.size(),0);
+        found.assign(in.size(),0);
+        for(size_t i=0;i<in.size();i++)
+            found[i]=detect(in[i],marker_ids[i],nRotations[i]);
+    }
+    /**
+     * @brief batched if true, the detector passes all the warped candidates of an image to detectBatch at once instead
+     * of calling detect on each one as soon as it is warped
+     */
+    virtual bool batched()const{return false;}
+
     /**
      * @brief getBestInputSize if desired, you can set the desired input size to the detect function
      * @return -1 if detect accept any type of input, or a size otherwise
      */
     virtual int getBestInputSize(){return -1;}
 
+    /**
+     * @brief setCellThreshold if true, labelers that can read the bits from the mean grey of each cell instead of
+     * thresholding the patch do so (see MarkerDetector::Params::_cellThreshold). The default ignores it
+     */
+    virtual void setCellThreshold(bool){}
+
 
     //returns an string that describes the labeler and can be used to create it
     virtual std::string getName()const=0;
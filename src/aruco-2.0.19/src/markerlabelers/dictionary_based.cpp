@@ -3,17 +3,92 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <bitset>
 #include <cmath>
+#include <algorithm>
 namespace aruco{
 
+//labeling kernels of a grid of N x N bits, for the patches of the default warp size (56 pixels), whose cells are S
+//pixels wide. The bounds of every loop are constant, so the compiler unrolls the cell sums and the rotation
+template<int N> struct FixedGrid{
+    static const int N2=N+2, S=56/N2;
+    //sum of the grey levels of each cell of the patch
+    static void cellSums(const cv::Mat &patch, int *cells){
+        for(int cy=0;cy<N2;cy++){
+            int *c=cells+cy*N2;
+            for(int y=cy*S;y<(cy+1)*S;y++){
+                const uchar *row=patch.ptr<uchar>(y);
+                for(int cx=0;cx<N2;cx++){
+                    int sum=0;
+                    for(int x=0;x<S;x++) sum+=row[cx*S+x];
+                    c[cx]+=sum;
+                }
+            }
+        }
+    }
+    //the code rotated 90 degrees, as DictionaryBased::rotate
+    static uint64_t rotate(uint64_t code){
+        uint64_t out=0;
+        for(int y=0;y<N;y++)
+            for(int x=0;x<N;x++)
+                out|=((code>>((N-1-y)*N+(N-1-x)))&1)<<((N-1-x)*N+y);
+        return out;
+    }
+};
+
+template<int N> static void setFixedGrid(void (*&cellSums)(const cv::Mat &,int *), uint64_t (*&rotate)(uint64_t), int &swidth){
+    cellSums=FixedGrid<N>::cellSums;
+    rotate=FixedGrid<N>::rotate;
+    swidth=FixedGrid<N>::S;
+}
+
 void DictionaryBased::setParams(const Dictionary &dic,float max_correction_rate){
+    setParams(std::make_shared<const Dictionary>(dic),max_correction_rate);
+}
+
+void DictionaryBased::setParams(std::shared_ptr<const Dictionary> dic,float max_correction_rate){
     _dic=dic;
     max_correction_rate=std::max(0.f,std::min(1.0f,max_correction_rate));
-    _maxCorrectionAllowed=float(_dic.tau())*max_correction_rate;
+    _maxCorrectionAllowed=float(_dic->tau())*max_correction_rate;
 
+    //bit k of a code is the cell (y,x) with k=(n-1-y)*n+(n-1-x). A rotation moves the cell (y,x) to (x,n-1-y)
+    int n=sqrt(_dic->nbits());
+    for(int k=0;k<64;k++) _rotBit[k]=k;
+    for(int y=0;y<n;y++)
+        for(int x=0;x<n;x++)
+            _rotBit[(n-1-y)*n+(n-1-x)]=(n-1-x)*n+y;
+
+    //the grid sizes of the predefined dictionaries have their own kernels
+    _fixedCellSums=nullptr;_fixedRotate=nullptr;_fixedSwidth=0;
+    switch(n*n==int(_dic->nbits()) ? n : 0){
+    case 4: setFixedGrid<4>(_fixedCellSums,_fixedRotate,_fixedSwidth); break;
+    case 5: setFixedGrid<5>(_fixedCellSums,_fixedRotate,_fixedSwidth); break;
+    case 6: setFixedGrid<6>(_fixedCellSums,_fixedRotate,_fixedSwidth); break;
+    case 7: setFixedGrid<7>(_fixedCellSums,_fixedRotate,_fixedSwidth); break;
+    case 8: setFixedGrid<8>(_fixedCellSums,_fixedRotate,_fixedSwidth); break;
+    }
+
+    buildCorrectionIndex();
+}
+
+void DictionaryBased::buildCorrectionIndex(){
+    _partShift.clear();_partBits.clear();_partIndex.clear();
+    if (_maxCorrectionAllowed<=0) return;
+    int nbits=_dic->nbits();
+    int nParts=std::min(_maxCorrectionAllowed,nbits);
+    for(int p=0;p<nParts;p++){
+        int start=p*nbits/nParts,end=(p+1)*nbits/nParts;
+        _partShift.push_back(start);
+        _partBits.push_back(end-start);
+    }
+    _partIndex.resize(nParts);
+    for(auto ci:_dic->getMapCode())
+        for(int p=0;p<nParts;p++){
+            uint64_t key=(ci.first>>_partShift[p])&partMask(p);
+            _partIndex[p][key].push_back(std::make_pair(ci.first,int(ci.second)));
+        }
 }
 
 std::string DictionaryBased::getName()const{
-    return aruco::Dictionary::getTypeString( _dic.getType());
+    return aruco::Dictionary::getTypeString( _dic->getType());
 }
 
 void DictionaryBased::toMat(uint64_t code,int nbits_sq,cv::Mat  &out) {
@@ -38,18 +113,24 @@ bool DictionaryBased::detect(const cv::Mat &in, int & marker_id,int &nRotations)
     cv::Mat grey;
     if (in.type() == CV_8UC1) grey = in;
     else cv::cvtColor(in, grey, CV_BGR2GRAY);
-    // threshold image
-    cv::threshold(grey, grey, 125, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
 
-     std::vector<uint64_t> ids;
+     uint64_t ids[4];
     //get the ids in the four rotations (if possible)
-    if ( !getInnerCode( grey,_dic.nbits(),ids)) return false;
+    if (_cellThreshold){
+        if ( !getCellMeanCode( grey,_dic->nbits(),ids)) return false;
+    }
+    else{
+        // threshold image
+        cv::threshold(grey, grey, 125, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+        if ( !getInnerCode( grey,_dic->nbits(),ids)) return false;
+    }
 
      //find the best one
     for(int i=0;i<4;i++){
-            if ( _dic.is(ids[i])){//is in the set?
+            int id=_dic->find(ids[i]);
+            if ( id!=-1){//is in the set?
                 nRotations=i;//how many rotations are and its id
-                marker_id=_dic[ids[i]];
+                marker_id=id;
                 return true;//bye bye
             }
     }
@@ -57,87 +138,141 @@ bool DictionaryBased::detect(const cv::Mat &in, int & marker_id,int &nRotations)
     //you get here, no valid id :(
     //lets try error correction
 
+    //only the codes that share a part with a rotation can be near enough. The nearest one is taken
     if(_maxCorrectionAllowed>0){//find distance to map elements
-        for(auto ci:_dic.getMapCode()){
-            for(int i=0;i<4;i++){
-                if (hamm_distance(ci.first,ids[i])<_maxCorrectionAllowed){
-                    marker_id=ci.second;
-                    nRotations=i;
-                    return true;
+        int bestDist=_maxCorrectionAllowed;
+        for(int i=0;i<4;i++){
+            for(size_t p=0;p<_partIndex.size();p++){
+                uint64_t key=(ids[i]>>_partShift[p])&partMask(p);
+                auto it=_partIndex[p].find(key);
+                if (it==_partIndex[p].end()) continue;
+                for(auto &ci:it->second){
+                    int dist=hamm_distance(ci.first,ids[i]);
+                    if (dist<bestDist){
+                        bestDist=dist;
+                        marker_id=ci.second;
+                        nRotations=i;
+                    }
                 }
             }
         }
+        return bestDist<_maxCorrectionAllowed;
     }
-    else  return false;
+    return false;
 
  }
 
- bool DictionaryBased::getInnerCode(const cv::Mat &thres_img,int total_nbits,std::vector<uint64_t> &ids){
+//adds the grey levels of one patch row to the sum of each of its cells of swidth pixels
+ARUCO_DISPATCH static void sumCellRow(const uchar *row, int *cells, int nCells, int swidth) {
+    for (int cx = 0; cx < nCells; cx++) {
+        const uchar *p = row + cx*swidth;
+        int sum = 0;
+        for (int x = 0; x < swidth; x++) sum += p[x];
+        cells[cx] += sum;
+    }
+}
+
+//sums of the grey levels of the bits_a2 x bits_a2 cells of swidth pixels of a patch, in a single pass. The labeler is
+//shared by the threads of the identification, so the sums are not kept in it
+void DictionaryBased::cellSums(const cv::Mat &patch, int bits_a2, int swidth, int *cells) const {
+    std::fill(cells, cells + bits_a2*bits_a2, 0);
+    if (_fixedCellSums && swidth == _fixedSwidth) {
+        _fixedCellSums(patch, cells);
+        return;
+    }
+    for (int y = 0; y < bits_a2*swidth; y++)
+        sumCellRow(patch.ptr<uchar>(y), &cells[(y / swidth) * bits_a2], bits_a2, swidth);
+}
+
+ bool DictionaryBased::getInnerCode(const cv::Mat &thres_img,int total_nbits,uint64_t ids[4]){
      int bits_a=sqrt(total_nbits);
     int bits_a2=bits_a+2;
     // Markers  are divided in (bits_a+2)x(bits_a+2) regions, of which the inner bits_axbits_a belongs to marker info
     // the external border shoould be entirely black
 
     int swidth = thres_img.rows / bits_a2;
+    //the patch is 0 or 255, so a cell is white when more than half of its pixels are, that is, its sum is above
+    int half = 255 * ((swidth * swidth) / 2);
+
+    //at most 8x8 bits, so 10x10 cells
+    int cellCount[100];
+    cellSums(thres_img, bits_a2, swidth, cellCount);
+
     for (int y = 0; y < bits_a2; y++) {
         int inc = bits_a2-1;
         if (y == 0 || y == bits_a2-1)
             inc = 1; // for first and last row, check the whole border
-        for (int x = 0; x < bits_a2; x += inc) {
-            cv::Mat square = thres_img(cv::Rect(x*swidth, y*swidth, swidth, swidth));
-            if (cv::countNonZero(square) > (swidth * swidth) / 2)
+        for (int x = 0; x < bits_a2; x += inc)
+            if (cellCount[y*bits_a2+x] > half)
                 return false; // can not be a marker because the border element is not black!
-        }
     }
 
-     // now,
-    // get information(for each inner square, determine if it is  black or white)
-
-    // now,
-    cv::Mat _bits = cv::Mat::zeros(bits_a, bits_a, CV_8UC1);
     // get information(for each inner square, determine if it is  black or white)
+    // The first bit read is the most significant one, as the bits are packed from the last cell
+    uint64_t code = 0;
+    for (int y = 0; y < bits_a; y++)
+        for (int x = 0; x < bits_a; x++)
+            code = (code << 1) | (uint64_t)(cellCount[(y+1)*bits_a2+x+1] > half);
 
-    for (int y = 0; y < bits_a; y++) {
-
-        for (int x = 0; x < bits_a; x++) {
-            int Xstart = (x + 1) * (swidth);
-            int Ystart = (y + 1) * (swidth);
-            cv::Mat square = thres_img(cv::Rect(Xstart, Ystart, swidth, swidth));
-            int nZ = cv::countNonZero(square);
-            if (nZ > (swidth * swidth) / 2)
-                _bits.at< uchar >(y, x) = 1;
-        }
+    //now, get the 64bits ids in the four rotations
+    for (int nr = 0; nr < 4; nr++) {
+        ids[nr] = code;
+        code = rotate(code);
     }
-    //now, get the 64bits ids
-
-    int nr=0;
-    do{
-        ids.push_back(touulong(_bits));
-        _bits=rotate(_bits);
-        nr++;
-    }while(nr<4);
      return true;
  }
 
- //convert matrix of (0,1)s in a 64 bit value
- uint64_t DictionaryBased::touulong(const cv::Mat &code){
+ bool DictionaryBased::getCellMeanCode(const cv::Mat &grey,int total_nbits,uint64_t ids[4]){
+    int bits_a=sqrt(total_nbits);
+    int bits_a2=bits_a+2;
+    int swidth = grey.rows / bits_a2;
+    int area = swidth * swidth;
+    int cellSum[100];
+    cellSums(grey, bits_a2, swidth, cellSum);
 
-     std::bitset<64> bits;
-     int bidx=0;
-     for (int y = code.rows-1; y >=0 ; y--)
-         for (int x =  code.cols-1; x >=0; x--)
-             bits[bidx++]=code.at<uchar>(y,x);
-     return bits.to_ullong();
+    //the border must be darker than the brightest inner cell. Candidates that are not markers fail here, before
+    //the means are sorted
+    const int minContrast = 16 * area;
+    int borderMax = 0, innerMax = 0;
+    for (int y = 0; y < bits_a2; y++)
+        for (int x = 0; x < bits_a2; x++) {
+            bool border = y == 0 || y == bits_a2-1 || x == 0 || x == bits_a2-1;
+            int &m = border ? borderMax : innerMax;
+            m = std::max(m, cellSum[y*bits_a2+x]);
+        }
+    if (innerMax - borderMax < minContrast) return false;
 
+    //the black and white cells are split at the largest gap between the sorted means, above the border ones
+    int sorted[100];
+    int n = 0;
+    for (int i = 0; i < bits_a2*bits_a2; i++)
+        if (cellSum[i] >= borderMax) sorted[n++] = cellSum[i];
+    std::sort(sorted, sorted + n);
+    int bestGap = -1, thres = borderMax;
+    for (int i = 0; i + 1 < n; i++)
+        if (sorted[i+1] - sorted[i] > bestGap) {
+            bestGap = sorted[i+1] - sorted[i];
+            thres = sorted[i] + bestGap / 2;
+        }
+
+    // The first bit read is the most significant one, as the bits are packed from the last cell
+    uint64_t code = 0;
+    for (int y = 0; y < bits_a; y++)
+        for (int x = 0; x < bits_a; x++)
+            code = (code << 1) | (uint64_t)(cellSum[(y+1)*bits_a2+x+1] > thres);
+
+    for (int nr = 0; nr < 4; nr++) {
+        ids[nr] = code;
+        code = rotate(code);
+    }
+    return true;
  }
- cv::Mat DictionaryBased::rotate(const cv::Mat &in) {
-     cv::Mat out;
-     in.copyTo(out);
-     for (int i = 0; i < in.rows; i++) {
-         for (int j = 0; j < in.cols; j++) {
-             out.at< uchar >(i, j) = in.at< uchar >(in.cols - j - 1, i);
-         }
-     }
+
+ uint64_t DictionaryBased::rotate(uint64_t code) const {
+     if (_fixedRotate) return _fixedRotate(code);
+     uint64_t out = 0;
+     for (int k = 0; code != 0; k++, code >>= 1)
+         if (code & 1) out |= uint64_t(1) << _rotBit[k];
      return out;
  }
 
@@ -31,6 +31,8 @@ or implied, of Rafael Muñoz Salinas.
 #include <opencv2/core/core.hpp>
 #include "../markerlabeler.h"
 #include "../dictionary.h"
+#include <unordered_map>
+#include <memory>
 namespace aruco {
 /**Labeler using a dictionary
  */
@@ -40,19 +42,45 @@ public:
     virtual ~DictionaryBased(){}
     //first, dictionary, second the maximum correction rate [0,1]. If 0,no correction, if 1, maximum allowed correction
     void setParams(const Dictionary &dic,float max_correction_rate);
+    //same as above, but shares the dictionary instead of copying it. Use it with Dictionary::getPredefined
+    void setParams(std::shared_ptr<const Dictionary> dic,float max_correction_rate);
 
     //main virtual class to o detection
     bool detect(const cv::Mat &in, int & marker_id,int &nRotations) ;
     //returns the dictionary name
     std::string getName()const;
+    //reads the bits from the cell means instead of the Otsu threshold of the patch
+    void setCellThreshold(bool enable){_cellThreshold=enable;}
 
 private:
 
-    bool  getInnerCode(const cv::Mat &thres_img, int total_nbits, std::vector<uint64_t> &ids);
-    cv::Mat rotate(const cv::Mat &in) ;
-    uint64_t touulong(const cv::Mat &code);
-    Dictionary _dic;
+    //gets the code of the marker in its four rotations. The cells are counted in a single pass over the image
+    bool  getInnerCode(const cv::Mat &thres_img, int total_nbits, uint64_t ids[4]);
+    //same from the grey patch: the border must be darker than the brightest inner cell, and the cell means are split
+    //at the largest gap above the border ones
+    bool  getCellMeanCode(const cv::Mat &grey, int total_nbits, uint64_t ids[4]);
+    bool _cellThreshold=false;
+    //sums of the grey levels of the cells of a patch, with the kernel of the grid size if swidth is that of its cells
+    void cellSums(const cv::Mat &patch, int bits_a2, int swidth, int *cells) const;
+    //rotates a code 90 degrees, moving each bit to its position in _rotBit
+    uint64_t rotate(uint64_t code) const;
+    //kernels of the grid size of the dictionary, for the cells of swidth pixels of the default warp size (FixedGrid
+    //in dictionary_based.cpp). Null if the grid has none
+    void (*_fixedCellSums)(const cv::Mat &patch, int *cells)=nullptr;
+    uint64_t (*_fixedRotate)(uint64_t code)=nullptr;
+    int _fixedSwidth=0;
+    std::shared_ptr<const Dictionary> _dic;
     int _maxCorrectionAllowed;
+    //destination bit of each bit of a code when the marker is rotated
+    int _rotBit[64];
+
+    //Multi-index for error correction. The code bits are split in _maxCorrectionAllowed parts, so a code
+    //with less than _maxCorrectionAllowed wrong bits has at least one part equal to the dictionary code.
+    //Each part is indexed by its value, so only the codes sharing a part are compared
+    void buildCorrectionIndex();
+    uint64_t partMask(int p) const { return _partBits[p]>=64 ? ~uint64_t(0) : (uint64_t(1)<<_partBits[p])-1; }
+    std::vector<int> _partShift, _partBits;
+    std::vector<std::unordered_map<uint64_t,std::vector<std::pair<uint64_t,int> > > > _partIndex;
      void toMat(uint64_t code,int nbits_sq,cv::Mat  &out) ;
 
 
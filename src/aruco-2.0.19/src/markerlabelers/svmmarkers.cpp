@@ -103,11 +103,8 @@ public:
 
 
 
-    /**
- */
-    bool  detect(const cv::Mat &in, int &mid,int &nRotations) {
-
-
+    //writes the features of a patch into a row of _patchSize*_patchSize floats. resized is a buffer for the resized patch
+    void extractFeatures(const cv::Mat &in, cv::Mat &resized, cv::Mat row) const {
         // convert to gray
         assert(in.rows == in.cols);
         cv::Mat grey;
@@ -117,19 +114,20 @@ public:
             cv::cvtColor(in, grey, CV_BGR2GRAY);
 
         // resize to svm path size
-        cv::Mat greyResized;
         if(grey.cols != _patchSize)
-            cv::resize(grey, greyResized, cv::Size(_patchSize, _patchSize) );
-        else
-            greyResized = grey;
+            cv::resize(grey, resized, cv::Size(_patchSize, _patchSize) );
+
+        // normalize image range, directly into the row
+        cv::Mat normalized = row.reshape(1, _patchSize);
+        cv::normalize(grey.cols != _patchSize ? resized : grey, normalized, _minFeatureValue, _maxFeatureValue, cv::NORM_MINMAX, CV_32FC1);
+    }
 
-        // normalize image range
-        cv::Mat greyResizedNormalized;
-        cv::normalize(greyResized, greyResizedNormalized, _minFeatureValue, _maxFeatureValue, cv::NORM_MINMAX, CV_32FC1);
+    /**
+ */
+    bool  detect(const cv::Mat &in, int &mid,int &nRotations) {
 
-        // rearrange data in a row
-        cv::Mat dataRow;
-        dataRow = greyResizedNormalized.reshape(1,1);
+        cv::Mat resized, dataRow(1, _patchSize*_patchSize, CV_32FC1);
+        extractFeatures(in, resized, dataRow);
 
         // predict id with svm
 #if  CV_VERSION_MAJOR >= 3
@@ -137,7 +135,27 @@ public:
 #else
         int predict_id = (int)_model->predict(dataRow, true);
 #endif
+        return decode(predict_id, mid, nRotations);
+    }
+
+    //features of all the patches in one matrix, classified by a single predict call
+    void detectBatch(const vector<cv::Mat> &in, vector<int> &mids, vector<int> &nRotations, vector<char> &found) {
+        int n = in.size();
+        mids.assign(n, -1);
+        nRotations.assign(n, 0);
+        found.assign(n, 0);
+        if (n == 0) return;
+        //the buffers are local, so that detectors sharing the labeler may classify at once
+        cv::Mat features(n, _patchSize*_patchSize, CV_32FC1), resized, results;
+        for (int i = 0; i < n; i++)
+            extractFeatures(in[i], resized, features.row(i));
+        _model->predict(features, results);
+        for (int i = 0; i < n; i++)
+            found[i] = decode(cvRound(results.at<float>(i)), mids[i], nRotations[i]);
+    }
 
+    //the marker id and rotation of an svm class
+    bool decode(int predict_id, int &mid, int &nRotations) const {
         // get rotation of marker
         nRotations = predict_id%4;
         // if _rotateMarkers, interchange rotation 1 and 3
@@ -170,6 +188,8 @@ bool SVMMarkers::load(string path)throw (cv::Exception){
  * Assign the detected rotation of the marker to nRotation
  */
 bool SVMMarkers::detect(const cv::Mat &in, int &marker_id, int &nRotations) { return _impl->detect(in,marker_id,nRotations);}
+void SVMMarkers::detectBatch(const std::vector<cv::Mat> &in, std::vector<int> &marker_ids, std::vector<int> &nRotations,
+                             std::vector<char> &found) { _impl->detectBatch(in,marker_ids,nRotations,found);}
 int SVMMarkers::getBestInputSize(){return _impl->getBestInputSize();}
 
 }
@@ -64,6 +64,12 @@ class   SVMMarkers: public MarkerLabeler {
      * Assign the detected rotation of the marker to nRotation
      */
      bool detect(const cv::Mat &in, int & marker_id,int &nRotations) ;
+     /**
+      * The features of all the patches go into one matrix, which is classified with a single predict call
+      */
+     void detectBatch(const std::vector<cv::Mat> &in, std::vector<int> &marker_ids, std::vector<int> &nRotations,
+                      std::vector<char> &found);
+     bool batched()const{return true;}
      int getBestInputSize();
 };
 
@@ -31,7 +31,13 @@ or implied, of Rafael Muñoz Salinas.
 #include <opencv2/highgui/highgui.hpp>
 
 #include <fstream>
+#include <cstring>
+#include <random>
+#include <numeric>
 #include "dictionary.h"
+#include "ar_omp.h"
+#include "ippe.h"
+#include "projectionkernel.h"
 using namespace std;
 using namespace cv;
 namespace aruco {
@@ -87,12 +93,106 @@ void MarkerMap::saveToFile(cv::FileStorage &fs) throw(cv::Exception) {
 *
 */
 void MarkerMap::readFromFile(string sfile) throw(cv::Exception) {
+    //the binary copy is used if it was written from this same file
+    uint64_t hash=fileHash(sfile);
+    if (hash!=0 && readFromBinary(sfile+".bin",hash))
+        return;
     try {
         cv::FileStorage fs(sfile, cv::FileStorage::READ);
         readFromFile(fs);
     } catch (std::exception &ex) {
         throw cv::Exception(81818, "MarkerMap::readFromFile", ex.what() + string(" file=)") + sfile, __FILE__, __LINE__);
     }
+    if (hash!=0)
+        saveToBinary(sfile+".bin",hash);
+}
+
+/**hash (FNV-1a) of the bytes of a file, or 0 if it can not be read
+*/
+uint64_t MarkerMap::fileHash(const string &sfile) {
+    ifstream file(sfile.c_str(), ios::binary);
+    if (!file)
+        return 0;
+    uint64_t h = 1469598103934665603ULL;
+    char buf[4096];
+    while (file.read(buf, sizeof(buf)) || file.gcount() > 0) {
+        for (streamsize i = 0; i < file.gcount(); i++) {
+            h ^= (unsigned char)buf[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+//binary copy of a map file: "AMMB", the version, the hash of the source file, the info type, the dictionary, and the
+//id and corners of every marker
+static const char binaryMagic[4] = {'A', 'M', 'M', 'B'};
+static const uint32_t binaryVersion = 1;
+
+/**Reads the binary copy of a map file, written by saveToBinary. Returns false if it does not exist or if it was not
+ * written from a file with this hash
+*/
+bool MarkerMap::readFromBinary(const string &bfile, uint64_t hash) {
+    ifstream file(bfile.c_str(), ios::binary);
+    char magic[4];
+    uint32_t version, nmarkers, nchars;
+    uint64_t fhash;
+    int32_t type;
+    if (!file.read(magic, 4) || memcmp(magic, binaryMagic, 4) != 0 || !file.read((char *)&version, sizeof(version)) ||
+        version != binaryVersion || !file.read((char *)&fhash, sizeof(fhash)) || fhash != hash)
+        return false;
+    file.read((char *)&type, sizeof(type));
+    file.read((char *)&nchars, sizeof(nchars));
+    if (!file || nchars > 4096)
+        return false;
+    string dict(nchars, ' ');
+    file.read(&dict[0], nchars);
+    file.read((char *)&nmarkers, sizeof(nmarkers));
+    if (!file)
+        return false;
+    vector< Marker3DInfo > markers(nmarkers);
+    for (auto &m : markers) {
+        int32_t id;
+        uint32_t ncorners;
+        file.read((char *)&id, sizeof(id));
+        file.read((char *)&ncorners, sizeof(ncorners));
+        if (!file || ncorners > 4096)
+            return false;
+        m.id = id;
+        m.resize(ncorners);
+        file.read((char *)m.data(), ncorners * sizeof(cv::Point3f));
+    }
+    if (!file)
+        return false;
+    vector< Marker3DInfo >::swap(markers);
+    mInfoType = type;
+    dictionary = dict;
+    updateIdIndex();
+    return true;
+}
+
+/**Writes the binary copy of a map file read from a file with this hash. Nothing is written if the file can not be created
+*/
+void MarkerMap::saveToBinary(const string &bfile, uint64_t hash) const {
+    ofstream file(bfile.c_str(), ios::binary);
+    if (!file)
+        return;
+    int32_t type = mInfoType;
+    uint32_t nchars = dictionary.size(), nmarkers = size();
+    file.write(binaryMagic, 4);
+    file.write((const char *)&binaryVersion, sizeof(binaryVersion));
+    file.write((const char *)&hash, sizeof(hash));
+    file.write((const char *)&type, sizeof(type));
+    file.write((const char *)&nchars, sizeof(nchars));
+    file.write(dictionary.data(), nchars);
+    file.write((const char *)&nmarkers, sizeof(nmarkers));
+    for (const auto &m : *this) {
+        int32_t id = m.id;
+        uint32_t ncorners = m.size();
+        file.write((const char *)&id, sizeof(id));
+        file.write((const char *)&ncorners, sizeof(ncorners));
+        file.write((const char *)m.data(), ncorners * sizeof(cv::Point3f));
+    }
 }
 
 
@@ -124,12 +224,40 @@ void MarkerMap::readFromFile(cv::FileStorage &fs) throw(cv::Exception) {
     if (fs["aruco_bc_dict"].name()=="aruco_bc_dict")
      fs["aruco_bc_dict"] >> dictionary;
 
+    updateIdIndex();
 }
 
 /**
  */
-int MarkerMap::getIndexOfMarkerId(int id) const {
+void MarkerMap::updateIdIndex() {
+    int maxId = -1;
+    for (size_t i = 0; i < size(); i++)
+        maxId = max(maxId, at(i).id);
+    idIndex.assign(maxId + 1, -1);
+    for (size_t i = 0; i < size(); i++)
+        if (at(i).id >= 0 && idIndex[at(i).id] == -1)
+            idIndex[at(i).id] = i;
+    std::shared_ptr<std::vector<cv::Point3f> > corners=std::make_shared<std::vector<cv::Point3f> >();
+    corners->reserve(4 * size());
+    for (size_t i = 0; i < size(); i++) {
+        if (at(i).size() != 4) {
+            flatCorners.reset();
+            return;
+        }
+        corners->insert(corners->end(), at(i).begin(), at(i).end());
+    }
+    flatCorners = corners;
+}
 
+/**
+ */
+int MarkerMap::getIndexOfMarkerId(int id) const {
+    //use the table if it has been built, otherwise search linearly
+    if (!idIndex.empty()) {
+        if (id < 0 || id >= (int)idIndex.size())
+            return -1;
+        return idIndex[id];
+    }
     for (size_t i = 0; i < size(); i++)
         if (at(i).id == id)
             return i;
@@ -139,9 +267,9 @@ int MarkerMap::getIndexOfMarkerId(int id) const {
 /**
  */
 const Marker3DInfo &MarkerMap::getMarker3DInfo(int id) const throw(cv::Exception) {
-    for (size_t i = 0; i < size(); i++)
-        if (at(i).id == id)
-            return at(i);
+    int index = getIndexOfMarkerId(id);
+    if (index != -1)
+        return at(index);
     throw cv::Exception(111, "MarkerMap::getMarker3DInfo", "Marker with the id given is not found", __FILE__, __LINE__);
 }
 
@@ -309,20 +437,19 @@ MarkerMap   MarkerMap::convertToMeters(float markerSize_meters)throw (cv::Except
         for (int c = 0; c < 4; c++) {
             BInfo[i][c] *= pixSize;
         }
+    BInfo.updateIdIndex();
     return BInfo;
 }
-cv::Mat MarkerMap::getImage(float METER2PIX)const throw (cv::Exception){
-
-    if (mInfoType==NONE)
+//limits of the image of the map, in the pixels of its corners
+static void imageLimits(const MarkerMap &map,float METER2PIX,cv::Point &pmin,cv::Point &pmax){
+    if (map.mInfoType==MarkerMap::NONE)
         throw cv::Exception(-1,"The board is not valid mInfoType==NONE  ",  "MarkerMap::getImage", __FILE__, __LINE__);
-    if (METER2PIX<=0 && mInfoType!=PIX)
+    if (METER2PIX<=0 && map.mInfoType!=MarkerMap::PIX)
         throw cv::Exception(-1,"The board is not expressed in pixels and not METER2PIX indicated",  "MarkerMap::getImage", __FILE__, __LINE__);
 
-    auto Dict=Dictionary::loadPredefined(dictionary);
-
-    //get image limits
-    cv::Point pmin(std::numeric_limits<int>::max(),std::numeric_limits<int>::max()),pmax(std::numeric_limits<int>::lowest(),std::numeric_limits<int>::lowest());
-    for(auto b:*this){
+    pmin=cv::Point(std::numeric_limits<int>::max(),std::numeric_limits<int>::max());
+    pmax=cv::Point(std::numeric_limits<int>::lowest(),std::numeric_limits<int>::lowest());
+    for(auto &b:map){
         for(auto p:b){
             pmin.x=min(int(p.x),pmin.x);
             pmin.y=min(int(p.y),pmin.y);
@@ -331,48 +458,57 @@ cv::Mat MarkerMap::getImage(float METER2PIX)const throw (cv::Exception){
             assert(p.z==0);
         }
     }
+}
 
+cv::Size MarkerMap::getImageSize(float METER2PIX)const throw (cv::Exception){
+    cv::Point pmin,pmax;
+    imageLimits(*this,METER2PIX,pmin,pmax);
     cv::Point psize=pmax-pmin;
-     cv::Mat image(cv::Size( psize.x,psize.y),CV_8UC1);
-    image.setTo(cv::Scalar::all(255));
-
-    vector<Marker3DInfo> p3d=*this;
-    //the points must be moved from a real reference system to image reference sysmte (y positive is inverse)
-     for(auto &m:p3d)
-        for(auto &p:m){
-        p-=cv::Point3f(pmin.x,pmax.y,0);
-        //now, use inverse y
-        p.y=-p.y;
-    }
-    for(auto m:p3d)
+    return cv::Size(psize.x,psize.y);
+}
+
+cv::Mat MarkerMap::getImage(float METER2PIX)const throw (cv::Exception){
+    cv::Mat image(getImageSize(METER2PIX),CV_8UC1);
+    getImageRows(image,0,METER2PIX);
+    return image;
+}
+
+void MarkerMap::getImageRows(cv::Mat &rows,int firstRow,float METER2PIX)const throw (cv::Exception){
+    cv::Point pmin,pmax;
+    imageLimits(*this,METER2PIX,pmin,pmax);
+    rows.setTo(cv::Scalar::all(255));
+
+    auto Dict=Dictionary::load(dictionary);
+    int lastRow=firstRow+rows.rows;
+    //the markers do not overlap, so each one is drawn by its own thread
+    #pragma omp parallel for schedule(dynamic)
+    for(int i=0;i<int(size());i++)
     {
+        const Marker3DInfo &m=at(i);
+        //the points must be moved from a real reference system to image reference sysmte (y positive is inverse)
+        int y0=int(pmax.y-m[0].y),y1=int(pmax.y-m[2].y);
+        int r0=std::max(y0,firstRow),r1=std::min(y1,lastRow);
+        if (r0>=r1)
+            continue;
         //get size and find size of this
         float size=cv::norm( m[0]-m[1]);
-         auto im1=Dict.getMarkerImage_id(m.id,int(size/8));
-         cv::Mat im2;
+        auto im1=Dict.getMarkerImage_id(m.id,int(size/8));
+        cv::Mat im2;
         //now resize to fit
         cv::resize(im1,im2,cv::Size(size,size));
-         //copy in correct position
-        auto ry=cv::Range(int(m[0].y),int(m[2].y) ) ;
-        auto rx=cv::Range(int(m[0].x),int(m[2].x));
-         cv::Mat sub=image(ry,rx);
-        im2.copyTo(sub);
+        //copy the rows in the strip in correct position
+        auto rx=cv::Range(int(m[0].x-pmin.x),int(m[2].x-pmin.x));
+        cv::Mat sub=rows(cv::Range(r0-firstRow,r1-firstRow),rx);
+        im2.rowRange(r0-y0,r1-y0).copyTo(sub);
     }
-    return image;
 }
 
-std::vector<int> MarkerMap::getIndices(vector<aruco::Marker> &markers)
+std::vector<int> MarkerMap::getIndices(const vector<aruco::Marker> &markers) const
 {
     std::vector<int> indices;
-    for(size_t i=0;i<markers.size();i++){
-        bool found=false;
-        for(size_t j=0;j<size() &&!found;j++){
-            if (markers[i].id==at(j).id){
-                found=true;
-                indices.push_back(i);
-            }
-        }
-    }
+    for(size_t i=0;i<markers.size();i++)
+        if (getIndexOfMarkerId(markers[i].id)!=-1)
+            indices.push_back(i);
     return indices;
 }
 void MarkerMap::toStream(std::ostream &str){
@@ -385,28 +521,163 @@ void MarkerMap::fromStream(std::istream &str){
     int s; str>>mInfoType>>s;resize(s);
     for(size_t i=0;i<size();i++) at(i).fromStream(str);
     str>>dictionary;
+    updateIdIndex();
 }
 pair<cv::Mat,cv::Mat> MarkerMap::calculateExtrinsics(const std::vector<aruco::Marker> &markers ,float markerSize, cv::Mat CameraMatrix, cv::Mat Distorsion   ) throw(cv::Exception){
     vector<cv::Point2f> p2d;
-    MarkerMap m_meters;
-    if (isExpressedInPixels())
-        m_meters=convertToMeters(markerSize);
-    else m_meters=*this;
     vector<cv::Point3f> p3d;
-    for(auto marker:markers){
-        auto it=find(m_meters.begin(),m_meters.end(),marker.id);
-        if ( it!=m_meters.end()){//is the marker part of the map?
-            for(auto p:marker)  p2d.push_back(p);
-            for(auto p:*it)  p3d.push_back(p);
+    return calculateExtrinsics(markers,markerSize,CameraMatrix,Distorsion,p2d,p3d);
+}
+
+void MarkerMap::getCorrespondences(const std::vector<aruco::Marker> &markers ,float markerSize,
+                                   vector<cv::Point2f> &p2d, vector<cv::Point3f> &p3d)const{
+    p2d.clear();
+    p3d.clear();
+    //a map in pixels is scaled as convertToMeters does, without copying it
+    float scale=1;
+    if (isExpressedInPixels() && size()>0)
+        scale=markerSize / float(int(cv::norm(at(0)[0] - at(0)[1])));
+    for(const auto &marker:markers){
+        int index=getIndexOfMarkerId(marker.id);
+        if ( index!=-1 && at(index).size()==4){//is the marker part of the map?
+            p2d.insert(p2d.end(),marker.begin(),marker.end());
+            const cv::Point3f *corners=getMarkerCorners(index);
+            for(int c=0;c<4;c++)  p3d.push_back(corners[c]*scale);
         }
     }
+}
 
+pair<cv::Mat,cv::Mat> MarkerMap::calculateExtrinsics(const std::vector<aruco::Marker> &markers ,float markerSize, cv::Mat CameraMatrix, cv::Mat Distorsion,
+                                                     vector<cv::Point2f> &p2d, vector<cv::Point3f> &p3d) throw(cv::Exception){
+    getCorrespondences(markers,markerSize,p2d,p3d);
     cv::Mat rvec,tvec;
     if (p2d.size()!=0){//no points in the vector
-        cv::solvePnPRansac(p3d,p2d,CameraMatrix,Distorsion,rvec,tvec);
+        if (!solvePnPMarkers(p3d,p2d,CameraMatrix,Distorsion,rvec,tvec))
+            cv::solvePnPRansac(p3d,p2d,CameraMatrix,Distorsion,rvec,tvec);
     }
     return make_pair(rvec,tvec);
 
 }
 
+bool MarkerMap::solvePnPMarkers(const vector<cv::Point3f> &p3d, const vector<cv::Point2f> &p2d, const cv::Mat &CameraMatrix,
+                                const cv::Mat &Distorsion, cv::Mat &rvec, cv::Mat &tvec, float inlierErr, double confidence){
+    int n=p2d.size()/4;
+    if (n==0 || p3d.size()!=p2d.size()) return false;
+    //the poses of all the markers as squares of unit side, scaled below by the side of each one in the map
+    vector<IPPE::SquarePoses> poses(n);
+    IPPE::solvePosesOfCentredSquares(1,&p2d[0],n,CameraMatrix,Distorsion,&poses[0]);
+    ProjectionKernel camera(CameraMatrix,Distorsion);
+
+    //the markers are tried in a fixed pseudo-random order, so the result does not change between calls
+    vector<int> order(n);
+    std::iota(order.begin(),order.end(),0);
+    std::shuffle(order.begin(),order.end(),std::mt19937(n));
+
+    cv::Mat bestR,bestT;
+    int bestInliers=0;
+    double bestErr=0;
+    vector<cv::Point2f> proj;
+    auto vec3d=[](const cv::Point3f &p){return cv::Vec3d(p.x,p.y,p.z);};
+    int needed=n;
+    for(int it=0;it<needed;it++){
+        int m=order[it];
+        const cv::Point3f *P=&p3d[4*m];
+        //frame of the marker in the map: corner 0 is at (-side/2,side/2,0) and corner 1 at (side/2,side/2,0)
+        cv::Vec3d x=vec3d(P[1]-P[0]),y=vec3d(P[0]-P[3]);
+        double side=0.5*(cv::norm(x)+cv::norm(y));
+        if (side<=0) continue;
+        x/=cv::norm(x);
+        y-=x*x.dot(y);
+        y/=cv::norm(y);
+        cv::Vec3d z=x.cross(y),c=vec3d(P[0]+P[1]+P[2]+P[3])*0.25;
+        cv::Matx33d L(x[0],y[0],z[0],x[1],y[1],z[1],x[2],y[2],z[2]);
+        for(int h=0;h<2;h++){
+            //map -> camera from marker -> camera
+            cv::Mat Rm;
+            cv::Rodrigues(cv::Mat(3,1,CV_64F,poses[m].rvec[h]),Rm);
+            cv::Matx33d R=cv::Matx33d(Rm)*L.t();
+            cv::Vec3d t=cv::Vec3d(poses[m].tvec[h])*side-R*c;
+            cv::Mat rv,tv(t);
+            cv::Rodrigues(cv::Mat(R),rv);
+            camera.project(p3d,rv,tv,proj);
+            int inliers=0;
+            double err=0;
+            for(int k=0;k<n;k++){
+                double e=0;
+                for(int j=0;j<4;j++) e+=cv::norm(proj[4*k+j]-p2d[4*k+j]);
+                if (e<4*inlierErr){inliers++;err+=e;}
+            }
+            if (inliers>bestInliers || (inliers==bestInliers && inliers>0 && err<bestErr)){
+                bestInliers=inliers;bestErr=err;
+                bestR=rv;bestT=tv.clone();
+            }
+        }
+        //each sample is a single marker, so k samples miss all the inlier markers with probability (1-w)^k
+        double w=double(bestInliers)/double(n);
+        if (w>=1) break;
+        if (w>0) needed=std::min(n,std::max(it+1,int(std::ceil(std::log(1-confidence)/std::log(1-w)))));
+    }
+    if (bestInliers==0) return false;
+
+    //refine on the corners of the inlier markers
+    camera.project(p3d,bestR,bestT,proj);
+    vector<cv::Point3f> in3d;
+    vector<cv::Point2f> in2d;
+    for(int k=0;k<n;k++){
+        double e=0;
+        for(int j=0;j<4;j++) e+=cv::norm(proj[4*k+j]-p2d[4*k+j]);
+        if (e<4*inlierErr){
+            in3d.insert(in3d.end(),p3d.begin()+4*k,p3d.begin()+4*k+4);
+            in2d.insert(in2d.end(),p2d.begin()+4*k,p2d.begin()+4*k+4);
+        }
+    }
+#if CV_VERSION_MAJOR >= 3
+    cv::solvePnP(in3d,in2d,CameraMatrix,Distorsion,bestR,bestT,true);
+#else //solvePnP from a guess does not work properly in OpenCV2
+    if (in2d.size()>4) cv::solvePnP(in3d,in2d,CameraMatrix,Distorsion,bestR,bestT);
+#endif
+    if (!cv::checkRange(bestR) || !cv::checkRange(bestT)) return false;
+    rvec=bestR;tvec=bestT;
+    return true;
+}
+
+//mean reprojection error in pixels of the pose
+static double meanReprojectionError(const vector<cv::Point3f> &p3d,const vector<cv::Point2f> &p2d,const cv::Mat &rvec,const cv::Mat &tvec,
+                                    const cv::Mat &CameraMatrix,const cv::Mat &Distorsion){
+    vector<cv::Point2f> proj;
+    ProjectionKernel(CameraMatrix,Distorsion).project(p3d,rvec,tvec,proj);
+    double err=0;
+    for(size_t i=0;i<proj.size();i++) err+=cv::norm(proj[i]-p2d[i]);
+    return err/double(proj.size());
+}
+
+bool MarkerMap::calculateExtrinsics(const std::vector<aruco::Marker> &markers ,float markerSize, cv::Mat CameraMatrix, cv::Mat Distorsion,
+                                    cv::Mat &rvec, cv::Mat &tvec, float maxReprojErr,
+                                    vector<cv::Point2f> *p2d, vector<cv::Point3f> *p3d) throw(cv::Exception){
+    vector<cv::Point2f> _p2d;
+    vector<cv::Point3f> _p3d;
+    if (p2d==0) p2d=&_p2d;
+    if (p3d==0) p3d=&_p3d;
+    if (rvec.empty() || tvec.empty()){//no previous pose
+        pair<cv::Mat,cv::Mat> rt=calculateExtrinsics(markers,markerSize,CameraMatrix,Distorsion,*p2d,*p3d);
+        rvec=rt.first;tvec=rt.second;
+        return !p2d->empty();
+    }
+    getCorrespondences(markers,markerSize,*p2d,*p3d);
+    if (p2d->empty()) return false;
+
+    //refine from the previous view, which is close to the current one in a sequence
+    cv::Mat rv,tv;
+    rvec.convertTo(rv,CV_64F);
+    tvec.convertTo(tv,CV_64F);
+    rv=rv.reshape(1,3);tv=tv.reshape(1,3);
+    cv::solvePnP(*p3d,*p2d,CameraMatrix,Distorsion,rv,tv,true);
+    if (!cv::checkRange(rv) || !cv::checkRange(tv) ||
+            meanReprojectionError(*p3d,*p2d,rv,tv,CameraMatrix,Distorsion)>maxReprojErr)
+        if (!solvePnPMarkers(*p3d,*p2d,CameraMatrix,Distorsion,rv,tv))//the seed was too far
+            cv::solvePnPRansac(*p3d,*p2d,CameraMatrix,Distorsion,rv,tv);
+    rvec=rv;tvec=tv;
+    return true;
+}
+
 };
@@ -28,6 +28,7 @@ or implied, of Rafael Muñoz Salinas.
 #ifndef _Aruco_MarkerMap_h
 #define _Aruco_MarkerMap_h
 #include <opencv2/core/core.hpp>
+#include <memory>
 #include <string>
 #include <vector>
 #include "exports.h"
@@ -96,7 +97,7 @@ public:
     //Example: The set has the elements with ids 10,21,31,41,92
     //The input vector has the markers with ids 10,88,9,12,41
     //function returns {0,4}, because element 0 (10) of the vector belongs to the set, and also element 4 (41) belongs to the set
-    std::vector<int> getIndices(vector<aruco::Marker> &markers);
+    std::vector<int> getIndices(const vector<aruco::Marker> &markers) const;
 
     /**Returns the Info of the marker with id specified. If not in the set, throws exception
      */
@@ -105,6 +106,18 @@ public:
     /**Returns the index of the marker (in this object) with id indicated, if is in the vector
      */
     int getIndexOfMarkerId(int id) const;
+    /**Rebuilds the id to index table used by getIndexOfMarkerId, getIndices and calculateExtrinsics, and the
+     * contiguous copy of the corners of getMarkerCorners. It is called when the map is read. Call it again if the
+     * markers are modified by hand
+     */
+    void updateIdIndex();
+    /**Corners of the marker of the index given (see getIndexOfMarkerId). They are read from a single array with the
+     * four corners of every marker in the order of the map, built by updateIdIndex and shared by the copies of the map,
+     * so the correspondences of many markers are not gathered from a heap block per marker
+     */
+    const cv::Point3f *getMarkerCorners(int index) const {
+        return flatCorners && flatCorners->size()==4*size() ? flatCorners->data()+4*index : at(index).data();
+    }
     /**Set in the list passed the set of the ids
      */
     void getIdList(vector< int > &ids, bool append = true) const;
@@ -113,12 +126,20 @@ public:
     /**Returns an image of this to be printed. This object must be in pixels @see isExpressedInPixels(). If not,please provide the METER2PIX conversion parameter
         */
     cv::Mat getImage(float METER2PIX=0)const throw (cv::Exception);
+    /**Size of the image of getImage()
+        */
+    cv::Size getImageSize(float METER2PIX=0)const throw (cv::Exception);
+    /**Draws the rows [firstRow,firstRow+rows.rows) of the image of getImage() into rows, an allocated CV_8UC1 image
+     * of its width. Large maps can be printed strip by strip this way, without the memory of the whole image
+        */
+    void getImageRows(cv::Mat &rows,int firstRow,float METER2PIX=0)const throw (cv::Exception);
 
 
     /**Saves the board info to a file
     */
     void saveToFile(string sfile) throw(cv::Exception);
-    /**Reads board info from a file
+    /**Reads board info from a file. The first time a file is read, a binary copy is written next to it (with ".bin"
+     * appended), which is read instead while the file does not change
     */
     void readFromFile(string sfile) throw(cv::Exception);
 
@@ -127,6 +148,26 @@ public:
     //calculates the camera location w.r.t. the map using the information provided
     //returns the <rvec,tvec>
     pair<cv::Mat,cv::Mat> calculateExtrinsics(const std::vector<aruco::Marker> &markers ,float markerSize, cv::Mat CameraMatrix, cv::Mat Distorsion   ) throw(cv::Exception);
+    //same as above, with the correspondences built in p2d and p3d, so that callers can reuse them between calls
+    pair<cv::Mat,cv::Mat> calculateExtrinsics(const std::vector<aruco::Marker> &markers ,float markerSize, cv::Mat CameraMatrix, cv::Mat Distorsion,
+                                              std::vector<cv::Point2f> &p2d, std::vector<cv::Point3f> &p3d) throw(cv::Exception);
+    /**Warm started version for consecutive views. If rvec and tvec are not empty, they are refined from that pose
+     * and solvePnPRansac is only used when the mean reprojection error of the refined pose is above maxReprojErr pixels.
+     * rvec and tvec are in/out. Returns false if none of the markers are in the map
+     */
+    bool calculateExtrinsics(const std::vector<aruco::Marker> &markers ,float markerSize, cv::Mat CameraMatrix, cv::Mat Distorsion,
+                             cv::Mat &rvec, cv::Mat &tvec, float maxReprojErr=2,
+                             std::vector<cv::Point2f> *p2d=0, std::vector<cv::Point3f> *p3d=0) throw(cv::Exception);
+
+    /**Robust pose of the correspondences of getCorrespondences, whose points are the four corners of each marker.
+     * Instead of sampling single points like solvePnPRansac, each hypothesis is one of the two IPPE poses of a single
+     * marker, and it is scored by the markers whose mean reprojection error is below inlierErr pixels. The markers are
+     * tried until one is an inlier marker with the given confidence, which usually takes a few, and the best pose is
+     * refined with solvePnP on the corners of its inliers. rvec and tvec are output as 3x1 CV_64F.
+     * Returns false if no marker agrees with any hypothesis
+     */
+    static bool solvePnPMarkers(const std::vector<cv::Point3f> &p3d, const std::vector<cv::Point2f> &p2d, const cv::Mat &CameraMatrix,
+                                const cv::Mat &Distorsion, cv::Mat &rvec, cv::Mat &tvec, float inlierErr=8, double confidence=0.99);
 
     //returns string indicating the dictionary
     std::string getDictionary()const{return dictionary;}
@@ -146,6 +187,11 @@ public:
 private:
     //dictionary it belongs to (if any)
     std::string dictionary;
+    //index in this vector of each marker id (-1 if not in the map). Empty if not built
+    std::vector<int> idIndex;
+    //corners of the markers, four per marker. Null if not built, or if a marker has not four corners. It is never
+    //modified once built, so the copies of the map share it
+    std::shared_ptr<const std::vector<cv::Point3f> > flatCorners;
 
 
 private:
@@ -155,6 +201,13 @@ private:
     /**Reads board info from a file
     */
     void readFromFile(cv::FileStorage &fs) throw(cv::Exception);
+    //binary copy of a map file, validated by the hash of the file it was written from
+    static uint64_t fileHash(const string &sfile);
+    bool readFromBinary(const string &bfile, uint64_t hash);
+    void saveToBinary(const string &bfile, uint64_t hash) const;
+    //image and object points of the markers in the map, scaled to markerSize if the map is in pixels
+    void getCorrespondences(const std::vector<aruco::Marker> &markers ,float markerSize,
+                            std::vector<cv::Point2f> &p2d, std::vector<cv::Point3f> &p3d)const;
 public:
     void toStream(std::ostream &str);
     void fromStream(std::istream &str);
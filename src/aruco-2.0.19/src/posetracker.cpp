@@ -1,18 +1,36 @@
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 #include "posetracker.h"
-#if CV_VERSION_MAJOR == 2
 #include "levmarq.h"
-#endif
+#include <Eigen/Geometry>
 #include "ippe.h"
+#include "projectionkernel.h"
 
 namespace aruco{
 
+//the poses are of the precision of the camera parameters unless it is set
+static const int defaultPoseType=CameraParameters::defaultPrecision();
+
+//i-th element of a pose vector or a camera matrix, of either precision
+static double impl__aruco_value(const cv::Mat &m,int i){
+    return m.depth()==CV_64F?m.ptr<double>(0)[i]:m.ptr<float>(0)[i];
+}
+//sets a 1x3 pose vector of the type from another of any type and layout
+static void impl__aruco_setVector(const cv::Mat &v,int type,cv::Mat &out){
+    if (v.type()==type && v.isContinuous()) v.reshape(1,1).copyTo(out);
+    else v.reshape(1,1).convertTo(out,type);
+}
+
+//the transform in the type of the pose
 cv::Mat impl__aruco_getRTMatrix(const cv::Mat &_rvec,const cv::Mat &_tvec){
     if (_rvec.empty())return cv::Mat();
-        cv::Mat Matrix=cv::Mat::eye ( 4,4,CV_32FC1 );
+        cv::Mat Matrix=cv::Mat::eye ( 4,4,_rvec.depth() );
         cv::Mat R33=cv::Mat ( Matrix,cv::Rect ( 0,0,3,3 ) );
         cv::Rodrigues ( _rvec,R33 );
-        for ( int i=0; i<3; i++ ) Matrix.at<float> ( i,3 ) =_tvec.ptr<float> ( 0 ) [i];
+        for ( int i=0; i<3; i++ ){
+            if (Matrix.depth()==CV_64F) Matrix.at<double> ( i,3 ) =_tvec.ptr<double> ( 0 ) [i];
+            else Matrix.at<float> ( i,3 ) =_tvec.ptr<float> ( 0 ) [i];
+        }
         return Matrix;
 
 }
@@ -33,86 +51,139 @@ void impl__aruco_getRTfromMatrix44 ( const cv::Mat &M,  cv::Mat &R,cv::Mat &T )
         for ( int i=0; i<3; i++ )
             T.ptr<double> ( 0 ) [i]=M.at<double> ( i,3 );
 }
-#if  CV_VERSION_MAJOR == 2
 
+//Pose refinement problem for FixedLevMarq. The observations are undistorted once, so the residuals and their analytic
+//Jacobian are those of a pinhole camera, in pixels. The rotation is updated as R=exp(w)*R, so its Jacobian at w=0 is -[R*P]x
 template<typename T>
-double __aruco_solve_pnp(const std::vector<cv::Point3f> & p3d,const std::vector<cv::Point2f> & p2d,const cv::Mat &cam_matrix,const cv::Mat &dist,cv::Mat &r_io,cv::Mat &t_io){
-
-    assert(r_io.type()==CV_32F);
-    assert(t_io.type()==CV_32F);
-    assert(t_io.total()==r_io.total());
-    assert(t_io.total()==3);
-    auto toSol=[](const cv::Mat &r,const cv::Mat &t){
-          typename LevMarq<T>::eVector sol(6);
-        for(int i=0;i<3;i++){
-            sol(i)=r.ptr<float>(0)[i];
-            sol(i+3)=t.ptr<float>(0)[i];
-        }
-        return sol;
-    };
-    auto fromSol=[](const typename LevMarq<T>::eVector &sol,cv::Mat &r,cv::Mat &t){
-        r.create(1,3,CV_32F);
-        t.create(1,3,CV_32F);
-        for(int i=0;i<3;i++){
-            r.ptr<float>(0)[i]=sol(i);
-            t.ptr<float>(0)[i]=sol(i+3);
-        }
+struct __aruco_pose_problem{
+    typedef Eigen::Matrix<T,6,1> Vector;
+    typedef Eigen::Matrix<T,6,6> Matrix;
+    struct State{
+        Eigen::Matrix<T,3,3> R;
+        Eigen::Matrix<T,3,1> t;
     };
+    const std::vector<cv::Point3f> &p3d;
+    const std::vector<cv::Point2f> &obs;//normalized undistorted observations
+    T fx,fy;
 
-    cv::Mat Jacb;
-    auto err_f= [&](const  typename LevMarq<T>::eVector &sol,typename LevMarq<T>::eVector &err){
-        std::vector<cv::Point2f> p2d_rej;
-        cv::Mat r,t;
-        fromSol(sol,r,t);
-        cv::projectPoints(p3d,r,t,cam_matrix,dist,p2d_rej,Jacb);
-        err.resize(p3d.size()*2);
-        int err_idx=0;
+    __aruco_pose_problem(const std::vector<cv::Point3f> &p3d_,const std::vector<cv::Point2f> &obs_,T fx_,T fy_):p3d(p3d_),obs(obs_),fx(fx_),fy(fy_){}
+
+    double error(const State &s)const{
+        double err=0;
         for(size_t i=0;i<p3d.size();i++){
-            err(err_idx++)=p2d_rej[i].x-p2d[i].x;
-            err(err_idx++)=p2d_rej[i].y-p2d[i].y;
+            Eigen::Matrix<T,3,1> pc=s.R*Eigen::Matrix<T,3,1>(p3d[i].x,p3d[i].y,p3d[i].z)+s.t;
+            T ex=fx*(pc(0)/pc(2)-obs[i].x),ey=fy*(pc(1)/pc(2)-obs[i].y);
+            err+=ex*ex+ey*ey;
         }
-    };
-    auto jac_f=[&](const  typename LevMarq<T>::eVector &sol,Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic> &J){
-        (void)(sol);
-      J.resize(p3d.size()*2,6);
-      for(size_t i=0;i<p3d.size()*2;i++){
-          double *jacb=Jacb.ptr<double>(i);
-          for(int j=0;j<6;j++) J(i,j)=jacb[j];
-      }
-    };
+        return err;
+    }
+    double linearize(const State &s,Matrix &JtJ,Vector &Jtr)const{
+        JtJ.setZero();
+        Jtr.setZero();
+        double err=0;
+        for(size_t i=0;i<p3d.size();i++){
+            Eigen::Matrix<T,3,1> rp=s.R*Eigen::Matrix<T,3,1>(p3d[i].x,p3d[i].y,p3d[i].z);
+            Eigen::Matrix<T,3,1> pc=rp+s.t;
+            T iz=1/pc(2);
+            T ex=fx*(pc(0)*iz-obs[i].x),ey=fy*(pc(1)*iz-obs[i].y);
+            err+=ex*ex+ey*ey;
+            //derivatives of the projection wrt the camera point
+            Eigen::Matrix<T,2,3> dp;
+            dp<<fx*iz,0,-fx*pc(0)*iz*iz,
+                0,fy*iz,-fy*pc(1)*iz*iz;
+            //derivatives of the camera point wrt (w,t)
+            Eigen::Matrix<T,3,6> dc;
+            dc<<0,rp(2),-rp(1),1,0,0,
+                -rp(2),0,rp(0),0,1,0,
+                rp(1),-rp(0),0,0,0,1;
+            Eigen::Matrix<T,2,6> J=dp*dc;
+            JtJ.noalias()+=J.transpose()*J;
+            Jtr.noalias()+=J.transpose()*Eigen::Matrix<T,2,1>(ex,ey);
+        }
+        return err;
+    }
+    State apply(const State &s,const Vector &d)const{
+        State out;
+        Eigen::Matrix<T,3,1> w=d.template head<3>();
+        T angle=w.norm();
+        Eigen::Matrix<T,3,3> dR;
+        if (angle<T(1e-12)) dR.setIdentity();
+        else dR=Eigen::AngleAxis<T>(angle,w/angle).toRotationMatrix();
+        out.R=dR*s.R;
+        out.t=s.t+d.template tail<3>();
+        return out;
+    }
+};
 
-    LevMarq<T> solver;
-    solver.setParams(100,0.01,0.01);
-  //  solver.verbose()=true;
-    typename LevMarq<T>::eVector sol=toSol(r_io,t_io);
-    auto err=solver.solve(sol,err_f,jac_f);
+//refines the pose in r_io,t_io, continuous 1x3 or 3x1 vectors of the type of T, which stay in that type (there is no
+//conversion of the pose). Returns the squared reprojection error of the undistorted points, in pixels. The fixed
+//refinements of a predicted pose (see MarkerMapMotionTracker) use a few iterations and small initial damping (tau)
+template<typename T>
+double __aruco_solve_pnp(const std::vector<cv::Point3f> & p3d,const std::vector<cv::Point2f> & p2d,const cv::Mat &cam_matrix,const cv::Mat &dist,cv::Mat &r_io,cv::Mat &t_io,
+                         int maxIters,double tau){
+
+    const int type=cv::DataType<T>::type;
+    assert(r_io.type()==type && r_io.isContinuous());
+    assert(t_io.type()==type && t_io.isContinuous());
+    assert(t_io.total()==r_io.total());
+    assert(t_io.total()==3);
+    std::vector<cv::Point2f> obs;
+    cv::undistortPoints(p2d,obs,cam_matrix,dist);
+    __aruco_pose_problem<T> problem(p3d,obs,impl__aruco_value(cam_matrix,0),impl__aruco_value(cam_matrix,cam_matrix.cols+1));
+
+    //the rotations are in the type of the pose, and the vectors are rewritten in place
+    typename __aruco_pose_problem<T>::State state;
+    cv::Matx<T,3,3> R;
+    cv::Mat rv(3,1,type,r_io.data),Rm(3,3,type,R.val);
+    cv::Rodrigues(rv,Rm);
+    for(int i=0;i<3;i++){
+        for(int j=0;j<3;j++) state.R(i,j)=R(i,j);
+        state.t(i)=t_io.ptr<T>(0)[i];
+    }
+    FixedLevMarq<T,6> solver(maxIters,0.01,0.01,tau);
+    double err=solver.solve(problem,state);
 
-    fromSol(sol,r_io,t_io);
+    for(int i=0;i<3;i++){
+        for(int j=0;j<3;j++) R(i,j)=state.R(i,j);
+        t_io.ptr<T>(0)[i]=state.t(i);
+    }
+    cv::Rodrigues(Rm,rv);
     return err;
 
 }
 
-double __aruco_solve_pnp(const std::vector<cv::Point3f> & p3d,const std::vector<cv::Point2f> & p2d,const cv::Mat &cam_matrix,const cv::Mat &dist,cv::Mat &r_io,cv::Mat &t_io){
-#ifdef DOUBLE_PRECISION_PNP
-    return __aruco_solve_pnp<double>(p3d,p2d,cam_matrix,dist,r_io,t_io);
-#else
-    return __aruco_solve_pnp<float>(p3d,p2d,cam_matrix,dist,r_io,t_io);
-#endif
+//refines a pose in the precision of its type, CV_32F or CV_64F
+double __aruco_solve_pnp(const std::vector<cv::Point3f> & p3d,const std::vector<cv::Point2f> & p2d,const cv::Mat &cam_matrix,const cv::Mat &dist,cv::Mat &r_io,cv::Mat &t_io,
+                         int maxIters=100,double tau=1){
+    if (r_io.type()==CV_64F)
+        return __aruco_solve_pnp<double>(p3d,p2d,cam_matrix,dist,r_io,t_io,maxIters,tau);
+    return __aruco_solve_pnp<float>(p3d,p2d,cam_matrix,dist,r_io,t_io,maxIters,tau);
+}
+
+MarkerPoseTracker::MarkerPoseTracker(){
+    _type=defaultPoseType;
+}
+
+void MarkerPoseTracker::setPrecision(int type){
+    assert(type==CV_32F || type==CV_64F);
+    if (type!=_type){
+        _type=type;
+        _rvec=cv::Mat();_tvec=cv::Mat();
+    }
 }
 
-#endif
 bool MarkerPoseTracker::estimatePose(  Marker &m,const   CameraParameters &_cam_params,float _msize,float minerrorRatio){
 
 
     if (_rvec.empty()){//if no previous data, use from scratch
         cv::Mat rv,tv;
-        auto solutions=IPPE::solvePnP_(Marker::get3DPoints(_msize),m,_cam_params.CameraMatrix,_cam_params.Distorsion);
-        double errorRatio=solutions[1].second/solutions[0].second;
+        IPPE::SquarePoses poses;
+        IPPE::solvePosesOfCentredSquares(_msize,&m[0],1,_cam_params.CameraMatrix,_cam_params.Distorsion,&poses);
+        double errorRatio=poses.reprojErr[1]/poses.reprojErr[0];
         if (errorRatio<minerrorRatio) return false;//is te error ratio big enough
         cv::solvePnP(Marker::get3DPoints(_msize),m,_cam_params.CameraMatrix,_cam_params.Distorsion,rv,tv);
-         rv.convertTo(_rvec,CV_32F);
-        tv.convertTo(_tvec,CV_32F);
-        impl__aruco_getRTfromMatrix44(solutions[0].first,rv,tv);
+        impl__aruco_setVector(rv,_type,_rvec);
+        impl__aruco_setVector(tv,_type,_tvec);
      }
     else{
 #if  CV_VERSION_MAJOR >= 3
@@ -134,6 +205,16 @@ bool MarkerPoseTracker::estimatePose(  Marker &m,const   CameraParameters &_cam_
 
 MarkerMapPoseTracker::MarkerMapPoseTracker(){
     _isValid=false;
+    _maxReprojErr=2;
+    _type=defaultPoseType;
+}
+
+void MarkerMapPoseTracker::setPrecision(int type){
+    assert(type==CV_32F || type==CV_64F);
+    if (type!=_type){
+        _type=type;
+        reset();
+    }
 }
 
 void MarkerMapPoseTracker::setParams(const  CameraParameters &cam_params,const MarkerMap &msconf, float markerSize)throw(cv::Exception)
@@ -152,10 +233,8 @@ void MarkerMapPoseTracker::setParams(const  CameraParameters &cam_params,const M
 
     _isValid=true;
 
-    //create a map for fast access to elements
-    _map_mm.clear();
-    for(auto m:msconf)
-        _map_mm.insert(make_pair(m.id,m));
+    //the id table and the contiguous corners of the map, in meters, for fast access to its markers
+    _msconf.updateIdIndex();
 }
 
 bool MarkerMapPoseTracker::estimatePose(const  vector<Marker> &v_m){
@@ -163,10 +242,12 @@ bool MarkerMapPoseTracker::estimatePose(const  vector<Marker> &v_m){
 
     vector<cv::Point2f> p2d;
     vector<cv::Point3f> p3d;
-    for(auto marker:v_m){
-        if ( _map_mm.find(marker.id)!=_map_mm.end()){//is the marker part of the map?
+    for(const auto &marker:v_m){
+        int index=_msconf.getIndexOfMarkerId(marker.id);
+        if ( index!=-1 && _msconf[index].size()==4){//is the marker part of the map?
             for(auto p:marker)  p2d.push_back(p);
-            for(auto p:_map_mm[marker.id])  p3d.push_back(p);
+            const cv::Point3f *corners=_msconf.getMarkerCorners(index);
+            p3d.insert(p3d.end(),corners,corners+4);
         }
     }
 
@@ -174,25 +255,16 @@ bool MarkerMapPoseTracker::estimatePose(const  vector<Marker> &v_m){
         _rvec=cv::Mat();_tvec=cv::Mat();return false;
     }
     else{
-        if(_rvec.empty()){//requires ransac since past pose is unknown
+        bool seeded=!_rvec.empty();
+        if(!seeded){//requires ransac since past pose is unknown
             cv::Mat rv,tv;
-            cv::solvePnPRansac(p3d,p2d,_cam_params.CameraMatrix,_cam_params.Distorsion,rv,tv);
+            if (!MarkerMap::solvePnPMarkers(p3d,p2d,_cam_params.CameraMatrix,_cam_params.Distorsion,rv,tv))
+                cv::solvePnPRansac(p3d,p2d,_cam_params.CameraMatrix,_cam_params.Distorsion,rv,tv);
 
 
             assert(tv.type()==CV_64F);
-            if (_rvec.rows==1) {
-                rv.convertTo(_rvec,CV_32F);
-                tv.convertTo(_tvec,CV_32F);
-            }
-            else{
-
-                _rvec.create(1,3,CV_32F);
-                _tvec.create(1,3,CV_32F);
-                for(int i=0;i<3;i++){
-                    _rvec.ptr<float>(0)[i]=rv.at<double>(i,0);
-                    _tvec.ptr<float>(0)[i]=tv.at<double>(i,0);
-                }
-            }
+            impl__aruco_setVector(rv,_type,_rvec);
+            impl__aruco_setVector(tv,_type,_tvec);
         }
 
 #if  CV_VERSION_MAJOR >= 3
@@ -202,7 +274,16 @@ bool MarkerMapPoseTracker::estimatePose(const  vector<Marker> &v_m){
         __aruco_solve_pnp(p3d,p2d,_cam_params.CameraMatrix,_cam_params.Distorsion,_rvec,_tvec);
 
 #endif
-
+        if (seeded){//the previous pose may be too far from the current one (fast motion, new markers). Then, start from ransac
+            vector<cv::Point2f> proj;
+            ProjectionKernel(_cam_params.CameraMatrix,_cam_params.Distorsion).project(p3d,_rvec,_tvec,proj);
+            double err=0;
+            for(size_t i=0;i<proj.size();i++) err+=cv::norm(proj[i]-p2d[i]);
+            if (!cv::checkRange(_rvec) || !cv::checkRange(_tvec) || err/double(proj.size())>_maxReprojErr){
+                _rvec=cv::Mat();_tvec=cv::Mat();
+                return estimatePose(v_m);
+            }
+        }
         return true;
     }
 }
@@ -215,4 +296,167 @@ cv::Mat MarkerMapPoseTracker::getRTMatrix (  ) const {
 cv::Mat MarkerPoseTracker::getRTMatrix (  ) const {
     return impl__aruco_getRTMatrix(_rvec,_tvec);
 }
+
+
+
+MarkerMapMotionTracker::MarkerMapMotionTracker(){
+    _tracking=false;
+    _refineIters=3;
+    _maxReprojErr=2;
+}
+
+void MarkerMapMotionTracker::setParams(const  CameraParameters &cam_params,const MarkerMap &msconf, float markerSize)throw(cv::Exception)
+{
+    _full.setParams(cam_params,msconf,markerSize);
+    _full.setMaxReprojectionError(_maxReprojErr);
+    _cam_params=cam_params;
+    reset();
+}
+
+void MarkerMapMotionTracker::reset(){
+    _tracking=false;
+    _rvec=cv::Mat();_tvec=cv::Mat();
+    _full.reset();
+}
+
+void MarkerMapMotionTracker::setPrecision(int type){
+    _full.setPrecision(type);
+    reset();
+}
+
+void MarkerMapMotionTracker::predictPose(cv::Mat &rvec,cv::Mat &tvec,cv::Matx33d &R,cv::Vec3d &t)const{
+    R=_dR*_R;
+    t=_dR*_t+_dt;
+    cv::Vec3d rv;
+    cv::Rodrigues(R,rv);
+    int type=_full.getPrecision();
+    rvec.create(1,3,type);
+    tvec.create(1,3,type);
+    for(int i=0;i<3;i++){
+        if (type==CV_64F){
+            rvec.ptr<double>(0)[i]=rv[i];
+            tvec.ptr<double>(0)[i]=t[i];
+        }
+        else{
+            rvec.ptr<float>(0)[i]=rv[i];
+            tvec.ptr<float>(0)[i]=t[i];
+        }
+    }
+}
+
+void MarkerMapMotionTracker::update(const cv::Mat &rvec,const cv::Mat &tvec,bool tracked){
+    cv::Vec3d rv,tn;
+    for(int i=0;i<3;i++){
+        rv[i]=impl__aruco_value(rvec,i);
+        tn[i]=impl__aruco_value(tvec,i);
+    }
+    cv::Matx33d Rn;
+    cv::Rodrigues(rv,Rn);
+    //the motion from the last frame. A pose from scratch starts with no motion
+    if (tracked){
+        _dR=Rn*_R.t();
+        _dt=tn-_dR*_t;
+    }
+    else{
+        _dR=cv::Matx33d::eye();
+        _dt=cv::Vec3d(0,0,0);
+    }
+    _R=Rn;
+    _t=tn;
+    impl__aruco_setVector(rvec,_full.getPrecision(),_rvec);
+    impl__aruco_setVector(tvec,_full.getPrecision(),_tvec);
+    _tracking=true;
+}
+
+bool MarkerMapMotionTracker::estimatePose(const  vector<Marker> &v_m){
+    vector<cv::Point2f> p2d;
+    vector<cv::Point3f> p3d;
+    const MarkerMap &map=_full.getMarkerMap();
+    for(const auto &marker:v_m){
+        int index=map.getIndexOfMarkerId(marker.id);
+        if (index!=-1 && map[index].size()==4){//is the marker part of the map?
+            for(auto p:marker)  p2d.push_back(p);
+            const cv::Point3f *corners=map.getMarkerCorners(index);
+            p3d.insert(p3d.end(),corners,corners+4);
+        }
+    }
+    if (p2d.size()==0){//lost
+        reset();
+        return false;
+    }
+
+    //the common case: a few iterations from the predicted pose
+    if (_tracking){
+        cv::Mat rv,tv;
+        cv::Matx33d R;
+        cv::Vec3d t;
+        predictPose(rv,tv,R,t);
+        double err=__aruco_solve_pnp(p3d,p2d,_cam_params.CameraMatrix,_cam_params.Distorsion,rv,tv,_refineIters,1e-3);
+        if (cv::checkRange(rv) && cv::checkRange(tv) && sqrt(err/double(p2d.size()))<=_maxReprojErr){
+            update(rv,tv,true);
+            return true;
+        }
+    }
+    //from scratch
+    _full.reset();
+    if (!_full.estimatePose(v_m)){
+        reset();
+        return false;
+    }
+    update(_full.getRvec(),_full.getTvec(),false);
+    return true;
+}
+
+bool MarkerMapMotionTracker::predictMarkers(vector<Marker> &markers,cv::Size imageSize)const{
+    markers.clear();
+    if (!_tracking) return false;
+    cv::Mat rv,tv;
+    cv::Matx33d R;
+    cv::Vec3d t;
+    predictPose(rv,tv,R,t);
+    vector<cv::Point3f> p3d;
+    vector<int> ids;
+    const MarkerMap &map=_full.getMarkerMap();
+    for(size_t i=0;i<map.size();i++){
+        //markers listed twice are only projected once
+        if (map[i].size()!=4 || map.getIndexOfMarkerId(map[i].id)!=int(i)) continue;
+        const cv::Point3f *corners=map.getMarkerCorners(i);
+        //markers behind the camera are not projected
+        bool front=true;
+        for(int c=0;c<4;c++) front&= (R*cv::Vec3d(corners[c].x,corners[c].y,corners[c].z)+t)[2]>0;
+        if (!front) continue;
+        p3d.insert(p3d.end(),corners,corners+4);
+        ids.push_back(map[i].id);
+    }
+    //the corners of every marker are projected at once
+    vector<cv::Point2f> proj;
+    ProjectionKernel(_cam_params.CameraMatrix,_cam_params.Distorsion).project(p3d,rv,tv,proj);
+    for(size_t k=0;k<ids.size();k++){
+        vector<cv::Point2f> corners(proj.begin()+4*k,proj.begin()+4*k+4);
+        bool inside=true;
+        if (imageSize.area()>0)
+            for(const auto &p:corners) inside&= p.x>=0 && p.y>=0 && p.x<imageSize.width && p.y<imageSize.height;
+        if (inside) markers.push_back(Marker(corners,ids[k]));
+    }
+    return true;
+}
+
+bool MarkerMapMotionTracker::predictRegions(vector<cv::Rect> &regions,cv::Size imageSize,float margin)const{
+    regions.clear();
+    vector<Marker> markers;
+    //the corners of a region may be out of the image, but not the whole marker
+    if (!predictMarkers(markers)) return false;
+    cv::Rect image(0,0,imageSize.width,imageSize.height);
+    for(const auto &m:markers){
+        cv::Rect r=cv::boundingRect(vector<cv::Point2f>(m));
+        int mx=r.width*margin,my=r.height*margin;
+        r=cv::Rect(r.x-mx,r.y-my,r.width+2*mx,r.height+2*my)&image;
+        if (r.area()>0) regions.push_back(r);
+    }
+    return true;
+}
+
+cv::Mat MarkerMapMotionTracker::getRTMatrix (  ) const {
+    return impl__aruco_getRTMatrix(_rvec,_tvec);
+}
 }
@@ -56,6 +56,7 @@ namespace aruco{
  */
 class ARUCO_EXPORTS MarkerPoseTracker{
   public:
+    MarkerPoseTracker();
     /**     estimate the pose of the marker.
      * @brief estimatePose
      * @param m marker info
@@ -73,8 +74,15 @@ class ARUCO_EXPORTS MarkerPoseTracker{
     //return the translation vector. Returns an empty matrix if last call to estimatePose returned false
     const cv::Mat getTvec()const{return _tvec;}
 
+    //precision of the poses and of their refinement: CV_32F (fast tracking) or CV_64F (final refinement). The poses of
+    //getRvec and getTvec are of this type. The default is that of the camera parameters (CameraParameters::defaultPrecision),
+    //so that they are used without conversion. Changing it forgets the last pose
+    void setPrecision(int type);
+    int getPrecision()const{return _type;}
+
   private:
     cv::Mat _rvec,_tvec;//current poses
+    int _type;
      double  solve_pnp(const std::vector<cv::Point3f> & p3d,const std::vector<cv::Point2f> & p2d,const cv::Mat &cam_matrix,const cv::Mat &dist,cv::Mat &r_io,cv::Mat &t_io);
 
 };
@@ -95,6 +103,15 @@ public:
     //estimates camera pose wrt the markermap
     //returns true if pose has been obtained and false otherwise
     bool estimatePose(const  vector<Marker> &v_m);
+    //mean reprojection error (pixels) above which the pose refined from the previous one is discarded and ransac is used instead
+    void setMaxReprojectionError(float err){_maxReprojErr=err;}
+    //forgets the last pose, so that the next one is estimated from scratch
+    void reset(){_rvec=cv::Mat();_tvec=cv::Mat();}
+    //same as MarkerPoseTracker::setPrecision
+    void setPrecision(int type);
+    int getPrecision()const{return _type;}
+    //the map, in meters
+    const MarkerMap &getMarkerMap()const{return _msconf;}
 
     //returns the 4x4 transform matrix. Returns an empty matrix if last call to estimatePose returned false
     cv::Mat getRTMatrix()const;
@@ -105,12 +122,70 @@ public:
 private:
 
     cv::Mat _rvec,_tvec;//current poses
+    int _type;
+    float _maxReprojErr;
     aruco::CameraParameters _cam_params;
-    MarkerMap _msconf;
-    std::map<int,Marker3DInfo> _map_mm;
+    MarkerMap _msconf;//in meters, with its id table and contiguous corners (see MarkerMap::getMarkerCorners)
     bool _isValid;
 };
 
+/**Tracks the pose of a markermap along a video sequence with a constant velocity model.
+ *
+ * The pose of the next frame is predicted from the motion between the last two, so the markers of the map can be
+ * projected where they are expected (see predictMarkers and predictRegions), e.g., to search them only in these regions.
+ * While tracking, the pose of each frame is refined from the prediction with a few iterations of an analytic
+ * Levenberg-Marquardt, instead of an iterative solvePnP. When the refinement does not fit the observations, or the map
+ * was lost, the pose is estimated again from scratch by MarkerMapPoseTracker. Use one tracker per map
+ */
+class ARUCO_EXPORTS MarkerMapMotionTracker{
+public:
+    MarkerMapMotionTracker();
+    //same as MarkerMapPoseTracker::setParams. Throws exception if wrong configuraiton
+    void setParams(const  CameraParameters &cam_params,const MarkerMap &msconf, float markerSize=-1)throw(cv::Exception);
+    bool isValid()const{return _full.isValid();}
+    //iterations of the refinement of a predicted pose (3 by default)
+    void setRefinementIterations(int n){_refineIters=n;}
+    //RMS reprojection error (pixels) above which a refined pose is discarded and estimated from scratch
+    void setMaxReprojectionError(float err){_maxReprojErr=err;_full.setMaxReprojectionError(err);}
+    //stops tracking, so that the next pose is estimated from scratch
+    void reset();
+    //same as MarkerPoseTracker::setPrecision, for the refinement of the predicted poses and for the poses from scratch
+    void setPrecision(int type);
+    int getPrecision()const{return _full.getPrecision();}
+    //true if the poses of the last frames were found, so that the next one can be predicted
+    bool isTracking()const{return _tracking;}
+
+    //estimates camera pose wrt the markermap. Returns true if pose has been obtained and false otherwise
+    bool estimatePose(const  vector<Marker> &v_m);
+    //the markers of the map, with their corners where they are expected in the next frame. Only the markers in front of
+    //the camera whose corners are all inside an image of imageSize (if not empty) are given.
+    //Returns false if there is no prediction
+    bool predictMarkers(vector<Marker> &markers,cv::Size imageSize=cv::Size())const;
+    //the regions of the image where the markers of predictMarkers are expected, enlarged by margin times their size
+    bool predictRegions(vector<cv::Rect> &regions,cv::Size imageSize,float margin=0.25)const;
+
+    //returns the 4x4 transform matrix. Returns an empty matrix if last call to estimatePose returned false
+    cv::Mat getRTMatrix()const;
+    //return the rotation vector. Returns an empty matrix if last call to estimatePose returned false
+    const cv::Mat getRvec()const{return _rvec;}
+    //return the translation vector. Returns an empty matrix if last call to estimatePose returned false
+    const cv::Mat getTvec()const{return _tvec;}
+private:
+    //pose of the next frame, from the last one and the velocity
+    void predictPose(cv::Mat &rvec,cv::Mat &tvec,cv::Matx33d &R,cv::Vec3d &t)const;
+    //sets the pose of the current frame, and the motion from the last one if it is tracked (from scratch otherwise)
+    void update(const cv::Mat &rvec,const cv::Mat &tvec,bool tracked);
+
+    MarkerMapPoseTracker _full;//poses from scratch
+    cv::Mat _rvec,_tvec;//current poses
+    cv::Matx33d _R,_dR;//rotation of the current pose, and rotation of the motion between the last two frames
+    cv::Vec3d _t,_dt;//the same for the translation, so that the next pose is (_dR*_R, _dR*_t+_dt)
+    bool _tracking;
+    int _refineIters;
+    float _maxReprojErr;
+    aruco::CameraParameters _cam_params;
+};
+
 };
 
 #endif
@@ -0,0 +1,195 @@
+/*****************************
+Copyright 2011 Rafael Muñoz Salinas. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY Rafael Muñoz Salinas ''AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Rafael Muñoz Salinas OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Rafael Muñoz Salinas.
+********************************/
+#include "projectionkernel.h"
+#include <opencv2/calib3d/calib3d.hpp>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+using namespace std;
+namespace aruco {
+
+// points projected at once. The model is evaluated on arrays of this many lanes, which Eigen vectorizes
+static const int kernelLanes = 32;
+typedef Eigen::Array< double, kernelLanes, 1 > Lanes;
+
+// element i of a continuous vector of either precision
+static double vectorValue(const cv::Mat &m, int i) {
+    return m.depth() == CV_64F ? m.ptr< double >(0)[i] : m.ptr< float >(0)[i];
+}
+
+void ProjectionKernel::setCamera(const cv::Mat &camMatrix, const cv::Mat &distCoeff) {
+    camMatrix.convertTo(_camMatrix, CV_64F);
+    if (distCoeff.empty())
+        _distCoeff = cv::Mat::zeros(1, 5, CV_64F);
+    else
+        distCoeff.reshape(1, 1).convertTo(_distCoeff, CV_64F);
+    const double *K = _camMatrix.ptr< double >(0), *d = _distCoeff.ptr< double >(0);
+    _fx = K[0];
+    _cx = K[2];
+    _fy = K[4];
+    _cy = K[5];
+    _exact = false;
+    for (int i = 0; i < 8; i++)
+        _k[i] = 0;
+    for (int i = 0; i < (int)_distCoeff.total(); i++) {
+        if (i < 8)
+            _k[i] = d[i];
+        else if (d[i] != 0)
+            _exact = true;
+    }
+}
+
+// the lanes after the n points repeat the last one, so that every lane is a valid point
+void ProjectionKernel::projectBlock(const cv::Point3f *in, int n, const double R[9], const double t[3], cv::Point2f *out,
+                                    double *jacobian) const {
+    Lanes X, Y, Z;
+    for (int i = 0; i < kernelLanes; i++) {
+        const cv::Point3f &p = in[std::min(i, n - 1)];
+        X[i] = p.x;
+        Y[i] = p.y;
+        Z[i] = p.z;
+    }
+    const double k1 = _k[0], k2 = _k[1], p1 = _k[2], p2 = _k[3], k3 = _k[4], k4 = _k[5], k5 = _k[6], k6 = _k[7];
+    Lanes rx = R[0] * X + R[1] * Y + R[2] * Z, ry = R[3] * X + R[4] * Y + R[5] * Z, rz = R[6] * X + R[7] * Y + R[8] * Z;
+    Lanes iz = (rz + t[2]).inverse();
+    Lanes x = (rx + t[0]) * iz, y = (ry + t[1]) * iz;
+    Lanes x2 = x * x, y2 = y * y, xy = x * y, r2 = x2 + y2;
+    Lanes ib = (1 + r2 * (k4 + r2 * (k5 + r2 * k6))).inverse();
+    Lanes radial = (1 + r2 * (k1 + r2 * (k2 + r2 * k3))) * ib;
+    Lanes u = _fx * (x * radial + 2 * p1 * xy + p2 * (r2 + 2 * x2)) + _cx;
+    Lanes v = _fy * (y * radial + p1 * (r2 + 2 * y2) + 2 * p2 * xy) + _cy;
+    for (int i = 0; i < n; i++)
+        out[i] = cv::Point2f(float(u[i]), float(v[i]));
+    if (!jacobian)
+        return;
+
+    // derivatives of the pixel wrt the camera point: distortion wrt normalized point, times normalized point wrt camera point
+    Lanes dr = (k1 + r2 * (2 * k2 + 3 * k3 * r2) - radial * (k4 + r2 * (2 * k5 + 3 * k6 * r2))) * ib;
+    Lanes dxy = 2 * xy * dr + 2 * p1 * x + 2 * p2 * y;
+    Lanes a00 = _fx * (radial + 2 * x2 * dr + 2 * p1 * y + 6 * p2 * x) * iz, a01 = _fx * dxy * iz;
+    Lanes a10 = _fy * dxy * iz, a11 = _fy * (radial + 2 * y2 * dr + 6 * p1 * y + 2 * p2 * x) * iz;
+    Lanes a02 = -(a00 * x + a01 * y), a12 = -(a10 * x + a11 * y);
+    // the camera point wrt (w,v) is [-[R*P]x I]
+    Lanes ju[3] = {a02 * ry - a01 * rz, a00 * rz - a02 * rx, a01 * rx - a00 * ry};
+    Lanes jv[3] = {a12 * ry - a11 * rz, a10 * rz - a12 * rx, a11 * rx - a10 * ry};
+    for (int i = 0; i < n; i++) {
+        double *Ju = jacobian + 12 * i, *Jv = Ju + 6;
+        for (int c = 0; c < 3; c++) {
+            Ju[c] = ju[c][i];
+            Jv[c] = jv[c][i];
+        }
+        Ju[3] = a00[i];
+        Ju[4] = a01[i];
+        Ju[5] = a02[i];
+        Jv[3] = a10[i];
+        Jv[4] = a11[i];
+        Jv[5] = a12[i];
+    }
+}
+
+// points of either precision, projected in their precision
+void ProjectionKernel::projectExact(const cv::Mat &in, const double R[9], const double t[3], cv::OutputArray out) const {
+    cv::Mat rvec, tvec(3, 1, CV_64F, (void *)t);
+    cv::Rodrigues(cv::Mat(3, 3, CV_64F, (void *)R), rvec);
+    cv::projectPoints(in, rvec, tvec, _camMatrix, _distCoeff, out);
+}
+
+// the points in blocks of lanes, or with cv::projectPoints
+void ProjectionKernel::projectPoints(const cv::Point3f *in, int n, const double R[9], const double t[3], cv::Point2f *out,
+                                     double *jacobian) const {
+    if (n <= 0)
+        return;
+    if (!_exact) {
+        for (int i = 0; i < n; i += kernelLanes)
+            projectBlock(in + i, std::min(kernelLanes, n - i), R, t, out + i, jacobian ? jacobian + 12 * i : NULL);
+        return;
+    }
+    cv::Mat points(n, 1, CV_32FC3, (void *)in), projected(n, 1, CV_32FC2, (void *)out);
+    projectExact(points, R, t, projected);
+    if (!jacobian)
+        return;
+    // the models of more coefficients are differentiated numerically, by central differences of (w,v) in doubles
+    const double h = 1e-6;
+    Eigen::Map< const Eigen::Matrix< double, 3, 3, Eigen::RowMajor > > Rm(R);
+    cv::Mat points64;
+    points.convertTo(points64, CV_64FC3);
+    vector< cv::Point2d > plus, minus;
+    for (int c = 0; c < 6; c++) {
+        double d[6] = {0, 0, 0, 0, 0, 0};
+        Eigen::Matrix< double, 3, 3, Eigen::RowMajor > Rd[2];
+        double td[2][3];
+        for (int s = 0; s < 2; s++) {
+            d[c] = s == 0 ? h : -h;
+            Eigen::Vector3d dw(d[0], d[1], d[2]);
+            if (c < 3)
+                Rd[s] = Eigen::AngleAxisd(dw.norm(), dw / dw.norm()).toRotationMatrix() * Rm;
+            else
+                Rd[s] = Rm;
+            for (int k = 0; k < 3; k++)
+                td[s][k] = t[k] + d[3 + k];
+        }
+        projectExact(points64, Rd[0].data(), td[0], plus);
+        projectExact(points64, Rd[1].data(), td[1], minus);
+        for (int i = 0; i < n; i++) {
+            jacobian[12 * i + c] = (plus[i].x - minus[i].x) / (2 * h);
+            jacobian[12 * i + 6 + c] = (plus[i].y - minus[i].y) / (2 * h);
+        }
+    }
+}
+
+void ProjectionKernel::project(const cv::Point3f *in, int n, const cv::Mat &rvec, const cv::Mat &tvec, cv::Point2f *out,
+                               double *jacobian) const {
+    assert(!empty() && rvec.total() == 3 && tvec.total() == 3 && rvec.isContinuous() && tvec.isContinuous());
+    Eigen::Vector3d w(vectorValue(rvec, 0), vectorValue(rvec, 1), vectorValue(rvec, 2));
+    double angle = w.norm();
+    Eigen::Matrix< double, 3, 3, Eigen::RowMajor > R = Eigen::Matrix3d::Identity();
+    if (angle > 1e-15)
+        R = Eigen::AngleAxisd(angle, w / angle).toRotationMatrix();
+    double t[3] = {vectorValue(tvec, 0), vectorValue(tvec, 1), vectorValue(tvec, 2)};
+    projectPoints(in, n, R.data(), t, out, jacobian);
+}
+
+void ProjectionKernel::project(const vector< cv::Point3f > &in, const cv::Mat &rvec, const cv::Mat &tvec,
+                               vector< cv::Point2f > &out, cv::Mat *jacobian) const {
+    int n = (int)in.size();
+    out.resize(n);
+    if (jacobian)
+        jacobian->create(2 * n, 6, CV_64F);
+    if (n > 0)
+        project(&in[0], n, rvec, tvec, &out[0], jacobian ? jacobian->ptr< double >(0) : NULL);
+}
+
+void ProjectionKernel::project(const vector< cv::Point3f > &in, vector< cv::Point2f > &out) const {
+    static const double identity[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1}, zero[3] = {0, 0, 0};
+    out.resize(in.size());
+    if (!in.empty())
+        projectPoints(&in[0], (int)in.size(), identity, zero, &out[0], NULL);
+}
+}
@@ -0,0 +1,76 @@
+/*****************************
+Copyright 2011 Rafael Muñoz Salinas. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY Rafael Muñoz Salinas ''AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Rafael Muñoz Salinas OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Rafael Muñoz Salinas.
+********************************/
+#ifndef _Aruco_ProjectionKernel_H
+#define _Aruco_ProjectionKernel_H
+#include "exports.h"
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+namespace aruco {
+/**\brief Projection of points with the distortion model of a camera, as cv::projectPoints
+ *
+ * cv::projectPoints converts its arguments through InputArray, allocates its matrices and always builds the
+ * derivatives of the intrinsics, which costs more than the projection itself for the few points of a marker or a
+ * view. This keeps the camera in doubles and projects the points in blocks of lanes, so that the compiler vectorizes
+ * the distortion model over the points (SSE, AVX or NEON, through Eigen). The model is that of up to 8 coefficients
+ * (k1 k2 p1 p2 k3 k4 k5 k6); a camera with the thin prism or tilted models is projected with cv::projectPoints.
+ * The Jacobian is that of the pose update of the pose refinements, R=exp(w)*R and t=t+v.
+ * The kernel is only read by the projections, so it can be shared by threads
+ */
+class ARUCO_EXPORTS ProjectionKernel {
+public:
+    ProjectionKernel() : _exact(false) {}
+    ProjectionKernel(const cv::Mat &camMatrix, const cv::Mat &distCoeff) { setCamera(camMatrix, distCoeff); }
+    void setCamera(const cv::Mat &camMatrix, const cv::Mat &distCoeff);
+    bool empty() const { return _camMatrix.empty(); }
+
+    /**projects points with a pose: a Rodrigues vector and a translation, continuous, of 3 elements of either precision.
+     * With jacobian, it also receives the 2n x 6 CV_64F derivatives of the coordinates of each point wrt (w,v)
+     */
+    void project(const std::vector< cv::Point3f > &in, const cv::Mat &rvec, const cv::Mat &tvec,
+                 std::vector< cv::Point2f > &out, cv::Mat *jacobian = NULL) const;
+    //same as above, for the n points of an array, such as a view of a larger one. jacobian, if not NULL, holds 12n doubles
+    void project(const cv::Point3f *in, int n, const cv::Mat &rvec, const cv::Mat &tvec, cv::Point2f *out,
+                 double *jacobian = NULL) const;
+    //projects points in camera coordinates
+    void project(const std::vector< cv::Point3f > &in, std::vector< cv::Point2f > &out) const;
+
+private:
+    void projectBlock(const cv::Point3f *in, int n, const double R[9], const double t[3], cv::Point2f *out,
+                      double *jacobian) const;
+    void projectPoints(const cv::Point3f *in, int n, const double R[9], const double t[3], cv::Point2f *out,
+                       double *jacobian) const;
+    void projectExact(const cv::Mat &in, const double R[9], const double t[3], cv::OutputArray out) const;
+
+    cv::Mat _camMatrix, _distCoeff;//CV_64F copies of the camera
+    double _fx, _fy, _cx, _cy;
+    double _k[8];//k1 k2 p1 p2 k3 k4 k5 k6, 0 when the camera has fewer
+    bool _exact;//the camera has more coefficients, so it is projected with cv::projectPoints
+};
+}
+#endif
@@ -0,0 +1,84 @@
+/*****************************
+Copyright 2011 Rafael Muñoz Salinas. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY Rafael Muñoz Salinas ''AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Rafael Muñoz Salinas OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Rafael Muñoz Salinas.
+********************************/
+#ifndef _Aruco_ThreadAccumulator_H
+#define _Aruco_ThreadAccumulator_H
+#include <vector>
+#include <iterator>
+#include <algorithm>
+namespace aruco {
+
+//per thread results of a parallel region, each thread appending to its own vector. The vector headers of the
+//threads are a cache line apart, so that appending from neighbouring threads does not bounce a shared line, and
+//the vectors keep their capacity between uses. join() moves the results into a single vector, in thread order.
+//A schedule(static) loop gives each thread one block of consecutive iterations, in thread order, so the results
+//of such a loop are joined in the order of its iterations, whatever the number of threads. The loops that fill
+//an accumulator must keep that schedule, since the candidates are identified and filtered in their order
+template < typename T > class ThreadAccumulator {
+  public:
+    //empties the vectors of nthreads threads, keeping their capacity
+    void reset(int nthreads) {
+        if (int(slots.size()) != nthreads) slots.resize(nthreads);
+        for (auto &s : slots) s.v.clear();
+    }
+    //the vector of a thread (omp_get_thread_num())
+    std::vector< T > &operator[](int thread) { return slots[thread].v; }
+    const std::vector< T > &operator[](int thread) const { return slots[thread].v; }
+    int threads() const { return slots.size(); }
+    //the capacity of each thread's vector, when a bound of its results is known
+    void reserve(size_t n) {
+        for (auto &s : slots) s.v.reserve(n);
+    }
+    size_t size() const {
+        size_t n = 0;
+        for (auto &s : slots) n += s.v.size();
+        return n;
+    }
+    //appends the results to v, moving them. Each thread's results are moved to its offset, the prefix sum of the
+    //sizes of the previous threads, on nthreads threads. The vectors are left with moved-from elements, to be cleared
+    //by the next reset
+    void join(std::vector< T > &v, bool clearv = false, int nthreads = 1) {
+        if (clearv) v.clear();
+        std::vector< size_t > offsets(slots.size() + 1, v.size());
+        for (size_t i = 0; i < slots.size(); i++) offsets[i + 1] = offsets[i] + slots[i].v.size();
+        if (offsets.back() == v.size()) return;
+        v.resize(offsets.back());
+#pragma omp parallel for schedule(static) num_threads(nthreads) if (offsets.back() - offsets[0] > 256)
+        for (int i = 0; i < int(slots.size()); i++)
+            std::move(slots[i].v.begin(), slots[i].v.end(), v.begin() + offsets[i]);
+    }
+
+  private:
+    //a full line of padding after each header, wherever the slots are allocated
+    struct slot {
+        std::vector< T > v;
+        char pad[64];
+    };
+    std::vector< slot > slots;
+};
+};
+#endif
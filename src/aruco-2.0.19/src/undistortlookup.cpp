@@ -0,0 +1,155 @@
+/*****************************
+Copyright 2011 Rafael Muñoz Salinas. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY Rafael Muñoz Salinas ''AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Rafael Muñoz Salinas OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Rafael Muñoz Salinas.
+********************************/
+#include "undistortlookup.h"
+#include "projectionkernel.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+using namespace std;
+namespace aruco {
+
+// nodes of a grid of step pixels from origin, covering size
+static vector< cv::Point2f > gridNodes(cv::Point2f origin, cv::Size2f size, int step, cv::Size &grid) {
+    grid = cv::Size(int(size.width / step) + 2, int(size.height / step) + 2);
+    vector< cv::Point2f > nodes;
+    nodes.reserve(grid.area());
+    for (int y = 0; y < grid.height; y++)
+        for (int x = 0; x < grid.width; x++)
+            nodes.push_back(cv::Point2f(origin.x + x * step, origin.y + y * step));
+    return nodes;
+}
+
+void UndistortLookup::create(const cv::Mat &camMatrix, const cv::Mat &distCoeff, cv::Size imageSize, int step,
+                             const cv::Mat &R, const cv::Mat &P) {
+    camMatrix.convertTo(_camMatrix, CV_64F);
+    distCoeff.convertTo(_distCoeff, CV_64F);
+    R.convertTo(_R, CV_64F);
+    if (P.empty())
+        _P = _camMatrix.clone();
+    else
+        P.convertTo(_P, CV_64F);
+    _imageSize = imageSize;
+    _step = std::max(1, step);
+    _invStep = 1.f / _step;
+
+    // the undistortion table covers the image with a margin of a node, for the corners refined slightly outside it
+    cv::Size grid;
+    _undistortTable.origin = cv::Point2f(-_step, -_step);
+    vector< cv::Point2f > nodes = gridNodes(_undistortTable.origin, cv::Size2f(imageSize.width + _step, imageSize.height + _step),
+                                            _step, grid), mapped;
+    undistortExact(nodes, mapped);
+    _undistortTable.nodes = cv::Mat(mapped, true).reshape(2, grid.height);
+
+    // the distortion table covers the undistortion of the image, so that the points undistorted from the image, and the
+    // lines fit to them, map back
+    _distortTable.nodes.release();
+    if (!_R.empty() || _P.size() != _camMatrix.size() || cv::norm(_P, _camMatrix, cv::NORM_INF) > 0)
+        return;
+    float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+    for (auto &p : mapped) {
+        x0 = std::min(x0, p.x);
+        y0 = std::min(y0, p.y);
+        x1 = std::max(x1, p.x);
+        y1 = std::max(y1, p.y);
+    }
+    _distortTable.origin = cv::Point2f(std::floor(x0) - _step, std::floor(y0) - _step);
+    nodes = gridNodes(_distortTable.origin, cv::Size2f(x1 - _distortTable.origin.x + _step, y1 - _distortTable.origin.y + _step),
+                      _step, grid);
+    distortExact(nodes, mapped);
+    _distortTable.nodes = cv::Mat(mapped, true).reshape(2, grid.height);
+}
+
+bool UndistortLookup::matches(const cv::Mat &camMatrix, const cv::Mat &distCoeff, cv::Size imageSize, int step) const {
+    if (empty() || imageSize != _imageSize || std::max(1, step) != _step || !_R.empty() || !canDistort() ||
+        camMatrix.total() != _camMatrix.total() || distCoeff.total() != _distCoeff.total())
+        return false;
+    cv::Mat K, D;
+    camMatrix.convertTo(K, CV_64F);
+    distCoeff.convertTo(D, CV_64F);
+    return cv::norm(K.reshape(1, 1), _camMatrix.reshape(1, 1), cv::NORM_INF) == 0 &&
+           cv::norm(D.reshape(1, 1), _distCoeff.reshape(1, 1), cv::NORM_INF) == 0;
+}
+
+bool UndistortLookup::interpolate(const table &t, cv::Point2f p, cv::Point2f &out) const {
+    float gx = (p.x - t.origin.x) * _invStep, gy = (p.y - t.origin.y) * _invStep;
+    if (!(gx >= 0 && gy >= 0)) // also false for NaN
+        return false;
+    int ix = int(gx), iy = int(gy);
+    if (ix >= t.nodes.cols - 1 || iy >= t.nodes.rows - 1)
+        return false;
+    float wx = gx - ix, wy = gy - iy;
+    const cv::Point2f *top = t.nodes.ptr< cv::Point2f >(iy) + ix, *bottom = t.nodes.ptr< cv::Point2f >(iy + 1) + ix;
+    cv::Point2f a = top[0] + (top[1] - top[0]) * wx, b = bottom[0] + (bottom[1] - bottom[0]) * wx;
+    out = a + (b - a) * wy;
+    return true;
+}
+
+void UndistortLookup::undistort(const vector< cv::Point2f > &in, vector< cv::Point2f > &out) const {
+    out.resize(in.size());
+    for (size_t i = 0; i < in.size(); i++)
+        if (!interpolate(_undistortTable, in[i], out[i])) {
+            vector< cv::Point2f > p(1, in[i]);
+            undistortExact(p, p);
+            out[i] = p[0];
+        }
+}
+
+void UndistortLookup::distort(const vector< cv::Point2f > &in, vector< cv::Point2f > &out) const {
+    out.resize(in.size());
+    for (size_t i = 0; i < in.size(); i++)
+        if (!interpolate(_distortTable, in[i], out[i])) {
+            vector< cv::Point2f > p(1, in[i]);
+            distortExact(p, p);
+            out[i] = p[0];
+        }
+}
+
+void UndistortLookup::undistortExact(const vector< cv::Point2f > &in, vector< cv::Point2f > &out) const {
+    if (in.empty()) {
+        out.clear();
+        return;
+    }
+    cv::undistortPoints(in, out, _camMatrix, _distCoeff, _R, _P);
+}
+
+// the points are moved to normalized coordinates with the camera matrix, and projected with the distortion
+void UndistortLookup::distortExact(const vector< cv::Point2f > &in, vector< cv::Point2f > &out) const {
+    if (in.empty()) {
+        out.clear();
+        return;
+    }
+    double fx = _camMatrix.at< double >(0, 0), fy = _camMatrix.at< double >(1, 1);
+    double cx = _camMatrix.at< double >(0, 2), cy = _camMatrix.at< double >(1, 2);
+    vector< cv::Point3f > rays(in.size());
+    for (size_t i = 0; i < in.size(); i++)
+        rays[i] = cv::Point3f((in[i].x - cx) / fx, (in[i].y - cy) / fy, 1);
+    ProjectionKernel(_camMatrix, _distCoeff).project(rays, out);
+}
+}
@@ -0,0 +1,79 @@
+/*****************************
+Copyright 2011 Rafael Muñoz Salinas. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY Rafael Muñoz Salinas ''AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL Rafael Muñoz Salinas OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of Rafael Muñoz Salinas.
+********************************/
+#ifndef _Aruco_UndistortLookup_H
+#define _Aruco_UndistortLookup_H
+#include "exports.h"
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+namespace aruco {
+/**\brief Point undistortion and distortion of a camera by table lookup
+ *
+ * cv::undistortPoints solves the distortion model iteratively for every point, and distorting a point builds
+ * matrices for cv::projectPoints. This computes both once, exactly, on the nodes of a grid of step pixels, and
+ * then maps each point by bilinear interpolation between the four nodes around it. The undistortion table covers
+ * the image, and the distortion table covers the undistorted image. Points outside the tables are mapped exactly.
+ * The tables are only read by the lookups, so they can be shared by threads
+ */
+class ARUCO_EXPORTS UndistortLookup {
+public:
+    UndistortLookup() : _step(0) {}
+
+    /**Computes the tables of a camera for images of a size. Undistorted points are in the pixels of P, after the
+     * rectification R, as in cv::undistortPoints. With R empty and P empty or the camera matrix, the distortion
+     * table is computed too. The error of the interpolation grows with step and with the distortion:
+     * 8 pixels keeps it in the hundredths of a pixel for usual lenses
+     */
+    void create(const cv::Mat &camMatrix, const cv::Mat &distCoeff, cv::Size imageSize, int step = 8,
+                const cv::Mat &R = cv::Mat(), const cv::Mat &P = cv::Mat());
+    //true if the tables are those of this camera (without rectification), image size and step
+    bool matches(const cv::Mat &camMatrix, const cv::Mat &distCoeff, cv::Size imageSize, int step) const;
+    bool empty() const { return _step == 0; }
+    //undistorts image points, as cv::undistortPoints with the R and P of create. out may be in
+    void undistort(const std::vector< cv::Point2f > &in, std::vector< cv::Point2f > &out) const;
+    //distorts points in the pixels of the camera matrix, as the inverse of undistort. Needs the distortion table
+    void distort(const std::vector< cv::Point2f > &in, std::vector< cv::Point2f > &out) const;
+    bool canDistort() const { return !_distortTable.nodes.empty(); }
+
+private:
+    struct table {
+        cv::Mat nodes;//CV_32FC2 mapped position of each node
+        cv::Point2f origin;//position of the first node
+    };
+    bool interpolate(const table &t, cv::Point2f p, cv::Point2f &out) const;
+    void undistortExact(const std::vector< cv::Point2f > &in, std::vector< cv::Point2f > &out) const;
+    void distortExact(const std::vector< cv::Point2f > &in, std::vector< cv::Point2f > &out) const;
+
+    cv::Mat _camMatrix, _distCoeff, _R, _P;//CV_64F copies of the camera, to map the points outside the tables
+    cv::Size _imageSize;
+    int _step;
+    float _invStep;
+    table _undistortTable, _distortTable;
+};
+}
+#endif
@@ -0,0 +1,136 @@
+#include "arucoBackend.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#ifdef WITH_OPENCV_ARUCO
+#include "opencv2/aruco.hpp"
+#endif
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+using namespace cv;
+
+namespace {
+
+// The detector of the vendored library, with its own parameters and labelers
+class vendoredBackend : public ArucoBackend
+{
+public:
+    void detect(aruco::MarkerDetector &detector, const vector<string> &, const Mat &gray,
+                vector<vector<aruco::Marker> > &markers)
+    {
+        detector.detect(gray, markers);
+    }
+};
+
+#ifdef WITH_OPENCV_ARUCO
+// cv::aruco::detectMarkers, with the parameters of the vendored detector translated
+class opencvBackend : public ArucoBackend
+{
+public:
+    void detect(aruco::MarkerDetector &detector, const vector<string> &dictionaries, const Mat &gray,
+                vector<vector<aruco::Marker> > &markers)
+    {
+        // The region of interest of the vendored detector, if any, is searched the same way
+        const vector<Point> &roi = detector.getROI();
+        Rect box = detector.roiBox(gray.size());
+        Point2f offset((float)box.x, (float)box.y);
+        markers.assign(dictionaries.size(), vector<aruco::Marker>());
+        if (box.area() == 0) return;
+        Ptr<cv::aruco::DetectorParameters> params = detectorParameters(detector.getParams(), box.size());
+        vector<vector<Point2f> > corners;
+        vector<int> indices;
+        for (size_t d = 0; d < dictionaries.size(); d++)
+        {
+            const dictionary &dict = get(dictionaries[d]);
+            corners.clear();
+            indices.clear();
+            cv::aruco::detectMarkers(gray(box), dict.dict, corners, indices, params);
+            for (size_t i = 0; i < indices.size(); i++)
+            {
+                for (auto &p:corners[i]) p += offset;
+                aruco::Marker marker(corners[i], dict.ids[indices[i]]);
+                if (roi.empty() || pointPolygonTest(roi, marker.getCenter(), false) >= 0)
+                    markers[d].push_back(marker);
+            }
+            // The vendored detector returns them sorted by id
+            sort(markers[d].begin(), markers[d].end(),
+                 [](const aruco::Marker &a, const aruco::Marker &b) { return a.id < b.id; });
+        }
+    }
+
+private:
+    // A vendored dictionary as an OpenCV one, and the vendored id of each of its markers
+    struct dictionary {
+        Ptr<cv::aruco::Dictionary> dict;
+        vector<int> ids;
+    };
+
+    // The OpenCV version of a dictionary, made once. Bit nbits-1-(y*n+x) of a vendored code is the cell (y,x),
+    // white if set, as in cv::aruco
+    const dictionary &get(const string &name)
+    {
+        lock_guard<mutex> lock(m);
+        dictionary &d = cache[name];
+        if (d.dict.empty())
+        {
+            aruco::Dictionary vendored = aruco::Dictionary::load(name);
+            int nbits = vendored.nbits(), n = (int)(sqrt((double)nbits) + 0.5);
+            Mat bytesList;
+            for (auto &code:vendored.getMapCode())
+            {
+                Mat bits(n, n, CV_8UC1);
+                for (int y = 0; y < n; y++)
+                    for (int x = 0; x < n; x++)
+                        bits.at<uchar>(y, x) = (code.first >> (nbits - 1 - (y*n + x))) & 1;
+                bytesList.push_back(cv::aruco::Dictionary::getByteListFromBits(bits));
+                d.ids.push_back(code.second);
+            }
+            d.dict = makePtr<cv::aruco::Dictionary>(bytesList, n, max(0, ((int)vendored.tau() - 1)/2));
+        }
+        return d;
+    }
+
+    // Same window sizes, marker sizes and corner refinement as the vendored detector
+    static Ptr<cv::aruco::DetectorParameters> detectorParameters(const aruco::MarkerDetector::Params &p, Size size)
+    {
+        Ptr<cv::aruco::DetectorParameters> params = cv::aruco::DetectorParameters::create();
+        int maxDim = max(size.width, size.height);
+        params->adaptiveThreshWinSizeMin = max(3, (int)(p._thresParam1 - 2*p._thresParam1_range));
+        params->adaptiveThreshWinSizeMax = max(params->adaptiveThreshWinSizeMin, (int)(p._thresParam1 + 2*p._thresParam1_range));
+        params->adaptiveThreshWinSizeStep = 2;
+        params->adaptiveThreshConstant = p._thresParam2;
+        params->minMarkerPerimeterRate = min((double)p._minSize_pix, 4.*p._minSize*maxDim)/maxDim;
+        params->maxMarkerPerimeterRate = 4.*p._maxSize;
+        params->minDistanceToBorder = (int)(p._borderDistThres*maxDim);
+        params->perspectiveRemovePixelPerCell = max(4, p._markerWarpSize/8);
+        if (p._cornerMethod == aruco::MarkerDetector::SUBPIX)
+        {
+            params->cornerRefinementMethod = cv::aruco::CORNER_REFINE_SUBPIX;
+            params->cornerRefinementWinSize = max(1, (int)p._subpix_wsize);
+        }
+        else if (p._cornerMethod == aruco::MarkerDetector::LINES)
+            params->cornerRefinementMethod = cv::aruco::CORNER_REFINE_CONTOUR;
+        else
+            params->cornerRefinementMethod = cv::aruco::CORNER_REFINE_NONE;
+        return params;
+    }
+
+    mutex m;
+    map<string, dictionary> cache;
+};
+#endif
+
+}
+
+ArucoBackend *ArucoBackend::get(Type type)
+{
+    static vendoredBackend vendored;
+#ifdef WITH_OPENCV_ARUCO
+    static opencvBackend opencv;
+    if (type == OPENCV) return &opencv;
+#endif
+    return type == VENDORED ? &vendored : NULL;
+}
@@ -0,0 +1,38 @@
+/*
+Marker detection backends of the ArUco patterns.
+
+The markers are detected either by the vendored ArUco library (aruco::MarkerDetector) or by the aruco module
+of OpenCV 3 and later (cv::aruco::detectMarkers), selected by the Aruco_Backend setting. Both give the markers
+of each dictionary of the pattern sorted by id, with their corners in the order of the vendored library, so
+the points and point keys of a view do not depend on the backend, only the corner positions do.
+
+The OpenCV backend is only built with OPENCV_ARUCO=1 (see the Makefile), since it needs the opencv_aruco
+library of opencv_contrib. Its dictionaries are made from the codes of the vendored ones, so custom
+dictionary files work with it too.
+*/
+
+#ifndef _arucoBackend_H
+#define _arucoBackend_H
+
+#include "opencv2/core/core.hpp"
+#include <string>
+#include <vector>
+#include "markerdetector.h"
+
+class ArucoBackend
+{
+public:
+    enum Type { VENDORED, OPENCV };
+    virtual ~ArucoBackend() {}
+
+    // Detects the markers of each dictionary in a grayscale image, with the parameters of a detector whose
+    // dictionaries were set to those (see MarkerDetector::setDictionaries). Safe to call from any thread, with
+    // a detector per thread
+    virtual void detect(aruco::MarkerDetector &detector, const std::vector<std::string> &dictionaries,
+                        const cv::Mat &gray, std::vector<std::vector<aruco::Marker> > &markers) = 0;
+
+    // Shared instance of a backend, or NULL if it was not built
+    static ArucoBackend *get(Type type);
+};
+
+#endif
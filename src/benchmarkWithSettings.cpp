@@ -0,0 +1,177 @@
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aruco.h"
+
+using namespace std;
+using namespace cv;
+using namespace aruco;
+
+#include "calibration.h"
+
+// Parses a comma separated list of integers
+static bool parseList(const char *arg, vector<int> &values)
+{
+    values.clear();
+    stringstream str(arg);
+    string item;
+    while (getline(str, item, ','))
+    {
+        char *end;
+        long v = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end || v < 0)
+            return false;
+        values.push_back((int)v);
+    }
+    return !values.empty();
+}
+
+// Reads the rows of a results file, keyed by dataset, stage, width and threads
+static bool readResults(const string &filename, map<string, double> &results)
+{
+    ifstream file(filename.c_str());
+    if (!file)
+        return false;
+    string line;
+    getline(file, line);        // Header
+    while (getline(file, line))
+    {
+        size_t last = line.find_last_of(','), count = line.find_last_of(',', last - 1);
+        if (last == string::npos || count == string::npos)
+            continue;
+        results[line.substr(0, count)] = atof(line.c_str() + last + 1);
+    }
+    return true;
+}
+
+int main( int argc, char** argv )
+{
+    vector<int> widths, threads;
+    widths.push_back(640);
+    widths.push_back(1280);
+    widths.push_back(0);
+    threads.push_back(1);
+    int nCores = (int)std::thread::hardware_concurrency();
+    if (nCores > 1) threads.push_back(nCores);
+    int repeats = 3;
+    string baseline;
+    double tolerance = 1.25;
+    double noiseFloor = 0.1;     // Differences below this many milliseconds are never regressions
+
+    bool scaling = false, widthsSet = false, threadsSet = false;
+    vector<string> stressLists;
+
+    int a = 1;
+    bool ok = true;
+    for (; ok && a + 1 < argc && argv[a][0] == '-'; a += 2)
+    {
+        if (!strcmp(argv[a], "-s")) { scaling = true; a--; }
+        else if (!strcmp(argv[a], "-w")) ok = widthsSet = parseList(argv[a + 1], widths);
+        else if (!strcmp(argv[a], "-t")) ok = threadsSet = parseList(argv[a + 1], threads);
+        else if (!strcmp(argv[a], "-r")) ok = (repeats = atoi(argv[a + 1])) > 0;
+        else if (!strcmp(argv[a], "-p")) {
+            stringstream str(argv[a + 1]);
+            string list;
+            while (getline(str, list, ',')) stressLists.push_back(list);
+        }
+        else if (!strcmp(argv[a], "-b")) baseline = argv[a + 1];
+        else if (!strcmp(argv[a], "-x")) ok = (tolerance = atof(argv[a + 1])) >= 1;
+        else ok = false;
+    }
+    for (int t:threads) ok &= t > 0;
+    if (!ok || argc - a < 2) {
+        cerr << "Usage: benchmarkWithSettings [-s] [-p lists] [-w widths] [-t threads] [-r repeats] [-b baseline.csv]"
+                " [-x tolerance] results.csv settings.yml..." << endl
+             << "   -s   strong and weak scaling of the detection and calibration, instead of the measurements" << endl
+             << "        (default widths 0, default threads 1, 2, 4... and the number of cores)" << endl
+             << "   -p   comma separated image lists or folders, detected with each settings file instead of its list," << endl
+             << "        for the tail latency of each frame (p50, p95, p99 and max). The frames are written to" << endl
+             << "        the results file name ending in _frames.csv" << endl
+             << "   -w   comma separated image widths, 0 for the native width (default 640,1280,0)" << endl
+             << "   -t   comma separated detection thread counts (default 1 and the number of cores)" << endl
+             << "   -r   runs of each measurement, the fastest is kept (default 3)" << endl
+             << "   -b   results of a previous build. Measurements slower than the tolerance times" << endl
+             << "        the baseline are reported, and the program returns 1" << endl
+             << "   -x   tolerance for the baseline comparison (default 1.25)" << endl;
+        return -1;
+    }
+
+    const char *resultsFile = argv[a];
+    ofstream out(resultsFile);
+    if (!out) {
+        cerr << "Could not create " << resultsFile << endl;
+        return -1;
+    }
+    if (scaling) {
+        if (!widthsSet) widths.assign(1, 0);
+        if (!threadsSet) {
+            threads.clear();
+            for (int t = 1; t < nCores; t *= 2) threads.push_back(t);
+            threads.push_back(max(1, nCores));
+        }
+        out << "dataset,scaling,stage,width,threads,count,ms,throughput,speedup,efficiency,serial_fraction" << endl;
+        for (int i = a + 1; i < argc; i++)
+            if (scalingBenchmarkWithSettings(argv[i], widths, threads, repeats, out) != 0)
+                return -1;
+        out.close();
+        printf("\nScaling results written to %s\n", resultsFile);
+        return 0;
+    }
+    out << "dataset,stage,width,threads,count,ms" << endl;
+    if (!stressLists.empty()) {
+        string framesFile = resultsFile;
+        if (framesFile.size() > 4 && framesFile.compare(framesFile.size() - 4, 4, ".csv") == 0)
+            framesFile.erase(framesFile.size() - 4);
+        framesFile += "_frames.csv";
+        ofstream frames(framesFile.c_str());
+        if (!frames) {
+            cerr << "Could not create " << framesFile << endl;
+            return -1;
+        }
+        frames << "dataset,image,ms,detect_ms,candidates,contours,points,over_budget" << endl;
+        for (int i = a + 1; i < argc; i++)
+            for (const string &list:stressLists)
+                if (stressBenchmarkWithSettings(argv[i], list, repeats, out, frames) != 0)
+                    return -1;
+    }
+    else
+        for (int i = a + 1; i < argc; i++)
+            if (benchmarkWithSettings(argv[i], widths, threads, repeats, out) != 0)
+                return -1;
+    out.close();
+    printf("\nBenchmark results written to %s\n", resultsFile);
+
+    if (baseline.empty())
+        return 0;
+    map<string, double> before, after;
+    if (!readResults(baseline, before) || !readResults(resultsFile, after)) {
+        cerr << "Could not read the baseline: " << baseline << endl;
+        return -1;
+    }
+    int nRegressions = 0, nCompared = 0;
+    for (auto &r:after)
+    {
+        auto b = before.find(r.first);
+        if (b == before.end())
+            continue;
+        nCompared++;
+        if (r.second > b->second*tolerance && r.second - b->second > noiseFloor)
+        {
+            printf("Regression: %s %.4f ms, baseline %.4f ms\n", r.first.c_str(), r.second, b->second);
+            nRegressions++;
+        }
+    }
+    printf("%d of %d measurements slower than %.2f times the baseline\n", nRegressions, nCompared, tolerance);
+    return nRegressions > 0 ? 1 : 0;
+}
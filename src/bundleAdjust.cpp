@@ -0,0 +1,465 @@
+/*
+Bundle adjustment of the intrinsics and view poses of a calibration. See bundleAdjust.h
+*/
+
+#include "bundleAdjust.h"
+
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+
+typedef Matrix<double, 6, 6> MatrixPP;
+typedef Matrix<double, 6, 1> VectorP;
+typedef Matrix<double, Dynamic, 6> MatrixGP;
+typedef Matrix<double, 2, BA_NINTRINSICS> JacobianC;
+typedef Matrix<double, 2, 6> JacobianP;
+
+//struct to store a pose during the optimization
+struct baPose {
+    Matrix3d R;
+    Vector3d t;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+//struct to store the normal equations of a view that are not shared: the pose block V, the
+//camera-pose block W and the right hand side -J^T r of the pose (bp)
+struct baViewBlocks {
+    MatrixGP W;
+    MatrixPP V;
+    VectorP bp;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+typedef std::vector<baPose, aligned_allocator<baPose> > poseList;
+typedef std::vector<baViewBlocks, aligned_allocator<baViewBlocks> > blockList;
+typedef std::vector<MatrixPP, aligned_allocator<MatrixPP> > matrixPPList;
+
+//struct to store the state of the optimization: the intrinsics of each camera and the poses of the
+//cameras (the first one is the identity) and of the views
+struct baState {
+    std::vector<double> intrinsics;
+    poseList cameras, views;
+};
+
+baOptions::baOptions() : fixAspectRatio(false), maxIterations(100), epsilon(1e-10), loss(BA_SQUARED_LOSS), lossScale(1)
+{
+    for (int i = 0; i < BA_NINTRINSICS; i++) fixed[i] = false;
+}
+
+static Matrix3d skew(const Vector3d &v)
+{
+    Matrix3d m;
+    m << 0, -v.z(), v.y(),
+         v.z(), 0, -v.x(),
+         -v.y(), v.x(), 0;
+    return m;
+}
+
+static Matrix3d rodriguesToMatrix(const double r[3])
+{
+    Vector3d w(r[0], r[1], r[2]);
+    double angle = w.norm();
+    if (angle < 1e-15) return Matrix3d::Identity();
+    return AngleAxisd(angle, w / angle).toRotationMatrix();
+}
+
+static void matrixToRodrigues(const Matrix3d &R, double r[3])
+{
+    AngleAxisd aa(R);
+    Vector3d w = aa.axis() * aa.angle();
+    for (int i = 0; i < 3; i++) r[i] = w(i);
+}
+
+// Applies a pose update (w, v): R <- exp(w) R, t <- t + v
+static baPose updatePose(const baPose &pose, const VectorP &d)
+{
+    baPose p;
+    p.R = rodriguesToMatrix(d.data()) * pose.R;
+    p.t = pose.t + d.tail<3>();
+    return p;
+}
+
+// Projects a point in camera coordinates. If Jc and A are not null, they receive the derivatives
+// of the projection wrt the intrinsics and wrt the point
+static Vector2d project(const double *k, const Vector3d &Xc, JacobianC *Jc, Matrix<double, 2, 3> *A)
+{
+    double iz = 1. / Xc.z();
+    double x = Xc.x() * iz, y = Xc.y() * iz;
+    double r2 = x*x + y*y, r4 = r2*r2, r6 = r4*r2;
+    double fx = k[BA_FX], fy = k[BA_FY], k1 = k[BA_K1], k2 = k[BA_K2], p1 = k[BA_P1], p2 = k[BA_P2], k3 = k[BA_K3];
+    double radial = 1 + k1*r2 + k2*r4 + k3*r6;
+    double xd = x*radial + 2*p1*x*y + p2*(r2 + 2*x*x);
+    double yd = y*radial + p1*(r2 + 2*y*y) + 2*p2*x*y;
+
+    if (Jc)
+    {
+        *Jc << xd, 0, 1, 0, fx*x*r2, fx*x*r4, fx*2*x*y, fx*(r2 + 2*x*x), fx*x*r6,
+               0, yd, 0, 1, fy*y*r2, fy*y*r4, fy*(r2 + 2*y*y), fy*2*x*y, fy*y*r6;
+    }
+    if (A)
+    {
+        // Chain rule: distorted point wrt normalized point wrt camera point
+        double dr = k1 + 2*k2*r2 + 3*k3*r4;
+        Matrix2d D;
+        D << fx*(radial + 2*x*x*dr + 2*p1*y + 6*p2*x), fx*(2*x*y*dr + 2*p1*x + 2*p2*y),
+             fy*(2*x*y*dr + 2*p1*x + 2*p2*y), fy*(radial + 2*y*y*dr + 6*p1*y + 2*p2*x);
+        Matrix<double, 2, 3> P;
+        P << iz, 0, -x*iz,
+             0, iz, -y*iz;
+        *A = D * P;
+    }
+    return Vector2d(fx*xd + k[BA_CX], fy*yd + k[BA_CY]);
+}
+
+static int pointCamera(const baView &view, int j)
+{
+    return view.cameras.empty() ? 0 : view.cameras[j];
+}
+
+// Loss of a point with a squared reprojection error e2. Huber is quadratic up to the scale and linear beyond,
+// Cauchy logarithmic beyond. Both equal e2 for small errors
+static double pointLoss(const baOptions &opt, double e2)
+{
+    double d2 = opt.lossScale * opt.lossScale;
+    switch (opt.loss)
+    {
+    case BA_HUBER_LOSS:
+        return e2 <= d2 ? e2 : 2 * opt.lossScale * std::sqrt(e2) - d2;
+    case BA_CAUCHY_LOSS:
+        return d2 * std::log1p(e2 / d2);
+    default:
+        return e2;
+    }
+}
+
+// Weight of the normal equations of a point with a squared reprojection error e2: the derivative of its loss
+static double pointWeight(const baOptions &opt, double e2)
+{
+    double d2 = opt.lossScale * opt.lossScale;
+    switch (opt.loss)
+    {
+    case BA_HUBER_LOSS:
+        return e2 <= d2 ? 1. : opt.lossScale / std::sqrt(e2);
+    case BA_CAUCHY_LOSS:
+        return 1. / (1. + e2 / d2);
+    default:
+        return 1.;
+    }
+}
+
+// Sum of the losses of the reprojection errors of a view
+static double viewCost(const baState &st, int i, const baView &view, const baOptions &opt)
+{
+    double cost = 0;
+    int n = (int)view.objectPoints.size() / 3;
+    for (int j = 0; j < n; j++)
+    {
+        const double *X = &view.objectPoints[3*j];
+        int c = pointCamera(view, j);
+        Vector3d Y = st.views[i].R * Vector3d(X[0], X[1], X[2]) + st.views[i].t;
+        Vector3d Xc = st.cameras[c].R * Y + st.cameras[c].t;
+        Vector2d r = project(&st.intrinsics[c * BA_NINTRINSICS], Xc, NULL, NULL)
+                     - Vector2d(view.imagePoints[2*j], view.imagePoints[2*j + 1]);
+        cost += pointLoss(opt, r.squaredNorm());
+    }
+    return cost;
+}
+
+// The sums over the views are split in chunks of this many views, in view order. The chunks are summed in
+// parallel and then added in chunk order, so the sums, and the solve, are the same on any number of threads
+static const int chunkViews = 16;
+
+static int nChunks(const std::vector<baView> &views)
+{
+    return ((int)views.size() + chunkViews - 1) / chunkViews;
+}
+
+static double totalCost(const baState &st, const std::vector<baView> &views, const baOptions &opt)
+{
+    int n = nChunks(views);
+    std::vector<double> chunkCost(n, 0.);
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < n; k++)
+        for (int i = k * chunkViews; i < std::min((k + 1) * chunkViews, (int)views.size()); i++)
+            chunkCost[k] += viewCost(st, i, views[i], opt);
+    double cost = 0;
+    for (int k = 0; k < n; k++)
+        cost += chunkCost[k];
+    return cost;
+}
+
+// Builds the normal equations of a view, adding its camera blocks to U and bc. The intrinsics of
+// camera c are at c*BA_NINTRINSICS of the camera parameters, followed by the poses of cameras 1..n-1.
+// With a robust loss, the residual and derivatives of each point are scaled by the square root of its weight
+static void viewNormalEquations(const baState &st, int i, const baView &view, const baOptions &opt,
+                                baViewBlocks &b, MatrixXd &U, VectorXd &bc)
+{
+    int nCameras = (int)st.cameras.size();
+    b.W.setZero(U.rows(), 6); b.V.setZero(); b.bp.setZero();
+    JacobianC Jc;
+    JacobianP Jp, Jr;
+    Matrix<double, 2, 3> A;
+    int n = (int)view.objectPoints.size() / 3;
+    for (int j = 0; j < n; j++)
+    {
+        const double *X = &view.objectPoints[3*j];
+        int c = pointCamera(view, j);
+        const double *k = &st.intrinsics[c * BA_NINTRINSICS];
+        Vector3d RX = st.views[i].R * Vector3d(X[0], X[1], X[2]);
+        Vector3d Y = RX + st.views[i].t;
+        Vector3d RY = st.cameras[c].R * Y;
+        Vector2d r = project(k, RY + st.cameras[c].t, &Jc, &A)
+                     - Vector2d(view.imagePoints[2*j], view.imagePoints[2*j + 1]);
+        if (opt.loss != BA_SQUARED_LOSS)
+        {
+            double w = std::sqrt(pointWeight(opt, r.squaredNorm()));
+            r *= w; Jc *= w; A *= w;
+        }
+
+        // With a fixed aspect ratio, fy follows fx
+        if (opt.fixAspectRatio)
+        {
+            Jc.col(BA_FX) += Jc.col(BA_FY) * (k[BA_FY] / k[BA_FX]);
+            Jc.col(BA_FY).setZero();
+        }
+        Matrix<double, 2, 3> AR = A * st.cameras[c].R;
+        Jp.leftCols<3>() = -AR * skew(RX);
+        Jp.rightCols<3>() = AR;
+
+        int ic = c * BA_NINTRINSICS;
+        U.block<BA_NINTRINSICS, BA_NINTRINSICS>(ic, ic).noalias() += Jc.transpose() * Jc;
+        bc.segment<BA_NINTRINSICS>(ic).noalias() -= Jc.transpose() * r;
+        b.W.block<BA_NINTRINSICS, 6>(ic, 0).noalias() += Jc.transpose() * Jp;
+        if (c > 0)
+        {
+            int ir = nCameras * BA_NINTRINSICS + (c - 1) * 6;
+            Jr.leftCols<3>() = -A * skew(RY);
+            Jr.rightCols<3>() = A;
+            U.block<6, 6>(ir, ir).noalias() += Jr.transpose() * Jr;
+            U.block<BA_NINTRINSICS, 6>(ic, ir).noalias() += Jc.transpose() * Jr;
+            U.block<6, BA_NINTRINSICS>(ir, ic).noalias() += Jr.transpose() * Jc;
+            bc.segment<6>(ir).noalias() -= Jr.transpose() * r;
+            b.W.block<6, 6>(ir, 0).noalias() += Jr.transpose() * Jp;
+        }
+        b.V.noalias() += Jp.transpose() * Jp;
+        b.bp.noalias() -= Jp.transpose() * r;
+    }
+}
+
+// Builds the normal equations of every view, in parallel. The rows of the fixed camera parameters are
+// cleared, so they are not updated
+static void normalEquations(const baState &st, const std::vector<baView> &views, const baOptions &opt,
+                            const std::vector<bool> &fixedParam, blockList &blocks, MatrixXd &U, VectorXd &bc)
+{
+    int nParams = (int)fixedParam.size();
+    int n = nChunks(views);
+    std::vector<MatrixXd> chunkU(n);
+    std::vector<VectorXd> chunkBc(n);
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < n; k++)
+    {
+        chunkU[k].setZero(nParams, nParams);
+        chunkBc[k].setZero(nParams);
+        for (int i = k * chunkViews; i < std::min((k + 1) * chunkViews, (int)views.size()); i++)
+        {
+            viewNormalEquations(st, i, views[i], opt, blocks[i], chunkU[k], chunkBc[k]);
+            for (int p = 0; p < nParams; p++)
+                if (fixedParam[p]) blocks[i].W.row(p).setZero();
+        }
+    }
+    U.setZero(nParams, nParams);
+    bc.setZero(nParams);
+    for (int k = 0; k < n; k++)
+    {
+        U += chunkU[k];
+        bc += chunkBc[k];
+    }
+    for (int p = 0; p < nParams; p++)
+        if (fixedParam[p])
+        {
+            U.row(p).setZero(); U.col(p).setZero();
+            bc(p) = 0;
+        }
+}
+
+// Reduced camera system with damping lambda: S = U - sum W V^-1 W^T, s = bc - sum W V^-1 bp.
+// The fixed parameters get an identity row, so S stays invertible
+static void reducedSystem(const blockList &blocks, const MatrixXd &U, const VectorXd &bc, double lambda,
+                          const std::vector<bool> &fixedParam, matrixPPList &Vinv,
+                          std::vector<MatrixGP, aligned_allocator<MatrixGP> > &WVinv, MatrixXd &S, VectorXd &s)
+{
+    int nParams = (int)fixedParam.size();
+    int nBlocks = (int)blocks.size(), n = (nBlocks + chunkViews - 1) / chunkViews;
+    std::vector<MatrixXd> chunkS(n);
+    std::vector<VectorXd> chunkRhs(n);
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < n; k++)
+    {
+        chunkS[k].setZero(nParams, nParams);
+        chunkRhs[k].setZero(nParams);
+        for (int i = k * chunkViews; i < std::min((k + 1) * chunkViews, nBlocks); i++)
+        {
+            MatrixPP V = blocks[i].V;
+            V.diagonal() *= 1 + lambda;
+            Vinv[i] = V.ldlt().solve(MatrixPP::Identity());
+            WVinv[i] = blocks[i].W * Vinv[i];
+            chunkS[k].noalias() += WVinv[i] * blocks[i].W.transpose();
+            chunkRhs[k].noalias() += WVinv[i] * blocks[i].bp;
+        }
+    }
+    S = U;
+    S.diagonal() *= 1 + lambda;
+    s = bc;
+    for (int k = 0; k < n; k++)
+    {
+        S -= chunkS[k];
+        s -= chunkRhs[k];
+    }
+    for (int p = 0; p < nParams; p++)
+        if (fixedParam[p])
+        {
+            S.row(p).setZero(); S.col(p).setZero();
+            S(p, p) = 1; s(p) = 0;
+        }
+}
+
+double bundleAdjust(baRig &rig, std::vector<baView> &views, const baOptions &opt)
+{
+    int nViews = (int)views.size();
+    int nCameras = rig.nCameras();
+    int nParams = nCameras * BA_NINTRINSICS + (nCameras - 1) * 6;
+    int nPoints = 0;
+
+    baState st;
+    st.intrinsics = rig.intrinsics;
+    st.cameras.resize(nCameras);
+    st.views.resize(nViews);
+    st.cameras[0].R.setIdentity();
+    st.cameras[0].t.setZero();
+    for (int c = 1; c < nCameras; c++)
+    {
+        st.cameras[c].R = rodriguesToMatrix(&rig.rvecs[3*c]);
+        st.cameras[c].t = Vector3d(rig.tvecs[3*c], rig.tvecs[3*c + 1], rig.tvecs[3*c + 2]);
+    }
+    for (int i = 0; i < nViews; i++)
+    {
+        st.views[i].R = rodriguesToMatrix(views[i].rvec);
+        st.views[i].t = Vector3d(views[i].tvec[0], views[i].tvec[1], views[i].tvec[2]);
+        nPoints += (int)views[i].objectPoints.size() / 3;
+    }
+    rig.stdDevs.assign(nParams, 0.);
+    rig.iterations = 0;
+    if (nPoints == 0) return 0;
+
+    // Camera parameters that are not optimized
+    std::vector<bool> fixedParam(nParams, false);
+    std::vector<double> aspectRatio(nCameras);
+    for (int c = 0; c < nCameras; c++)
+    {
+        for (int p = 0; p < BA_NINTRINSICS; p++)
+            fixedParam[c * BA_NINTRINSICS + p] = opt.fixed[p];
+        if (opt.fixAspectRatio) fixedParam[c * BA_NINTRINSICS + BA_FY] = true;
+        aspectRatio[c] = st.intrinsics[c * BA_NINTRINSICS + BA_FX] / st.intrinsics[c * BA_NINTRINSICS + BA_FY];
+    }
+
+    blockList blocks(nViews);
+    matrixPPList Vinv(nViews);
+    std::vector<MatrixGP, aligned_allocator<MatrixGP> > WVinv(nViews);
+    double cost = totalCost(st, views, opt);
+    double lambda = 1e-3;
+
+    for (int iter = 0; iter < opt.maxIterations; iter++)
+    {
+        MatrixXd U, S;
+        VectorXd bc, s;
+        normalEquations(st, views, opt, fixedParam, blocks, U, bc);
+
+        // Increase the damping until a step decreases the cost
+        bool accepted = false;
+        double newCost = cost;
+        baState newSt = st;
+        while (!accepted && lambda < 1e16)
+        {
+            reducedSystem(blocks, U, bc, lambda, fixedParam, Vinv, WVinv, S, s);
+            VectorXd dc = S.ldlt().solve(s);
+
+            for (int p = 0; p < nCameras * BA_NINTRINSICS; p++) newSt.intrinsics[p] = st.intrinsics[p] + dc(p);
+            for (int c = 0; opt.fixAspectRatio && c < nCameras; c++)
+                newSt.intrinsics[c * BA_NINTRINSICS + BA_FY] = newSt.intrinsics[c * BA_NINTRINSICS + BA_FX] / aspectRatio[c];
+            for (int c = 1; c < nCameras; c++)
+                newSt.cameras[c] = updatePose(st.cameras[c], dc.segment<6>(nCameras * BA_NINTRINSICS + (c - 1) * 6));
+
+            // Back substitution of the view pose updates
+            #pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < nViews; i++)
+                newSt.views[i] = updatePose(st.views[i], Vinv[i] * (blocks[i].bp - blocks[i].W.transpose() * dc));
+
+            newCost = totalCost(newSt, views, opt);
+            if (newCost < cost)
+            {
+                accepted = true;
+                lambda = std::max(lambda / 10, 1e-12);
+            }
+            else
+                lambda *= 10;
+        }
+        if (!accepted)
+            break;
+        rig.iterations++;
+
+        double decrease = cost - newCost;
+        std::swap(st, newSt);
+        cost = newCost;
+        if (decrease < opt.epsilon * cost)
+            break;
+    }
+
+    // The error of every point, whatever the loss
+    if (opt.loss != BA_SQUARED_LOSS)
+        cost = totalCost(st, views, baOptions());
+
+    // Covariance of the camera parameters: the inverse of the undamped reduced system (the pose blocks
+    // marginalized), scaled by the residual variance
+    MatrixXd U, S;
+    VectorXd bc, s;
+    normalEquations(st, views, opt, fixedParam, blocks, U, bc);
+    reducedSystem(blocks, U, bc, 0, fixedParam, Vinv, WVinv, S, s);
+    int nFree = nViews * 6;
+    for (int p = 0; p < nParams; p++) nFree += fixedParam[p] ? 0 : 1;
+    double variance = cost / std::max(2 * nPoints - nFree, 1);
+    VectorXd covariance = S.ldlt().solve(MatrixXd::Identity(nParams, nParams)).diagonal();
+    for (int p = 0; p < nParams; p++)
+        if (!fixedParam[p]) rig.stdDevs[p] = std::sqrt(std::max(covariance(p) * variance, 0.));
+    for (int c = 0; opt.fixAspectRatio && c < nCameras; c++)
+        rig.stdDevs[c * BA_NINTRINSICS + BA_FY] = rig.stdDevs[c * BA_NINTRINSICS + BA_FX] / aspectRatio[c];
+
+    rig.intrinsics = st.intrinsics;
+    rig.rvecs.assign(3 * nCameras, 0.);
+    rig.tvecs.assign(3 * nCameras, 0.);
+    for (int c = 1; c < nCameras; c++)
+    {
+        matrixToRodrigues(st.cameras[c].R, &rig.rvecs[3*c]);
+        for (int j = 0; j < 3; j++) rig.tvecs[3*c + j] = st.cameras[c].t(j);
+    }
+    for (int i = 0; i < nViews; i++)
+    {
+        matrixToRodrigues(st.views[i].R, views[i].rvec);
+        for (int j = 0; j < 3; j++) views[i].tvec[j] = st.views[i].t(j);
+    }
+    return std::sqrt(cost / nPoints);
+}
+
+double bundleAdjust(double intrinsics[BA_NINTRINSICS], std::vector<baView> &views, const baOptions &opt,
+                    double stdDevs[BA_NINTRINSICS], int *iterations)
+{
+    baRig rig;
+    rig.intrinsics.assign(intrinsics, intrinsics + BA_NINTRINSICS);
+    double rms = bundleAdjust(rig, views, opt);
+    for (int p = 0; p < BA_NINTRINSICS; p++) intrinsics[p] = rig.intrinsics[p];
+    for (int p = 0; stdDevs && p < BA_NINTRINSICS; p++) stdDevs[p] = rig.stdDevs[p];
+    if (iterations) *iterations = rig.iterations;
+    return rms;
+}
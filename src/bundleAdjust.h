@@ -0,0 +1,71 @@
+/*
+Bundle adjustment of the intrinsics and view poses of a calibration.
+
+The normal equations of a calibration have a block arrow structure: the camera parameters are
+shared by every point, and each pose only by the points of its view. The pose blocks are eliminated
+with a Schur complement, so the cost of an iteration grows linearly with the number of views,
+instead of cubically as in the dense Levenberg-Marquardt of calibrateCamera.
+
+With several cameras, the camera parameters are the intrinsics of each camera and the pose of each
+camera relative to the first one, so a rig is calibrated in a single solve.
+
+With a robust loss, the squared error of each point is replaced by a Huber or Cauchy loss of its
+reprojection error, which grows slower beyond the loss scale. Each iteration weighs the normal equations
+of each point by the weight of its current error (iteratively reweighted least squares), so badly detected
+points lose their influence during the solve, instead of in further solves after they are removed.
+
+This file only depends on Eigen, so that it can be built and used without OpenCV types.
+*/
+
+#ifndef _bundleAdjust_H
+#define _bundleAdjust_H
+
+#include <cstddef>
+#include <vector>
+
+// Loss of the reprojection error of each point
+enum { BA_SQUARED_LOSS, BA_HUBER_LOSS, BA_CAUCHY_LOSS };
+
+// Indices of the intrinsic parameters. The distortion model is the 5 coefficient model of OpenCV
+enum { BA_FX, BA_FY, BA_CX, BA_CY, BA_K1, BA_K2, BA_P1, BA_P2, BA_K3, BA_NINTRINSICS };
+
+//struct to store the cameras of a rig
+struct baRig {
+    std::vector<double> intrinsics;     // BA_NINTRINSICS parameters of each camera
+    std::vector<double> rvecs, tvecs;   // Pose of each camera wrt the first one, 3 values per camera (the first is not used)
+    std::vector<double> stdDevs;        // Output: standard deviation of each camera parameter (0 if fixed), in the
+                                        // order of the solver: the intrinsics of each camera, then the w v pose of cameras 1..n-1
+    int iterations;                     // Output: number of Levenberg-Marquardt iterations run
+    int nCameras() const { return (int)intrinsics.size() / BA_NINTRINSICS; }
+};
+
+//struct to store a view of the pattern and its pose
+struct baView {
+    std::vector<double> objectPoints;   // x y z of each point
+    std::vector<double> imagePoints;    // u v of each point
+    std::vector<int> cameras;           // Camera that saw each point. Leave empty if they are all from the first camera
+    double rvec[3], tvec[3];            // Pose of the pattern wrt the first camera (Rodrigues vector), refined in place
+};
+
+//struct to store the solver settings
+struct baOptions {
+    baOptions();
+    bool fixed[BA_NINTRINSICS];     // Intrinsic parameters kept at their initial value, in every camera
+    bool fixAspectRatio;            // Keep fx/fy of each camera at its initial value
+    int maxIterations;              // Maximum number of Levenberg-Marquardt iterations
+    double epsilon;                 // Stop once an iteration decreases the cost by less than this fraction
+    int loss;                       // BA_SQUARED_LOSS, BA_HUBER_LOSS or BA_CAUCHY_LOSS
+    double lossScale;               // Reprojection error, in pixels, beyond which a robust loss grows slower
+};
+
+// Refines the cameras of the rig and the pose of every view, minimizing the loss of the reprojection errors.
+// Every view and camera must be initialized, and each view needs at least 3 points. Returns the RMS error,
+// over every point whatever the loss
+double bundleAdjust(baRig &rig, std::vector<baView> &views, const baOptions &opt);
+
+// Same as above, with a single camera. If stdDevs is not NULL, it receives the standard deviation of each intrinsic,
+// and if iterations is not NULL, the number of iterations run
+double bundleAdjust(double intrinsics[BA_NINTRINSICS], std::vector<baView> &views, const baOptions &opt,
+                    double stdDevs[BA_NINTRINSICS] = NULL, int *iterations = NULL);
+
+#endif
@@ -1,13 +1,13 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/calib3d/calib3d.hpp"
-#include "opencv2/highgui/highgui.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <cctype>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "aruco.h"
@@ -21,8 +21,17 @@ using namespace aruco;
 int main( int argc, char** argv )
 {
     const char * inputSettingsFile;
+    if (argc == 3 && !strcmp(argv[1], "-serve"))
+        return serveCalibrations(argv[2]);
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "-manifest"))
+        return calibrateManifest(argv[2], argc == 4 ? atoi(argv[3]) : 0);
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "-dryrun"))
+        return estimateWithSettings(argv[2], argc == 4 ? atoi(argv[3]) : 20);
     if (argc != 2) {
         cerr << "Usage: calibrateWithSettings [path to settings file]" << endl
+             << "       calibrateWithSettings -serve [socket path]" << endl
+             << "       calibrateWithSettings -manifest [path to manifest] [concurrent jobs]" << endl
+             << "       calibrateWithSettings -dryrun [path to settings file] [sample images]" << endl
              << "The settings folder contains several example files with "
                 "descriptions of each parameter. Check the README for more detail." << endl;
         return -1;
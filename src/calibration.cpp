@@ -7,8 +7,8 @@ which are example calibration programs provided by opencv. It supports unique
 functionality with Rafael Munoz-Salinas' ArUco library, including calibration
 with a 3D ArUco box rig.
 
-The program has three modes: intrinsic calibration, stereo calibration, and live
-feed preview. It supports three patterns: chessboard, ArUco single, and ArUco box.
+The program has four modes: intrinsic calibration, stereo calibration, multi camera
+rig calibration, and live feed preview. It supports three patterns: chessboard, ArUco single, and ArUco box.
 
 Read the read me for more information and guidance.
 */
@@ -16,17 +16,72 @@ Read the read me for more information and guidance.
 #include "opencv2/core/core.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/video/tracking.hpp"
+// CV_MAJOR_VERSION is the epoch (2) with OpenCV 2.4, whose CV_VERSION_MAJOR is 4
+#if CV_MAJOR_VERSION >= 3
+#include "opencv2/core/ocl.hpp"
+// The image files and the cameras, without the windows of HighGUI (see display.h)
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgcodecs/imgcodecs_c.h"
+#include "opencv2/videoio.hpp"
+#include "opencv2/videoio/videoio_c.h"
+#else
 #include "opencv2/highgui/highgui.hpp"
+#endif
 #include <aruco.h>
+#include "bundleAdjust.h"
+#include "frameContainer.h"
+#include "correspondenceDB.h"
+#include "frameRing.h"
+#include "frameCalibrator.h"
+#include "arucoBackend.h"
+#include "pipelineTrace.h"
+#include "allocStats.h"
+#include "matPool.h"
+#include "stageQueue.h"
+#include "threadAffinity.h"
+#include "objectStore.h"
+#include "display.h"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <cctype>
+#include <climits>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <glob.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <deque>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <stdint.h>
+#include <float.h>
+#include <random>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+inline int omp_get_thread_num() { return 0; }
+inline int omp_get_max_threads() { return 1; }
+#endif
 
 using namespace cv;
 using namespace aruco;
@@ -36,16 +91,338 @@ const char* previewHelp =
     "Preview functions:\n"
         "  <ESC>, 'q' - quit the program\n"
         "  'u' - toggle undistortion on/off\n"
-        "  'c' - toggle ArUco marker coordinates/IDs\n";
+        "  'c' - toggle ArUco marker coordinates/IDs\n"
+        "  'l' - reload the detection and display settings\n";
+
+const char* stereoPreviewHelp =
+    "Stereo preview functions:\n"
+        "  <ESC>, 'q' - calibrate the kept pairs, if any, and quit the program\n"
+        "  <SPACE> - keep the current pair, if the pattern is found in both frames\n"
+        "  'k' - calibrate the kept pairs\n"
+        "  'r' - toggle rectification on/off\n"
+        "  'l' - reload the detection and display settings\n";
+
+//struct to store a sparse undistortion or rectification map: the input position of every step-th output pixel, and
+//of the last row and column. The map of the other pixels is interpolated between these nodes (see gridRemap)
+struct mapGrid {
+    Mat points;     //CV_32FC2 input positions, (size.height-1)/step+2 rows by (size.width-1)/step+2 columns
+    int step = 0;   //output pixels between two nodes
+    Size size;      //size of the images it remaps
+
+    bool fits(Size imageSize) const { return !points.empty() && imageSize == size; }
+};
+
+//struct to store the distortion of a camera sampled over its ideal (undistorted, normalized) points, so that the
+//maps of each rectification are looked up instead of running the distortion model again (see Rectify_TableStep)
+struct distortionTable {
+    Mat points;             //CV_32FC2 input positions of the nodes
+    Point2d origin;         //ideal point of the first node
+    double stepX = 0, stepY = 0;    //ideal point units between two nodes
+    int step = 0;           //input pixels between two nodes, near the center
+    Size size;              //size of the input images
+    Mat cameraMatrix, distCoeffs;   //intrinsics of the table, CV_64F
+
+    bool fits(const Mat &K, const Mat &dist, Size imageSize) const
+    {
+        if (points.empty() || imageSize != size || K.total() != 9 || dist.total() != distCoeffs.total())
+            return false;
+        Mat k, d;
+        K.convertTo(k, CV_64F);
+        dist.convertTo(d, CV_64F);
+        return norm(k.reshape(1, 3), cameraMatrix, NORM_INF) == 0 && norm(d.reshape(1, (int)d.total()), distCoeffs, NORM_INF) == 0;
+    }
+};
 
 //struct to store parameters for intrinsic calibration
+//a distortion model tried by the model selection (see Calibrate_ModelCandidates), and its cross-validated error
+struct modelCandidate {
+    string name;                //as in the setting
+    int flag = 0;               //calibrateCamera flags of the model
+    double heldOutErr = -1;     //RMS reprojection error of the held out views, negative if a fold failed to calibrate
+};
+
 struct intrinsicCalibration {
     Mat cameraMatrix, distCoeffs;   //intrinsic camera matrices
     vector<Mat> rvecs, tvecs;       //extrinsic rotation and translation vectors for each image
     vector<vector<Point2f> > imagePoints;   //corner points on 2d image
     vector<vector<Point3f> > objectPoints;  //corresponding 3d object points
+    vector<vector<int> > pointKeys;         //ArUco only: key of each point (see arucoPointKey)
+    vector<int> imageIndex;                 //Chessboard and ArUco boards only: index of each view's image in the image list
     vector<float> reprojErrs;   //vector of reprojection errors for each pixel
+    vector<vector<float> > pointErrs;   //reprojection error of each point, for each view
     double totalAvgErr = 0;     //average error across every pixel
+    int nSolves = 0;            //number of times the intrinsics were solved (once, plus each outlier rejection round)
+    int solverIterations = 0;   //Levenberg-Marquardt iterations of those solves (SPARSE solver only)
+    Mat stdDevs;                //standard deviation of fx fy cx cy k1 k2 p1 p2 k3 (SPARSE solver only)
+    Mat undistortMap[2];        //undistortion maps for remap() (CV_16SC2 and CV_16UC1), see updateUndistortMaps
+    mapGrid undistortGrid;      //sparse undistortion map, used instead of undistortMap with Map_GridStep
+    distortionTable distortTable;   //distortion of the ideal points for the rectification maps, with Rectify_TableStep
+    vector<modelCandidate> models;  //models compared by the model selection, if any
+    int modelFlag = -1;         //flags of the selected model, or -1 to use those of the settings
+};
+
+//struct to store a precomputed setting of a lens table and its intrinsics
+struct lensEntry {
+    vector<double> setting;
+    intrinsicCalibration cal;
+};
+
+// Keeps the undistortion maps (CV_16SC2 and CV_16UC1) of the precomputed settings of a lens table, by setting and
+// image size, once they are built (see lensMaps). Once the built maps take more than the cap, the least recently used
+// are released, and built again when they are needed. Maps read from Lens_MapCache are memory mappings of their files,
+// whose pages the system can drop, so they are kept until the store is destroyed without counting. Thread safe
+class LensMapStore
+{
+public:
+    explicit LensMapStore(size_t maxBytes) : capacity(maxBytes), used(0) {}
+
+    // The maps of a setting at a size, if they are kept
+    bool get(int entry, Size size, Mat (&maps)[2])
+    {
+        lock_guard<mutex> lock(m);
+        auto it = kept.find(key(entry, size));
+        if (it == kept.end())
+            return false;
+        maps[0] = it->second.maps[0];
+        maps[1] = it->second.maps[1];
+        if (!it->second.mapping)
+            order.splice(order.begin(), order, it->second.use);
+        return true;
+    }
+
+    // Keeps the maps of a setting at a size, in the memory mapping of their file if given. The maps put last
+    // are kept even if they alone take more than the cap, so that the preview does not build them every frame
+    void put(int entry, Size size, const Mat (&maps)[2], const shared_ptr<void> &mapping)
+    {
+        lock_guard<mutex> lock(m);
+        mapKey k = key(entry, size);
+        if (kept.count(k))      // Built meanwhile by another thread
+            return;
+        size_t bytes = mapping ? 0 : maps[0].total()*maps[0].elemSize() + maps[1].total()*maps[1].elemSize();
+        while (bytes > 0 && used + bytes > capacity && !order.empty())
+            erase(order.back());
+        keptMaps &item = kept[k];
+        item.maps[0] = maps[0];
+        item.maps[1] = maps[1];
+        item.mapping = mapping;
+        if (!mapping)
+        {
+            order.push_front(k);
+            item.use = order.begin();
+            used += bytes;
+        }
+    }
+
+private:
+    typedef pair<int, pair<int, int> > mapKey;  // setting, and width and height of the maps
+    struct keptMaps {
+        Mat maps[2];
+        shared_ptr<void> mapping;   // memory mapping of the file of the maps, if they were read from Lens_MapCache
+        list<mapKey>::iterator use; // position in order of built maps
+    };
+
+    static mapKey key(int entry, Size size) { return make_pair(entry, make_pair(size.width, size.height)); }
+    void erase(const mapKey &k)
+    {
+        auto it = kept.find(k);
+        used -= it->second.maps[0].total()*it->second.maps[0].elemSize()
+                + it->second.maps[1].total()*it->second.maps[1].elemSize();
+        order.erase(it->second.use);
+        kept.erase(it);
+    }
+
+    size_t capacity, used;      // maximum and current bytes of the built maps
+    list<mapKey> order;         // built maps, the most recently used first
+    map<mapKey, keptMaps> kept;
+    mutex m;
+};
+
+//struct to store the intrinsics of a zoom or focus lens at its calibrated settings (see Lens_Table). A setting has
+//one value per axis (zoom, focus...), and the calibrated settings are every combination of the calibrated values of
+//the axes. Intrinsics in between are interpolated, and the settings of a lattice of Lens_Subdivisions values between
+//two calibrated ones are precomputed, and their undistortion maps are kept once built
+struct lensTable {
+    vector<vector<double> > axes;       //calibrated values of each axis, increasing
+    vector<intrinsicCalibration> points;    //intrinsics of each calibrated setting, the first axis varying fastest
+    vector<vector<double> > lattice;    //precomputed values of each axis
+    vector<lensEntry> entries;          //precomputed settings, the first axis varying fastest
+    shared_ptr<LensMapStore> maps;      //undistortion maps of the precomputed settings built so far
+
+    bool empty() const { return points.empty(); }
+
+    // Intrinsics at a setting, linearly interpolated along each axis between the calibrated values around it. The
+    // setting is clamped to the calibrated range
+    intrinsicCalibration interpolate(const vector<double> &setting) const
+    {
+        int nAxes = (int)axes.size();
+        vector<int> lower(nAxes);
+        vector<double> t(nAxes);
+        for (int d = 0; d < nAxes; d++)
+        {
+            const vector<double> &v = axes[d];
+            int i = (int)(upper_bound(v.begin(), v.end(), setting[d]) - v.begin()) - 1;
+            i = max(0, min(i, (int)v.size() - 2));
+            lower[d] = i;
+            t[d] = v.size() < 2 ? 0 : min(1., max(0., (setting[d] - v[i])/(v[i+1] - v[i])));
+        }
+        intrinsicCalibration cal;
+        cal.cameraMatrix = Mat::zeros(3, 3, CV_64F);
+        cal.distCoeffs = Mat::zeros(points[0].distCoeffs.size(), CV_64F);
+        for (int corner = 0; corner < (1 << nAxes); corner++)
+        {
+            double w = 1;
+            int index = 0, stride = 1;
+            for (int d = 0; d < nAxes; d++)
+            {
+                bool upper = ((corner >> d) & 1) && axes[d].size() > 1;
+                if (((corner >> d) & 1) && !upper)
+                    w = 0;      // A single value has no upper corner
+                w *= upper ? t[d] : 1 - t[d];
+                index += (lower[d] + (upper ? 1 : 0))*stride;
+                stride *= (int)axes[d].size();
+            }
+            if (w == 0)
+                continue;
+            cal.cameraMatrix += w*points[index].cameraMatrix;
+            cal.distCoeffs += w*points[index].distCoeffs;
+        }
+        return cal;
+    }
+
+    // Index of the precomputed setting nearest to a setting, found on each axis
+    int nearest(const vector<double> &setting) const
+    {
+        int index = 0, stride = 1;
+        for (size_t d = 0; d < lattice.size(); d++)
+        {
+            const vector<double> &v = lattice[d];
+            int i = (int)(lower_bound(v.begin(), v.end(), setting[d]) - v.begin());
+            if (i == (int)v.size() || (i > 0 && setting[d] - v[i-1] < v[i] - setting[d]))
+                i--;
+            index += i*stride;
+            stride *= (int)v.size();
+        }
+        return index;
+    }
+};
+
+// Copies a continuous matrix of the given type into a vector. An empty matrix is an empty vector
+template<class T> static bool matToVector(const Mat &m, int type, vector<T> &v)
+{
+    if (!m.empty() && (m.type() != type || !m.isContinuous()))
+        return false;
+    v.assign((const T *)m.data, (const T *)m.data + m.total());
+    return true;
+}
+
+//struct to store the correspondences of many views contiguously, with one array per field. View v holds
+//the image points offsets[v] to offsets[v+1]-1, and ids[v] is its index in the views it was taken from.
+//Its object points start at objectOffsets[v]. A view with the same object points as the previous one
+//shares them, so a chessboard, whose views all have the whole board, stores its object points once.
+//The views are handed to calibrateCamera and stereoCalibrate as Mat headers into the arrays, without copies
+struct correspondenceStore {
+    vector<Point3f> objectPoints;           //object points of the views, shared by consecutive views with the same points
+    vector<Point2f> imagePoints[2];         //image points of every view, in each camera (the second one for stereo only)
+    vector<int> offsets = vector<int>(1, 0);    //first image point of each view, and the total number of points
+    vector<int> objectOffsets;              //first object point of each view
+    vector<int> ids;                        //index of each view in its calibration struct
+
+    int size() const { return (int)ids.size(); }
+    int count(int v) const { return offsets[v+1] - offsets[v]; }
+
+    // Appends a view. imagePoints2 are its points in the second camera, with the same object points
+    void add(int id, const vector<Point3f> &object, const vector<Point2f> &image, const vector<Point2f> *image2 = NULL)
+    {
+        add(id, object.empty() ? NULL : &object[0], (int)object.size(), image, image2);
+    }
+    void add(int id, const Point3f *object, int n, const vector<Point2f> &image, const vector<Point2f> *image2 = NULL)
+    {
+        int last = objectOffsets.empty() ? -1 : objectOffsets.back();
+        if (last >= 0 && count(size() - 1) == n && equal(object, object + n, objectPoints.begin() + last))
+            objectOffsets.push_back(last);
+        else
+        {
+            objectOffsets.push_back((int)objectPoints.size());
+            objectPoints.insert(objectPoints.end(), object, object + n);
+        }
+        imagePoints[0].insert(imagePoints[0].end(), image.begin(), image.end());
+        if (image2) imagePoints[1].insert(imagePoints[1].end(), image2->begin(), image2->end());
+        offsets.push_back((int)imagePoints[0].size());
+        ids.push_back(id);
+    }
+
+    // Appends the views of inCal that have points
+    void add(const intrinsicCalibration &inCal)
+    {
+        size_t n = 0;
+        for (auto &v:inCal.objectPoints) n += v.size();
+        // The object points are not reserved, as they may be shared
+        imagePoints[0].reserve(imagePoints[0].size() + n);
+        for (int i = 0; i < (int)inCal.objectPoints.size(); i++)
+            if (!inCal.objectPoints[i].empty()) add(i, inCal.objectPoints[i], inCal.imagePoints[i]);
+    }
+
+    // A store with the given views of this one (their positions, not their ids)
+    correspondenceStore select(const vector<int> &views) const
+    {
+        correspondenceStore sub;
+        vector<Point2f> image, image2;
+        for (int v:views)
+        {
+            image.assign(imagePoints[0].begin() + offsets[v], imagePoints[0].begin() + offsets[v+1]);
+            if (!imagePoints[1].empty())
+                image2.assign(imagePoints[1].begin() + offsets[v], imagePoints[1].begin() + offsets[v+1]);
+            sub.add(ids[v], &objectPoints[objectOffsets[v]], count(v), image, imagePoints[1].empty() ? NULL : &image2);
+        }
+        return sub;
+    }
+
+    // Headers of a view (n x 1, CV_32FC3 and CV_32FC2) into the arrays, valid while the store is not changed
+    Mat objectView(int v) const { return Mat(count(v), 1, CV_32FC3, (void *)&objectPoints[objectOffsets[v]]); }
+    Mat imageView(int v, int camera = 0) const { return Mat(count(v), 1, CV_32FC2, (void *)&imagePoints[camera][offsets[v]]); }
+    vector<Mat> objectViews() const
+    {
+        vector<Mat> views(size());
+        for (int v = 0; v < size(); v++) views[v] = objectView(v);
+        return views;
+    }
+    vector<Mat> imageViews(int camera = 0) const
+    {
+        vector<Mat> views(size());
+        for (int v = 0; v < size(); v++) views[v] = imageView(v, camera);
+        return views;
+    }
+
+    // The arrays as named matrices, to be written at once with writeCalibrationBinary
+    void toMats(const string &prefix, vector<pair<string, Mat> > &mats) const
+    {
+        mats.push_back(make_pair(prefix + "Object_Points", Mat(objectPoints, false)));
+        mats.push_back(make_pair(prefix + "Image_Points", Mat(imagePoints[0], false)));
+        if (!imagePoints[1].empty()) mats.push_back(make_pair(prefix + "Image_Points2", Mat(imagePoints[1], false)));
+        mats.push_back(make_pair(prefix + "Offsets", Mat(offsets, false)));
+        mats.push_back(make_pair(prefix + "Object_Offsets", Mat(objectOffsets, false)));
+        mats.push_back(make_pair(prefix + "Ids", Mat(ids, false)));
+    }
+
+    // Reads the arrays written with toMats. Returns false if they are missing or do not describe valid views
+    bool fromMats(const string &prefix, map<string, Mat> &mats)
+    {
+        if (!matToVector(mats[prefix + "Object_Points"], CV_32FC3, objectPoints)
+                || !matToVector(mats[prefix + "Image_Points"], CV_32FC2, imagePoints[0])
+                || !matToVector(mats[prefix + "Image_Points2"], CV_32FC2, imagePoints[1])
+                || !matToVector(mats[prefix + "Offsets"], CV_32S, offsets)
+                || !matToVector(mats[prefix + "Object_Offsets"], CV_32S, objectOffsets)
+                || !matToVector(mats[prefix + "Ids"], CV_32S, ids))
+            return false;
+        if (offsets.size() != ids.size() + 1 || objectOffsets.size() != ids.size() || offsets[0] != 0
+                || offsets.back() != (int)imagePoints[0].size()
+                || (!imagePoints[1].empty() && imagePoints[1].size() != imagePoints[0].size()))
+            return false;
+        for (int v = 0; v < size(); v++)
+            if (count(v) < 0 || objectOffsets[v] < 0 || objectOffsets[v] + count(v) > (int)objectPoints.size())
+                return false;
+        return true;
+    }
 };
 
 //struct to store parameters for stereo calibration
@@ -53,25 +430,709 @@ struct stereoCalibration {
     Mat R, T, E, F;         //Extrinsic matrices (rotation, translation, essential, fundamental)
     Mat R1, R2, P1, P2, Q;  //Rectification parameters (rectification transformations, projection matrices, disparity-to-depth mapping matrix)
     Rect validRoi[2];       //Rectangle within the rectified image that contains all valid points
+    Mat rmap[2][2];         //Rectification maps of each camera for remap() (CV_16SC2 and CV_16UC1)
+    mapGrid rectifyGrid[2]; //Sparse rectification maps of each camera, used instead of rmap with Map_GridStep
+};
+
+//struct to store the rectification quality of a stereo calibration, measured on the shared corners of its views
+//(see checkRectification). Distances are in pixels
+struct rectificationCheck {
+    struct view {
+        int index;          //view in the calibration structs
+        int points;
+        double meanDy, rmsDy, maxDy;    //vertical disparity of the rectified corners
+        double epipolar;    //mean distance of the right corners to the epipolar lines of the left ones
+    };
+    vector<view> views;
+    int points = 0;
+    double meanDy = 0, rmsDy = 0, maxDy = 0, epipolar = 0;
+    bool accepted = true;   //the RMS vertical disparity is within Rectify_MaxVerticalError
+};
+
+//struct to store the drift of a stereo rig from its stored extrinsics (see checkDrift). The rotation and the
+//translation are those of the median pose of the right camera wrt the left one, solved from the new views
+struct driftCheck {
+    rectificationCheck rectification;   //check of the stored extrinsics on the new views
+    int views = 0;              //views whose pose was solved in both cameras
+    double rotation = -1;       //angle between the new and the stored rotation (degrees), -1 without a pose
+    double translation = -1;    //distance between the new and the stored translation (pattern units)
+    double translationRatio = -1;   //the same distance relative to the stored baseline
+    bool recalibrate = true;    //the RMS vertical disparity is above Stereo_DriftThreshold
+};
+
+//struct to store running statistics of the views accepted during a capture. Each view updates them once, as it
+//is accepted, so they are never computed again over every view: the reprojection error of the view against the
+//estimate of that moment (Welford mean and variance), the corners in each cell of a grid over the image, and
+//the pose bins seen (tilt in steps of 15 degrees, and the tilt direction in 8 sectors, as in selectKeyframes)
+struct captureStats {
+    int views = 0;
+    int scored = 0;             //views with an error, those accepted once there was an estimate
+    double errMean = 0, errM2 = 0;  //mean of the view errors (pixels), and sum of their squared deviations
+    Mat cells;                  //CV_32S corners in each cell of cellSize pixels
+    int cellSize = 32;
+    vector<bool> poseSeen = vector<bool>(6*8, false);
+    int poses = 0;              //pose bins seen
+
+    //Error of a view against the intrinsics (negative without them), and its pose bin (negative if it has no
+    //pose). The pose of a view without intrinsics is found with a guessed camera, a focal length of one image width
+    static void score(const vector<Point2f> &imagePoints, const vector<Point3f> &objectPoints, Size imageSize,
+                      const Mat &cameraMatrix, const Mat &distCoeffs, double &err, int &poseBin)
+    {
+        err = -1;
+        poseBin = -1;
+        bool scoring = !cameraMatrix.empty();
+        Mat K = scoring ? cameraMatrix : (Mat_<double>(3, 3) << imageSize.width, 0, imageSize.width/2.,
+                                          0, imageSize.width, imageSize.height/2., 0, 0, 1);
+        Mat D = scoring ? distCoeffs : Mat();
+        Mat rvec, tvec, R;
+        try { solvePnP(objectPoints, imagePoints, K, D, rvec, tvec); }
+        catch (const cv::Exception &) { return; }      // No pose (e.g. too few 3D points): only the cells count
+        if (scoring)
+        {
+            vector<Point2f> projected;
+            ProjectionKernel(K, D).project(objectPoints, rvec, tvec, projected);
+            err = norm(imagePoints, projected, NORM_L2)/sqrt((double)max<size_t>(1, imagePoints.size()));
+        }
+        Rodrigues(rvec, R);
+        Vec3d n(R.at<double>(0, 2), R.at<double>(1, 2), R.at<double>(2, 2));    // Pattern z axis in the camera
+        int tilt = min(5, (int)(acos(min(1., fabs(n[2])))*180/CV_PI/15));
+        double direction = atan2(n[1]*(n[2] < 0 ? -1 : 1), n[0]*(n[2] < 0 ? -1 : 1))*180/CV_PI;
+        poseBin = tilt*8 + (tilt == 0 ? 0 : ((int)floor((direction + 180)/45)) % 8);
+    }
+
+    //Adds a view with its score
+    void add(const vector<Point2f> &imagePoints, Size imageSize, double err, int poseBin)
+    {
+        views++;
+        if (cells.empty())
+            cells = Mat::zeros((imageSize.height + cellSize - 1)/cellSize, (imageSize.width + cellSize - 1)/cellSize, CV_32S);
+        for (auto &p:imagePoints)
+        {
+            int r = (int)p.y/cellSize, c = (int)p.x/cellSize;
+            if (r >= 0 && c >= 0 && r < cells.rows && c < cells.cols) cells.at<int>(r, c)++;
+        }
+        if (err >= 0)
+        {
+            scored++;
+            double d = err - errMean;
+            errMean += d/scored;
+            errM2 += d*(err - errMean);
+        }
+        if (poseBin >= 0 && !poseSeen[poseBin])
+        {
+            poseSeen[poseBin] = true;
+            poses++;
+        }
+    }
+
+    double errStdDev() const { return scored > 1 ? sqrt(errM2/(scored - 1)) : 0; }
+    //Fraction of the cells that hold a corner
+    double covered() const { return cells.empty() ? 0 : (double)countNonZero(cells)/cells.total(); }
+};
+
+//struct to store the parameters of a multi camera rig
+struct rigCalibration {
+    vector<Mat> R, T;       //Rotation matrix and translation vector of each camera wrt the first one
+    double err = 0;         //RMS reprojection error of the rig bundle adjustment
+    int nSolves = 0;        //number of rig bundle adjustments (once, plus each outlier rejection round)
+    int iterations = 0;     //Levenberg-Marquardt iterations of those bundle adjustments
+};
+
+//struct to store what has been detected on an image, so it can be drawn only when it is displayed or saved
+struct patternOverlay {
+    vector<Point2f> chessboardCorners;      //detected chessboard corners, or inner corners of a CHARUCO pattern (empty if none)
+    vector<vector<Marker> > markers;        //detected markers of each marker map
+    vector<vector<Point3f> > objectPoints;  //integer object points of those markers
+    string status;                          //effort of the preview detection (see Preview_TargetFPS), empty if none
+};
+
+//struct to store an image with its grayscale version. The grayscale image is converted once, when it
+//is first needed, and shared by every detection step. Images read without color are used as they are
+//a camera frame as the driver gives it, without the conversion to BGR (see LivePreview_PixelFormat). Its luminance
+//is the gray image of the detection, and its color image is only made to be shown
+struct rawFrame {
+    enum Format { BGR, YUYV, NV12, MJPEG, GRAY };
+    Mat data;               //captured buffer: the frame, or a single row of its bytes with some capture backends
+    Format format = BGR;
+    Size size;              //frame size reported by the capture, for the buffers of a single row
+
+    //the Y plane, a view of the buffer for NV12. An empty Mat if the buffer does not hold a frame of the format
+    Mat luminance() const
+    {
+        pipelineTrace::scope trace("gray");
+        Mat y;
+        if (data.channels() == 3)           //converted by the capture backend anyway
+            cvtColor(data, y, COLOR_BGR2GRAY);
+        else if (format == MJPEG)
+            y = imdecode(data, CV_LOAD_IMAGE_GRAYSCALE);    //the chroma is neither upsampled nor converted
+        else if (format == YUYV && planes(2).data)
+            extractChannel(planes(2), y, 0);
+        else if (format == NV12 && planes(1).data)
+            y = planes(1).rowRange(0, size.height);
+        else if (format == BGR || format == GRAY)
+            y = data;
+        return y;
+    }
+
+    //the BGR image, made only when the frame is drawn and shown
+    Mat color() const
+    {
+        pipelineTrace::scope trace("color");
+        Mat bgr;
+        if (data.channels() == 3)
+            bgr = data;
+        else if (format == MJPEG)
+            bgr = imdecode(data, CV_LOAD_IMAGE_COLOR);
+        else if (format == YUYV && planes(2).data)
+            cvtColor(planes(2), bgr, COLOR_YUV2BGR_YUYV);
+        else if (format == NV12 && planes(1).data)
+            cvtColor(planes(1), bgr, COLOR_YUV2BGR_NV12);
+        else if (format == GRAY)
+            cvtColor(data, bgr, COLOR_GRAY2BGR);
+        return bgr;
+    }
+
+private:
+    //the buffer as a frame of 2 channels (YUYV) or as the Y plane followed by the UV plane (NV12, 1 channel),
+    //sharing its data. An empty Mat if its bytes do not match
+    Mat planes(int cn) const
+    {
+        int rows = cn == 2 ? size.height : size.height*3/2;
+        size_t bytes = cn == 2 ? (size_t)size.area()*2 : (size_t)rows*size.width;
+        if (data.rows == rows && data.cols == size.width && data.channels() == cn)
+            return data;
+        if (!data.isContinuous() || data.total()*data.elemSize() != bytes || size.area() == 0)
+            return Mat();
+        return data.reshape(cn, rows);
+    }
+};
+
+struct imageFrame {
+    Mat img;        //image as read or captured (color, or grayscale when no color is needed)
+    rawFrame raw;   //captured buffer of a camera read in its own pixel format, img being its luminance
+    int camera = 0;             //camera that took it, whose Detection_Roi applies. -1 to search the whole image
+    int64 deadline = 0;         //tick count when the detection must stop (see Detection_TimeBudget), 0 for none
+    bool overBudget = false;    //set when the detection stopped at the deadline
+    int pyramidOffset = 0;      //levels added to the ArUco candidate pyramid level (see DetectionGovernor)
+    // True, and marks the frame over budget, once the deadline has passed
+    bool late()
+    {
+        if (deadline > 0 && getTickCount() > deadline)
+            overBudget = true;
+        return overBudget;
+    }
+    const Mat &gray()
+    {
+        if (grayImg.empty())
+        {
+            if (img.channels() == 1) grayImg = img;
+            else
+            {
+                pipelineTrace::scope trace("gray");
+                cvtColor(img, grayImg, COLOR_BGR2GRAY);
+            }
+        }
+        return grayImg;
+    }
+    //sets img to the luminance of a captured buffer, keeping the buffer for color()
+    void setCaptured(const rawFrame &captured)
+    {
+        raw = captured;
+        img = raw.luminance();
+        grayImg.release();
+    }
+    //the image to draw on and show: img, or the color image of the captured buffer at the size of img
+    Mat color() const { return color(img, raw); }
+    static Mat color(const Mat &img, const rawFrame &raw)
+    {
+        if (!raw.data.data || img.channels() == 3)
+            return img;
+        Mat bgr = raw.color();
+        if (!bgr.data)
+            return img;
+        if (bgr.size() != img.size())       //halved by Image_MaxWidth
+            resize(bgr, bgr, img.size());
+        return bgr;
+    }
+private:
+    Mat grayImg;
 };
 
 //struct to store parameters for an ArUco pattern
 struct arucoPattern {
-    vector <MarkerMap> markerMapList;  // ArUco marker maps
-    // These parameters are used to calculate the integer 3D object coordinates of the pattern (see getIntPoints)
+    // ArUco marker maps. Their corners are replaced by the integer 3D object coordinates of the
+    // pattern when the config is read (see toIntPoints), so detection uses them as they are
+    vector <MarkerMap> markerMapList;
+    // These parameters are used to calculate the integer 3D object coordinates of the pattern
     vector <string> planeList;      // Corresponding 3D planes for each marker map
+    vector <int> drawCorner;        // Index of the corner drawn on each marker of a map, from its plane
     // The x y transformations to make the origin the bottom left corner
     int xOffset;
     int yOffset;
     int denominator;    // The denominator required to make all point values integers
+
+    // Distinct dictionaries of the marker maps, and the index of each map's dictionary
+    vector <string> dictionaries;
+    vector <int> mapDictionary;
+};
+
+// Replaces the corners of a marker map with integer values that correspond to its 3D plane,
+// and sets the corner drawn on its markers. This is done once, when the config is read
+void toIntPoints(arucoPattern &arPat, int index){
+    const string &plane = arPat.planeList[index];
+    float xOffset = arPat.xOffset;
+    float yOffset = arPat.yOffset;
+    float denom = arPat.denominator;
+
+    // corner is the index of the corner to be drawn. Each marker's points are stored in a list:
+    //    [upper left, upper right, lower right, lower left]
+    // The plane is an axis permutation with signs: p' = (A*p + offset)/denom
+    Matx33f A;
+    Vec3f offset;
+    int corner;
+    if (plane == "YZ") {
+        A = Matx33f(0, 0, 0,  0, 1, 0,  -1, 0, 0);
+        offset = Vec3f(0, yOffset, xOffset);
+        corner = 2;
+    } else if (plane == "XZ") {
+        A = Matx33f(1, 0, 0,  0, 0, 0,  0, -1, 0);
+        offset = Vec3f(xOffset, 0, yOffset);
+        corner = 0;
+    } else {   //plane == "XY"
+        A = Matx33f(1, 0, 0,  0, 1, 0,  0, 0, 0);
+        offset = Vec3f(xOffset, yOffset, 0);
+        corner = 3;
+    }
+    arPat.drawCorner.resize(arPat.planeList.size());
+    arPat.drawCorner[index] = corner;
+
+    for (auto &marker:arPat.markerMapList[index])
+        for (auto &p:marker) {
+            Vec3f q = A*Vec3f(p.x, p.y, p.z) + offset;
+            p = Point3f(q[0]/denom, q[1]/denom, q[2]/denom);
+        }    // The corners read through MarkerMap::getMarkerCorners are a copy of these
+    arPat.markerMapList[index].updateIdIndex();
+}
+
+// Whether no marker id is in two maps of the same dictionary. The markers of a dictionary are matched to
+// every map that uses it, so the independent boards of an ARUCO_BOARDS pattern must tell them apart by id
+bool boardIdsDistinct(const arucoPattern &arPat)
+{
+    vector<set<int> > ids(arPat.dictionaries.size());
+    for (size_t j = 0; j < arPat.markerMapList.size(); j++)
+        for (auto &marker:arPat.markerMapList[j])
+            if (!ids[arPat.mapDictionary[j]].insert(marker.id).second)
+                return false;
+    return true;
+}
+
+// Returns a key that identifies a marker corner across images, ordered by map, marker and corner
+inline int arucoPointKey(int mapIndex, int markerId, int corner)
+{
+    return ((mapIndex << 16) + markerId)*4 + corner;
+}
+
+// Layout of a CHARUCO pattern: a marker map whose markers fill the black squares of a chessboard, as written
+// by createArucoPatterns, so that two markers meet at each inner corner of the board
+struct charucoLayout {
+    vector<Point2f> markerCorners;      // Corners of each marker of the map, in the plane of the board
+    float side;                         // Side of a square in the plane of the board
+    struct saddle {
+        Point3f objectPoint;            // Integer object point (see toIntPoints)
+        Point2f boardPoint;
+        int key;                        // Key of the first marker corner at it (see arucoPointKey)
+        vector<int> markers;            // Markers of the map near it, which predict where it is
+    };
+    vector<saddle> saddles;
+};
+
+// Finds the inner corners of a CHARUCO marker map, the marker corners shared by two markers. Returns false if there
+// are none, as in a map whose markers are apart
+bool findCharucoLayout(const MarkerMap &map, charucoLayout &layout)
+{
+    layout.markerCorners.clear();
+    layout.saddles.clear();
+    if (map.empty() || map[0].size() != 4)
+        return false;
+    // The plane of the board is spanned by the sides of the first marker
+    Point3f origin = map[0][0], u = map[0][1] - origin, v = map[0][3] - origin;
+    layout.side = (float)norm(u);
+    if (layout.side <= 0)
+        return false;
+    u *= 1.f/layout.side;
+    v *= 1.f/(float)norm(v);
+    for (auto &m:map)
+        for (auto &p:m)
+            layout.markerCorners.push_back(Point2f((p - origin).dot(u), (p - origin).dot(v)));
+
+    // Corners closer than a tenth of a square are the same board point
+    float tolerance = 0.1f*layout.side;
+    vector<char> used(layout.markerCorners.size(), 0);
+    for (size_t a = 0; a < layout.markerCorners.size(); a++)
+    {
+        if (used[a]) continue;
+        bool shared = false;
+        for (size_t b = a + 1; b < layout.markerCorners.size(); b++)
+            if (!used[b] && b/4 != a/4 && norm(layout.markerCorners[b] - layout.markerCorners[a]) < tolerance)
+                used[b] = shared = true;
+        if (!shared) continue;
+        charucoLayout::saddle c;
+        c.objectPoint = map[a/4][a%4];
+        c.boardPoint = layout.markerCorners[a];
+        c.key = arucoPointKey(0, map[a/4].id, a%4);
+        // The markers around the corner: the two that meet at it and those of the next black squares
+        for (size_t k = 0; k < map.size(); k++)
+        {
+            Point2f center = (layout.markerCorners[4*k] + layout.markerCorners[4*k+2])*0.5f;
+            if (norm(center - c.boardPoint) < 2*layout.side)
+                c.markers.push_back((int)k);
+        }
+        layout.saddles.push_back(c);
+    }
+    return !layout.saddles.empty();
+}
+
+//--------------------------Binary calibration files--------------------------//
+// Binary calibration files start with this header, followed by nEntries entries and the matrix
+// data. Data offsets are from the start of the file and 16 byte aligned, so that the file can
+// be memory mapped and the matrices used in place. Values are stored in native byte order
+const int calibrationFileVersion = 1;
+enum calibrationFileKind { INTRINSIC_FILE = 0, STEREO_FILE = 1, RIG_FILE = 2, SHARD_FILE = 3, SOLVE_FILE = 4 };
+
+struct calibrationFileHeader {
+    char magic[4];          // "CCAL"
+    int32_t version;        // calibrationFileVersion
+    int32_t kind;           // calibrationFileKind
+    int32_t imageWidth, imageHeight;
+    int32_t nEntries;       // Number of matrices in the file
 };
 
+struct calibrationFileEntry {
+    char name[36];          // Zero terminated matrix name, as in the YAML files
+    int32_t rows, cols, type;   // OpenCV matrix size and type
+    int64_t offset;         // Position of the continuous, row major matrix data
+};
+
+// Checks that an entry of a file of the given length is a matrix of a type the files are written with, whose
+// data lies within the file
+static bool validCalibrationEntry(const calibrationFileEntry &e, int64_t length)
+{
+    int depth = CV_MAT_DEPTH(e.type);
+    return e.rows >= 0 && e.cols >= 0 && e.offset >= 0 && e.offset % 16 == 0
+            && (e.type & ~CV_MAT_TYPE_MASK) == 0 && depth <= CV_64F && CV_MAT_CN(e.type) <= 4
+            && e.offset + (int64_t)e.rows*e.cols*CV_ELEM_SIZE(e.type) <= length;
+}
+
+// Writes a list of named matrices to a binary calibration file. The file is written under a temporary name
+// and renamed into place, so that the caches never read a partly written file
+static bool writeCalibrationBinary(const string &filename, int kind, Size imageSize,
+                                   const vector<pair<string, Mat> > &mats)
+{
+    char suffix[32];
+    sprintf(suffix, ".%d.tmp", (int)getpid());
+    string tmpName = filename + suffix;
+    ofstream file(tmpName.c_str(), ios::binary);
+    if (!file)
+        return false;
+
+    calibrationFileHeader header;
+    memcpy(header.magic, "CCAL", 4);
+    header.version = calibrationFileVersion;
+    header.kind = kind;
+    header.imageWidth = imageSize.width;
+    header.imageHeight = imageSize.height;
+    header.nEntries = (int32_t)mats.size();
+
+    vector<calibrationFileEntry> entries(mats.size());
+    int64_t pos = sizeof(header) + entries.size()*sizeof(calibrationFileEntry);
+    for (size_t i = 0; i < mats.size(); i++)
+    {
+        memset(&entries[i], 0, sizeof(calibrationFileEntry));
+        strncpy(entries[i].name, mats[i].first.c_str(), sizeof(entries[i].name) - 1);
+        entries[i].rows = mats[i].second.rows;
+        entries[i].cols = mats[i].second.cols;
+        entries[i].type = mats[i].second.type();
+        pos = (pos + 15) & ~(int64_t)15;
+        entries[i].offset = pos;
+        pos += mats[i].second.total()*mats[i].second.elemSize();
+    }
+
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)&entries[0], entries.size()*sizeof(calibrationFileEntry));
+    for (size_t i = 0; i < mats.size(); i++)
+    {
+        Mat m = mats[i].second.isContinuous() ? mats[i].second : mats[i].second.clone();
+        while ((int64_t)file.tellp() < entries[i].offset) file.put(0);
+        file.write((const char *)m.data, m.total()*m.elemSize());
+    }
+    file.close();
+    if (!file || rename(tmpName.c_str(), filename.c_str()) != 0)
+    {
+        remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Reads the named matrices of a binary calibration file. Returns false if it is not a valid file
+static bool readCalibrationBinary(const string &filename, int kind, Size &imageSize,
+                                  map<string, Mat> &mats)
+{
+    ifstream file(filename.c_str(), ios::binary | ios::ate);
+    int64_t length = file ? (int64_t)file.tellg() : 0;
+    file.seekg(0);
+    calibrationFileHeader header;
+    if (!file.read((char *)&header, sizeof(header)) || memcmp(header.magic, "CCAL", 4) != 0
+            || header.version != calibrationFileVersion || header.kind != kind || header.nEntries < 0
+            || (int64_t)(sizeof(header) + header.nEntries*sizeof(calibrationFileEntry)) > length)
+        return false;
+
+    // A truncated or corrupt file is rejected before any of its matrices is allocated
+    vector<calibrationFileEntry> entries(header.nEntries);
+    if (header.nEntries > 0 && !file.read((char *)&entries[0], entries.size()*sizeof(calibrationFileEntry)))
+        return false;
+    for (auto &e:entries)
+        if (!validCalibrationEntry(e, length))
+            return false;
+    map<string, Mat> found;
+    for (auto &e:entries)
+    {
+        e.name[sizeof(e.name) - 1] = 0;
+        Mat m(e.rows, e.cols, e.type);
+        file.seekg(e.offset);
+        if (!file.read((char *)m.data, m.total()*m.elemSize()))
+            return false;
+        found[e.name] = m;
+    }
+    imageSize = Size(header.imageWidth, header.imageHeight);
+    for (auto &m:found)
+        mats[m.first] = m.second;
+    return true;
+}
+
+// Same as readCalibrationBinary, with the matrices used in place in a read only memory mapping of the file, so that
+// their pages are only read once they are used. The mapping is released with the last copy of mapping
+static bool mapCalibrationBinary(const string &filename, int kind, Size &imageSize, map<string, Mat> &mats,
+                                 shared_ptr<void> &mapping)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(calibrationFileHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    size_t length = (size_t)st.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);        // The mapping keeps the file open
+    if (data == MAP_FAILED)
+        return false;
+    shared_ptr<void> m(data, [length](void *p) { munmap(p, length); });
+
+    const calibrationFileHeader &header = *(const calibrationFileHeader *)data;
+    if (memcmp(header.magic, "CCAL", 4) != 0 || header.version != calibrationFileVersion || header.kind != kind
+            || header.nEntries < 0 || sizeof(header) + header.nEntries*sizeof(calibrationFileEntry) > length)
+        return false;
+    const calibrationFileEntry *entries = (const calibrationFileEntry *)((const char *)data + sizeof(header));
+    map<string, Mat> found;
+    for (int i = 0; i < header.nEntries; i++)
+    {
+        calibrationFileEntry e = entries[i];
+        e.name[sizeof(e.name) - 1] = 0;
+        if (!validCalibrationEntry(e, (int64_t)length))
+            return false;
+        found[e.name] = Mat(e.rows, e.cols, e.type, (char *)data + e.offset);
+    }
+    imageSize = Size(header.imageWidth, header.imageHeight);
+    mats.swap(found);
+    mapping = m;
+    return true;
+}
+
+//-------------------------------Image enumeration-----------------------------//
+// Compares names with the numbers in them compared by value, so that img2 comes before img10
+static bool naturalLess(const string &a, const string &b)
+{
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size())
+    {
+        if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j]))
+        {
+            // Leading zeros are skipped, and the longer number is the larger one
+            while (i < a.size() - 1 && a[i] == '0' && isdigit((unsigned char)a[i+1])) i++;
+            while (j < b.size() - 1 && b[j] == '0' && isdigit((unsigned char)b[j+1])) j++;
+            size_t ia = i, jb = j;
+            while (ia < a.size() && isdigit((unsigned char)a[ia])) ia++;
+            while (jb < b.size() && isdigit((unsigned char)b[jb])) jb++;
+            if (ia - i != jb - j)
+                return ia - i < jb - j;
+            int c = a.compare(i, ia - i, b, j, jb - j);
+            if (c != 0)
+                return c < 0;
+            i = ia;
+            j = jb;
+        }
+        else if (a[i] != b[j])
+            return a[i] < b[j];
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+    if (a.size() - i != b.size() - j)
+        return a.size() - i < b.size() - j;
+    return a < b;       // Names that only differ by leading zeros
+}
+
+// Whether a file name has the extension of an image format that imread reads
+static bool isImageFile(const string &name)
+{
+    static const char *extensions[] = { "jpg", "jpeg", "jpe", "png", "bmp", "dib", "tif", "tiff", "pgm", "ppm",
+                                        "pbm", "pnm", "webp", "jp2", "exr", "hdr", "pic", "sr", "ras" };
+    size_t dot = name.rfind('.');
+    if (dot == string::npos)
+        return false;
+    string ext = name.substr(dot + 1);
+    for (auto &c:ext) c = (char)tolower((unsigned char)c);
+    for (auto e:extensions)
+        if (ext == e)
+            return true;
+    return false;
+}
+
+// Reads the size of a JPEG image from the frame header, without decoding it. Returns false if the file is
+// not a JPEG image
+static bool jpegImageSize(const string &name, Size &size)
+{
+    FILE *f = fopen(name.c_str(), "rb");
+    if (!f)
+        return false;
+    bool found = false;
+    unsigned char b[7];
+    if (fread(b, 1, 2, f) == 2 && b[0] == 0xFF && b[1] == 0xD8)
+    {
+        // Segments up to the start of frame, whose length follows each marker
+        while (fread(b, 1, 4, f) == 4 && b[0] == 0xFF)
+        {
+            int marker = b[1], length = (b[2] << 8) | b[3];
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+            {
+                found = fread(b, 1, 5, f) == 5;
+                size = Size((b[3] << 8) | b[4], (b[1] << 8) | b[2]);
+                break;
+            }
+            if (length < 2 || fseek(f, length - 2, SEEK_CUR) != 0)
+                break;
+        }
+    }
+    fclose(f);
+    return found && size.area() > 0;
+}
+
+// Reads the size of a PNG image from its IHDR chunk, without decoding it. Returns false if the file is not a
+// PNG image
+static bool pngImageSize(const string &name, Size &size)
+{
+    FILE *f = fopen(name.c_str(), "rb");
+    if (!f)
+        return false;
+    unsigned char b[24];
+    bool found = fread(b, 1, 24, f) == 24 && !memcmp(b, "\x89PNG\r\n\x1a\n", 8) && !memcmp(b + 12, "IHDR", 4);
+    fclose(f);
+    if (found)
+        size = Size((b[16] << 24) | (b[17] << 16) | (b[18] << 8) | b[19], (b[20] << 24) | (b[21] << 16) | (b[22] << 8) | b[23]);
+    return found && size.area() > 0;
+}
+
+// Lists the images of a directory, or the files that match a glob pattern, in natural order. Returns false
+// if the input is neither a directory nor a pattern
+static bool listImageFiles(const string &input, vector<string> &files)
+{
+    files.clear();
+    if (input.find_first_of("*?[") != string::npos)
+    {
+        glob_t g;
+        if (glob(input.c_str(), GLOB_NOSORT, NULL, &g) == 0)
+            files.assign(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+        globfree(&g);
+    }
+    else if (DIR *dir = opendir(input.c_str()))
+    {
+        string path = input;
+        if (path[path.size() - 1] != '/') path += '/';
+        while (struct dirent *entry = readdir(dir))
+            if (entry->d_name[0] != '.' && isImageFile(entry->d_name))
+                files.push_back(path + entry->d_name);
+        closedir(dir);
+    }
+    else
+        return false;
+    sort(files.begin(), files.end(), naturalLess);
+    return true;
+}
+
+// Pairs the images of a stereo list by name: an image whose file name contains leftTag goes with the image
+// whose name has rightTag in its place. The list is replaced by the pairs, left image first, in the order of
+// the left images. Returns the number of images left without a pair, which are dropped
+static int pairStereoImages(vector<string> &list, const string &leftTag, const string &rightTag)
+{
+    map<string, int> rights;
+    for (int i = 0; i < (int)list.size(); i++)
+        rights[list[i]] = i;
+    vector<string> pairs;
+    vector<bool> paired(list.size(), false);
+    for (int i = 0; i < (int)list.size(); i++)
+    {
+        const string &name = list[i];
+        size_t base = name.rfind('/');
+        size_t tag = name.rfind(leftTag);
+        if (tag == string::npos || (base != string::npos && tag < base))
+            continue;
+        string right = name.substr(0, tag) + rightTag + name.substr(tag + leftTag.size());
+        auto it = rights.find(right);
+        if (it == rights.end() || it->second == i || paired[it->second])
+            continue;
+        paired[i] = paired[it->second] = true;
+        pairs.push_back(name);
+        pairs.push_back(right);
+    }
+    int unpaired = (int)(list.size() - pairs.size());
+    list.swap(pairs);
+    return unpaired;
+}
+
+// Marker map of a config file, parsed once per process. The jobs of a manifest or of the server that use the
+// same rig share it, and a file that changed is read again
+static MarkerMap sharedMarkerMap(const string &filename)
+{
+    static mutex m;
+    static map<string, pair<uint64_t, MarkerMap> > maps;     // Hash of the file and its map, by path
+    uint64_t hash = MarkerMap::fileHash(filename);
+    {
+        lock_guard<mutex> lock(m);
+        auto it = maps.find(filename);
+        if (hash != 0 && it != maps.end() && it->second.first == hash)
+            return it->second.second;
+    }
+    MarkerMap map;
+    map.readFromFile(filename);
+    lock_guard<mutex> lock(m);
+    if (hash != 0)
+        maps[filename] = make_pair(hash, map);
+    return map;
+}
+
 class Settings
 {
 public:
-    Settings() : goodInput(false) {}
-    enum Pattern { CHESSBOARD, ARUCO_SINGLE, ARUCO_BOX, NOT_EXISTING };
-    enum Mode { INTRINSIC, STEREO, PREVIEW, INVALID };
+    Settings() : goodInput(false), sharedProcess(false), frameInput(false) {}
+    enum Pattern { CHESSBOARD, ARUCO_SINGLE, ARUCO_BOX, CHARUCO, ARUCO_BOARDS, NOT_EXISTING };
+    enum Mode { INTRINSIC, STEREO, MULTI, PREVIEW, INVALID };
+    enum Solver { OPENCV_SOLVER, SPARSE_SOLVER, INVALID_SOLVER };
+    enum Loss { NO_LOSS, HUBER_LOSS, CAUCHY_LOSS, INVALID_LOSS };
 
     //Writes settings serialization to a file. Uncomment the other write() function
     //outside the settings class to use this functionality
@@ -83,29 +1144,140 @@ public:
                   << "ChessboardSize_Width"  <<  boardSize.width
                   << "ChessboardSize_Height" <<  boardSize.height
                   << "SquareSize" << squareSize
+                  << "Chessboard_FastWidth" << chessboardFastWidth
 
                   << "ImageList_Filename" <<  imageListFilename
+                  << "ImageList_LeftTag" << leftTag
+                  << "ImageList_RightTag" << rightTag
+                  << "StreamInput_Filename" << streamInput
+                  << "Stream_FrameStride" << streamStride
+                  << "Stream_MinMotion" << streamMinMotion
                   << "ArucoConfig_Filename" <<  arucoConfigFilename
                   << "IntrinsicInput_Filename" <<  intrinsicInputFilename
 
                   << "IntrinsicOutput_Filename" <<  intrinsicOutput
                   << "ExtrinsicOutput_Filename" <<  extrinsicOutput
+                  << "Save_BinaryCalibration" << saveBinary
+                  << "Save_RunReport" << saveRunReport
+                  << "Save_Trace" << saveTrace
 
                   << "UndistortedImages_Path" <<  undistortedPath
                   << "RectifiedImages_Path" <<  rectifiedPath
+                  << "RectifiedImages_Container" << rectifiedContainer
                   << "DetectedImages_Path" <<  detectedPath
+                  << "SavedImages_Format" << savedImagesFormat
 
                   << "Calibrate_FixDistCoeffs" << fixDistCoeffs
                   << "Calibrate_FixAspectRatio" <<  aspectRatio
                   << "Calibrate_AssumeZeroTangentialDistortion" <<  assumeZeroTangentDist
                   << "Calibrate_FixPrincipalPointAtTheCenter" <<  fixPrincipalPoint
+                  << "Calibrate_ModelCandidates" << modelCandidatesInput
+                  << "Calibrate_ModelFolds" << modelFolds
+                  << "Calibrate_OutlierThreshold" << outlierThreshold
+                  << "Calibrate_OutlierIterations" << outlierIterations
+                  << "Calibrate_CoarsePoints" << coarsePoints
+                  << "Calibrate_Solver" << solverInput
+                  << "Calibrate_JointStereo" << jointStereo
+                  << "Calibrate_NormalizedStereo" << normalizedStereo
+                  << "Subset_Trials" << subsetTrials
+                  << "Subset_Tolerance" << subsetTolerance
+                  << "Subset_ImageList_Filename" << subsetImageList
+                  << "Keyframe_MaxViews" << keyframeViews
+                  << "Rectify_MaxVerticalError" << maxVerticalError
+                  << "Rectify_CheckLookupStep" << checkLookupStep
 
                   << "Show_UndistortedImages" <<  showUndistorted
                   << "Show_RectifiedImages" <<  showRectified
                   << "Show_ArucoMarkerCoordinates" << showArucoCoords
                   << "Wait_NextDetectedImage" << wait
+                  << "Headless" << headless
 
                   << "LivePreviewCameraID" <<  cameraIDInput
+                  << "LivePreviewCameraID2" << cameraID2Input
+                  << "LivePreview_PixelFormat" << pixelFormatInput
+                  << "LiveStereo_MaxSkew" << stereoMaxSkew
+                  << "LiveStereo_RectifyInput" << rectifyInputFilename
+                  << "Preview_IncrementalCalibration" << incrementalCalibration
+                  << "Preview_IncrementalTolerance" << incrementalTolerance
+                  << "Preview_DisplayWidth" << previewWidth
+                  << "Rig_Cameras" << nCameras
+
+                  << "BatchDetection_Threads" << batchThreads
+                  << "Prefetch_QueueDepth" << prefetchDepth
+                  << "Prefetch_Threads" << prefetchThreads
+                  << "Remote_Transfers" << remoteTransfers
+                  << "Remote_MaxMemory" << remoteMB
+                  << "Threads_Affinity" << threadAffinityPolicy
+                  << "Threads_IoCores" << ioCores
+                  << "Aruco_CandidatePyramidLevel" << arucoPyrLevel
+                  << "Aruco_QuadDecimate" << arucoDecimate
+                  << "Aruco_AdaptiveThreshold" << arucoAdaptiveThres
+                  << "Aruco_CornerRefinement" << cornerMethodInput
+                  << "Aruco_Backend" << backendInput
+                  << "Aruco_CellThreshold" << arucoCellThreshold
+                  << "Aruco_FastQuadFit" << arucoFastQuad
+                  << "Aruco_GuidedFaces" << arucoGuidedFaces
+                  << "Aruco_PrintStats" << arucoStats
+                  << "Aruco_Threads" << arucoThreads
+                  << "Aruco_AutotuneFile" << autotuneFile
+                  << "Aruco_AutotuneSample" << autotuneSample
+                  << "Aruco_AutotuneRecall" << autotuneRecall
+                  << "Image_MaxWidth" << maxImageWidth
+                  << "DetectionCache_Path" << detectionCachePath
+                  << "SolveCache_Path" << solveCachePath
+                  << "Camera_Name" << cameraName
+                  << "CalibrationHistory_Path" << historyPath
+                  << "Detection_Checkpoint" << checkpointFile
+                  << "Detection_CheckpointSync" << checkpointSync
+                  << "Detection_ShardCount" << shardCount
+                  << "Detection_ShardIndex" << shardIndex
+                  << "Detection_ShardFile" << shardFile
+                  << "Detection_MinSharpness" << minSharpness
+                  << "Detection_Roi" << "[";
+        for (auto &coords:roiCoords)
+            fs << coords;
+        fs << "]"
+                  << "Detection_TimeBudget" << timeBudget
+                  << "SavedImages_QueueDepth" << saveQueueDepth
+                  << "SavedImages_Threads" << saveThreads
+                  << "Queue_MaxMemory" << queueMB
+                  << "FrameStore_MaxMemory" << frameStoreMB
+                  << "Memory_PoolMB" << poolMB
+                  << "Memory_HugePages" << hugePages
+                  << "Export_UseOpenCL" << exportOpenCL
+                  << "Export_Threads" << exportThreads
+                  << "Remap_TileSize" << remapTileSize
+                  << "Rectify_BandRows" << rectifyBandRows
+                  << "Rectify_CropToValidRoi" << cropRectified
+                  << "Map_GridStep" << mapGridStep
+                  << "Preview_TrackingInterval" << trackingInterval
+                  << "Preview_StaticThreshold" << staticThreshold
+                  << "Preview_StaticRefresh" << staticRefresh
+                  << "Parallel_Deterministic" << deterministic
+                  << "Aruco_MapIdsOnly" << arucoMapIdsOnly
+                  << "Aruco_FusedFirstPass" << arucoFusedFirstPass
+                  << "Decode_Hardware" << hardwareDecode
+                  << "Aruco_LowPower" << arucoLowPower
+                  << "CorrespondenceDB_File" << correspondenceDBFile
+                  << "CorrespondenceDB_From" << correspondenceDBFrom
+                  << "CorrespondenceDB_To" << correspondenceDBTo
+                  << "Chessboard_Scales" << chessboardScales
+                  << "SavedImages_ThumbnailWidth" << thumbnailWidth
+                  << "SavedImages_SheetTiles" << sheetTiles
+                  << "LiveStereo_SharedMemory" << sharedMemoryName
+                  << "LiveStereo_SharedSlots" << sharedSlots
+                  << "Stereo_DriftInput" << driftInputFilename
+                  << "Stereo_DriftThreshold" << driftThreshold
+                  << "Stereo_ExtrinsicUpdate" << extrinsicUpdate
+                  << "Preview_TargetFPS" << targetFPS
+                  << "Calibrate_RobustLoss" << robustLossInput
+                  << "Calibrate_RobustScale" << robustScale
+                  << "Rectify_TableStep" << rectifyTableStep
+                  << "Lens_Table" << lensTableFilename
+                  << "Lens_Setting" << lensSettingInput
+                  << "Lens_Subdivisions" << lensSubdivisions
+                  << "Lens_MapCache" << lensMapCache
+                  << "Lens_MapMemory" << lensMapMB
            << "}";
     }
     void read(const FileNode& node)             //Reads settings serialization
@@ -116,38 +1288,312 @@ public:
         node["ChessboardSize_Width" ] >> boardSize.width;
         node["ChessboardSize_Height"] >> boardSize.height;
         node["SquareSize"]  >> squareSize;
+        node["Chessboard_FastWidth"] >> chessboardFastWidth;
 
         node["ImageList_Filename"] >> imageListFilename;
+        node["ImageList_LeftTag"] >> leftTag;
+        node["ImageList_RightTag"] >> rightTag;
+        if (leftTag.empty()) leftTag = "0";
+        if (rightTag.empty()) rightTag = "0";
+        node["StreamInput_Filename"] >> streamInput;
+        if (streamInput.empty()) streamInput = "0";
+        node["Stream_FrameStride"] >> streamStride;
+        if (streamStride == 0) streamStride = 1;
+        node["Stream_MinMotion"] >> streamMinMotion;
         node["ArucoConfig_Filename"] >> arucoConfigFilename;
         node["IntrinsicInput_Filename"] >> intrinsicInputFilename;
 
         node["IntrinsicOutput_Filename"] >> intrinsicOutput;
         node["ExtrinsicOutput_Filename"] >> extrinsicOutput;
+        node["Save_BinaryCalibration"] >> saveBinary;
+        node["Save_RunReport"] >> saveRunReport;
+        node["Save_Trace"] >> saveTrace;
 
         node["UndistortedImages_Path"] >> undistortedPath;
         node["RectifiedImages_Path"] >> rectifiedPath;
+        node["RectifiedImages_Container"] >> rectifiedContainer;
+        if (rectifiedContainer.empty())
+            rectifiedContainer = "0";
         node["DetectedImages_Path"] >> detectedPath;
+        node["SavedImages_Format"] >> savedImagesFormat;
+        if (savedImagesFormat.empty()) savedImagesFormat = "jpg";      // Images were always saved as JPEG
 
         node["Calibrate_FixDistCoeffs"] >> fixDistCoeffs;
         node["Calibrate_FixAspectRatio"] >> aspectRatio;
         node["Calibrate_AssumeZeroTangentialDistortion"] >> assumeZeroTangentDist;
         node["Calibrate_FixPrincipalPointAtTheCenter"] >> fixPrincipalPoint;
+        node["Calibrate_ModelCandidates"] >> modelCandidatesInput;
+        if (modelCandidatesInput.empty()) modelCandidatesInput = "0";
+        node["Calibrate_ModelFolds"] >> modelFolds;
+        if (modelFolds == 0) modelFolds = 5;
+        node["Calibrate_OutlierThreshold"] >> outlierThreshold;
+        node["Calibrate_OutlierIterations"] >> outlierIterations;
+        node["Calibrate_CoarsePoints"] >> coarsePoints;
+        node["Calibrate_Solver"] >> solverInput;
+        if (solverInput.empty()) solverInput = "OPENCV";       // calibrateCamera was always used
+        node["Calibrate_JointStereo"] >> jointStereo;
+        node["Calibrate_NormalizedStereo"] >> normalizedStereo;
+        node["Subset_Trials"] >> subsetTrials;
+        node["Subset_Tolerance"] >> subsetTolerance;
+        node["Subset_ImageList_Filename"] >> subsetImageList;
+        if (subsetImageList.empty()) subsetImageList = "0";
+        node["Keyframe_MaxViews"] >> keyframeViews;
+        node["Rectify_MaxVerticalError"] >> maxVerticalError;
+        node["Rectify_CheckLookupStep"] >> checkLookupStep;
 
         node["Show_UndistortedImages"] >> showUndistorted;
         node["Show_RectifiedImages"] >> showRectified;
         node["Show_ArucoMarkerCoordinates"] >> showArucoCoords;
         node["Wait_NextDetectedImage"] >> wait;
+        node["Headless"] >> headless;
 
         node["LivePreviewCameraID"] >> cameraIDInput;
-        interprate();
-    }
-    void interprate()       //Interprets the settings and checks for valid input
-    {
+        node["LivePreviewCameraID2"] >> cameraID2Input;
+        if (cameraID2Input.empty()) cameraID2Input = "-1";
+        node["LivePreview_PixelFormat"] >> pixelFormatInput;
+        if (pixelFormatInput.empty()) pixelFormatInput = "BGR";      // The frames were always converted to BGR
+        node["LiveStereo_MaxSkew"] >> stereoMaxSkew;
+        node["LiveStereo_RectifyInput"] >> rectifyInputFilename;
+        if (rectifyInputFilename.empty()) rectifyInputFilename = "0";
+        node["Preview_IncrementalCalibration"] >> incrementalCalibration;
+        node["Preview_IncrementalTolerance"] >> incrementalTolerance;
+        node["Preview_DisplayWidth"] >> previewWidth;
+        node["Rig_Cameras"] >> nCameras;
+
+        node["BatchDetection_Threads"] >> batchThreads;
+        node["Prefetch_QueueDepth"] >> prefetchDepth;
+        node["Prefetch_Threads"] >> prefetchThreads;
+        if (node["Remote_Transfers"].empty())
+            remoteTransfers = 16;
+        else
+            node["Remote_Transfers"] >> remoteTransfers;
+        if (node["Remote_MaxMemory"].empty())
+            remoteMB = 256;
+        else
+            node["Remote_MaxMemory"] >> remoteMB;
+        node["Threads_Affinity"] >> threadAffinityPolicy;
+        if (threadAffinityPolicy.empty()) threadAffinityPolicy = "none";
+        node["Threads_IoCores"] >> ioCores;
+        node["Aruco_CandidatePyramidLevel"] >> arucoPyrLevel;
+        if (node["Aruco_QuadDecimate"].empty())
+            arucoDecimate = 1;
+        else
+            node["Aruco_QuadDecimate"] >> arucoDecimate;
+        node["Aruco_AdaptiveThreshold"] >> arucoAdaptiveThres;
+        node["Aruco_CornerRefinement"] >> cornerMethodInput;
+        if (cornerMethodInput.empty()) cornerMethodInput = "SUBPIX";     // cornerSubPix was always used
+        node["Aruco_Backend"] >> backendInput;
+        node["Aruco_CellThreshold"] >> arucoCellThreshold;
+        node["Aruco_FastQuadFit"] >> arucoFastQuad;
+        node["Aruco_GuidedFaces"] >> arucoGuidedFaces;
+        if (backendInput.empty()) backendInput = "ARUCO";
+        node["Aruco_PrintStats"] >> arucoStats;
+        node["Aruco_Threads"] >> arucoThreads;
+        node["Aruco_AutotuneFile"] >> autotuneFile;
+        if (autotuneFile.empty()) autotuneFile = "0";
+        node["Aruco_AutotuneSample"] >> autotuneSample;
+        if (node["Aruco_AutotuneRecall"].empty())
+            autotuneRecall = 0.99;
+        else
+            node["Aruco_AutotuneRecall"] >> autotuneRecall;
+        arucoThresParam1 = 5;       // The threshold search always used these
+        arucoThresRange = 10;
+        if (node["Image_MaxWidth"].empty())      // Images were always halved above 1280 pixels
+            maxImageWidth = 1280;
+        else
+            node["Image_MaxWidth"] >> maxImageWidth;
+        node["DetectionCache_Path"] >> detectionCachePath;
+        if (detectionCachePath.empty()) detectionCachePath = "0";
+        node["SolveCache_Path"] >> solveCachePath;
+        if (solveCachePath.empty()) solveCachePath = "0";
+        node["Camera_Name"] >> cameraName;
+        if (cameraName.empty()) cameraName = "0";
+        node["CalibrationHistory_Path"] >> historyPath;
+        if (historyPath.empty()) historyPath = "0";
+        node["Detection_Checkpoint"] >> checkpointFile;
+        if (checkpointFile.empty()) checkpointFile = "0";
+        node["Detection_CheckpointSync"] >> checkpointSync;
+        node["Detection_ShardCount"] >> shardCount;
+        node["Detection_ShardIndex"] >> shardIndex;
+        node["Detection_ShardFile"] >> shardFile;
+        if (shardFile.empty()) shardFile = "0";
+        node["Detection_MinSharpness"] >> minSharpness;
+        roiCoords.clear();
+        FileNode rois = node["Detection_Roi"];
+        for (FileNodeIterator it = rois.begin(); it != rois.end(); ++it)
+        {
+            vector<int> coords;
+            *it >> coords;
+            roiCoords.push_back(coords);
+        }
+        node["Detection_TimeBudget"] >> timeBudget;
+        node["SavedImages_QueueDepth"] >> saveQueueDepth;
+        node["SavedImages_Threads"] >> saveThreads;
+        node["Queue_MaxMemory"] >> queueMB;
+        node["FrameStore_MaxMemory"] >> frameStoreMB;
+        node["Memory_PoolMB"] >> poolMB;
+        node["Memory_HugePages"] >> hugePages;
+        node["Export_UseOpenCL"] >> exportOpenCL;
+        node["Export_Threads"] >> exportThreads;
+        node["Remap_TileSize"] >> remapTileSize;
+        node["Rectify_BandRows"] >> rectifyBandRows;
+        node["Rectify_CropToValidRoi"] >> cropRectified;
+        node["Map_GridStep"] >> mapGridStep;
+        node["Preview_TrackingInterval"] >> trackingInterval;
+        node["Preview_StaticThreshold"] >> staticThreshold;
+        node["Preview_StaticRefresh"] >> staticRefresh;
+        node["Parallel_Deterministic"] >> deterministic;
+        node["Aruco_MapIdsOnly"] >> arucoMapIdsOnly;
+        node["Aruco_FusedFirstPass"] >> arucoFusedFirstPass;
+        node["Decode_Hardware"] >> hardwareDecode;
+        if (hardwareDecode.empty()) hardwareDecode = "0";
+        node["Aruco_LowPower"] >> arucoLowPower;
+        node["CorrespondenceDB_File"] >> correspondenceDBFile;
+        if (correspondenceDBFile.empty()) correspondenceDBFile = "0";
+        node["CorrespondenceDB_From"] >> correspondenceDBFrom;
+        if (correspondenceDBFrom.empty()) correspondenceDBFrom = "0";
+        node["CorrespondenceDB_To"] >> correspondenceDBTo;
+        if (correspondenceDBTo.empty()) correspondenceDBTo = "0";
+        node["Chessboard_Scales"] >> chessboardScales;
+        node["SavedImages_ThumbnailWidth"] >> thumbnailWidth;
+        node["SavedImages_SheetTiles"] >> sheetTiles;
+        node["LiveStereo_SharedMemory"] >> sharedMemoryName;
+        if (sharedMemoryName.empty()) sharedMemoryName = "0";
+        node["LiveStereo_SharedSlots"] >> sharedSlots;
+        node["Stereo_DriftInput"] >> driftInputFilename;
+        if (driftInputFilename.empty()) driftInputFilename = "0";
+        node["Stereo_DriftThreshold"] >> driftThreshold;
+        node["Stereo_ExtrinsicUpdate"] >> extrinsicUpdate;
+        node["Preview_TargetFPS"] >> targetFPS;
+        node["Calibrate_RobustLoss"] >> robustLossInput;
+        if (robustLossInput.empty()) robustLossInput = "NONE";
+        node["Calibrate_RobustScale"] >> robustScale;
+        if (robustScale == 0) robustScale = 1;
+        node["Rectify_TableStep"] >> rectifyTableStep;
+        node["Lens_Table"] >> lensTableFilename;
+        if (lensTableFilename.empty()) lensTableFilename = "0";
+        node["Lens_Setting"] >> lensSettingInput;
+        node["Lens_Subdivisions"] >> lensSubdivisions;
+        node["Lens_MapCache"] >> lensMapCache;
+        if (lensMapCache.empty()) lensMapCache = "0";
+        node["Lens_MapMemory"] >> lensMapMB;
+        interprate();
+    }
+    // Rereads the settings that PREVIEW applies between frames: those of the detection and of the display. The
+    // capture, the dictionaries and the marker maps are kept, so the rest of the file is ignored. Returns false,
+    // with nothing changed, if one of them is invalid
+    bool reloadLive(const FileNode& node)
+    {
+        int pyrLevel, fastWidth, scales, interval, width, refresh;
+        float decimate = 1, still, fps;
+        bool adaptive, cellThreshold, fastQuad, fusedFirstPass, lowPower, coords;
+        double sharpness, budget;
+        string cornerInput, lensInput;
+        vector<vector<int> > rois;
+        node["Aruco_CandidatePyramidLevel"] >> pyrLevel;
+        if (!node["Aruco_QuadDecimate"].empty())
+            node["Aruco_QuadDecimate"] >> decimate;
+        node["Aruco_AdaptiveThreshold"] >> adaptive;
+        node["Aruco_CornerRefinement"] >> cornerInput;
+        if (cornerInput.empty()) cornerInput = "SUBPIX";
+        node["Aruco_CellThreshold"] >> cellThreshold;
+        node["Aruco_FastQuadFit"] >> fastQuad;
+        node["Aruco_FusedFirstPass"] >> fusedFirstPass;
+        node["Aruco_LowPower"] >> lowPower;
+        node["Chessboard_FastWidth"] >> fastWidth;
+        node["Chessboard_Scales"] >> scales;
+        node["Detection_MinSharpness"] >> sharpness;
+        FileNode roiNode = node["Detection_Roi"];
+        for (FileNodeIterator it = roiNode.begin(); it != roiNode.end(); ++it)
+        {
+            vector<int> c;
+            *it >> c;
+            rois.push_back(c);
+        }
+        node["Detection_TimeBudget"] >> budget;
+        node["Preview_TrackingInterval"] >> interval;
+        node["Preview_StaticThreshold"] >> still;
+        node["Preview_StaticRefresh"] >> refresh;
+        node["Preview_DisplayWidth"] >> width;
+        node["Preview_TargetFPS"] >> fps;
+        node["Show_ArucoMarkerCoordinates"] >> coords;
+        node["Lens_Setting"] >> lensInput;
+
+        bool good = true;
+        MarkerDetector::CornerRefinementMethod cornerMethod = MarkerDetector::SUBPIX;
+        if (!cornerInput.compare("LINES")) cornerMethod = MarkerDetector::LINES;
+        else if (!cornerInput.compare("HARRIS")) cornerMethod = MarkerDetector::HARRIS;
+        else if (cornerInput.compare("SUBPIX"))
+        {
+            cerr << "Invalid ArUco corner refinement: " << cornerInput << endl;
+            good = false;
+        }
+        if (pyrLevel < 0 || decimate < 1 || fastWidth < 0 || scales < 0 || sharpness < 0 || budget < 0 || interval < 0 ||
+            still < 0 || refresh < 0 || fps < 0)
+        {
+            cerr << "Invalid detection settings: a pyramid level, width, sharpness, budget, interval, threshold or frame rate is negative, "
+                    "or the quad decimation is below 1" << endl;
+            good = false;
+        }
+        if (scales > 6)
+        {
+            cerr << "Invalid number of chessboard scales (0 to 6): " << scales << endl;
+            good = false;
+        }
+        // The rendering thread is only started with a display width
+        if ((width > 0) != (previewWidth > 0))
+        {
+            cerr << "Preview_DisplayWidth can be changed, but not set to or from 0, while the preview runs" << endl;
+            good = false;
+        }
+        vector<double> setting = lensSetting;
+        if (!lens.empty() && !parseLensSetting(lensInput, setting))
+            good = false;
+        vector<vector<Point> > polygons;
+        if (!parseDetectionRoi(rois, polygons))
+            good = false;
+        if (!good)
+            return false;
+
+        arucoPyrLevel = pyrLevel;
+        arucoDecimate = decimate;
+        arucoAdaptiveThres = adaptive;
+        arucoCornerMethod = cornerMethod;
+        cornerMethodInput = cornerInput;
+        arucoCellThreshold = cellThreshold;
+        arucoFastQuad = fastQuad;
+        arucoFusedFirstPass = fusedFirstPass;
+        arucoLowPower = lowPower;
+        chessboardFastWidth = fastWidth;
+        chessboardScales = scales;
+        minSharpness = sharpness;
+        roiCoords = rois;
+        detectionRoi = polygons;
+        timeBudget = budget;
+        trackingInterval = interval;
+        staticThreshold = still;
+        staticRefresh = refresh;
+        previewWidth = width;
+        targetFPS = fps;
+        showArucoCoords = coords;
+        // The intrinsic input follows the lens setting, as when the settings are loaded
+        if (!lens.empty())
+        {
+            lensSettingInput = lensInput;
+            lensSetting = setting;
+            intrinsicInput = lens.interpolate(setting);
+            lensIndex = lens.nearest(setting);
+        }
+        return true;
+    }
+    void interprate()       //Interprets the settings and checks for valid input
+    {
         goodInput = true;
 
         mode = INVALID;
         if (!modeInput.compare("INTRINSIC")) mode = INTRINSIC;
         if (!modeInput.compare("STEREO")) mode = STEREO;
+        if (!modeInput.compare("MULTI")) mode = MULTI;
         if (!modeInput.compare("PREVIEW")) mode = PREVIEW;
         if (mode == INVALID)
             {
@@ -155,10 +1601,21 @@ public:
                 goodInput = false;
             }
 
+        solver = INVALID_SOLVER;
+        if (!solverInput.compare("OPENCV")) solver = OPENCV_SOLVER;
+        if (!solverInput.compare("SPARSE")) solver = SPARSE_SOLVER;
+        if (solver == INVALID_SOLVER)
+            {
+                cerr << "Invalid calibration solver: " << solverInput << endl;
+                goodInput = false;
+            }
+
         calibrationPattern = NOT_EXISTING;
         if (!patternInput.compare("CHESSBOARD")) calibrationPattern = CHESSBOARD;
         if (!patternInput.compare("ARUCO_SINGLE")) calibrationPattern = ARUCO_SINGLE;
         if (!patternInput.compare("ARUCO_BOX")) calibrationPattern = ARUCO_BOX;
+        if (!patternInput.compare("CHARUCO")) calibrationPattern = CHARUCO;
+        if (!patternInput.compare("ARUCO_BOARDS")) calibrationPattern = ARUCO_BOARDS;
         if (calibrationPattern == NOT_EXISTING)
             {
                 cerr << "Invalid calibration pattern: " << patternInput << endl;
@@ -175,31 +1632,145 @@ public:
             cerr << "Invalid square size " << squareSize << endl;
             goodInput = false;
         }
+        if (chessboardFastWidth < 0)
+        {
+            cerr << "Invalid chessboard fast detection width: " << chessboardFastWidth << endl;
+            goodInput = false;
+        }
+        if (chessboardScales < 0 || chessboardScales > 6)
+        {
+            cerr << "Invalid number of chessboard scales (0 to 6): " << chessboardScales << endl;
+            goodInput = false;
+        }
 
-        if (mode == PREVIEW)
+        // The object points of the board are the same in every view, so they are computed once
+        chessboardObjectPoints.clear();
+        for( int i = 0; i < boardSize.height; i++ )
+            for( int j = 0; j < boardSize.width; j++ )
+                chessboardObjectPoints.push_back(Point3f(float(j*squareSize), float(i*squareSize), 0));
+
+        if (frameInput)
+        {
+            nImages = 0;        // The frames are counted as they are added
+            if (mode != INTRINSIC && mode != STEREO) {
+                cerr << "In-memory calibration requires INTRINSIC or STEREO mode" << endl;
+                goodInput = false;
+            }
+        }
+        else if (mode == PREVIEW)
         {
-            if (cameraIDInput[0] >= '0' && cameraIDInput[0] <= '9')
+            nImages = 0;
+            if (!pixelFormatInput.compare("BGR")) captureFormat = rawFrame::BGR;
+            else if (!pixelFormatInput.compare("YUYV")) captureFormat = rawFrame::YUYV;
+            else if (!pixelFormatInput.compare("NV12")) captureFormat = rawFrame::NV12;
+            else if (!pixelFormatInput.compare("MJPEG")) captureFormat = rawFrame::MJPEG;
+            else
+            {
+                cerr << "Invalid live preview pixel format: " << pixelFormatInput << endl;
+                goodInput = false;
+            }
+            if (goodInput && cameraIDInput[0] >= '0' && cameraIDInput[0] <= '9')
             {
                 stringstream ss(cameraIDInput);
                 ss >> cameraID;
-                capture.open(cameraID);
+                openCamera(capture, cameraID, 0);
             }
             if (!capture.isOpened())
             {
                 cerr << "Invalid camera ID for live preview: " << cameraIDInput << endl;
                 goodInput = false;
             }
-            else
-                printf( "\n%s", previewHelp );
+            // A second camera makes it a stereo preview
+            cameraID2 = -1;
+            if (goodInput && cameraID2Input != "-1")
+            {
+                if (cameraID2Input[0] >= '0' && cameraID2Input[0] <= '9')
+                {
+                    stringstream ss(cameraID2Input);
+                    ss >> cameraID2;
+                    openCamera(capture2, cameraID2, 1);
+                }
+                if (!capture2.isOpened())
+                {
+                    cerr << "Invalid second camera ID for live preview: " << cameraID2Input << endl;
+                    goodInput = false;
+                }
+            }
+            if (stereoMaxSkew < 0)
+            {
+                cerr << "Invalid live stereo skew: " << stereoMaxSkew << endl;
+                goodInput = false;
+            }
+            if (sharedMemoryName != "0" && (sharedMemoryName[0] != '/' || sharedMemoryName.find('/', 1) != string::npos
+                                            || sharedSlots < 2))
+            {
+                cerr << "Invalid live stereo shared memory: " << sharedMemoryName << " " << sharedSlots
+                     << " (a name \"/name\" and at least 2 slots)" << endl;
+                goodInput = false;
+            }
+            if (rectifyInputFilename != "0" && !readRectifyInput(rectifyInputFilename))
+                goodInput = false;
+            if (goodInput)
+                printf( "\n%s", capture2.isOpened() ? stereoPreviewHelp : previewHelp );
+        }
+        else if (streamInput != "0")
+        {
+            nImages = 0;        // The frames are counted as they are streamed
+            if (mode != INTRINSIC) {
+                cerr << "Streaming input requires INTRINSIC mode" << endl;
+                goodInput = false;
+            }
+            if (streamStride < 1 || streamMinMotion < 0) {
+                cerr << "Invalid stream decimation: " << streamStride << " " << streamMinMotion << endl;
+                goodInput = false;
+            }
         }
         else if (readImageList(imageListFilename))
         {
+            if (mode == STEREO && leftTag != "0" && (rightTag == "0" || rightTag == leftTag))
+            {
+                cerr << "Invalid stereo image tags: " << leftTag << " " << rightTag << endl;
+                goodInput = false;
+            }
+            else if (mode == STEREO && leftTag != "0" && !correspondences.isOpened())
+            {
+                int unpaired = pairStereoImages(imageList, leftTag, rightTag);
+                if (unpaired > 0)
+                    printf("\n%d images of the list have no stereo pair, and are not used\n", unpaired);
+            }
             nImages = (int)imageList.size();
+            fetcher.reset();
+            if (any_of(imageList.begin(), imageList.end(), objectFetcher::isUrl))
+            {
+                if (!objectFetcher::available())
+                {
+                    cerr << "URLs in the image list need a build with OBJECT_STORE=1" << endl;
+                    goodInput = false;
+                }
+                else if (remoteTransfers < 1 || remoteMB < 0)
+                {
+                    cerr << "Invalid object store settings: " << remoteTransfers << " " << remoteMB << endl;
+                    goodInput = false;
+                }
+                else
+                    fetcher = make_shared<objectFetcher>(imageList, remoteTransfers, (size_t)remoteMB << 20);
+            }
             if (mode == STEREO)
                 if (nImages % 2 != 0) {
                     cerr << "Image list must have even # of elements for stereo calibration" << endl;
                     goodInput = false;
                 }
+            if (mode == MULTI)
+            {
+                if (nCameras < 2 || nImages % nCameras != 0) {
+                    cerr << "Image list must have a multiple of the # of rig cameras (at least 2): " << nCameras << endl;
+                    goodInput = false;
+                }
+                if (batchThreads <= 0) {
+                    cerr << "MULTI mode requires batch detection (BatchDetection_Threads > 0)" << endl;
+                    goodInput = false;
+                }
+            }
         }
         else {
             cerr << "Invalid image list: " << imageListFilename << endl;
@@ -210,16 +1781,32 @@ public:
         {
             if (readArucoConfig(arucoConfigFilename)) {
                 nMarkerMaps = (int)arPat.markerMapList.size();
-                if (calibrationPattern == ARUCO_SINGLE && nMarkerMaps != 1)
+                if ((calibrationPattern == ARUCO_SINGLE || calibrationPattern == CHARUCO) && nMarkerMaps != 1)
                 {
                     cerr << "Incorrect # of marker maps for ArUco single pattern: " << nMarkerMaps << endl;
                     goodInput = false;
                 }
+                else if (calibrationPattern == CHARUCO && !findCharucoLayout(arPat.markerMapList[0], charuco))
+                {
+                    cerr << "The marker map of a CHARUCO pattern must be a chessboard of markers" << endl;
+                    goodInput = false;
+                }
                 else if (calibrationPattern == ARUCO_BOX && nMarkerMaps != 3)
                 {
                     cerr << "Incorrect # of marker maps for ArUco box pattern: " << nMarkerMaps << endl;
                     goodInput = false;
                 }
+                else if (calibrationPattern == ARUCO_BOARDS && !boardIdsDistinct(arPat))
+                {
+                    cerr << "The marker maps of an ArUco boards pattern with the same dictionary must not share ids" << endl;
+                    goodInput = false;
+                }
+                else if (calibrationPattern == ARUCO_BOARDS && (mode == STEREO || mode == MULTI || incrementalCalibration))
+                {
+                    cerr << "An ArUco boards pattern only calibrates the intrinsics of a single camera, "
+                            "without Preview_IncrementalCalibration" << endl;
+                    goodInput = false;
+                }
             }
             else {
                 cerr << "Invalid ArUco config file: " << arucoConfigFilename << endl;
@@ -227,925 +1814,9486 @@ public:
             }
         }
 
+        // Without intrinsic input, the intrinsics of an ARUCO_BOX camera start from its box faces (see initBoxIntrinsics)
         useIntrinsicInput = false;
         if (readIntrinsicInput(intrinsicInputFilename)) {
             useIntrinsicInput = true;
         }
-        else if (calibrationPattern == ARUCO_BOX) {
-            cerr << "Must input intrinsics to calibrate with ARUCO_BOX pattern" << endl;
+
+        // With a lens table, the intrinsic input is interpolated at the lens setting instead
+        lens = lensTable();
+        lensIndex = 0;
+        if (lensSubdivisions < 0)
+        {
+            cerr << "Invalid number of lens setting subdivisions: " << lensSubdivisions << endl;
             goodInput = false;
         }
-
-        flag = 0;
-        int digit, shift;
-        // For each '1' digit in the fixDistCoeffs setting, add the fix flag
-        for (int i=0; i<5; i++)
+        else if (lensMapMB < 0)
         {
-            digit = fixDistCoeffs[i] - '0';   //gets first digit as int
-            // The FIX_K[1-5] flags are separated by powers of 2, with a jump of 3 after K3
-            if (i >= 3) shift = i + 3;
-            else shift = i;
-            if (digit)
-                flag |= CV_CALIB_FIX_K1 << shift;
+            cerr << "Invalid lens map memory: " << lensMapMB << endl;
+            goodInput = false;
         }
-
-        if(fixPrincipalPoint)       flag |= CV_CALIB_FIX_PRINCIPAL_POINT;
-        if(assumeZeroTangentDist)   flag |= CV_CALIB_ZERO_TANGENT_DIST;
-        if(aspectRatio)             flag |= CV_CALIB_FIX_ASPECT_RATIO;
-    }
-
-    // Sets up the next image for pattern detection
-    Mat imageSetup(int imageIndex)
-    {
-        Mat img;
-        if( capture.isOpened() )
+        else if (lensTableFilename != "0")
         {
-            Mat capImg;
-            capture >> capImg;
-            capImg.copyTo(img);
+            if (useIntrinsicInput)
+            {
+                cerr << "Lens_Table and IntrinsicInput_Filename can not be used together" << endl;
+                goodInput = false;
+            }
+            else if (!readLensTable(lensTableFilename) || !parseLensSetting(lensSettingInput, lensSetting))
+            {
+                lens = lensTable();
+                goodInput = false;
+            }
+            else
+            {
+                intrinsicInput = lens.interpolate(lensSetting);
+                lensIndex = lens.nearest(lensSetting);
+                lens.maps = make_shared<LensMapStore>((size_t)lensMapMB << 20);
+                useIntrinsicInput = true;
+            }
         }
-        else if( imageIndex < (int)imageList.size() )
-            img = imread(imageList[imageIndex], CV_LOAD_IMAGE_COLOR);
-
-        // If the image is too big, resize it. This makes it more visible and
-        // prevents errors with ArUco detection
-        if (img.cols>1280) resize(img, img, Size(), 0.5, 0.5);
-
-        return img;
-    }
-
-    // Reads the image list from a file
-    bool readImageList( const string& filename )
-    {
-        imageList.clear();
-        FileStorage fs(filename, FileStorage::READ);
-        if( !fs.isOpened() )
-            return false;
-        FileNode n = fs.getFirstTopLevelNode();
-        if( n.type() != FileNode::SEQ )
-            return false;
-        FileNodeIterator it = n.begin(), it_end = n.end();
-        for( ; it != it_end; ++it )
-            imageList.push_back((string)*it);
-        return true;
-    }
-
-    // Sets up arucoPattern struct from a config file
-    bool readArucoConfig( const string& filename )
-    {
-        FileStorage fs(filename, FileStorage::READ);
-        if( !fs.isOpened() )
-            return false;
 
-        FileNode n = fs["MarkerMap_Configs"];
-        FileNodeIterator it = n.begin(), it_end = n.end();
-        for( ; it != it_end; ++it ) {
-            MarkerMap map;
-            map.readFromFile((string)*it);
-            arPat.markerMapList.push_back(map);
+        // The drift check solves nothing, so the intrinsics of both cameras come from the intrinsic input
+        useDriftInput = false;
+        if (driftInputFilename != "0")
+        {
+            if (mode != STEREO || !useIntrinsicInput)
+            {
+                cerr << "Stereo drift check requires STEREO mode and IntrinsicInput_Filename" << endl;
+                goodInput = false;
+            }
+            else if (driftThreshold <= 0)
+            {
+                cerr << "Invalid stereo drift threshold: " << driftThreshold << endl;
+                goodInput = false;
+            }
+            else if (readDriftInput(driftInputFilename))
+                useDriftInput = true;
+            else
+                goodInput = false;
         }
-
-        n = fs["Planes"];
-        it = n.begin(), it_end = n.end();
-        for( ; it != it_end; ++it ) {
-            arPat.planeList.push_back((string)*it);
+        if (extrinsicUpdate && driftInputFilename == "0")
+        {
+            cerr << "Stereo extrinsic update requires Stereo_DriftInput" << endl;
+            goodInput = false;
         }
 
-        fs["xOffset"] >> arPat.xOffset;
-        fs["yOffset"] >> arPat.yOffset;
-        fs["Denominator"] >> arPat.denominator;
-
-        return true;
-    }
-
-    // Sets up intrinsicInput struct from an intrinsics file
-    bool readIntrinsicInput( const string& filename )
-    {
-        FileStorage fs(filename, FileStorage::READ);
-        if( !fs.isOpened() ) {
-            if ( filename == "0" )       // Intentional lack of input
-                return false;
-            else {                       // Unintentional invalid input
-                cerr << "Invalid intrinsic input: " << filename << endl;
-                return false;
-            }
+        if (correspondences.isOpened() && batchThreads <= 0)
+        {
+            cerr << "An image list of a correspondence database requires batch detection (BatchDetection_Threads > 0)" << endl;
+            goodInput = false;
         }
-        fs["Camera_Matrix"] >> intrinsicInput.cameraMatrix;
-        fs["Distortion_Coefficients"] >> intrinsicInput.distCoeffs;
-        return true;
-    }
-
-    // Saves the intrinsic parameters of the inCal struct to intrinsicOutput
-    void saveIntrinsics(intrinsicCalibration &inCal)
-    {
-        if (intrinsicOutput == "0") return;
-        FileStorage fs( intrinsicOutput, FileStorage::WRITE );
-
-        time_t tm;
-        time( &tm );
-        struct tm *t2 = localtime( &tm );
-        char buf[1024];
-        strftime( buf, sizeof(buf)-1, "%c", t2 );
-        fs << "Calibration_Time" << buf;
-
-        fs << "Image_Width" << imageSize.width;
-        fs << "Image_Height" << imageSize.height;
-
-        fs << "Calibration_Pattern" << patternInput;
-        if (calibrationPattern == CHESSBOARD)
+        if (historyPath != "0" && (cameraName == "0" || cameraName.find_first_of("/\\") != string::npos))
         {
-            fs << "Board_Width" << boardSize.width;
-            fs << "Board_Height" << boardSize.height;
-            fs << "Square_Size" << squareSize;
+            cerr << "CalibrationHistory_Path needs a Camera_Name without slashes: " << cameraName << endl;
+            goodInput = false;
         }
-
-        if( flag & CV_CALIB_FIX_ASPECT_RATIO )
-            fs << "AspectRatio" << aspectRatio;
-
-        if( flag )
-            sprintf( buf, "%s%s%s%s%s%s%s%s%s",
-                flag & CV_CALIB_FIX_K1 ? "+FIX_K1 " : "",
-                flag & CV_CALIB_FIX_K2 ? "+FIX_K2 " : "",
-                flag & CV_CALIB_FIX_K3 ? "+FIX_K3 " : "",
-                flag & CV_CALIB_FIX_K4 ? "+FIX_K4 " : "",
-                flag & CV_CALIB_FIX_K5 ? "+FIX_K5 " : "",
-                flag & CV_CALIB_USE_INTRINSIC_GUESS ? "+USE_INTRINSIC_GUESS " : "",
-                flag & CV_CALIB_FIX_ASPECT_RATIO ? "+FIX_ASPECT_RATIO " : "",
-                flag & CV_CALIB_FIX_PRINCIPAL_POINT ? "+FIX_PRINCIPAL_POINT " : "",
-                flag & CV_CALIB_ZERO_TANGENT_DIST ? "+ZERO_TANGENT_DIST " : "" );
-        fs << "Calibration_Flags" << buf;
-
-        fs << "Camera_Matrix" << inCal.cameraMatrix;
-        fs << "Distortion_Coefficients" << inCal.distCoeffs;
-
-        fs << "Avg_Reprojection_Error" << inCal.totalAvgErr;
-        if( !inCal.reprojErrs.empty() )
-            fs << "Per_View_Reprojection_Errors" << Mat(inCal.reprojErrs);
-    }
-
-    // Saves the stereo parameters of the sterCal struct to extrinsicOutput
-    void saveExtrinsics(stereoCalibration &sterCal)
-    {
-        if (extrinsicOutput == "0") return;
-        FileStorage fs( extrinsicOutput, FileStorage::WRITE );
-
-        time_t tm;
-        time( &tm );
-        struct tm *t2 = localtime( &tm );
-        char buf[1024];
-        strftime( buf, sizeof(buf)-1, "%c", t2 );
-        fs << "Calibration_Time" << buf;
-
+        if (batchThreads < 0)
+        {
+            cerr << "Invalid number of batch detection threads: " << batchThreads << endl;
+            goodInput = false;
+        }
+        if ((threadAffinityPolicy != "none" && threadAffinityPolicy != "compact" && threadAffinityPolicy != "spread")
+                || ioCores < 0)
+        {
+            cerr << "Invalid thread affinity settings: " << threadAffinityPolicy << " " << ioCores << endl;
+            goodInput = false;
+        }
+        if (prefetchDepth < 0 || (prefetchDepth > 0 && prefetchThreads <= 0))
+        {
+            cerr << "Invalid prefetch settings: " << prefetchDepth << " " << prefetchThreads << endl;
+            goodInput = false;
+        }
+        if (arucoThreads < 0)
+        {
+            cerr << "Invalid number of ArUco detection threads: " << arucoThreads << endl;
+            goodInput = false;
+        }
+        if (autotuneFile != "0" && (autotuneSample < 0 || autotuneRecall <= 0 || autotuneRecall > 1))
+        {
+            cerr << "Invalid ArUco autotune settings: " << autotuneSample << " " << autotuneRecall << endl;
+            goodInput = false;
+        }
+        if (checkpointSync < 0)
+        {
+            cerr << "Invalid detection checkpoint sync interval: " << checkpointSync << endl;
+            goodInput = false;
+        }
+        if (shardCount < 0 || (shardCount > 0 && (shardIndex < -1 || shardIndex >= shardCount)))
+        {
+            cerr << "Invalid detection shard: " << shardIndex << " of " << shardCount << endl;
+            goodInput = false;
+        }
+        else if (shardCount > 0 && !frameInput && ((mode != INTRINSIC && mode != STEREO) || batchThreads <= 0
+                                    || streamInput != "0" || shardFile == "0"))
+        {
+            cerr << "Detection shards require batch detection of an image list in INTRINSIC or STEREO mode, "
+                    "and a shard file" << endl;
+            goodInput = false;
+        }
+        if (arucoPyrLevel < 0)
+        {
+            cerr << "Invalid ArUco candidate pyramid level: " << arucoPyrLevel << endl;
+            goodInput = false;
+        }
+        if (arucoDecimate < 1)
+        {
+            cerr << "Invalid ArUco quad decimation: " << arucoDecimate << endl;
+            goodInput = false;
+        }
+        if (!cornerMethodInput.compare("SUBPIX")) arucoCornerMethod = MarkerDetector::SUBPIX;
+        else if (!cornerMethodInput.compare("LINES")) arucoCornerMethod = MarkerDetector::LINES;
+        else if (!cornerMethodInput.compare("HARRIS")) arucoCornerMethod = MarkerDetector::HARRIS;
+        else
+        {
+            cerr << "Invalid ArUco corner refinement: " << cornerMethodInput << endl;
+            goodInput = false;
+        }
+        if (!backendInput.compare("ARUCO")) arucoBackend = ArucoBackend::VENDORED;
+        else if (!backendInput.compare("OPENCV")) arucoBackend = ArucoBackend::OPENCV;
+        else
+        {
+            cerr << "Invalid ArUco backend: " << backendInput << endl;
+            goodInput = false;
+        }
+        if (goodInput && !ArucoBackend::get(arucoBackend))
+        {
+            cerr << "The OPENCV ArUco backend needs a build with OPENCV_ARUCO=1" << endl;
+            goodInput = false;
+        }
+        modelCandidates.clear();
+        if (modelCandidatesInput != "0")
+        {
+            stringstream models(modelCandidatesInput);
+            string model;
+            while (models >> model)
+            {
+                modelCandidate m;
+                m.name = model;
+                if (!parseModelFlag(model, m.flag))
+                {
+                    cerr << "Invalid distortion model candidate: " << model << endl;
+                    goodInput = false;
+                }
+                modelCandidates.push_back(m);
+            }
+        }
+        if (modelFolds < 2)
+        {
+            cerr << "Invalid number of model selection folds: " << modelFolds << endl;
+            goodInput = false;
+        }
+        if (subsetTrials < 0 || (subsetTrials > 0 && subsetTolerance <= 0))
+        {
+            cerr << "Invalid subset analysis settings: " << subsetTrials << " " << subsetTolerance << endl;
+            goodInput = false;
+        }
+        if (maxVerticalError < 0)
+        {
+            cerr << "Invalid maximum vertical error: " << maxVerticalError << endl;
+            goodInput = false;
+        }
+        if (checkLookupStep < 0)
+        {
+            cerr << "Invalid rectification check lookup step: " << checkLookupStep << endl;
+            goodInput = false;
+        }
+        if (keyframeViews < 0 || (keyframeViews > 0 && keyframeViews < 4))
+        {
+            cerr << "Invalid keyframe budget (at least 4 views): " << keyframeViews << endl;
+            goodInput = false;
+        }
+        if (outlierThreshold < 0 || outlierIterations < 0)
+        {
+            cerr << "Invalid outlier rejection settings: " << outlierThreshold << " " << outlierIterations << endl;
+            goodInput = false;
+        }
+        if (coarsePoints < 0 || (coarsePoints > 0 && coarsePoints < 4))
+        {
+            cerr << "Invalid number of coarse calibration points: " << coarsePoints << endl;
+            goodInput = false;
+        }
+        if (savedImagesFormat != "jpg" && savedImagesFormat != "png" && savedImagesFormat != "webp"
+                && savedImagesFormat != "pnm")
+        {
+            cerr << "Invalid saved images format: " << savedImagesFormat << endl;
+            goodInput = false;
+        }
+        if (saveQueueDepth < 0 || (saveQueueDepth > 0 && saveThreads <= 0))
+        {
+            cerr << "Invalid image saving settings: " << saveQueueDepth << " " << saveThreads << endl;
+            goodInput = false;
+        }
+        if (thumbnailWidth < 0 || (thumbnailWidth > 0 && sheetTiles < 1))
+        {
+            cerr << "Invalid contact sheet settings: " << thumbnailWidth << " " << sheetTiles << endl;
+            goodInput = false;
+        }
+        if (queueMB < 0)
+        {
+            cerr << "Invalid queue memory: " << queueMB << endl;
+            goodInput = false;
+        }
+        if (saveRunReport && (mode == PREVIEW || runReportFilename().empty()))
+        {
+            cerr << "The run report needs the INTRINSIC, STEREO or MULTI mode and an output filename" << endl;
+            goodInput = false;
+        }
+        if (saveTrace && (mode == PREVIEW || traceFilename().empty()))
+        {
+            cerr << "The trace needs the INTRINSIC, STEREO or MULTI mode and an output filename" << endl;
+            goodInput = false;
+        }
+        if (minSharpness < 0)
+        {
+            cerr << "Invalid minimum sharpness: " << minSharpness << endl;
+            goodInput = false;
+        }
+        if (!parseDetectionRoi(roiCoords, detectionRoi))
+            goodInput = false;
+        if (timeBudget < 0)
+        {
+            cerr << "Invalid detection time budget: " << timeBudget << endl;
+            goodInput = false;
+        }
+        if (exportThreads < 0)
+        {
+            cerr << "Invalid number of export threads: " << exportThreads << endl;
+            goodInput = false;
+        }
+        if (remapTileSize < 0)
+        {
+            cerr << "Invalid remap tile size: " << remapTileSize << endl;
+            goodInput = false;
+        }
+        if (rectifyBandRows < 0)
+        {
+            cerr << "Invalid number of rectification band rows: " << rectifyBandRows << endl;
+            goodInput = false;
+        }
+        if (mapGridStep < 0)
+        {
+            cerr << "Invalid map grid step: " << mapGridStep << endl;
+            goodInput = false;
+        }
+        else if (mapGridStep > 0 && rectifyBandRows > 0)
+        {
+            cerr << "Map_GridStep and Rectify_BandRows cannot be used together" << endl;
+            goodInput = false;
+        }
+        if (rectifyTableStep < 0)
+        {
+            cerr << "Invalid distortion table step: " << rectifyTableStep << endl;
+            goodInput = false;
+        }
+        if (frameStoreMB < 0)
+        {
+            cerr << "Invalid frame store memory: " << frameStoreMB << endl;
+            goodInput = false;
+        }
+        if (poolMB < 0)
+        {
+            cerr << "Invalid buffer pool memory: " << poolMB << endl;
+            goodInput = false;
+        }
+        if (trackingInterval < 0)
+        {
+            cerr << "Invalid preview tracking interval: " << trackingInterval << endl;
+            goodInput = false;
+        }
+        if (staticThreshold < 0 || staticRefresh < 0)
+        {
+            cerr << "Invalid preview static scene check: " << staticThreshold << " " << staticRefresh << endl;
+            goodInput = false;
+        }
+        if (targetFPS < 0)
+        {
+            cerr << "Invalid preview target frame rate: " << targetFPS << endl;
+            goodInput = false;
+        }
+        robustLoss = INVALID_LOSS;
+        if (!robustLossInput.compare("NONE")) robustLoss = NO_LOSS;
+        if (!robustLossInput.compare("HUBER")) robustLoss = HUBER_LOSS;
+        if (!robustLossInput.compare("CAUCHY")) robustLoss = CAUCHY_LOSS;
+        if (robustLoss == INVALID_LOSS || robustScale <= 0)
+        {
+            cerr << "Invalid robust loss: " << robustLossInput << " " << robustScale << endl;
+            goodInput = false;
+        }
+        if (robustLoss != NO_LOSS && solver != SPARSE_SOLVER && !jointStereo && mode != MULTI)
+        {
+            cerr << "Calibrate_RobustLoss needs the bundle adjustment: Calibrate_Solver SPARSE, "
+                    "Calibrate_JointStereo or MULTI mode" << endl;
+            goodInput = false;
+        }
+        if (deterministic && (timeBudget > 0 || autotuneFile != "0"))
+        {
+            cerr << "Parallel_Deterministic can not be used with Detection_TimeBudget or Aruco_AutotuneFile, "
+                    "which depend on the time taken" << endl;
+            goodInput = false;
+        }
+        if (incrementalCalibration && incrementalTolerance <= 0)
+        {
+            cerr << "Invalid incremental calibration tolerance: " << incrementalTolerance << endl;
+            goodInput = false;
+        }
+        if (previewWidth < 0)
+        {
+            cerr << "Invalid preview display width: " << previewWidth << endl;
+            goodInput = false;
+        }
+        // A build without HighGUI shows nothing
+        if (!display::available())
+            headless = true;
+        if (headless)
+        {
+            if (mode == PREVIEW)
+            {
+                cerr << (display::available() ? "Headless mode can not be used with PREVIEW mode"
+                                              : "PREVIEW mode needs a build with HighGUI") << endl;
+                goodInput = false;
+            }
+            // Nothing is shown, so there is nothing to wait for
+            showUndistorted = showRectified = wait = false;
+        }
+        if (maxImageWidth < 0)
+        {
+            cerr << "Invalid maximum image width: " << maxImageWidth << endl;
+            goodInput = false;
+        }
+
+        flag = 0;
+        int digit, shift;
+        // For each '1' digit in the fixDistCoeffs setting, add the fix flag
+        for (int i=0; i<5; i++)
+        {
+            digit = fixDistCoeffs[i] - '0';   //gets first digit as int
+            // The FIX_K[1-5] flags are separated by powers of 2, with a jump of 3 after K3
+            if (i >= 3) shift = i + 3;
+            else shift = i;
+            if (digit)
+                flag |= CV_CALIB_FIX_K1 << shift;
+        }
+
+        if(fixPrincipalPoint)       flag |= CV_CALIB_FIX_PRINCIPAL_POINT;
+        if(assumeZeroTangentDist)   flag |= CV_CALIB_ZERO_TANGENT_DIST;
+        if(aspectRatio)             flag |= CV_CALIB_FIX_ASPECT_RATIO;
+    }
+
+    // Flags of a model candidate: five fixDistCoeffs digits, followed by "a" to fix the aspect ratio, "t" to
+    // assume zero tangential distortion and "p" to fix the principal point, e.g. "00011t"
+    static bool parseModelFlag(const string &model, int &flag)
+    {
+        flag = 0;
+        if (model.size() < 5)
+            return false;
+        for (int i = 0; i < 5; i++)
+        {
+            if (model[i] != '0' && model[i] != '1')
+                return false;
+            if (model[i] == '1')
+                flag |= CV_CALIB_FIX_K1 << (i >= 3 ? i + 3 : i);
+        }
+        for (size_t i = 5; i < model.size(); i++)
+        {
+            if (model[i] == 'a')        flag |= CV_CALIB_FIX_ASPECT_RATIO;
+            else if (model[i] == 't')   flag |= CV_CALIB_ZERO_TANGENT_DIST;
+            else if (model[i] == 'p')   flag |= CV_CALIB_FIX_PRINCIPAL_POINT;
+            else return false;
+        }
+        return true;
+    }
+
+    // Sets up the next image for pattern detection. Images of the list are read with the imread flags
+    Mat imageSetup(int imageIndex, int flags = CV_LOAD_IMAGE_COLOR)
+    {
+        Mat img;
+        if( capture.isOpened() )
+            capture >> img;     // A new buffer, the capture keeps none of it
+        else if( imageIndex < (int)imageList.size() )
+            return readListImage(imageIndex, flags);
+
+        limitImageWidth(img);
+        return img;
+    }
+
+    // Reads an image file, resizing it like imageSetup. Safe to call from any thread. A JPEG image that
+    // is halved is decoded at half its size instead (OpenCV 3.1 or later), which skips most of the
+    // decoding work and the full size buffer
+    Mat readImage(const string& filename, int flags = CV_LOAD_IMAGE_COLOR) const
+    {
+        pipelineTrace::scope trace("decode");
+#if CV_MAJOR_VERSION > 3 || (CV_MAJOR_VERSION == 3 && CV_MINOR_VERSION >= 1)
+        Size size;
+        if (maxImageWidth > 0 && (flags == CV_LOAD_IMAGE_COLOR || flags == CV_LOAD_IMAGE_GRAYSCALE)
+                && jpegImageSize(filename, size) && max(size.width, size.height) > maxImageWidth
+                && size.width % 2 == 0 && size.height % 2 == 0)
+        {
+            Mat img = imread(filename, flags == CV_LOAD_IMAGE_COLOR ? IMREAD_REDUCED_COLOR_2 : IMREAD_REDUCED_GRAYSCALE_2);
+            // The image may be turned by its EXIF orientation, and then its width is the height of the frame
+            bool halved = img.cols*2 == size.width && img.rows*2 == size.height && size.width > maxImageWidth;
+            bool turned = img.cols*2 == size.height && img.rows*2 == size.width && size.height > maxImageWidth;
+            if (halved || turned)
+                return img;
+        }
+#endif
+        Mat img = imread(filename, flags);
+        limitImageWidth(img);
+        return img;
+    }
+
+    // Reads an image of the list, from the frame container if the list is one. Container frames are
+    // not copied unless they need a conversion or a resize, so they may be read only (see frameContainer::owns).
+    // Safe to call from any thread
+    Mat readListImage(int index, int flags = CV_LOAD_IMAGE_COLOR) const
+    {
+        if (!container.isOpened())
+            return objectFetcher::isUrl(imageList[index]) ? readRemoteImage(index, flags) : readImage(imageList[index], flags);
+
+        pipelineTrace::scope trace("decode");
+        Mat img = container.frame(index);
+        if (flags == CV_LOAD_IMAGE_GRAYSCALE && img.channels() == 3)
+            cvtColor(img, img, CV_BGR2GRAY);
+        else if (flags == CV_LOAD_IMAGE_COLOR && img.channels() == 1)
+            cvtColor(img, img, CV_GRAY2BGR);
+        limitImageWidth(img);
+        return img;
+    }
+
+    // Opens preview camera k. An MJPEG camera is read through the hardware JPEG decoder of Decode_Hardware if there
+    // is one, as frames of its luminance, and otherwise it is asked for the pixel format of LivePreview_PixelFormat
+    void openCamera(VideoCapture &cap, int id, int k)
+    {
+        // The second camera of a stereo preview is only decoded in hardware if the first one is
+        if (!pixelFormatInput.compare("MJPEG") && hardwareDecode != "0" && (k == 0 || captureFormat == rawFrame::GRAY))
+        {
+            // The decoder gives planar YUV, whose Y plane is the whole GRAY8 frame, so the chroma is never converted.
+            // OpenCV tells a GStreamer pipeline from a device by its elements
+            stringstream pipeline;
+            pipeline << "v4l2src device=/dev/video" << id << " ! image/jpeg ! jpegparse ! "
+                     << (hardwareDecode == "1" ? string("decodebin") : hardwareDecode)
+                     << " ! videoconvert ! video/x-raw,format=GRAY8 ! appsink drop=true max-buffers=1";
+            if (cap.open(pipeline.str()))
+            {
+                captureFormat = rawFrame::GRAY;
+                captureSize[k] = Size((int)cap.get(CV_CAP_PROP_FRAME_WIDTH), (int)cap.get(CV_CAP_PROP_FRAME_HEIGHT));
+                return;
+            }
+            // Both cameras give frames of the same format
+            if (k == 1)
+            {
+                cerr << "Camera " << id << " could not be read with the JPEG decoder " << hardwareDecode
+                     << ", as the first camera is" << endl;
+                return;
+            }
+            printf("\nCamera %d could not be read with the JPEG decoder %s, it is decoded in software\n", id,
+                   hardwareDecode.c_str());
+        }
+        cap.open(id);
+        setupCaptureFormat(cap, k);
+    }
+
+    // Opens the video file of the stream input, on a hardware decoder with Decode_Hardware if OpenCV finds one
+    bool openStreamVideo(VideoCapture &video) const
+    {
+#if CV_MAJOR_VERSION > 4 || (CV_MAJOR_VERSION == 4 && (CV_MINOR_VERSION > 5 || (CV_MINOR_VERSION == 5 && CV_SUBMINOR_VERSION >= 2)))
+        if (hardwareDecode != "0")
+        {
+            vector<int> params = { CAP_PROP_HW_ACCELERATION, VIDEO_ACCELERATION_ANY };
+            if (video.open(streamInput, CAP_FFMPEG, params)
+                    && video.get(CAP_PROP_HW_ACCELERATION) != VIDEO_ACCELERATION_NONE)
+                return true;
+            video.release();
+            printf("\nNo hardware decoder for %s, it is decoded in software\n", streamInput.c_str());
+        }
+#else
+        if (hardwareDecode != "0")
+            printf("\nDecode_Hardware needs OpenCV 4.5.2 or later for videos, %s is decoded in software\n",
+                   streamInput.c_str());
+#endif
+        return video.open(streamInput);
+    }
+
+    // Asks a preview camera for frames in the pixel format of LivePreview_PixelFormat, without their conversion to BGR
+    void setupCaptureFormat(VideoCapture &cap, int k)
+    {
+        if (!cap.isOpened() || captureFormat == rawFrame::BGR)
+            return;
+        int fourcc = captureFormat == rawFrame::YUYV ? CV_FOURCC('Y','U','Y','V') :
+                     captureFormat == rawFrame::NV12 ? CV_FOURCC('N','V','1','2') : CV_FOURCC('M','J','P','G');
+        cap.set(CV_CAP_PROP_FOURCC, fourcc);
+        cap.set(CV_CAP_PROP_CONVERT_RGB, 0);
+        captureSize[k] = Size((int)cap.get(CV_CAP_PROP_FRAME_WIDTH), (int)cap.get(CV_CAP_PROP_FRAME_HEIGHT));
+    }
+
+    // Sets up a frame of preview camera k from its captured buffer: the buffer itself with the BGR format, and
+    // otherwise its luminance, with the buffer kept for the color image. Halved like imageSetup. Returns false
+    // if the buffer is not a frame of the format
+    bool setCapturedFrame(imageFrame &frame, const Mat &captured, int k) const
+    {
+        if (captureFormat == rawFrame::BGR || !captured.data)
+            frame.img = captured;
+        else
+        {
+            rawFrame raw;
+            raw.data = captured;
+            raw.format = captureFormat;
+            raw.size = captureSize[k];
+            frame.setCaptured(raw);
+            if (!frame.img.data)
+            {
+                cerr << "The frames of camera " << k << " are not " << pixelFormatInput << " frames of "
+                     << captureSize[k].width << "x" << captureSize[k].height << ", set LivePreview_PixelFormat to BGR" << endl;
+                return false;
+            }
+        }
+        limitImageWidth(frame.img);
+        return true;
+    }
+
+    // Reads an image of the list from the object store. The first read takes the object fetched ahead, and a
+    // later one fetches it again
+    Mat readRemoteImage(int index, int flags) const
+    {
+        vector<uchar> bytes;
+        {
+            pipelineTrace::scope trace("fetch");
+            if (!(fetcher && fetcher->take(index, bytes)) && !objectFetcher::fetch(imageList[index], bytes))
+                return Mat();
+        }
+        pipelineTrace::scope trace("decode");
+        Mat img = imdecode(bytes, flags);
+        limitImageWidth(img);
+        return img;
+    }
+
+    // The image of the list will not be read, so it is not fetched ahead, or its object is released
+    void skipListImage(int index) const
+    {
+        if (fetcher)
+            fetcher->skip(index);
+    }
+
+    // If the image is wider than maxImageWidth, it is halved. This makes it more visible
+    // on screen. Detection parameters are scaled with the image width (see scaleArucoParams),
+    // so full resolution images can also be detected
+    void limitImageWidth(Mat &img) const
+    {
+        if (maxImageWidth > 0 && img.cols > maxImageWidth)
+            resize(img, img, Size(), 0.5, 0.5);
+    }
+
+    // Reads the image list from a file, which can also be a frame container (see frameContainer.h) or a
+    // correspondence database (see correspondenceDB.h)
+    bool readImageList( const string& filename )
+    {
+        imageList.clear();
+        correspondences.close();
+        correspondenceImages.clear();
+        if (container.open(filename))
+        {
+            imageList = container.names();
+            return true;
+        }
+        if (correspondences.open(filename))
+            return readCorrespondenceList();
+        // A directory or a glob pattern of images is listed instead of being read
+        if (listImageFiles(filename, imageList))
+            return !imageList.empty();
+        FileStorage fs(filename, FileStorage::READ);
+        if( !fs.isOpened() )
+            return false;
+        FileNode n = fs.getFirstTopLevelNode();
+        if( n.type() != FileNode::SEQ )
+            return false;
+        FileNodeIterator it = n.begin(), it_end = n.end();
+        for( ; it != it_end; ++it )
+            imageList.push_back((string)*it);
+        return true;
+    }
+
+    // The image list of a correspondence database: the images of Camera_Name (of any camera for "0") in the
+    // sessions of the slice, detected with as many images per view as this mode has
+    bool readCorrespondenceList()
+    {
+        int perView = mode == STEREO ? 2 : mode == MULTI ? nCameras : 1;
+        for (auto &e:correspondences.entries())
+        {
+            string time = correspondenceDB::sessionTime(e.session);
+            if ((cameraName == "0" || e.camera == cameraName) && e.nCameras == perView
+                    && (correspondenceDBFrom == "0" || time >= correspondenceDBFrom)
+                    && (correspondenceDBTo == "0" || time.compare(0, correspondenceDBTo.size(), correspondenceDBTo) <= 0))
+            {
+                imageList.push_back(e.name);
+                correspondenceImages.push_back(e);
+            }
+        }
+        if (imageList.empty())
+            cerr << "No views of camera " << cameraName << " in the slice of the correspondence database" << endl;
+        return !imageList.empty();
+    }
+
+    // Sets up arucoPattern struct from a config file
+    bool readArucoConfig( const string& filename )
+    {
+        FileStorage fs(filename, FileStorage::READ);
+        if( !fs.isOpened() )
+            return false;
+
+        FileNode n = fs["MarkerMap_Configs"];
+        FileNodeIterator it = n.begin(), it_end = n.end();
+        for( ; it != it_end; ++it ) {
+            MarkerMap map = sharedMarkerMap((string)*it);
+            arPat.markerMapList.push_back(map);
+
+            // Marker maps that share a dictionary share a labeler in detection
+            string dict = map.getDictionary();
+            int index = find(arPat.dictionaries.begin(), arPat.dictionaries.end(), dict) - arPat.dictionaries.begin();
+            if (index == (int)arPat.dictionaries.size())
+                arPat.dictionaries.push_back(dict);
+            arPat.mapDictionary.push_back(index);
+        }
+
+        n = fs["Planes"];
+        it = n.begin(), it_end = n.end();
+        for( ; it != it_end; ++it ) {
+            arPat.planeList.push_back((string)*it);
+        }
+
+        fs["xOffset"] >> arPat.xOffset;
+        fs["yOffset"] >> arPat.yOffset;
+        fs["Denominator"] >> arPat.denominator;
+
+        if (arPat.planeList.size() != arPat.markerMapList.size() || arPat.denominator == 0)
+            return false;
+        for (size_t j = 0; j < arPat.markerMapList.size(); j++)
+            toIntPoints(arPat, (int)j);
+
+        return true;
+    }
+
+    // Sets up intrinsicInput struct from an intrinsics file
+    bool readIntrinsicInput( const string& filename )
+    {
+        return readIntrinsics(filename, intrinsicInput);
+    }
+
+    // Reads the calibrated settings of a lens table, and precomputes the intrinsics of its lattice. The maps are
+    // only built once the preview uses them (see lensMaps)
+    bool readLensTable( const string& filename )
+    {
+        FileStorage fs(filename, FileStorage::READ);
+        if (!fs.isOpened())
+        {
+            cerr << "Invalid lens table: " << filename << endl;
+            return false;
+        }
+        FileNode pointsNode = fs["Lens_Points"];
+        vector<vector<double> > settings;
+        vector<intrinsicCalibration> cals;
+        for (FileNodeIterator it = pointsNode.begin(); it != pointsNode.end(); ++it)
+        {
+            vector<double> setting;
+            string file;
+            (*it)["Setting"] >> setting;
+            (*it)["Intrinsics"] >> file;
+            intrinsicCalibration cal;
+            if (setting.empty() || (!settings.empty() && setting.size() != settings[0].size()))
+            {
+                cerr << "Invalid lens table: every point needs a setting with the same number of values" << endl;
+                return false;
+            }
+            if (file.empty() || file == "0" || !readIntrinsics(file, cal) || cal.cameraMatrix.total() != 9)
+            {
+                cerr << "Invalid lens table: the intrinsics of a point could not be read: " << file << endl;
+                return false;
+            }
+            settings.push_back(setting);
+            cals.push_back(cal);
+        }
+        if (settings.empty())
+        {
+            cerr << "Invalid lens table, it has no Lens_Points: " << filename << endl;
+            return false;
+        }
+
+        // The points must hold every combination of the values of the axes once
+        int nAxes = (int)settings[0].size(), nPoints = 1;
+        size_t nCoeffs = 0;
+        lens.axes.assign(nAxes, vector<double>());
+        for (int d = 0; d < nAxes; d++)
+        {
+            for (auto &setting:settings)
+                lens.axes[d].push_back(setting[d]);
+            sort(lens.axes[d].begin(), lens.axes[d].end());
+            lens.axes[d].erase(unique(lens.axes[d].begin(), lens.axes[d].end()), lens.axes[d].end());
+            nPoints *= (int)lens.axes[d].size();
+        }
+        for (auto &cal:cals)
+            nCoeffs = max(nCoeffs, cal.distCoeffs.total());
+        lens.points.assign(nPoints, intrinsicCalibration());
+        for (size_t p = 0; p < settings.size(); p++)
+        {
+            int index = 0, stride = 1;
+            for (int d = 0; d < nAxes; d++)
+            {
+                index += (int)(lower_bound(lens.axes[d].begin(), lens.axes[d].end(), settings[p][d]) - lens.axes[d].begin())*stride;
+                stride *= (int)lens.axes[d].size();
+            }
+            if (!lens.points[index].cameraMatrix.empty())
+            {
+                cerr << "Invalid lens table: a setting is calibrated twice" << endl;
+                return false;
+            }
+            intrinsicCalibration &point = lens.points[index];
+            cals[p].cameraMatrix.convertTo(point.cameraMatrix, CV_64F);
+            point.distCoeffs = Mat::zeros((int)nCoeffs, 1, CV_64F);
+            Mat d = cals[p].distCoeffs.reshape(1, (int)cals[p].distCoeffs.total());
+            d.convertTo(point.distCoeffs.rowRange(0, d.rows), CV_64F);
+        }
+        if ((int)settings.size() != nPoints)
+        {
+            cerr << "Invalid lens table: " << settings.size() << " points, but its axes have " << nPoints
+                 << " combinations of values" << endl;
+            return false;
+        }
+
+        // The lattice: the calibrated values of each axis, and lensSubdivisions values between two of them
+        lens.lattice.assign(nAxes, vector<double>());
+        int nEntries = 1;
+        for (int d = 0; d < nAxes; d++)
+        {
+            const vector<double> &v = lens.axes[d];
+            for (size_t i = 0; i + 1 < v.size(); i++)
+                for (int k = 0; k <= lensSubdivisions; k++)
+                    lens.lattice[d].push_back(v[i] + (v[i+1] - v[i])*k/(lensSubdivisions + 1));
+            lens.lattice[d].push_back(v.back());
+            nEntries *= (int)lens.lattice[d].size();
+        }
+        lens.entries.resize(nEntries);
+        for (int e = 0; e < nEntries; e++)
+        {
+            int rest = e;
+            for (int d = 0; d < nAxes; d++)
+            {
+                lens.entries[e].setting.push_back(lens.lattice[d][rest % lens.lattice[d].size()]);
+                rest /= (int)lens.lattice[d].size();
+            }
+            lens.entries[e].cal = lens.interpolate(lens.entries[e].setting);
+        }
+        return true;
+    }
+
+    // Parses a lens setting, one value per axis of the lens table
+    bool parseLensSetting( const string& input, vector<double> &setting )
+    {
+        istringstream str(input);
+        vector<double> values;
+        double v;
+        while (str >> v)
+            values.push_back(v);
+        if (values.size() != lens.axes.size() || !str.eof())
+        {
+            cerr << "Invalid lens setting, it needs " << lens.axes.size() << " values: " << input << endl;
+            return false;
+        }
+        setting = values;
+        return true;
+    }
+
+    // Reads the intrinsics of a text or binary intrinsics file
+    bool readIntrinsics( const string& filename, intrinsicCalibration &cal )
+    {
+        // Binary intrinsics, written with Save_BinaryCalibration
+        if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0)
+        {
+            map<string, Mat> mats;
+            Size size;
+            if (!readCalibrationBinary(filename, INTRINSIC_FILE, size, mats)
+                    || mats["Camera_Matrix"].empty() || mats["Distortion_Coefficients"].empty()) {
+                cerr << "Invalid intrinsic input: " << filename << endl;
+                return false;
+            }
+            cal.cameraMatrix = mats["Camera_Matrix"];
+            cal.distCoeffs = mats["Distortion_Coefficients"];
+            // Precomputed maps are only valid for the image size they were computed for
+            if (!mats["Undistortion_Map_1"].empty() && mats["Undistortion_Map_1"].size() == size)
+            {
+                cal.undistortMap[0] = mats["Undistortion_Map_1"];
+                cal.undistortMap[1] = mats["Undistortion_Map_2"];
+            }
+            Mat grid = mats["Undistortion_Grid"], gridStep = mats["Undistortion_Grid_Step"];
+            if (!grid.empty() && !gridStep.empty() && gridStep.type() == CV_32S && gridStep.at<int>(0) > 0)
+            {
+                mapGrid &g = cal.undistortGrid;
+                g.step = gridStep.at<int>(0);
+                g.size = size;
+                if (grid.type() == CV_32FC2 && grid.cols == (size.width - 1)/g.step + 2
+                        && grid.rows == (size.height - 1)/g.step + 2)
+                    g.points = grid;
+            }
+            return true;
+        }
+
+        FileStorage fs(filename, FileStorage::READ);
+        if( !fs.isOpened() ) {
+            if ( filename == "0" )       // Intentional lack of input
+                return false;
+            else {                       // Unintentional invalid input
+                cerr << "Invalid intrinsic input: " << filename << endl;
+                return false;
+            }
+        }
+        fs["Camera_Matrix"] >> cal.cameraMatrix;
+        fs["Distortion_Coefficients"] >> cal.distCoeffs;
+        return true;
+    }
+
+    // Reads the rectification maps of the live stereo preview from binary extrinsics, written with
+    // Save_BinaryCalibration. The text extrinsics do not hold the intrinsics the maps are built from
+    bool readRectifyInput( const string& filename )
+    {
+        map<string, Mat> mats;
+        Size size;
+        if (!readCalibrationBinary(filename, STEREO_FILE, size, mats)
+                || mats["Rectification_Map_1_1"].empty() || mats["Rectification_Map_2_1"].empty()) {
+            cerr << "Invalid rectification input (binary extrinsics with rectification maps): " << filename << endl;
+            return false;
+        }
+        liveRectifyMap[0][0] = mats["Rectification_Map_1_1"];
+        liveRectifyMap[0][1] = mats["Rectification_Map_1_2"];
+        liveRectifyMap[1][0] = mats["Rectification_Map_2_1"];
+        liveRectifyMap[1][1] = mats["Rectification_Map_2_2"];
+        return true;
+    }
+
+    // Reads the stored extrinsics of the drift check, text or binary (".bin", written with Save_BinaryCalibration)
+    bool readDriftInput( const string& filename )
+    {
+        stereoCalibration &c = driftInput;
+        if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0)
+        {
+            map<string, Mat> mats;
+            Size size;
+            if (readCalibrationBinary(filename, STEREO_FILE, size, mats))
+            {
+                c.R = mats["Rotation_Matrix"];
+                c.T = mats["Translation_Vector"];
+                c.E = mats["Essential_Matrix"];
+                c.F = mats["Fundamental_Matrix"];
+                c.R1 = mats["Rectification_Transformation_1"];
+                c.R2 = mats["Rectification_Transformation_2"];
+                c.P1 = mats["Projection_Matrix_1"];
+                c.P2 = mats["Projection_Matrix_2"];
+                c.Q = mats["Disparity-to-depth_Mapping_Matrix"];
+            }
+        }
+        else
+        {
+            FileStorage fs(filename, FileStorage::READ);
+            if (fs.isOpened())
+            {
+                FileNode stereo = fs["Stereo_Parameters"], rect = fs["Rectification_Parameters"];
+                stereo["Rotation_Matrix"] >> c.R;
+                stereo["Translation_Vector"] >> c.T;
+                stereo["Essential_Matrix"] >> c.E;
+                stereo["Fundamental_Matrix"] >> c.F;
+                rect["Rectification_Transformation_1"] >> c.R1;
+                rect["Rectification_Transformation_2"] >> c.R2;
+                rect["Projection_Matrix_1"] >> c.P1;
+                rect["Projection_Matrix_2"] >> c.P2;
+                rect["Disparity-to-depth_Mapping_Matrix"] >> c.Q;
+            }
+        }
+        if (c.R.total() != 9 || c.T.total() != 3 || c.F.empty() || c.R1.empty() || c.R2.empty()
+                || c.P1.empty() || c.P2.empty()) {
+            cerr << "Invalid stereo drift input (extrinsics with rectification parameters): " << filename << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // The run report and the trace are written next to the output of the mode, or next to the other output
+    // if it is not saved
+    string runReportFilename() const { return reportOutput().empty() ? string() : reportOutput() + ".report.yml"; }
+    string traceFilename() const { return reportOutput().empty() ? string() : reportOutput() + ".trace.json"; }
+    string reportOutput() const
+    {
+        bool extrinsic = (mode == STEREO || mode == MULTI) ? extrinsicOutput != "0" : intrinsicOutput == "0";
+        const string &output = extrinsic ? extrinsicOutput : intrinsicOutput;
+        return output == "0" ? string() : output;
+    }
+
+    // Saves the intrinsic parameters of the inCal struct to intrinsicOutput
+    void saveIntrinsics(const intrinsicCalibration &inCal) const
+    {
+        if (intrinsicOutput == "0") return;
+        FileStorage fs( intrinsicOutput, FileStorage::WRITE );
+
+        time_t tm;
+        time( &tm );
+        struct tm *t2 = localtime( &tm );
+        char buf[1024];
+        strftime( buf, sizeof(buf)-1, "%c", t2 );
+        fs << "Calibration_Time" << buf;
+
+        fs << "Image_Width" << imageSize.width;
+        fs << "Image_Height" << imageSize.height;
+
+        fs << "Calibration_Pattern" << patternInput;
+        if (calibrationPattern == CHESSBOARD)
+        {
+            fs << "Board_Width" << boardSize.width;
+            fs << "Board_Height" << boardSize.height;
+            fs << "Square_Size" << squareSize;
+        }
+
+        // The flags of the selected model, if the model selection ran
+        int flag = inCal.modelFlag >= 0 ? inCal.modelFlag | (this->flag & CV_CALIB_USE_INTRINSIC_GUESS) : this->flag;
+        if( flag & CV_CALIB_FIX_ASPECT_RATIO )
+            fs << "AspectRatio" << aspectRatio;
+
+        if( flag )
+            sprintf( buf, "%s%s%s%s%s%s%s%s%s",
+                flag & CV_CALIB_FIX_K1 ? "+FIX_K1 " : "",
+                flag & CV_CALIB_FIX_K2 ? "+FIX_K2 " : "",
+                flag & CV_CALIB_FIX_K3 ? "+FIX_K3 " : "",
+                flag & CV_CALIB_FIX_K4 ? "+FIX_K4 " : "",
+                flag & CV_CALIB_FIX_K5 ? "+FIX_K5 " : "",
+                flag & CV_CALIB_USE_INTRINSIC_GUESS ? "+USE_INTRINSIC_GUESS " : "",
+                flag & CV_CALIB_FIX_ASPECT_RATIO ? "+FIX_ASPECT_RATIO " : "",
+                flag & CV_CALIB_FIX_PRINCIPAL_POINT ? "+FIX_PRINCIPAL_POINT " : "",
+                flag & CV_CALIB_ZERO_TANGENT_DIST ? "+ZERO_TANGENT_DIST " : "" );
+        fs << "Calibration_Flags" << buf;
+
+        fs << "Camera_Matrix" << inCal.cameraMatrix;
+        fs << "Distortion_Coefficients" << inCal.distCoeffs;
+
+        fs << "Avg_Reprojection_Error" << inCal.totalAvgErr;
+        if( !inCal.stdDevs.empty() )
+            fs << "Intrinsic_Standard_Deviations" << inCal.stdDevs;
+        if( !inCal.reprojErrs.empty() )
+            fs << "Per_View_Reprojection_Errors" << Mat(inCal.reprojErrs);
+        if (!inCal.models.empty())
+        {
+            fs << "Model_Selection" << "{" << "Folds" << modelFolds << "Models" << "[";
+            for (auto &m:inCal.models)
+                fs << "{" << "Model" << m.name << "HeldOut_Reprojection_Error" << m.heldOutErr
+                   << "Selected" << (int)(m.flag == inCal.modelFlag) << "}";
+            fs << "]" << "}";
+        }
+
+        if (saveBinary)
+        {
+            vector<pair<string, Mat> > mats;
+            mats.push_back(make_pair("Camera_Matrix", inCal.cameraMatrix));
+            mats.push_back(make_pair("Distortion_Coefficients", inCal.distCoeffs));
+            mats.push_back(make_pair("Avg_Reprojection_Error", Mat(1, 1, CV_64F, Scalar(inCal.totalAvgErr))));
+            if( !inCal.reprojErrs.empty() )
+                mats.push_back(make_pair("Per_View_Reprojection_Errors", Mat(inCal.reprojErrs)));
+            if (!inCal.undistortMap[0].empty())
+            {
+                mats.push_back(make_pair("Undistortion_Map_1", inCal.undistortMap[0]));
+                mats.push_back(make_pair("Undistortion_Map_2", inCal.undistortMap[1]));
+            }
+            if (!inCal.undistortGrid.points.empty())
+            {
+                mats.push_back(make_pair("Undistortion_Grid", inCal.undistortGrid.points));
+                mats.push_back(make_pair("Undistortion_Grid_Step", Mat(1, 1, CV_32S, Scalar(inCal.undistortGrid.step))));
+            }
+            // The calibrated correspondences, so the calibration can be solved again
+            correspondenceStore store;
+            store.add(inCal);
+            if (store.size() > 0)
+                store.toMats("Correspondence_", mats);
+            if (!writeCalibrationBinary(intrinsicOutput + ".bin", INTRINSIC_FILE, imageSize, mats))
+                cerr << "Could not write binary intrinsics: " << intrinsicOutput << ".bin" << endl;
+        }
+    }
+
+    // Saves the stereo parameters of the sterCal struct to extrinsicOutput
+    void saveExtrinsics(const stereoCalibration &sterCal) const
+    {
+        if (extrinsicOutput == "0") return;
+        FileStorage fs( extrinsicOutput, FileStorage::WRITE );
+
+        time_t tm;
+        time( &tm );
+        struct tm *t2 = localtime( &tm );
+        char buf[1024];
+        strftime( buf, sizeof(buf)-1, "%c", t2 );
+        fs << "Calibration_Time" << buf;
+
+        fs << "Calibration_Pattern" << patternInput;
+
+        fs << "Stereo_Parameters";
+        fs << "{" << "Rotation_Matrix"     << sterCal.R
+                  << "Translation_Vector"  << sterCal.T
+                  << "Essential_Matrix"    << sterCal.E
+                  << "Fundamental_Matrix"  << sterCal.F
+           << "}";
+
+        fs << "Rectification_Parameters";
+        fs << "{" << "Rectification_Transformation_1"       << sterCal.R1
+                  << "Rectification_Transformation_2"       << sterCal.R2
+                  << "Projection_Matrix_1"                  << sterCal.P1
+                  << "Projection_Matrix_2"                  << sterCal.P2
+                  << "Disparity-to-depth_Mapping_Matrix"    << sterCal.Q
+           << "}";
+
+        // The binary file also stores the rectification maps, so they do not need to be recomputed
+        if (saveBinary)
+        {
+            Mat rois(2, 4, CV_32S);
+            for (int k = 0; k < 2; k++)
+            {
+                rois.at<int>(k, 0) = sterCal.validRoi[k].x;
+                rois.at<int>(k, 1) = sterCal.validRoi[k].y;
+                rois.at<int>(k, 2) = sterCal.validRoi[k].width;
+                rois.at<int>(k, 3) = sterCal.validRoi[k].height;
+            }
+            vector<pair<string, Mat> > mats;
+            mats.push_back(make_pair("Rotation_Matrix", sterCal.R));
+            mats.push_back(make_pair("Translation_Vector", sterCal.T));
+            mats.push_back(make_pair("Essential_Matrix", sterCal.E));
+            mats.push_back(make_pair("Fundamental_Matrix", sterCal.F));
+            mats.push_back(make_pair("Rectification_Transformation_1", sterCal.R1));
+            mats.push_back(make_pair("Rectification_Transformation_2", sterCal.R2));
+            mats.push_back(make_pair("Projection_Matrix_1", sterCal.P1));
+            mats.push_back(make_pair("Projection_Matrix_2", sterCal.P2));
+            mats.push_back(make_pair("Disparity-to-depth_Mapping_Matrix", sterCal.Q));
+            mats.push_back(make_pair("Valid_ROIs", rois));
+            mats.push_back(make_pair("Rectification_Map_1_1", sterCal.rmap[0][0]));
+            mats.push_back(make_pair("Rectification_Map_1_2", sterCal.rmap[0][1]));
+            mats.push_back(make_pair("Rectification_Map_2_1", sterCal.rmap[1][0]));
+            mats.push_back(make_pair("Rectification_Map_2_2", sterCal.rmap[1][1]));
+            if (!sterCal.rectifyGrid[0].points.empty())
+            {
+                mats.push_back(make_pair("Rectification_Grid_1", sterCal.rectifyGrid[0].points));
+                mats.push_back(make_pair("Rectification_Grid_2", sterCal.rectifyGrid[1].points));
+                mats.push_back(make_pair("Rectification_Grid_Step", Mat(1, 1, CV_32S, Scalar(sterCal.rectifyGrid[0].step))));
+            }
+            if (!writeCalibrationBinary(extrinsicOutput + ".bin", STEREO_FILE, imageSize, mats))
+                cerr << "Could not write binary extrinsics: " << extrinsicOutput << ".bin" << endl;
+        }
+    }
+
+    // Saves the intrinsics of each camera and its pose wrt the first one to extrinsicOutput
+    void saveRig(const vector<intrinsicCalibration> &cams, const rigCalibration &rig) const
+    {
+        if (extrinsicOutput == "0") return;
+        FileStorage fs( extrinsicOutput, FileStorage::WRITE );
+
+        time_t tm;
+        time( &tm );
+        struct tm *t2 = localtime( &tm );
+        char buf[1024];
+        strftime( buf, sizeof(buf)-1, "%c", t2 );
+        fs << "Calibration_Time" << buf;
+
+        fs << "Image_Width" << imageSize.width;
+        fs << "Image_Height" << imageSize.height;
         fs << "Calibration_Pattern" << patternInput;
+        fs << "Rig_Cameras" << (int)cams.size();
+        fs << "Rig_Reprojection_Error" << rig.err;
+
+        vector<pair<string, Mat> > mats;
+        for (size_t c = 0; c < cams.size(); c++)
+        {
+            sprintf(buf, "Camera_%d", (int)c);
+            fs << buf;
+            fs << "{" << "Camera_Matrix"           << cams[c].cameraMatrix
+                      << "Distortion_Coefficients" << cams[c].distCoeffs
+                      << "Rotation_Matrix"         << rig.R[c]
+                      << "Translation_Vector"      << rig.T[c]
+                      << "Avg_Reprojection_Error"  << cams[c].totalAvgErr
+               << "}";
+
+            string n(buf);
+            mats.push_back(make_pair(n + "_Camera_Matrix", cams[c].cameraMatrix));
+            mats.push_back(make_pair(n + "_Distortion_Coefficients", cams[c].distCoeffs));
+            mats.push_back(make_pair(n + "_Rotation_Matrix", rig.R[c]));
+            mats.push_back(make_pair(n + "_Translation_Vector", rig.T[c]));
+        }
+        if (saveBinary && !writeCalibrationBinary(extrinsicOutput + ".bin", RIG_FILE, imageSize, mats))
+            cerr << "Could not write binary extrinsics: " << extrinsicOutput << ".bin" << endl;
+    }
+
+public:
+//--------------------------Calibration configuration-------------------------//
+    // Program modes:
+    //    INTRINSIC  — calculates intrinsics parameters and  undistorts images
+    //    STEREO     — calculates extrinsic stereo paramaters and rectifies images
+    //    MULTI      — calculates the intrinsics and poses of a rig of cameras together
+    //    PREVIEW    — detects pattern on live feed, previewing detection and undistortion
+    Mode mode;
+    Pattern calibrationPattern;   // Supported calibration patterns: CHESSBOARD, ARUCO_SINGLE, ARUCO_BOX, CHARUCO, ARUCO_BOARDS
+
+    Size boardSize;     // Size of chessboard (number of inner corners per chessboard row and column)
+    float squareSize;   // The size of a square in some user defined metric system (pixel, millimeter, etc.)
+    vector<Point3f> chessboardObjectPoints;   // 3D object points of the chessboard corners, row by row
+    int chessboardFastWidth;    // Width of the downscaled check before the full resolution chessboard search, 0 to always search the whole image
+    // Otherwise, the chessboard can be searched at several scales at once, each half the previous one down from
+    // the full resolution (3 for 1/4, 1/2 and full), with the first board found kept. 0 or 1 for the full resolution only
+    int chessboardScales;
+
+//-----------------------------Input settings---------------------------------//
+    vector<string> imageList;   // Image list to run calibration
+    string imageListFilename;   // Input filename for image list
+
+    // Leave at "0" to take the stereo pairs of the image list in order, left image first. Otherwise, an image whose
+    // file name contains the left tag is paired with the image that has the right tag in its place
+    string leftTag;         // Part of the name of the left images (STEREO mode)
+    string rightTag;        // Part of the name of the right images, replacing the left tag
+    frameContainer container;   // Frames of the image list, if its file is a frame container
+    correspondenceDB correspondences;   // Views of the image list, if its file is a correspondence database
+    vector<correspondenceDB::entry> correspondenceImages;  // Record of each image of the list in the database
+
+    //A video file or a glob pattern of images (e.g. "../input/images/*.jpg") can be streamed instead
+    //of the image list, in INTRINSIC mode. Leave at "0" to use the image list
+    string streamInput;         // Video filename or image pattern
+    int streamStride;           // Only every this many frames of the stream are considered
+    float streamMinMotion;      // Mean gray level change from the last kept frame below which a frame is skipped
+
+    arucoPattern arPat;      // arucoPattern struct that stores information for an ArUco pattern
+    charucoLayout charuco;   // Inner corners of the CHARUCO marker map
+    string arucoConfigFilename;      // Input filename to configure ArUco pattern
+
+    //Intrinsic input can be used as an initial estimate for intrinsic calibration,
+    //as fixed intrinsics for stereo calibration, or to preview undistortion in preview mode
+    //Leave filename at "0" to calculate new intrinsics
+    intrinsicCalibration intrinsicInput; // Struct to store inputted intrinsics
+
+    // Leave Lens_Table at "0" for a fixed lens. Otherwise, the intrinsic input is interpolated from the calibrated
+    // settings of the table at Lens_Setting, and the preview switches to the undistortion maps of the precomputed
+    // setting nearest to it when Lens_Setting is reloaded
+    string lensTableFilename;   // File of the calibrated lens settings
+    string lensSettingInput;    // Lens setting, one value per axis of the table
+    int lensSubdivisions;       // Precomputed settings between two calibrated values of an axis
+    string lensMapCache;        // Path at which to store the undistortion maps of the precomputed settings
+    int lensMapMB;              // Maximum memory (MB) of the undistortion maps built by the preview
+    lensTable lens;
+    vector<double> lensSetting;
+    int lensIndex;              // Index of the precomputed setting nearest to lensSetting
+    string intrinsicInputFilename;       // Intrinsic input filename
+    bool useIntrinsicInput;              // Boolean to simplify program
+
+//-----------------------------Output settings--------------------------------//
+    string intrinsicOutput;    // File to write results of intrinsic calibration
+    string extrinsicOutput;    // File to write results of stereo calibration
+    bool saveBinary;           // Also write the results to a binary file, with ".bin" appended to the filename
+    bool saveRunReport;        // Also write a run report (see runReport), with ".report.yml" appended to the filename
+    bool saveTrace;            // Also write a trace of the stages (see pipelineTrace), with ".trace.json" appended
+
+    // LEAVE THESE SETTINGS AT "0" TO NOT SAVE IMAGES
+    string undistortedPath;    // Path at which to save undistorted images
+    string rectifiedPath;      // Path at which to save rectified images
+    string rectifiedContainer; // Frame container to which to write the rectified pairs, with Q
+    string detectedPath;       // Path at which to save images with detected patterns
+    string savedImagesFormat;  // Format of the saved images: jpg, png, webp (lossless) or pnm (raw)
+
+//-----------------------Intrinsic Calibration settings-----------------------//
+    // It is recommended to fix distortion coefficients 3-5 ("00111"). Only 1-2 are needed
+    // in most cases, and 3 produces significant distortion in stereo rectification
+    string fixDistCoeffs;         // A string of five digits (0 or 1) that control which distortion coefficients will be fixed (1 = fixed)
+    float aspectRatio;            // The aspect ratio. If it is non zero, it will be fixed in calibration
+    bool assumeZeroTangentDist;   // Assume zero tangential distortion
+    bool fixPrincipalPoint;       // Fix the principal point at the center
+    int flag;                     // Flag to modify calibration
+
+    // Leave at "0" to calibrate with the flags above. Otherwise, the intrinsics are calibrated with each of
+    // these models (see parseModelFlag), scored by their reprojection error on held out views over the folds,
+    // and the best one is used
+    string modelCandidatesInput;              // Distortion models to compare, separated by spaces
+    vector<modelCandidate> modelCandidates;
+    int modelFolds;                           // Number of cross-validation folds of the model selection
+
+    // Leave the iterations at 0 to calibrate once. Otherwise, points with a reprojection
+    // error above the threshold are removed and the calibration is solved again
+    float outlierThreshold;       // Reprojection error (pixels) above which a point is an outlier
+    int outlierIterations;        // Maximum number of outlier rejection rounds
+
+    // Leave at NONE to minimize the squared reprojection errors. Otherwise, the bundle adjustment minimizes a
+    // robust loss of them, and the outliers are removed once after it instead of in rounds of solves
+    Loss robustLoss;              // Loss of the reprojection errors in bundleAdjust
+    float robustScale;            // Reprojection error (pixels) beyond which the robust loss grows slower
+
+    // Leave at 0 to solve on every point at once. Otherwise, the intrinsics are first solved on at most this
+    // many points of each view, spread over the view, and the solve on every point starts from them
+    int coarsePoints;             // Points per view of the coarse solve
+
+    // OPENCV solves the intrinsics and every view with calibrateCamera. SPARSE uses a bundle adjustment
+    // that eliminates the view poses (see bundleAdjust.h), which is much faster with many views
+    Solver solver;                // Solver used for intrinsic calibration
+
+    // In STEREO mode, the intrinsics of each camera are normally calibrated first, and then kept fixed
+    // to solve the pose between the cameras. If true, both are solved together in a single bundle
+    // adjustment, starting from the intrinsic input if there is one
+    bool jointStereo;             // Solve the intrinsics and stereo extrinsics together
+
+    // If true, the pose between the cameras with fixed intrinsics is solved on the undistorted and normalized
+    // points, which are computed once, instead of distorting every point on each iteration of stereoCalibrate
+    bool normalizedStereo;        // Solve the fixed intrinsic stereo pose on normalized points
+
+    // Leave the trials at 0 to skip the subset analysis. Otherwise, after INTRINSIC calibration, random
+    // subsets of the views of increasing size are calibrated (this many of each size, in parallel) until
+    // the intrinsics are stable, and the best subset of that size is written to an image list
+    int subsetTrials;             // Number of calibrations of each subset size
+    float subsetTolerance;        // Standard deviation (pixels) of fx, fy, cx and cy below which a subset size is stable
+    string subsetImageList;       // Image list to write the selected subset to ("0" to not write it)
+
+    // Leave at 0 to calibrate every detected view. Otherwise, in INTRINSIC mode, the views that add the most
+    // new coverage of the image and of the pattern poses are kept, up to this many, and the rest are skipped
+    int keyframeViews;            // Maximum number of views to calibrate
+
+    // Leave at 0 to only report the rectification check of STEREO mode. Otherwise, the extrinsics are not saved
+    // when the RMS vertical disparity of the rectified corners is above this many pixels
+    double maxVerticalError;      // Largest RMS vertical disparity of accepted extrinsics
+
+    // Leave at 0 to rectify and undistort the corners of the rectification check with the distortion model.
+    // Otherwise, they are interpolated in tables of this step (see aruco::UndistortLookup), computed once
+    int checkLookupStep;          // Step (pixels) of the point undistortion tables of the rectification check
+
+//--------------------------------UI settings---------------------------------//
+    bool showUndistorted;   // Show undistorted images after intrinsic calibration
+    bool showRectified;     // Show rectified images after stereo calibration
+    bool showArucoCoords;   // Draw each marker with its 3D coordinate. If false, IDs will be printed
+    bool wait;              // Wait until a key is pressed to show the next detected image
+    bool headless;          // Never open a window. Detections are only drawn if they are saved
+
+//----------------------------Performance settings----------------------------//
+    // Leave at 0 to detect the images one at a time, displaying each detection.
+    // Otherwise, images are decoded and detected headless on this many threads
+    int batchThreads;       // Number of threads for batch detection (INTRINSIC, STEREO and MULTI modes)
+
+    // Leave at "none" to let the system move the threads. "compact" pins each detection thread to a core,
+    // filling a NUMA node before the next, and "spread" deals them out over the nodes. The I/O cores are kept
+    // for the threads that decode and write images
+    string threadAffinityPolicy;    // Placement of the detection threads
+    int ioCores;                    // Number of cores reserved for the I/O threads
+
+    // Leave the queue depth at 0 to read each image when it is needed. Otherwise, the
+    // next images of the list are decoded in the background while the current one is detected
+    int prefetchDepth;      // Maximum number of images decoded ahead of detection
+    int prefetchThreads;    // Number of threads decoding images
+
+    // The images of a list of URLs are fetched from the object store ahead of their detection, many at once, while
+    // fewer than the maximum memory (MB) of them is held (see objectStore.h)
+    int remoteTransfers;    // Maximum number of objects fetched at once
+    int remoteMB;           // Memory of the fetched objects above which no new fetch starts, 0 for no limit
+    shared_ptr<objectFetcher> fetcher;  // Fetcher of the image list, if it has URLs
+
+    // ArUco markers can be searched in a downscaled image (each level halves it), and their
+    // corners are then refined at full resolution. Leave at 0 to search at full resolution
+    int arucoPyrLevel;      // Pyramid level in which ArUco candidates are searched
+
+    // Above 1, ArUco markers are searched in the image reduced by this factor instead, which may be any
+    // value, and their sides are then fitted to the edges of the full resolution image
+    float arucoDecimate;    // Reduction of the image in which ArUco candidates are searched
+
+    // If true, the ArUco contours are fitted with the specialized quadrilateral fit (see CheckRectContour::fitQuad)
+    // instead of approxPolyDP, which stops early on the contours that are not quadrilaterals
+    bool arucoFastQuad;     // Fit the ArUco candidates with the specialized quadrilateral fit
+
+    // ArUco markers are searched in several threshold images. If true, they are searched one at a
+    // time, the most successful ones first, until every marker of the maps is found
+    bool arucoAdaptiveThres;    // Stop searching threshold images once the markers are found
+
+    // SUBPIX refines the ArUco corners with cornerSubPix. LINES fits lines to the marker contours, and HARRIS takes
+    // the maximum of the Harris response near each corner, computed once per image tile (pixel accuracy only)
+    MarkerDetector::CornerRefinementMethod arucoCornerMethod;   // ArUco corner refinement method
+
+    // ARUCO detects the markers with the vendored ArUco library, and OPENCV with the aruco module of OpenCV, with
+    // the same parameters (see arucoBackend.h). The points of a view are the same but for the corner positions
+    ArucoBackend::Type arucoBackend;    // Marker detection backend
+
+    // If true, the bits of the ArUco candidates are read from the mean grey of their cells, after a check that
+    // the border is dark, instead of an Otsu threshold of each candidate
+    bool arucoCellThreshold;    // Read the ArUco bits from the cell means
+
+    // If true, the faces of an ARUCO_BOX rig with less than half of their markers found are searched again in
+    // the image region where the box pose of the other faces projects them, at full resolution
+    bool arucoGuidedFaces;      // Search the missed box faces where the found ones predict them
+
+    // If true, the time of each ArUco detection stage and the candidate and contour counts
+    // are added up over the run, and printed once the images are detected
+    bool arucoStats;        // Print the ArUco detection statistics
+
+    // Leave at 0 to run the parallel stages of each ArUco detection on every core. In batch detection, each
+    // image is detected on a single thread, since the images are already detected in parallel
+    int arucoThreads;       // Number of threads of an ArUco detection
+
+    // Leave at "0" to search the ArUco threshold images with the default parameters. Otherwise, the file keeps
+    // the fastest threshold search that finds the markers of the sample images as the widest one does. It is
+    // written by the first run, from a sweep over a sample of the image list, and read by later runs with the
+    // same pattern and detection settings
+    string autotuneFile;    // File of the tuned ArUco detection parameters
+    int autotuneSample;     // Number of images of the list to tune on, 0 for all of them
+    double autotuneRecall;  // Fraction of the points of the widest search the tuned one must find
+
+    // Threshold window size and range of the ArUco detector, set by the autotune
+    int arucoThresParam1, arucoThresRange;
+
+    // Images wider than this are halved when they are read. Set to 0 to work at native resolution
+    int maxImageWidth;      // Maximum image width before halving
+
+    // Leave at "0" to detect every image on every run. Otherwise, batch detection results are
+    // stored in this path, and images whose content and detection settings are unchanged are not detected again
+    string detectionCachePath;  // Path at which to cache detection results
+
+    // Leave at "0" to solve every calibration. Otherwise, the results of the intrinsic and stereo solves are
+    // stored in this path, and a solve of the same correspondences with the same settings is read back instead
+    string solveCachePath;      // Path at which to cache calibration results
+
+    // Leave the path at "0" to start each calibration from scratch. Otherwise, the intrinsics of each INTRINSIC
+    // calibration are added to the history in this path under the camera name and image size, and the next
+    // calibration of that camera starts from its latest entry (see historyGuess)
+    string cameraName;          // Identifier of the calibrated camera in the history
+    string historyPath;         // Path of the calibration history
+
+    // Leave at "0" to keep the batch detection results in memory only. Otherwise, each detected image is appended
+    // to this file as it completes, and a run with the same image list and detection settings resumes after the
+    // images that the file holds. The file is synced to the disk every checkpointSync images (0 leaves it to the system)
+    string checkpointFile;  // File of the detection checkpoint
+    int checkpointSync;     // Images between syncs of the checkpoint file
+
+    // Leave the count at 0 to detect every view in this run. Otherwise, the views are split between that many
+    // runs, possibly on other machines: run k (the index) detects the views v with v % count == k, and saves their
+    // points to the shard file with "_k.bin" appended. A run with the index -1 detects nothing, and calibrates
+    // from the points of every shard file instead
+    int shardCount;         // Number of detection shards
+    int shardIndex;         // Shard detected by this run, or -1 to merge the shards
+    string shardFile;       // Prefix of the shard files
+
+    // Leave at 0 to detect every image. Otherwise, images whose sharpness (see prescreenFrame) is
+    // below this are rejected before the detection, as the pattern can not be found accurately in them
+    double minSharpness;    // Minimum sharpness of a detected image
+
+    // Leave empty to search the whole images. Otherwise, the list has the polygon of each camera (in the order
+    // of the images of a view) as x y pixel coordinates of the images as detected, after Image_MaxWidth. The
+    // detection only runs around it, and patterns out of it are dropped. An empty polygon searches the whole image
+    vector<vector<int> > roiCoords;     // Coordinates of the polygon of each camera
+    vector<vector<Point> > detectionRoi;    // Polygons of roiCoords
+
+    // Leave at 0 to let every detection finish. Otherwise, the detection of an image stops once it has
+    // taken this long, and the image is skipped as if its pattern had not been found
+    double timeBudget;      // Time budget of the detection of an image, in milliseconds
+
+    // Leave the queue depth at 0 to save each image before processing the next one. Otherwise,
+    // images are handed to background threads that encode and write them
+    int saveQueueDepth;     // Maximum number of images waiting to be written
+    int saveThreads;        // Number of threads writing images
+
+    // Leave the thumbnail width at 0 to save the images at full size. Otherwise, the detected, undistorted and
+    // rectified images are drawn at that width on contact sheets of tiles x tiles thumbnails, with an index of the
+    // sheet and tile of each image (the "sheets.yml" file next to the sheets)
+    int thumbnailWidth;     // Width of the thumbnails of the contact sheets
+    int sheetTiles;         // Thumbnails per row and column of a contact sheet
+
+    // Leave at 0 to bound the frame stream and image writer queues by their depths only. Otherwise, the
+    // frames waiting in them hold at most this size together, and the threads feeding them wait for space
+    int queueMB;            // Maximum memory (MB) of the queued frames
+
+    // Leave at 0 to read the images again to undistort or rectify them after the calibration. Otherwise,
+    // the images decoded for detection are kept in memory up to this size, releasing the least recently used
+    int frameStoreMB;       // Maximum memory (MB) of the kept images
+
+    // Leave at 0 to allocate the buffers of each frame anew. Otherwise, the large Mat buffers freed by a frame
+    // are kept, up to this size, for the next frames (see matPool)
+    int poolMB;             // Maximum memory (MB) of the kept buffers
+    bool hugePages;         // Back the kept buffers with huge pages (Linux)
+
+    // If set, the undistorted and rectified images that are saved without being shown are remapped on the
+    // OpenCL device (OpenCV 3 or later), with the maps uploaded once. Otherwise, or without a device, on the CPU
+    bool exportOpenCL;      // Remap the exported images on the OpenCL device
+
+    // Leave at 0 to export the undistorted and rectified images that are saved without being shown on the batch
+    // detection threads, or on every core without batch detection. Otherwise, on this many threads
+    int exportThreads;      // Number of threads reading, remapping and writing the exported images
+
+    // Leave at 0 to remap each undistorted or rectified image at once. Otherwise, the image is remapped in square
+    // tiles of this many pixels, in parallel, each from the part of the input its maps read (see tiledRemap)
+    int remapTileSize;      // Side of the remap tiles, in pixels
+
+    // Leave at 0 to compute the full resolution rectification maps once. Otherwise, they are not kept: each
+    // rectified image is remapped in horizontal bands of this many rows, with the maps of one band at a time
+    int rectifyBandRows;    // Rows of the rectification bands
+
+    // Leave at 0 to compute the rectification maps with the distortion model at every pixel. Otherwise, the
+    // distortion of each camera is sampled once every this many pixels, and the maps are interpolated from it
+    int rectifyTableStep;   // Input pixels between the nodes of the distortion table
+    bool cropRectified;     // Crop the rectified images to the region valid in both views
+
+    // Leave at 0 to keep the full resolution undistortion and rectification maps. Otherwise, only the map of every
+    // this many output pixels is kept, and the rest is interpolated tile by tile as the images are remapped
+    int mapGridStep;        // Output pixels between the nodes of the sparse maps
+
+    // Leave at 0 to detect the ArUco pattern on every preview frame. Otherwise, the markers are
+    // tracked from the previous frame, and fully detected every this many frames or when they are lost
+    int trackingInterval;   // Frames between full detections in PREVIEW mode
+
+    // Leave at 0 to detect every preview frame with the configured effort. Otherwise, the ArUco detection effort
+    // is lowered while the detection is slower than this frame rate, and raised again once it is well within it
+    // (see DetectionGovernor)
+    float targetFPS;        // Frame rate the preview detection should keep up with
+
+    // Leave at 0 to detect every frame of a live preview. Otherwise, a frame whose 64 pixel wide thumbnail
+    // changed by less than this mean gray level since the last detected frame is not detected, and the last
+    // detection is drawn again. The detection still runs every staticRefresh frames (0 for never)
+    float staticThreshold;  // Mean gray level change below which the scene is unchanged
+    int staticRefresh;      // Frames of an unchanged scene after which the detection runs again
+
+    // If true, the correspondences and the calibration are the same whatever the number of threads and the order
+    // the images are detected in: each image is detected without the threshold levels that found the markers of
+    // the previous images (see MarkerDetector::resetHistory), which is slower with Aruco_AdaptiveThreshold
+    bool deterministic;
+
+    // If true, the ArUco labelers only match the ids of the marker maps, so the codes of the other markers of
+    // the dictionaries are neither compared nor reported
+    bool arucoMapIdsOnly;
+
+    // If true, the ArUco detection reads a color image once for its grey image, first pyramid level and integral image
+    bool arucoFusedFirstPass;
+
+    // Leave at "0" to decode in software. Otherwise, the stream video is decoded by the hardware decoder that the
+    // FFmpeg backend of OpenCV finds (OpenCV 4.5.2 or later), and MJPEG preview cameras are read through a GStreamer
+    // pipeline with the JPEG decoder element given ("1" lets decodebin pick one), which hands out the luminance only
+    string hardwareDecode;
+
+    // If true, the ArUco detection uses the low power profile of MarkerDetector::Params::setLowPower, which overrides
+    // the threshold range, Aruco_AdaptiveThreshold, Aruco_CellThreshold, Aruco_FastQuadFit and Aruco_FusedFirstPass,
+    // and searches the candidates in pyramid level 1 at least
+    bool arucoLowPower;
+
+    // Leave at "0" to keep the detections of the run only. Otherwise, the points detected by batch detection are
+    // appended to this correspondence database (see correspondenceDB.h), under Camera_Name and the start time of
+    // the run. The image list can also be a database, to calibrate again from the views of Camera_Name in it
+    // without detecting any image: those of the sessions from CorrespondenceDB_From to CorrespondenceDB_To
+    string correspondenceDBFile;
+    string correspondenceDBFrom;    // First session of the slice, a prefix of "YYYY-MM-DD HH:MM:SS", "0" for the first one
+    string correspondenceDBTo;      // Last session of the slice, a prefix as well ("2026-06" ends with June), "0" for the last one
+
+//-----------------------------Program variables------------------------------//
+    int nImages;        // Number of images in the image list
+    Size imageSize;     // Size of each image
+    int nMarkerMaps;       // Number of marker maps read from config list
+
+//-----------------------------Multi camera settings--------------------------//
+    // In MULTI mode, the image list holds the image of each camera for each view, in camera order
+    int nCameras;           // Number of cameras in the rig
+
+//---------------------------Live Preview settings----------------------------//
+    int cameraID;           //ID for live preview camera. Generally "0" is built in webcam
+    VideoCapture capture;   //Live capture object
+
+    // With a second camera, both are previewed side by side (see runStereoPreview). Each is read on its own
+    // thread, and their frames are paired by the time they were grabbed
+    int cameraID2;          // ID of the second (right) camera, -1 for a single camera
+    VideoCapture capture2;  // Live capture object of the second camera
+    double stereoMaxSkew;   // Largest time (ms) between the grabs of a pair, 0 for no limit
+
+    // Leave at BGR to have the capture convert the frames. Otherwise, the cameras are asked for YUYV, NV12 or MJPEG
+    // frames, which are not converted: their luminance is detected, and the color image is only made to be shown
+    rawFrame::Format captureFormat;     // Pixel format asked of the preview cameras
+    Size captureSize[2];                // Frame size of each preview camera, as reported by its capture
+    Mat liveRectifyMap[2][2];   // Rectification maps of each camera for the pairs, from LiveStereo_RectifyInput
+
+    // Leave at "0" to only show the rectified pairs. Otherwise, once there are rectification maps, every pair is
+    // rectified into a ring of frames in this POSIX shared memory object ("/name"), for other processes to map
+    // (see frameRing.h)
+    string sharedMemoryName;
+    int sharedSlots;            // Frames of the ring
+
+    // Leave at "0" to always calibrate. Otherwise, STEREO mode first checks these stored extrinsics, with the
+    // intrinsic input, on the views of the image list, and only calibrates again if the RMS vertical disparity
+    // of their rectified corners is above the threshold, in pixels (see checkDrift)
+    string driftInputFilename;
+    double driftThreshold;
+    stereoCalibration driftInput;       // The stored extrinsics
+    bool useDriftInput;
+
+    // If true, drifted extrinsics are updated instead of calibrated again: R and T are refined from the stored
+    // ones, with the intrinsics fixed, and only the rectification is computed again (see runExtrinsicUpdate)
+    bool extrinsicUpdate;
+
+    // If true, the intrinsics are calibrated from the preview frames while they arrive, and saved to the
+    // intrinsic output on quit. The estimate is stable once the standard deviation of fx, fy, cx and cy
+    // is below the tolerance
+    bool incrementalCalibration;    // Calibrate the intrinsics during the live preview
+    float incrementalTolerance;     // Standard deviation (pixels) below which the estimate is stable
+
+    // Leave at 0 to draw and show the preview frames on the detection thread, at full resolution. Otherwise, they
+    // are drawn on their own thread at most this wide, so drawing and display do not slow the detection down
+    int previewWidth;       // Width at which the preview is shown
+
+    bool goodInput;         //Tracks input validity
+    bool sharedProcess;     //Another job of the process set up the threads and the buffer pool (see calibrateManifest)
+    bool frameInput;        //The frames are handed over in memory (see FrameCalibrator), without an image list. Set before reading
+    string settingsFile;    //File the settings were read from, reread by the live reload of PREVIEW (see reloadLive)
+private:
+    // Builds the polygon of each camera from its list of x y coordinates (see Detection_Roi)
+    static bool parseDetectionRoi(const vector<vector<int> > &coords, vector<vector<Point> > &polygons)
+    {
+        bool good = true;
+        polygons.assign(coords.size(), vector<Point>());
+        for (size_t c = 0; c < coords.size(); c++)
+        {
+            if (!coords[c].empty() && (coords[c].size() % 2 || coords[c].size() < 6))
+            {
+                cerr << "Invalid detection ROI of camera " << c << ": it needs the x y coordinates of at least 3 points" << endl;
+                good = false;
+                continue;
+            }
+            for (size_t k = 0; k + 1 < coords[c].size(); k += 2)
+                polygons[c].push_back(Point(coords[c][k], coords[c][k + 1]));
+        }
+        return good;
+    }
+
+    // Input variables only needed to set up settings
+    string modeInput;
+    string patternInput;
+    string cameraIDInput;
+    string cameraID2Input;
+    string pixelFormatInput;
+    string rectifyInputFilename;
+    string solverInput;
+    string robustLossInput;
+    string cornerMethodInput;
+    string backendInput;
+};
+
+static void read(const FileNode& node, Settings& x, const Settings& default_value = Settings())
+{
+    if(node.empty())
+        x = default_value;
+    else
+        x.read(node);
+}
+
+// Decodes the upcoming images of an image list on background threads, so the next image
+// is ready by the time the detection of the current one finishes
+class ImageLoader
+{
+public:
+    ImageLoader() : settings(NULL), next(0), toLoad(0), depth(1), flags(CV_LOAD_IMAGE_COLOR), stop(false) {}
+    ~ImageLoader() { close(); }
+
+    // Starts decoding the images of the list, keeping at most queueDepth images ahead of read()
+    // The images are decoded with the imread flags (CV_LOAD_IMAGE_GRAYSCALE if color is not needed)
+    void open(const Settings &s, int queueDepth, int nThreads, int readFlags = CV_LOAD_IMAGE_COLOR)
+    {
+        close();
+        settings = &s;
+        flags = readFlags;
+        depth = max(1, queueDepth);
+        next = toLoad = 0;
+        stop = false;
+        for (int t = 0; t < nThreads; t++)
+            workers.push_back(thread(&ImageLoader::work, this));
+    }
+
+    // Returns the next image of the list in order. An empty Mat marks the end of the list
+    Mat read()
+    {
+        unique_lock<mutex> lock(m);
+        if (next >= (int)settings->imageList.size())
+            return Mat();
+        loadedCond.wait(lock, [this]{ return loaded.count(next) > 0; });
+        Mat img = loaded[next];
+        loaded.erase(next++);
+        spaceCond.notify_all();
+        return img;
+    }
+
+    // Stops the decoding threads and releases the images that were not read
+    void close()
+    {
+        {
+            lock_guard<mutex> lock(m);
+            stop = true;
+        }
+        spaceCond.notify_all();
+        for (auto &w:workers) w.join();
+        workers.clear();
+        loaded.clear();
+    }
+
+    bool isOpened() const { return !workers.empty(); }
+
+private:
+    void work()
+    {
+        threadAffinity::pinIO();
+        unique_lock<mutex> lock(m);
+        for (;;)
+        {
+            spaceCond.wait(lock, [this]{
+                return stop || (toLoad < (int)settings->imageList.size() && toLoad < next + depth); });
+            if (stop)
+                return;
+            int index = toLoad++;
+            lock.unlock();
+            Mat img = settings->readListImage(index, flags);
+            lock.lock();
+            loaded[index] = img;
+            loadedCond.notify_all();
+        }
+    }
+
+    const Settings *settings;   // settings with the image list, which must outlive the loader
+    vector<thread> workers;
+    map<int, Mat> loaded;   // decoded images waiting to be read, by list index
+    int next;               // index of the next image to be read
+    int toLoad;             // index of the next image to be decoded
+    int depth;
+    int flags;              // imread flags of the images
+    bool stop;
+    mutex m;
+    condition_variable loadedCond, spaceCond;
+};
+
+// Decodes a video file or the images of a glob pattern on a background thread, so detection starts
+// with the first frame. Only every streamStride-th frame is considered, and it is skipped if it changed
+// by less than streamMinMotion since the last kept frame (a still camera gives the same view)
+class FrameStream
+{
+public:
+    FrameStream() : settings(NULL), flags(CV_LOAD_IMAGE_COLOR) {}
+    ~FrameStream() { close(); }
+
+    // Opens the stream input of the settings, keeping at most queueDepth frames ahead of read(), and
+    // their memory within the budget if there is one. The frames are converted like imread with the flags.
+    // Returns false if there is nothing to stream
+    bool open(const Settings &s, int queueDepth, int readFlags = CV_LOAD_IMAGE_COLOR, memoryBudget *budget = NULL)
+    {
+        close();
+        settings = &s;
+        flags = readFlags;
+        queue.reset(new spscQueue<pair<string, Mat> >(max(1, queueDepth), budget));
+        files.clear();
+        const string &input = s.streamInput;
+        if (listImageFiles(input, files))
+        {
+            if (files.empty())
+                return false;
+        }
+        else if (!s.openStreamVideo(video))
+            return false;
+        worker = thread(&FrameStream::work, this);
+        return true;
+    }
+
+    // Returns the next kept frame and its name: the image file, or the video file and frame number.
+    // An empty Mat marks the end of the stream
+    Mat read(string &name)
+    {
+        pair<string, Mat> frame;
+        if (!queue || !queue->pop(frame))
+            return Mat();
+        name = frame.first;
+        return frame.second;
+    }
+
+    // Stops the decoding thread and releases the frames that were not read
+    void close()
+    {
+        if (queue) queue->close();
+        if (worker.joinable()) worker.join();
+        video.release();
+        pair<string, Mat> frame;
+        while (queue && queue->pop(frame)) {}
+    }
+
+    bool isOpened() const { return worker.joinable(); }
+
+    // Occupancy of the frame queue, kept after close for the run report
+    queueStats stats() const { return queue ? queue->stats() : queueStats(); }
+
+private:
+    void work()
+    {
+        threadAffinity::pinIO();
+        Mat last;       // Thumbnail of the last kept frame
+        for (int n = 0;; n++)
+        {
+            // Skipped frames are not converted, or not even read from a pattern
+            Mat img;
+            string name;
+            bool skip = n % settings->streamStride != 0;
+            if (files.empty())
+            {
+                if (!video.grab())
+                    break;
+                if (skip)
+                    continue;
+                video.retrieve(img);
+                if (flags == CV_LOAD_IMAGE_GRAYSCALE && img.channels() == 3)
+                    cvtColor(img, img, CV_BGR2GRAY);
+                settings->limitImageWidth(img);
+                stringstream ss;
+                ss << settings->streamInput << "#" << n;
+                name = ss.str();
+            }
+            else
+            {
+                if (n >= (int)files.size())
+                    break;
+                if (skip)
+                    continue;
+                name = files[n];
+                img = settings->readImage(name, flags);
+                if (!img.data)
+                {
+                    fprintf(stderr, "Could not read image: %s\n", name.c_str());
+                    continue;
+                }
+            }
+            if (settings->streamMinMotion > 0 && !moved(img, last))
+                continue;
+
+            if (!queue->push(make_pair(name, img), img.total()*img.elemSize()))
+                return;             // Closed by close()
+        }
+        queue->close();             // The frames left are still read
+    }
+
+    // Compares 64 pixel wide grayscale thumbnails, replacing the last one if the frame moved enough
+    bool moved(const Mat &img, Mat &last) const
+    {
+        Mat thumb, gray, diff;
+        resize(img, thumb, Size(64, max(1, img.rows*64/img.cols)), 0, 0, INTER_AREA);
+        if (thumb.channels() == 3) cvtColor(thumb, gray, CV_BGR2GRAY);
+        else gray = thumb;
+        if (last.data && last.size() == gray.size())
+        {
+            absdiff(gray, last, diff);
+            if (mean(diff)[0] < settings->streamMinMotion)
+                return false;
+        }
+        last = gray;
+        return true;
+    }
+
+    const Settings *settings;   // settings with the stream input, which must outlive the stream
+    VideoCapture video;
+    vector<string> files;       // images of the pattern, or empty for a video
+    thread worker;
+    unique_ptr<spscQueue<pair<string, Mat> > > queue;  // kept frames waiting to be read, with their names. The
+                                                        // worker closes it at the end of the stream
+    int flags;                  // imread flags of the frames
+};
+
+// Skips the detection of live preview frames while a still camera sees an unchanged scene (see
+// Preview_StaticThreshold). Each frame is compared with the last detected one by the mean gray level change of
+// their 64 pixel wide thumbnails, from the gray image that the detection would convert anyway, and an unchanged
+// frame is drawn with the overlay of the last detection. The scene is detected again once it changed, or after
+// Preview_StaticRefresh unchanged frames, so a slow drift or a missed change does not last
+class StaticScene
+{
+public:
+    // Whether the detection of the frame can be skipped
+    bool unchanged(const Settings &s, imageFrame &frame)
+    {
+        if (s.staticThreshold <= 0)
+            return false;
+        const Mat &gray = frame.gray();
+        Mat thumb, diff;
+        resize(gray, thumb, Size(64, max(1, gray.rows*64/gray.cols)), 0, 0, INTER_AREA);
+        if (last.data && last.size() == thumb.size() && (s.staticRefresh <= 0 || skipped < s.staticRefresh))
+        {
+            absdiff(thumb, last, diff);
+            if (mean(diff)[0] < s.staticThreshold)
+            {
+                skipped++;
+                nSkipped++;
+                return true;
+            }
+        }
+        last = thumb;
+        skipped = 0;
+        return false;
+    }
+
+    // Keeps the overlay of a detected frame, drawn again on the unchanged frames
+    void detected(const patternOverlay &o) { overlay = o; }
+
+    const patternOverlay &lastOverlay() const { return overlay; }
+    int skippedFrames() const { return nSkipped; }
+
+private:
+    Mat last;                   // Thumbnail of the last detected frame
+    patternOverlay overlay;     // Its detection
+    int skipped = 0;            // Unchanged frames since it was detected
+    int nSkipped = 0;           // Frames whose detection was skipped
+};
+
+// Reads the live capture on its own thread, keeping only the latest frame. Detection always gets the
+// freshest frame, so when it is slower than the camera the frames are dropped instead of queued, and the
+// latency stays within one frame. Frames are handed over without a copy: the capture thread reads into
+// a spare buffer, which is swapped with the latest frame, and buffers of dropped frames are reused
+class CaptureThread
+{
+public:
+    CaptureThread() : capture(NULL), fresh(false), done(false), stop(false) {}
+    ~CaptureThread() { close(); }
+
+    void open(VideoCapture &cap)
+    {
+        close();
+        capture = &cap;
+        fresh = done = stop = false;
+        worker = thread(&CaptureThread::work, this);
+    }
+
+    // Waits for a frame newer than the last one read. An empty Mat marks the end of the capture
+    Mat read()
+    {
+        unique_lock<mutex> lock(m);
+        freshCond.wait(lock, [this]{ return fresh || done; });
+        if (!fresh)
+            return Mat();
+        fresh = false;
+        return latest;      // The capture thread no longer writes to this buffer
+    }
+
+    void close()
+    {
+        {
+            lock_guard<mutex> lock(m);
+            stop = true;
+        }
+        if (worker.joinable()) worker.join();
+        latest.release();
+    }
+
+    bool isOpened() const { return worker.joinable(); }
+
+private:
+    void work()
+    {
+        Mat spare;      // Buffer that no one else references
+        for (;;)
+        {
+            Mat frame = spare;
+            spare.release();
+            if (!capture->read(frame) || !frame.data)
+                break;
+            lock_guard<mutex> lock(m);
+            if (stop)
+                return;
+            if (fresh)
+                spare = latest;     // Dropped without being read, so it can be reused
+            latest = frame;
+            fresh = true;
+            freshCond.notify_all();
+        }
+        lock_guard<mutex> lock(m);
+        done = true;
+        freshCond.notify_all();
+    }
+
+    VideoCapture *capture;      // capture opened by the settings, which must outlive the thread
+    thread worker;
+    Mat latest;                 // latest frame, unread if fresh
+    bool fresh;
+    bool done;                  // the capture ended
+    bool stop;
+    mutex m;
+    condition_variable freshCond;
+};
+
+// Reads two live captures, each on its own thread, and pairs their frames by the time they were grabbed. Each
+// thread keeps its last few frames. A pair is the newest frame of the camera that is behind, with the frame of
+// the other camera grabbed nearest to it, so two cameras at slightly different rates still give matching pairs.
+// Pairs grabbed further apart than the maximum skew are dropped
+class StereoCapture
+{
+public:
+    StereoCapture() : maxSkewMs(0), nDropped(0), stop(false) {}
+    ~StereoCapture() { close(); }
+
+    void open(VideoCapture &left, VideoCapture &right, double maxSkew)
+    {
+        close();
+        maxSkewMs = maxSkew;
+        nDropped = 0;
+        stop = false;
+        VideoCapture *caps[2] = { &left, &right };
+        for (int k = 0; k < 2; k++)
+        {
+            cams[k].capture = caps[k];
+            cams[k].recent.clear();
+            cams[k].done = false;
+            cams[k].lastTicks = 0;
+        }
+        for (int k = 0; k < 2; k++)
+            cams[k].worker = thread(&StereoCapture::work, this, k);
+    }
+
+    // Waits for a pair newer than the last one read. Returns false at the end of either capture. ticks is set to
+    // the tick count of the first grab of the pair
+    bool read(Mat &left, Mat &right, double &skewMs, int64 *ticks = NULL)
+    {
+        unique_lock<mutex> lock(m);
+        for (;;)
+        {
+            cond.wait(lock, [this]{ return stop || cams[0].done || cams[1].done || (fresh(0) && fresh(1)); });
+            if (!fresh(0) || !fresh(1))
+                return false;
+            int behind = cams[0].recent.back().ticks <= cams[1].recent.back().ticks ? 0 : 1, ahead = 1 - behind;
+            const stamped &a = cams[behind].recent.back();
+            const stamped *b = NULL;
+            for (auto &f:cams[ahead].recent)
+                if (f.ticks > cams[ahead].lastTicks && (!b || llabs(f.ticks - a.ticks) < llabs(b->ticks - a.ticks)))
+                    b = &f;
+            skewMs = 1000.*llabs(a.ticks - b->ticks)/getTickFrequency();
+            cams[behind].lastTicks = a.ticks;
+            cams[ahead].lastTicks = b->ticks;
+            if (maxSkewMs > 0 && skewMs > maxSkewMs)
+            {
+                nDropped++;
+                continue;
+            }
+            (behind == 0 ? left : right) = a.img;
+            (behind == 0 ? right : left) = b->img;
+            if (ticks)
+                *ticks = min(a.ticks, b->ticks);
+            return true;
+        }
+    }
+
+    void close()
+    {
+        {
+            lock_guard<mutex> lock(m);
+            stop = true;
+        }
+        for (auto &c:cams)
+        {
+            if (c.worker.joinable()) c.worker.join();
+            c.recent.clear();
+        }
+    }
+
+    bool isOpened() const { return cams[0].worker.joinable(); }
+    // Pairs dropped for their skew
+    int dropped() const { return nDropped; }
+
+private:
+    static const int historyFrames = 4;
+
+    struct stamped {
+        int64 ticks;
+        Mat img;
+    };
+    struct camera {
+        VideoCapture *capture = NULL;  // capture opened by the settings, which must outlive the thread
+        thread worker;
+        deque<stamped> recent;          // last frames, oldest first
+        int64 lastTicks = 0;            // grab time of the frame of the last pair read
+        bool done = false;              // the capture ended
+    };
+
+    bool fresh(int k) const { return !cams[k].recent.empty() && cams[k].recent.back().ticks > cams[k].lastTicks; }
+
+    void work(int k)
+    {
+        camera &c = cams[k];
+        for (;;)
+        {
+            // The frame is stamped when it is grabbed, before the slower decoding of retrieve
+            stamped f;
+            if (!c.capture->grab())
+                break;
+            f.ticks = getTickCount();
+            if (!c.capture->retrieve(f.img) || !f.img.data)
+                break;
+            lock_guard<mutex> lock(m);
+            if (stop)
+                return;
+            c.recent.push_back(f);      // A new buffer each time, since the frames read may still be in use
+            if ((int)c.recent.size() > historyFrames)
+                c.recent.pop_front();
+            cond.notify_all();
+        }
+        lock_guard<mutex> lock(m);
+        c.done = true;
+        cond.notify_all();
+    }
+
+    camera cams[2];
+    double maxSkewMs;
+    int nDropped;
+    bool stop;
+    mutex m;
+    condition_variable cond;
+};
+
+// Encodes and writes images on background threads, so the processing loops do not wait
+// for the encoder. write() only blocks when queueDepth images are already waiting, or when the
+// waiting images hold the memory budget
+// With contact sheets, each image is drawn as a thumbnail on a sheet of tiles instead (see SavedImages_ThumbnailWidth)
+class ImageWriter
+{
+public:
+    ImageWriter() : thumbWidth(0), sheetTiles(0) {}
+    ~ImageWriter() { close(); }
+
+    // Sets the format of the images and starts the writing threads. With a queue depth of 0,
+    // images are written by write() itself. With a thumbnail width above 0, the images are drawn at that
+    // width on contact sheets of tiles x tiles thumbnails
+    void open(const string &format, int queueDepth, int nThreads, memoryBudget *budget = NULL, int thumbnailWidth = 0,
+              int tiles = 0)
+    {
+        close();
+        thumbWidth = thumbnailWidth;
+        sheetTiles = tiles;
+        extension = format;
+        params.clear();
+        if (format == "webp")           // A quality above 100 selects lossless WebP
+        {
+            params.push_back(CV_IMWRITE_WEBP_QUALITY);
+            params.push_back(101);
+        }
+        else if (format == "png")       // Fast compression, these are only debug outputs
+        {
+            params.push_back(CV_IMWRITE_PNG_COMPRESSION);
+            params.push_back(1);
+        }
+        queue.reset();
+        if (queueDepth > 0)
+        {
+            queue.reset(new mpmcQueue<pair<string, Mat> >(queueDepth, budget));
+            for (int t = 0; t < nThreads; t++)
+                workers.push_back(thread(&ImageWriter::work, this));
+        }
+    }
+
+    // Writes an image to name + the format extension. The image data must not be modified
+    // afterwards, as it is only referenced until it has been written
+    void write(const string &name, const Mat &img)
+    {
+        if (thumbWidth > 0)
+            addThumbnail(name, img);
+        else
+            writeFile(name + "." + extension, img);
+    }
+
+    // Writes the contact sheets that are not full and their index files, then the queued images, and stops the
+    // writing threads
+    void close()
+    {
+        flushSheets();
+        if (queue) queue->close();
+        for (auto &w:workers) w.join();
+        workers.clear();
+    }
+
+    // Occupancy of the queue of images to write, kept after close for the run report
+    queueStats stats() const { return queue ? queue->stats() : queueStats(); }
+
+private:
+    void work()
+    {
+        threadAffinity::pinIO();
+        pair<string, Mat> item;
+        while (queue->pop(item))
+        {
+            pipelineTrace::scope trace("encode");
+            imwrite(item.first, item.second, params);
+        }
+    }
+
+    void writeFile(const string &filename, const Mat &img)
+    {
+        if (workers.empty())
+        {
+            pipelineTrace::scope trace("encode");
+            imwrite(filename, img, params);
+            return;
+        }
+        queue->push(make_pair(filename, img), img.total()*img.elemSize());
+    }
+
+    // The contact sheets of the images whose names only differ by their number (such as detected_12), which
+    // is their place on the sheets, so the sheets do not depend on the order the images are written in
+    struct sheetGroup {
+        Size tile;                  // size of the tiles, from the aspect ratio of the first image
+        map<int, Mat> sheets;       // sheets being drawn, by number
+        map<int, int> drawn;        // thumbnails drawn on each of them
+        map<int, Rect> places;      // place of each image number on its sheet, for the index
+    };
+
+    string sheetName(const string &prefix, int sheet) const
+    {
+        char name[32];
+        sprintf(name, "sheet_%d.", sheet);
+        return prefix + name + extension;
+    }
+
+    // Draws an image at the thumbnail width, with its number, on the tile of its number
+    void addThumbnail(const string &name, const Mat &img)
+    {
+        size_t digits = name.find_last_not_of("0123456789") + 1;
+        string prefix = name.substr(0, digits);
+        int number = digits < name.size() ? atoi(name.c_str() + digits) : 0;
+        int perSheet = sheetTiles*sheetTiles;
+
+        Mat thumb;
+        {
+            pipelineTrace::scope trace("thumbnail");
+            double scale = (double)thumbWidth/img.cols;
+            resize(img, thumb, Size(thumbWidth, max(1, cvRound(img.rows*scale))), 0, 0, INTER_AREA);
+            if (thumb.channels() == 1)
+                cvtColor(thumb, thumb, COLOR_GRAY2BGR);
+            string label = name.substr(name.find_last_of("/\\") + 1);
+            putText(thumb, label, Point(4, 14), FONT_HERSHEY_SIMPLEX, .4, Scalar(0, 0, 0), 3);
+            putText(thumb, label, Point(4, 14), FONT_HERSHEY_SIMPLEX, .4, Scalar(255, 255, 255), 1);
+        }
+
+        Mat full;
+        string fullName;
+        {
+            lock_guard<mutex> lock(sheetMutex);
+            sheetGroup &g = groups[prefix];
+            if (g.tile.area() == 0)
+                g.tile = thumb.size();
+            int sheet = number/perSheet, slot = number % perSheet;
+            Mat &canvas = g.sheets[sheet];
+            if (canvas.empty())
+                canvas = Mat::zeros(g.tile.height*sheetTiles, g.tile.width*sheetTiles, CV_8UC3);
+            // Images of another aspect ratio are cropped to the tile
+            Rect place(slot % sheetTiles * g.tile.width, slot / sheetTiles * g.tile.height,
+                       min(thumb.cols, g.tile.width), min(thumb.rows, g.tile.height));
+            thumb(Rect(Point(0, 0), place.size())).copyTo(canvas(place));
+            g.places[number] = place;
+            if (++g.drawn[sheet] == perSheet)
+            {
+                full = canvas;
+                fullName = sheetName(prefix, sheet);
+                g.sheets.erase(sheet);
+            }
+        }
+        if (full.data)
+            writeFile(fullName, full);
+    }
+
+    // Writes the sheets that are not full, and the index of each group: the sheet and tile of each image
+    void flushSheets()
+    {
+        lock_guard<mutex> lock(sheetMutex);
+        int perSheet = sheetTiles*sheetTiles;
+        for (auto &entry:groups)
+        {
+            sheetGroup &g = entry.second;
+            for (auto &sheet:g.sheets)
+                writeFile(sheetName(entry.first, sheet.first), sheet.second);
+            g.sheets.clear();
+            FileStorage fs(entry.first + "sheets.yml", FileStorage::WRITE);
+            if (!fs.isOpened())
+                continue;
+            fs << "Images" << "[";
+            for (auto &p:g.places)
+            {
+                string sheet = sheetName(entry.first, p.first/perSheet);
+                fs << "{" << "Number" << p.first << "Sheet" << sheet.substr(sheet.find_last_of("/\\") + 1)
+                   << "Tile" << p.second << "}";
+            }
+            fs << "]";
+        }
+        groups.clear();
+    }
+
+    string extension;
+    vector<int> params;     // imwrite parameters of the format
+    vector<thread> workers;
+    unique_ptr<mpmcQueue<pair<string, Mat> > > queue;  // images waiting to be written, with their filename
+    int thumbWidth;         // width of the thumbnails of the contact sheets, 0 to write the images
+    int sheetTiles;         // thumbnails per row and column of a sheet
+    mutex sheetMutex;
+    map<string, sheetGroup> groups;     // contact sheets by the names of their images without the number
+};
+
+// Uncomment write() if you want to save your settings, using code like this:
+        // FileStorage fs("settingsOutput.yml", FileStorage::WRITE);
+        // fs << "Settings" << s;
+
+// static void write(FileStorage& fs, const string&, const Settings& x)
+// {
+//     x.write(fs);
+// }
+
+
+// Keeps the images decoded for detection, so the undistortion and rectification stages do not decode
+// them again. Once the memory cap is reached, the least recently used images are released, and those
+// are read again by take(). Thread safe
+class FrameStore
+{
+public:
+    FrameStore() : capacity(0), used(0) {}
+
+    // Keeps at most maxBytes of images. 0 disables the store
+    void open(size_t maxBytes)
+    {
+        lock_guard<mutex> lock(m);
+        capacity = maxBytes;
+        clear();
+    }
+    bool isOpened() const { return capacity > 0; }
+
+    // Keeps the image of a list index. If copy is false, the image data must not be modified afterwards
+    void put(int index, const Mat &img, bool copy)
+    {
+        size_t bytes = img.total() * img.elemSize();
+        if (!img.data || bytes > capacity)
+            return;
+        lock_guard<mutex> lock(m);
+        erase(index);
+        while (used + bytes > capacity)
+            erase(order.back());
+        order.push_front(index);
+        frames[index] = make_pair(copy ? img.clone() : img, order.begin());
+        used += bytes;
+    }
+
+    // Releases and returns the image of a list index, converted to grayscale with CV_LOAD_IMAGE_GRAYSCALE.
+    // Returns an empty Mat if it is not kept, or if color is requested and it was kept in grayscale
+    Mat take(int index, int flags)
+    {
+        Mat img;
+        {
+            lock_guard<mutex> lock(m);
+            auto it = frames.find(index);
+            if (it == frames.end())
+                return Mat();
+            img = it->second.first;
+            erase(index);
+        }
+        if (flags == CV_LOAD_IMAGE_GRAYSCALE && img.channels() != 1)
+        {
+            Mat gray;
+            cvtColor(img, gray, COLOR_BGR2GRAY);
+            return gray;
+        }
+        if (flags != CV_LOAD_IMAGE_GRAYSCALE && img.channels() == 1)
+            return Mat();
+        return img;
+    }
+
+    // Releases every image
+    void close()
+    {
+        lock_guard<mutex> lock(m);
+        clear();
+    }
+
+private:
+    void erase(int index)
+    {
+        auto it = frames.find(index);
+        if (it == frames.end())
+            return;
+        used -= it->second.first.total() * it->second.first.elemSize();
+        order.erase(it->second.second);
+        frames.erase(it);
+    }
+    void clear()
+    {
+        frames.clear();
+        order.clear();
+        used = 0;
+    }
+
+    size_t capacity, used;  // maximum and current bytes of the kept images
+    list<int> order;        // list indices of the kept images, the most recently used first
+    map<int, pair<Mat, list<int>::iterator> > frames;   // kept images by list index
+    mutex m;
+};
+
+// Traces the stages of the ArUco detector (see MarkerDetector::traceHook), within the stage of their image
+static void traceArucoStage(const char *stage, int level, bool begin)
+{
+    if (begin)
+        pipelineTrace::begin(stage, -1, level);
+    else
+        pipelineTrace::end();
+}
+
+// Report of a run, written next to the calibration output (see the Save_RunReport setting): the detection time,
+// point count and status of each image, the wall and CPU time of each stage, the solver iterations, the peak
+// memory and the detection throughput. Builds that count allocations (see allocStats) add those of each stage
+// and image. The results of an image are stored at its list index, so images can be reported from several
+// threads once open has sized the list
+class runReport
+{
+public:
+    // Times a stage of the run from its construction to its destruction. The CPU time is that of the
+    // whole process, so it is above the wall time when the stage runs on several threads
+    class stage
+    {
+    public:
+        stage(runReport &r, const char *n) : report(r), name(n), ticks(getTickCount()), cpu(clock()),
+                                             allocs(allocStats::process()), trace(n) {}
+        ~stage()
+        {
+            report.addStage(name, elapsedMs(ticks), 1000.*(clock() - cpu)/CLOCKS_PER_SEC, allocStats::process() - allocs);
+        }
+    private:
+        runReport &report;
+        const char *name;
+        int64 ticks;
+        clock_t cpu;
+        allocCounts allocs;             // Of every thread, like the CPU time
+        pipelineTrace::scope trace;     // The stages are traced too (see Save_Trace)
+    };
+
+    runReport() : opened(false), startTicks(0), startCpu(0), hasRectification(false), hasDrift(false),
+                  hasCapture(false) {}
+
+    // Starts the report of a run, if the settings ask for one, and its trace
+    void open(const Settings &s)
+    {
+        if (s.saveTrace)
+        {
+            pipelineTrace::open();
+            MarkerDetector::traceHook = traceArucoStage;
+        }
+        opened = s.saveRunReport;
+        images.assign(s.nImages, image());
+        stages.clear();
+        solvers.clear();
+        queues.clear();
+        hasRectification = false;
+        hasDrift = false;
+        hasCapture = false;
+        startTicks = getTickCount();
+        startCpu = clock();
+    }
+    bool isOpened() const { return opened; }
+
+    // Records the detection of a list image, with 0 points if the pattern was not found or the image
+    // could not be read. Streamed images extend the list, which is not thread safe
+    void detected(int index, const string &name, double ms, int points, bool cached, bool readable = true)
+    {
+        if (!opened || index < 0)
+            return;
+        if (index >= (int)images.size())
+            images.resize(index + 1);
+        image &img = images[index];
+        img.name = name;
+        img.ms = ms;
+        img.points = points;
+        img.cached = cached;
+        img.status = !readable ? "unreadable" : points > 0 ? "accepted" : "pattern not found";
+    }
+
+    // Records the allocations of an image, on the thread that detected it
+    void allocated(int index, const allocCounts &allocs)
+    {
+        if (opened && index >= 0 && index < (int)images.size())
+            images[index].allocs = allocs;
+    }
+
+    // Records why an image was rejected before its detection (see prescreenFrame)
+    void skipped(int index, const string &reason)
+    {
+        if (opened && index >= 0 && index < (int)images.size())
+            images[index].status = reason;
+    }
+
+    // Records why an image whose pattern was found is not used by the calibration
+    void reject(int index, const char *reason)
+    {
+        if (opened && index >= 0 && index < (int)images.size() && images[index].points > 0)
+            images[index].status = reason;
+    }
+
+    // Rejects the images of the views of a calibration struct that have been cleared since had was taken
+    // (see viewsWithPoints). camera is the index of the struct's images in each view of nViews images
+    void rejectCleared(const intrinsicCalibration &inCal, const vector<bool> &had, int camera, int nViews,
+                       const char *reason)
+    {
+        for (size_t v = 0; v < had.size() && v < inCal.objectPoints.size(); v++)
+            if (had[v] && inCal.objectPoints[v].empty())
+                reject(v < inCal.imageIndex.size() ? inCal.imageIndex[v] : (int)v*nViews + camera, reason);
+    }
+    static vector<bool> viewsWithPoints(const intrinsicCalibration &inCal)
+    {
+        vector<bool> had(inCal.objectPoints.size());
+        for (size_t v = 0; v < had.size(); v++) had[v] = !inCal.objectPoints[v].empty();
+        return had;
+    }
+
+    void addStage(const char *name, double wallMs, double cpuMs, const allocCounts &allocs = allocCounts())
+    {
+        if (!opened)
+            return;
+        lock_guard<mutex> lock(m);
+        stages.push_back(stageTime(name, wallMs, cpuMs, allocs));
+    }
+
+    // Records the solves of a solver and their Levenberg-Marquardt iterations (-1 if the solver does not report them)
+    void addSolver(const string &name, int solves, int iterations)
+    {
+        if (!opened)
+            return;
+        lock_guard<mutex> lock(m);
+        solverStats st = { name, solves, iterations };
+        solvers.push_back(st);
+    }
+
+    // Records the occupancy of a queue between the pipeline threads (see stageQueue.h). A queue that is
+    // recorded again replaces its earlier record
+    void addQueue(const string &name, const queueStats &st)
+    {
+        if (!opened || st.capacity == 0)
+            return;
+        lock_guard<mutex> lock(m);
+        for (auto &q:queues)
+            if (q.first == name)
+            {
+                q.second = st;
+                return;
+            }
+        queues.push_back(make_pair(name, st));
+    }
+
+    // Records the statistics of the views accepted during a capture (see captureStats)
+    void captured(const captureStats &st)
+    {
+        if (!opened)
+            return;
+        lock_guard<mutex> lock(m);
+        capture = st;
+        hasCapture = true;
+    }
+
+    // Records the rectification check of a stereo calibration
+    void rectified(const rectificationCheck &q)
+    {
+        if (!opened)
+            return;
+        lock_guard<mutex> lock(m);
+        rectification = q;
+        hasRectification = true;
+    }
+
+    // Records the drift check of a stereo calibration
+    void drifted(const driftCheck &d)
+    {
+        if (!opened)
+            return;
+        lock_guard<mutex> lock(m);
+        drift = d;
+        hasDrift = true;
+    }
+
+    // Writes the report. The detection throughput is the number of images over the wall time of the
+    // detection stage. Returns false if the report could not be written
+    bool write(const Settings &s)
+    {
+        if (pipelineTrace::isOpened())
+        {
+            MarkerDetector::traceHook = NULL;
+            if (pipelineTrace::write(s.traceFilename()))
+                printf("\nTrace written to %s\n", s.traceFilename().c_str());
+            else
+                cerr << "Could not write the trace: " << s.traceFilename() << endl;
+        }
+        if (!opened)
+            return true;
+        opened = false;
+        const char *modes[] = { "INTRINSIC", "STEREO", "MULTI", "PREVIEW" };
+        const char *patterns[] = { "CHESSBOARD", "ARUCO_SINGLE", "ARUCO_BOX", "CHARUCO", "ARUCO_BOARDS" };
+        FileStorage fs(s.runReportFilename(), FileStorage::WRITE);
+        if (!fs.isOpened())
+        {
+            cerr << "Could not write the run report: " << s.runReportFilename() << endl;
+            return false;
+        }
+
+        int nDetected = 0, nAccepted = 0;
+        for (auto &img:images)
+        {
+            nDetected += img.name.empty() ? 0 : 1;
+            nAccepted += img.status == "accepted" ? 1 : 0;
+        }
+        double detectionMs = 0;
+        for (auto &st:stages)
+            if (st.name == "Detection") detectionMs += st.wallMs;
+        time_t t = time(NULL);
+        char date[64];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+
+        fs << "Date" << date;
+        fs << "Mode" << modes[s.mode];
+        fs << "Calibration_Pattern" << patterns[s.calibrationPattern];
+        fs << "Image_Width" << s.imageSize.width;
+        fs << "Image_Height" << s.imageSize.height;
+        fs << "Images" << nDetected;
+        fs << "Images_Accepted" << nAccepted;
+        fs << "Detection_Throughput" << (detectionMs > 0 ? 1000.*nDetected/detectionMs : 0.);   // images per second
+        fs << "Total_WallTime" << elapsedMs(startTicks);
+        fs << "Total_CpuTime" << 1000.*(clock() - startCpu)/CLOCKS_PER_SEC;
+        fs << "Peak_RSS_MB" << peakRssMB();
+        bool allocs = allocStats::isEnabled();
+        if (allocs)
+            fs << "Peak_Heap_MB" << allocStats::peakBytes()/1048576.;
+        if (s.poolMB > 0)
+        {
+            long long hits, misses;
+            matPool::stats(hits, misses);
+            fs << "Mat_Pool_Hits" << (double)hits << "Mat_Pool_Misses" << (double)misses;
+        }
+
+        // Times are in milliseconds
+        fs << "Stages" << "[";
+        for (auto &st:stages)
+        {
+            fs << "{" << "Name" << st.name << "Wall_ms" << st.wallMs << "Cpu_ms" << st.cpuMs;
+            if (allocs)
+                fs << "Allocations" << (double)st.allocs.allocations << "Allocated_MB" << st.allocs.bytes/1048576.
+                   << "Mat_Allocations" << (double)st.allocs.matAllocations << "Mat_Allocated_MB" << st.allocs.matBytes/1048576.;
+            fs << "}";
+        }
+        fs << "]";
+        fs << "Solvers" << "[";
+        for (auto &st:solvers)
+            fs << "{" << "Name" << st.name << "Solves" << st.solves << "Iterations" << st.iterations << "}";
+        fs << "]";
+        // The wait times add up those of every thread on the queue
+        // In pixels, on the shared corners of each stereo view (see checkRectification)
+        if (hasRectification)
+        {
+            const rectificationCheck &q = rectification;
+            fs << "Rectification" << "{" << "Points" << q.points << "Mean_VerticalError" << q.meanDy
+               << "Rms_VerticalError" << q.rmsDy << "Max_VerticalError" << q.maxDy << "Mean_EpipolarError" << q.epipolar
+               << "Accepted" << (int)q.accepted << "Views" << "[";
+            for (auto &v:q.views)
+                fs << "{" << "View" << v.index << "Points" << v.points << "Mean_VerticalError" << v.meanDy
+                   << "Rms_VerticalError" << v.rmsDy << "Max_VerticalError" << v.maxDy
+                   << "Mean_EpipolarError" << v.epipolar << "}";
+            fs << "]" << "}";
+        }
+        // Of the stored extrinsics, checked before calibrating again (see checkDrift)
+        if (hasDrift)
+        {
+            const driftCheck &d = drift;
+            fs << "Drift" << "{" << "Points" << d.rectification.points
+               << "Rms_VerticalError" << d.rectification.rmsDy << "Max_VerticalError" << d.rectification.maxDy
+               << "Mean_EpipolarError" << d.rectification.epipolar << "Pose_Views" << d.views
+               << "Rotation_Degrees" << d.rotation << "Translation" << d.translation
+               << "Translation_Ratio" << d.translationRatio << "Recalibrated" << (int)d.recalibrate << "}";
+        }
+        // The errors are in pixels, each against the estimate when its view was accepted
+        if (hasCapture)
+        {
+            const captureStats &c = capture;
+            fs << "Capture" << "{" << "Views" << c.views << "Scored_Views" << c.scored << "Mean_ViewError" << c.errMean
+               << "StdDev_ViewError" << c.errStdDev() << "Coverage" << c.covered() << "Pose_Bins" << c.poses << "}";
+        }
+        fs << "Queues" << "[";
+        for (auto &q:queues)
+            fs << "{" << "Name" << q.first << "Capacity" << (int)q.second.capacity << "Pushes" << (double)q.second.pushes
+               << "Max_Items" << (int)q.second.maxItems << "Mean_Items" << q.second.meanItems
+               << "Max_MB" << q.second.maxBytes/1048576. << "Push_Wait_ms" << q.second.pushWaitMs
+               << "Pop_Wait_ms" << q.second.popWaitMs << "}";
+        fs << "]";
+        fs << "Image_Results" << "[";
+        for (size_t i = 0; i < images.size(); i++)
+        {
+            const image &img = images[i];
+            if (img.name.empty())
+                continue;
+            fs << "{" << "Index" << (int)i << "Name" << img.name << "Detection_ms" << img.ms << "Points" << img.points;
+            if (s.calibrationPattern != Settings::CHESSBOARD)
+                fs << "Markers" << img.points/4;
+            fs << "Cached" << (int)img.cached;
+            if (allocs && !img.cached)
+                fs << "Allocations" << (double)img.allocs.allocations << "Allocated_KB" << img.allocs.bytes/1024.;
+            fs << "Status" << img.status << "}";
+        }
+        fs << "]";
+        printf("\nRun report written to %s\n", s.runReportFilename().c_str());
+        return true;
+    }
+
+    static double elapsedMs(int64 ticks) { return 1000.*(getTickCount() - ticks)/getTickFrequency(); }
+
+    // Peak resident memory of the process (ru_maxrss is in bytes on macOS, and in kilobytes elsewhere)
+    static double peakRssMB()
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+#ifdef __APPLE__
+        return usage.ru_maxrss/1048576.;
+#else
+        return usage.ru_maxrss/1024.;
+#endif
+    }
+
+private:
+
+    struct image {
+        string name;            // empty if the image has not been reported
+        double ms = 0;          // detection time
+        int points = 0;         // detected points (4 per ArUco marker)
+        bool cached = false;    // read from the detection cache
+        string status;          // "accepted", or why the image is not used
+        allocCounts allocs;     // of its decoding and detection
+    };
+    struct stageTime {
+        stageTime(const char *n, double w, double c, const allocCounts &a) : name(n), wallMs(w), cpuMs(c), allocs(a) {}
+        string name;
+        double wallMs, cpuMs;
+        allocCounts allocs;
+    };
+    struct solverStats {
+        string name;
+        int solves, iterations;
+    };
+
+    bool opened;
+    int64 startTicks;
+    clock_t startCpu;
+    vector<image> images;
+    vector<stageTime> stages;
+    vector<solverStats> solvers;
+    vector<pair<string, queueStats> > queues;
+    rectificationCheck rectification;
+    bool hasRectification;
+    driftCheck drift;
+    bool hasDrift;
+    captureStats capture;
+    bool hasCapture;
+    mutex m;
+};
+
+// The imread flags of the images that are kept for the undistortion or rectification stage. Returns
+// -1 if that stage does not run, so there is nothing to keep
+static int frameStoreFlags(const Settings &s)
+{
+    if (s.mode == Settings::INTRINSIC && (s.undistortedPath != "0" || s.showUndistorted))
+        return CV_LOAD_IMAGE_COLOR;
+    if (s.mode == Settings::STEREO && (s.rectifiedPath != "0" || s.rectifiedContainer != "0" || s.showRectified))
+        return CV_LOAD_IMAGE_GRAYSCALE;
+    return -1;
+}
+
+// Reads an image of the list for a stage after the calibration, from the frame store if it is kept there
+static Mat rereadImage(const Settings &s, FrameStore &frames, int index, int flags)
+{
+    Mat img = frames.take(index, flags);
+    return img.data ? img : s.readListImage(index, flags);
+}
+
+
+//----------------Error checking/Debugging helper functions-------------------//
+// Checks if a path points to an existing directory
+bool pathCheck(const string& path)
+{
+    DIR* dir = opendir(path.c_str());
+    if (dir)              // If the path is an actual directory
+    {
+        closedir(dir);
+        return true;
+    }
+    else                  // Directory does not exist
+        return false;
+}
+
+// Legibly prints the contents of a matrix
+void printMat(Mat m, const char *name)
+{
+    Size s = m.size();
+    printf("%s: \t[", name);
+    for (int i=0; i < s.height; i++)
+    {
+        for (int j=0; j < s.width; j++)
+            printf("%.2f, ", m.at<double>(i,j));
+        // if(i+1 != s.height)
+            // cout << endl << "\t ";
+    }
+    cout << "]\n\n";
+}
+
+// Legibly prints the points of an intrinsic calibration struct
+void printPoints(const intrinsicCalibration inCal)
+{
+    for (auto v:inCal.objectPoints)
+    {
+        cout << "object " << v.size() << endl << "[";
+        for (auto p:v)
+             cout << " " << p << " ";
+        cout << endl << endl;
+    }
+    for (auto v:inCal.imagePoints)
+    {
+        cout << "image " << v.size() << endl << "[";
+        for (auto p:v)
+             cout << " " << p << " ";
+        cout << endl << endl;
+    }
+}
+
+
+//-------------------------Calibration functions------------------------------//
+// Calculates the reprojection error with a set of intrinsics
+// The views are projected in parallel. Along with the RMS error of each view (reprojErrs),
+// the error of every point is stored in pointErrs so outliers can be found without reprojecting
+double computeReprojectionErrors(intrinsicCalibration &inCal)
+{
+    int nViews = (int)inCal.objectPoints.size();
+    vector<double> viewErrs(nViews);       // sum of squared errors of each view
+    vector<vector<Point2f> > projected(omp_get_max_threads());    // projection buffer per thread
+    ProjectionKernel camera(inCal.cameraMatrix, inCal.distCoeffs);
+    inCal.reprojErrs.resize(nViews);
+    inCal.pointErrs.resize(nViews);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nViews; i++)
+    {
+        vector<Point2f> &imagePoints2 = projected[omp_get_thread_num()];
+        const vector<Point2f> &imagePoints = inCal.imagePoints[i];
+        vector<float> &errs = inCal.pointErrs[i];
+        int n = (int)inCal.objectPoints[i].size();
+
+        errs.resize(n);
+        viewErrs[i] = 0;
+        if (n == 0)
+        {
+            inCal.reprojErrs[i] = 0;
+            continue;
+        }
+        camera.project(inCal.objectPoints[i], inCal.rvecs[i], inCal.tvecs[i], imagePoints2);
+        for (int j = 0; j < n; j++)
+        {
+            Point2f d = imagePoints[j] - imagePoints2[j];
+            double errSq = d.x*d.x + d.y*d.y;
+            errs[j] = (float)sqrt(errSq);
+            viewErrs[i] += errSq;
+        }
+        inCal.reprojErrs[i] = (float)sqrt(viewErrs[i]/n);
+    }
+
+    // Sum in view order, so the result does not depend on the number of threads
+    int totalPoints = 0;
+    double totalErr = 0;
+    for (int i = 0; i < nViews; i++)
+    {
+        totalErr += viewErrs[i];
+        totalPoints += (int)inCal.objectPoints[i].size();
+    }
+    return sqrt(totalErr/totalPoints);
+}
+
+// Appends the image and object points of the detected markers that belong to the map, along with their keys
+void calcArucoCorners(vector<Point2f> &imagePointsBuf, vector<Point3f> &objectPointsBuf,
+                      vector<int> &pointKeysBuf, const vector<Marker> &markers_detected,
+                      const MarkerMap &map, int mapIndex)
+{
+    imagePointsBuf.reserve(imagePointsBuf.size() + 4*markers_detected.size());
+    objectPointsBuf.reserve(objectPointsBuf.size() + 4*markers_detected.size());
+    pointKeysBuf.reserve(pointKeysBuf.size() + 4*markers_detected.size());
+    // For each detected marker
+    for(size_t i=0;i<markers_detected.size();i++){
+        // Look the marker up in the map
+        int markerIndex = map.getIndexOfMarkerId(markers_detected[i].id);
+        if (markerIndex != -1){
+            // If the marker has been found, add its image and object points
+            const Point3f *corners = map.getMarkerCorners(markerIndex);
+            for(int j=0;j<4;j++){
+                imagePointsBuf.push_back(markers_detected[i][j]);
+                objectPointsBuf.push_back(corners[j]);
+                pointKeysBuf.push_back(arucoPointKey(mapIndex, markers_detected[i].id, j));
+            }
+        }
+    }
+    //cout<<inCal.objectPoints.size()/4<<" markers detected"<<endl;
+}
+
+// Appends the image and object points of the inner corners of a CHARUCO pattern, along with their keys. Each corner
+// is predicted by a homography of the detected markers around it, so corners whose own markers were not found are
+// predicted too, and it is then refined as the saddle point of the chessboard in a window of about a quarter square
+void calcCharucoCorners(const charucoLayout &layout, const Mat &gray, vector<Point2f> &imagePointsBuf,
+                        vector<Point3f> &objectPointsBuf, vector<int> &pointKeysBuf,
+                        const vector<Marker> &markers_detected, const MarkerMap &map)
+{
+    vector<int> detectedOf(map.size(), -1);
+    for (size_t i = 0; i < markers_detected.size(); i++)
+    {
+        int markerIndex = map.getIndexOfMarkerId(markers_detected[i].id);
+        if (markerIndex != -1) detectedOf[markerIndex] = (int)i;
+    }
+
+    vector<Point2f> boardPoints, imagePoints, corner(1);
+    for (auto &c:layout.saddles)
+    {
+        boardPoints.clear();
+        imagePoints.clear();
+        for (int k:c.markers)
+            if (detectedOf[k] >= 0)
+                for (int j = 0; j < 4; j++)
+                {
+                    boardPoints.push_back(layout.markerCorners[4*k+j]);
+                    imagePoints.push_back(markers_detected[detectedOf[k]][j]);
+                }
+        if (boardPoints.size() < 4)
+            continue;
+        Mat H = boardPoints.size() == 4 ? getPerspectiveTransform(boardPoints, imagePoints)
+                                        : findHomography(boardPoints, imagePoints, 0);
+        if (H.empty())
+            continue;
+        vector<Point2f> board(2, c.boardPoint), predicted;
+        board[1].x += layout.side;
+        perspectiveTransform(board, predicted, H);
+
+        // The window stays inside the squares around the corner
+        int wsize = max(2, min(5, (int)(norm(predicted[1] - predicted[0])/4)));
+        if (predicted[0].x < 2*wsize || predicted[0].y < 2*wsize
+                || predicted[0].x >= gray.cols - 2*wsize || predicted[0].y >= gray.rows - 2*wsize)
+            continue;
+        corner[0] = predicted[0];
+        cornerSubPix(gray, corner, Size(wsize, wsize), Size(-1, -1),
+                     TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 20, 0.01));
+        if (norm(corner[0] - predicted[0]) > wsize)     // Drifted away, not a saddle point
+            continue;
+        imagePointsBuf.push_back(corner[0]);
+        objectPointsBuf.push_back(c.objectPoint);
+        pointKeysBuf.push_back(c.key);
+    }
+}
+
+// Returns the indices of the points of a view, sorted by their key
+static vector<int> sortedByKey(const vector<int> &keys)
+{
+    vector<int> order(keys.size());
+    for (int i=0; i<(int)order.size(); i++) order[i] = i;
+    // Detected markers are sorted by id, so keys are usually sorted already
+    if (!is_sorted(keys.begin(), keys.end()))
+        sort(order.begin(), order.end(), [&keys](int a, int b) { return keys[a] < keys[b]; });
+    return order;
+}
+
+// Stereo calibration requires both images to have the same # of image and object points, but
+// ArUco detections can include an arbitrary subset of all markers.
+// This function limits the points lists to only those points shared between each image,
+// by merging the sorted point keys of both views
+void getSharedPoints(intrinsicCalibration &inCal, intrinsicCalibration &inCal2)
+{
+    vector<Point3f> sharedObjectPoints;
+    vector<Point2f> sharedImagePoints, sharedImagePoints2;   //shared image points for each inCal
+    vector<int> sharedKeys;
+
+    //for each objectPoints vector in overall objectPoints vector of vectors
+    for (int i=0; i<(int)inCal.objectPoints.size(); i++)
+    {
+        const vector<int> &keys = inCal.pointKeys.at(i), &keys2 = inCal2.pointKeys.at(i);
+        vector<int> order = sortedByKey(keys), order2 = sortedByKey(keys2);
+
+        sharedObjectPoints.clear();
+        sharedImagePoints.clear();
+        sharedImagePoints2.clear();
+        sharedKeys.clear();
+        size_t a = 0, b = 0;
+        while (a < order.size() && b < order2.size())
+        {
+            int j = order[a], shared = order2[b];
+            if (keys[j] < keys2[shared]) a++;
+            else if (keys2[shared] < keys[j]) b++;
+            else        //object point is shared
+            {
+                sharedObjectPoints.push_back(inCal.objectPoints[i][j]);
+                sharedImagePoints.push_back(inCal.imagePoints[i][j]);
+                sharedImagePoints2.push_back(inCal2.imagePoints[i][shared]);
+                sharedKeys.push_back(keys[j]);
+                a++;
+                b++;
+            }
+        }
+        inCal2.objectPoints[i] = sharedObjectPoints;
+        inCal.objectPoints[i].swap(sharedObjectPoints);
+        inCal.imagePoints[i].swap(sharedImagePoints);
+        inCal2.imagePoints[i].swap(sharedImagePoints2);
+        inCal2.pointKeys[i] = sharedKeys;
+        inCal.pointKeys[i].swap(sharedKeys);
+    }
+}
+
+// Draws an inputted ArUco marker
+// Draws either the ID or 3D coordinate, depening on the showArucoCoords setting
+void drawMarker(const Settings &s, const Marker &marker, Mat &img, Scalar color, int lineWidth, Point3f printPoint, int corner) {
+    // Draw a rectangle around the marker
+    // marker[x] is coordinate of corner on image
+    line(img, marker[0], marker[1], color, lineWidth, CV_AA);
+    line(img, marker[1], marker[2], color, lineWidth, CV_AA);
+    line(img, marker[2], marker[3], color, lineWidth, CV_AA);
+    line(img, marker[3], marker[0], color, lineWidth, CV_AA);
+
+    auto p2=Point2f(lineWidth, lineWidth);
+    rectangle(img, marker[corner] - p2, marker[corner] + p2,  Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), lineWidth, CV_AA);
+
+    // Determine the center point
+    Point cent(0, 0);
+    for (int i = 0; i < 4; i++) {
+        cent.x += marker[i].x;
+        cent.y += marker[i].y;
+    }
+    cent.x /= 4.;
+    cent.y /= 4.;
+
+    if (s.showArucoCoords) {        // draw the input printPoint, which is the marker coordinate
+        rectangle(img, marker[corner] - p2, marker[corner] + p2,  Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), lineWidth, CV_AA);
+
+        char p[100];
+        sprintf(p, "(%d,%d,%d)", (int)printPoint.x, (int)printPoint.y, (int)printPoint.z);
+        putText(img, p, cent, FONT_HERSHEY_SIMPLEX, .5f, Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), 2);
+    }
+    else {                          // draw the ID number
+        char cad[100];
+        sprintf(cad, "id=%d", marker.id);
+        putText(img, cad, cent, FONT_HERSHEY_SIMPLEX,  max(0.5f,float(lineWidth)*0.3f), Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), max(lineWidth,2));
+    }
+}
+
+// Draws the detected markers of a marker map onto the image
+void drawArucoMarkers(const Settings &s, Mat &img, const vector<Point3f> &objectPointsBuf,
+                      const vector<Marker> &markers, int index)
+{
+    // corner variable is the index of the corner to be draw, set from the plane of the map
+    // (XY 3, YZ 2, XZ 0), and each plane is drawn in its own color
+    int corner = s.arPat.drawCorner[index];
+    int colorSwitch = corner == 3 ? 0 : corner == 2 ? 1 : 2;
+
+    // Color for marker to be drawn in draw function
+    Scalar color = Scalar(0,0,0);
+    color[colorSwitch] = 255;
+
+    // Draws each detected markers onto the image
+    // Each marker has 4 detected object points, so loop through size of inCal.objectPoints/4
+    for (int k = 0; k < (int)objectPointsBuf.size()/4; k++)
+        drawMarker(s, markers[k], img, color, max(float(1.f),1.5f*float(img.cols)/1000.f),
+                   objectPointsBuf[k*4+corner], corner);
+}
+
+// Draws the detection results of an image
+void drawOverlay(const Settings &s, Mat &img, const patternOverlay &overlay)
+{
+    if (s.calibrationPattern == Settings::CHESSBOARD)
+    {
+        if (!overlay.chessboardCorners.empty())
+            drawChessboardCorners(img, s.boardSize, Mat(overlay.chessboardCorners), true);
+    }
+    else
+        for (int j = 0; j < (int)overlay.markers.size(); j++)
+            drawArucoMarkers(s, img, overlay.objectPoints[j], overlay.markers[j], j);
+    if (s.calibrationPattern == Settings::CHARUCO)
+        for (auto &p:overlay.chessboardCorners)
+            circle(img, p, max(2, img.cols/400), Scalar(0, 255, 255), max(1, img.cols/1000));
+    // The status goes in the bottom left corner, away from the incremental calibration status
+    if (!overlay.status.empty())
+    {
+        putText(img, overlay.status, Point(10, img.rows - 15), FONT_HERSHEY_SIMPLEX, .6f, Scalar(0, 0, 0), 3);
+        putText(img, overlay.status, Point(10, img.rows - 15), FONT_HERSHEY_SIMPLEX, .6f, Scalar(0, 255, 255), 1);
+    }
+}
+
+// Cheap check of an image before the pattern is detected. The image is rejected if its sharpness, the
+// variance of the Laplacian of the image downscaled to at most 640 pixels wide, is below Detection_MinSharpness.
+// Blurry images, and images of a plain scene, fail the check. Returns false with the reason if rejected
+bool prescreenFrame(const Settings &s, imageFrame &frame, string &reason)
+{
+    pipelineTrace::scope trace("prescreen");
+    // The time budget of the detection starts with the prescreen, which is run right before it
+    if (s.timeBudget > 0)
+        frame.deadline = getTickCount() + (int64)(s.timeBudget*1e-3*getTickFrequency());
+    if (s.minSharpness <= 0)
+        return true;
+    // At a fixed width, the cost does not grow with the image, and the sharpness depends little on the resolution
+    const Mat &gray = frame.gray();
+    Mat small = gray, lap;
+    if (gray.cols > 640)
+        resize(gray, small, Size(640, cvRound(gray.rows*640./gray.cols)), 0, 0, INTER_AREA);
+    Laplacian(small, lap, CV_16S);
+    Scalar mean, dev;
+    meanStdDev(lap, mean, dev);
+    double sharpness = dev[0]*dev[0];
+    if (sharpness >= s.minSharpness)
+        return true;
+    char r[64];
+    sprintf(r, "too blurry (sharpness %.1f)", sharpness);
+    reason = r;
+    return false;
+}
+
+// Polygon to which the detection of a frame is restricted (see Detection_Roi), empty for the whole image
+static const vector<Point> &detectionRoi(const Settings &s, const imageFrame &frame)
+{
+    static const vector<Point> none;
+    return frame.camera >= 0 && frame.camera < (int)s.detectionRoi.size() ? s.detectionRoi[frame.camera] : none;
+}
+
+// Where the board was found in the last frame of a sequence, so that the next fast detection
+// (see Chessboard_FastWidth) first searches around it
+struct chessboardHint {
+    Rect roi;       //area of the board in the last frame, empty if it was not found
+};
+
+// The bounding box of chessboard corners, grown by margin squares on each side
+static Rect chessboardArea(const vector<Point2f> &corners, Size boardSize, float margin)
+{
+    Rect r = boundingRect(corners);
+    int mx = cvCeil(margin*r.width/max(1, boardSize.width - 1));
+    int my = cvCeil(margin*r.height/max(1, boardSize.height - 1));
+    return Rect(r.x - mx, r.y - my, r.width + 2*mx, r.height + 2*my);
+}
+
+// Looks for the chessboard in an area of the image only. The corners are in image coordinates
+static bool findChessboardIn(const Mat &gray, Size boardSize, Rect roi, vector<Point2f> &corners, int flags)
+{
+    roi &= Rect(0, 0, gray.cols, gray.rows);
+    if (roi.area() == 0 || !findChessboardCorners(gray(roi), boardSize, corners, flags))
+        return false;
+    for (auto &p:corners) p += Point2f((float)roi.x, (float)roi.y);
+    return true;
+}
+
+// Searches the chessboard at nScales scales, each half the previous one down from the full resolution, and keeps the
+// board of the coarsest scale that finds it. The coarse scales are quick and find most boards, while the full
+// resolution finds the small ones. The scales are searched at once on OpenMP threads, coarsest first, unless inTurn
+// is set or the call is made from a thread of a team, as in a batch detection: they are then searched one after the
+// other on the calling thread, up to the first board. A search that has not started once a coarser board is found is
+// skipped, but one of findChessboardCorners can not be interrupted, so the call returns once the running ones finish.
+// The board kept does not depend on the order the searches finish in. The corners of a downscaled board are refined
+// at its scale before they are carried over to the full resolution, to be refined there by cornerSubPix
+static bool findChessboardScales(const Mat &gray, Size boardSize, int nScales, bool inTurn, vector<Point2f> &corners,
+                                 int flags)
+{
+    vector<vector<Point2f> > found(nScales);
+    atomic<int> coarsest(nScales);      // the coarsest scale with a board so far, counted from the coarsest one
+    #pragma omp parallel for schedule(dynamic) num_threads(nScales) if(!inTurn)
+    for (int k = 0; k < nScales; k++)
+    {
+        if (coarsest < k)
+            continue;
+        double scale = 1./(1 << (nScales - 1 - k));
+        Mat scaled = gray;
+        if (scale < 1)
+            resize(gray, scaled, Size(), scale, scale, INTER_AREA);
+        if (!findChessboardCorners(scaled, boardSize, found[k], flags))
+            continue;
+        if (scale < 1)
+        {
+            // The window stays within a square, which may be a few pixels wide at this scale
+            float spacing = FLT_MAX;
+            for (size_t j = 1; j < found[k].size(); j++)
+                if (j % boardSize.width != 0)
+                    spacing = min(spacing, (float)norm(found[k][j] - found[k][j-1]));
+            int win = max(1, min(5, (int)(spacing*0.4f)));
+            cornerSubPix(scaled, found[k], Size(win, win), Size(-1,-1),
+                         TermCriteria(CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 20, 0.05));
+            for (auto &p:found[k]) p *= (float)(1/scale);
+        }
+        int c = coarsest;
+        while (k < c && !coarsest.compare_exchange_weak(c, k)) {}
+    }
+    if (coarsest == nScales)
+        return false;
+    corners.swap(found[coarsest]);
+    return true;
+}
+
+// Detects the pattern on a chessboard image
+// If overlay is not NULL, the detection is stored in it to be drawn with drawOverlay
+// If hint is not NULL, the fast detection searches around the board of the previous frame first
+// A search of findChessboardCorners can not be interrupted, so the time budget of the frame is only
+// checked between the searches. Nothing is added if the frame went over it
+void chessboardDetect(const Settings &s, imageFrame &frame, intrinsicCalibration &inCal, patternOverlay *overlay,
+                      chessboardHint *hint = NULL)
+{
+    pipelineTrace::scope trace("chessboard");
+    //grayscale image of the search. With a detection ROI, only the area around it is searched, grown
+    //by the cornerSubPix window so that the board corners at its edge are found
+    const vector<Point> &roi = detectionRoi(s, frame);
+    Rect box(0, 0, frame.img.cols, frame.img.rows);
+    if (!roi.empty())
+    {
+        Rect r = boundingRect(roi);
+        box &= Rect(r.x - 11, r.y - 11, r.width + 22, r.height + 22);
+        if (box.area() == 0)
+            return;
+    }
+    Mat imgGray = frame.gray()(box);
+    const int flags = CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS | CV_CALIB_CB_FAST_CHECK |
+                      CV_CALIB_CB_NORMALIZE_IMAGE;
+
+    //buffer to store points for each image
+    vector<Point2f> imagePointsBuf;
+    bool found;
+    if (s.chessboardFastWidth > 0 && imgGray.cols > s.chessboardFastWidth)
+    {
+        // The board is searched at full resolution only around where it was in the previous frame,
+        // or else where a check of the downscaled image finds it. Images without a board fail that check quickly
+        found = hint && hint->roi.area() > 0 && findChessboardIn(imgGray, s.boardSize, hint->roi - box.tl(),
+                                                                 imagePointsBuf, flags);
+        if (!found)
+        {
+            double scale = (double)s.chessboardFastWidth/imgGray.cols;
+            Mat small;
+            resize(imgGray, small, Size(), scale, scale, INTER_AREA);
+            vector<Point2f> smallCorners;
+            if (findChessboardCorners(small, s.boardSize, smallCorners, flags) && !frame.late())
+            {
+                for (auto &p:smallCorners) p *= 1./scale;
+                found = findChessboardIn(imgGray, s.boardSize, chessboardArea(smallCorners, s.boardSize, 2),
+                                         imagePointsBuf, flags);
+                // Otherwise cornerSubPix refines the upscaled corners, which are within a few pixels
+                if (!found)
+                {
+                    imagePointsBuf.swap(smallCorners);
+                    found = true;
+                }
+            }
+        }
+        // The board may move between frames, so its next search area has a wider margin
+        if (hint)
+            hint->roi = found ? chessboardArea(imagePointsBuf, s.boardSize, 3) + box.tl() : Rect();
+    }
+    else if (s.chessboardScales > 1)
+        found = findChessboardScales(imgGray, s.boardSize, s.chessboardScales, s.deterministic, imagePointsBuf, flags);
+    else
+        found = findChessboardCorners( imgGray, s.boardSize, imagePointsBuf, flags);
+    // The corners are refined in the whole image, and a board that is not entirely inside the ROI is dropped
+    if (found)
+    {
+        for (auto &p:imagePointsBuf) p += Point2f((float)box.x, (float)box.y);
+        for (size_t k = 0; k < imagePointsBuf.size() && found && !roi.empty(); k++)
+            found = pointPolygonTest(roi, imagePointsBuf[k], false) >= 0;
+    }
+    if (found && !frame.late())
+    {
+        pipelineTrace::scope subpixTrace("subpix");
+        const Mat &fullGray = frame.gray();
+        // The corners are refined independently, so each row of the board is refined in parallel
+        #pragma omp parallel for
+        for (int r = 0; r < s.boardSize.height; r++)
+        {
+            vector<Point2f> row(imagePointsBuf.begin() + r*s.boardSize.width,
+                                imagePointsBuf.begin() + (r+1)*s.boardSize.width);
+            cornerSubPix(fullGray, row, Size(11,11), Size(-1,-1),
+                         TermCriteria( CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 30, 0.1 ));
+            copy(row.begin(), row.end(), imagePointsBuf.begin() + r*s.boardSize.width);
+        }
+
+        //add these image points to the overall calibration vector
+        inCal.imagePoints.push_back(imagePointsBuf);
+
+        //the corresponding objectPoints are the same for every view
+        inCal.objectPoints.push_back(s.chessboardObjectPoints);
+        if (overlay)
+            overlay->chessboardCorners = imagePointsBuf;
+    }
+}
+
+// The parameters of the ArUco detector for the settings, before they are scaled to the image width
+static MarkerDetector::Params arucoDetectorParams(const Settings &s, int nThreads)
+{
+    //set specific parameters for this configuration
+    MarkerDetector::Params params;
+    params._borderDistThres=.01;//acept markers near the borders
+    params._maxSize=0.9;
+    params._thresParam1=s.arucoThresParam1;
+    params._thresParam1_range=s.arucoThresRange;//search in wide range of values for param1 (see autotuneAruco)
+    params._cornerMethod=s.arucoCornerMethod;//subpixel corner refinement by default
+    params._pyrCandidateLevel=s.arucoPyrLevel;//coarse to fine search
+    params._quadDecimate=s.arucoDecimate;
+    params._adaptiveThresLevels=s.arucoAdaptiveThres;
+    params._cellThreshold=s.arucoCellThreshold;
+    params._fastQuadFit=s.arucoFastQuad;
+    params._fusedFirstPass=s.arucoFusedFirstPass;
+    if (s.arucoLowPower)
+        params.setLowPower();
+    params._nThreads=nThreads;
+    return params;
+}
+
+// Sets up a marker detector for the ArUco pattern. The detector keeps its labelers and
+// buffers, so it should be created once and reused for every image. nThreads is the number of
+// threads of each detection, 0 for the count shared by the detectors (see Aruco_Threads)
+void setupArucoDetector(const Settings &s, MarkerDetector &TheMarkerDetector, int nThreads = 0)
+{
+    TheMarkerDetector.setParams(arucoDetectorParams(s, nThreads));//set the params above
+
+    // The maps tell which markers can be found, so the threshold search can stop once all are
+    vector<vector<int> > expectedIds(s.arPat.dictionaries.size());
+    for (int j = 0; j < s.nMarkerMaps; j++)
+        for (auto &m:s.arPat.markerMapList[j])
+            expectedIds[s.arPat.mapDictionary[j]].push_back(m.id);
+
+    // The markers of every map are detected in a single pass over the image, and with Aruco_MapIdsOnly
+    // the labelers only hold the codes of these markers
+    TheMarkerDetector.setDictionaries(s.arPat.dictionaries, 0,
+                                      s.arucoMapIdsOnly ? expectedIds : vector<vector<int> >());
+    TheMarkerDetector.setExpectedMarkers(expectedIds);
+}
+
+// Scales the pixel based detection parameters with the image width. The parameters were
+// tuned for images up to 1280 pixels wide. Wider images search candidates in a pyramid level
+// of about that width, so native resolution detection costs about the same as the halved image
+void scaleArucoParams(const Settings &s, MarkerDetector::Params &params, int cols)
+{
+    params._subpix_wsize = (10./2000.)*float(cols);//search corner subpix in a window area
+    params._minSize_pix = max(25, 25*cols/1280);
+    int level = 0;
+    while ((cols >> level) > 1920) level++;
+    params._pyrCandidateLevel = max(s.arucoPyrLevel, level);
+}
+
+// Follows the markers of the last full detection on the next video frames with optical flow,
+// which is much cheaper than detecting them again. Used by the live preview. The corners are
+// predicted with constant velocity from the last two frames, where the flow starts
+class MarkerTracker
+{
+public:
+    MarkerTracker() : interval(0), frames(0) {}
+
+    // Tracks for at most interval frames after each full detection. 0 disables the tracking
+    void open(int trackingInterval) { interval = trackingInterval; frames = 0; prevMarkers.clear(); velocity.clear(); }
+
+    // Changes the interval, keeping the markers being tracked
+    void setInterval(int trackingInterval) { interval = trackingInterval; }
+
+    // Moves the markers of the previous frame to img. Returns false when a full detection is due,
+    // either because of the interval or because too many markers were lost
+    bool track(imageFrame &frame, vector<vector<Marker> > &markers)
+    {
+        if (interval <= 0 || prevMarkers.empty() || frames >= interval)
+            return false;
+        Mat gray = toGray(frame);
+        if (gray.size() != prevGray.size())
+            return false;
+
+        vector<Point2f> prevPoints, points;
+        for (auto &dict:prevMarkers)
+            for (auto &m:dict)
+                prevPoints.insert(prevPoints.end(), m.begin(), m.end());
+        if (prevPoints.empty())
+            return false;
+        vector<uchar> status;
+        vector<float> err;
+        int flags = 0;
+        if (velocity.size() == prevPoints.size())
+        {
+            points.resize(prevPoints.size());
+            for (size_t i = 0; i < points.size(); i++) points[i] = prevPoints[i] + velocity[i];
+            flags = OPTFLOW_USE_INITIAL_FLOW;
+        }
+        calcOpticalFlowPyrLK(prevGray, gray, prevPoints, points, status, err, Size(21,21), 3,
+                             TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01), flags);
+
+        // A marker is kept only if its four corners were tracked
+        size_t nPrev = prevPoints.size() / 4, nKept = 0, k = 0;
+        markers.assign(prevMarkers.size(), vector<Marker>());
+        vector<Point2f> motion;
+        for (size_t d = 0; d < prevMarkers.size(); d++)
+            for (auto &m:prevMarkers[d]) {
+                bool ok = status[k] && status[k+1] && status[k+2] && status[k+3];
+                if (ok) {
+                    markers[d].push_back(m);
+                    for (int c = 0; c < 4; c++) {
+                        markers[d].back()[c] = points[k+c];
+                        motion.push_back(points[k+c] - prevPoints[k+c]);
+                    }
+                    nKept++;
+                }
+                k += 4;
+            }
+        if (nKept*2 < nPrev)   // Lost: detect again
+            return false;
+
+        prevGray = gray;
+        prevMarkers = markers;
+        velocity.swap(motion);
+        frames++;
+        return true;
+    }
+
+    // Starts tracking from a full detection
+    void reset(imageFrame &frame, const vector<vector<Marker> > &markers)
+    {
+        if (interval <= 0) return;
+        prevGray = toGray(frame);
+        prevMarkers = markers;
+        velocity.clear();
+        frames = 0;
+    }
+
+private:
+    // The grayscale image of the frame, copied if it is the image itself, which is drawn on afterwards
+    static Mat toGray(imageFrame &frame)
+    {
+        const Mat &gray = frame.gray();
+        return gray.data == frame.img.data ? gray.clone() : gray;
+    }
+
+    int interval, frames;
+    Mat prevGray;
+    vector<vector<Marker> > prevMarkers;
+    vector<Point2f> velocity;   // Motion of each corner of prevMarkers in the last frame, empty after a detection
+};
+
+// Holds the live preview at Preview_TargetFPS by trading ArUco detection effort for time. Level 0 is the effort of
+// the settings, and each level above cuts it a step further: the threshold range is halved, then a single
+// threshold is searched with fewer subpixel iterations, then the candidates are searched a pyramid level higher,
+// and full detections are further apart at every level, the markers being tracked in between. The detection time
+// of each frame is averaged, and the level goes up while the average is over the frame time of the target, and
+// down once it is below half of it. A level is held for some frames, so the average catches up with the change
+class DetectionGovernor
+{
+public:
+    static const int maxLevel = 4;
+
+    DetectionGovernor() : level(0), averageMs(0), hold(0) {}
+
+    // Sets a detector and its tracker to the effort of the current level, if they are not, before each frame. The
+    // settings reloaded in between reset them, and the level too if the target was set to 0
+    void apply(const Settings &s, MarkerDetector &detector, MarkerTracker &tracker)
+    {
+        if (s.targetFPS <= 0)
+        {
+            level = 0;
+            return;
+        }
+        // The levels cut from the parameters of the settings, those of Aruco_LowPower included
+        MarkerDetector::Params base = arucoDetectorParams(s, 0), params = detector.getParams();
+        double range = level >= 2 ? 0 : level == 1 ? floor(base._thresParam1_range/2) : base._thresParam1_range;
+        int iterations = level >= 3 ? 4 : level == 2 ? 8 : base._subpixMaxIterations;
+        if (params._thresParam1_range != range || params._subpixMaxIterations != iterations)
+        {
+            params._thresParam1_range = range;
+            params._subpixMaxIterations = iterations;
+            detector.setParams(params);
+        }
+        tracker.setInterval(level == 0 ? s.trackingInterval : max(s.trackingInterval, 1 << level));
+    }
+
+    // Pyramid levels added to the candidate search of the frames (see imageFrame::pyramidOffset)
+    int pyramidOffset() const { return level >= 4 ? 2 : level == 3 ? 1 : 0; }
+
+    // Adds the detection time of a frame, and changes the level if needed
+    void update(const Settings &s, double ms)
+    {
+        if (s.targetFPS <= 0)
+            return;
+        averageMs = averageMs > 0 ? 0.8*averageMs + 0.2*ms : ms;
+        if (hold > 0)
+        {
+            hold--;
+            return;
+        }
+        double frameMs = 1000./s.targetFPS;
+        if (averageMs > frameMs && level < maxLevel)
+        {
+            level++;
+            hold = holdFrames;
+        }
+        else if (averageMs < 0.5*frameMs && level > 0)
+        {
+            level--;
+            hold = holdFrames;
+        }
+    }
+
+    // The effort level, the average detection time and the target, to be drawn on the preview
+    string status(const Settings &s) const
+    {
+        if (s.targetFPS <= 0)
+            return "";
+        char text[96];
+        sprintf(text, "Effort level %d/%d, detection %.1f ms, target %.3g fps", level, maxLevel, averageMs, s.targetFPS);
+        return text;
+    }
+
+private:
+    static const int holdFrames = 15;
+
+    int level;
+    double averageMs;   // Detection time of the last frames, exponentially weighted
+    int hold;           // Frames until the level can change again
+};
+
+// Searches the faces of an ARUCO_BOX rig that have less than half of their markers in the detection, in the
+// image region where they are expected (see Aruco_GuidedFaces). The coarse pose of the box is found from the
+// markers of the other faces with a guessed pinhole camera, which is enough to bound the regions with a
+// margin. Each region is detected at full resolution, and only the markers of the missed faces are added
+static void detectGuidedFaces(const Settings &s, MarkerDetector &detector, const Mat &gray,
+                              vector<vector<Marker> > &detected)
+{
+    vector<Point2f> p2d;
+    vector<Point3f> p3d;
+    vector<int> missed;
+    for (int j = 0; j < s.nMarkerMaps; j++)
+    {
+        const MarkerMap &map = s.arPat.markerMapList[j];
+        const vector<Marker> &markers = detected[s.arPat.mapDictionary[j]];
+        vector<int> indices = map.getIndices(markers);
+        if (indices.size()*2 < map.size())
+            missed.push_back(j);
+        else
+            for (int index:indices)
+            {
+                p2d.insert(p2d.end(), markers[index].begin(), markers[index].end());
+                const Point3f *corners = map.getMarkerCorners(map.getIndexOfMarkerId(markers[index].id));
+                p3d.insert(p3d.end(), corners, corners + 4);
+            }
+    }
+    if (missed.empty() || p2d.empty())
+        return;
+
+    double f = max(gray.cols, gray.rows);
+    Mat K = (Mat_<double>(3,3) << f, 0, gray.cols/2., 0, f, gray.rows/2., 0, 0, 1), rvec, tvec;
+    if (!MarkerMap::solvePnPMarkers(p3d, p2d, K, Mat(), rvec, tvec))
+        return;
+    Matx33d R;
+    Rodrigues(rvec, R);
+    Vec3d t(tvec);
+
+    // The full resolution search of each region uses the parameters of the full frame, scaled to its width
+    MarkerDetector::Params params = detector.getParams();
+    // The regions are searched whole, and their markers out of the detection ROI dropped afterwards
+    vector<Point> roi = detector.getROI();
+    detector.setROI(vector<Point>());
+    vector<vector<Marker> > found;
+    vector<Point2f> proj;
+    for (int j:missed)
+    {
+        const MarkerMap &map = s.arPat.markerMapList[j];
+        vector<Point3f> corners;
+        for (auto &info:map)
+            for (auto &p:info)
+                if ((R*Vec3d(p.x, p.y, p.z) + t)[2] > 0)    // In front of the camera
+                    corners.push_back(p);
+        if (corners.empty())
+            continue;
+        projectPoints(corners, rvec, tvec, K, Mat(), proj);
+        Rect box = boundingRect(proj);
+        int mx = box.width/4, my = box.height/4;
+        box = Rect(box.x - mx, box.y - my, box.width + 2*mx, box.height + 2*my) & Rect(0, 0, gray.cols, gray.rows);
+        if (box.width < 32 || box.height < 32)
+            continue;
+
+        MarkerDetector::Params region = params;
+        scaleArucoParams(s, region, box.width);
+        region._pyrCandidateLevel = 0;
+        region._quadDecimate = 1;
+        detector.setParams(region);
+        ArucoBackend::get(s.arucoBackend)->detect(detector, s.arPat.dictionaries, gray(box), found);
+
+        // Markers of the face that the full frame missed
+        int d = s.arPat.mapDictionary[j];
+        vector<Marker> &markers = detected[d];
+        for (auto &m:found[d])
+        {
+            if (map.getIndexOfMarkerId(m.id) == -1)
+                continue;
+            bool known = false;
+            for (auto &k:markers) known |= k.id == m.id;
+            if (known)
+                continue;
+            for (auto &p:m) p += Point2f((float)box.x, (float)box.y);
+            if (roi.empty() || pointPolygonTest(roi, m.getCenter(), false) >= 0)
+                markers.push_back(m);
+        }
+        sort(markers.begin(), markers.end());
+    }
+    detector.setParams(params);
+    detector.setROI(roi);
+}
+
+// Detects the pattern on an ArUco image, with a detector set up by setupArucoDetector
+// If overlay is not NULL, the detection is stored in it to be drawn with drawOverlay
+// If tracker is not NULL, the markers are tracked from the previous frame when possible
+void arucoDetect(const Settings &s, MarkerDetector &TheMarkerDetector, imageFrame &frame,
+                 intrinsicCalibration &inCal, int vectorIndex, patternOverlay *overlay,
+                 MarkerTracker *tracker = NULL)
+{
+    pipelineTrace::scope trace("aruco");
+    // The pixel based parameters depend on the image width
+    MarkerDetector::Params params = TheMarkerDetector.getParams(), scaled = params;
+    scaleArucoParams(s, scaled, frame.img.cols);
+    scaled._pyrCandidateLevel += frame.pyramidOffset;
+    // The detector stops at the deadline of the frame (see Detection_TimeBudget), with what it has left of it
+    if (frame.deadline > 0) {
+        if (frame.late())
+            return;
+        scaled._timeBudgetMs = (frame.deadline - getTickCount())*1e3/getTickFrequency();
+    }
+    if (scaled._subpix_wsize != params._subpix_wsize || scaled._minSize_pix != params._minSize_pix
+            || scaled._pyrCandidateLevel != params._pyrCandidateLevel || scaled._timeBudgetMs != params._timeBudgetMs)
+        TheMarkerDetector.setParams(scaled);
+    // Only the area of the camera's ROI is searched, if it has one
+    const vector<Point> &roi = detectionRoi(s, frame);
+    if (TheMarkerDetector.getROI() != roi)
+        TheMarkerDetector.setROI(roi);
+    // Each image is searched as if it were the first one, so its markers do not depend on the images before it.
+    // Cached and checkpointed detections are always searched so, since they must only depend on the image and settings
+    if (s.deterministic || s.detectionCachePath != "0" || s.checkpointFile != "0")
+        TheMarkerDetector.resetHistory();
+
+    // The markers, and the points when they are not stored, go to buffers reused by each thread,
+    // so a detection loop does not allocate them again
+    static thread_local vector<vector<Marker> > detectedPerDictionary;
+    static thread_local vector<Point2f> imageScratch;
+    static thread_local vector<Point3f> objectScratch;
+    static thread_local vector<int> keyScratch;
+
+    // The overall imagePoints and objectPoints vectors for the image
+    // The points from all marker maps will be added to these image vectors
+    // In PREVIEW mode, the points are only stored if inCal has a vector for them
+    bool store = vectorIndex < (int)inCal.imagePoints.size();
+    vector<Point2f> &imgImagePoints = store ? inCal.imagePoints.at(vectorIndex) : imageScratch;
+    vector<Point3f> &imgObjectPoints = store ? inCal.objectPoints.at(vectorIndex) : objectScratch;
+    vector<int> &imgPointKeys = store ? inCal.pointKeys.at(vectorIndex) : keyScratch;
+    if (!store) {
+        imageScratch.clear();
+        objectScratch.clear();
+        keyScratch.clear();
+    }
+
+    // detect the markers using MarkerDetector object
+    if (!tracker || !tracker->track(frame, detectedPerDictionary)) {
+        ArucoBackend::get(s.arucoBackend)->detect(TheMarkerDetector, s.arPat.dictionaries, frame.gray(), detectedPerDictionary);
+        // The markers of a detection cut short are incomplete, so none of them is used or tracked
+        if (frame.deadline > 0 && (TheMarkerDetector.getStats().overBudget || frame.late())) {
+            frame.overBudget = true;
+            return;
+        }
+        if (s.arucoGuidedFaces && s.calibrationPattern == Settings::ARUCO_BOX)
+            detectGuidedFaces(s, TheMarkerDetector, frame.gray(), detectedPerDictionary);
+        if (tracker) tracker->reset(frame, detectedPerDictionary);
+    }
+
+    if (overlay) {
+        overlay->markers.assign(s.nMarkerMaps, vector<Marker>());
+        overlay->objectPoints.assign(s.nMarkerMaps, vector<Point3f>());
+    }
+
+    //for each marker map, find its markers
+    pipelineTrace::scope correspondencesTrace("correspondences");
+    for(int j=0; j < s.nMarkerMaps; j++) {
+        const MarkerMap &map = s.arPat.markerMapList[j];
+        vector<Marker> &detectedMarkers = detectedPerDictionary[s.arPat.mapDictionary[j]];
+
+        // The points of this map are appended to the overall vectors
+        size_t first = imgObjectPoints.size();
+        if (s.calibrationPattern == Settings::CHARUCO)
+            calcCharucoCorners(s.charuco, frame.gray(), imgImagePoints, imgObjectPoints, imgPointKeys, detectedMarkers, map);
+        else
+            calcArucoCorners(imgImagePoints,imgObjectPoints,imgPointKeys,detectedMarkers,map,j);
+
+        // The map corners are already the integer object points of the pattern, which compensate
+        // for box geometry, based on the plane list in the aruco pattern config (see toIntPoints)
+
+        // Keep the markers of this map, in the order of their points, to draw them later
+        if (overlay) {
+            for (int index:map.getIndices(detectedMarkers))
+                overlay->markers[j].push_back(detectedMarkers[index]);
+            overlay->objectPoints[j].assign(imgObjectPoints.begin() + first, imgObjectPoints.end());
+        }
+        // The corners of a CHARUCO pattern are drawn over the markers, which are drawn with their own corners
+        if (overlay && s.calibrationPattern == Settings::CHARUCO) {
+            overlay->chessboardCorners.assign(imgImagePoints.begin() + first, imgImagePoints.end());
+            overlay->objectPoints[j].clear();
+            for (auto &m:overlay->markers[j]) {
+                const Point3f *corners = map.getMarkerCorners(map.getIndexOfMarkerId(m.id));
+                overlay->objectPoints[j].insert(overlay->objectPoints[j].end(), corners, corners + 4);
+            }
+        }
+    }
+}
+
+// Prints the ArUco detection statistics of a run (see the Aruco_PrintStats setting)
+void printArucoStats(const MarkerDetector::Stats &stats)
+{
+    if (stats.nCalls == 0)
+        return;
+    double n = stats.nCalls;
+    printf("\nArUco detection of %d images, average ms per image:", stats.nCalls);
+    printf("\n  Threshold %.2f, Rectangles %.2f, Identify %.2f, Refinement %.2f, Filtering %.2f, Total %.2f",
+           stats.thresholdTime/n, stats.rectanglesTime/n, stats.identifyTime/n, stats.refineTime/n,
+           stats.filterTime/n, stats.totalTime/n);
+    printf("\n  Contours per threshold level:");
+    for (int c:stats.contoursPerLevel) printf(" %.1f", c/n);
+    printf("\n  Candidates %.1f, identified %.1f, not identified %.1f",
+           stats.nCandidates/n, stats.labelerHits/n, stats.labelerMisses/n);
+    printf("\n  Corners refined with cornerSubPix %.1f (at most %d iterations in total)\n",
+           stats.subpixCorners/n, stats.subpixMaxIterations);
+    if (stats.overBudget > 0)
+        printf("  Stopped at the time budget %d times\n", stats.overBudget);
+}
+
+// 64 bit FNV-1a hash, which can be chained by passing the previous hash
+static unsigned long long hashBytes(const void *data, size_t n, unsigned long long h = 14695981039346656037ULL)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ bytes[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Hashes the content of a file. Returns false if the file can not be read
+static bool hashFile(const string &filename, unsigned long long &h)
+{
+    ifstream file(filename.c_str(), ios::binary);
+    if (!file)
+        return false;
+    vector<char> buffer(1 << 16);
+    while (file.read(&buffer[0], buffer.size()) || file.gcount() > 0)
+        h = hashBytes(&buffer[0], (size_t)file.gcount(), h);
+    return true;
+}
+
+// Hashes an image of the list: its file, or its frame if the list is a frame container
+static bool hashListImage(const Settings &s, int index, unsigned long long &h)
+{
+    if (!s.container.isOpened())
+        return hashFile(s.imageList[index], h);
+    Mat frame = s.container.frame(index);
+    for (int r = 0; r < frame.rows; r++)
+        h = hashBytes(frame.ptr(r), frame.cols * frame.elemSize(), h);
+    return true;
+}
+
+// Hashes everything that changes the detection result of an image: the pattern, the
+// image scaling and the detector parameters. Cached detections are only valid for the same hash
+static unsigned long long detectionConfigHash(const Settings &s, const MarkerDetector &detector)
+{
+    ostringstream str;
+    str << "v1 " << s.calibrationPattern << " " << s.maxImageWidth << " " << s.minSharpness << " " << s.timeBudget << " ";
+    for (auto &coords:s.roiCoords)
+    {
+        str << "roi";
+        for (int c:coords) str << " " << c;
+        str << " ";
+    }
+    if (s.deterministic)
+        str << "deterministic ";
+    if (s.calibrationPattern != Settings::CHESSBOARD && s.arucoMapIdsOnly)
+        str << "mapIds ";
+    if (s.calibrationPattern != Settings::CHESSBOARD && s.arucoFusedFirstPass)
+        str << "fusedFirstPass ";
+    if (s.calibrationPattern != Settings::CHESSBOARD && s.arucoLowPower)
+        str << "lowPower ";
+    if (s.calibrationPattern == Settings::CHESSBOARD && s.chessboardScales > 1)
+        str << "scales " << s.chessboardScales << " ";
+    if (s.calibrationPattern == Settings::CHESSBOARD)
+        str << s.boardSize << " " << s.squareSize << " " << s.chessboardFastWidth;
+    else
+    {
+        MarkerDetector::Params params = detector.getParams();
+        str << params._thresMethod << " " << params._thresParam1 << " " << params._thresParam2 << " "
+            << params._thresParam1_range << " " << params._cornerMethod << " " << params._markerWarpSize << " "
+            << params._borderDistThres << " " << params._minSize << " " << params._maxSize << " "
+            << s.arucoBackend << " " << s.arucoCellThreshold << " " << s.arucoGuidedFaces << " " << s.arucoPyrLevel << " " << s.arucoDecimate << " " << s.arucoAdaptiveThres << " " << s.arucoFastQuad << " " << s.arPat.xOffset << " " << s.arPat.yOffset << " " << s.arPat.denominator;
+        for (int j = 0; j < s.nMarkerMaps; j++)
+        {
+            const MarkerMap &map = s.arPat.markerMapList[j];
+            str << " " << s.arPat.planeList[j] << " " << map.getDictionary();
+            for (auto &m:map)
+            {
+                str << " " << m.id;
+                for (auto p:m) str << " " << p;
+            }
+        }
+    }
+    string config = str.str();
+    return hashBytes(config.data(), config.size());
+}
+
+// Reads the cached detection of an image. Returns false if there is no cached detection
+static bool readCachedDetection(const string &filename, vector<Point2f> &imagePoints,
+                                vector<Point3f> &objectPoints, vector<int> &pointKeys, Size &imageSize)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+    fs["Image_Width"] >> imageSize.width;
+    fs["Image_Height"] >> imageSize.height;
+    fs["Image_Points"] >> imagePoints;
+    fs["Object_Points"] >> objectPoints;
+    fs["Point_Keys"] >> pointKeys;
+    return imageSize.area() > 0 && imagePoints.size() == objectPoints.size();
+}
+
+// Stores the detection of an image in the cache
+static void writeCachedDetection(const string &filename, const vector<Point2f> &imagePoints,
+                                 const vector<Point3f> &objectPoints, const vector<int> &pointKeys, Size imageSize)
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+        return;
+    fs << "Image_Width" << imageSize.width;
+    fs << "Image_Height" << imageSize.height;
+    fs << "Image_Points" << imagePoints;
+    fs << "Object_Points" << objectPoints;
+    fs << "Point_Keys" << pointKeys;
+}
+
+// Append-only file of the images completed by a batch detection (see Detection_Checkpoint), so that an interrupted
+// run is resumed without detecting them again. Each record holds an image index, its points and a checksum, and the
+// records are appended in the order the images complete. A record that was not completely written is dropped, and
+// a stereo view is only used once the records of both its images are complete
+class DetectionCheckpoint
+{
+public:
+    DetectionCheckpoint() : file(NULL), syncInterval(0), nUnsynced(0) {}
+    ~DetectionCheckpoint() { close(); }
+
+    // Opens the checkpoint file, reading the images it holds into the per image results and marking them done.
+    // A file of another image list or of other detection settings is started again. Returns false if the file
+    // can not be written
+    bool open(const Settings &s, unsigned long long configHash, vector<vector<Point2f> > &imagePoints,
+              vector<vector<Point3f> > &objectPoints, vector<vector<int> > &pointKeys, vector<Size> &imageSizes,
+              vector<char> &done)
+    {
+        close();
+        const string &filename = s.checkpointFile;
+        fileHeader h = makeHeader(s, configHash);
+        long valid = 0;
+        int nRead = 0;
+        if (FILE *in = fopen(filename.c_str(), "rb"))
+        {
+            fileHeader read;
+            if (fread(&read, sizeof(read), 1, in) == 1 && memcmp(&read, &h, sizeof(h)) == 0)
+            {
+                valid = sizeof(h);
+                record r;
+                vector<char> data;
+                while (readRecord(in, s.nImages, r, data))
+                {
+                    const char *p = &data[0];
+                    int i = r.index;
+                    imagePoints[i].assign((const Point2f *)p, (const Point2f *)p + r.nPoints);
+                    p += r.nPoints*sizeof(Point2f);
+                    objectPoints[i].assign((const Point3f *)p, (const Point3f *)p + r.nPoints);
+                    p += r.nPoints*sizeof(Point3f);
+                    pointKeys[i].assign((const int32_t *)p, (const int32_t *)p + r.nKeys);
+                    imageSizes[i] = Size(r.width, r.height);
+                    done[i] = 1;
+                    nRead++;
+                    valid = ftell(in);
+                }
+            }
+            fclose(in);
+        }
+
+        // Appends continue after the last complete record
+        if (valid > 0 && truncate(filename.c_str(), valid) == 0)
+            file = fopen(filename.c_str(), "ab");
+        else
+        {
+            nRead = 0;
+            fill(done.begin(), done.end(), 0);
+            file = fopen(filename.c_str(), "wb");
+            if (file && (fwrite(&h, sizeof(h), 1, file) != 1 || fflush(file) != 0))
+                close();
+        }
+        if (!file)
+            return false;
+        syncInterval = s.checkpointSync;
+        nUnsynced = 0;
+        if (nRead > 0)
+            printf("\nResuming from the detection checkpoint: %d of %d images already detected\n", nRead, s.nImages);
+        return true;
+    }
+
+    bool isOpened() const { return file != NULL; }
+
+    // Appends the detection of an image. Each record is flushed to the system, so it survives a crash of the
+    // program, and the file is synced to the disk every syncInterval records
+    void append(int index, const vector<Point2f> &imagePoints, const vector<Point3f> &objectPoints,
+                const vector<int> &pointKeys, Size size)
+    {
+        if (objectPoints.size() != imagePoints.size() || (!pointKeys.empty() && pointKeys.size() != imagePoints.size()))
+            return;
+        record r;
+        r.index = index;
+        r.nPoints = (int32_t)imagePoints.size();
+        r.nKeys = (int32_t)pointKeys.size();
+        r.width = size.width;
+        r.height = size.height;
+        vector<char> buf((const char *)&r, (const char *)(&r + 1));
+        appendBytes(buf, imagePoints.data(), imagePoints.size()*sizeof(Point2f));
+        appendBytes(buf, objectPoints.data(), objectPoints.size()*sizeof(Point3f));
+        appendBytes(buf, pointKeys.data(), pointKeys.size()*sizeof(int));
+        uint64_t sum = hashBytes(&buf[0], buf.size());
+        appendBytes(buf, &sum, sizeof(sum));
+
+        lock_guard<mutex> lock(m);
+        if (!file)
+            return;
+        if (fwrite(&buf[0], buf.size(), 1, file) != 1 || fflush(file) != 0)
+        {
+            cerr << "Could not write the detection checkpoint, it is not updated any more" << endl;
+            fclose(file);
+            file = NULL;
+            return;
+        }
+        if (syncInterval > 0 && ++nUnsynced >= syncInterval)
+        {
+            fsync(fileno(file));
+            nUnsynced = 0;
+        }
+    }
+
+    void close()
+    {
+        if (!file)
+            return;
+        if (syncInterval > 0)
+            fsync(fileno(file));
+        fclose(file);
+        file = NULL;
+    }
+
+private:
+    DetectionCheckpoint(const DetectionCheckpoint &);
+    DetectionCheckpoint &operator=(const DetectionCheckpoint &);
+
+    // The file starts with the image list and detection settings it was written for
+    struct fileHeader {
+        char magic[4];          // "CDCK"
+        int32_t version;
+        uint64_t configHash;    // detectionConfigHash
+        uint64_t listHash;      // Hash of the image names
+        int32_t nImages;
+        int32_t reserved;
+    };
+    // Followed by the image points, object points and point keys, and the checksum of the record
+    struct record {
+        int32_t index, nPoints, nKeys, width, height;
+    };
+
+    static fileHeader makeHeader(const Settings &s, unsigned long long configHash)
+    {
+        fileHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "CDCK", 4);
+        h.version = 1;
+        h.configHash = configHash;
+        h.listHash = hashBytes(NULL, 0);
+        for (auto &name:s.imageList)
+            h.listHash = hashBytes(name.c_str(), name.size() + 1, h.listHash);
+        h.nImages = s.nImages;
+        return h;
+    }
+
+    static void appendBytes(vector<char> &buf, const void *data, size_t n)
+    {
+        buf.insert(buf.end(), (const char *)data, (const char *)data + n);
+    }
+
+    // Reads the next record into r and its points into data. Returns false at the end of the file, or at a
+    // record that is incomplete or does not match its checksum
+    static bool readRecord(FILE *in, int nImages, record &r, vector<char> &data)
+    {
+        if (fread(&r, sizeof(r), 1, in) != 1 || r.index < 0 || r.index >= nImages || r.nPoints < 0
+                || r.nPoints > (1 << 24) || (r.nKeys != 0 && r.nKeys != r.nPoints))
+            return false;
+        size_t n = r.nPoints*(sizeof(Point2f) + sizeof(Point3f)) + r.nKeys*sizeof(int32_t);
+        data.assign((const char *)&r, (const char *)(&r + 1));
+        data.resize(sizeof(r) + n + 1);
+        uint64_t sum;
+        if ((n > 0 && fread(&data[sizeof(r)], n, 1, in) != 1) || fread(&sum, sizeof(sum), 1, in) != 1)
+            return false;
+        if (hashBytes(&data[0], sizeof(r) + n) != sum)
+            return false;
+        data.erase(data.begin(), data.begin() + sizeof(r));
+        return true;
+    }
+
+    FILE *file;
+    int syncInterval;       // Records between syncs to the disk, 0 to leave them to the system
+    int nUnsynced;
+    mutex m;
+};
+
+//------------------------------Detection shards-------------------------------//
+// The views of an image list can be detected by several runs (see Detection_ShardCount), each of which saves
+// the points of its images to a shard file. This is a correspondence store whose ids are the image indices,
+// with the ArUco point keys of its points, and the shard and hash of the detection settings it was detected with
+
+// Whether this run detects a view: every view without shards, and none when the shards are merged
+static bool detectsView(const Settings &s, int view)
+{
+    return s.shardCount <= 0 || (s.shardIndex >= 0 && view % s.shardCount == s.shardIndex);
+}
+
+static string shardFilename(const Settings &s, int index)
+{
+    char name[32];
+    sprintf(name, "_%d.bin", index);
+    return s.shardFile + name;
+}
+
+static Mat shardInfo(const Settings &s, int index, unsigned long long configHash)
+{
+    Mat info(1, 5, CV_32S);
+    int *p = info.ptr<int>();
+    p[0] = index;
+    p[1] = s.shardCount;
+    p[2] = s.nImages;
+    p[3] = (int)(configHash >> 32);
+    p[4] = (int)(configHash & 0xffffffff);
+    return info;
+}
+
+// Saves the points detected on the images of this run's shard. nViews is the number of images per view
+static bool writeShard(const Settings &s, int nViews, unsigned long long configHash, const vector<vector<Point2f> > &imagePoints,
+                       const vector<vector<Point3f> > &objectPoints, const vector<vector<int> > &pointKeys)
+{
+    correspondenceStore store;
+    vector<int> keys;
+    for (int i = 0; i < s.nImages; i++)
+        if (!imagePoints[i].empty() && detectsView(s, i/nViews))
+        {
+            store.add(i, objectPoints[i], imagePoints[i]);
+            keys.insert(keys.end(), pointKeys[i].begin(), pointKeys[i].end());
+        }
+    vector<pair<string, Mat> > mats;
+    mats.push_back(make_pair("Shard", shardInfo(s, s.shardIndex, configHash)));
+    store.toMats("", mats);
+    if (!keys.empty()) mats.push_back(make_pair("Point_Keys", Mat(keys, false)));
+    string filename = shardFilename(s, s.shardIndex);
+    if (!writeCalibrationBinary(filename, SHARD_FILE, s.imageSize, mats))
+    {
+        cerr << "Could not write detection shard: " << filename << endl;
+        return false;
+    }
+    printf("\nDetection shard %d of %d saved to %s: %d images with the pattern\n", s.shardIndex, s.shardCount,
+           filename.c_str(), store.size());
+    return true;
+}
+
+// Reads the points of every shard file into the per image results of batchDetect. The shards must have been
+// detected from the same image list, with the same detection settings
+static bool readShards(const Settings &s, unsigned long long configHash, vector<vector<Point2f> > &imagePoints,
+                       vector<vector<Point3f> > &objectPoints, vector<vector<int> > &pointKeys,
+                       vector<Size> &imageSizes, runReport &report)
+{
+    for (int k = 0; k < s.shardCount; k++)
+    {
+        string filename = shardFilename(s, k);
+        map<string, Mat> mats;
+        Size size;
+        correspondenceStore store;
+        vector<int> keys;
+        if (!readCalibrationBinary(filename, SHARD_FILE, size, mats) || !store.fromMats("", mats)
+                || !matToVector(mats["Point_Keys"], CV_32S, keys)
+                || (!keys.empty() && keys.size() != store.imagePoints[0].size()))
+        {
+            cerr << "Invalid detection shard: " << filename << endl;
+            return false;
+        }
+        Mat info = mats["Shard"], expected = shardInfo(s, k, configHash);
+        if (info.size() != expected.size() || info.type() != CV_32S || countNonZero(info != expected) > 0)
+        {
+            cerr << "Detection shard " << filename << " was detected from another image list or with other settings" << endl;
+            return false;
+        }
+        for (int v = 0; v < store.size(); v++)
+        {
+            int i = store.ids[v], begin = store.offsets[v], end = store.offsets[v+1];
+            if (i < 0 || i >= s.nImages)
+            {
+                cerr << "Invalid detection shard: " << filename << endl;
+                return false;
+            }
+            imagePoints[i].assign(store.imagePoints[0].begin() + begin, store.imagePoints[0].begin() + end);
+            objectPoints[i].assign(store.objectPoints.begin() + store.objectOffsets[v],
+                                   store.objectPoints.begin() + store.objectOffsets[v] + store.count(v));
+            if (!keys.empty()) pointKeys[i].assign(keys.begin() + begin, keys.begin() + end);
+            imageSizes[i] = size;
+            report.detected(i, s.imageList[i], 0, store.count(v), true);
+        }
+    }
+    printf("\n%d detection shards merged", s.shardCount);
+    return true;
+}
+
+//------------------------------Correspondence database-----------------------//
+// The points of every image of a run can be kept in a correspondence database (see CorrespondenceDB_File), and
+// a database can be the image list of a later run, whose views are then read from it instead of being detected
+
+// Appends the points detected on the images of this run to the database. nViews is the number of images per view
+static void appendCorrespondences(const Settings &s, int nViews, unsigned long long configHash,
+                                  const vector<vector<Point2f> > &imagePoints, const vector<vector<Point3f> > &objectPoints,
+                                  const vector<vector<int> > &pointKeys, const vector<Size> &imageSizes)
+{
+    correspondenceDBWriter db;
+    if (!db.open(s.correspondenceDBFile, (int64_t)time(NULL)))
+    {
+        printf("\nThe correspondence database could not be used. Invalid file: %s\n", s.correspondenceDBFile.c_str());
+        return;
+    }
+    for (int i = 0; i < s.nImages; i++)
+        if (!db.append(s.cameraName, i/nViews, i % nViews, nViews, imageSizes[i], configHash, s.imageList[i],
+                       imagePoints[i], objectPoints[i], pointKeys[i]))
+        {
+            printf("\nThe correspondence database could not be written: %s\n", s.correspondenceDBFile.c_str());
+            return;
+        }
+    printf("\n%d images added to the correspondence database %s\n", s.nImages, s.correspondenceDBFile.c_str());
+}
+
+// Reads the points of the images of a correspondence database into the per image results of batchDetect
+static bool readCorrespondences(const Settings &s, vector<vector<Point2f> > &imagePoints,
+                                vector<vector<Point3f> > &objectPoints, vector<vector<int> > &pointKeys,
+                                vector<Size> &imageSizes, vector<char> &done)
+{
+    for (int i = 0; i < s.nImages; i++)
+    {
+        const correspondenceDB::entry &e = s.correspondenceImages[i];
+        if (!s.correspondences.points(e, imagePoints[i], objectPoints[i], pointKeys[i]))
+        {
+            cerr << "Invalid record of the correspondence database: " << e.name << endl;
+            return false;
+        }
+        imageSizes[i] = e.size;
+        done[i] = 1;
+    }
+    set<long long> sessions;
+    for (auto &e:s.correspondenceImages) sessions.insert(e.session);
+    printf("\n%d images of %d sessions read from the correspondence database, from %s to %s\n", s.nImages,
+           (int)sessions.size(), correspondenceDB::sessionTime(*sessions.begin()).c_str(),
+           correspondenceDB::sessionTime(*sessions.rbegin()).c_str());
+    return true;
+}
+
+// Detects the pattern on every image of the image list without any display, decoding and
+// detecting several images at once. Results are merged in image order afterwards, so the
+// calibration input does not depend on which thread finished first. cals holds the struct
+// of each camera (one, two for STEREO, or the rig cameras for MULTI). Returns false if
+// the detection shards could not be written or merged
+bool batchDetect(Settings &s, const vector<intrinsicCalibration*> &cals, ImageWriter &writer, FrameStore &frames,
+                 bool save, runReport &report)
+{
+    runReport::stage timing(report, "Detection");
+    int nViews = (int)cals.size();      // images per calibration view
+    int size = s.nImages/nViews;
+    intrinsicCalibration &inCal = *cals[0], &inCal2 = *cals.back();
+
+    // Per image detection results, filled in parallel
+    vector<vector<Point2f> > imagePoints(s.nImages);
+    vector<vector<Point3f> > objectPoints(s.nImages);
+    vector<vector<int> > pointKeys(s.nImages);
+    vector<Size> imageSizes(s.nImages);
+
+    // One persistent detector per thread, single threaded so the images detected at once do not oversubscribe the cores
+    vector<MarkerDetector> detectors(s.batchThreads);
+    if (s.calibrationPattern != Settings::CHESSBOARD)
+        for (auto &d:detectors) setupArucoDetector(s, d, 1);
+
+    // Images are looked up in the detection cache by the hash of their content and of the detection setup
+    bool useCache = false;
+    if (s.detectionCachePath != "0")
+    {
+        if (pathCheck(s.detectionCachePath))
+            useCache = true;
+        else
+            printf("\nDetection cache could not be used. Invalid path: %s\n", s.detectionCachePath.c_str());
+    }
+    unsigned long long configHash = detectionConfigHash(s, detectors[0]);
+    int nCached = 0;
+
+    // Merging the shards replaces the detection
+    if (s.shardCount > 0 && s.shardIndex < 0
+            && !readShards(s, configHash, imagePoints, objectPoints, pointKeys, imageSizes, report))
+        return false;
+
+    // The images completed by an earlier run that was interrupted are read from the checkpoint, and those of a
+    // correspondence database are all read from it
+    vector<char> done(s.nImages, 0);
+    bool replay = s.correspondences.isOpened();
+    if (replay && !readCorrespondences(s, imagePoints, objectPoints, pointKeys, imageSizes, done))
+        return false;
+    DetectionCheckpoint checkpoint;
+    if (s.checkpointFile != "0" && !replay && !(s.shardCount > 0 && s.shardIndex < 0)
+            && !checkpoint.open(s, configHash, imagePoints, objectPoints, pointKeys, imageSizes, done))
+        printf("\nDetection checkpoint could not be used. Invalid file: %s\n", s.checkpointFile.c_str());
+
+    #pragma omp parallel for schedule(dynamic) num_threads(s.batchThreads) reduction(+:nCached)
+    for (int i = 0; i < s.nImages; i++)
+    {
+        threadAffinity::pinWorker(omp_get_thread_num());   // A thread decodes and detects its images on one core
+        pipelineTrace::scope trace("image", i);
+        if (!detectsView(s, i/nViews))
+        {
+            s.skipListImage(i);
+            continue;
+        }
+        if (done[i])
+        {
+            s.skipListImage(i);
+            report.detected(i, s.imageList[i], 0, (int)imagePoints[i].size(), true);
+            continue;
+        }
+
+        // A cache hit skips both decoding and detection (the detected image is not saved either)
+        string cacheFile;
+        unsigned long long h = configHash;
+        if (useCache && hashListImage(s, i, h))
+        {
+            char name[32];
+            sprintf(name, "%016llx.yml", h);
+            cacheFile = s.detectionCachePath + name;
+            if (readCachedDetection(cacheFile, imagePoints[i], objectPoints[i], pointKeys[i], imageSizes[i]))
+            {
+                s.skipListImage(i);
+                report.detected(i, s.imageList[i], 0, (int)imagePoints[i].size(), true);
+                if (checkpoint.isOpened())
+                    checkpoint.append(i, imagePoints[i], objectPoints[i], pointKeys[i], imageSizes[i]);
+                nCached++;
+                continue;
+            }
+            imagePoints[i].clear();
+            objectPoints[i].clear();
+            pointKeys[i].clear();
+        }
+
+        // Color is only needed to draw the saved images, or to undistort them afterwards
+        allocCounts allocStart = allocStats::thread();
+        imageFrame image;
+        image.camera = i % nViews;
+        image.img = s.readListImage(i, save || frameStoreFlags(s) == CV_LOAD_IMAGE_COLOR ?
+                                       CV_LOAD_IMAGE_COLOR : CV_LOAD_IMAGE_GRAYSCALE);
+        Mat &img = image.img;
+        if (!img.data)
+        {
+            fprintf(stderr, "Could not read image: %s\n", s.imageList[i].c_str());
+            report.detected(i, s.imageList[i], 0, 0, false, false);
+            continue;
+        }
+        imageSizes[i] = img.size();
+        frames.put(i, img, save);      // The saved images are drawn on
+
+        // Each image is detected into its own struct, with a single points vector for ArUco
+        intrinsicCalibration imgCal;
+        patternOverlay overlay;
+        int64 start = getTickCount();
+        string skipReason;
+        bool screened = prescreenFrame(s, image, skipReason);
+        if (!screened)
+            cacheFile.clear();      // Only detections are cached
+        else if (s.calibrationPattern == Settings::CHESSBOARD)
+            chessboardDetect(s, image, imgCal, save ? &overlay : NULL);
+        else
+        {
+            imgCal.imagePoints.resize(1);
+            imgCal.objectPoints.resize(1);
+            imgCal.pointKeys.resize(1);
+            arucoDetect(s, detectors[omp_get_thread_num()], image, imgCal, 0, save ? &overlay : NULL);
+        }
+        // A detection cut short depends on the timing, so it is reported as skipped and not cached
+        if (image.overBudget)
+        {
+            screened = false;
+            skipReason = "over the detection time budget";
+            cacheFile.clear();
+        }
+        if (!imgCal.imagePoints.empty())
+        {
+            imagePoints[i].swap(imgCal.imagePoints[0]);
+            objectPoints[i].swap(imgCal.objectPoints[0]);
+            if (!imgCal.pointKeys.empty()) pointKeys[i].swap(imgCal.pointKeys[0]);
+        }
+        report.detected(i, s.imageList[i], runReport::elapsedMs(start), (int)imagePoints[i].size(), false);
+        report.allocated(i, allocStats::thread() - allocStart);
+        if (!screened)
+            report.skipped(i, skipReason);
+        if (!cacheFile.empty())
+            writeCachedDetection(cacheFile, imagePoints[i], objectPoints[i], pointKeys[i], imageSizes[i]);
+        if (checkpoint.isOpened() && !image.overBudget)     // A resumed run detects it again
+            checkpoint.append(i, imagePoints[i], objectPoints[i], pointKeys[i], imageSizes[i]);
+
+        // If a valid path for detected images has been provided, save them to this path
+        if (save)
+        {
+            char imgSave[1000];
+            if (s.container.owns(img)) img = img.clone();     // Container frames are read only
+            drawOverlay(s, img, overlay);
+            sprintf(imgSave, "%sdetected_%d", s.detectedPath.c_str(), i);
+            writer.write(imgSave, img);
+        }
+    }
+
+    for (int i = 0; i < s.nImages; i++)
+        if (imageSizes[i].area() > 0)
+        {
+            s.imageSize = imageSizes[i];
+            break;
+        }
+    if (s.shardCount > 0 && s.shardIndex >= 0)
+        return writeShard(s, nViews, configHash, imagePoints, objectPoints, pointKeys);
+    if (s.correspondenceDBFile != "0" && !replay)
+        appendCorrespondences(s, nViews, configHash, imagePoints, objectPoints, pointKeys, imageSizes);
+
+    // Merge the results in image order. For stereo, the even images are the left view
+    int nFound = 0;
+    for (int v = 0; v < size; v++)
+    {
+        int left = v*nViews, right = left + nViews - 1;
+        if (s.mode == Settings::MULTI)
+        {
+            // The rig is solved with the views of each camera, so every detection is kept. The
+            // vectors of every pattern are sized beforehand
+            bool found = false;
+            for (int c = 0; c < nViews; c++)
+            {
+                found |= !imagePoints[left + c].empty();
+                cals[c]->imagePoints[v].swap(imagePoints[left + c]);
+                cals[c]->objectPoints[v].swap(objectPoints[left + c]);
+                if (!cals[c]->pointKeys.empty()) cals[c]->pointKeys[v].swap(pointKeys[left + c]);
+            }
+            if (!found)
+                continue;
+        }
+        else if (s.calibrationPattern == Settings::CHESSBOARD)
+        {
+            // A chessboard view is only usable if the board has been found in every image of it
+            if (imagePoints[left].empty() || imagePoints[right].empty())
+            {
+                report.reject(left, "pattern not found in the other image of the view");
+                report.reject(right, "pattern not found in the other image of the view");
+                continue;
+            }
+            inCal.imagePoints.push_back(vector<Point2f>());
+            inCal.objectPoints.push_back(vector<Point3f>());
+            inCal.imagePoints.back().swap(imagePoints[left]);
+            inCal.objectPoints.back().swap(objectPoints[left]);
+            inCal.imageIndex.push_back(left);
+            if (s.mode == Settings::STEREO)
+            {
+                inCal2.imagePoints.push_back(vector<Point2f>());
+                inCal2.objectPoints.push_back(vector<Point3f>());
+                inCal2.imagePoints.back().swap(imagePoints[right]);
+                inCal2.objectPoints.back().swap(objectPoints[right]);
+                inCal2.imageIndex.push_back(right);
+            }
+        }
+        else        // ArUco vectors are sized beforehand, one element per view
+        {
+            if (imagePoints[left].empty() || imagePoints[right].empty())
+            {
+                report.reject(left, "pattern not found in the other image of the view");
+                report.reject(right, "pattern not found in the other image of the view");
+                continue;
+            }
+            inCal.imagePoints[v].swap(imagePoints[left]);
+            inCal.objectPoints[v].swap(objectPoints[left]);
+            inCal.pointKeys[v].swap(pointKeys[left]);
+            if (s.mode == Settings::STEREO)
+            {
+                inCal2.imagePoints[v].swap(imagePoints[right]);
+                inCal2.objectPoints[v].swap(objectPoints[right]);
+                inCal2.pointKeys[v].swap(pointKeys[right]);
+            }
+        }
+        nFound++;
+    }
+    if (s.arucoStats && s.calibrationPattern != Settings::CHESSBOARD)
+    {
+        MarkerDetector::Stats stats;
+        for (auto &d:detectors) stats.add(d.getTotalStats());
+        printArucoStats(stats);
+    }
+    if (useCache)
+        printf("\n%d of %d images read from the detection cache", nCached, s.nImages);
+    printf("\nPattern detected in %d of %d views\n", nFound, size);
+    return true;
+}
+
+
+//--------------------Running and saving functions----------------------------//
+// Computes the undistortion maps of a set of intrinsics, unless they are already computed
+// for this image size. Images are then undistorted with remap, without rebuilding the maps
+static void updateUndistortMaps(const Mat &cameraMatrix, const Mat &distCoeffs, Size size, Mat (&maps)[2])
+{
+    if (!maps[0].empty() && maps[0].size() == size)
+        return;
+    initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(), cameraMatrix, size,
+                            CV_16SC2, maps[0], maps[1]);
+}
+
+// remap of the fixed point maps of updateUndistortMaps (CV_16SC2 and CV_16UC1) in tiles of Remap_TileSize
+// pixels. Each tile is remapped from the bounding box of the input pixels its maps read, so the tile and its
+// input stay in cache even where the distortion is strong. Tiles run in parallel (nested in the parallel
+// exports, they run on the calling thread). Other maps, and a tile size of 0, remap the image at once
+static void tiledRemap(const Settings &s, const Mat &img, Mat &out, const Mat &map1, const Mat &map2)
+{
+    int t = s.remapTileSize;
+    if (t <= 0 || map1.type() != CV_16SC2 || (map1.cols <= t && map1.rows <= t))
+    {
+        remap(img, out, map1, map2, CV_INTER_LINEAR);
+        return;
+    }
+    out.create(map1.size(), img.type());
+    int nx = (map1.cols + t - 1)/t, ny = (map1.rows + t - 1)/t;
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nx*ny; k++)
+    {
+        Rect tile((k%nx)*t, (k/nx)*t, 0, 0);
+        tile.width = min(t, map1.cols - tile.x);
+        tile.height = min(t, map1.rows - tile.y);
+        Mat m1 = map1(tile), m2 = map2.empty() ? Mat() : map2(tile), dst = out(tile);
+
+        // The integer parts of the map are the top left pixels of the bilinear interpolation
+        int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+        for (int y = 0; y < m1.rows; y++)
+        {
+            const short *p = m1.ptr<short>(y);
+            for (int x = 0; x < m1.cols; x++)
+            {
+                x0 = min(x0, (int)p[2*x]);
+                x1 = max(x1, (int)p[2*x]);
+                y0 = min(y0, (int)p[2*x+1]);
+                y1 = max(y1, (int)p[2*x+1]);
+            }
+        }
+        Rect box = Rect(x0, y0, x1 - x0 + 2, y1 - y0 + 2) & Rect(0, 0, img.cols, img.rows);
+        if (box.area() == 0)
+        {
+            dst.setTo(Scalar::all(0));      // The whole tile maps outside of the image
+            continue;
+        }
+        // The input box is treated as the whole image, so pixels outside of it are the constant border,
+        // as they are outside of the image. The maps are moved to the box
+        Mat shifted;
+        subtract(m1, Scalar(box.x, box.y), shifted);
+        remap(img(box), dst, shifted, m2, CV_INTER_LINEAR);
+    }
+}
+
+// Computes the sparse map of an undistortion (R empty and P the camera matrix) or a rectification. The nodes are
+// the map of an image smaller by step, with the projection scaled down by step, so they keep full resolution
+// input positions
+static void buildMapGrid(const Mat &cameraMatrix, const Mat &distCoeffs, const Mat &R, const Mat &P, Size size,
+                         int step, mapGrid &grid)
+{
+    Mat Ps, unused;
+    P.convertTo(Ps, CV_64F);
+    Ps.rowRange(0, 2) *= 1./step;
+    initUndistortRectifyMap(cameraMatrix, distCoeffs, R, Ps, Size((size.width - 1)/step + 2, (size.height - 1)/step + 2),
+                            CV_32FC2, grid.points, unused);
+    grid.step = step;
+    grid.size = size;
+}
+
+// Distorts an ideal point with the 8 coefficient model of OpenCV (k1 k2 p1 p2 k3 k4 k5 k6)
+static Point2d distortIdeal(const double *k, double x, double y)
+{
+    double r2 = x*x + y*y, r4 = r2*r2, r6 = r4*r2;
+    double radial = (1 + k[0]*r2 + k[1]*r4 + k[4]*r6) / (1 + k[5]*r2 + k[6]*r4 + k[7]*r6);
+    return Point2d(x*radial + 2*k[2]*x*y + k[3]*(r2 + 2*x*x), y*radial + k[2]*(r2 + 2*y*y) + 2*k[3]*x*y);
+}
+
+// Samples the distortion of a camera every step input pixels (near the center) over the ideal points of its
+// images: those of the undistorted image border, with a tenth of their extent added on each side. Returns false,
+// with the table cleared, for intrinsics the table can not hold (skew, or more than 8 coefficients)
+static bool buildDistortionTable(const Mat &cameraMatrix, const Mat &distCoeffs, Size size, int step,
+                                 distortionTable &table)
+{
+    table = distortionTable();
+    Mat K, d;
+    cameraMatrix.convertTo(K, CV_64F);
+    distCoeffs.convertTo(d, CV_64F);
+    d = d.reshape(1, (int)d.total());
+    if (K.total() != 9 || K.at<double>(0, 1) != 0 || d.total() > 8)
+        return false;
+    double k[8] = { 0 };
+    for (int j = 0; j < (int)d.total(); j++) k[j] = d.at<double>(j);
+
+    vector<Point2f> border, ideal;
+    for (int j = 0; j <= 64; j++)
+    {
+        float x = j*(size.width - 1)/64.f, y = j*(size.height - 1)/64.f;
+        border.push_back(Point2f(x, 0));
+        border.push_back(Point2f(x, (float)(size.height - 1)));
+        border.push_back(Point2f(0, y));
+        border.push_back(Point2f((float)(size.width - 1), y));
+    }
+    undistortPoints(border, ideal, K, d);
+    double x0 = DBL_MAX, y0 = DBL_MAX, x1 = -DBL_MAX, y1 = -DBL_MAX;
+    for (auto &p:ideal)
+    {
+        x0 = min(x0, (double)p.x);
+        x1 = max(x1, (double)p.x);
+        y0 = min(y0, (double)p.y);
+        y1 = max(y1, (double)p.y);
+    }
+    double fx = K.at<double>(0, 0), fy = K.at<double>(1, 1), cx = K.at<double>(0, 2), cy = K.at<double>(1, 2);
+    double mx = (x1 - x0)/10, my = (y1 - y0)/10;
+    table.stepX = step/fx;
+    table.stepY = step/fy;
+    table.origin = Point2d(x0 - mx, y0 - my);
+    table.points.create((int)ceil((y1 - y0 + 2*my)/table.stepY) + 2, (int)ceil((x1 - x0 + 2*mx)/table.stepX) + 2,
+                        CV_32FC2);
+    #pragma omp parallel for schedule(static)
+    for (int r = 0; r < table.points.rows; r++)
+    {
+        Point2f *node = table.points.ptr<Point2f>(r);
+        for (int c = 0; c < table.points.cols; c++)
+        {
+            Point2d p = distortIdeal(k, table.origin.x + c*table.stepX, table.origin.y + r*table.stepY);
+            node[c] = Point2f((float)(fx*p.x + cx), (float)(fy*p.y + cy));
+        }
+    }
+    table.step = step;
+    table.size = size;
+    table.cameraMatrix = K;
+    table.distCoeffs = d;
+    return true;
+}
+
+// The fixed point maps of initUndistortRectifyMap (CV_16SC2 and CV_16UC1) for a rectification R and P, looked up
+// in a distortion table. The homography of R and P gives the ideal point of each output pixel, incrementally along
+// its row, and its input position is interpolated between the nodes around it. Pixels beyond the table or behind
+// the camera map outside of the input, so they take the border color
+static void tableRectifyMaps(const distortionTable &table, const Mat &R, const Mat &P, Size size, Mat &map1, Mat &map2)
+{
+    Mat Rd = Mat::eye(3, 3, CV_64F), Pd;
+    if (!R.empty())
+        R.convertTo(Rd, CV_64F);
+    P.colRange(0, 3).convertTo(Pd, CV_64F);
+    Matx33d H = (Mat)(Pd * Rd).inv(DECOMP_LU);
+    map1.create(size, CV_16SC2);
+    map2.create(size, CV_16UC1);
+    int cols = table.points.cols - 1, rows = table.points.rows - 1;
+    double isx = 1/table.stepX, isy = 1/table.stepY;
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < size.height; y++)
+    {
+        short *m1 = map1.ptr<short>(y);
+        ushort *m2 = map2.ptr<ushort>(y);
+        double X = H(0, 1)*y + H(0, 2), Y = H(1, 1)*y + H(1, 2), W = H(2, 1)*y + H(2, 2);
+        for (int x = 0; x < size.width; x++, X += H(0, 0), Y += H(1, 0), W += H(2, 0))
+        {
+            float u = -1, v = -1;
+            if (W > 0)
+            {
+                double gx = (X/W - table.origin.x)*isx, gy = (Y/W - table.origin.y)*isy;
+                if (gx >= 0 && gy >= 0 && gx < cols && gy < rows)
+                {
+                    int ix = (int)gx, iy = (int)gy;
+                    float wx = (float)(gx - ix), wy = (float)(gy - iy);
+                    const Point2f *top = table.points.ptr<Point2f>(iy) + ix, *bottom = table.points.ptr<Point2f>(iy + 1) + ix;
+                    Point2f a = top[0] + (top[1] - top[0])*wx, b = bottom[0] + (bottom[1] - bottom[0])*wx;
+                    Point2f p = a + (b - a)*wy;
+                    u = p.x;
+                    v = p.y;
+                }
+            }
+            int iu = saturate_cast<int>(u*INTER_TAB_SIZE), iv = saturate_cast<int>(v*INTER_TAB_SIZE);
+            m1[2*x] = saturate_cast<short>(iu >> INTER_BITS);
+            m1[2*x+1] = saturate_cast<short>(iv >> INTER_BITS);
+            m2[x] = (ushort)((iv & (INTER_TAB_SIZE - 1))*INTER_TAB_SIZE + (iu & (INTER_TAB_SIZE - 1)));
+        }
+    }
+}
+
+// Builds the distortion table of a camera with Rectify_TableStep, unless it already has one for its intrinsics
+static void updateDistortionTable(const Settings &s, intrinsicCalibration &cal)
+{
+    if (s.rectifyTableStep <= 0 || (cal.distortTable.step == s.rectifyTableStep
+                                    && cal.distortTable.fits(cal.cameraMatrix, cal.distCoeffs, s.imageSize)))
+        return;
+    buildDistortionTable(cal.cameraMatrix, cal.distCoeffs, s.imageSize, s.rectifyTableStep, cal.distortTable);
+}
+
+// Fixed point rectification maps of a camera (CV_16SC2 and CV_16UC1), from its distortion table if it has one for
+// its intrinsics, or else from initUndistortRectifyMap
+static void rectifyMaps(const Settings &s, const intrinsicCalibration &cal, const Mat &R, const Mat &P, Size size,
+                        Mat &map1, Mat &map2)
+{
+    if (cal.distortTable.fits(cal.cameraMatrix, cal.distCoeffs, s.imageSize))
+        tableRectifyMaps(cal.distortTable, R, P, size, map1, map2);
+    else
+        initUndistortRectifyMap(cal.cameraMatrix, cal.distCoeffs, R, P, size, CV_16SC2, map1, map2);
+}
+
+// remap with a sparse map. The map of each tile of Remap_TileSize pixels (256 without tiles) is interpolated
+// from the nodes around it and the tile is remapped right away, so the full map is never built, and the map
+// of a tile is still in cache when it is read. Tiles run in parallel, as in tiledRemap
+static void gridRemap(const Settings &s, const Mat &img, Mat &out, const mapGrid &grid)
+{
+    pipelineTrace::scope trace("remap");
+    int t = s.remapTileSize > 0 ? s.remapTileSize : 256, step = grid.step;
+    out.create(grid.size, img.type());
+    int nx = (out.cols + t - 1)/t, ny = (out.rows + t - 1)/t;
+    float inv = 1.f/step;
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nx*ny; k++)
+    {
+        Rect tile((k%nx)*t, (k/nx)*t, 0, 0);
+        tile.width = min(t, out.cols - tile.x);
+        tile.height = min(t, out.rows - tile.y);
+        Mat map(tile.size(), CV_32FC2), dst = out(tile);
+        for (int y = 0; y < tile.height; y++)
+        {
+            int gy = (tile.y + y)/step;
+            float wy = ((tile.y + y)%step)*inv;
+            const Point2f *top = grid.points.ptr<Point2f>(gy), *bottom = grid.points.ptr<Point2f>(gy + 1);
+            Point2f *m = map.ptr<Point2f>(y);
+            for (int x = 0; x < tile.width; x++)
+            {
+                int gx = (tile.x + x)/step;
+                float wx = ((tile.x + x)%step)*inv;
+                Point2f a = top[gx] + (top[gx+1] - top[gx])*wx, b = bottom[gx] + (bottom[gx+1] - bottom[gx])*wx;
+                m[x] = a + (b - a)*wy;
+            }
+        }
+        remap(img, dst, map, Mat(), CV_INTER_LINEAR);
+    }
+}
+
+// remap with a pair of maps, on the OpenCL device if asked for (Export_UseOpenCL) and possible. The maps are
+// uploaded once by open, and images of another size than the maps are remapped on the CPU with maps of their own
+class exportRemap
+{
+public:
+    exportRemap() : settings(NULL), onDevice(false) {}
+
+    // inputSize is the size of the images the maps read, if the maps only cover a part of the output
+    void open(const Settings &s, const Mat &map1, const Mat &map2, Size inputSize = Size())
+    {
+        settings = &s;
+        maps[0] = map1;
+        maps[1] = map2;
+        input = inputSize.area() > 0 ? inputSize : map1.size();
+        onDevice = false;
+#if CV_MAJOR_VERSION >= 3
+        if (s.exportOpenCL && cv::ocl::useOpenCL())
+        {
+            map1.copyTo(device[0]);
+            map2.copyTo(device[1]);
+            onDevice = true;
+        }
+#else
+        if (s.exportOpenCL)
+            printf("\nExport_UseOpenCL needs OpenCV 3 or later, the images are remapped on the CPU\n");
+#endif
+    }
+    bool isOnDevice() const { return onDevice; }
+
+    // Remaps img into a new out. maps are the CPU maps to use for images of another size (see updateUndistortMaps)
+    void remap(const Mat &img, Mat &out, const Mat (&cpuMaps)[2]) const
+    {
+        pipelineTrace::scope trace("remap");
+#if CV_MAJOR_VERSION >= 3
+        if (onDevice && img.size() == input)
+        {
+            try {
+                UMat result;
+                cv::remap(img.getUMat(ACCESS_READ), result, device[0], device[1], CV_INTER_LINEAR);
+                result.copyTo(out);
+                return;
+            }
+            catch (cv::Exception &) {}      // The device failed, the CPU remaps this image
+        }
+#endif
+        tiledRemap(*settings, img, out, cpuMaps[0], cpuMaps[1]);
+    }
+
+private:
+    const Settings *settings;   // settings with the remap tile size, which must outlive the remap
+    Mat maps[2];
+    Size input;
+#if CV_MAJOR_VERSION >= 3
+    UMat device[2];
+#endif
+    bool onDevice;
+};
+
+// Runs two independent tasks at once, the second one on its own thread.
+// An exception thrown by either task is rethrown in the calling thread
+template <class Task1, class Task2>
+void runConcurrently(Task1 first, Task2 second)
+{
+    exception_ptr error;
+    thread worker([&]() {
+        try { second(); }
+        catch (...) { error = current_exception(); }
+    });
+    try { first(); }
+    catch (...) { worker.join(); throw; }
+    worker.join();
+    if (error) rethrow_exception(error);
+}
+
+// Number of threads of the exports that are not shown (see Settings::exportThreads)
+static int exportThreads(const Settings &s)
+{
+    if (s.exportThreads > 0)
+        return s.exportThreads;
+    return s.batchThreads > 0 ? s.batchThreads : omp_get_max_threads();
+}
+
+// Correct an images radial distortion using a set of intrinsic parameters
+static void undistortImages(const Settings &s, intrinsicCalibration &inCal, ImageWriter &writer, FrameStore &frames)
+{
+    char imgSave[1000];
+
+    bool save = false;
+    if(s.undistortedPath != "0" && s.mode != Settings::PREVIEW)
+    {
+        if( pathCheck(s.undistortedPath) )
+            save = true;
+        else
+            printf("\nUndistorted images could not be saved. Invalid path: %s\n", s.undistortedPath.c_str());
+    }
+
+    // The maps are computed even if no image is undistorted, as they are saved with the intrinsics. With
+    // Map_GridStep, only the sparse map is computed, and images of another size get their own full maps
+    if (s.mapGridStep > 0)
+        buildMapGrid(inCal.cameraMatrix, inCal.distCoeffs, Mat(), inCal.cameraMatrix, s.imageSize, s.mapGridStep,
+                     inCal.undistortGrid);
+    else
+        updateUndistortMaps(inCal.cameraMatrix, inCal.distCoeffs, s.imageSize, inCal.undistortMap);
+    if (!save && !s.showUndistorted)
+        return;
+
+    // Nothing is shown, so the images are read and undistorted on the export threads while the writer
+    // encodes the previous ones: reading, remapping and writing of different images overlap. Without a
+    // writer queue, each thread encodes and writes its own images. The file names keep the list order.
+    // Each thread starts from the shared maps, and only computes its own for images of another size
+    if (!s.showUndistorted)
+    {
+        exportRemap device;
+        if (s.mapGridStep == 0)
+            device.open(s, inCal.undistortMap[0], inCal.undistortMap[1]);
+        #pragma omp parallel for schedule(dynamic) num_threads(exportThreads(s))
+        for (int i = 0; i < s.nImages; i++)
+        {
+            pipelineTrace::scope trace("undistort", i);
+            Mat img = rereadImage(s, frames, i, CV_LOAD_IMAGE_COLOR), Uimg;
+            if (!img.data)
+                continue;
+            if (inCal.undistortGrid.fits(img.size()))
+                gridRemap(s, img, Uimg, inCal.undistortGrid);
+            else
+            {
+                Mat maps[2] = { inCal.undistortMap[0], inCal.undistortMap[1] };
+                updateUndistortMaps(inCal.cameraMatrix, inCal.distCoeffs, img.size(), maps);
+                device.remap(img, Uimg, maps);
+            }
+            char name[1000];
+            sprintf(name, "%sundistorted_%d", s.undistortedPath.c_str(), i);
+            writer.write(name, Uimg);
+        }
+        return;
+    }
+
+    display::open("Undistorted");
+    for( int i = 0; i < s.nImages; i++ )
+    {
+        Mat img = rereadImage(s, frames, i, CV_LOAD_IMAGE_COLOR), Uimg;  // new buffers, queued images are not overwritten
+        if (!img.data)      // Streamed video frames can only be undistorted from the frame store
+            continue;
+        if (inCal.undistortGrid.fits(img.size()))
+            gridRemap(s, img, Uimg, inCal.undistortGrid);
+        else
+        {
+            updateUndistortMaps(inCal.cameraMatrix, inCal.distCoeffs, img.size(), inCal.undistortMap);
+            tiledRemap(s, img, Uimg, inCal.undistortMap[0], inCal.undistortMap[1]);
+        }
+
+        // If a valid path for undistorted images has been provided, save them to this path
+        if(save)
+        {
+            sprintf(imgSave, "%sundistorted_%d", s.undistortedPath.c_str(), i);
+            writer.write(imgSave, Uimg);
+        }
+
+        display::show("Undistorted", Uimg);
+        char c = (char)display::waitKey();
+        if( (c & 255) == 27 || c == 'q' || c == 'Q' )   //escape key or 'q'
+            break;
+    }
+    display::close("Undistorted");
+}
+
+// Rectifies the area of one view in horizontal bands of Rectify_BandRows rows, without the full resolution maps.
+// The maps of each band are computed with the projection moved to the band, and the band is remapped from the
+// input rows its maps read, so only the maps of one band exist at a time
+static void rectifyBands(const Settings &s, const intrinsicCalibration &cal, const Mat &R, const Mat &P,
+                         const Mat &img, Mat &out, Rect area)
+{
+    pipelineTrace::scope trace("remap");
+    out.create(area.size(), img.type());
+    Mat maps[2];
+    for (int y = 0; y < out.rows; y += s.rectifyBandRows)
+    {
+        Mat band = out.rowRange(y, min(out.rows, y + s.rectifyBandRows)), Pb = P.clone();
+        Pb.at<double>(0, 2) -= area.x;
+        Pb.at<double>(1, 2) -= area.y + y;
+        rectifyMaps(s, cal, R, Pb, band.size(), maps[0], maps[1]);
+
+        // The integer parts of the map are the top rows of the bilinear interpolation
+        int y0 = INT_MAX, y1 = INT_MIN;
+        for (int r = 0; r < maps[0].rows; r++)
+        {
+            const short *p = maps[0].ptr<short>(r);
+            for (int x = 0; x < maps[0].cols; x++)
+            {
+                y0 = min(y0, (int)p[2*x+1]);
+                y1 = max(y1, (int)p[2*x+1]);
+            }
+        }
+        y0 = max(y0, 0);
+        y1 = min(y1 + 2, img.rows);
+        if (y1 <= y0)
+        {
+            band.setTo(Scalar::all(0));     // The whole band maps outside of the image
+            continue;
+        }
+        subtract(maps[0], Scalar(0, y0), maps[0]);
+        remap(img.rowRange(y0, y1), band, maps[0], maps[1], CV_INTER_LINEAR);
+    }
+}
+
+// Rectifies an image pair using a set of extrinsic stereo parameters
+// Both views of a pair are processed at once, each on its own thread. The full resolution
+// rectification (rmap) is only computed when the images are saved. The preview is remapped
+// straight from the input image into the canvas, with maps computed for the canvas size. With
+// Rectify_BandRows, the saved images are rectified in bands instead (see rectifyBands).
+// With Rectify_CropToValidRoi, only the region valid in both views is remapped and saved, and with
+// RectifiedImages_Container the pairs are also written to one frame container, for stereo matching
+void rectifyImages(const Settings &s, const intrinsicCalibration &inCal,
+                   const intrinsicCalibration &inCal2, const stereoCalibration &sterCal,
+                   ImageWriter &writer, FrameStore &frames)
+{
+    const Mat *P[2] = { &sterCal.P1, &sterCal.P2 }, *R[2] = { &sterCal.R1, &sterCal.R2 };
+    const intrinsicCalibration *cal[2] = { &inCal, &inCal2 };
+
+    bool save = false;
+    if(s.rectifiedPath != "0")
+    {
+        if( pathCheck(s.rectifiedPath) )
+            save = true;
+        else
+            printf("\nRectified images could not be saved. Invalid path: %s\n", s.rectifiedPath.c_str());
+    }
+    if (!save && s.rectifiedContainer == "0" && !s.showRectified)
+        return;
+
+    // The region valid in both views. It is the same for both, so the rows of a pair stay aligned and the
+    // disparities are unchanged
+    Rect full(Point(0, 0), s.imageSize), crop = full;
+    if (s.cropRectified)
+    {
+        crop = sterCal.validRoi[0] & sterCal.validRoi[1] & full;
+        if (crop.area() == 0)
+        {
+            printf("\nThe valid regions of the rectified views do not overlap, the images are not cropped\n");
+            crop = full;
+        }
+    }
+    // Maps of the cropped region only, so nothing outside of it is remapped
+    Mat rmap[2][2];
+    for (int k = 0; k < 2; k++)
+        for (int j = 0; j < 2; j++)
+            if (!sterCal.rmap[k][j].empty())
+                rmap[k][j] = sterCal.rmap[k][j](crop);
+
+    // One container of the pairs, left then right, with the projections and Q of the cropped images
+    frameContainerWriter packed;
+    bool pack = false;
+    mutex packedMutex;
+    if (s.rectifiedContainer != "0")
+    {
+        vector<string> names;
+        char name[1000];
+        for (int j = 0; j < s.nImages/2*2; j++)
+        {
+            sprintf(name, "%s_rectified_%d", j%2 == 0 ? "left" : "right", j/2);
+            names.push_back(name);
+        }
+        Mat Q, P1, P2, roi = (Mat_<int>(1, 4) << crop.x, crop.y, crop.width, crop.height);
+        sterCal.Q.convertTo(Q, CV_64F);
+        sterCal.P1.convertTo(P1, CV_64F);
+        sterCal.P2.convertTo(P2, CV_64F);
+        Q.at<double>(0, 3) += crop.x;
+        Q.at<double>(1, 3) += crop.y;
+        Mat *Pk[2] = { &P1, &P2 };
+        for (int k = 0; k < 2; k++)
+        {
+            Pk[k]->at<double>(0, 2) -= crop.x;
+            Pk[k]->at<double>(1, 2) -= crop.y;
+        }
+        vector<pair<string, Mat> > mats;
+        mats.push_back(make_pair("Disparity-to-depth_Mapping_Matrix", Q));
+        mats.push_back(make_pair("Projection_Matrix_1", P1));
+        mats.push_back(make_pair("Projection_Matrix_2", P2));
+        mats.push_back(make_pair("Valid_ROI", roi));
+        pack = packed.open(s.rectifiedContainer, names, crop.size(), CV_8UC1, mats);
+        if (!pack)
+            printf("\nThe rectified pairs could not be written to %s\n", s.rectifiedContainer.c_str());
+    }
+    if (!save && !pack && !s.showRectified)
+        return;
+
+    // Rectifies view k of an image into the crop
+    auto rectifyCropped = [&](int k, const Mat &img, Mat &rimg, const exportRemap *device) {
+        if (s.rectifyBandRows > 0)
+            rectifyBands(s, *cal[k], *R[k], *P[k], img, rimg, crop);
+        else if (s.mapGridStep > 0)
+        {
+            gridRemap(s, img, rimg, sterCal.rectifyGrid[k]);
+            rimg = rimg(crop);
+        }
+        else if (device)
+            device->remap(img, rimg, rmap[k]);
+        else
+            tiledRemap(s, img, rimg, rmap[k][0], rmap[k][1]);
+    };
+    // Saves the j-th rectified image of the list. An image that could not be read leaves a black frame in the
+    // container, so the pairs keep their places
+    auto saveRectified = [&](int j, const Mat &rimg) {
+        if (save && rimg.data)
+        {
+            char name[1000];
+            sprintf(name, "%s%s_rectified_%d", s.rectifiedPath.c_str(), j%2 == 0 ? "left" : "right", j/2);
+            writer.write(name, rimg);
+        }
+        if (pack)
+        {
+            lock_guard<mutex> lock(packedMutex);
+            packed.write(j, rimg.data ? rimg : Mat::zeros(crop.size(), CV_8UC1));
+        }
+    };
+
+    // Nothing is shown, so the images of every view are read and rectified on the export threads
+    // while the writer encodes the previous ones, as in undistortImages
+    if (!s.showRectified)
+    {
+        exportRemap device[2];
+        for (int k = 0; k < 2 && s.rectifyBandRows == 0 && s.mapGridStep == 0; k++)
+            device[k].open(s, rmap[k][0], rmap[k][1], s.imageSize);
+        #pragma omp parallel for schedule(dynamic) num_threads(exportThreads(s))
+        for (int j = 0; j < s.nImages/2*2; j++)
+        {
+            pipelineTrace::scope trace("rectify", j);
+            Mat img = rereadImage(s, frames, j, CV_LOAD_IMAGE_GRAYSCALE), rimg;
+            if (img.data)
+                rectifyCropped(j%2, img, rimg, &device[j%2]);
+            saveRectified(j, rimg);
+        }
+        if (pack && !packed.close())
+            printf("\nThe rectified pairs could not all be written to %s\n", s.rectifiedContainer.c_str());
+        return;
+    }
+
+    Mat canvas;
+    double sf = 600. / MAX(s.imageSize.width, s.imageSize.height);
+    int w = cvRound(s.imageSize.width * sf);
+    int h = cvRound(s.imageSize.height * sf);
+    canvas.create(h, w*2, CV_8UC3);
+
+    // Maps from the canvas to the input images: the rectification with the projection scaled to the canvas
+    Mat previewMap[2][2];
+    for (int k = 0; k < 2; k++)
+    {
+        Mat Ps = P[k]->clone();
+        Ps.rowRange(0, 2) *= sf;
+        rectifyMaps(s, *cal[k], *R[k], Ps, Size(w, h), previewMap[k][0], previewMap[k][1]);
+    }
+
+    // Preview buffers reused for every pair
+    Mat preview[2];
+
+    display::open("Rectified");
+    for( int i = 0; i < s.nImages/2; i++ )
+    {
+        auto rectifyView = [&](int k) {
+            Mat img = rereadImage(s, frames, i*2+k, CV_LOAD_IMAGE_GRAYSCALE);
+
+            // If a valid path for rectified images has been provided, save them to this path
+            if (save || pack)
+            {
+                Mat rimg;       // new buffer, the writer keeps it until it is written
+                if (img.data)
+                    rectifyCropped(k, img, rimg, NULL);
+                saveRectified(i*2+k, rimg);
+            }
+
+            Mat canvasPart = canvas(Rect(w*k, 0, w, h));
+            remap(img, preview[k], previewMap[k][0], previewMap[k][1], CV_INTER_LINEAR);
+            cvtColor(preview[k], canvasPart, COLOR_GRAY2BGR);
+
+            Rect vroi(cvRound(sterCal.validRoi[k].x*sf), cvRound(sterCal.validRoi[k].y*sf),
+                      cvRound(sterCal.validRoi[k].width*sf), cvRound(sterCal.validRoi[k].height*sf));
+            rectangle(canvasPart, vroi, Scalar(0,0,255), 3, 8);
+        };
+        runConcurrently([&]() { rectifyView(0); }, [&]() { rectifyView(1); });
+
+        for( int j = 0; j < canvas.rows; j += 16 )
+            line(canvas, Point(0, j), Point(canvas.cols, j), Scalar(0, 255, 0), 1, 8);
+
+        display::show("Rectified", canvas);
+        char c = (char)display::waitKey();
+        if( c == 27 || c == 'q' || c == 'Q' )
+            break;
+    }
+    display::close("Rectified");
+    if (pack && !packed.close())
+        printf("\nThe rectified pairs could not all be written to %s\n", s.rectifiedContainer.c_str());
+}
+
+// Removes every point of a view. Empty views are skipped by the calibration functions,
+// which keeps the views of both cameras aligned in stereo mode
+static void clearView(intrinsicCalibration &inCal, int i)
+{
+    inCal.imagePoints[i].clear();
+    inCal.objectPoints[i].clear();
+    if (i < (int)inCal.pointKeys.size()) inCal.pointKeys[i].clear();
+    if (i < (int)inCal.pointErrs.size()) inCal.pointErrs[i].clear();
+}
+
+// Splits each view of an ARUCO_BOARDS camera into a view of each of its boards, in the coordinates of the
+// board's plane, since the boards of an image are independent and each has its own pose. The boards with less
+// than 8 points are dropped, and imageIndex keeps the image of each board view. The extrinsics and errors of
+// the views are cleared, since they no longer match them
+static void splitBoardViews(const Settings &s, intrinsicCalibration &inCal)
+{
+    size_t nMaps = s.arPat.planeList.size();
+    intrinsicCalibration boards;
+    vector<vector<Point3f> > objects(nMaps);
+    vector<vector<Point2f> > images(nMaps);
+    vector<vector<int> > keys(nMaps);
+    for (size_t i = 0; i < inCal.objectPoints.size() && i < inCal.pointKeys.size(); i++)
+    {
+        for (size_t j = 0; j < nMaps; j++)
+        {
+            objects[j].clear();
+            images[j].clear();
+            keys[j].clear();
+        }
+        for (size_t k = 0; k < inCal.objectPoints[i].size() && k < inCal.pointKeys[i].size(); k++)
+        {
+            size_t j = inCal.pointKeys[i][k] >> 18;     // Map of the point (see arucoPointKey)
+            if (j >= nMaps)
+                continue;
+            const Point3f &p = inCal.objectPoints[i][k];
+            const string &plane = s.arPat.planeList[j];
+            objects[j].push_back(plane == "YZ" ? Point3f(p.y, p.z, 0) : plane == "XZ" ? Point3f(p.x, p.z, 0) :
+                                                                                       Point3f(p.x, p.y, 0));
+            images[j].push_back(inCal.imagePoints[i][k]);
+            keys[j].push_back(inCal.pointKeys[i][k]);
+        }
+        int image = i < inCal.imageIndex.size() ? inCal.imageIndex[i] : (int)i;
+        for (size_t j = 0; j < nMaps; j++)
+            if (objects[j].size() >= 8)
+            {
+                boards.objectPoints.push_back(objects[j]);
+                boards.imagePoints.push_back(images[j]);
+                boards.pointKeys.push_back(keys[j]);
+                boards.imageIndex.push_back(image);
+            }
+    }
+    printf("%d board views in %d images\n", (int)boards.objectPoints.size(), (int)inCal.objectPoints.size());
+    inCal.objectPoints.swap(boards.objectPoints);
+    inCal.imagePoints.swap(boards.imagePoints);
+    inCal.pointKeys.swap(boards.pointKeys);
+    inCal.imageIndex.swap(boards.imageIndex);
+    inCal.rvecs.clear();
+    inCal.tvecs.clear();
+    inCal.reprojErrs.clear();
+    inCal.pointErrs.clear();
+}
+
+// Initial intrinsics of an ARUCO_BOX camera without intrinsic input, from its own views. calibrateCamera can not
+// start from non planar points, but each face seen in a view is a planar pattern: the faces with at least two
+// markers go to initCameraMatrix2D as separate views, in the coordinates of their plane, so their homographies
+// give the focal lengths together. The principal point starts at the center and the distortion at zero, as in
+// calibrateCamera. Returns false if no face has enough markers
+static bool initBoxIntrinsics(const Settings &s, intrinsicCalibration &inCal)
+{
+    size_t nMaps = s.arPat.planeList.size();
+    vector<vector<Point3f> > faceObjects;
+    vector<vector<Point2f> > faceImages;
+    vector<vector<Point3f> > objects(nMaps);
+    vector<vector<Point2f> > images(nMaps);
+    for (size_t i = 0; i < inCal.objectPoints.size() && i < inCal.pointKeys.size(); i++)
+    {
+        for (size_t j = 0; j < nMaps; j++)
+        {
+            objects[j].clear();
+            images[j].clear();
+        }
+        for (size_t k = 0; k < inCal.objectPoints[i].size() && k < inCal.pointKeys[i].size(); k++)
+        {
+            size_t j = inCal.pointKeys[i][k] >> 18;     // Map of the point (see arucoPointKey)
+            if (j >= nMaps)
+                continue;
+            // The plane coordinates are those the face was mapped from (see toIntPoints)
+            const Point3f &p = inCal.objectPoints[i][k];
+            const string &plane = s.arPat.planeList[j];
+            objects[j].push_back(plane == "YZ" ? Point3f(p.y, p.z, 0) : plane == "XZ" ? Point3f(p.x, p.z, 0) :
+                                                                                       Point3f(p.x, p.y, 0));
+            images[j].push_back(inCal.imagePoints[i][k]);
+        }
+        for (size_t j = 0; j < nMaps; j++)
+            if (objects[j].size() >= 8)
+            {
+                faceObjects.push_back(objects[j]);
+                faceImages.push_back(images[j]);
+            }
+    }
+    if (faceObjects.empty())
+        return false;
+    Mat cameraMatrix = initCameraMatrix2D(faceObjects, faceImages, s.imageSize, s.aspectRatio);
+    if (!checkRange(cameraMatrix))
+        return false;
+    inCal.cameraMatrix = cameraMatrix;
+    inCal.distCoeffs = Mat::zeros(8, 1, CV_64F);
+    printf("Intrinsics initialized from %d box faces: fx = %.1f, fy = %.1f\n", (int)faceObjects.size(),
+           cameraMatrix.at<double>(0, 0), cameraMatrix.at<double>(1, 1));
+    return true;
+}
+
+// Initial intrinsics for bundleAdjust: the current ones with CV_CALIB_USE_INTRINSIC_GUESS, and
+// otherwise initCameraMatrix2D, which needs a planar pattern (z = 0). Returns false if it can not be used
+static bool initSparseIntrinsics(const Settings &s, const correspondenceStore &store, int flag, intrinsicCalibration &inCal)
+{
+    if (!(flag & CV_CALIB_USE_INTRINSIC_GUESS))
+    {
+        for (auto &p:store.objectPoints)
+            if (p.z != 0)
+                return false;
+        // The principal point starts at the center, as in calibrateCamera
+        inCal.cameraMatrix = initCameraMatrix2D(store.objectViews(), store.imageViews(), s.imageSize, s.aspectRatio);
+        inCal.distCoeffs = Mat::zeros(8, 1, CV_64F);
+    }
+    // Only the first 5 coefficients are in the model (no CV_CALIB_RATIONAL_MODEL)
+    Mat dist = Mat::zeros(8, 1, CV_64F), inDist;
+    inCal.distCoeffs.convertTo(inDist, CV_64F);
+    for (int j = 0; j < 5 && j < (int)inDist.total(); j++) dist.at<double>(j) = inDist.ptr<double>()[j];
+    if (flag & CV_CALIB_ZERO_TANGENT_DIST) dist.at<double>(2) = dist.at<double>(3) = 0;
+    inCal.distCoeffs = dist;
+    return true;
+}
+
+// bundleAdjust settings equivalent to the calibrateCamera flags, with the robust loss of the settings
+static baOptions sparseOptions(const Settings &s, int flag)
+{
+    baOptions opt;
+    opt.loss = s.robustLoss == Settings::HUBER_LOSS ? BA_HUBER_LOSS
+             : s.robustLoss == Settings::CAUCHY_LOSS ? BA_CAUCHY_LOSS : BA_SQUARED_LOSS;
+    opt.lossScale = s.robustScale;
+    opt.fixed[BA_K1] = (flag & CV_CALIB_FIX_K1) != 0;
+    opt.fixed[BA_K2] = (flag & CV_CALIB_FIX_K2) != 0;
+    opt.fixed[BA_K3] = (flag & CV_CALIB_FIX_K3) != 0;
+    opt.fixed[BA_P1] = opt.fixed[BA_P2] = (flag & CV_CALIB_ZERO_TANGENT_DIST) != 0;
+    opt.fixed[BA_CX] = opt.fixed[BA_CY] = (flag & CV_CALIB_FIX_PRINCIPAL_POINT) != 0;
+    opt.fixAspectRatio = (flag & CV_CALIB_FIX_ASPECT_RATIO) != 0;
+    return opt;
+}
+
+static void packIntrinsics(const intrinsicCalibration &inCal, double *k)
+{
+    const Mat &K = inCal.cameraMatrix, &dist = inCal.distCoeffs;
+    k[BA_FX] = K.at<double>(0, 0);
+    k[BA_FY] = K.at<double>(1, 1);
+    k[BA_CX] = K.at<double>(0, 2);
+    k[BA_CY] = K.at<double>(1, 2);
+    for (int j = 0; j < 5; j++) k[BA_K1 + j] = dist.at<double>(j);
+}
+
+static void unpackIntrinsics(const double *k, intrinsicCalibration &inCal)
+{
+    inCal.cameraMatrix = (Mat_<double>(3, 3) << k[BA_FX], 0, k[BA_CX], 0, k[BA_FY], k[BA_CY], 0, 0, 1);
+    inCal.distCoeffs = Mat::zeros(8, 1, CV_64F);
+    for (int j = 0; j < 5; j++) inCal.distCoeffs.at<double>(j) = k[BA_K1 + j];
+}
+
+// Pose of a view with solvePnP, starting from its previous extrinsics if there are any (outlier rejection rounds)
+static void initViewPose(const intrinsicCalibration &inCal, int view, InputArray objectPoints,
+                         InputArray imagePoints, Mat &rvec, Mat &tvec)
+{
+    bool guess = view < (int)inCal.rvecs.size() && !inCal.rvecs[view].empty();
+    if (guess)
+    {
+        inCal.rvecs[view].convertTo(rvec, CV_64F);
+        inCal.tvecs[view].convertTo(tvec, CV_64F);
+    }
+    solvePnP(objectPoints, imagePoints, inCal.cameraMatrix, inCal.distCoeffs, rvec, tvec, guess);
+}
+
+static void addViewPoints(baView &v, const Mat &objectPoints, const Mat &imagePoints, int camera)
+{
+    const Point3f *object = objectPoints.ptr<Point3f>();
+    const Point2f *image = imagePoints.ptr<Point2f>();
+    int n = (int)objectPoints.total();
+    v.objectPoints.reserve(v.objectPoints.size() + 3*n);
+    v.imagePoints.reserve(v.imagePoints.size() + 2*n);
+    v.cameras.reserve(v.cameras.size() + n);
+    for (int j = 0; j < n; j++)
+    {
+        v.objectPoints.push_back(object[j].x);
+        v.objectPoints.push_back(object[j].y);
+        v.objectPoints.push_back(object[j].z);
+        v.imagePoints.push_back(image[j].x);
+        v.imagePoints.push_back(image[j].y);
+        v.cameras.push_back(camera);
+    }
+}
+
+// Same as calibrateCamera, with bundleAdjust. The ids of the store are the indices of its views in inCal
+static void sparseCalibrateCamera(const Settings &s, intrinsicCalibration &inCal, const correspondenceStore &store,
+                                  vector<Mat> &rvecs, vector<Mat> &tvecs, int flag)
+{
+    if (!initSparseIntrinsics(s, store, flag, inCal))
+    {
+        cerr << "The sparse solver needs intrinsic input with a non planar pattern. Using calibrateCamera" << endl;
+        calibrateCamera(store.objectViews(), store.imageViews(), s.imageSize,
+                        inCal.cameraMatrix, inCal.distCoeffs, rvecs, tvecs, flag);
+        inCal.stdDevs = Mat();
+        return;
+    }
+
+    vector<baView> baViews(store.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < store.size(); k++)
+    {
+        Mat rvec, tvec, object = store.objectView(k), image = store.imageView(k);
+        initViewPose(inCal, store.ids[k], object, image, rvec, tvec);
+        addViewPoints(baViews[k], object, image, 0);
+        for (int j = 0; j < 3; j++)
+        {
+            baViews[k].rvec[j] = rvec.at<double>(j);
+            baViews[k].tvec[j] = tvec.at<double>(j);
+        }
+    }
+
+    double intrinsics[BA_NINTRINSICS], stdDevs[BA_NINTRINSICS];
+    int iterations = 0;
+    packIntrinsics(inCal, intrinsics);
+    bundleAdjust(intrinsics, baViews, sparseOptions(s, flag), stdDevs, &iterations);
+    inCal.solverIterations += iterations;
+    unpackIntrinsics(intrinsics, inCal);
+    inCal.stdDevs = Mat(BA_NINTRINSICS, 1, CV_64F, stdDevs).clone();
+
+    rvecs.resize(baViews.size());
+    tvecs.resize(baViews.size());
+    for (size_t k = 0; k < baViews.size(); k++)
+    {
+        rvecs[k] = Mat(3, 1, CV_64F, baViews[k].rvec).clone();
+        tvecs[k] = Mat(3, 1, CV_64F, baViews[k].tvec).clone();
+    }
+}
+
+// Solves the intrinsics of inCal from the views of the store with the solver of the settings.
+// The extrinsics are returned in the order of the store
+static void calibrateStore(const Settings &s, intrinsicCalibration &inCal, const correspondenceStore &store,
+                           vector<Mat> &rvecs, vector<Mat> &tvecs, int flag)
+{
+    inCal.nSolves++;
+    if (s.solver == Settings::SPARSE_SOLVER)
+        sparseCalibrateCamera(s, inCal, store, rvecs, tvecs, flag);
+    else
+    {
+        calibrateCamera(store.objectViews(), store.imageViews(), s.imageSize,
+                        inCal.cameraMatrix, inCal.distCoeffs, rvecs, tvecs, flag);
+        inCal.stdDevs = Mat();
+    }
+}
+
+// Runs calibrateCamera on the views that have points. The extrinsics of each view are
+// stored at the index of the view, and are left empty for views without points
+static void calibrateViews(const Settings &s, intrinsicCalibration &inCal, int flag)
+{
+    correspondenceStore store;
+    store.add(inCal);
+    vector<Mat> rvecs, tvecs;
+    calibrateStore(s, inCal, store, rvecs, tvecs, flag);
+
+    inCal.rvecs.assign(inCal.objectPoints.size(), Mat());
+    inCal.tvecs.assign(inCal.objectPoints.size(), Mat());
+    for (int k = 0; k < store.size(); k++)
+    {
+        inCal.rvecs[store.ids[k]] = rvecs[k];
+        inCal.tvecs[store.ids[k]] = tvecs[k];
+    }
+}
+
+// Removes the points with a reprojection error above the outlier threshold, using the
+// errors of the last computeReprojectionErrors. Views left with less than 4 points are cleared.
+// Chessboard stereo views must keep the same points in both cameras, so whole views are removed
+// instead. Returns the number of points removed
+static int rejectOutliers(const Settings &s, intrinsicCalibration &inCal)
+{
+    bool wholeViews = (s.mode == Settings::STEREO && s.calibrationPattern == Settings::CHESSBOARD);
+    bool hasKeys = !inCal.pointKeys.empty();
+    int removed = 0;
+
+    for (int i = 0; i < (int)inCal.objectPoints.size(); i++)
+    {
+        int n = (int)inCal.objectPoints[i].size();
+        if (wholeViews)
+        {
+            if (n > 0 && inCal.reprojErrs[i] > s.outlierThreshold)
+            {
+                clearView(inCal, i);
+                removed += n;
+            }
+            continue;
+        }
+
+        // Keep the inliers, compacting the point vectors in place
+        int kept = 0;
+        for (int j = 0; j < n; j++)
+            if (inCal.pointErrs[i][j] <= s.outlierThreshold)
+            {
+                inCal.imagePoints[i][kept] = inCal.imagePoints[i][j];
+                inCal.objectPoints[i][kept] = inCal.objectPoints[i][j];
+                if (hasKeys) inCal.pointKeys[i][kept] = inCal.pointKeys[i][j];
+                inCal.pointErrs[i][kept] = inCal.pointErrs[i][j];
+                kept++;
+            }
+        inCal.imagePoints[i].resize(kept);
+        inCal.objectPoints[i].resize(kept);
+        if (hasKeys) inCal.pointKeys[i].resize(kept);
+        inCal.pointErrs[i].resize(kept);
+        if (kept < 4) clearView(inCal, i);
+        removed += n - (int)inCal.objectPoints[i].size();
+    }
+    return removed;
+}
+
+// Picks the model of Calibrate_ModelCandidates with the lowest reprojection error on views it was not calibrated
+// with. The views are split in Calibrate_ModelFolds folds of consecutive views, since neighbouring frames of a
+// video are alike and would score a model on views nearly in its own calibration. Each model is calibrated
+// without each fold, and the held out views are scored with their pose from solvePnP. Every model and fold is
+// solved at once on the OpenMP threads. Returns the flags of the selected model with guessFlag, or the flags of
+// the settings if no model could be calibrated
+static int selectModel(const Settings &s, intrinsicCalibration &inCal, int guessFlag)
+{
+    correspondenceStore store;
+    store.add(inCal);
+    int nViews = store.size(), folds = min(s.modelFolds, nViews), nModels = (int)s.modelCandidates.size();
+    inCal.models = s.modelCandidates;
+    inCal.modelFlag = -1;
+    if (folds < 2)
+    {
+        printf("\nModel selection needs at least 2 views\n");
+        inCal.models.clear();
+        return s.flag | guessFlag;
+    }
+
+    vector<double> sqErrs(nModels * folds, -1);
+    vector<int> nPoints(nModels * folds, 0);
+    #pragma omp parallel for schedule(dynamic)
+    for (int task = 0; task < nModels * folds; task++)
+    {
+        int m = task / folds, f = task % folds;
+        int first = f * nViews / folds, last = (f + 1) * nViews / folds;
+        vector<int> training;
+        for (int v = 0; v < nViews; v++)
+            if (v < first || v >= last) training.push_back(v);
+
+        intrinsicCalibration cal;
+        if (s.useIntrinsicInput)
+        {
+            cal.cameraMatrix = s.intrinsicInput.cameraMatrix.clone();
+            cal.distCoeffs = s.intrinsicInput.distCoeffs.clone();
+        } else if (guessFlag) {     // The guess of solveIntrinsics
+            cal.cameraMatrix = inCal.cameraMatrix.clone();
+            cal.distCoeffs = inCal.distCoeffs.clone();
+        } else {
+            cal.cameraMatrix = Mat::eye(3, 3, CV_64F);
+            cal.distCoeffs = Mat::zeros(8, 1, CV_64F);
+        }
+        try {
+            vector<Mat> rvecs, tvecs;
+            calibrateStore(s, cal, store.select(training), rvecs, tvecs, s.modelCandidates[m].flag | guessFlag);
+        } catch (const cv::Exception &) {
+            continue;       // degenerate training views
+        }
+        if (!checkRange(cal.cameraMatrix) || !checkRange(cal.distCoeffs))
+            continue;
+
+        double err = 0;
+        int n = 0;
+        vector<Point2f> projected;
+        ProjectionKernel camera(cal.cameraMatrix, cal.distCoeffs);
+        for (int v = first; v < last; v++)
+        {
+            Mat rvec, tvec;
+            try { solvePnP(store.objectView(v), store.imageView(v), cal.cameraMatrix, cal.distCoeffs, rvec, tvec); }
+            catch (const cv::Exception &) { continue; }
+            projected.resize(store.count(v));
+            camera.project(&store.objectPoints[store.objectOffsets[v]], store.count(v), rvec, tvec, projected.data());
+            const Point2f *observed = &store.imagePoints[0][store.offsets[v]];
+            for (size_t j = 0; j < projected.size(); j++)
+            {
+                Point2f d = projected[j] - observed[j];
+                err += d.dot(d);
+            }
+            n += (int)projected.size();
+        }
+        sqErrs[task] = err;
+        nPoints[task] = n;
+    }
+
+    int best = -1;
+    printf("\nModel selection, %d folds (RMS reprojection error of the held out views):\n", folds);
+    for (int m = 0; m < nModels; m++)
+    {
+        double err = 0;
+        int n = 0;
+        bool solved = true;
+        for (int f = 0; f < folds; f++)
+        {
+            solved = solved && sqErrs[m * folds + f] >= 0;
+            err += sqErrs[m * folds + f];
+            n += nPoints[m * folds + f];
+        }
+        modelCandidate &model = inCal.models[m];
+        model.heldOutErr = solved && n > 0 ? sqrt(err / n) : -1;
+        if (model.heldOutErr >= 0 && (best < 0 || model.heldOutErr < inCal.models[best].heldOutErr))
+            best = m;
+    }
+    for (int m = 0; m < nModels; m++)
+    {
+        if (inCal.models[m].heldOutErr >= 0)
+            printf("  %-12s %.4f%s\n", inCal.models[m].name.c_str(), inCal.models[m].heldOutErr, m == best ? "  (selected)" : "");
+        else
+            printf("  %-12s failed\n", inCal.models[m].name.c_str());
+    }
+    if (best < 0)
+    {
+        printf("No model could be calibrated on every fold, the flags of the settings are used\n");
+        return s.flag | guessFlag;
+    }
+    inCal.modelFlag = inCal.models[best].flag;
+    return inCal.modelFlag | guessFlag;
+}
+
+// The points of a view kept by the coarse solve: at most maxPoints, one in each cell of a grid over the bounding
+// box of the view (the point nearest the centre of its cell), so they still cover the view evenly
+static vector<int> stratifiedPoints(const vector<Point2f> &points, int maxPoints)
+{
+    vector<int> kept;
+    if ((int)points.size() <= maxPoints)
+    {
+        for (int j = 0; j < (int)points.size(); j++) kept.push_back(j);
+        return kept;
+    }
+    float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+    for (auto &p:points)
+    {
+        x0 = min(x0, p.x); x1 = max(x1, p.x);
+        y0 = min(y0, p.y); y1 = max(y1, p.y);
+    }
+    int g = max(1, (int)sqrt((double)maxPoints));
+    float w = max(x1 - x0, 1e-3f)/g, h = max(y1 - y0, 1e-3f)/g;
+    vector<int> best(g*g, -1);
+    vector<float> bestDist(g*g, FLT_MAX);
+    for (int j = 0; j < (int)points.size(); j++)
+    {
+        int cx = min(g - 1, (int)((points[j].x - x0)/w)), cy = min(g - 1, (int)((points[j].y - y0)/h));
+        float dx = points[j].x - (x0 + (cx + 0.5f)*w), dy = points[j].y - (y0 + (cy + 0.5f)*h);
+        int c = cy*g + cx;
+        if (dx*dx + dy*dy < bestDist[c])
+        {
+            bestDist[c] = dx*dx + dy*dy;
+            best[c] = j;
+        }
+    }
+    for (int j:best)
+        if (j >= 0) kept.push_back(j);
+    sort(kept.begin(), kept.end());
+    return kept;
+}
+
+// Solves the intrinsics on the stratifiedPoints of each view (Calibrate_CoarsePoints). Each iteration of the
+// solve costs the number of points, so the coarse solve is cheap, and the solve on every point then starts
+// close to the result and needs few iterations. The views keep their indices, so the sparse solver also starts
+// from the coarse poses. Returns false if no view has more points, or if the coarse solve failed
+static bool coarseSolve(const Settings &s, intrinsicCalibration &inCal, int flag)
+{
+    intrinsicCalibration coarse;
+    coarse.cameraMatrix = inCal.cameraMatrix.clone();
+    coarse.distCoeffs = inCal.distCoeffs.clone();
+    int nViews = (int)inCal.objectPoints.size(), nKept = 0, nPoints = 0;
+    coarse.imagePoints.resize(nViews);
+    coarse.objectPoints.resize(nViews);
+    for (int i = 0; i < nViews; i++)
+    {
+        for (int j:stratifiedPoints(inCal.imagePoints[i], s.coarsePoints))
+        {
+            coarse.imagePoints[i].push_back(inCal.imagePoints[i][j]);
+            coarse.objectPoints[i].push_back(inCal.objectPoints[i][j]);
+        }
+        nKept += (int)coarse.imagePoints[i].size();
+        nPoints += (int)inCal.imagePoints[i].size();
+    }
+    if (nKept == nPoints)
+        return false;
+
+    try { calibrateViews(s, coarse, flag); }
+    catch (const cv::Exception &) { return false; }
+    inCal.nSolves += coarse.nSolves;
+    inCal.solverIterations += coarse.solverIterations;
+    if (!checkRange(coarse.cameraMatrix) || !checkRange(coarse.distCoeffs))
+        return false;
+    printf("Coarse calibration on %d of %d points. Avg reprojection error = %.4f\n", nKept, nPoints,
+           computeReprojectionErrors(coarse));
+    inCal.cameraMatrix = coarse.cameraMatrix;
+    inCal.distCoeffs = coarse.distCoeffs;
+    inCal.rvecs = coarse.rvecs;
+    inCal.tvecs = coarse.tvecs;
+    return true;
+}
+
+//--------------------------------Solve cache---------------------------------//
+// Results of the solves are stored in SolveCache_Path, in binary calibration files named by the hash of what the
+// solve depends on: its correspondences, the image size, the settings of the solver and the intrinsic input.
+// The termination criteria of the solvers are fixed, so they are part of the version of the key
+
+// File of a solve in the cache, or an empty string if there is no cache. config names the solve and its settings
+static string solveCacheFile(const Settings &s, const string &config, const correspondenceStore &store,
+                             const vector<int> &pointKeys, const vector<Mat> &inputs)
+{
+    if (s.solveCachePath == "0")
+        return string();
+    if (!pathCheck(s.solveCachePath))
+    {
+        printf("\nSolve cache could not be used. Invalid path: %s\n", s.solveCachePath.c_str());
+        return string();
+    }
+    ostringstream str;
+    str << "v1 " << config << " " << s.imageSize << " " << store.size();
+    string text = str.str();
+    unsigned long long h = hashBytes(text.data(), text.size());
+    h = hashBytes(store.objectPoints.data(), store.objectPoints.size()*sizeof(Point3f), h);
+    for (int k = 0; k < 2; k++)
+        h = hashBytes(store.imagePoints[k].data(), store.imagePoints[k].size()*sizeof(Point2f), h);
+    h = hashBytes(store.offsets.data(), store.offsets.size()*sizeof(int), h);
+    h = hashBytes(store.objectOffsets.data(), store.objectOffsets.size()*sizeof(int), h);
+    h = hashBytes(store.ids.data(), store.ids.size()*sizeof(int), h);
+    h = hashBytes(pointKeys.data(), pointKeys.size()*sizeof(int), h);
+    for (auto &m:inputs)
+    {
+        Mat c = m.isContinuous() ? m : m.clone();
+        int header[3] = { c.rows, c.cols, c.type() };
+        h = hashBytes(header, sizeof(header), h);
+        h = hashBytes(c.data, c.total()*c.elemSize(), h);
+    }
+    char name[32];
+    sprintf(name, "%016llx.solve", h);
+    return s.solveCachePath + name;
+}
+
+// The point keys of the views of a store, in its order
+static vector<int> storePointKeys(const intrinsicCalibration &inCal, const correspondenceStore &store)
+{
+    vector<int> keys;
+    for (int id:store.ids)
+        if (id < (int)inCal.pointKeys.size())
+            keys.insert(keys.end(), inCal.pointKeys[id].begin(), inCal.pointKeys[id].end());
+    return keys;
+}
+
+// Stores the result of runIntrinsicCalibration: the intrinsics, the views left after the outlier rejection with
+// their poses and errors, and the model selection
+static void writeCachedIntrinsics(const Settings &s, const string &filename, const intrinsicCalibration &inCal, bool ok)
+{
+    correspondenceStore store;
+    store.add(inCal);
+    vector<int> keys = storePointKeys(inCal, store);
+    Mat poses(store.size(), 6, CV_64F, Scalar(0));
+    vector<float> pointErrs;
+    for (int k = 0; k < store.size(); k++)
+    {
+        int id = store.ids[k];
+        for (int j = 0; j < 3 && id < (int)inCal.rvecs.size() && !inCal.rvecs[id].empty(); j++)
+        {
+            poses.at<double>(k, j) = inCal.rvecs[id].at<double>(j);
+            poses.at<double>(k, 3 + j) = inCal.tvecs[id].at<double>(j);
+        }
+        if (id < (int)inCal.pointErrs.size() && (int)inCal.pointErrs[id].size() == store.count(k))
+            pointErrs.insert(pointErrs.end(), inCal.pointErrs[id].begin(), inCal.pointErrs[id].end());
+    }
+    if ((int)pointErrs.size() != store.offsets.back()) pointErrs.clear();
+    vector<double> modelErrs;
+    for (auto &m:inCal.models) modelErrs.push_back(m.heldOutErr);
+
+    vector<pair<string, Mat> > mats;
+    Mat result = (Mat_<double>(1, 6) << ok, inCal.totalAvgErr, inCal.nSolves, inCal.solverIterations,
+                  inCal.modelFlag, (double)inCal.objectPoints.size());
+    mats.push_back(make_pair("Result", result));
+    mats.push_back(make_pair("Camera_Matrix", inCal.cameraMatrix));
+    mats.push_back(make_pair("Distortion_Coefficients", inCal.distCoeffs));
+    if (!inCal.stdDevs.empty()) mats.push_back(make_pair("Intrinsic_Standard_Deviations", inCal.stdDevs));
+    if (!inCal.reprojErrs.empty()) mats.push_back(make_pair("Per_View_Reprojection_Errors", Mat(inCal.reprojErrs, false)));
+    if (!pointErrs.empty()) mats.push_back(make_pair("Point_Errors", Mat(pointErrs, false)));
+    if (!modelErrs.empty()) mats.push_back(make_pair("Model_Errors", Mat(modelErrs, false)));
+    if (store.size() > 0)
+    {
+        mats.push_back(make_pair("Poses", poses));
+        store.toMats("Correspondence_", mats);
+    }
+    if (!keys.empty()) mats.push_back(make_pair("Point_Keys", Mat(keys, false)));
+    if (!writeCalibrationBinary(filename, SOLVE_FILE, s.imageSize, mats))
+        cerr << "Could not write to the solve cache: " << filename << endl;
+}
+
+// Reads a result of writeCachedIntrinsics into inCal. Returns false if there is none, or if it does not fit inCal
+static bool readCachedIntrinsics(const Settings &s, const string &filename, intrinsicCalibration &inCal, bool &ok)
+{
+    map<string, Mat> mats;
+    Size size;
+    if (!readCalibrationBinary(filename, SOLVE_FILE, size, mats) || size != s.imageSize)
+        return false;
+    Mat result = mats["Result"];
+    if (result.total() != 6 || result.type() != CV_64F || (int)result.at<double>(5) != (int)inCal.objectPoints.size())
+        return false;
+    correspondenceStore store;
+    vector<int> keys;
+    vector<float> reprojErrs, pointErrs;
+    vector<double> modelErrs;
+    Mat poses = mats["Poses"];
+    if ((mats.count("Correspondence_Ids") && !store.fromMats("Correspondence_", mats))
+            || !matToVector(mats["Point_Keys"], CV_32S, keys)
+            || !matToVector(mats["Per_View_Reprojection_Errors"], CV_32F, reprojErrs)
+            || !matToVector(mats["Point_Errors"], CV_32F, pointErrs)
+            || !matToVector(mats["Model_Errors"], CV_64F, modelErrs)
+            || (!keys.empty() && keys.size() != store.imagePoints[0].size())
+            || (!pointErrs.empty() && pointErrs.size() != store.imagePoints[0].size())
+            || (store.size() > 0 && (poses.rows != store.size() || poses.cols != 6 || poses.type() != CV_64F))
+            || (!modelErrs.empty() && modelErrs.size() != s.modelCandidates.size()))
+        return false;
+    for (int id:store.ids)
+        if (id < 0 || id >= (int)inCal.objectPoints.size())
+            return false;
+
+    // The views of the store are those left after the outlier rejection
+    int nViews = (int)inCal.objectPoints.size();
+    for (int i = 0; i < nViews; i++) clearView(inCal, i);
+    inCal.rvecs.assign(nViews, Mat());
+    inCal.tvecs.assign(nViews, Mat());
+    inCal.pointErrs.assign(nViews, vector<float>());
+    if (!keys.empty()) inCal.pointKeys.resize(nViews);
+    for (int k = 0; k < store.size(); k++)
+    {
+        int id = store.ids[k], first = store.offsets[k], last = store.offsets[k+1];
+        Mat object = store.objectView(k), image = store.imageView(k);
+        object.copyTo(inCal.objectPoints[id]);
+        image.copyTo(inCal.imagePoints[id]);
+        if (!keys.empty()) inCal.pointKeys[id].assign(keys.begin() + first, keys.begin() + last);
+        if (!pointErrs.empty()) inCal.pointErrs[id].assign(pointErrs.begin() + first, pointErrs.begin() + last);
+        inCal.rvecs[id] = poses.row(k).colRange(0, 3).t();
+        inCal.tvecs[id] = poses.row(k).colRange(3, 6).t();
+    }
+    inCal.cameraMatrix = mats["Camera_Matrix"];
+    inCal.distCoeffs = mats["Distortion_Coefficients"];
+    inCal.stdDevs = mats["Intrinsic_Standard_Deviations"];
+    inCal.reprojErrs = reprojErrs;
+    inCal.totalAvgErr = result.at<double>(1);
+    inCal.modelFlag = (int)result.at<double>(4);
+    inCal.models = modelErrs.empty() ? vector<modelCandidate>() : s.modelCandidates;
+    for (size_t m = 0; m < modelErrs.size(); m++) inCal.models[m].heldOutErr = modelErrs[m];
+    inCal.nSolves = inCal.solverIterations = 0;     // Nothing was solved
+    ok = result.at<double>(0) != 0;
+    return true;
+}
+
+// The history of CalibrationHistory_Path holds a binary intrinsic file per calibration, and the index history.yml
+// with the camera name, image size, time, error and file of each calibration, oldest first
+struct historyEntry {
+    string camera, file, time;
+    Size imageSize;
+    double error;
+};
+
+static mutex historyMutex;      // Jobs of a manifest may add to the same history
+
+static vector<historyEntry> readHistoryIndex(const string &path)
+{
+    vector<historyEntry> entries;
+    FileStorage fs(path + "history.yml", FileStorage::READ);
+    if (!fs.isOpened())
+        return entries;
+    FileNode n = fs["History"];
+    for (FileNodeIterator it = n.begin(); it != n.end(); ++it)
+    {
+        historyEntry e;
+        (*it)["Camera"] >> e.camera;
+        (*it)["File"] >> e.file;
+        (*it)["Calibration_Time"] >> e.time;
+        (*it)["Image_Width"] >> e.imageSize.width;
+        (*it)["Image_Height"] >> e.imageSize.height;
+        (*it)["Avg_Reprojection_Error"] >> e.error;
+        entries.push_back(e);
+    }
+    return entries;
+}
+
+// Initial intrinsics of an INTRINSIC calibration from the history: the latest entry of the camera at the image
+// size, or else its latest entry at another size, with the camera matrix scaled to the image size (as with
+// CameraParameters::resize). Returns false if the camera has no entry
+static bool historyGuess(const Settings &s, Mat &cameraMatrix, Mat &distCoeffs)
+{
+    if (s.historyPath == "0" || s.mode != Settings::INTRINSIC)
+        return false;
+    vector<historyEntry> entries;
+    {
+        lock_guard<mutex> lock(historyMutex);
+        entries = readHistoryIndex(s.historyPath);
+    }
+    int latest = -1;
+    for (int i = 0; i < (int)entries.size(); i++)
+        if (entries[i].camera == s.cameraName && (latest < 0 || entries[i].imageSize == s.imageSize
+                                                  || entries[latest].imageSize != s.imageSize))
+            latest = i;
+    map<string, Mat> mats;
+    Size size;
+    if (latest < 0 || !readCalibrationBinary(s.historyPath + entries[latest].file, INTRINSIC_FILE, size, mats)
+            || mats["Camera_Matrix"].empty() || mats["Distortion_Coefficients"].empty()
+            || size.width <= 0 || size.height <= 0)
+        return false;
+    mats["Camera_Matrix"].convertTo(cameraMatrix, CV_64F);
+    double sx = (double)s.imageSize.width/size.width, sy = (double)s.imageSize.height/size.height;
+    cameraMatrix.row(0) *= sx;
+    cameraMatrix.row(1) *= sy;
+    distCoeffs = Mat::zeros(8, 1, CV_64F);
+    Mat d = mats["Distortion_Coefficients"].reshape(1, (int)mats["Distortion_Coefficients"].total());
+    d.rowRange(0, min(d.rows, 8)).convertTo(distCoeffs.rowRange(0, min(d.rows, 8)), CV_64F);
+    printf("\nStarting from the calibration of %s (%s, %dx%d)\n", s.cameraName.c_str(), entries[latest].time.c_str(),
+           size.width, size.height);
+    return true;
+}
+
+// Adds the intrinsics of an INTRINSIC calibration to the history
+static void addToHistory(const Settings &s, const intrinsicCalibration &inCal)
+{
+    if (s.historyPath == "0" || s.mode != Settings::INTRINSIC)
+        return;
+    if (!pathCheck(s.historyPath))
+    {
+        printf("\nThe calibration could not be added to the history. Invalid path: %s\n", s.historyPath.c_str());
+        return;
+    }
+    lock_guard<mutex> lock(historyMutex);
+    vector<historyEntry> entries = readHistoryIndex(s.historyPath);
+    historyEntry e;
+    e.camera = s.cameraName;
+    e.imageSize = s.imageSize;
+    e.error = inCal.totalAvgErr;
+    time_t tm;
+    time(&tm);
+    char buf[64];
+    strftime(buf, sizeof(buf) - 1, "%Y-%m-%d %H:%M:%S", localtime(&tm));
+    e.time = buf;
+    ostringstream name;
+    name << e.camera << "_" << e.imageSize.width << "x" << e.imageSize.height << "_" << entries.size() << ".bin";
+    e.file = name.str();
+    vector<pair<string, Mat> > mats;
+    mats.push_back(make_pair(string("Camera_Matrix"), inCal.cameraMatrix));
+    mats.push_back(make_pair(string("Distortion_Coefficients"), inCal.distCoeffs));
+    if (!writeCalibrationBinary(s.historyPath + e.file, INTRINSIC_FILE, e.imageSize, mats))
+    {
+        printf("\nThe calibration could not be added to the history: %s\n", (s.historyPath + e.file).c_str());
+        return;
+    }
+    entries.push_back(e);
+
+    FileStorage fs(s.historyPath + "history.yml", FileStorage::WRITE);
+    fs << "History" << "[";
+    for (auto &h:entries)
+        fs << "{" << "Camera" << h.camera << "Image_Width" << h.imageSize.width << "Image_Height" << h.imageSize.height
+           << "Calibration_Time" << h.time << "Avg_Reprojection_Error" << h.error << "File" << h.file << "}";
+    fs << "]";
+}
+
+// Run intrinsic calibration, using the image and object points to calculate the
+// camera matrix and distortion coefficients. With Calibrate_ModelCandidates, the flags
+// are those of the model picked by selectModel, and with Calibrate_CoarsePoints, the
+// solve on every point starts from coarseSolve. With SolveCache_Path, an unchanged
+// calibration is read from the cache. Without intrinsic input, an INTRINSIC calibration
+// starts from the latest one of the camera in CalibrationHistory_Path
+static bool solveIntrinsics(const Settings &s, intrinsicCalibration &inCal, const Mat *guess);
+
+bool runIntrinsicCalibration(const Settings &s, intrinsicCalibration &inCal)
+{
+    correspondenceStore store;
+    store.add(inCal);
+    ostringstream config;
+    config << "intrinsic " << s.flag << " " << s.solver << " " << s.outlierThreshold << " " << s.outlierIterations
+           << " " << s.coarsePoints << " " << s.modelCandidatesInput << " " << s.modelFolds << " " << s.mode << " "
+           << s.calibrationPattern << " " << s.useIntrinsicInput << " calibrateCamera 30 eps "
+           << s.robustLoss << " " << s.robustScale;
+    Mat guess[2];
+    bool warmStart = !s.useIntrinsicInput && historyGuess(s, guess[0], guess[1]);
+    vector<Mat> inputs;
+    if (s.useIntrinsicInput)
+    {
+        inputs.push_back(s.intrinsicInput.cameraMatrix);
+        inputs.push_back(s.intrinsicInput.distCoeffs);
+    }
+    else if (warmStart)
+    {
+        config << " history";
+        inputs.push_back(guess[0]);
+        inputs.push_back(guess[1]);
+    }
+    string cacheFile = solveCacheFile(s, config.str(), store, storePointKeys(inCal, store), inputs);
+    bool ok = false;
+    if (!cacheFile.empty() && readCachedIntrinsics(s, cacheFile, inCal, ok))
+    {
+        printf("Intrinsics read from the solve cache. Avg reprojection error = %.4f\n", inCal.totalAvgErr);
+        return ok;
+    }
+    ok = solveIntrinsics(s, inCal, warmStart ? guess : NULL);
+    if (!cacheFile.empty())
+        writeCachedIntrinsics(s, cacheFile, inCal, ok);
+    return ok;
+}
+
+static bool solveIntrinsics(const Settings &s, intrinsicCalibration &inCal, const Mat *guess)
+{
+    int flag = s.flag;
+    if (s.useIntrinsicInput)     //precalculated intrinsic have been inputted. Use these
+    {
+        inCal.cameraMatrix = s.intrinsicInput.cameraMatrix.clone();
+        inCal.distCoeffs = s.intrinsicInput.distCoeffs.clone();
+        flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+
+    } else if (guess) {     //a previous calibration of the camera
+        inCal.cameraMatrix = guess[0].clone();
+        inCal.distCoeffs = guess[1].clone();
+        flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+
+    } else if (s.calibrationPattern == Settings::ARUCO_BOX) {     //the box is not planar, so it needs a guess
+        if (!initBoxIntrinsics(s, inCal))
+        {
+            cerr << "No face of the box has enough markers to initialize the intrinsics" << endl;
+            return false;
+        }
+        flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+
+    } else {                //else, create empty matrices to be calculated
+        inCal.cameraMatrix = Mat::eye(3, 3, CV_64F);
+        inCal.distCoeffs = Mat::zeros(8, 1, CV_64F);
+    }
+    inCal.nSolves = inCal.solverIterations = 0;
+    if (!s.modelCandidates.empty())
+        flag = selectModel(s, inCal, flag & CV_CALIB_USE_INTRINSIC_GUESS);
+    if (s.coarsePoints > 0 && coarseSolve(s, inCal, flag))
+        flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+    calibrateViews(s, inCal, flag);
+
+    // if( flag & CV_CALIB_FIX_ASPECT_RATIO )
+    //     inCal.cameraMatrix.at<double>(0,0) = aspectRatio;
+
+    bool ok = checkRange(inCal.cameraMatrix) && checkRange(inCal.distCoeffs);
+    inCal.totalAvgErr = computeReprojectionErrors(inCal);
+
+    // The robust loss already kept the outliers from pulling the solve, so they are only removed
+    if (ok && s.robustLoss != Settings::NO_LOSS && s.solver == Settings::SPARSE_SOLVER)
+    {
+        if (s.outlierIterations > 0)
+        {
+            int removed = rejectOutliers(s, inCal);
+            inCal.totalAvgErr = computeReprojectionErrors(inCal);
+            printf("Outliers of the robust solve: %d points removed. Avg reprojection error = %.4f\n",
+                   removed, inCal.totalAvgErr);
+        }
+        return ok;
+    }
+
+    // Remove outliers and solve again, starting from the previous intrinsics
+    for (int round = 1; ok && round <= s.outlierIterations; round++)
+    {
+        int removed = rejectOutliers(s, inCal);
+        if (removed == 0)
+            break;
+        calibrateViews(s, inCal, flag | CV_CALIB_USE_INTRINSIC_GUESS);
+        ok = checkRange(inCal.cameraMatrix) && checkRange(inCal.distCoeffs);
+        inCal.totalAvgErr = computeReprojectionErrors(inCal);
+        printf("Outlier rejection round %d: %d points removed. Avg reprojection error = %.4f\n",
+               round, removed, inCal.totalAvgErr);
+    }
+    return ok;
+}
+
+// Marks the cells of a coverage grid (cellSize pixels) that hold at least one of the points
+static void markCoverage(const vector<Point2f> &points, int cellSize, Mat &cells)
+{
+    for (auto &p:points)
+    {
+        int r = (int)p.y/cellSize, c = (int)p.x/cellSize;
+        if (r >= 0 && c >= 0 && r < cells.rows && c < cells.cols) cells.at<uchar>(r, c) = 1;
+    }
+}
+
+// Keeps at most keyframeViews views of inCal, clearing the others. Views are picked greedily by what they
+// add to the kept ones: cells of a coverage grid over the image, and a bonus for a new rough pose (distance,
+// tilt and tilt direction of the pattern, from solvePnP with a guessed camera). Once no view adds anything,
+// the selection stops early. Returns the number of kept views
+static int selectKeyframes(const Settings &s, intrinsicCalibration &inCal)
+{
+    const int gridCols = 16;            // Columns of the coverage grid
+    const int poseBonus = gridCols;     // Score of a new pose bin, in cells
+    int cellSize = max(1, (s.imageSize.width + gridCols - 1)/gridCols);
+    Mat cameraMatrix = s.useIntrinsicInput ? s.intrinsicInput.cameraMatrix : (Mat_<double>(3, 3) <<
+                       s.imageSize.width, 0, s.imageSize.width/2., 0, s.imageSize.width, s.imageSize.height/2., 0, 0, 1);
+    Mat distCoeffs = s.useIntrinsicInput ? s.intrinsicInput.distCoeffs : Mat();
+
+    // Cells and rough pose of each view
+    int nViews = (int)inCal.objectPoints.size();
+    vector<vector<int> > viewCells(nViews);
+    vector<Vec3d> poses(nViews);    // Depth, tilt (degrees) and tilt direction (degrees)
+    vector<double> depths;
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nViews; i++)
+    {
+        if (inCal.objectPoints[i].size() < 4)
+            continue;
+        Mat cells = Mat::zeros((s.imageSize.height + cellSize - 1)/cellSize, gridCols, CV_8U);
+        markCoverage(inCal.imagePoints[i], cellSize, cells);
+        for (int k = 0; k < (int)cells.total(); k++)
+            if (cells.data[k]) viewCells[i].push_back(k);
+
+        Mat rvec, tvec, R;
+        try { solvePnP(inCal.objectPoints[i], inCal.imagePoints[i], cameraMatrix, distCoeffs, rvec, tvec); }
+        catch (const cv::Exception &) { continue; }     // No pose (e.g. too few 3D points): only the cells count
+        Rodrigues(rvec, R);
+        Vec3d n(R.at<double>(0, 2), R.at<double>(1, 2), R.at<double>(2, 2));    // Pattern z axis in the camera
+        poses[i] = Vec3d(fabs(tvec.at<double>(2)), acos(min(1., fabs(n[2])))*180/CV_PI,
+                         atan2(n[1]*(n[2] < 0 ? -1 : 1), n[0]*(n[2] < 0 ? -1 : 1))*180/CV_PI);
+    }
+    int nCandidates = 0;
+    for (int i = 0; i < nViews; i++)
+    {
+        if (!viewCells[i].empty()) nCandidates++;
+        if (poses[i][0] > 0) depths.push_back(poses[i][0]);
+    }
+    if (nCandidates <= s.keyframeViews || depths.empty())
+        return nCandidates;
+    nth_element(depths.begin(), depths.begin() + depths.size()/2, depths.end());
+    double medianDepth = max(depths[depths.size()/2], 1e-9);
+
+    // Pose bins: depth in steps of sqrt(2), tilt in steps of 15 degrees, and the tilt direction
+    // in 8 sectors, only for tilted views
+    vector<int> poseBins(nViews);
+    for (int i = 0; i < nViews; i++)
+    {
+        int depth = cvRound(2*log2(max(poses[i][0], 1e-9)/medianDepth));
+        depth = min(4, max(-4, depth)) + 4;
+        int tilt = min(5, (int)(poses[i][1]/15));
+        int sector = tilt == 0 ? 0 : ((int)floor((poses[i][2] + 180)/45)) % 8;
+        poseBins[i] = (depth*6 + tilt)*8 + sector;
+    }
+
+    // Greedy selection of the view with the largest gain
+    vector<uchar> covered(gridCols*((s.imageSize.height + cellSize - 1)/cellSize), 0);
+    vector<bool> poseSeen(9*6*8, false), kept(nViews, false);
+    int nKept = 0;
+    while (nKept < s.keyframeViews)
+    {
+        int best = -1, bestGain = 0;
+        for (int i = 0; i < nViews; i++)
+        {
+            if (kept[i] || viewCells[i].empty())
+                continue;
+            int gain = poseSeen[poseBins[i]] ? 0 : poseBonus;
+            for (int k:viewCells[i]) gain += !covered[k];
+            if (gain > bestGain)
+            {
+                best = i;
+                bestGain = gain;
+            }
+        }
+        if (best < 0)
+            break;
+        kept[best] = true;
+        poseSeen[poseBins[best]] = true;
+        for (int k:viewCells[best]) covered[k] = 1;
+        nKept++;
+    }
+
+    for (int i = 0; i < nViews; i++)
+        if (!kept[i] && !inCal.objectPoints[i].empty()) clearView(inCal, i);
+    printf("\nKeyframe selection: %d of %d views kept, covering %.0f%% of the image\n", nKept, nCandidates,
+           100.*countNonZero(covered)/covered.size());
+    return nKept;
+}
+
+// Calibrates random subsets of the calibrated views of inCal, of increasing size, to find how many
+// views give stable intrinsics. The subsets of a size are solved in parallel, reusing the detections
+// in memory. The analysis stops at the first size where fx, fy, cx and cy vary less than the subset
+// tolerance, and the subset of that size closest to the full calibration is written to an image list
+static void runSubsetAnalysis(const Settings &s, const intrinsicCalibration &inCal)
+{
+    // The trials select their views from a single store of every view
+    correspondenceStore store;
+    store.add(inCal);
+    int nViews = store.size();
+    vector<int> views(nViews);
+    for (int k = 0; k < nViews; k++) views[k] = k;
+    if (nViews < 8)
+    {
+        printf("\nSubset analysis needs at least 8 views\n");
+        return;
+    }
+
+    int flag = s.flag;
+    // The box is not planar, so without intrinsic input its subsets start from the full calibration
+    bool boxGuess = !s.useIntrinsicInput && s.calibrationPattern == Settings::ARUCO_BOX;
+    if (s.useIntrinsicInput || boxGuess) flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+    const int nParams = 6;
+    const char *names[nParams] = { "fx", "fy", "cx", "cy", "k1", "k2" };
+    double full[nParams] = { inCal.cameraMatrix.at<double>(0, 0), inCal.cameraMatrix.at<double>(1, 1),
+                             inCal.cameraMatrix.at<double>(0, 2), inCal.cameraMatrix.at<double>(1, 2),
+                             inCal.distCoeffs.at<double>(0), inCal.distCoeffs.at<double>(1) };
+
+    vector<int> best;
+    printf("\nSubset analysis, %d calibrations of each size (mean +- standard deviation):\n", s.subsetTrials);
+    for (int size = 4; size < nViews && best.empty(); size += max(1, size/2))
+    {
+        vector<vector<int> > subsets(s.subsetTrials);
+        vector<vector<double> > params(s.subsetTrials);
+        #pragma omp parallel for schedule(dynamic)
+        for (int t = 0; t < s.subsetTrials; t++)
+        {
+            // Each trial has its own seed, so the subsets do not depend on the number of threads
+            mt19937 rng(size * 7919 + t);
+            vector<int> subset = views;
+            shuffle(subset.begin(), subset.end(), rng);
+            subset.resize(size);
+            sort(subset.begin(), subset.end());
+
+            intrinsicCalibration sub;
+            if (s.useIntrinsicInput)
+            {
+                sub.cameraMatrix = s.intrinsicInput.cameraMatrix.clone();
+                sub.distCoeffs = s.intrinsicInput.distCoeffs.clone();
+            } else if (boxGuess) {
+                sub.cameraMatrix = inCal.cameraMatrix.clone();
+                sub.distCoeffs = inCal.distCoeffs.clone();
+            } else {
+                sub.cameraMatrix = Mat::eye(3, 3, CV_64F);
+                sub.distCoeffs = Mat::zeros(8, 1, CV_64F);
+            }
+            try {
+                vector<Mat> rvecs, tvecs;
+                calibrateStore(s, sub, store.select(subset), rvecs, tvecs, flag);
+            } catch (const cv::Exception &) {
+                continue;       // degenerate subset
+            }
+            if (!checkRange(sub.cameraMatrix) || !checkRange(sub.distCoeffs))
+                continue;
+            const Mat &K = sub.cameraMatrix;
+            double p[nParams] = { K.at<double>(0, 0), K.at<double>(1, 1), K.at<double>(0, 2), K.at<double>(1, 2),
+                                  sub.distCoeffs.at<double>(0), sub.distCoeffs.at<double>(1) };
+            params[t].assign(p, p + nParams);
+            subsets[t].swap(subset);
+        }
+
+        // Statistics of the solved trials
+        double mean[nParams] = {0}, var[nParams] = {0};
+        int nSolved = 0;
+        for (int t = 0; t < s.subsetTrials; t++)
+            if (!params[t].empty())
+            {
+                nSolved++;
+                for (int p = 0; p < nParams; p++) mean[p] += params[t][p];
+            }
+        if (nSolved < 2)
+            continue;
+        for (int p = 0; p < nParams; p++) mean[p] /= nSolved;
+        for (int t = 0; t < s.subsetTrials; t++)
+            for (int p = 0; p < nParams && !params[t].empty(); p++)
+                var[p] += (params[t][p] - mean[p]) * (params[t][p] - mean[p]) / (nSolved - 1);
+
+        bool stable = true;
+        printf("%4d views:", size);
+        for (int p = 0; p < nParams; p++)
+        {
+            printf("  %s %.4g +- %.3g", names[p], mean[p], sqrt(var[p]));
+            if (p < 4 && sqrt(var[p]) > s.subsetTolerance) stable = false;
+        }
+        printf("\n");
+
+        // The selected subset is the one with the intrinsics closest to the full calibration
+        double bestDist = DBL_MAX;
+        for (int t = 0; stable && t < s.subsetTrials; t++)
+        {
+            if (params[t].empty())
+                continue;
+            double dist = 0;
+            for (int p = 0; p < 4; p++) dist += (params[t][p] - full[p]) * (params[t][p] - full[p]);
+            if (dist < bestDist)
+            {
+                bestDist = dist;
+                best = subsets[t];
+            }
+        }
+    }
+
+    if (best.empty())
+    {
+        printf("No subset smaller than the %d views gives stable intrinsics\n", nViews);
+        return;
+    }
+    printf("Smallest stable subset: %d of %d views\n", (int)best.size(), nViews);
+    if (s.subsetImageList == "0")
+        return;
+    FileStorage fs(s.subsetImageList, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        cerr << "Could not write the subset image list: " << s.subsetImageList << endl;
+        return;
+    }
+    fs << "images" << "[";
+    for (int k:best)
+    {
+        int v = store.ids[k];
+        fs << s.imageList[inCal.imageIndex.empty() ? v : inCal.imageIndex[v]];
+    }
+    fs << "]";
+}
+
+// Median of each component of the vectors
+static Mat componentMedian(const vector<Mat> &vecs)
+{
+    Mat m(3, 1, CV_64F);
+    vector<double> values(vecs.size());
+    for (int j = 0; j < 3; j++)
+    {
+        for (size_t i = 0; i < vecs.size(); i++) values[i] = vecs[i].at<double>(j);
+        nth_element(values.begin(), values.begin() + values.size()/2, values.end());
+        m.at<double>(j) = values[values.size()/2];
+    }
+    return m;
+}
+
+// Pose (R, t) of camera b wrt camera a, as the median of the relative poses of the views seen by both.
+// rvecs and tvecs are the pose of each view in each camera. Returns false if no view is shared
+static bool medianRelativePose(const vector<Mat> (&rvecs)[2], const vector<Mat> (&tvecs)[2], Mat &R, Mat &t)
+{
+    vector<Mat> relR, relT;
+    for (size_t i = 0; i < rvecs[0].size(); i++)
+        if (!rvecs[0][i].empty() && !rvecs[1][i].empty())
+        {
+            Mat Ra, Rb, r;
+            Rodrigues(rvecs[0][i], Ra);
+            Rodrigues(rvecs[1][i], Rb);
+            Mat Rab = Rb * Ra.t();
+            Rodrigues(Rab, r);
+            relR.push_back(r);
+            relT.push_back(tvecs[1][i] - Rab * tvecs[0][i]);
+        }
+    if (relR.empty())
+        return false;
+    Rodrigues(componentMedian(relR), R);
+    t = componentMedian(relT);
+    return true;
+}
+
+// Solves the intrinsics of every camera and the pose of each camera wrt the first one with a single
+// bundleAdjust. Each camera keeps all of its points, shared or not. The cameras are initialized as in
+// sparseCalibrateCamera, and their poses by chaining the median relative poses of cameras that share
+// views. Returns the RMS reprojection error, or a negative value if the rig can not be initialized
+static double solveRig(const Settings &s, const vector<intrinsicCalibration*> &cals, rigCalibration &rig, int flag)
+{
+    int nCameras = (int)cals.size();
+    int nViews = (int)cals[0]->objectPoints.size();
+
+    for (int c = 0; c < nCameras; c++)
+    {
+        correspondenceStore store;
+        store.add(*cals[c]);
+        if (store.size() == 0)
+        {
+            cerr << "The pattern has not been detected by camera " << c << endl;
+            return -1;
+        }
+        if (!initSparseIntrinsics(s, store, flag, *cals[c]))
+        {
+            cerr << "Rig calibration needs intrinsic input with a non planar pattern" << endl;
+            return -1;
+        }
+    }
+
+    // Pose of each view in each camera
+    vector<vector<Mat> > rvecs(nCameras, vector<Mat>(nViews)), tvecs(nCameras, vector<Mat>(nViews));
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nViews; i++)
+        for (int c = 0; c < nCameras; c++)
+            if (!cals[c]->objectPoints[i].empty())
+                initViewPose(*cals[c], i, cals[c]->objectPoints[i], cals[c]->imagePoints[i], rvecs[c][i], tvecs[c][i]);
+
+    // Pose of each camera wrt the first one, walking from the cameras already placed
+    rig.R.assign(nCameras, Mat());
+    rig.T.assign(nCameras, Mat());
+    rig.R[0] = Mat::eye(3, 3, CV_64F);
+    rig.T[0] = Mat::zeros(3, 1, CV_64F);
+    vector<int> placed(1, 0);
+    for (size_t q = 0; q < placed.size(); q++)
+    {
+        int a = placed[q];
+        for (int b = 0; b < nCameras; b++)
+        {
+            Mat R, t;
+            if (!rig.R[b].empty())
+                continue;
+            vector<Mat> pairR[2] = { rvecs[a], rvecs[b] }, pairT[2] = { tvecs[a], tvecs[b] };
+            if (!medianRelativePose(pairR, pairT, R, t))
+                continue;
+            rig.R[b] = R * rig.R[a];
+            rig.T[b] = R * rig.T[a] + t;
+            placed.push_back(b);
+        }
+    }
+    if ((int)placed.size() < nCameras)
+    {
+        cerr << "Every camera must share views with the others to calibrate the rig" << endl;
+        return -1;
+    }
+
+    baRig baCams;
+    baCams.intrinsics.resize(nCameras * BA_NINTRINSICS);
+    baCams.rvecs.resize(3 * nCameras);
+    baCams.tvecs.resize(3 * nCameras);
+    for (int c = 0; c < nCameras; c++)
+    {
+        packIntrinsics(*cals[c], &baCams.intrinsics[c * BA_NINTRINSICS]);
+        Mat r;
+        Rodrigues(rig.R[c], r);
+        for (int j = 0; j < 3; j++)
+        {
+            baCams.rvecs[3*c + j] = r.at<double>(j);
+            baCams.tvecs[3*c + j] = rig.T[c].at<double>(j);
+        }
+    }
+
+    // The views are expressed in the first camera, from the first camera that saw them
+    vector<baView> baViews;
+    vector<int> views;
+    for (int i = 0; i < nViews; i++)
+    {
+        int c = 0;
+        while (c < nCameras && rvecs[c][i].empty()) c++;
+        if (c == nCameras)
+            continue;
+        Mat R, rvec, tvec;
+        Rodrigues(rvecs[c][i], R);
+        Rodrigues(rig.R[c].t() * R, rvec);
+        tvec = rig.R[c].t() * (tvecs[c][i] - rig.T[c]);
+
+        baView v;
+        for (int k = 0; k < nCameras; k++)
+            addViewPoints(v, Mat(cals[k]->objectPoints[i]), Mat(cals[k]->imagePoints[i]), k);
+        for (int j = 0; j < 3; j++)
+        {
+            v.rvec[j] = rvec.at<double>(j);
+            v.tvec[j] = tvec.at<double>(j);
+        }
+        baViews.push_back(v);
+        views.push_back(i);
+    }
+
+    rig.err = bundleAdjust(baCams, baViews, sparseOptions(s, flag));
+    rig.nSolves++;
+    rig.iterations += baCams.iterations;
+
+    for (int c = 0; c < nCameras; c++)
+    {
+        unpackIntrinsics(&baCams.intrinsics[c * BA_NINTRINSICS], *cals[c]);
+        Rodrigues(Mat(3, 1, CV_64F, &baCams.rvecs[3*c]), rig.R[c]);
+        rig.T[c] = Mat(3, 1, CV_64F, &baCams.tvecs[3*c]).clone();
+        cals[c]->rvecs.assign(nViews, Mat());
+        cals[c]->tvecs.assign(nViews, Mat());
+    }
+    // Extrinsics of each camera, for the reprojection errors
+    for (size_t n = 0; n < baViews.size(); n++)
+    {
+        int i = views[n];
+        Mat rvec = Mat(3, 1, CV_64F, baViews[n].rvec), tvec = Mat(3, 1, CV_64F, baViews[n].tvec), R;
+        Rodrigues(rvec, R);
+        for (int c = 0; c < nCameras; c++)
+            if (!cals[c]->objectPoints[i].empty())
+            {
+                Rodrigues(rig.R[c] * R, cals[c]->rvecs[i]);
+                cals[c]->tvecs[i] = rig.R[c] * tvec + rig.T[c];
+            }
+    }
+    return rig.err;
+}
+
+// Rig calibration: the intrinsics of every camera and their poses are solved together, with the
+// outlier rejection rounds of runIntrinsicCalibration. Returns the RMS reprojection error, or a
+// negative value if it failed
+static double runRigCalibration(const Settings &s, const vector<intrinsicCalibration*> &cals, rigCalibration &rig)
+{
+    int flag = s.flag;
+    for (size_t c = 0; c < cals.size(); c++)
+    {
+        if (s.useIntrinsicInput)     //the input intrinsics are the initial estimate
+        {
+            cals[c]->cameraMatrix = s.intrinsicInput.cameraMatrix.clone();
+            cals[c]->distCoeffs = s.intrinsicInput.distCoeffs.clone();
+            flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+        }
+        else if (s.calibrationPattern == Settings::ARUCO_BOX)     //or those of the box faces of each camera
+        {
+            if (!initBoxIntrinsics(s, *cals[c]))
+            {
+                cerr << "No face of the box has enough markers to initialize the intrinsics of camera " << c << endl;
+                return -1;
+            }
+            flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+        }
+        cals[c]->rvecs.clear();
+        cals[c]->tvecs.clear();
+    }
+
+    if (solveRig(s, cals, rig, flag) < 0)
+        return -1;
+    for (size_t c = 0; c < cals.size(); c++)
+        cals[c]->totalAvgErr = computeReprojectionErrors(*cals[c]);
+
+    // With a robust loss, the outliers are removed once, without solving again
+    if (s.robustLoss != Settings::NO_LOSS && s.outlierIterations > 0)
+    {
+        int removed = 0;
+        for (size_t c = 0; c < cals.size(); c++)
+        {
+            removed += rejectOutliers(s, *cals[c]);
+            cals[c]->totalAvgErr = computeReprojectionErrors(*cals[c]);
+        }
+        printf("Outliers of the robust solve: %d points removed\n", removed);
+    }
+    for (int round = 1; s.robustLoss == Settings::NO_LOSS && round <= s.outlierIterations; round++)
+    {
+        int removed = 0;
+        for (size_t c = 0; c < cals.size(); c++)
+            removed += rejectOutliers(s, *cals[c]);
+        if (removed == 0)
+            break;
+        if (solveRig(s, cals, rig, flag | CV_CALIB_USE_INTRINSIC_GUESS) < 0)
+            return -1;
+        for (size_t c = 0; c < cals.size(); c++)
+            cals[c]->totalAvgErr = computeReprojectionErrors(*cals[c]);
+        printf("Outlier rejection round %d: %d points removed. Rig reprojection error = %.4f\n",
+               round, removed, rig.err);
+    }
+    for (size_t c = 0; c < cals.size(); c++)
+        printf("\nJoint calibration of camera %d. Avg reprojection error = %.4f", (int)c, cals[c]->totalAvgErr);
+    printf("\n");
+    return rig.err;
+}
+
+// Joint stereo calibration: a rig calibration of both cameras. E and F are derived from R and T,
+// as in stereoCalibrate. Returns the RMS reprojection error, or a negative value if it failed
+static double runJointStereoCalibration(const Settings &s, intrinsicCalibration &inCal,
+                                        intrinsicCalibration &inCal2, stereoCalibration &sterCal)
+{
+    vector<intrinsicCalibration*> cals;
+    cals.push_back(&inCal);
+    cals.push_back(&inCal2);
+    rigCalibration rig;
+    double err = runRigCalibration(s, cals, rig);
+    if (err < 0)
+        return err;
+    sterCal.R = rig.R[1];
+    sterCal.T = rig.T[1];
+
+    // E = [T]x R and F = K2^-T E K1^-1
+    const Mat &T = sterCal.T;
+    Mat Tx = (Mat_<double>(3, 3) << 0, -T.at<double>(2), T.at<double>(1),
+                                    T.at<double>(2), 0, -T.at<double>(0),
+                                    -T.at<double>(1), T.at<double>(0), 0);
+    sterCal.E = Tx * sterCal.R;
+    sterCal.F = inCal2.cameraMatrix.inv().t() * sterCal.E * inCal.cameraMatrix.inv();
+    if (fabs(sterCal.F.at<double>(2, 2)) > 0)
+        sterCal.F /= sterCal.F.at<double>(2, 2);
+    return err;
+}
+
+// Replaces the image points of a camera of a store by their undistorted points in normalized coordinates.
+// The arrays are contiguous, so they are undistorted in chunks, in parallel
+static void normalizeStorePoints(correspondenceStore &store, int camera, const Mat &cameraMatrix, const Mat &distCoeffs)
+{
+    vector<Point2f> &points = store.imagePoints[camera];
+    const int chunk = 4096;
+    int n = (int)points.size(), nChunks = (n + chunk - 1)/chunk;
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nChunks; k++)
+    {
+        Mat part(min(chunk, n - k*chunk), 1, CV_32FC2, &points[k*chunk]), normalized;
+        undistortPoints(part, normalized, cameraMatrix, distCoeffs);
+        normalized.copyTo(part);
+    }
+}
+
+// stereoCalibrate with fixed intrinsics on the normalized points of both cameras, with identity camera matrices
+// and no distortion. Its error is in normalized units, so the RMS pixel error is measured afterwards: each view
+// is posed from its normalized left points, the right pose follows from R and T, and the object points are
+// projected with the real intrinsics of both cameras. F is derived from E with the real camera matrices
+static double normalizedStereoCalibrate(const Settings &s, const correspondenceStore &store, const intrinsicCalibration &inCal,
+                                        const intrinsicCalibration &inCal2, stereoCalibration &sterCal)
+{
+    correspondenceStore normalized = store;
+    runConcurrently([&]() { normalizeStorePoints(normalized, 0, inCal.cameraMatrix, inCal.distCoeffs); },
+                    [&]() { normalizeStorePoints(normalized, 1, inCal2.cameraMatrix, inCal2.distCoeffs); });
+    Mat K[2] = { Mat::eye(3, 3, CV_64F), Mat::eye(3, 3, CV_64F) }, D[2] = { Mat::zeros(1, 5, CV_64F), Mat::zeros(1, 5, CV_64F) };
+    stereoCalibrate(normalized.objectViews(), normalized.imageViews(0), normalized.imageViews(1), K[0], D[0], K[1], D[1],
+                    s.imageSize, sterCal.R, sterCal.T, sterCal.E, sterCal.F,
+                    TermCriteria(CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, 1000, 1e-10), CV_CALIB_FIX_INTRINSIC);
+    sterCal.F = inCal2.cameraMatrix.inv().t() * sterCal.E * inCal.cameraMatrix.inv();
+    if (fabs(sterCal.F.at<double>(2, 2)) > 0)
+        sterCal.F /= sterCal.F.at<double>(2, 2);
+
+    vector<double> viewErrs(store.size(), 0.);
+    ProjectionKernel cameras[2] = { ProjectionKernel(inCal.cameraMatrix, inCal.distCoeffs),
+                                    ProjectionKernel(inCal2.cameraMatrix, inCal2.distCoeffs) };
+    #pragma omp parallel for schedule(dynamic)
+    for (int v = 0; v < store.size(); v++)
+    {
+        Mat rvec, tvec, R1, rvec2, tvec2;
+        vector<Point2f> projected(store.count(v));
+        const Point3f *object = &store.objectPoints[store.objectOffsets[v]];
+        solvePnP(normalized.objectView(v), normalized.imageView(v), K[0], Mat(), rvec, tvec);
+        cameras[0].project(object, store.count(v), rvec, tvec, projected.data());
+        viewErrs[v] = pow(norm(Mat(projected), store.imageView(v), NORM_L2), 2);
+        Rodrigues(rvec, R1);
+        Rodrigues(sterCal.R * R1, rvec2);
+        tvec2 = sterCal.R * tvec + sterCal.T;
+        cameras[1].project(object, store.count(v), rvec2, tvec2, projected.data());
+        viewErrs[v] += pow(norm(Mat(projected), store.imageView(v, 1), NORM_L2), 2);
+    }
+    // Sum in view order, so the result does not depend on the number of threads
+    double sum = 0;
+    for (double e:viewErrs) sum += e;
+    int n = store.offsets.back();
+    return n > 0 ? sqrt(sum/(2*n)) : 0;
+}
+
+// Solves the rotation and translation between the cameras with stereoCalibrate, keeping the
+// intrinsics of each camera (from intrinsic input or runIntrinsicCalibration) fixed
+static double runFixedIntrinsicStereoCalibration(const Settings &s, intrinsicCalibration &inCal,
+                                                 intrinsicCalibration &inCal2, stereoCalibration &sterCal)
+{
+    if (s.useIntrinsicInput)     //precalculated intrinsic have been inputted. Use these
+    {
+        inCal.cameraMatrix = s.intrinsicInput.cameraMatrix;
+        inCal2.cameraMatrix = s.intrinsicInput.cameraMatrix;
+        inCal.distCoeffs = s.intrinsicInput.distCoeffs;
+        inCal2.distCoeffs = s.intrinsicInput.distCoeffs;
+    }
+
+    // Stereo calibration requires both images to have the same # of image and object points, but
+    // getSharedPoints limits the points lists to only those points shared between each image
+    if (s.calibrationPattern != Settings::CHESSBOARD)       //ArUco pattern
+        getSharedPoints(inCal, inCal2);
+
+    // Views rejected in either camera are left out
+    correspondenceStore store;
+    for (int i = 0; i < (int)inCal.objectPoints.size(); i++)
+        if (!inCal.imagePoints[i].empty() && !inCal2.imagePoints[i].empty())
+            store.add(i, inCal.objectPoints[i], inCal.imagePoints[i], &inCal2.imagePoints[i]);
+
+    // The intrinsics are fixed, so the result only depends on them and on the shared points
+    vector<Mat> inputs;
+    inputs.push_back(inCal.cameraMatrix);
+    inputs.push_back(inCal.distCoeffs);
+    inputs.push_back(inCal2.cameraMatrix);
+    inputs.push_back(inCal2.distCoeffs);
+    string cacheFile = solveCacheFile(s, s.normalizedStereo ? "stereo FIX_INTRINSIC normalized 1000 1e-10"
+                                                            : "stereo FIX_INTRINSIC 1000 1e-10", store, vector<int>(), inputs);
+    map<string, Mat> cached;
+    Size size;
+    if (!cacheFile.empty() && readCalibrationBinary(cacheFile, SOLVE_FILE, size, cached) && size == s.imageSize
+            && cached["Stereo_Reprojection_Error"].total() == 1 && !cached["Rotation_Matrix"].empty())
+    {
+        sterCal.R = cached["Rotation_Matrix"];
+        sterCal.T = cached["Translation_Vector"];
+        sterCal.E = cached["Essential_Matrix"];
+        sterCal.F = cached["Fundamental_Matrix"];
+        printf("\nStereo extrinsics read from the solve cache\n");
+        return cached["Stereo_Reprojection_Error"].at<double>(0);
+    }
+
+    double err;
+    if (s.normalizedStereo)
+        err = normalizedStereoCalibrate(s, store, inCal, inCal2, sterCal);
+    else
+        err = stereoCalibrate(
+               store.objectViews(), store.imageViews(0), store.imageViews(1),
+               inCal.cameraMatrix, inCal.distCoeffs,
+               inCal2.cameraMatrix, inCal2.distCoeffs,
+               s.imageSize, sterCal.R, sterCal.T, sterCal.E, sterCal.F, TermCriteria(CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, 1000, 1e-10), CV_CALIB_FIX_INTRINSIC);
+    if (!cacheFile.empty())
+    {
+        vector<pair<string, Mat> > mats;
+        mats.push_back(make_pair("Rotation_Matrix", sterCal.R));
+        mats.push_back(make_pair("Translation_Vector", sterCal.T));
+        mats.push_back(make_pair("Essential_Matrix", sterCal.E));
+        mats.push_back(make_pair("Fundamental_Matrix", sterCal.F));
+        mats.push_back(make_pair("Stereo_Reprojection_Error", Mat(1, 1, CV_64F, Scalar(err))));
+        if (!writeCalibrationBinary(cacheFile, SOLVE_FILE, s.imageSize, mats))
+            cerr << "Could not write to the solve cache: " << cacheFile << endl;
+    }
+    return err;
+}
+
+// Computes the rectification of extrinsics, and with maps, the maps of the rectified images
+static void rectifyExtrinsics(const Settings &s, intrinsicCalibration &inCal, intrinsicCalibration &inCal2,
+                              stereoCalibration &sterCal, bool maps)
+{
+    stereoRectify(inCal.cameraMatrix, inCal.distCoeffs,
+                 inCal2.cameraMatrix, inCal2.distCoeffs,
+                 s.imageSize, sterCal.R, sterCal.T, sterCal.R1, sterCal.R2,
+                 sterCal.P1, sterCal.P2, sterCal.Q,
+                 CALIB_ZERO_DISPARITY, 1, s.imageSize,
+                 &sterCal.validRoi[0], &sterCal.validRoi[1]);
+    if (!maps)
+        return;
+
+    //Precompute maps for remap(), one camera on each thread. They are not kept when the images are rectified in bands,
+    //and only the sparse maps are computed with Map_GridStep
+    if (s.mapGridStep > 0)
+    {
+        buildMapGrid(inCal.cameraMatrix, inCal.distCoeffs, sterCal.R1, sterCal.P1, s.imageSize, s.mapGridStep,
+                     sterCal.rectifyGrid[0]);
+        buildMapGrid(inCal2.cameraMatrix, inCal2.distCoeffs, sterCal.R2, sterCal.P2, s.imageSize, s.mapGridStep,
+                     sterCal.rectifyGrid[1]);
+    }
+    else
+    {
+        // With Rectify_TableStep, the distortion of each camera is sampled once, and the maps of this and any later
+        // rectification of the same intrinsics (the bands, an extrinsic update) are looked up in it
+        runConcurrently([&]() { updateDistortionTable(s, inCal); }, [&]() { updateDistortionTable(s, inCal2); });
+        if (s.rectifyBandRows == 0)
+            runConcurrently(
+                [&]() { rectifyMaps(s, inCal, sterCal.R1, sterCal.P1, s.imageSize, sterCal.rmap[0][0], sterCal.rmap[0][1]); },
+                [&]() { rectifyMaps(s, inCal2, sterCal.R2, sterCal.P2, s.imageSize, sterCal.rmap[1][0], sterCal.rmap[1][1]); });
+    }
+}
+
+// Run stereo calibration, using the points and intrinsics of two viewpoints to determine
+// the rotation and translation between them. With joint calibration, the intrinsics are solved here too
+stereoCalibration runStereoCalibration(const Settings &s, intrinsicCalibration &inCal,
+                                       intrinsicCalibration &inCal2, ImageWriter &writer, FrameStore &frames)
+{
+    stereoCalibration sterCal;
+    double err = -1;
+    if (s.jointStereo)
+    {
+        err = runJointStereoCalibration(s, inCal, inCal2, sterCal);
+        if (err < 0)
+        {
+            cerr << "Joint stereo calibration failed. Calibrating each camera first" << endl;
+            if (!s.useIntrinsicInput)
+                runConcurrently([&]() { runIntrinsicCalibration(s, inCal); },
+                                [&]() { runIntrinsicCalibration(s, inCal2); });
+        }
+    }
+    if (err < 0)
+        err = runFixedIntrinsicStereoCalibration(s, inCal, inCal2, sterCal);
+
+    printf("\nStereo reprojection error = %.4f\n", err);
+
+    // Rectify the images using these extrinsic results
+    rectifyExtrinsics(s, inCal, inCal2, sterCal, true);
+    rectifyImages(s, inCal, inCal2, sterCal, writer, frames);
+    return sterCal;
+}
+
+// Updates the stored extrinsics (Stereo_DriftInput) of a rig whose cameras only moved wrt each other, from a few
+// views: R and T and the pose of each view are refined with bundleAdjust from the stored R and T and the pose of
+// the view in the left camera, on the shared corners of the views. The intrinsics are fixed, so the corners are
+// undistorted first and solved in normalized coordinates, with any distortion model. Only the rectification is
+// computed again, and the maps if they are saved; the images are not rectified. Returns false if no view has a pose
+static bool runExtrinsicUpdate(const Settings &s, intrinsicCalibration &inCal, intrinsicCalibration &inCal2,
+                               stereoCalibration &sterCal)
+{
+    baRig rig;
+    rig.intrinsics.assign(2 * BA_NINTRINSICS, 0.);
+    rig.rvecs.assign(6, 0.);
+    rig.tvecs.assign(6, 0.);
+    for (int c = 0; c < 2; c++)
+        rig.intrinsics[c * BA_NINTRINSICS + BA_FX] = rig.intrinsics[c * BA_NINTRINSICS + BA_FY] = 1;
+    Mat r, R, T;
+    s.driftInput.R.convertTo(R, CV_64F);
+    s.driftInput.T.reshape(1, 3).convertTo(T, CV_64F);
+    Rodrigues(R, r);
+    for (int j = 0; j < 3; j++)
+    {
+        rig.rvecs[3 + j] = r.at<double>(j);
+        rig.tvecs[3 + j] = T.at<double>(j);
+    }
+
+    int nViews = (int)min(inCal.imagePoints.size(), inCal2.imagePoints.size());
+    vector<baView> baViews(nViews);
+    vector<bool> posed(nViews, false);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < nViews; i++)
+    {
+        const vector<Point3f> &object = inCal.objectPoints[i];
+        if (object.size() < 4 || object.size() != inCal.imagePoints[i].size()
+                || object.size() != inCal2.imagePoints[i].size())
+            continue;
+        vector<Point2f> normalized[2];
+        undistortPoints(inCal.imagePoints[i], normalized[0], inCal.cameraMatrix, inCal.distCoeffs);
+        undistortPoints(inCal2.imagePoints[i], normalized[1], inCal2.cameraMatrix, inCal2.distCoeffs);
+        Mat rvec, tvec;
+        try { solvePnP(object, normalized[0], Mat::eye(3, 3, CV_64F), noArray(), rvec, tvec); }
+        catch (const cv::Exception &) { continue; }     // Too few points for a pose
+        baView &v = baViews[i];
+        for (int c = 0; c < 2; c++)
+            addViewPoints(v, Mat(object), Mat(normalized[c]), c);
+        for (int j = 0; j < 3; j++)
+        {
+            v.rvec[j] = rvec.at<double>(j);
+            v.tvec[j] = tvec.at<double>(j);
+        }
+        posed[i] = true;
+    }
+    vector<baView> views;
+    for (int i = 0; i < nViews; i++)
+        if (posed[i])
+            views.push_back(baViews[i]);
+    if (views.empty())
+        return false;
+
+    baOptions opt;
+    for (int p = 0; p < BA_NINTRINSICS; p++)
+        opt.fixed[p] = true;
+    double err = bundleAdjust(rig, views, opt);
+    Rodrigues(Mat(3, 1, CV_64F, &rig.rvecs[3]), sterCal.R);
+    sterCal.T = Mat(3, 1, CV_64F, &rig.tvecs[3]).clone();
+
+    // E = [T]x R and F = K2^-T E K1^-1
+    const Mat &t = sterCal.T;
+    Mat Tx = (Mat_<double>(3, 3) << 0, -t.at<double>(2), t.at<double>(1),
+                                    t.at<double>(2), 0, -t.at<double>(0),
+                                    -t.at<double>(1), t.at<double>(0), 0);
+    sterCal.E = Tx * sterCal.R;
+    sterCal.F = inCal2.cameraMatrix.inv().t() * sterCal.E * inCal.cameraMatrix.inv();
+    if (fabs(sterCal.F.at<double>(2, 2)) > 0)
+        sterCal.F /= sterCal.F.at<double>(2, 2);
+
+    // The error is in normalized coordinates, so it is scaled by the focal length of the left camera
+    printf("\nExtrinsic update on %d views: %d iterations, reprojection error = %.4f pixels\n", (int)views.size(),
+           rig.iterations, err * inCal.cameraMatrix.at<double>(0, 0));
+    rectifyExtrinsics(s, inCal, inCal2, sterCal, s.saveBinary);
+    return true;
+}
+
+// Measures the rectification of a stereo calibration on the corners its views share, without remapping any
+// image. The corners of each camera are rectified with its R and P, where a good calibration gives both corners
+// of a point the same row, and undistorted with its camera matrix, where the right corner should lie on the
+// epipolar line of the left one. The views are measured in parallel
+rectificationCheck checkRectification(const Settings &s, const intrinsicCalibration &inCal,
+                                      const intrinsicCalibration &inCal2, const stereoCalibration &sterCal)
+{
+    rectificationCheck q;
+    vector<int> views;
+    for (int v = 0; v < (int)min(inCal.imagePoints.size(), inCal2.imagePoints.size()); v++)
+        if (!inCal.imagePoints[v].empty() && inCal.imagePoints[v].size() == inCal2.imagePoints[v].size())
+            views.push_back(v);
+    q.views.resize(views.size());
+    vector<double> sumSq(views.size());
+
+    // With Rectify_CheckLookupStep, the rectification and the undistortion of each camera are tables
+    UndistortLookup lookup[4];
+    if (s.checkLookupStep > 0)
+    {
+        #pragma omp parallel for
+        for (int k = 0; k < 4; k++)
+        {
+            const intrinsicCalibration &cal = k%2 == 0 ? inCal : inCal2;
+            if (k < 2)
+                lookup[k].create(cal.cameraMatrix, cal.distCoeffs, s.imageSize, s.checkLookupStep,
+                                 k == 0 ? sterCal.R1 : sterCal.R2, k == 0 ? sterCal.P1 : sterCal.P2);
+            else
+                lookup[k].create(cal.cameraMatrix, cal.distCoeffs, s.imageSize, s.checkLookupStep);
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < (int)views.size(); j++)
+    {
+        int v = views[j];
+        const vector<Point2f> &left = inCal.imagePoints[v], &right = inCal2.imagePoints[v];
+        vector<Point2f> r1, r2, u1, u2;
+        if (s.checkLookupStep > 0)
+        {
+            lookup[0].undistort(left, r1);
+            lookup[1].undistort(right, r2);
+            lookup[2].undistort(left, u1);
+            lookup[3].undistort(right, u2);
+        }
+        else
+        {
+            undistortPoints(left, r1, inCal.cameraMatrix, inCal.distCoeffs, sterCal.R1, sterCal.P1);
+            undistortPoints(right, r2, inCal2.cameraMatrix, inCal2.distCoeffs, sterCal.R2, sterCal.P2);
+            undistortPoints(left, u1, inCal.cameraMatrix, inCal.distCoeffs, noArray(), inCal.cameraMatrix);
+            undistortPoints(right, u2, inCal2.cameraMatrix, inCal2.distCoeffs, noArray(), inCal2.cameraMatrix);
+        }
+        vector<Vec3f> lines;    // Normalized, so a*x + b*y + c is the distance to the line
+        computeCorrespondEpilines(u1, 1, sterCal.F, lines);
+
+        rectificationCheck::view &r = q.views[j];
+        r.index = v;
+        r.points = (int)left.size();
+        r.meanDy = r.maxDy = r.epipolar = 0;
+        for (size_t k = 0; k < left.size(); k++)
+        {
+            double dy = fabs(r1[k].y - r2[k].y);
+            r.meanDy += dy;
+            sumSq[j] += dy*dy;
+            r.maxDy = max(r.maxDy, dy);
+            r.epipolar += fabs(lines[k][0]*u2[k].x + lines[k][1]*u2[k].y + lines[k][2]);
+        }
+        r.rmsDy = sqrt(sumSq[j]/r.points);
+        r.meanDy /= r.points;
+        r.epipolar /= r.points;
+    }
+
+    double totalSq = 0;
+    for (size_t j = 0; j < q.views.size(); j++)
+    {
+        const rectificationCheck::view &r = q.views[j];
+        q.points += r.points;
+        q.meanDy += r.meanDy*r.points;
+        q.epipolar += r.epipolar*r.points;
+        q.maxDy = max(q.maxDy, r.maxDy);
+        totalSq += sumSq[j];
+    }
+    if (q.points > 0)
+    {
+        q.meanDy /= q.points;
+        q.epipolar /= q.points;
+        q.rmsDy = sqrt(totalSq/q.points);
+    }
+    q.accepted = q.points > 0 && (s.maxVerticalError <= 0 || q.rmsDy <= s.maxVerticalError);
+    return q;
+}
 
-        fs << "Stereo_Parameters";
-        fs << "{" << "Rotation_Matrix"     << sterCal.R
-                  << "Translation_Vector"  << sterCal.T
-                  << "Essential_Matrix"    << sterCal.E
-                  << "Fundamental_Matrix"  << sterCal.F
-           << "}";
+// Checks a stereo rig against its stored extrinsics (Stereo_DriftInput) without calibrating, so that a few views
+// are enough. The stored extrinsics are checked on the new views as a new calibration would be (see
+// checkRectification), with the intrinsic input in both cameras, and the pose of the pattern in each view is
+// solved in each camera, which gives the pose of the right camera wrt the left one to compare with R and T
+driftCheck checkDrift(const Settings &s, intrinsicCalibration &inCal, intrinsicCalibration &inCal2)
+{
+    inCal.cameraMatrix = inCal2.cameraMatrix = s.intrinsicInput.cameraMatrix;
+    inCal.distCoeffs = inCal2.distCoeffs = s.intrinsicInput.distCoeffs;
+    if (s.calibrationPattern != Settings::CHESSBOARD)       //ArUco pattern
+        getSharedPoints(inCal, inCal2);
 
-        fs << "Rectification_Parameters";
-        fs << "{" << "Rectification_Transformation_1"       << sterCal.R1
-                  << "Rectification_Transformation_2"       << sterCal.R2
-                  << "Projection_Matrix_1"                  << sterCal.P1
-                  << "Projection_Matrix_2"                  << sterCal.P2
-                  << "Disparity-to-depth_Mapping_Matrix"    << sterCal.Q
-           << "}";
+    driftCheck d;
+    d.rectification = checkRectification(s, inCal, inCal2, s.driftInput);
+    int n = (int)d.rectification.views.size();
+    vector<Mat> rvecs[2], tvecs[2];
+    for (int k = 0; k < 2; k++)
+    {
+        rvecs[k].resize(n);
+        tvecs[k].resize(n);
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < 2*n; j++)
+    {
+        int k = j%2, v = d.rectification.views[j/2].index;
+        const intrinsicCalibration &cal = k == 0 ? inCal : inCal2;
+        if (v >= (int)cal.objectPoints.size() || cal.objectPoints[v].size() != cal.imagePoints[v].size())
+            continue;
+        Mat rvec, tvec;
+        try { solvePnP(cal.objectPoints[v], cal.imagePoints[v], cal.cameraMatrix, cal.distCoeffs, rvec, tvec); }
+        catch (const cv::Exception &) { continue; }     // Too few points for a pose
+        rvecs[k][j/2] = rvec;
+        tvecs[k][j/2] = tvec;
+    }
+    for (int j = 0; j < n; j++)
+        if (!rvecs[0][j].empty() && !rvecs[1][j].empty())
+            d.views++;
+
+    Mat R, T;
+    if (medianRelativePose(rvecs, tvecs, R, T))
+    {
+        Mat storedR, storedT, r;
+        s.driftInput.R.convertTo(storedR, CV_64F);
+        s.driftInput.T.reshape(1, 3).convertTo(storedT, CV_64F);
+        Rodrigues(Mat(R * storedR.t()), r);
+        d.rotation = norm(r) * 180 / CV_PI;
+        d.translation = norm(T - storedT);
+        d.translationRatio = d.translation / max(norm(storedT), 1e-12);
+    }
+    d.recalibrate = d.rectification.points == 0 || d.rectification.rmsDy > s.driftThreshold;
+    return d;
+}
+
+// Records the intrinsic solves of a calibration struct in the run report
+static void reportIntrinsicSolves(const Settings &s, runReport &report, const string &name, const intrinsicCalibration &inCal)
+{
+    report.addSolver(name, inCal.nSolves, s.solver == Settings::SPARSE_SOLVER ? inCal.solverIterations : -1);
+}
+
+// Runs the appropriate calibration based on the mode and saves the results
+void runCalibrationAndSave(const Settings &s, intrinsicCalibration &inCal, intrinsicCalibration &inCal2,
+                           ImageWriter &writer, FrameStore &frames, runReport &report)
+{
+    bool ok;
+    if (s.calibrationPattern == Settings::ARUCO_BOARDS)
+        splitBoardViews(s, inCal);
+    vector<bool> had = runReport::viewsWithPoints(inCal), had2 = runReport::viewsWithPoints(inCal2);
+    if (s.mode == Settings::STEREO) {         // stereo calibration
+        if (s.useDriftInput)
+        {
+            driftCheck drift;
+            {
+                runReport::stage timing(report, "Drift check");
+                drift = checkDrift(s, inCal, inCal2);
+            }
+            report.drifted(drift);
+            printf("\nDrift check of the stored extrinsics on %d corners of %d views: vertical error RMS %.3f, "
+                   "max %.3f pixels, epipolar error %.3f pixels\n", drift.rectification.points,
+                   (int)drift.rectification.views.size(), drift.rectification.rmsDy, drift.rectification.maxDy,
+                   drift.rectification.epipolar);
+            if (drift.rotation >= 0)
+                printf("Pose drift on %d views: rotation %.4f degrees, translation %.4f (%.2f%% of the baseline)\n",
+                       drift.views, drift.rotation, drift.translation, 100*drift.translationRatio);
+            if (!drift.recalibrate)
+            {
+                printf("RMS vertical error within Stereo_DriftThreshold (%.3f), the stored extrinsics are kept\n",
+                       s.driftThreshold);
+                return;
+            }
+            printf("RMS vertical error above Stereo_DriftThreshold (%.3f), %s\n", s.driftThreshold,
+                   s.extrinsicUpdate ? "updating the extrinsics" : "calibrating again");
+        }
+
+        stereoCalibration sterCal;
+        bool updated = false;
+        if (s.useDriftInput && s.extrinsicUpdate)
+        {
+            runReport::stage timing(report, "Extrinsic update");
+            updated = runExtrinsicUpdate(s, inCal, inCal2, sterCal);
+            if (!updated)
+                cerr << "Extrinsic update failed, no view has a pose in both cameras. Calibrating again" << endl;
+        }
+        if (updated)
+            ok = true;
+        else if (!s.useIntrinsicInput && !s.jointStereo)
+        {
+        // The cameras are calibrated independently, so both run at once. The results
+        // are printed afterwards, always left first
+        bool ok2 = false;
+        {
+            runReport::stage timing(report, "Intrinsic calibration");
+            runConcurrently([&]() { ok = runIntrinsicCalibration(s, inCal); },
+                            [&]() { ok2 = runIntrinsicCalibration(s, inCal2); });
+        }
+        reportIntrinsicSolves(s, report, "Left intrinsics", inCal);
+        reportIntrinsicSolves(s, report, "Right intrinsics", inCal2);
+        report.rejectCleared(inCal, had, 0, 2, "outlier rejection");
+        report.rejectCleared(inCal2, had2, 1, 2, "outlier rejection");
+        printf("%s for left. Avg reprojection error = %.4f\n",
+                ok ? "\nIntrinsic calibration succeeded" : "\nIntrinsic calibration failed",
+                inCal.totalAvgErr);
+        ok = ok2;
+        printf("%s for right. Avg reprojection error = %.4f\n",
+                ok ? "\nIntrinsic calibration succeeded" : "\nIntrinsic calibration failed",
+                inCal2.totalAvgErr);
+        } else
+            ok = true;
+
+        if (!updated)
+        {
+            runReport::stage timing(report, "Stereo calibration and rectification");
+            sterCal = runStereoCalibration(s, inCal, inCal2, writer, frames);
+        }
+        rectificationCheck check;
+        {
+            runReport::stage timing(report, "Rectification check");
+            check = checkRectification(s, inCal, inCal2, sterCal);
+        }
+        report.rectified(check);
+        printf("\nRectification check on %d corners of %d views: vertical error mean %.3f, RMS %.3f, max %.3f pixels, "
+               "epipolar error %.3f pixels\n", check.points, (int)check.views.size(), check.meanDy, check.rmsDy,
+               check.maxDy, check.epipolar);
+        if (!check.accepted)
+        {
+            cerr << "Stereo calibration rejected: RMS vertical error above Rectify_MaxVerticalError ("
+                 << s.maxVerticalError << "), the extrinsics are not saved" << endl;
+            return;
+        }
+        runReport::stage timing(report, "Saving");
+        s.saveExtrinsics(sterCal);
+
+    } else {                        // intrinsic calibration
+        if (s.keyframeViews > 0)
+        {
+            runReport::stage timing(report, "Keyframe selection");
+            selectKeyframes(s, inCal);
+            report.rejectCleared(inCal, had, 0, 1, "not a keyframe");
+            had = runReport::viewsWithPoints(inCal);
+        }
+        {
+            runReport::stage timing(report, "Intrinsic calibration");
+            ok = runIntrinsicCalibration(s, inCal);
+        }
+        reportIntrinsicSolves(s, report, "Intrinsics", inCal);
+        report.rejectCleared(inCal, had, 0, 1, "outlier rejection");
+        printf("%s. Avg reprojection error = %.4f\n",
+                ok ? "\nIntrinsic calibration succeeded" : "\nIntrinsic calibration failed",
+                inCal.totalAvgErr);
+
+        if( ok ) {
+            {
+                runReport::stage timing(report, "Undistortion");
+                undistortImages(s, inCal, writer, frames);
+            }
+            {
+                runReport::stage timing(report, "Saving");
+                s.saveIntrinsics(inCal);
+                addToHistory(s, inCal);
+            }
+            if (s.subsetTrials > 0)
+            {
+                runReport::stage timing(report, "Subset analysis");
+                runSubsetAnalysis(s, inCal);
+            }
+        }
+    }
+}
+
+// Runs the rig calibration of MULTI mode and saves the results
+void runRigCalibrationAndSave(const Settings &s, vector<intrinsicCalibration> &cams, runReport &report)
+{
+    vector<intrinsicCalibration*> cals;
+    for (auto &c:cams) cals.push_back(&c);
+    rigCalibration rig;
+    double err;
+    {
+        runReport::stage timing(report, "Rig calibration");
+        err = runRigCalibration(s, cals, rig);
+    }
+    report.addSolver("Rig", rig.nSolves, rig.iterations);
+    if (err < 0)
+    {
+        printf("\nRig calibration failed\n");
+        return;
+    }
+    printf("\nRig calibration succeeded. Reprojection error = %.4f\n", rig.err);
+    runReport::stage timing(report, "Saving");
+    s.saveRig(cams, rig);
+}
+
+// Calibrates the intrinsics from the live preview while frames keep arriving. Views are handed to add(),
+// and a background thread solves the calibration again with bundleAdjust whenever there are new ones,
+// starting from the last estimate and the last pose of each view. A view is only kept if the pattern
+// moved or changed its size or shape since every kept view, so holding the pattern still adds nothing
+class IncrementalCalibrator
+{
+public:
+    IncrementalCalibrator() : s(NULL), stop(false), nSolved(0), nEstimates(0) {}
+    ~IncrementalCalibrator() { close(); }
+
+    // Starts the solving thread. The image size of the settings must not change while it is open
+    void open(const Settings &settings)
+    {
+        close();
+        s = &settings;
+        stop = false;
+        setGuess(settings);
+        worker = thread(&IncrementalCalibrator::work, this);
+    }
+
+    // Copies the intrinsic input that the first solve starts from, so that a live reload of the lens setting
+    // changes it between two solves
+    void setGuess(const Settings &settings)
+    {
+        lock_guard<mutex> lock(m);
+        guess = intrinsicCalibration();
+        if (settings.useIntrinsicInput)
+        {
+            guess.cameraMatrix = settings.intrinsicInput.cameraMatrix.clone();
+            guess.distCoeffs = settings.intrinsicInput.distCoeffs.clone();
+        }
+    }
+    bool isOpened() const { return worker.joinable(); }
+
+    // Adds a view if it differs from the kept ones. Returns true if it was kept
+    bool add(const vector<Point2f> &imagePoints, const vector<Point3f> &objectPoints)
+    {
+        if (objectPoints.size() < 4)
+            return false;
+        // Shape of the view: center and size of the bounding box of its points, in image widths
+        Rect box = boundingRect(imagePoints);
+        float w = (float)s->imageSize.width;
+        Vec4f shape((box.x + box.width/2.f)/w, (box.y + box.height/2.f)/w, box.width/w, box.height/w);
+
+        Mat cameraMatrix, distCoeffs;
+        {
+            lock_guard<mutex> lock(m);
+            for (auto &kept:shapes)
+                if (norm(shape - kept, NORM_INF) < minViewChange)
+                    return false;
+            shapes.push_back(shape);
+            views.imagePoints.push_back(imagePoints);
+            views.objectPoints.push_back(objectPoints);
+            cameraMatrix = estimate.cameraMatrix;   // A new estimate replaces these, it does not write into them
+            distCoeffs = estimate.distCoeffs;
+        }
+        added.notify_one();
+
+        // The view is scored without the lock, so the solving thread does not wait for its pose
+        double err;
+        int poseBin;
+        captureStats::score(imagePoints, objectPoints, s->imageSize, cameraMatrix, distCoeffs, err, poseBin);
+        lock_guard<mutex> lock(m);
+        stats.add(imagePoints, s->imageSize, err, poseBin);
+        return true;
+    }
+
+    // Running statistics of the kept views, with a copy of their grid
+    captureStats captured()
+    {
+        lock_guard<mutex> lock(m);
+        captureStats st = stats;
+        st.cells = stats.cells.clone();
+        return st;
+    }
+
+    // Returns the number of estimates so far (0 if there is none yet). The last one is copied to cal,
+    // unless it is estimate number known, which the caller already has
+    int get(intrinsicCalibration &cal, int known = -1)
+    {
+        lock_guard<mutex> lock(m);
+        if (nEstimates != known) cal = estimate;
+        return nEstimates;
+    }
+
+    // Number of kept views and fraction of the image they cover
+    void coverage(int &nViews, double &covered)
+    {
+        lock_guard<mutex> lock(m);
+        nViews = (int)views.objectPoints.size();
+        covered = stats.covered();
+    }
+
+    // Draws the number of views, the coverage, the running view error and poses, and the intrinsics of cal
+    // (an estimate) with their standard deviation
+    void drawStatus(Mat &img, const intrinsicCalibration &cal)
+    {
+        int nViews;
+        double covered;
+        bool solved = !cal.cameraMatrix.empty();
+        coverage(nViews, covered);
+        captureStats st = captured();
+
+        char text[256];
+        vector<string> lines;
+        vector<Scalar> colors;
+        sprintf(text, "Views: %d  Coverage: %.0f%%", nViews, covered*100);
+        lines.push_back(text);
+        colors.push_back(Scalar(255, 255, 255));
+        if (st.scored > 0)
+            sprintf(text, "View error: %.2f +- %.2f px  Poses: %d", st.errMean, st.errStdDev(), st.poses);
+        else
+            sprintf(text, "Poses: %d", st.poses);
+        lines.push_back(text);
+        colors.push_back(Scalar(255, 255, 255));
+        if (solved)
+        {
+            const char *names[4] = { "fx", "fy", "cx", "cy" };
+            double k[4] = { cal.cameraMatrix.at<double>(0, 0), cal.cameraMatrix.at<double>(1, 1),
+                            cal.cameraMatrix.at<double>(0, 2), cal.cameraMatrix.at<double>(1, 2) };
+            double maxStdDev = 0;
+            for (int j = 0; j < 4; j++)
+            {
+                double sd = cal.stdDevs.empty() ? 0 : cal.stdDevs.at<double>(j);
+                maxStdDev = max(maxStdDev, sd);
+                sprintf(text, "%s: %.1f +- %.2f", names[j], k[j], sd);
+                lines.push_back(text);
+                colors.push_back(Scalar(255, 255, 255));
+            }
+            bool stable = !cal.stdDevs.empty() && maxStdDev <= s->incrementalTolerance;
+            sprintf(text, "Error: %.2f px  %s", cal.totalAvgErr, stable ? "Stable" : "Add more views");
+            lines.push_back(text);
+            colors.push_back(stable ? Scalar(0, 255, 0) : Scalar(0, 0, 255));
+        }
+        for (size_t j = 0; j < lines.size(); j++)
+        {
+            Point org(10, 25 + 22*(int)j);
+            putText(img, lines[j], org, FONT_HERSHEY_SIMPLEX, .6f, Scalar(0, 0, 0), 3);
+            putText(img, lines[j], org, FONT_HERSHEY_SIMPLEX, .6f, colors[j], 1);
+        }
+
+        // Coverage map in the top right corner: covered cells in green, brighter with more corners
+        const Mat &map = st.cells;
+        if (map.empty())
+            return;
+        int scale = max(1, img.cols/(4*map.cols));
+        Rect roi(img.cols - map.cols*scale - 10, 10, map.cols*scale, map.rows*scale);
+        if (roi.x < 0 || roi.br().y > img.rows)
+            return;
+        double maxCount;
+        minMaxLoc(map, NULL, &maxCount);
+        Mat level, big, mask, color;
+        map.convertTo(level, CV_8U, 175./max(1., maxCount), 80);
+        resize(level, big, roi.size(), 0, 0, INTER_NEAREST);
+        resize(map > 0, mask, roi.size(), 0, 0, INTER_NEAREST);
+        color = Mat(roi.size(), img.type(), Scalar::all(64));
+        Mat zero = Mat::zeros(roi.size(), CV_8U), green;
+        vector<Mat> planes = { zero, big, zero };
+        merge(planes, green);
+        if (img.channels() == 3)
+            green.copyTo(color, mask);
+        else
+            big.copyTo(color, mask);
+        addWeighted(img(roi), 0.3, color, 0.7, 0, img(roi));
+        rectangle(img, roi, Scalar(255, 255, 255));
+    }
+
+    // Waits for the current solve to finish and stops the thread
+    void close()
+    {
+        if (!worker.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(m);
+            stop = true;
+        }
+        added.notify_one();
+        worker.join();
+    }
+
+private:
+    static const int minViews = 3;          // Views needed for the first solve
+    static constexpr float minViewChange = 0.05f;  // Change of the view shape (image widths) needed to keep a view
+
+    void work()
+    {
+        unique_lock<mutex> lock(m);
+        for (;;)
+        {
+            added.wait(lock, [this]() { return stop || (int)views.objectPoints.size() > nSolved; });
+            if (stop)
+                return;
+            // Solve a copy of the views, so more can be added meanwhile
+            intrinsicCalibration cal = estimate;
+            if (cal.cameraMatrix.empty() && !guess.cameraMatrix.empty())
+            {
+                cal.cameraMatrix = guess.cameraMatrix.clone();
+                cal.distCoeffs = guess.distCoeffs.clone();
+            }
+            cal.imagePoints = views.imagePoints;
+            cal.objectPoints = views.objectPoints;
+            nSolved = (int)cal.objectPoints.size();
+            if (nSolved < minViews)
+                continue;
+            lock.unlock();
+            bool ok = false;
+            try { ok = solve(cal); }
+            catch (const cv::Exception &e) { cerr << "Incremental calibration failed: " << e.what() << endl; }
+            lock.lock();
+            if (ok)
+            {
+                estimate = cal;
+                nEstimates++;
+            }
+        }
+    }
+
+    // Solves the views of cal, starting from its intrinsics (the intrinsic input for the first solve) and poses
+    // if it has them
+    bool solve(intrinsicCalibration &cal)
+    {
+        int flag = s->flag;
+        if (!cal.cameraMatrix.empty())
+            flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+        else if (s->calibrationPattern == Settings::ARUCO_BOX)
+        {
+            if (!initBoxIntrinsics(*s, cal))
+                return false;
+            flag |= CV_CALIB_USE_INTRINSIC_GUESS;
+        }
+        correspondenceStore store;      // Every kept view has points, so the views keep their order
+        store.add(cal);
+        vector<Mat> rvecs, tvecs;
+        sparseCalibrateCamera(*s, cal, store, rvecs, tvecs, flag);
+        cal.rvecs.swap(rvecs);
+        cal.tvecs.swap(tvecs);
+        if (!checkRange(cal.cameraMatrix) || !checkRange(cal.distCoeffs))
+            return false;
+        cal.totalAvgErr = computeReprojectionErrors(cal);
+        return true;
+    }
+
+    const Settings *s;
+    thread worker;
+    mutex m;
+    condition_variable added;
+    bool stop;
+    intrinsicCalibration views;     // Kept views (points only)
+    vector<Vec4f> shapes;           // Shape of each kept view (see add)
+    captureStats stats;             // Running statistics of the kept views, with their coverage grid
+    intrinsicCalibration estimate;  // Last estimate
+    intrinsicCalibration guess;     // Intrinsic input, if any (see setGuess)
+    int nSolved;                    // Number of views in the last solve
+    int nEstimates;                 // Number of estimates so far
+};
+
+// The camera matrix of intrinsics calibrated at one image size, for images of another size. It is rescaled
+// like the camera parameters of the ArUco detector (CameraParameters::resize), in double precision as calibrated
+static Mat rescaledCameraMatrix(const Mat &cameraMatrix, Size calibratedSize, Size size)
+{
+    if (calibratedSize.area() == 0 || calibratedSize == size)
+        return cameraMatrix;
+    CameraParameters params(cameraMatrix, Mat::zeros(5, 1, CV_64F), calibratedSize, CV_64F);  // The distortion does not scale
+    params.resize(size);
+    return params.CameraMatrix;
+}
+
+// The undistortion maps of a precomputed setting of the lens table at a size, from its intrinsics rescaled from
+// calibratedSize. They are built the first time the preview needs them and kept in the map store of the table. With
+// Lens_MapCache, the maps of each setting and size are kept in a binary intrinsics file named by the hash of the
+// intrinsics and size, which later runs map in place: their pages are only read once the preview uses them
+static void lensMaps(const Settings &s, int index, Size size, Size calibratedSize, Mat (&maps)[2])
+{
+    LensMapStore &store = *s.lens.maps;
+    if (store.get(index, size, maps))
+        return;
+    const lensEntry &entry = s.lens.entries[index];
+    Mat K;
+    rescaledCameraMatrix(entry.cal.cameraMatrix, calibratedSize, size).convertTo(K, CV_64F);
+    string file;
+    if (s.lensMapCache != "0")
+    {
+        int dims[2] = { size.width, size.height };
+        unsigned long long h = hashBytes(K.ptr(), 9*sizeof(double));
+        h = hashBytes(entry.cal.distCoeffs.ptr(), entry.cal.distCoeffs.total()*sizeof(double), h);
+        h = hashBytes(dims, sizeof(dims), h);
+        char name[32];
+        sprintf(name, "%016llx.bin", h);
+        file = s.lensMapCache + name;
+
+        map<string, Mat> mats;
+        Size fileSize;
+        shared_ptr<void> mapping;
+        if (mapCalibrationBinary(file, INTRINSIC_FILE, fileSize, mats, mapping) && fileSize == size
+                && mats["Undistortion_Map_1"].size() == size && mats["Undistortion_Map_1"].type() == CV_16SC2
+                && mats["Undistortion_Map_2"].size() == size && mats["Undistortion_Map_2"].type() == CV_16UC1)
+        {
+            maps[0] = mats["Undistortion_Map_1"];
+            maps[1] = mats["Undistortion_Map_2"];
+            store.put(index, size, maps, mapping);
+            return;
+        }
+    }
+    updateUndistortMaps(K, entry.cal.distCoeffs, size, maps);
+    if (!file.empty())
+    {
+        vector<pair<string, Mat> > mats;
+        mats.push_back(make_pair("Camera_Matrix", K));
+        mats.push_back(make_pair("Distortion_Coefficients", entry.cal.distCoeffs));
+        mats.push_back(make_pair("Undistortion_Map_1", maps[0]));
+        mats.push_back(make_pair("Undistortion_Map_2", maps[1]));
+        if (!writeCalibrationBinary(file, INTRINSIC_FILE, size, mats))
+            cerr << "Could not write to the lens map cache: " << file << endl;
+    }
+    store.put(index, size, maps, shared_ptr<void>());
+}
+
+// Undistorts the preview image if the setting has been toggled with the 'u' key. Without intrinsic input, the
+// incremental estimate is used. The maps are built for the size of the image, from the intrinsics rescaled from
+// calibratedSize (the image size if empty), and reused for the following frames. With intrinsic input, or when
+// the image is downscaled for display, they are built before the undistortion is toggled, so that toggling it
+// does not hold up a frame. Full resolution maps can also be read with binary intrinsic input. With a lens table,
+// the maps of the precomputed setting nearest to the lens setting are used instead, and only built the first time
+static void undistortCheck(const Settings &s, Mat &img, bool &undistortPreview, Mat (&maps)[2],
+                           const intrinsicCalibration &estimate, Size calibratedSize = Size())
+{
+    const intrinsicCalibration &cal = !s.lens.empty() ? s.lens.entries[s.lensIndex].cal
+                                    : s.useIntrinsicInput ? s.intrinsicInput : estimate;
+    bool prebuild = s.useIntrinsicInput || calibratedSize.area() > 0;
+    // With a lens table, a new lens setting switches to the maps kept for it
+    if (!s.lens.empty())
+        lensMaps(s, s.lensIndex, img.size(), calibratedSize.area() > 0 ? calibratedSize : img.size(), maps);
+    if (!cal.cameraMatrix.empty() && (undistortPreview || prebuild) && maps[0].size() != img.size())
+        updateUndistortMaps(rescaledCameraMatrix(cal.cameraMatrix, calibratedSize, img.size()), cal.distCoeffs,
+                            img.size(), maps);
+    if (!undistortPreview)
+        return;
+    if (cal.cameraMatrix.empty())
+    {
+        cerr << "\nUndistorted preview requires intrinsic input or an incremental calibration estimate.\n";
+        undistortPreview = !undistortPreview;
+        return;
+    }
+    Mat undistorted;
+    remap(img, undistorted, maps[0], maps[1], CV_INTER_LINEAR);
+    img = undistorted;
+}
+
+// Tells when the settings file of a preview has been saved again, so its detection and display settings can be
+// reloaded without restarting the capture. The file is looked at no more than twice a second
+class SettingsWatcher
+{
+public:
+    SettingsWatcher() : lastCheck(0), mtime(0), size(0) {}
+
+    void open(const string &path)
+    {
+        file = path;
+        lastCheck = getTickCount();
+        stamp(mtime, size);
+    }
+
+    // Whether the file has been modified since the last call
+    bool changed()
+    {
+        if (file.empty() || getTickCount() - lastCheck < getTickFrequency()/2)
+            return false;
+        lastCheck = getTickCount();
+        time_t t;
+        off_t n;
+        if (!stamp(t, n) || (t == mtime && n == size))
+            return false;
+        mtime = t;
+        size = n;
+        return true;
+    }
+
+private:
+    bool stamp(time_t &t, off_t &n) const
+    {
+        struct stat st;
+        if (stat(file.c_str(), &st))
+            return false;
+        t = st.st_mtime;
+        n = st.st_size;
+        return true;
+    }
+
+    string file;
+    int64 lastCheck;
+    time_t mtime;
+    off_t size;
+};
+
+// Reloads the detection and display settings of a preview from its settings file (see Settings::reloadLive),
+// and gives the new parameters to its ArUco detectors and trackers between two frames. The detectors keep their
+// dictionaries and buffers, and the trackers their markers. If given, displayLock is held while the settings
+// change, so that a thread drawing with them (see PreviewRenderer) does not read them meanwhile. Returns false if
+// the current settings are kept
+static bool reloadPreviewSettings(Settings &s, MarkerDetector *detectors, MarkerTracker *trackers, int n,
+                                  mutex *displayLock = NULL)
+{
+    bool reloaded = false;
+    try
+    {
+        FileStorage fs(s.settingsFile, FileStorage::READ);
+        if (fs.isOpened())
+        {
+            unique_lock<mutex> lock;
+            if (displayLock) lock = unique_lock<mutex>(*displayLock);
+            reloaded = s.reloadLive(fs["Settings"]);
+        }
+    }
+    catch (cv::Exception &)     // A file being written may not parse yet
+    {
+    }
+    if (!reloaded)
+    {
+        printf("\nThe settings could not be reloaded from %s, the current ones are kept\n", s.settingsFile.c_str());
+        return false;
+    }
+    for (int k = 0; k < n; k++)
+    {
+        if (s.calibrationPattern != Settings::CHESSBOARD)
+            detectors[k].setParams(arucoDetectorParams(s, detectors[k].getParams()._nThreads));
+        trackers[k].setInterval(s.trackingInterval);
+    }
+    printf("\nDetection settings reloaded from %s\n", s.settingsFile.c_str());
+    return true;
+}
+
+// Shows the live preview on its own thread (see Preview_DisplayWidth). The detection loop hands over each frame
+// with its detection, and the thread downscales the latest one to the display width before drawing the detection,
+// the undistortion and the incremental calibration status on it. Frames handed over while one is drawn replace
+// each other, so detection never waits for the display. The keys of the preview window are handled by the thread
+class PreviewRenderer
+{
+public:
+    PreviewRenderer() : settings(NULL), incremental(NULL), fresh(false), status(false), newEstimate(false),
+                        quit(false), reload(false), stop(false) {}
+    ~PreviewRenderer() { close(); }
+
+    // Opens the preview window. The settings and the incremental calibration must outlive the renderer. The
+    // settings of the drawing (Preview_DisplayWidth, Show_ArucoMarkerCoordinates) are changed by its keys and by
+    // the live reload, which must hold settingsLock() while it changes them
+    void open(Settings &s, IncrementalCalibrator &calibrator)
+    {
+        close();
+        settings = &s;
+        incremental = &calibrator;
+        fresh = status = newEstimate = quit = reload = stop = false;
+        worker = thread(&PreviewRenderer::work, this);
+    }
+
+    // Hands over a frame and its detection. The frame must not be written to afterwards. The color image of a
+    // captured buffer is made by the thread. With status, the incremental calibration status is drawn, and
+    // estimate is given when there is a new one
+    void show(const imageFrame &image, patternOverlay &overlay, bool drawStatus, const intrinsicCalibration *estimate)
+    {
+        lock_guard<mutex> lock(m);
+        frame = image.img;
+        frameRaw = image.raw;
+        std::swap(frameOverlay, overlay);
+        fresh = true;
+        status = drawStatus;
+        if (estimate)
+        {
+            // Only what the drawing uses, not the views
+            nextEstimate.cameraMatrix = estimate->cameraMatrix.clone();
+            nextEstimate.distCoeffs = estimate->distCoeffs.clone();
+            nextEstimate.stdDevs = estimate->stdDevs.clone();
+            nextEstimate.totalAvgErr = estimate->totalAvgErr;
+            newEstimate = true;
+        }
+        freshCond.notify_all();
+    }
+
+    // Whether the preview has been quit with its keys
+    bool quitRequested()
+    {
+        lock_guard<mutex> lock(m);
+        return quit;
+    }
+
+    // Whether the settings should be reloaded, asked with the keys once since the last call
+    bool reloadRequested()
+    {
+        lock_guard<mutex> lock(m);
+        bool r = reload;
+        reload = false;
+        return r;
+    }
+
+    // Stops the thread and closes the preview window
+    void close()
+    {
+        if (!worker.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(m);
+            stop = true;
+        }
+        freshCond.notify_all();
+        worker.join();
+        frame.release();
+    }
+
+    bool isOpened() const { return worker.joinable(); }
+
+    // Held by the thread while it draws with the settings
+    mutex &settingsLock() { return drawing; }
+
+private:
+    PreviewRenderer(const PreviewRenderer &);
+    PreviewRenderer &operator=(const PreviewRenderer &);
+
+    void work()
+    {
+        Settings &s = *settings;
+        display::open("Detected");
+        bool undistortPreview = false;
+        Mat maps[2];
+        intrinsicCalibration estimate;
+        for (;;)
+        {
+            Mat img;
+            rawFrame raw;
+            patternOverlay overlay;
+            bool drawStatus;
+            {
+                unique_lock<mutex> lock(m);
+                freshCond.wait_for(lock, chrono::milliseconds(20), [this]{ return fresh || stop; });
+                if (stop)
+                    break;
+                if (newEstimate)
+                {
+                    swap(estimate, nextEstimate);
+                    newEstimate = false;
+                    if (!s.useIntrinsicInput) maps[0] = maps[1] = Mat();
+                }
+                if (fresh)
+                {
+                    img = frame;
+                    raw = frameRaw;
+                    frame.release();
+                    frameRaw = rawFrame();
+                    swap(overlay, frameOverlay);
+                    fresh = false;
+                }
+                drawStatus = status;
+            }
+
+            if (img.data)
+            {
+                lock_guard<mutex> lock(drawing);
+                // The frame is only read, since it may still be referenced by the capture or the frame store
+                img = imageFrame::color(img, raw);
+                double scale = min(1., (double)s.previewWidth/img.cols);
+                Mat shown;
+                if (scale < 1)
+                    resize(img, shown, Size(cvRound(img.cols*scale), cvRound(img.rows*scale)), 0, 0, INTER_AREA);
+                else
+                    shown = img.clone();
+                if (shown.channels() == 1)
+                    cvtColor(shown, shown, COLOR_GRAY2BGR);
+                scaleOverlay(overlay, (float)scale);
+                drawOverlay(s, shown, overlay);
+                undistortCheck(s, shown, undistortPreview, maps, estimate, img.size());
+                if (drawStatus)
+                    incremental->drawStatus(shown, estimate);
+                display::show("Detected", shown);
+            }
+
+            // The window events are handled by waitKey, which also runs when there is no new frame
+            char c = (char)display::waitKey(1);
+            if (c == 'u')
+                undistortPreview = !undistortPreview;
+            if (c == 'c')
+            {
+                lock_guard<mutex> lock(drawing);
+                s.showArucoCoords = !s.showArucoCoords;
+            }
+            else if (c == 'l')
+            {
+                lock_guard<mutex> lock(m);
+                reload = true;
+            }
+            else if ((c & 255) == 27 || c == 'q' || c == 'Q')
+            {
+                lock_guard<mutex> lock(m);
+                quit = true;
+            }
+        }
+        display::close("Detected");
+    }
+
+    // Moves the detection to the coordinates of the downscaled frame
+    static void scaleOverlay(patternOverlay &overlay, float scale)
+    {
+        if (scale == 1)
+            return;
+        for (auto &p:overlay.chessboardCorners) p *= scale;
+        for (auto &markers:overlay.markers)
+            for (auto &marker:markers)
+                for (auto &p:marker) p *= scale;
+    }
+
+    Settings *settings;
+    IncrementalCalibrator *incremental;
+    thread worker;
+    Mat frame;                      // latest frame, not drawn yet if fresh
+    rawFrame frameRaw;              // its captured buffer, if it is the luminance of one
+    patternOverlay frameOverlay;    // its detection
+    intrinsicCalibration nextEstimate;  // new incremental estimate, not drawn yet if newEstimate
+    bool fresh;
+    bool status;                    // draw the incremental calibration status
+    bool newEstimate;
+    bool quit;                      // quit with the keys of the window
+    bool reload;                    // reload the settings, asked with the keys of the window
+    bool stop;
+    mutex m;
+    condition_variable freshCond;
+    mutex drawing;                  // held while the drawing reads the settings (see settingsLock)
+};
+
+// Reads a settings file into s. Returns false if it cannot be read or is not valid
+static bool loadSettings(const string &inputSettingsFile, Settings &s)
+{
+    FileStorage fs(inputSettingsFile, FileStorage::READ);   // Read the settings
+    if (!fs.isOpened())
+    {
+        cerr << "Could not open the settings file: \"" << inputSettingsFile << "\"" << endl;
+        return false;
     }
+    s.settingsFile = inputSettingsFile;
+    fs["Settings"] >> s;
+    fs.release();                                         // close Settings file
 
-public:
-//--------------------------Calibration configuration-------------------------//
-    // Program modes:
-    //    INTRINSIC  — calculates intrinsics parameters and  undistorts images
-    //    STEREO     — calculates extrinsic stereo paramaters and rectifies images
-    //    PREVIEW    — detects pattern on live feed, previewing detection and undistortion
-    Mode mode;
-    Pattern calibrationPattern;   // Three supported calibration patterns: CHESSBOARD, ARUCO_SINGLE, ARUCO_BOX
+    if (!s.goodInput)
+    {
+        cerr << "Invalid input detected. Application stopping. " << endl;
+        return false;
+    }
+    return true;
+}
 
-    Size boardSize;     // Size of chessboard (number of inner corners per chessboard row and column)
-    float squareSize;   // The size of a square in some user defined metric system (pixel, millimeter, etc.)
+// A threshold search of the ArUco detector tried by autotuneAruco
+struct arucoTuning
+{
+    int thresParam1, thresRange, pyrLevel;
+    bool adaptive;
 
-//-----------------------------Input settings---------------------------------//
-    vector<string> imageList;   // Image list to run calibration
-    string imageListFilename;   // Input filename for image list
+    void apply(Settings &s) const
+    {
+        s.arucoThresParam1 = thresParam1;
+        s.arucoThresRange = thresRange;
+        s.arucoPyrLevel = pyrLevel;
+        s.arucoAdaptiveThres = adaptive;
+    }
+};
 
-    arucoPattern arPat;      // arucoPattern struct that stores information for an ArUco pattern
-    string arucoConfigFilename;      // Input filename to configure ArUco pattern
+// Detects the ArUco pattern on images in parallel with the detector settings of s, one single threaded detector
+// per thread as in batch detection. Returns the time per image of the fastest of two runs, in milliseconds
+static double timeArucoDetection(const Settings &s, const vector<Mat> &images, vector<vector<Point2f> > &imagePoints,
+                                 vector<vector<int> > &pointKeys)
+{
+    int nThreads = s.batchThreads > 0 ? s.batchThreads : omp_get_max_threads();
+    vector<MarkerDetector> detectors(nThreads);
+    for (auto &d:detectors) setupArucoDetector(s, d, 1);
+    imagePoints.assign(images.size(), vector<Point2f>());
+    pointKeys.assign(images.size(), vector<int>());
+
+    double best = DBL_MAX;
+    for (int r = 0; r < 2; r++)
+    {
+        int64 start = getTickCount();
+        #pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+        for (int i = 0; i < (int)images.size(); i++)
+        {
+            imageFrame image;
+            image.img = images[i];
+            image.camera = -1;      // The sample mixes the cameras, so the whole images are searched
+            intrinsicCalibration imgCal;
+            imgCal.imagePoints.resize(1);
+            imgCal.objectPoints.resize(1);
+            imgCal.pointKeys.resize(1);
+            arucoDetect(s, detectors[omp_get_thread_num()], image, imgCal, 0, NULL);
+            imagePoints[i].clear();
+            pointKeys[i].clear();
+            if (!imgCal.imagePoints.empty())
+            {
+                imagePoints[i].swap(imgCal.imagePoints[0]);
+                pointKeys[i].swap(imgCal.pointKeys[0]);
+            }
+        }
+        best = min(best, 1000.*(getTickCount() - start)/getTickFrequency()/images.size());
+    }
+    return best;
+}
 
-    //Intrinsic input can be used as an initial estimate for intrinsic calibration,
-    //as fixed intrinsics for stereo calibration, or to preview undistortion in preview mode
-    //Leave filename at "0" to calculate new intrinsics
-    intrinsicCalibration intrinsicInput; // Struct to store inputted intrinsics
-    string intrinsicInputFilename;       // Intrinsic input filename
-    bool useIntrinsicInput;              // Boolean to simplify program
+// Picks the ArUco threshold search of Aruco_AutotuneFile. If the file was written for the same pattern and
+// detection settings, its search is used. Otherwise, every search of a small sweep detects a sample of the
+// image list, and the fastest one that finds Aruco_AutotuneRecall of the points of the widest search, at the
+// same place, is used and saved to the file. The searches are timed one after the other, so that they do not
+// slow each other down. Returns false if the sample cannot be read or the file cannot be written
+static bool autotuneAruco(Settings &s)
+{
+    // Corners found by a search must be this close to those of the widest one, in pixels
+    const double maxShift = 0.1;
+
+    // The widest search is the one of the settings, on every threshold image
+    arucoTuning widest = { s.arucoThresParam1, s.arucoThresRange, s.arucoPyrLevel, false };
+    arucoTuning configured = { s.arucoThresParam1, s.arucoThresRange, s.arucoPyrLevel, s.arucoAdaptiveThres };
+    MarkerDetector detector;
+    setupArucoDetector(s, detector, 1);
+    char configHash[17];
+    sprintf(configHash, "%016llx", detectionConfigHash(s, detector));
+
+    FileStorage in(s.autotuneFile, FileStorage::READ);
+    if (in.isOpened() && (string)in["Config_Hash"] == configHash)
+    {
+        arucoTuning t = configured;
+        in["Aruco_ThresholdWindow"] >> t.thresParam1;
+        in["Aruco_ThresholdRange"] >> t.thresRange;
+        in["Aruco_CandidatePyramidLevel"] >> t.pyrLevel;
+        in["Aruco_AdaptiveThreshold"] >> t.adaptive;
+        t.apply(s);
+        printf("\nArUco detection tuned by %s: window %d, range %d, pyramid level %d, adaptive %d\n",
+               s.autotuneFile.c_str(), t.thresParam1, t.thresRange, t.pyrLevel, (int)t.adaptive);
+        return true;
+    }
+    in.release();
+    if (s.imageList.empty())
+    {
+        printf("\nNo image list to tune the ArUco detection on. The default detection is used\n");
+        return true;
+    }
 
-//-----------------------------Output settings--------------------------------//
-    string intrinsicOutput;    // File to write results of intrinsic calibration
-    string extrinsicOutput;    // File to write results of stereo calibration
+    // An evenly spaced sample of the list
+    int nSample = s.autotuneSample > 0 ? min(s.autotuneSample, (int)s.imageList.size()) : (int)s.imageList.size();
+    vector<Mat> images;
+    for (int k = 0; k < nSample; k++)
+    {
+        int i = (int)((long long)k*s.imageList.size()/nSample);
+        Mat img = s.readListImage(i, CV_LOAD_IMAGE_GRAYSCALE);
+        if (!img.data)
+        {
+            cerr << "Could not read image: " << s.imageList[i] << endl;
+            return false;
+        }
+        images.push_back(img);
+    }
 
-    // LEAVE THESE SETTINGS AT "0" TO NOT SAVE IMAGES
-    string undistortedPath;    // Path at which to save undistorted images
-    string rectifiedPath;      // Path at which to save rectified images
-    string detectedPath;       // Path at which to save images with detected patterns
+    // Narrower ranges of window sizes, centred at several sizes, and a coarser candidate search
+    vector<arucoTuning> sweep;
+    for (int pyrLevel = s.arucoPyrLevel; pyrLevel <= s.arucoPyrLevel + 1; pyrLevel++)
+        for (int adaptive = 0; adaptive <= 1; adaptive++)
+        {
+            if (pyrLevel != widest.pyrLevel || adaptive)
+                sweep.push_back({ widest.thresParam1, widest.thresRange, pyrLevel, adaptive != 0 });
+            for (int thresRange:{ 6, 3, 1 })
+                for (int thresParam1:{ 5, 9, 15 })
+                    if (thresRange < widest.thresRange)
+                        sweep.push_back({ thresParam1, thresRange, pyrLevel, adaptive != 0 });
+        }
 
-//-----------------------Intrinsic Calibration settings-----------------------//
-    // It is recommended to fix distortion coefficients 3-5 ("00111"). Only 1-2 are needed
-    // in most cases, and 3 produces significant distortion in stereo rectification
-    string fixDistCoeffs;         // A string of five digits (0 or 1) that control which distortion coefficients will be fixed (1 = fixed)
-    float aspectRatio;            // The aspect ratio. If it is non zero, it will be fixed in calibration
-    bool assumeZeroTangentDist;   // Assume zero tangential distortion
-    bool fixPrincipalPoint;       // Fix the principal point at the center
-    int flag;                     // Flag to modify calibration
+    vector<vector<Point2f> > refPoints, points;
+    vector<vector<int> > refKeys, keys;
+    widest.apply(s);
+    double widestTime = timeArucoDetection(s, images, refPoints, refKeys);
+    size_t nRef = 0;
+    vector<map<int, Point2f> > reference(images.size());
+    for (size_t i = 0; i < images.size(); i++)
+        for (size_t k = 0; k < refKeys[i].size(); k++)
+            reference[i][refKeys[i][k]] = refPoints[i][k];
+    for (auto &r:reference) nRef += r.size();
+    if (nRef == 0)
+    {
+        printf("\nNo ArUco marker found on the %d sample images. The default detection is used\n", (int)images.size());
+        configured.apply(s);
+        return true;
+    }
 
-//--------------------------------UI settings---------------------------------//
-    bool showUndistorted;   // Show undistorted images after intrinsic calibration
-    bool showRectified;     // Show rectified images after stereo calibration
-    bool showArucoCoords;   // Draw each marker with its 3D coordinate. If false, IDs will be printed
-    bool wait;              // Wait until a key is pressed to show the next detected image
+    arucoTuning best = widest;
+    double bestTime = widestTime, bestRecall = 1;
+    for (auto &t:sweep)
+    {
+        t.apply(s);
+        double ms = timeArucoDetection(s, images, points, keys);
+        size_t nFound = 0;
+        for (size_t i = 0; i < images.size(); i++)
+            for (size_t k = 0; k < keys[i].size(); k++)
+            {
+                auto ref = reference[i].find(keys[i][k]);
+                if (ref != reference[i].end() && norm(ref->second - points[i][k]) <= maxShift)
+                    nFound++;
+            }
+        double recall = (double)nFound/nRef;
+        if (recall >= s.autotuneRecall && ms < bestTime)
+        {
+            best = t;
+            bestTime = ms;
+            bestRecall = recall;
+        }
+    }
+    best.apply(s);
+    printf("\nArUco detection tuned on %d images: window %d, range %d, pyramid level %d, adaptive %d. "
+           "%.2f ms per image instead of %.2f, recall %.4f\n", (int)images.size(), best.thresParam1, best.thresRange,
+           best.pyrLevel, (int)best.adaptive, bestTime, widestTime, bestRecall);
 
-//-----------------------------Program variables------------------------------//
-    int nImages;        // Number of images in the image list
-    Size imageSize;     // Size of each image
-    int nMarkerMaps;       // Number of marker maps read from config list
+    FileStorage out(s.autotuneFile, FileStorage::WRITE);
+    if (!out.isOpened())
+    {
+        cerr << "Could not write the ArUco autotune file: " << s.autotuneFile << endl;
+        return false;
+    }
+    out << "Config_Hash" << configHash
+        << "Aruco_ThresholdWindow" << best.thresParam1
+        << "Aruco_ThresholdRange" << best.thresRange
+        << "Aruco_CandidatePyramidLevel" << best.pyrLevel
+        << "Aruco_AdaptiveThreshold" << best.adaptive
+        << "Sample_Images" << (int)images.size()
+        << "Recall" << bestRecall
+        << "Time_PerImage" << bestTime
+        << "Widest_Time_PerImage" << widestTime;
+    return true;
+}
 
-//---------------------------Live Preview settings----------------------------//
-    int cameraID;           //ID for live preview camera. Generally "0" is built in webcam
-    VideoCapture capture;   //Live capture object
+// Live preview of two cameras (LivePreviewCameraID2). The frames of a pair are detected at once, each on its own
+// thread with its own detector, tracker and chessboard hint, and shown side by side. The pairs kept with the space
+// key are calibrated as in STEREO mode, and the extrinsics saved. The pairs are then rectified with the maps of
+// that calibration, or before it with those of LiveStereo_RectifyInput
+static int runStereoPreview(Settings &s)
+{
+    const int minPairs = 3;     // Pairs needed to calibrate
+    StereoCapture cameras;
+    cameras.open(s.capture, s.capture2, s.stereoMaxSkew);
+
+    // The two detections share the cores
+    int nThreads = s.arucoThreads > 0 ? s.arucoThreads : max(1, omp_get_max_threads()/2);
+    MarkerDetector detectors[2];
+    MarkerTracker trackers[2];
+    DetectionGovernor governor;     // The pair is detected at once, so both cameras share the effort level
+    chessboardHint hints[2];
+    for (int k = 0; k < 2; k++)
+    {
+        if (s.calibrationPattern != Settings::CHESSBOARD)
+            setupArucoDetector(s, detectors[k], nThreads);
+        trackers[k].open(s.trackingInterval);
+    }
+    SettingsWatcher watcher;
+    watcher.open(s.settingsFile);
+
+    Mat rectifyMap[2][2];
+    for (int k = 0; k < 2; k++)
+        for (int j = 0; j < 2; j++) rectifyMap[k][j] = s.liveRectifyMap[k][j];
+    intrinsicCalibration kept[2];       // Views of the pairs kept with the space key
+    int nKept = 0, nCalibrated = 0;
+    bool rectify = false;
+
+    // Calibrates the kept pairs, then rectifies the next pairs with the result
+    auto calibrate = [&]() {
+        if (nKept < minPairs)
+        {
+            printf("\nStereo calibration needs at least %d pairs, %d kept\n", minPairs, nKept);
+            return;
+        }
+        Settings cs = s;
+        cs.mode = Settings::STEREO;
+        cs.rectifiedPath = cs.rectifiedContainer = "0";     // There is no image list to rectify
+        cs.showRectified = false;
+        cs.rectifyBandRows = cs.mapGridStep = 0;    // The full maps rectify the preview
+        intrinsicCalibration cal = kept[0], cal2 = kept[1];
+        bool ok = true, ok2 = true;
+        if (!cs.useIntrinsicInput && !cs.jointStereo)
+            runConcurrently([&]() { ok = runIntrinsicCalibration(cs, cal); },
+                            [&]() { ok2 = runIntrinsicCalibration(cs, cal2); });
+        if (!ok || !ok2)
+        {
+            cerr << "\nIntrinsic calibration of the kept pairs failed" << endl;
+            return;
+        }
+        ImageWriter writer;     // Nothing is saved, so neither is used
+        FrameStore frames;
+        stereoCalibration sterCal = runStereoCalibration(cs, cal, cal2, writer, frames);
+        cs.saveExtrinsics(sterCal);
+        for (int k = 0; k < 2; k++)
+            for (int j = 0; j < 2; j++) rectifyMap[k][j] = sterCal.rmap[k][j];
+        nCalibrated = nKept;
+    };
+
+    // The rectified pairs are published to the shared memory ring, created at the size and type of the frames
+    frameRingWriter ring;
+
+    display::open("Stereo preview");
+    Mat frames[2], view[2], canvas;
+    double skewMs = 0;
+    int64 grabTicks = 0;
+    for (int i = 0;; i++)
+    {
+        pipelineTrace::scope trace("pair", i);
+        if (!cameras.read(frames[0], frames[1], skewMs, &grabTicks))
+            break;
+        rawFrame raws[2];
+        for (int k = 0; k < 2; k++)
+        {
+            imageFrame captured;
+            if (!s.setCapturedFrame(captured, frames[k], k))
+                return -1;
+            frames[k] = captured.img;
+            raws[k] = captured.raw;
+        }
+        if (frames[0].size() != frames[1].size())
+        {
+            cerr << "The live stereo cameras must have the same frame size" << endl;
+            return -1;
+        }
+        s.imageSize = frames[0].size();
+
+        intrinsicCalibration found[2];
+        patternOverlay overlay[2];
+        auto detect = [&](int k) {
+            imageFrame image;
+            image.img = frames[k];
+            image.camera = k;
+            image.pyramidOffset = governor.pyramidOffset();
+            string reason;
+            if (!prescreenFrame(s, image, reason))
+                return;
+            if (s.calibrationPattern == Settings::CHESSBOARD)
+                chessboardDetect(s, image, found[k], &overlay[k], &hints[k]);
+            else
+            {
+                found[k].imagePoints.resize(1);
+                found[k].objectPoints.resize(1);
+                found[k].pointKeys.resize(1);
+                arucoDetect(s, detectors[k], image, found[k], 0, &overlay[k], &trackers[k]);
+            }
+        };
+        // The frames that are detected are rectified straight into the next slot of the ring, in parallel
+        if (s.sharedMemoryName != "0" && rectifyMap[0][0].size() == s.imageSize)
+        {
+            if (!ring.fits(s.imageSize, frames[0].type()))
+            {
+                if (!ring.open(s.sharedMemoryName, s.imageSize, frames[0].type(), 2, s.sharedSlots))
+                {
+                    cerr << "Could not create the shared memory of the rectified pairs: " << s.sharedMemoryName << endl;
+                    return -1;
+                }
+                printf("\nPublishing the rectified pairs to the shared memory %s\n", s.sharedMemoryName.c_str());
+            }
+            vector<Mat> slot = ring.begin();
+            runConcurrently([&]() { remap(frames[0], slot[0], rectifyMap[0][0], rectifyMap[0][1], CV_INTER_LINEAR); },
+                            [&]() { remap(frames[1], slot[1], rectifyMap[1][0], rectifyMap[1][1], CV_INTER_LINEAR); });
+            ring.publish((int64_t)(grabTicks*(1e9/getTickFrequency())), skewMs);
+        }
 
-    bool goodInput;         //Tracks input validity
-private:
-    // Input variables only needed to set up settings
-    string modeInput;
-    string patternInput;
-    string cameraIDInput;
-};
+        bool governed = s.calibrationPattern != Settings::CHESSBOARD;
+        if (governed)
+            for (int k = 0; k < 2; k++)
+                governor.apply(s, detectors[k], trackers[k]);
+        int64 start = getTickCount();
+        runConcurrently([&]() { detect(0); }, [&]() { detect(1); });
+        if (governed)
+            governor.update(s, runReport::elapsedMs(start));
+        bool both = true;
+        for (int k = 0; k < 2; k++)
+            both = both && !found[k].imagePoints.empty() && !found[k].imagePoints[0].empty();
+
+        // The rectified pairs are shown without the detection, with lines along the rows that should match
+        bool rectified = rectify && rectifyMap[0][0].size() == s.imageSize;
+        for (int k = 0; k < 2; k++)
+        {
+            // The color of a captured buffer is only made to be shown
+            Mat shown = imageFrame::color(frames[k], raws[k]);
+            if (rectified)
+                remap(shown, view[k], rectifyMap[k][0], rectifyMap[k][1], CV_INTER_LINEAR);
+            else
+            {
+                view[k] = shown.data == frames[k].data ? shown.clone() : shown;
+                drawOverlay(s, view[k], overlay[k]);
+            }
+            if (view[k].channels() == 1)
+                cvtColor(view[k], view[k], COLOR_GRAY2BGR);
+        }
+        hconcat(view[0], view[1], canvas);
+        if (s.previewWidth > 0 && canvas.cols > s.previewWidth)
+            resize(canvas, canvas, Size(s.previewWidth, canvas.rows*s.previewWidth/canvas.cols), 0, 0, INTER_AREA);
+        if (rectified)
+            for (int j = 0; j < canvas.rows; j += 16)
+                line(canvas, Point(0, j), Point(canvas.cols, j), Scalar(0, 255, 0), 1, 8);
+        char status[128];
+        sprintf(status, "skew %.1f ms, dropped %d, kept %d", skewMs, cameras.dropped(), nKept);
+        putText(canvas, status, Point(10, 25), FONT_HERSHEY_SIMPLEX, 0.7, both ? Scalar(0, 255, 0) : Scalar(0, 0, 255), 2);
+        if (governed && s.targetFPS > 0)
+            putText(canvas, governor.status(s), Point(10, 50), FONT_HERSHEY_SIMPLEX, 0.7, Scalar(0, 255, 255), 2);
+        display::show("Stereo preview", canvas);
+
+        char c = (char)display::waitKey(s.wait ? 0: 50);
+        if (c == ' ' && both)
+        {
+            for (int k = 0; k < 2; k++)
+            {
+                kept[k].imagePoints.push_back(found[k].imagePoints[0]);
+                kept[k].objectPoints.push_back(found[k].objectPoints[0]);
+                if (s.calibrationPattern == Settings::CHESSBOARD)
+                    kept[k].imageIndex.push_back(nKept);
+                else
+                    kept[k].pointKeys.push_back(found[k].pointKeys[0]);
+            }
+            printf("\nPair %d kept, skew %.1f ms", ++nKept, skewMs);
+        }
+        else if (c == 'r')
+        {
+            rectify = !rectify;
+            if (rectify && rectifyMap[0][0].empty())
+            {
+                cerr << "\nRectified preview requires LiveStereo_RectifyInput or a calibration of the kept pairs.\n";
+                rectify = false;
+            }
+        }
+        else if (c == 'c')
+            s.showArucoCoords = !s.showArucoCoords;
+        else if (c == 'k')
+            calibrate();
+        if (c == 'l' || watcher.changed())
+            reloadPreviewSettings(s, detectors, trackers, 2);
+        else if( (c & 255) == 27 || c == 'q' || c == 'Q' )
+            break;
+    }
+    display::close("Stereo preview");
+    cameras.close();
+    if (nKept > nCalibrated)
+        calibrate();
+    return 0;
+}
 
-static void read(const FileNode& node, Settings& x, const Settings& default_value = Settings())
+// Detects patterns on the images of a set of settings, runs calibration and saves results
+// Sets up what the whole process shares: the threads of the ArUco detection, their cores and the buffer pool
+static void setupProcess(const Settings &s)
 {
-    if(node.empty())
-        x = default_value;
-    else
-        x.read(node);
+    MarkerDetector::setSharedThreads(s.arucoThreads);
+    // The main thread and the team of the ArUco detection are pinned before any frame buffer is allocated
+    if (!threadAffinity::configure(s.threadAffinityPolicy, s.ioCores))
+        printf("\nThe thread affinity could not be set on this system, the threads are not pinned\n");
+    threadAffinity::pinTeam(s.arucoThreads > 0 ? s.arucoThreads : omp_get_max_threads());
+    if (s.poolMB > 0 && !matPool::install((size_t)s.poolMB << 20, s.hugePages))
+        printf("\nMemory_PoolMB needs OpenCV 3 or later, the buffers are not pooled\n");
 }
 
-// Uncomment write() if you want to save your settings, using code like this:
-        // FileStorage fs("settingsOutput.yml", FileStorage::WRITE);
-        // fs << "Settings" << s;
+static int runCalibration(Settings &s)
+{
+    //struct to store calibration parameters
+    intrinsicCalibration inCal, inCal2;
+    intrinsicCalibration *currentInCal = &inCal;
+
+    int size = (s.mode == Settings::STEREO) ? s.nImages/2 : s.nImages;
+    //ArUco patterns require correctly sized vectors
+    if (s.calibrationPattern != Settings::CHESSBOARD) {
+        inCal.imagePoints.resize(size);
+        inCal.objectPoints.resize(size);
+        inCal2.imagePoints.resize(size);
+        inCal2.objectPoints.resize(size);
+        inCal.pointKeys.resize(size);
+        inCal2.pointKeys.resize(size);
+    }
+    int vectorIndex = -1;
+    bool undistortPreview = false;
+    Mat previewMaps[2] = { s.intrinsicInput.undistortMap[0], s.intrinsicInput.undistortMap[1] };
+
+    if (!s.sharedProcess)
+        setupProcess(s);
+    if (s.mode == Settings::PREVIEW && s.capture2.isOpened())
+        return runStereoPreview(s);
+    // The threshold search may be tuned once on a sample of the images (see Aruco_AutotuneFile)
+    if (s.calibrationPattern != Settings::CHESSBOARD && s.autotuneFile != "0" && !autotuneAruco(s))
+        return -1;
+    MarkerDetector detector;
+    if (s.calibrationPattern != Settings::CHESSBOARD)
+        setupArucoDetector(s, detector);
+    MarkerTracker tracker;
+    DetectionGovernor governor;
+    SettingsWatcher watcher;
+    if (s.mode == Settings::PREVIEW)
+    {
+        tracker.open(s.trackingInterval);
+        watcher.open(s.settingsFile);
+    }
+    // The chessboard of the last frame of each camera, where the next fast detection starts
+    chessboardHint hints[2];
+
+    // The preview views are handed to the incremental calibration instead of being kept
+    IncrementalCalibrator incremental;
+    intrinsicCalibration frame, estimate;
+    int nEstimates = 0;
+
+    // Saved images are encoded and written in the background. The frames waiting in the writer and
+    // stream queues share one memory budget
+    memoryBudget queueMemory((size_t)s.queueMB << 20);
+    ImageWriter writer;
+    writer.open(s.savedImagesFormat, s.saveQueueDepth, s.saveThreads, &queueMemory, s.thumbnailWidth, s.sheetTiles);
+
+    // The decoded images are kept for the stages after the calibration, if they run
+    FrameStore frames;
+    if (frameStoreFlags(s) >= 0)
+        frames.open((size_t)s.frameStoreMB << 20);
+
+    // Timings, counts and the status of each image, written next to the output (see Save_RunReport)
+    runReport report;
+    report.open(s);
+
+    char imgSave[1000];
+    bool save = false;
+    if(s.detectedPath != "0" && s.mode != Settings::PREVIEW)
+    {
+        if( pathCheck(s.detectedPath) )
+            save = true;
+        else
+            printf("\nDetected images could not be saved. Invalid path: %s\n", s.detectedPath.c_str());
+    }
+
+    // A rig is always detected in batch, one struct per camera
+    if (s.mode == Settings::MULTI)
+    {
+        vector<intrinsicCalibration> cams(s.nCameras);
+        vector<intrinsicCalibration*> cals;
+        for (auto &c:cams)
+        {
+            c.imagePoints.resize(s.nImages/s.nCameras);
+            c.objectPoints.resize(s.nImages/s.nCameras);
+            if (s.calibrationPattern != Settings::CHESSBOARD) c.pointKeys.resize(s.nImages/s.nCameras);
+            cals.push_back(&c);
+        }
+        batchDetect(s, cals, writer, frames, save, report);
+        runRigCalibrationAndSave(s, cams, report);
+        report.addQueue("Image writer", writer.stats());
+        report.write(s);
+        return 0;
+    }
+
+    // Headless batch detection, followed directly by the calibration. Streams are not enumerated up front
+    if (s.batchThreads > 0 && s.mode != Settings::PREVIEW && s.streamInput == "0")
+    {
+        vector<intrinsicCalibration*> cals(1, &inCal);
+        if (s.mode == Settings::STEREO) cals.push_back(&inCal2);
+        if (!batchDetect(s, cals, writer, frames, save, report))
+            return -1;
+        // A detection shard is only saved, and calibrated once the shards are merged
+        if((int)inCal.imagePoints.size() > 0 && !(s.shardCount > 0 && s.shardIndex >= 0))
+            runCalibrationAndSave(s, inCal, inCal2, writer, frames, report);
+        report.addQueue("Image writer", writer.stats());
+        report.write(s);
+        return 0;
+    }
+
+    // In headless mode, detections are only drawn for the saved images, and images that are
+    // not drawn are read without color
+    bool draw = !s.headless || save;
+    int readFlags = draw || frameStoreFlags(s) == CV_LOAD_IMAGE_COLOR ? CV_LOAD_IMAGE_COLOR : CV_LOAD_IMAGE_GRAYSCALE;
+
+    // Decode the next images in the background while the current one is detected
+    ImageLoader loader;
+    FrameStream stream;
+    if (s.streamInput != "0")
+    {
+        if (!stream.open(s, s.prefetchDepth, readFlags, &queueMemory))
+        {
+            cerr << "Invalid stream input: " << s.streamInput << endl;
+            return -1;
+        }
+    }
+    else if (s.prefetchDepth > 0 && s.mode != Settings::PREVIEW)
+        loader.open(s, s.prefetchDepth, s.prefetchThreads, readFlags);
+
+    // The live capture runs on its own thread, so the preview shows the latest frame
+    CaptureThread camera;
+    if (s.capture.isOpened())
+        camera.open(s.capture);
+    // A still camera that sees an unchanged scene is not detected again (see Preview_StaticThreshold)
+    StaticScene scene;
+
+    // The lens maps are cached by the thread that draws the preview, so the path is checked before it starts
+    if (s.mode == Settings::PREVIEW && !s.lens.empty() && s.lensMapCache != "0" && !pathCheck(s.lensMapCache))
+    {
+        printf("\nLens maps could not be cached. Invalid path: %s\n", s.lensMapCache.c_str());
+        s.lensMapCache = "0";
+    }
+
+    // With a display width, the preview is drawn and shown by its own thread
+    PreviewRenderer renderer;
+    if (s.mode == Settings::PREVIEW && !s.headless && !s.wait && s.previewWidth > 0)
+        renderer.open(s, incremental);
+    else if (!s.headless)
+        display::open("Detected");
+    // Only the detection itself is timed for the report, not the display and the waits for keys
+    int64 detectionTicks = 0;
+    clock_t detectionCpu = 0;
+    allocCounts detectionAllocs;
+    // For each image in the image list
+    for(int i = 0;;i++)
+    {
+        pipelineTrace::scope trace("image", i);
+        // Switches between intrinsic calibration structs for stereo mode
+        if (i%2 == 0) {
+            currentInCal = &inCal;
+            vectorIndex++;
+        } else if (s.mode == Settings::STEREO)
+            currentInCal = &inCal2;
+        else
+            vectorIndex++;
+
+        // Set up the image
+        imageFrame image;
+        image.camera = s.mode == Settings::STEREO ? i%2 : 0;
+        string name;
+        if (camera.isOpened())
+            s.setCapturedFrame(image, camera.read(), 0);       // An invalid frame ends the preview
+        else
+            image.img = stream.isOpened() ? stream.read(name) :
+                        loader.isOpened() ? loader.read() : s.imageSetup(i, readFlags);
+        Mat &img = image.img;
+        if (s.mode != Settings::PREVIEW)
+            frames.put(i, img, draw);      // The detection is drawn on the image
+
+        // If there is no data, the photos have run out
+        if(!img.data)
+        {
+            loader.close();
+            stream.close();
+            if (s.arucoStats) printArucoStats(detector.getTotalStats());
+            report.addStage("Detection", 1000.*detectionTicks/getTickFrequency(), 1000.*detectionCpu/CLOCKS_PER_SEC,
+                            detectionAllocs);
+            if((int)inCal.imagePoints.size() > 0) {
+                if (renderer.isOpened()) renderer.close();
+                else if (!s.headless) display::close("Detected");
+                runCalibrationAndSave(s, inCal, inCal2, writer, frames, report);
+            }
+            break;
+        }
+        // Streamed frames join the image list as they arrive
+        if (stream.isOpened())
+        {
+            s.imageList.push_back(name);
+            s.nImages = i + 1;
+            if (s.calibrationPattern != Settings::CHESSBOARD) {
+                inCal.imagePoints.resize(s.nImages);
+                inCal.objectPoints.resize(s.nImages);
+                inCal.pointKeys.resize(s.nImages);
+            }
+        }
+        if (s.imageSize != img.size())      // Read by the incremental calibration thread
+            s.imageSize = img.size();
+        if (s.mode == Settings::PREVIEW && s.incrementalCalibration && !incremental.isOpened())
+            incremental.open(s);
+
+        //Detect the pattern in the image, adding data to the imagePoints
+        //and objectPoints calibration parameters
+        patternOverlay overlay;
+        // The effort of the ArUco detection follows the frame rate of the preview (see Preview_TargetFPS)
+        bool governed = s.mode == Settings::PREVIEW && s.calibrationPattern != Settings::CHESSBOARD;
+        if (governed)
+        {
+            governor.apply(s, detector, tracker);
+            image.pyramidOffset = governor.pyramidOffset();
+        }
+        int64 start = getTickCount();
+        clock_t startCpu = clock();
+        allocCounts allocStart = allocStats::thread();
+        string skipReason;
+        bool still = camera.isOpened() && scene.unchanged(s, image);
+        bool screened = still || prescreenFrame(s, image, skipReason);
+        if (still)
+            overlay = scene.lastOverlay();      // The last detection is drawn again
+        else if (!screened)
+            ;       // Not detected, as if the pattern had not been found
+        else if (incremental.isOpened())
+        {
+            frame.imagePoints.clear();
+            frame.objectPoints.clear();
+            frame.pointKeys.clear();
+            if (s.calibrationPattern == Settings::CHESSBOARD)
+                chessboardDetect(s, image, frame, draw ? &overlay : NULL, &hints[0]);
+            else
+            {
+                frame.imagePoints.resize(1);
+                frame.objectPoints.resize(1);
+                frame.pointKeys.resize(1);
+                arucoDetect(s, detector, image, frame, 0, draw ? &overlay : NULL, &tracker);
+            }
+            if (!frame.imagePoints.empty() && incremental.add(frame.imagePoints[0], frame.objectPoints[0]))
+                printf("\nView %d added to the incremental calibration", i);
+        }
+        else if(s.calibrationPattern == Settings::CHESSBOARD)
+        {
+            chessboardDetect(s, image, *currentInCal, draw ? &overlay : NULL,
+                             &hints[s.mode == Settings::STEREO ? i%2 : 0]);
+            if (currentInCal->imagePoints.size() > currentInCal->imageIndex.size())
+                currentInCal->imageIndex.push_back(i);
+        }
+        else
+            arucoDetect(s, detector, image, *currentInCal, vectorIndex, draw ? &overlay : NULL, &tracker);
+        if (!still)
+            scene.detected(overlay);
+        if (image.overBudget)
+        {
+            screened = false;
+            skipReason = "over the detection time budget";
+        }
+        if (governed)
+        {
+            if (!still)     // The frames of an unchanged scene cost nothing
+                governor.update(s, runReport::elapsedMs(start));
+            overlay.status = governor.status(s);
+        }
+        if (report.isOpened())
+        {
+            detectionTicks += getTickCount() - start;
+            detectionCpu += clock() - startCpu;
+            allocCounts allocs = allocStats::thread() - allocStart;
+            detectionAllocs += allocs;
+            int nPoints = 0;
+            if (s.calibrationPattern != Settings::CHESSBOARD)
+                nPoints = (int)currentInCal->imagePoints[vectorIndex].size();
+            else if (!currentInCal->imageIndex.empty() && currentInCal->imageIndex.back() == i)
+                nPoints = (int)currentInCal->imagePoints.back().size();
+            report.detected(i, stream.isOpened() ? name : s.imageList[i], runReport::elapsedMs(start), nPoints, false);
+            report.allocated(i, allocs);
+            if (!screened)
+                report.skipped(i, skipReason);
+        }
+        if (draw && !renderer.isOpened())
+        {
+            if (s.container.owns(img)) img = img.clone();     // Container frames are read only
+            img = image.color();    // The color of a captured buffer is only made to be shown
+            drawOverlay(s, img, overlay);
+        }
+
+        // A new estimate needs new undistortion maps
+        int n = incremental.isOpened() ? incremental.get(estimate, nEstimates) : 0;
+        bool newEstimate = n != nEstimates;
+        if (newEstimate)
+        {
+            nEstimates = n;
+            if (!s.useIntrinsicInput) previewMaps[0] = previewMaps[1] = Mat();
+        }
+
+        if (renderer.isOpened())
+        {
+            renderer.show(image, overlay, incremental.isOpened(), newEstimate ? &estimate : NULL);
+            if ((renderer.reloadRequested() || watcher.changed())
+                    && reloadPreviewSettings(s, &detector, &tracker, 1, &renderer.settingsLock()) && incremental.isOpened())
+                incremental.setGuess(s);
+            if (!renderer.quitRequested())
+                continue;
+            if (s.arucoStats) printArucoStats(detector.getTotalStats());
+            report.addStage("Detection", 1000.*detectionTicks/getTickFrequency(), 1000.*detectionCpu/CLOCKS_PER_SEC,
+                            detectionAllocs);
+            break;
+        }
+
+        if (s.mode == Settings::PREVIEW)    // Check if the preview should be undistorted
+            undistortCheck(s, img, undistortPreview, previewMaps, estimate);
+        if (incremental.isOpened())
+            incremental.drawStatus(img, estimate);
 
-// static void write(FileStorage& fs, const string&, const Settings& x)
-// {
-//     x.write(fs);
-// }
+        // If a valid path for detected images has been provided, save them to this path
+        if(save)
+        {
+            sprintf(imgSave, "%sdetected_%d", s.detectedPath.c_str(), i);
+            writer.write(imgSave, img);
+        }
 
+        if (s.headless)
+            continue;
+        display::show("Detected", img);
 
-//----------------Error checking/Debugging helper functions-------------------//
-// Checks if a path points to an existing directory
-bool pathCheck(const string& path)
-{
-    DIR* dir = opendir(path.c_str());
-    if (dir)              // If the path is an actual directory
+        // If wait setting is true, wait till next key press (waitkey(0)). Otherwise, wait 50 ms
+        char c = (char)display::waitKey(s.wait ? 0: 50);
+
+        if (c == 'u')
+            undistortPreview = !undistortPreview;
+        if (s.mode == Settings::PREVIEW && (c == 'l' || watcher.changed())
+                && reloadPreviewSettings(s, &detector, &tracker, 1) && incremental.isOpened())
+            incremental.setGuess(s);
+        if (c == 'c' && s.mode == Settings::PREVIEW)
+            s.showArucoCoords = !s.showArucoCoords;
+        else if( (c & 255) == 27 || c == 'q' || c == 'Q' )
+        {
+            if (s.arucoStats) printArucoStats(detector.getTotalStats());
+            report.addStage("Detection", 1000.*detectionTicks/getTickFrequency(), 1000.*detectionCpu/CLOCKS_PER_SEC,
+                            detectionAllocs);
+            break;
+        }
+    }
+    if (renderer.isOpened()) renderer.close();
+    else if (!s.headless) display::close("Detected");
+    if (scene.skippedFrames() > 0)
+        printf("\nThe detection of %d frames of an unchanged scene was skipped\n", scene.skippedFrames());
+    if (incremental.isOpened())
+        report.captured(incremental.captured());
+    report.addQueue("Frame stream", stream.stats());
+    report.addQueue("Image writer", writer.stats());
+    report.write(s);
+
+    // Keep the last incremental estimate
+    if (incremental.isOpened())
     {
-        closedir(dir);
-        return true;
+        incremental.close();
+        if (incremental.get(estimate, nEstimates) > 0)
+        {
+            printf("\nIncremental calibration of %d views. Avg reprojection error = %.4f\n",
+                   (int)estimate.objectPoints.size(), estimate.totalAvgErr);
+            s.saveIntrinsics(estimate);
+        }
     }
-    else                  // Directory does not exist
-        return false;
+    return 0;
 }
 
-// Legibly prints the contents of a matrix
-void printMat(Mat m, const char *name)
+// Main function. Detects patterns on images, runs calibration and saves results
+int calibrateWithSettings( const string inputSettingsFile )
 {
-    Size s = m.size();
-    printf("%s: \t[", name);
-    for (int i=0; i < s.height; i++)
-    {
-        for (int j=0; j < s.width; j++)
-            printf("%.2f, ", m.at<double>(i,j));
-        // if(i+1 != s.height)
-            // cout << endl << "\t ";
-    }
-    cout << "]\n\n";
+    Settings s;
+    if (!loadSettings(inputSettingsFile, s))
+        return -1;
+    return runCalibration(s);
 }
 
-// Legibly prints the points of an intrinsic calibration struct
-void printPoints(const intrinsicCalibration inCal)
+// Server mode: runs the calibration of each settings file sent to a local socket, one job after the other, in
+// this process. The predefined dictionaries, the binary copies of the marker maps and the OpenMP threads are
+// then shared by every job, and a job only costs its detection and solve. A job is a connection that sends the
+// path of a settings file on one line. The reply is "status <value>" (the return value of calibrateWithSettings),
+// then the files the job wrote ("intrinsics", "extrinsics" and "report" followed by their paths), and "end".
+// The line "quit" stops the server
+int serveCalibrations( const string socketPath )
 {
-    for (auto v:inCal.objectPoints)
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path))
     {
-        cout << "object " << v.size() << endl << "[";
-        for (auto p:v)
-             cout << " " << p << " ";
-        cout << endl << endl;
+        cerr << "Socket path too long: " << socketPath << endl;
+        return -1;
     }
-    for (auto v:inCal.imagePoints)
+    strcpy(addr.sun_path, socketPath.c_str());
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());     // The socket of a previous server
+    if (server < 0 || ::bind(server, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(server, 16) < 0)
     {
-        cout << "image " << v.size() << endl << "[";
-        for (auto p:v)
-             cout << " " << p << " ";
-        cout << endl << endl;
+        cerr << "Could not listen on " << socketPath << ": " << strerror(errno) << endl;
+        if (server >= 0) close(server);
+        return -1;
     }
-}
+    printf("\nWaiting for calibration jobs on %s\n", socketPath.c_str());
 
-
-//-------------------------Calibration functions------------------------------//
-// Calculates the reprojection error with a set of intrinsics
-double computeReprojectionErrors(intrinsicCalibration &inCal)
-{
-    vector<Point2f> imagePoints2;
-    int i, totalPoints = 0;
-    double totalErr = 0, err;
-    inCal.reprojErrs.resize(inCal.objectPoints.size());
-    for( i = 0; i < (int)inCal.objectPoints.size(); i++ )
+    for (;;)
     {
-        projectPoints(Mat(inCal.objectPoints[i]), inCal.rvecs[i], inCal.tvecs[i],
-                      inCal.cameraMatrix, inCal.distCoeffs, imagePoints2);
-        err = norm(Mat(inCal.imagePoints[i]), Mat(imagePoints2), CV_L2);
-        int n = (int)inCal.objectPoints[i].size();
-        inCal.reprojErrs[i] = (float)sqrt(err*err/n);
-        totalErr += err*err;
-        totalPoints += n;
+        int client = accept(server, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR) continue;
+            cerr << "Could not accept a job: " << strerror(errno) << endl;
+            break;
+        }
+        string job;
+        char c;
+        while (recv(client, &c, 1, 0) == 1 && c != '\n')
+            job += c;
+        if (!job.empty() && job[job.size() - 1] == '\r')
+            job.erase(job.size() - 1);
+
+        ostringstream reply;
+        bool quit = job == "quit";
+        if (quit)
+            reply << "status 0\n";
+        else
+        {
+            printf("\nJob: %s\n", job.c_str());
+            Settings s;
+            int status = -1;
+            try {
+                if (loadSettings(job, s))
+                    status = runCalibration(s);
+            }
+            catch (cv::Exception &e) {
+                cerr << "Job failed: " << e.what() << endl;
+            }
+            reply << "status " << status << "\n";
+            if (status == 0)
+            {
+                if (s.intrinsicOutput != "0") reply << "intrinsics " << s.intrinsicOutput << "\n";
+                if (s.extrinsicOutput != "0" && (s.mode == Settings::STEREO || s.mode == Settings::MULTI))
+                    reply << "extrinsics " << s.extrinsicOutput << "\n";
+                if (s.saveRunReport && !s.runReportFilename().empty())
+                    reply << "report " << s.runReportFilename() << "\n";
+            }
+        }
+        reply << "end\n";
+        string r = reply.str();
+        send(client, r.data(), r.size(), MSG_NOSIGNAL);     // A client that left does not stop the server
+        close(client);
+        if (quit)
+            break;
     }
-    return sqrt(totalErr/totalPoints);
+    close(server);
+    unlink(socketPath.c_str());
+    return 0;
 }
 
-// Calculates the 3D object points of a chessboard
-void calcChessboardCorners(Settings s, vector<Point3f>& objectPointsBuf)
+// Settings files of a manifest, a YAML/XML list like an image list
+static bool readManifest(const string &filename, vector<string> &files)
 {
-    for( int i = 0; i < s.boardSize.height; i++ )
-        for( int j = 0; j < s.boardSize.width; j++ )
-            objectPointsBuf.push_back(Point3f(float(j*s.squareSize),
-                                      float(i*s.squareSize), 0));
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+    FileNode n = fs.getFirstTopLevelNode();
+    if (n.type() != FileNode::SEQ)
+        return false;
+    for (FileNodeIterator it = n.begin(); it != n.end(); ++it)
+        files.push_back((string)*it);
+    return true;
 }
 
-// Calculates the 3D object points corresponding to detected ArUco markers
-void calcArucoCorners(vector<Point2f> &imagePointsBuf, vector<Point3f> &objectPointsBuf,
-                      const vector<Marker> &markers_detected, const MarkerMap &map)
+// Manifest mode: calibrates the cameras of every settings file of a manifest (a YAML/XML list of paths, like an
+// image list) in this process. At most concurrentJobs jobs run at once (0 for one job per 4 cores), and each one
+// detects on its share of the cores: the batch detection threads of its settings, or fewer. A job solves as soon
+// as its own detection is done, while the other jobs keep detecting, and the next job starts when one ends. The
+// marker maps of a rig are parsed once for all its jobs, and the predefined dictionaries and the buffer pool are
+// shared. The threads and the pool are set up from the settings of the first job. Every job must be a headless
+// batch calibration (INTRINSIC, STEREO or MULTI mode with BatchDetection_Threads). Returns 0 if every job succeeded
+int calibrateManifest( const string manifestFile, int concurrentJobs )
 {
-    imagePointsBuf.clear();
-    objectPointsBuf.clear();
-    // For each detected marker
-    for(size_t i=0;i<markers_detected.size();i++){
-        int markerIndex = -1;
-        // Search for the marker in the map
-        for(size_t j=0;j<map.size() && markerIndex==-1;j++)
-            if (map[j].id==markers_detected[i].id ) markerIndex=j;
-        if (markerIndex != -1){
-            // If the marker has been found, add its image and object points
-            for(int j=0;j<4;j++){
-                imagePointsBuf.push_back(markers_detected[i][j]);
-                objectPointsBuf.push_back(map[markerIndex][j]);
+    vector<string> files;
+    if (!readManifest(manifestFile, files) || files.empty())
+    {
+        cerr << "Could not read the settings files of the manifest: \"" << manifestFile << "\"" << endl;
+        return -1;
+    }
+    int nJobs = (int)files.size(), cores = max(1, omp_get_max_threads());
+    if (concurrentJobs <= 0)
+        concurrentJobs = max(1, cores/4);
+    concurrentJobs = min(concurrentJobs, nJobs);
+    int jobThreads = max(1, cores/concurrentJobs);
+
+    // The settings are read up front, so a bad file is reported before any job starts
+    vector<unique_ptr<Settings> > jobs(nJobs);
+    vector<int> status(nJobs, -1);
+    vector<double> elapsedMs(nJobs, 0.);
+    const Settings *first = NULL;
+    for (int j = 0; j < nJobs; j++)
+    {
+        jobs[j].reset(new Settings);
+        Settings &s = *jobs[j];
+        if (!loadSettings(files[j], s))
+            jobs[j].reset();
+        else if (s.mode == Settings::PREVIEW || s.batchThreads <= 0 || !s.headless || s.streamInput != "0")
+        {
+            cerr << "Manifest jobs must be headless batch calibrations: \"" << files[j] << "\"" << endl;
+            jobs[j].reset();
+        }
+        else
+        {
+            s.batchThreads = min(s.batchThreads, jobThreads);
+            s.exportThreads = min(s.exportThreads, jobThreads);
+            s.sharedProcess = true;
+            if (!first) first = &s;
+        }
+    }
+    if (!first)
+        return -1;
+    setupProcess(*first);
+    printf("\nCalibrating %d cameras, %d at once on %d threads each\n", nJobs, concurrentJobs, jobThreads);
+
+    atomic<int> next(0);
+    auto work = [&]()
+    {
+        for (int j; (j = next++) < nJobs;)
+        {
+            if (!jobs[j])
+                continue;
+            int64 start = getTickCount();
+            try {
+                status[j] = runCalibration(*jobs[j]);
+            }
+            catch (cv::Exception &e) {
+                cerr << "Job " << files[j] << " failed: " << e.what() << endl;
             }
+            elapsedMs[j] = 1000.*(getTickCount() - start)/getTickFrequency();
+            jobs[j].reset();    // The images and points of the job are released now
         }
+    };
+    vector<thread> workers;
+    for (int t = 1; t < concurrentJobs; t++)
+        workers.push_back(thread(work));
+    work();
+    for (auto &w:workers)
+        w.join();
+
+    int failed = 0;
+    printf("\n%-8s %10s  %s\n", "Status", "Time (s)", "Settings");
+    for (int j = 0; j < nJobs; j++)
+    {
+        printf("%-8s %10.2f  %s\n", status[j] == 0 ? "ok" : "failed", elapsedMs[j]/1000., files[j].c_str());
+        failed += status[j] != 0;
     }
-    //cout<<inCal.objectPoints.size()/4<<" markers detected"<<endl;
+    printf("%d of %d cameras calibrated\n", nJobs - failed, nJobs);
+    return failed == 0 ? 0 : -1;
 }
 
-// Modify the object points to be integer values that correspond to 3D planes
-vector<Point3f> getIntPoints(Settings s, vector<Point3f> &points, int index){
-    vector<Point3f> intPoints;
+//--------------------In-memory calibration (see frameCalibrator.h)----------------------------//
+struct FrameCalibrator::state {
+    Settings s;
+    MarkerDetector detector;
+    chessboardHint hints[2];        // Where the next chessboard search of each camera starts
+    intrinsicCalibration cal[2];    // Points of the frames of each camera
+    int nFrames = 0;                // Frames kept, with their points in cal
+};
 
-    // variables to increase clarity
-    string plane = s.arPat.planeList[index];
-    int xOffset = s.arPat.xOffset;
-    int yOffset = s.arPat.yOffset;
-    int denom = s.arPat.denominator;
+FrameCalibrator::FrameCalibrator() : st(NULL) {}
 
-    if (plane == "YZ")
-        for(auto p:points) intPoints.push_back(Point3f(0, (p.y + yOffset)/denom,
-        (-p.x + xOffset)/denom));
-    else if (plane == "XZ")
-        for(auto p:points) intPoints.push_back(Point3f((p.x + xOffset)/denom, 0,
-        (-p.y + yOffset)/denom));
-    else   //plane == "XY"
-        for(auto p:points) intPoints.push_back(Point3f((p.x + xOffset)/denom,
-        (p.y + yOffset)/denom, 0));
+FrameCalibrator::~FrameCalibrator() { delete st; }
+
+bool FrameCalibrator::open(const string &settings)
+{
+    delete st;
+    st = new state;
+    Settings &s = st->s;
+    s.frameInput = true;
+    try {
+        FileStorage fs(settings, FileStorage::READ + FileStorage::MEMORY);
+        if (fs.isOpened())
+            fs["Settings"] >> s;
+    }
+    catch (cv::Exception &e) {
+        cerr << "Invalid calibration settings: " << e.what() << endl;
+        s.goodInput = false;
+    }
+    if (!s.goodInput)
+    {
+        delete st;
+        st = NULL;
+        return false;
+    }
 
-    return intPoints;
+    // Nothing is shown or written
+    s.intrinsicOutput = s.extrinsicOutput = s.undistortedPath = s.rectifiedPath = s.rectifiedContainer = "0";
+    s.showUndistorted = s.showRectified = false;
+    s.saveRunReport = s.saveTrace = false;
+    s.imageSize = Size();       // Set by the first frame
+    if (s.calibrationPattern != Settings::CHESSBOARD)
+        setupArucoDetector(s, st->detector);
+    return true;
 }
 
-// Stereo calibration requires both images to have the same # of image and object points, but
-// ArUco detections can include an arbitrary subset of all markers.
-// This function limits the points lists to only those points shared between each image
-void getSharedPoints(intrinsicCalibration &inCal, intrinsicCalibration &inCal2)
+bool FrameCalibrator::isOpened() const { return st != NULL; }
+
+int FrameCalibrator::nFrames() const { return st ? st->nFrames : 0; }
+
+// Detects the pattern of a frame of a camera. Chessboard views are appended when the board is found, and ArUco
+// views are stored at the index of the next frame. Returns the number of points found, or -1 on an error
+int FrameCalibrator::detect(const Mat &frame, int camera)
 {
-    // pointers to make code more legible
-    vector<Point3f> *oPoints, *oPoints2;
-    vector<Point2f> *iPoints, *iPoints2;
-    int shared;     //index of a shared object point
+    Settings &s = st->s;
+    if (frame.empty() || frame.depth() != CV_8U || (frame.channels() != 1 && frame.channels() != 3))
+    {
+        cerr << "Frames must be 8 bit grayscale or BGR images" << endl;
+        return -1;
+    }
+    if (s.imageSize == Size())
+        s.imageSize = frame.size();
+    else if (frame.size() != s.imageSize)
+    {
+        cerr << "Frame size " << frame.cols << "x" << frame.rows << " differs from the first frame" << endl;
+        return -1;
+    }
 
-    //for each objectPoints vector in overall objectPoints vector of vectors
-    for (int i=0; i<(int)inCal.objectPoints.size(); i++)
+    intrinsicCalibration &cal = st->cal[camera];
+    imageFrame f;
+    f.img = frame;      // A header, the frame is not copied
+    f.camera = camera;
+    if (s.calibrationPattern == Settings::CHESSBOARD)
     {
-        vector<Point3f> sharedObjectPoints;
-        vector<Point2f> sharedImagePoints, sharedImagePoints2;   //shared image points for each inCal
+        size_t n = cal.imagePoints.size();
+        chessboardDetect(s, f, cal, NULL, &st->hints[camera]);
+        if (cal.imagePoints.size() == n)
+            return 0;
+        cal.imageIndex.push_back(st->nFrames);
+        return (int)cal.imagePoints.back().size();
+    }
+    cal.imagePoints.resize(st->nFrames + 1);
+    cal.objectPoints.resize(st->nFrames + 1);
+    cal.pointKeys.resize(st->nFrames + 1);
+    arucoDetect(s, st->detector, f, cal, st->nFrames, NULL);
+    return (int)cal.imagePoints[st->nFrames].size();
+}
+
+// Removes the views of a camera after the first n, when a frame is not kept
+static void truncateViews(intrinsicCalibration &cal, size_t n)
+{
+    if (cal.imagePoints.size() > n) cal.imagePoints.resize(n);
+    if (cal.objectPoints.size() > n) cal.objectPoints.resize(n);
+    if (cal.pointKeys.size() > n) cal.pointKeys.resize(n);
+    if (cal.imageIndex.size() > n) cal.imageIndex.resize(n);
+}
 
-        oPoints = &inCal.objectPoints.at(i);
-        oPoints2 = &inCal2.objectPoints.at(i);
-        iPoints  = &inCal.imagePoints.at(i);
-        iPoints2 = &inCal2.imagePoints.at(i);
-        for (int j=0; j<(int)oPoints->size(); j++)
+int FrameCalibrator::addFrame(const Mat &frame)
+{
+    if (!st || st->s.mode != Settings::INTRINSIC)
+        return -1;
+    size_t before = st->cal[0].imagePoints.size();
+    int n = detect(frame, 0);
+    if (n <= 0)
+        truncateViews(st->cal[0], before);
+    else
+        st->nFrames++;
+    return n;
+}
+
+// A pair is only kept if the pattern is found in both frames, so the views of both cameras stay aligned.
+// Returns the points found in the frame with fewer
+int FrameCalibrator::addFrame(const Mat &left, const Mat &right)
+{
+    if (!st || st->s.mode != Settings::STEREO)
+        return -1;
+    size_t before[2] = { st->cal[0].imagePoints.size(), st->cal[1].imagePoints.size() };
+    int n = detect(left, 0), n2 = n < 0 ? -1 : detect(right, 1);
+    n = min(n, n2);
+    if (n <= 0)
+        for (int k = 0; k < 2; k++)
+            truncateViews(st->cal[k], before[k]);
+    else
+        st->nFrames++;
+    return n;
+}
+
+bool FrameCalibrator::calibrate(frameCalibrationResult &result)
+{
+    if (!st || st->nFrames == 0)
+        return false;
+    const Settings &s = st->s;
+
+    // The calibration clears outliers and sets the poses, so it runs on copies of the points
+    intrinsicCalibration inCal = st->cal[0], inCal2 = st->cal[1];
+    bool ok = true;
+    try {
+        if (s.mode == Settings::STEREO)
         {
-            for (shared=0; shared<(int)oPoints2->size(); shared++)
-                if (oPoints->at(j) == oPoints2->at(shared)) break;
-            if (shared != (int)oPoints2->size())       //object point is shared
+            if (!s.useIntrinsicInput && !s.jointStereo)
+            {
+                bool ok2 = false;
+                runConcurrently([&]() { ok = runIntrinsicCalibration(s, inCal); },
+                                [&]() { ok2 = runIntrinsicCalibration(s, inCal2); });
+                ok = ok && ok2;
+            }
+            if (ok)
             {
-                sharedObjectPoints.push_back(oPoints->at(j));
-                sharedImagePoints.push_back(iPoints->at(j));
-                sharedImagePoints2.push_back(iPoints2->at(shared));
+                ImageWriter writer;     // Nothing is saved, so neither is used
+                FrameStore frames;
+                stereoCalibration sterCal = runStereoCalibration(s, inCal, inCal2, writer, frames);
+                result.R = sterCal.R;
+                result.T = sterCal.T;
+                result.E = sterCal.E;
+                result.F = sterCal.F;
+                result.R1 = sterCal.R1;
+                result.R2 = sterCal.R2;
+                result.P1 = sterCal.P1;
+                result.P2 = sterCal.P2;
+                result.Q = sterCal.Q;
+                result.validRoi[0] = sterCal.validRoi[0];
+                result.validRoi[1] = sterCal.validRoi[1];
+                ok = checkRange(sterCal.R) && checkRange(sterCal.T);
             }
         }
-        *oPoints = sharedObjectPoints;
-        *oPoints2 = sharedObjectPoints;
-        *iPoints = sharedImagePoints;
-        *iPoints2 = sharedImagePoints2;
+        else
+        {
+            if (s.keyframeViews > 0)
+                selectKeyframes(s, inCal);
+            ok = runIntrinsicCalibration(s, inCal);
+        }
+    }
+    catch (cv::Exception &e) {
+        cerr << "Calibration failed: " << e.what() << endl;
+        return false;
     }
-}
-
-// Draws an inputted ArUco marker
-// Draws either the ID or 3D coordinate, depening on the showArucoCoords setting
-void drawMarker(Settings s, Marker &marker, Mat &img, Scalar color, int lineWidth, Point3f printPoint, int corner) {
-    // Draw a rectangle around the marker
-    // marker[x] is coordinate of corner on image
-    line(img, marker[0], marker[1], color, lineWidth, CV_AA);
-    line(img, marker[1], marker[2], color, lineWidth, CV_AA);
-    line(img, marker[2], marker[3], color, lineWidth, CV_AA);
-    line(img, marker[3], marker[0], color, lineWidth, CV_AA);
-
-    auto p2=Point2f(lineWidth, lineWidth);
-    rectangle(img, marker[corner] - p2, marker[corner] + p2,  Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), lineWidth, CV_AA);
 
-    // Determine the center point
-    Point cent(0, 0);
-    for (int i = 0; i < 4; i++) {
-        cent.x += marker[i].x;
-        cent.y += marker[i].y;
+    const intrinsicCalibration *cals[2] = { &inCal, &inCal2 };
+    for (int k = 0; k < (s.mode == Settings::STEREO ? 2 : 1); k++)
+    {
+        result.cameraMatrix[k] = cals[k]->cameraMatrix;
+        result.distCoeffs[k] = cals[k]->distCoeffs;
+        result.avgError[k] = cals[k]->totalAvgErr;
     }
-    cent.x /= 4.;
-    cent.y /= 4.;
+    result.rvecs = inCal.rvecs;
+    result.tvecs = inCal.tvecs;
+    result.nViews = 0;
+    for (size_t v = 0; v < inCal.imagePoints.size(); v++)
+        if (!inCal.imagePoints[v].empty()) result.nViews++;
+    return ok;
+}
 
-    if (s.showArucoCoords) {        // draw the input printPoint, which is the marker coordinate
-        rectangle(img, marker[corner] - p2, marker[corner] + p2,  Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), lineWidth, CV_AA);
 
-        char p[100];
-        sprintf(p, "(%d,%d,%d)", (int)printPoint.x, (int)printPoint.y, (int)printPoint.z);
-        putText(img, p, cent, FONT_HERSHEY_SIMPLEX, .5f, Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), 2);
-    }
-    else {                          // draw the ID number
-        char cad[100];
-        sprintf(cad, "id=%d", marker.id);
-        putText(img, cad, cent, FONT_HERSHEY_SIMPLEX,  max(0.5f,float(lineWidth)*0.3f), Scalar(255 - color[0], 255 - color[1], 255 - color[2], 255), max(lineWidth,2));
-    }
+// Writes a benchmark measurement as a CSV row: dataset, stage, image width, threads, timed runs and
+// milliseconds per run
+static void writeBenchmarkRow(ostream &out, const string &dataset, const string &stage, int width,
+                              int threads, int count, double ms)
+{
+    char row[256];
+    snprintf(row, sizeof(row), "%s,%s,%d,%d,%d,%.4f\n", dataset.c_str(), stage.c_str(), width, threads, count, ms);
+    out << row;
 }
 
-// Draws all the detected markers onto the image
-void drawArucoMarkers(Settings s, Mat &img, vector<Point3f> &objectPointsBuf,
-                      vector<Marker> detectedMarkers,
-                      vector<int> markersFromSet, int index)
+// Reads the settings of a benchmark and decodes its images once, at native resolution, so decoding is not
+// timed. The dataset is named by the settings file, without its path and extension. An image list given
+// replaces that of the settings, and names the dataset. Returns false on an error
+static bool readBenchmarkImages(const string &inputSettingsFile, Settings &s, string &dataset, vector<Mat> &images,
+                                const string &imageList = "")
 {
-    // corner variable is the index of the corner to be draw
-    // each marker's points are stored in a list:
-    //    [upper left, upper right, lower right, lower left]
-    int corner, colorSwitch;
-    string plane = s.arPat.planeList[index];
-    if (plane == "XY") {
-        corner = 3;
-        colorSwitch = 0;
-    } else if (plane == "YZ") {
-        corner = 2;
-        colorSwitch = 1;
-    } else {  //plane == "XZ"
-        corner = 0;
-        colorSwitch = 2;
+    FileStorage fs(inputSettingsFile, FileStorage::READ);   // Read the settings
+    if (!fs.isOpened())
+    {
+        cerr << "Could not open the settings file: \"" << inputSettingsFile << "\"" << endl;
+        return false;
+    }
+    fs["Settings"] >> s;
+    fs.release();
+    if (!s.goodInput)
+    {
+        cerr << "Invalid input detected. Benchmark stopping. " << endl;
+        return false;
+    }
+    if ((s.mode != Settings::INTRINSIC && s.mode != Settings::STEREO) || s.streamInput != "0" || s.nImages == 0)
+    {
+        cerr << "The benchmark needs the image list of an INTRINSIC or STEREO settings file: "
+             << inputSettingsFile << endl;
+        return false;
+    }
+    dataset = inputSettingsFile.substr(inputSettingsFile.find_last_of("/\\") + 1);
+    dataset = dataset.substr(0, dataset.find_last_of('.'));
+    if (!imageList.empty())
+    {
+        if (!s.readImageList(imageList))
+        {
+            cerr << "Could not read the image list: " << imageList << endl;
+            return false;
+        }
+        s.nImages = (int)s.imageList.size();
+        s.fetcher.reset();
+        dataset = imageList.substr(0, imageList.find_last_not_of("/\\") + 1);     // The list path, without its extension
+        size_t dot = dataset.find_last_of('.');
+        if (dot != string::npos && dataset.find_first_of("/\\", dot) == string::npos)
+            dataset.erase(dot);
     }
 
-    // Color for marker to be drawn in draw function
-    Scalar color = Scalar(0,0,0);
-    color[colorSwitch] = 255;
-
-    // Draws each detected markers onto the image
-    // Each marker has 4 detected object points, so loop through size of inCal.objectPoints/4
-    int markerIndex;
-    for (int k = 0; k < (int)objectPointsBuf.size()/4; k++) {
-        markerIndex = markersFromSet[k];
-        drawMarker(s, detectedMarkers[markerIndex], img, color, max(float(1.f),1.5f*float(img.cols)/1000.f),
-                   objectPointsBuf[k*4+corner], corner);
+    // The calibrations are timed without outlier rejection
+    s.maxImageWidth = 0;
+    s.outlierIterations = 0;
+    images.resize(s.nImages);
+    for (int i = 0; i < s.nImages; i++)
+    {
+        images[i] = s.readListImage(i, CV_LOAD_IMAGE_GRAYSCALE);
+        if (!images[i].data)
+        {
+            cerr << "Could not read image: " << s.imageList[i] << endl;
+            return false;
+        }
     }
-    img.copyTo(img);
+    return true;
 }
 
-// Detects the pattern on a chessboard image
-void chessboardDetect(Settings s, Mat &img, intrinsicCalibration &inCal)
+// The images of a benchmark scaled down to a width (0 keeps the native width)
+static vector<Mat> scaledBenchmarkImages(const vector<Mat> &images, int width)
 {
-    //create grayscale copy for cornerSubPix function
-    Mat imgGray;
-    cvtColor(img, imgGray, COLOR_BGR2GRAY);
-
-    //buffer to store points for each image
-    vector<Point2f> imagePointsBuf;
-    vector<Point3f> objectPointsBuf;
-    bool found = findChessboardCorners( img, s.boardSize, imagePointsBuf,
-        CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS | CV_CALIB_CB_FAST_CHECK |
-        CV_CALIB_CB_NORMALIZE_IMAGE);
-    if (found)
+    vector<Mat> scaled(images.size());
+    for (size_t i = 0; i < images.size(); i++)
     {
-        cornerSubPix(imgGray, imagePointsBuf, Size(11,11), Size(-1,-1),
-                     TermCriteria( CV_TERMCRIT_EPS+CV_TERMCRIT_ITER, 30, 0.1 ));
-
-        //add these image points to the overall calibration vector
-        inCal.imagePoints.push_back(imagePointsBuf);
-
-        //find the corresponding objectPoints
-        calcChessboardCorners(s, objectPointsBuf);
-        inCal.objectPoints.push_back(objectPointsBuf);
-        drawChessboardCorners(img, s.boardSize, Mat(imagePointsBuf), found);
+        if (width > 0 && images[i].cols > width)
+            resize(images[i], scaled[i], Size(width, cvRound(images[i].rows*(double)width/images[i].cols)),
+                   0, 0, INTER_AREA);
+        else
+            scaled[i] = images[i];
     }
+    return scaled;
 }
 
-// Detects the pattern on an ArUco image
-void arucoDetect(Settings s, Mat &img, intrinsicCalibration &inCal, int vectorIndex)
+// Per image detection results of the last run of a benchmark
+struct benchmarkPoints
 {
-    MarkerDetector TheMarkerDetector;
-    //set specific parameters for this configuration
-    MarkerDetector::Params params;
-    params._borderDistThres=.01;//acept markers near the borders
-    params._maxSize=0.9;
-    params._thresParam1=5;
-    params._thresParam1_range=10;//search in wide range of values for param1
-    params._cornerMethod=MarkerDetector::SUBPIX;//use subpixel corner refinement
-    params._subpix_wsize= (10./2000.)*float(img.cols) ;//search corner subpix in a window area
-    //cout<<params._subpix_wsize<<" "<<float(img.cols)<<endl;
-    TheMarkerDetector.setParams(params);//set the params above
-
-    // Pointers to the overall imagePoints and objectPoints vectors for the image
-    // The points from all marker maps will be added to these image vectors
-    vector<Point2f> *imgImagePoints;
-    vector<Point3f> *imgObjectPoints;
+    vector<vector<Point2f> > imagePoints;
+    vector<vector<Point3f> > objectPoints;
+    vector<vector<int> > pointKeys;
+};
 
-    if (s.mode != Settings::PREVIEW) {
-        imgImagePoints = &inCal.imagePoints.at(vectorIndex);
-        imgObjectPoints = &inCal.objectPoints.at(vectorIndex);
+// Times the detection of the images on nThreads, with one persistent single threaded detector per thread, as in
+// batch detection. Returns the milliseconds per image of the fastest of the repeats, with the detector stats of
+// that run and the allocations of the last one (once the detectors have grown their buffers)
+static double timeBenchmarkDetection(const Settings &s, const vector<Mat> &images, int nThreads, int repeats,
+                                     benchmarkPoints &points, MarkerDetector::Stats &stats, allocCounts &allocs)
+{
+    bool aruco = s.calibrationPattern != Settings::CHESSBOARD;
+    int nImages = (int)images.size();
+    points.imagePoints.assign(nImages, vector<Point2f>());
+    points.objectPoints.assign(nImages, vector<Point3f>());
+    points.pointKeys.assign(nImages, vector<int>());
+    vector<MarkerDetector> detectors(nThreads);
+    if (aruco)
+        for (auto &d:detectors) setupArucoDetector(s, d, 1);
+
+    double best = DBL_MAX;
+    for (int r = 0; r < repeats; r++)
+    {
+        for (auto &d:detectors) d.resetStats();
+        allocCounts allocStart = allocStats::process();
+        int64 start = getTickCount();
+        #pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+        for (int i = 0; i < nImages; i++)
+        {
+            imageFrame image;
+            image.img = images[i];
+            image.camera = -1;      // The images are rescaled, so the ROI coordinates do not apply
+            intrinsicCalibration imgCal;
+            if (aruco)
+            {
+                imgCal.imagePoints.resize(1);
+                imgCal.objectPoints.resize(1);
+                imgCal.pointKeys.resize(1);
+                arucoDetect(s, detectors[omp_get_thread_num()], image, imgCal, 0, NULL);
+            }
+            else
+                chessboardDetect(s, image, imgCal, NULL);
+            points.imagePoints[i].clear();
+            points.objectPoints[i].clear();
+            points.pointKeys[i].clear();
+            if (!imgCal.imagePoints.empty())
+            {
+                points.imagePoints[i].swap(imgCal.imagePoints[0]);
+                points.objectPoints[i].swap(imgCal.objectPoints[0]);
+                if (!imgCal.pointKeys.empty()) points.pointKeys[i].swap(imgCal.pointKeys[0]);
+            }
+        }
+        double ms = 1000.*(getTickCount() - start)/getTickFrequency()/nImages;
+        if (r == repeats - 1)
+            allocs = allocStats::process() - allocStart;
+        if (ms < best)
+        {
+            best = ms;
+            stats = MarkerDetector::Stats();
+            for (auto &d:detectors) stats.add(d.getTotalStats());
+        }
     }
+    return best;
+}
 
-    //for each marker map, detect its markers and draw them
-    for(int j=0; j < s.nMarkerMaps; j++) {
-        MarkerMap map = s.arPat.markerMapList[j];
-        TheMarkerDetector.setDictionary(map.getDictionary());
-        vector<Marker> detectedMarkers;
-        vector<int> markersFromSet;
-
-        // Point buffers to store points for each config
-        vector<Point2f> imagePointsBuf;
-        vector<Point3f> objectPointsBuf;
-
-        // detect the markers using MarkerDetector object
-        detectedMarkers = TheMarkerDetector.detect(img);
-        markersFromSet = map.getIndices(detectedMarkers);
-        calcArucoCorners(imagePointsBuf,objectPointsBuf,detectedMarkers,map);
-
-        // Convert the object points to int values. This also compensates for box geometry,
-        // based on the plane list in the aruco pattern config
-        objectPointsBuf = getIntPoints(s, objectPointsBuf, j);
+// The name of the detection of a benchmark
+static const char *benchmarkDetection(const Settings &s)
+{
+    return s.calibrationPattern == Settings::CHESSBOARD ? "chessboardDetect"
+           : s.arucoBackend == ArucoBackend::OPENCV ? "cv::aruco::detectMarkers" : "arucoDetect";
+}
 
-        // Add the point buffers to the overall calibration vectors
-        if(objectPointsBuf.size()>0 && s.mode != Settings::PREVIEW){
-            for (auto p:imagePointsBuf) imgImagePoints->push_back(p);
-            for (auto p:objectPointsBuf) imgObjectPoints->push_back(p);
+// The views of a benchmark detected in every image of them, as in batch detection
+static void benchmarkViews(const Settings &s, const benchmarkPoints &points, intrinsicCalibration &inCal,
+                           intrinsicCalibration &inCal2)
+{
+    bool aruco = s.calibrationPattern != Settings::CHESSBOARD;
+    int nViews = (s.mode == Settings::STEREO) ? 2 : 1;
+    for (int v = 0; v < (int)points.imagePoints.size()/nViews; v++)
+    {
+        int left = v*nViews, right = left + nViews - 1;
+        if (points.imagePoints[left].empty() || points.imagePoints[right].empty())
+            continue;
+        inCal.imagePoints.push_back(points.imagePoints[left]);
+        inCal.objectPoints.push_back(points.objectPoints[left]);
+        if (aruco) inCal.pointKeys.push_back(points.pointKeys[left]);
+        else inCal.imageIndex.push_back(left);
+        if (s.mode == Settings::STEREO)
+        {
+            inCal2.imagePoints.push_back(points.imagePoints[right]);
+            inCal2.objectPoints.push_back(points.objectPoints[right]);
+            if (aruco) inCal2.pointKeys.push_back(points.pointKeys[right]);
+            else inCal2.imageIndex.push_back(right);
         }
-        drawArucoMarkers(s, img, objectPointsBuf, detectedMarkers, markersFromSet, j);
     }
 }
 
-
-//--------------------Running and saving functions----------------------------//
-// Correct an images radial distortion using a set of intrinsic parameters
-static void undistortImages(Settings s, intrinsicCalibration &inCal)
+// Milliseconds of the fastest of the repeats of the intrinsic calibration of the views
+static double timeBenchmarkCalibration(const Settings &s, const intrinsicCalibration &inCal, int repeats,
+                                       intrinsicCalibration &cal)
 {
-    Mat img, Uimg;
-    char imgSave[1000];
-
-    bool save = false;
-    if(s.undistortedPath != "0" && s.mode != Settings::PREVIEW)
+    double best = DBL_MAX;
+    for (int r = 0; r < repeats; r++)
     {
-        if( pathCheck(s.undistortedPath) )
-            save = true;
-        else
-            printf("\nUndistorted images could not be saved. Invalid path: %s\n", s.undistortedPath.c_str());
+        cal = inCal;
+        int64 start = getTickCount();
+        runIntrinsicCalibration(s, cal);
+        best = min(best, 1000.*(getTickCount() - start)/getTickFrequency());
     }
+    return best;
+}
 
-    namedWindow("Undistorted", CV_WINDOW_AUTOSIZE);
-    for( int i = 0; i < s.nImages; i++ )
+// Times the detection and calibration of the images of an INTRINSIC or STEREO settings file, writing a
+// CSV row for each measurement (see writeBenchmarkRow). The images are decoded once and scaled down to
+// each width (0 keeps the native width). The detection is timed on each number of threads, with the
+// ArUco detector stages, and the calibrations on the points of the last detection. Each measurement is
+// the fastest of the repeats. Returns 0 on success
+int benchmarkWithSettings(const string inputSettingsFile, const vector<int> &widths, const vector<int> &threads,
+                          int repeats, ostream &out)
+{
+    Settings s;
+    string dataset;
+    vector<Mat> images;
+    if (!readBenchmarkImages(inputSettingsFile, s, dataset, images))
+        return -1;
+    bool aruco = s.calibrationPattern != Settings::CHESSBOARD;
+
+    for (int width:widths)
     {
-        img = s.imageSetup(i);
-        undistort(img, Uimg, inCal.cameraMatrix, inCal.distCoeffs);
+        vector<Mat> scaled = scaledBenchmarkImages(images, width);
+        int imageWidth = scaled[0].cols;
+        benchmarkPoints points;
 
-        // If a valid path for undistorted images has been provided, save them to this path
-        if(save)
+        for (int nThreads:threads)
         {
-            sprintf(imgSave, "%sundistorted_%d.jpg", s.undistortedPath.c_str(), i);
-            imwrite(imgSave, Uimg);
+            MarkerDetector::Stats stats;
+            allocCounts allocs;
+            double best = timeBenchmarkDetection(s, scaled, nThreads, repeats, points, stats, allocs);
+            const char *detection = benchmarkDetection(s);
+            writeBenchmarkRow(out, dataset, detection, imageWidth, nThreads,
+                              s.nImages, best);
+            // In the builds that count them (see allocStats), the allocations per image are written like a time,
+            // so that the baseline comparison also reports the detections that allocate more
+            if (allocStats::isEnabled())
+            {
+                writeBenchmarkRow(out, dataset, string(detection) + " allocations", imageWidth, nThreads,
+                                  s.nImages, (double)allocs.allocations/s.nImages);
+                writeBenchmarkRow(out, dataset, string(detection) + " allocated KB", imageWidth, nThreads,
+                                  s.nImages, allocs.bytes/1024./s.nImages);
+            }
+
+            // The stages are the time spent on each image, whatever the thread that detected it
+            if (aruco && stats.nCalls > 0)
+            {
+                double n = stats.nCalls;
+                writeBenchmarkRow(out, dataset, "MarkerDetector::threshold", imageWidth, nThreads, stats.nCalls, stats.thresholdTime/n);
+                writeBenchmarkRow(out, dataset, "MarkerDetector::rectangles", imageWidth, nThreads, stats.nCalls, stats.rectanglesTime/n);
+                writeBenchmarkRow(out, dataset, "MarkerDetector::identify", imageWidth, nThreads, stats.nCalls, stats.identifyTime/n);
+                writeBenchmarkRow(out, dataset, "MarkerDetector::refine", imageWidth, nThreads, stats.nCalls, stats.refineTime/n);
+                writeBenchmarkRow(out, dataset, "MarkerDetector::filter", imageWidth, nThreads, stats.nCalls, stats.filterTime/n);
+                writeBenchmarkRow(out, dataset, "MarkerDetector::detect", imageWidth, nThreads, stats.nCalls, stats.totalTime/n);
+            }
         }
 
-        if(s.showUndistorted)
+        intrinsicCalibration inCal, inCal2;
+        benchmarkViews(s, points, inCal, inCal2);
+        if (inCal.imagePoints.size() < 2)
         {
-            imshow("Undistorted", Uimg);
-            char c = (char)waitKey();
-            if( (c & 255) == 27 || c == 'q' || c == 'Q' )   //escape key or 'q'
-                break;
+            printf("\n%s: too few views detected at width %d to time the calibration\n", dataset.c_str(), imageWidth);
+            continue;
+        }
+        s.imageSize = scaled[0].size();
+
+        intrinsicCalibration cal, cal2;
+        double best = timeBenchmarkCalibration(s, inCal, repeats, cal);
+        writeBenchmarkRow(out, dataset, s.solver == Settings::SPARSE_SOLVER ? "sparseCalibrateCamera" : "calibrateCamera",
+                          imageWidth, 1, (int)inCal.imagePoints.size(), best);
+
+        if (s.mode != Settings::STEREO)
+            continue;
+        cal2 = inCal2;
+        runIntrinsicCalibration(s, cal2);
+        best = DBL_MAX;
+        for (int r = 0; r < repeats; r++)
+        {
+            intrinsicCalibration left = cal, right = cal2;
+            stereoCalibration sterCal;
+            int64 start = getTickCount();
+            runFixedIntrinsicStereoCalibration(s, left, right, sterCal);
+            best = min(best, 1000.*(getTickCount() - start)/getTickFrequency());
         }
+        writeBenchmarkRow(out, dataset, "stereoCalibrate", imageWidth, 1, (int)inCal.imagePoints.size(), best);
     }
-    destroyWindow("Undistorted");
+    return 0;
 }
 
-// Rectifies an image pair using a set of extrinsic stereo parameters
-void rectifyImages(Settings s, intrinsicCalibration &inCal,
-                   intrinsicCalibration &inCal2, stereoCalibration &sterCal)
+// Value at a percentile (0 to 100) of unsorted values, by the nearest rank
+static double percentile(vector<double> values, double p)
 {
-    Mat rmap[2][2];
-
-    //Precompute maps for remap()
-    initUndistortRectifyMap(inCal.cameraMatrix, inCal.distCoeffs, sterCal.R1,
-                        sterCal.P1, s.imageSize, CV_16SC2, rmap[0][0], rmap[0][1]);
-    initUndistortRectifyMap(inCal2.cameraMatrix, inCal2.distCoeffs, sterCal.R2,
-                        sterCal.P2, s.imageSize, CV_16SC2, rmap[1][0], rmap[1][1]);
-
-    Mat canvas, rimg, cimg;
-    double sf = 600. / MAX(s.imageSize.width, s.imageSize.height);
-    int w = cvRound(s.imageSize.width * sf);
-    int h = cvRound(s.imageSize.height * sf);
-    canvas.create(h, w*2, CV_8UC3);
-
-    // buffer for image filename
-    char imgSave[1000];
-    const char *view;
+    if (values.empty())
+        return 0;
+    size_t rank = (size_t)max(1., ceil(p/100*values.size()));
+    nth_element(values.begin(), values.begin() + (rank - 1), values.end());
+    return values[rank - 1];
+}
 
-    bool save = false;
-    if(s.rectifiedPath != "0")
-    {
-        if( pathCheck(s.undistortedPath) )
-            save = true;
-        else
-            printf("\nRectified images could not be saved. Invalid path: %s\n", s.rectifiedPath.c_str());
-    }
+// Writes the p50, p95, p99 and max rows of a per frame measurement
+static void writeTailRows(ostream &out, const string &dataset, const string &stage, int width, int count,
+                          const vector<double> &values)
+{
+    writeBenchmarkRow(out, dataset, stage + " p50", width, 1, count, percentile(values, 50));
+    writeBenchmarkRow(out, dataset, stage + " p95", width, 1, count, percentile(values, 95));
+    writeBenchmarkRow(out, dataset, stage + " p99", width, 1, count, percentile(values, 99));
+    writeBenchmarkRow(out, dataset, stage + " max", width, 1, count, percentile(values, 100));
+}
 
-    namedWindow("Rectified", CV_WINDOW_AUTOSIZE);
-    for( int i = 0; i < s.nImages/2; i++ )
+// Times the detection of each image of an INTRINSIC or STEREO settings file, or of the image list given instead
+// (the corpus of pathological images, see createSyntheticScenes -stress), to report the tail of its latency.
+// Each image is detected alone on one thread, at native resolution, and its time is the fastest of the repeats.
+// The rows of the results (see writeBenchmarkRow) are the p50, p95, p99 and max of the detection latency and,
+// for ArUco, of MarkerDetector::detect and of the candidates and contours per frame (written as times, so
+// that the baseline comparison reports their growth), with the number of frames over the time budget. A row
+// per frame is written to frames: dataset, image, ms, detect ms, candidates, contours, points and whether its
+// search ran out of the budget. Returns 0 on success
+int stressBenchmarkWithSettings(const string inputSettingsFile, const string &imageList, int repeats, ostream &out,
+                                ostream &frames)
+{
+    Settings s;
+    string dataset;
+    vector<Mat> images;
+    if (!readBenchmarkImages(inputSettingsFile, s, dataset, images, imageList))
+        return -1;
+    bool aruco = s.calibrationPattern != Settings::CHESSBOARD;
+    MarkerDetector detector;
+    if (aruco)
+        setupArucoDetector(s, detector, 1);
+
+    vector<double> latency, detect, candidates, contours;
+    int overBudget = 0;
+    for (int i = 0; i < s.nImages; i++)
     {
-        for( int k = 0; k < 2; k++ )
+        double best = DBL_MAX;
+        int nPoints = 0;
+        MarkerDetector::Stats stats;
+        for (int r = 0; r < repeats; r++)
         {
-            Mat img = imread(s.imageList[i*2+k], 0), rimg, cimg;
-            if (img.cols>1280) resize(img, img, Size(), 0.5, 0.5);
-            remap(img, rimg, rmap[k][0], rmap[k][1], CV_INTER_LINEAR);
-
-            // If a valid path for rectified images has been provided, save them to this path
-            if (save)
+            imageFrame image;
+            image.img = images[i];
+            image.camera = -1;
+            intrinsicCalibration imgCal;
+            detector.resetStats();
+            int64 start = getTickCount();
+            if (aruco)
             {
-                view = "left";
-                if (k == 1) view = "right";
-                sprintf(imgSave, "%s%s_rectified_%d.jpg", s.rectifiedPath.c_str(), view, i);
-                imwrite(imgSave, rimg);
+                imgCal.imagePoints.resize(1);
+                imgCal.objectPoints.resize(1);
+                imgCal.pointKeys.resize(1);
+                arucoDetect(s, detector, image, imgCal, 0, NULL);
+            }
+            else
+                chessboardDetect(s, image, imgCal, NULL);
+            double ms = 1000.*(getTickCount() - start)/getTickFrequency();
+            if (ms < best)
+            {
+                best = ms;
+                nPoints = imgCal.imagePoints.empty() ? 0 : (int)imgCal.imagePoints[0].size();
+                if (aruco)
+                    stats = detector.getTotalStats();       // Of every detect call of the image
             }
-
-            cvtColor(rimg, cimg, COLOR_GRAY2BGR);
-            Mat canvasPart = canvas(Rect(w*k, 0, w, h));
-            resize(cimg, canvasPart, canvasPart.size(), 0, 0, CV_INTER_AREA);
-
-            Rect vroi(cvRound(sterCal.validRoi[k].x*sf), cvRound(sterCal.validRoi[k].y*sf),
-                      cvRound(sterCal.validRoi[k].width*sf), cvRound(sterCal.validRoi[k].height*sf));
-            rectangle(canvasPart, vroi, Scalar(0,0,255), 3, 8);
         }
-        for( int j = 0; j < canvas.rows; j += 16 )
-            line(canvas, Point(0, j), Point(canvas.cols, j), Scalar(0, 255, 0), 1, 8);
-
-        if (s.showRectified)
+        int nContours = 0;
+        for (int c:stats.contoursPerLevel)
+            nContours += c;
+        latency.push_back(best);
+        if (aruco)
         {
-            imshow("Rectified", canvas);
-            char c = (char)waitKey();
-            if( c == 27 || c == 'q' || c == 'Q' )
-                break;
+            detect.push_back(stats.totalTime);
+            candidates.push_back(stats.nCandidates);
+            contours.push_back(nContours);
+            overBudget += stats.overBudget > 0;
         }
+        char row[512];
+        snprintf(row, sizeof(row), "%s,%s,%.4f,%.4f,%d,%d,%d,%d\n", dataset.c_str(), s.imageList[i].c_str(), best,
+                 stats.totalTime, stats.nCandidates, nContours, nPoints, stats.overBudget > 0);
+        frames << row;
+    }
+
+    int width = images.empty() ? 0 : images[0].cols;
+    writeTailRows(out, dataset, benchmarkDetection(s), width, s.nImages, latency);
+    if (aruco)
+    {
+        writeTailRows(out, dataset, "MarkerDetector::detect", width, s.nImages, detect);
+        writeTailRows(out, dataset, "MarkerDetector candidates", width, s.nImages, candidates);
+        writeTailRows(out, dataset, "MarkerDetector contours", width, s.nImages, contours);
+        writeBenchmarkRow(out, dataset, "MarkerDetector over budget", width, 1, s.nImages, overBudget);
     }
-    destroyWindow("Rectified");
+    printf("\n%s: %d frames, detection p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms\n", dataset.c_str(),
+           s.nImages, percentile(latency, 50), percentile(latency, 95), percentile(latency, 99),
+           percentile(latency, 100));
+    return 0;
 }
 
-// Run intrinsic calibration, using the image and object points to calculate the
-// camera matrix and distortion coefficients
-bool runIntrinsicCalibration(Settings s, intrinsicCalibration &inCal)
+// A measurement of the scaling benchmark on a number of threads: the milliseconds of a run and the count of
+// images or views it processed. The detection and the calibration are timed as they elapse, and the stages of
+// the detector add up their time on every thread
+struct scalingPoint
 {
-    if (s.useIntrinsicInput)     //precalculated intrinsic have been inputted. Use these
-    {
-        inCal.cameraMatrix = s.intrinsicInput.cameraMatrix;
-        inCal.distCoeffs = s.intrinsicInput.distCoeffs;
-        calibrateCamera(inCal.objectPoints, inCal.imagePoints, s.imageSize,
-                        inCal.cameraMatrix, inCal.distCoeffs,
-                        inCal.rvecs, inCal.tvecs, s.flag | CV_CALIB_USE_INTRINSIC_GUESS);
+    int threads;
+    int count;
+    double ms;
+    bool elapsed;
 
-    } else {                //else, create empty matrices to be calculated
-        inCal.cameraMatrix = Mat::eye(3, 3, CV_64F);
-        inCal.distCoeffs = Mat::zeros(8, 1, CV_64F);
+    // Images or views per second
+    double throughput() const { return ms > 0 ? 1000.*count*(elapsed ? 1 : threads)/ms : 0; }
+};
 
-        calibrateCamera(inCal.objectPoints, inCal.imagePoints, s.imageSize,
-                        inCal.cameraMatrix, inCal.distCoeffs,
-                        inCal.rvecs, inCal.tvecs, s.flag);
+// Writes the rows of a measurement of the scaling benchmark on each number of threads, against the one on a
+// single thread: the throughput, the speedup (its ratio), the efficiency (speedup per thread) and the serial
+// fraction. On a fixed dataset (strong scaling), the serial fraction is the Karp-Flatt metric of the speedup.
+// On a dataset growing with the threads (weak scaling), the speedup is Gustafson's scaled speedup and the
+// serial fraction the part of the work that it does not scale
+static void writeScalingRows(ostream &out, const string &dataset, const char *scaling, const string &stage,
+                             int width, const vector<scalingPoint> &points)
+{
+    bool weak = !strcmp(scaling, "weak");
+    for (const scalingPoint &p:points)
+    {
+        double base = points[0].throughput(), speedup = base > 0 ? p.throughput()/base : 0;
+        int n = p.threads;
+        double serial = n < 2 || speedup <= 0 ? 0 : weak ? (n - speedup)/(n - 1) : (1/speedup - 1./n)/(1 - 1./n);
+        char row[320];
+        snprintf(row, sizeof(row), "%s,%s,%s,%d,%d,%d,%.4f,%.2f,%.3f,%.3f,%.4f\n", dataset.c_str(), scaling,
+                 stage.c_str(), width, n, p.count, p.ms, p.throughput(), speedup, speedup/n, serial);
+        out << row;
     }
-
-    // if( flag & CV_CALIB_FIX_ASPECT_RATIO )
-    //     inCal.cameraMatrix.at<double>(0,0) = aspectRatio;
-
-    bool ok = checkRange(inCal.cameraMatrix) && checkRange(inCal.distCoeffs);
-    inCal.totalAvgErr = computeReprojectionErrors(inCal);
-    return ok;
 }
 
-// Run stereo calibration, using the points and intrinsics of two viewpoints to determine
-// the rotation and translation between them
-stereoCalibration runStereoCalibration(Settings s, intrinsicCalibration &inCal, intrinsicCalibration &inCal2)
+// Prints the speedup curve of the detection and of the calibration
+static void printScalingCurve(const string &dataset, const char *scaling, const string &stage,
+                              const vector<scalingPoint> &points)
 {
-    stereoCalibration sterCal;
-    if (s.useIntrinsicInput)     //precalculated intrinsic have been inputted. Use these
+    printf("\n%s, %s scaling of %s:\n", dataset.c_str(), scaling, stage.c_str());
+    double base = points[0].throughput();
+    for (const scalingPoint &p:points)
     {
-        inCal.cameraMatrix = s.intrinsicInput.cameraMatrix;
-        inCal2.cameraMatrix = s.intrinsicInput.cameraMatrix;
-        inCal.distCoeffs = s.intrinsicInput.distCoeffs;
-        inCal2.distCoeffs = s.intrinsicInput.distCoeffs;
+        double speedup = base > 0 ? p.throughput()/base : 0;
+        printf("%4d threads %10.1f/s  speedup %5.2f  efficiency %3.0f%%  |%s\n", p.threads, p.throughput(), speedup,
+               100*speedup/p.threads, string(min(60, max(0, cvRound(speedup*4))), '#').c_str());
     }
+}
 
-    // Stereo calibration requires both images to have the same # of image and object points, but
-    // getSharedPoints limits the points lists to only those points shared between each image
-    if (s.calibrationPattern != Settings::CHESSBOARD)       //ArUco pattern
-        getSharedPoints(inCal, inCal2);
-
-    double err = stereoCalibrate(
-               inCal.objectPoints, inCal.imagePoints, inCal2.imagePoints,
-               inCal.cameraMatrix, inCal.distCoeffs,
-               inCal2.cameraMatrix, inCal2.distCoeffs,
-               s.imageSize, sterCal.R, sterCal.T, sterCal.E, sterCal.F, TermCriteria(CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, 1000, 1e-10), CV_CALIB_FIX_INTRINSIC);
-
-    printf("\nStereo reprojection error = %.4f\n", err);
-
-    // Rectify the images using these extrinsic results
-    stereoRectify(inCal.cameraMatrix, inCal.distCoeffs,
-                 inCal2.cameraMatrix, inCal2.distCoeffs,
-                 s.imageSize, sterCal.R, sterCal.T, sterCal.R1, sterCal.R2,
-                 sterCal.P1, sterCal.P2, sterCal.Q,
-                 CALIB_ZERO_DISPARITY, 1, s.imageSize,
-                 &sterCal.validRoi[0], &sterCal.validRoi[1]);
-
-    rectifyImages(s, inCal, inCal2, sterCal);
-    return sterCal;
+// Sets the threads of the calibration: those of its OpenMP loops and of the parallel loops of OpenCV
+static void setCalibrationThreads(int ompThreads, int cvThreads)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(ompThreads);
+#else
+    (void)ompThreads;
+#endif
+    cv::setNumThreads(cvThreads);
 }
 
-// Runs the appropriate calibration based on the mode and saves the results
-void runCalibrationAndSave(Settings s, intrinsicCalibration &inCal, intrinsicCalibration &inCal2)
+// Times the scaling of the detection and calibration of the images of an INTRINSIC or STEREO settings file on
+// each number of threads, at each width. With strong scaling, the dataset is the same on every number of
+// threads. With weak scaling, it is repeated as many times as there are threads (the images are shared, not
+// copied), so each thread has the same work. The detection rows add those of the ArUco detector stages, from
+// their timers, and the calibration is the intrinsic calibration of the views detected, run with the threads
+// of OpenMP and OpenCV set to the count. A single thread is always measured first, as the base of the speedup.
+// Writes a CSV row for each measurement (see writeScalingRows) and prints the speedup curves. Returns 0 on success
+int scalingBenchmarkWithSettings(const string inputSettingsFile, const vector<int> &widths,
+                                 const vector<int> &threads, int repeats, ostream &out)
 {
-    bool ok;
-    if (s.mode == Settings::STEREO) {         // stereo calibration
-        if (!s.useIntrinsicInput)
+    Settings s;
+    string dataset;
+    vector<Mat> images;
+    if (!readBenchmarkImages(inputSettingsFile, s, dataset, images))
+        return -1;
+    s.solveCachePath = "0";     // A cached solve would not be timed
+    bool aruco = s.calibrationPattern != Settings::CHESSBOARD;
+    vector<int> counts(1, 1);
+    for (int n:threads)
+        if (n > 1 && find(counts.begin(), counts.end(), n) == counts.end())
+            counts.push_back(n);
+    int ompThreads = omp_get_max_threads(), cvThreads = cv::getNumThreads();
+
+    static const char *stageNames[] = { "MarkerDetector::threshold", "MarkerDetector::rectangles",
+                                        "MarkerDetector::identify", "MarkerDetector::refine",
+                                        "MarkerDetector::filter", "MarkerDetector::detect" };
+    const char *scalings[] = { "strong", "weak" };
+    for (int width:widths)
+    {
+        vector<Mat> scaled = scaledBenchmarkImages(images, width);
+        int imageWidth = scaled[0].cols;
+        for (const char *scaling:scalings)
         {
-        ok = runIntrinsicCalibration(s, inCal);
-        printf("%s for left. Avg reprojection error = %.4f\n",
-                ok ? "\nIntrinsic calibration succeeded" : "\nIntrinsic calibration failed",
-                inCal.totalAvgErr);
-        ok = runIntrinsicCalibration(s, inCal2);
-        printf("%s for right. Avg reprojection error = %.4f\n",
-                ok ? "\nIntrinsic calibration succeeded" : "\nIntrinsic calibration failed",
-                inCal2.totalAvgErr);
-        } else
-            ok = true;
-
-        stereoCalibration sterCal = runStereoCalibration(s, inCal, inCal2);
-        s.saveExtrinsics(sterCal);
+            bool weak = !strcmp(scaling, "weak");
+            vector<scalingPoint> detection, calibration, stages[6];
+            for (int n:counts)
+            {
+                vector<Mat> work(weak ? n*scaled.size() : scaled.size());
+                for (size_t i = 0; i < work.size(); i++)
+                    work[i] = scaled[i % scaled.size()];
+                benchmarkPoints points;
+                MarkerDetector::Stats stats;
+                allocCounts allocs;
+                double ms = timeBenchmarkDetection(s, work, n, repeats, points, stats, allocs);
+                scalingPoint p = { n, (int)work.size(), ms*work.size(), true };
+                detection.push_back(p);
+                if (aruco && stats.nCalls > 0)
+                {
+                    double times[6] = { stats.thresholdTime, stats.rectanglesTime, stats.identifyTime,
+                                        stats.refineTime, stats.filterTime, stats.totalTime };
+                    for (int k = 0; k < 6; k++)
+                    {
+                        scalingPoint sp = { n, stats.nCalls, times[k], false };
+                        stages[k].push_back(sp);
+                    }
+                }
 
-    } else {                        // intrinsic calibration
-        ok = runIntrinsicCalibration(s, inCal);
-        printf("%s. Avg reprojection error = %.4f\n",
-                ok ? "\nIntrinsic calibration succeeded" : "\nIntrinsic calibration failed",
-                inCal.totalAvgErr);
+                intrinsicCalibration inCal, inCal2, cal;
+                benchmarkViews(s, points, inCal, inCal2);
+                if (inCal.imagePoints.size() < 2)
+                    continue;
+                s.imageSize = scaled[0].size();
+                setCalibrationThreads(n, n);
+                double calMs = timeBenchmarkCalibration(s, inCal, repeats, cal);
+                setCalibrationThreads(ompThreads, cvThreads);
+                scalingPoint cp = { n, (int)inCal.imagePoints.size(), calMs, true };
+                calibration.push_back(cp);
+            }
 
-        if( ok ) {
-            undistortImages(s, inCal);
-            s.saveIntrinsics(inCal);
+            writeScalingRows(out, dataset, scaling, benchmarkDetection(s), imageWidth, detection);
+            printScalingCurve(dataset, scaling, benchmarkDetection(s), detection);
+            for (int k = 0; k < 6; k++)
+                if (stages[k].size() == counts.size())
+                    writeScalingRows(out, dataset, scaling, stageNames[k], imageWidth, stages[k]);
+            const char *solve = s.solver == Settings::SPARSE_SOLVER ? "sparseCalibrateCamera" : "calibrateCamera";
+            if (calibration.size() == counts.size())
+            {
+                writeScalingRows(out, dataset, scaling, solve, imageWidth, calibration);
+                printScalingCurve(dataset, scaling, solve, calibration);
+            }
+            else
+                printf("\n%s: too few views detected at width %d to time the calibration\n", dataset.c_str(), imageWidth);
         }
     }
+    return 0;
 }
 
-// Undistorts the preview image if the setting has been toggled with the 'u' key
-static void undistortCheck(Settings s, Mat &img, bool &undistortPreview)
+// The header of an image of the list for a dry run: the format (the file extension, "container" or "remote"),
+// the size if the header tells it without decoding, and the bytes of the file
+struct imageHeader
+{
+    string format;
+    Size size;
+    int64 bytes = 0;
+    bool found = false;     // false if the file does not exist. Remote images are not looked up
+};
+
+// Reads the headers of the images of the list in parallel. Only the first bytes of each file are read
+static vector<imageHeader> scanImageHeaders(const Settings &s)
 {
-    if (undistortPreview)
+    vector<imageHeader> headers(s.imageList.size());
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < (int)headers.size(); i++)
     {
-        if (s.useIntrinsicInput)
+        imageHeader &h = headers[i];
+        const string &name = s.imageList[i];
+        if (s.container.isOpened())
         {
-            Mat temp = img.clone();
-            undistort(temp, img, s.intrinsicInput.cameraMatrix,
-                      s.intrinsicInput.distCoeffs);
-        } else {
-            cerr << "\nUndistorted preview requires intrinsic input.\n";
-            undistortPreview = !undistortPreview;
+            h.format = "container";
+            h.size = s.container.frameSize();
+            h.found = true;
+            continue;
+        }
+        if (objectFetcher::isUrl(name))
+        {
+            h.format = "remote";
+            continue;
         }
+        struct stat st;
+        if (stat(name.c_str(), &st) != 0)
+            continue;
+        h.found = true;
+        h.bytes = st.st_size;
+        size_t dot = name.rfind('.');
+        h.format = dot == string::npos ? "none" : name.substr(dot + 1);
+        for (auto &c:h.format) c = (char)tolower((unsigned char)c);
+        if (!jpegImageSize(name, h.size))
+            pngImageSize(name, h.size);
     }
+    return headers;
 }
 
-// Main function. Detects patterns on images, runs calibration and saves results
-int calibrateWithSettings( const string inputSettingsFile )
+// Estimates the run time and the peak memory of an INTRINSIC or STEREO job before it runs, and prints a plan
+// (calibrateWithSettings -dryrun). The headers of the images are read in parallel for their count, formats and
+// sizes, and about sampleSize images, whole views spread over the list, are decoded and detected with the
+// settings, on one thread and on every core, as batch detection does. The speedup gives the serial fraction of
+// the detection (the Karp-Flatt metric, see writeScalingRows), from which the detection of the whole list is
+// extrapolated on each number of threads with Amdahl's law, and the recommended count is the most threads that
+// keep half of their efficiency. The calibration of the views detected, and of half of them, gives the power of
+// the view count that its time grows with, which is extrapolated to the views the list should give. The peak
+// memory adds the memory of the process once the settings are read, the images in flight, the buffers of the
+// detectors (measured on the sample), the frame store, the saved image queue and the maps of the export.
+// Nothing is written. Returns 0 on success
+int estimateWithSettings(const string inputSettingsFile, int sampleSize)
 {
     Settings s;
-    FileStorage fs(inputSettingsFile, FileStorage::READ);   // Read the settings
-    if (!fs.isOpened())
-    {
-        cerr << "Could not open the settings file: \"" << inputSettingsFile << "\"" << endl;
+    if (!loadSettings(inputSettingsFile, s))
         return -1;
-    }
-    fs["Settings"] >> s;
-    fs.release();                                         // close Settings file
-
-    if (!s.goodInput)
+    if ((s.mode != Settings::INTRINSIC && s.mode != Settings::STEREO) || s.streamInput != "0" ||
+        s.correspondences.isOpened() || s.nImages == 0)
     {
-        cerr << "Invalid input detected. Application stopping. " << endl;
+        cerr << "The dry run needs the image list of an INTRINSIC or STEREO settings file: " << inputSettingsFile << endl;
         return -1;
     }
-
-    //struct to store calibration parameters
-    intrinsicCalibration inCal, inCal2;
-    intrinsicCalibration *currentInCal = &inCal;
-
-    int size = (s.mode == Settings::STEREO) ? s.nImages/2 : s.nImages;
-    //ArUco patterns require correctly sized vectors
-    if (s.calibrationPattern != Settings::CHESSBOARD) {
-        inCal.imagePoints.resize(size);
-        inCal.objectPoints.resize(size);
-        inCal2.imagePoints.resize(size);
-        inCal2.objectPoints.resize(size);
+    s.solveCachePath = "0";     // A cached solve would not be timed
+    const double MB = 1048576.;
+    double baseMB = runReport::peakRssMB();
+    int cores = max(1, omp_get_max_threads());
+    int perView = s.mode == Settings::STEREO ? 2 : 1, nViews = s.nImages/perView;
+
+    // The headers of the whole list
+    int64 start = getTickCount();
+    vector<imageHeader> headers = scanImageHeaders(s);
+    map<string, int> formats;
+    map<pair<int, int>, int> sizes;
+    int missing = 0, unsized = 0;
+    int64 fileBytes = 0;
+    for (auto &h:headers)
+    {
+        if (!h.found && h.format != "remote")
+        {
+            missing++;
+            continue;
+        }
+        formats[h.format]++;
+        fileBytes += h.bytes;
+        if (h.size.area() > 0) sizes[make_pair(h.size.width, h.size.height)]++;
+        else unsized++;
     }
-    int vectorIndex = -1;
-    bool undistortPreview = false;
-
-    char imgSave[1000];
-    bool save = false;
-    if(s.detectedPath != "0" && s.mode != Settings::PREVIEW)
+    printf("\nDry run of %s: %d images (%d views), %.1f MB of files, headers read in %.0f ms\n",
+           inputSettingsFile.c_str(), s.nImages, nViews, fileBytes/MB, runReport::elapsedMs(start));
+    printf("Formats:");
+    for (auto &f:formats)
+        printf(" %s %d", f.first.c_str(), f.second);
+    printf("\nSizes:");
+    for (auto &z:sizes)
+        printf(" %dx%d %d", z.first.first, z.first.second, z.second);
+    if (unsized > 0)
+        printf(" unknown until decoded %d", unsized);
+    printf("\n");
+    if (missing > 0)
     {
-        if( pathCheck(s.detectedPath) )
-            save = true;
-        else
-            printf("\nDetected images could not be saved. Invalid path: %s\n", s.detectedPath.c_str());
+        cerr << missing << " images of the list do not exist" << endl;
+        return -1;
     }
 
-    namedWindow("Detected", CV_WINDOW_AUTOSIZE);
-    // For each image in the image list
-    for(int i = 0;;i++)
+    // The sample, decoded as the detection reads the images
+    bool save = s.detectedPath != "0";
+    int readFlags = save || frameStoreFlags(s) == CV_LOAD_IMAGE_COLOR ? CV_LOAD_IMAGE_COLOR : CV_LOAD_IMAGE_GRAYSCALE;
+    int sampleViews = max(2, min(nViews, sampleSize/perView));
+    vector<Mat> sample;
+    double decodeMs = 0;
+    for (int k = 0; k < sampleViews; k++)
     {
-        // Switches between intrinsic calibration structs for stereo mode
-        if (i%2 == 0) {
-            currentInCal = &inCal;
-            vectorIndex++;
-        } else if (s.mode == Settings::STEREO)
-            currentInCal = &inCal2;
-        else
-            vectorIndex++;
-
-        // Set up the image
-        Mat img = s.imageSetup(i);
-
-        // If there is no data, the photos have run out
-        if(!img.data)
+        int v = (int)((int64)k*nViews/sampleViews);
+        for (int j = 0; j < perView; j++)
         {
-            if((int)inCal.imagePoints.size() > 0) {
-                destroyWindow("Detected");
-                runCalibrationAndSave(s, inCal, inCal2);
+            int64 decodeStart = getTickCount();
+            sample.push_back(s.readListImage(v*perView + j, readFlags));
+            decodeMs += runReport::elapsedMs(decodeStart);
+            if (!sample.back().data)
+            {
+                cerr << "Could not read image: " << s.imageList[v*perView + j] << endl;
+                return -1;
             }
-            break;
         }
-        s.imageSize = img.size();
-
-        //Detect the pattern in the image, adding data to the imagePoints
-        //and objectPoints calibration parameters
-        if(s.calibrationPattern == Settings::CHESSBOARD)
-            chessboardDetect(s, img, *currentInCal);
-        else
-            arucoDetect(s, img, *currentInCal, vectorIndex);
-
-        if (s.mode == Settings::PREVIEW)    // Check if the preview should be undistorted
-            undistortCheck(s, img, undistortPreview);
-
-        // If a valid path for detected images has been provided, save them to this path
-        if(save)
+    }
+    decodeMs /= sample.size();
+    Size imageSize = sample[0].size();
+    double imageMB = sample[0].total()*sample[0].elemSize()/MB;
+    double decodedMB = runReport::peakRssMB();
+
+    // The detection of the sample on one thread and on every core
+    benchmarkPoints points;
+    MarkerDetector::Stats stats;
+    allocCounts allocs;
+    double detectMs = timeBenchmarkDetection(s, sample, 1, 1, points, stats, allocs);
+    double serial = 1;
+    if (cores > 1)
+    {
+        double parallelMs = timeBenchmarkDetection(s, sample, cores, 1, points, stats, allocs);
+        double speedup = parallelMs > 0 ? detectMs/parallelMs : 1;
+        serial = min(1., max(0., (1/speedup - 1./cores)/(1 - 1./cores)));
+    }
+    double detectorMB = max(0., runReport::peakRssMB() - decodedMB)/cores;
+    auto speedup = [&](int n) { return 1/(serial + (1 - serial)/n); };
+    int threads = serial > 0 ? max(1, (int)min((double)cores, (1 + serial)/serial)) : cores;
+    printf("\nSample of %d images at %dx%d: decode %.1f ms, detection %.1f ms per image on one thread, "
+           "serial fraction %.3f\n", (int)sample.size(), imageSize.width, imageSize.height, decodeMs, detectMs, serial);
+
+    int nPoints = 0;
+    for (auto &p:points.imagePoints)
+        nPoints += (int)p.size();
+    intrinsicCalibration inCal, inCal2;
+    benchmarkViews(s, points, inCal, inCal2);
+    int sampleDetected = (int)inCal.imagePoints.size();
+    int expectedViews = (int)((int64)nViews*sampleDetected/sampleViews);
+    if (s.keyframeViews > 0)
+        expectedViews = min(expectedViews, s.keyframeViews);
+    printf("Views detected in the sample: %d of %d, about %d views to calibrate\n", sampleDetected, sampleViews,
+           expectedViews);
+
+    // The detection of the whole list on the configured threads, and on the recommended ones
+    double imageMs = decodeMs + detectMs;
+    int configured = s.batchThreads > 0 ? s.batchThreads : 1;
+    printf("\nDetection: %.1f s on %d thread%s", s.nImages*imageMs/speedup(configured)/1000, configured,
+           configured > 1 ? "s" : "");
+    if (s.batchThreads <= 0)
+        printf(" (BatchDetection_Threads is 0: one image at a time, an upper bound)");
+    printf(", %.1f s on %d threads\n", s.nImages*imageMs/speedup(threads)/1000, threads);
+
+    // The calibration of the views of the sample, and of half of them, gives the growth of its time
+    double solveMs = 0;
+    if (sampleDetected >= 4)
+    {
+        s.imageSize = imageSize;
+        intrinsicCalibration cal, half, halfViews;
+        double fullMs = timeBenchmarkCalibration(s, inCal, 1, cal);
+        int nHalf = sampleDetected/2;
+        halfViews.imagePoints.assign(inCal.imagePoints.begin(), inCal.imagePoints.begin() + nHalf);
+        halfViews.objectPoints.assign(inCal.objectPoints.begin(), inCal.objectPoints.begin() + nHalf);
+        if (!inCal.pointKeys.empty())
+            halfViews.pointKeys.assign(inCal.pointKeys.begin(), inCal.pointKeys.begin() + nHalf);
+        if (!inCal.imageIndex.empty())
+            halfViews.imageIndex.assign(inCal.imageIndex.begin(), inCal.imageIndex.begin() + nHalf);
+        double halfMs = timeBenchmarkCalibration(s, halfViews, 1, half);
+        double power = halfMs > 0 && fullMs > halfMs ? log(fullMs/halfMs)/log((double)sampleDetected/nHalf) : 1;
+        power = min(3., max(1., power));
+        double growth = pow(max(1., (double)expectedViews/sampleDetected), power);
+        solveMs = fullMs*growth*perView;
+        if (s.mode == Settings::STEREO)
         {
-            sprintf(imgSave, "%sdetected_%d.jpg", s.detectedPath.c_str(), i);
-            imwrite(imgSave, img);
+            intrinsicCalibration cal2 = inCal2;
+            runIntrinsicCalibration(s, cal2);
+            stereoCalibration sterCal;
+            int64 stereoStart = getTickCount();
+            runFixedIntrinsicStereoCalibration(s, cal, cal2, sterCal);
+            solveMs += runReport::elapsedMs(stereoStart)*growth;
         }
-
-        imshow("Detected", img);
-
-        // If wait setting is true, wait till next key press (waitkey(0)). Otherwise, wait 50 ms
-        char c = (char)waitKey(s.wait ? 0: 50);
-
-        if (c == 'u')
-            undistortPreview = !undistortPreview;
-        if (c == 'c' && s.mode == Settings::PREVIEW)
-            s.showArucoCoords = !s.showArucoCoords;
-        else if( (c & 255) == 27 || c == 'q' || c == 'Q' )
-            break;
+        printf("Calibration: %.1f s (%.0f ms for %d views of the sample, time growing with the views to the power %.2f)\n",
+               solveMs/1000, fullMs, sampleDetected, power);
+    }
+    else
+        printf("Calibration: too few views detected in the sample to time it\n");
+
+    // The peak memory: the detection and the export run one after the other, while the frame store and the
+    // points are kept throughout
+    bool exporting = frameStoreFlags(s) >= 0;
+    double datasetMB = s.nImages*imageMB;
+    double storeMB = exporting && s.frameStoreMB > 0 ? min((double)s.frameStoreMB, datasetMB) : 0;
+    double pointsMB = nPoints > 0 ? (double)s.nImages*nPoints/sample.size()*(sizeof(Point2f) + sizeof(Point3f) + sizeof(int))/MB : 0;
+    double queuedMB = s.batchThreads > 0 ? s.prefetchDepth*imageMB : 0;
+    if (s.queueMB > 0)
+        queuedMB = min(queuedMB, (double)s.queueMB);
+    int detectThreads = s.batchThreads > 0 ? s.batchThreads : 1;
+    double detectionMB = detectThreads*(imageMB + detectorMB) + queuedMB + (save ? s.saveQueueDepth*imageMB : 0);
+    double exportMB = 0;
+    if (exporting)
+    {
+        int exportThreads = s.exportThreads > 0 ? s.exportThreads : s.batchThreads > 0 ? s.batchThreads : cores;
+        bool fullMaps = s.mapGridStep == 0 && s.rectifyBandRows == 0;
+        exportMB = perView*(fullMaps ? imageSize.area()*6/MB : 0) + exportThreads*2*imageMB + s.saveQueueDepth*imageMB;
     }
-    destroyWindow("Detected");
+    double peakMB = baseMB + storeMB + pointsMB + max(detectionMB, exportMB);
+    double physicalMB = (double)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE)/MB;
+    printf("\nPeak memory: %.0f MB of %.0f MB (process %.0f, detection %.0f, export %.0f, frame store %.0f, points %.0f)\n",
+           peakMB, physicalMB, baseMB, detectionMB, exportMB, storeMB, pointsMB);
+
+    // The plan
+    printf("\nPlan:\n");
+    printf("  BatchDetection_Threads: %d (%.0f%% efficiency, %d configured)\n", threads, 100*speedup(threads)/threads,
+           s.batchThreads);
+    printf("  Total: about %.1f s\n", (s.nImages*imageMs/speedup(threads) + solveMs)/1000);
+    bool stream = exporting && datasetMB > 0.5*physicalMB;
+    if (stream)
+        printf("  Streaming: needed. The decoded images take %.0f MB, so the export should read them again from the "
+               "files: FrameStore_MaxMemory at most %.0f\n", datasetMB, 0.25*physicalMB);
+    else if (exporting)
+        printf("  Streaming: not needed. FrameStore_MaxMemory %.0f keeps every decoded image for the export\n",
+               ceil(datasetMB));
+    else
+        printf("  Streaming: not needed. The images are only read once\n");
+    if (peakMB > 0.75*physicalMB)
+    {
+        printf("  Low memory: needed. The peak is over 75%% of the memory, try:\n");
+        if (s.batchThreads > 0 && s.queueMB == 0)
+            printf("    Queue_MaxMemory to bound the images decoded ahead (%.0f MB)\n", queuedMB);
+        if (storeMB > 0)
+            printf("    FrameStore_MaxMemory below %.0f\n", storeMB);
+        if (exporting && s.mapGridStep == 0 && s.rectifyBandRows == 0)
+            printf("    Map_GridStep 8 or Rectify_BandRows, instead of the full maps (%.0f MB)\n",
+                   perView*imageSize.area()*6/MB);
+        if (s.maxImageWidth <= 0 && imageSize.width > 1280)
+            printf("    Image_MaxWidth 1280, to halve the images\n");
+        if (threads > 1)
+            printf("    Fewer threads: each holds %.0f MB\n", imageMB + detectorMB);
+    }
+    else
+        printf("  Low memory: not needed\n");
     return 0;
 }
@@ -5,7 +5,11 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/calib3d/calib3d.hpp"
+#if CV_MAJOR_VERSION >= 3
+#include "opencv2/videoio.hpp"       // No HighGUI, so the headless targets build without it (see display.h)
+#else
 #include "opencv2/highgui/highgui.hpp"
+#endif
 
 #include <iostream>
 #include <fstream>
@@ -21,6 +25,15 @@ using namespace cv;
 using namespace aruco;
 
 int calibrateWithSettings( const string inputSettingsFile );
+int serveCalibrations( const string socketPath );
+int calibrateManifest( const string manifestFile, int concurrentJobs );
+int benchmarkWithSettings( const string inputSettingsFile, const vector<int> &widths, const vector<int> &threads,
+                           int repeats, ostream &out );
+int stressBenchmarkWithSettings( const string inputSettingsFile, const string &imageList, int repeats, ostream &out,
+                                 ostream &frames );
+int scalingBenchmarkWithSettings( const string inputSettingsFile, const vector<int> &widths,
+                                  const vector<int> &threads, int repeats, ostream &out );
+int estimateWithSettings( const string inputSettingsFile, int sampleSize );
 
 
 struct intrinsicCalibration {
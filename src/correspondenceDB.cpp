@@ -0,0 +1,357 @@
+/*
+Correspondence database of the detections of many calibration runs. See correspondenceDB.h
+*/
+
+#include "correspondenceDB.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+const int maxPoints = 1 << 24;
+
+uint64_t checksum(const unsigned char *data, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ data[i]) * 1099511628211ULL;
+    return h;
+}
+
+void appendBytes(vector<char> &buf, const void *data, size_t n)
+{
+    buf.insert(buf.end(), (const char *)data, (const char *)data + n);
+}
+
+// Pads a record to 8 bytes, sets its size and appends its checksum
+void finishRecord(vector<char> &buf)
+{
+    buf.resize((buf.size() + 7) & ~(size_t)7, 0);
+    int32_t bytes = (int32_t)(buf.size() + sizeof(uint64_t));
+    memcpy(&buf[offsetof(correspondenceDBRecord, bytes)], &bytes, sizeof(bytes));
+    uint64_t sum = checksum((const unsigned char *)&buf[0], buf.size());
+    appendBytes(buf, &sum, sizeof(sum));
+}
+
+// Keys are stored as the zigzag varint of their difference to the previous key, so the consecutive corners of
+// a marker take a byte each
+void putKey(vector<char> &buf, int key, int &previous)
+{
+    int64_t d = (int64_t)key - previous;
+    uint64_t z = d < 0 ? ((uint64_t)(-(d + 1)) << 1) | 1 : (uint64_t)d << 1;
+    while (z >= 0x80)
+    {
+        buf.push_back((char)(z | 0x80));
+        z >>= 7;
+    }
+    buf.push_back((char)z);
+    previous = key;
+}
+
+bool getKey(const unsigned char *&p, const unsigned char *end, int &key)
+{
+    uint64_t z = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char b = *p++;
+        z |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            int64_t d = (z & 1) ? -(int64_t)(z >> 1) - 1 : (int64_t)(z >> 1);
+            key = (int)(key + d);
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+bool correspondenceDB::open(const string &filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(correspondenceDBHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    length = (size_t)st.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);        // The mapping keeps the file open
+    if (data == MAP_FAILED)
+        return false;
+    size_t n = length;
+    shared_ptr<unsigned char> map((unsigned char *)data, [n](unsigned char *p) { munmap(p, n); });
+
+    correspondenceDBHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "CCDB", 4) != 0 || header.version < 1 || header.version > correspondenceDBVersion)
+        return false;
+
+    // The records are checked in order, and the first one that is incomplete or does not match its checksum
+    // ends the file. Records of an unknown kind are skipped
+    const unsigned char *base = (const unsigned char *)data;
+    size_t pos = sizeof(header);
+    while (pos + sizeof(correspondenceDBRecord) <= length)
+    {
+        correspondenceDBRecord r;
+        memcpy(&r, base + pos, sizeof(r));
+        if (r.bytes < (int32_t)(sizeof(r) + sizeof(uint64_t)) || r.bytes % 8 != 0 || pos + r.bytes > length)
+            break;
+        uint64_t sum;
+        memcpy(&sum, base + pos + r.bytes - sizeof(sum), sizeof(sum));
+        if (checksum(base + pos, r.bytes - sizeof(sum)) != sum)
+            break;
+        const unsigned char *p = base + pos + sizeof(r), *end = base + pos + r.bytes - sizeof(sum);
+        if (r.kind == PATTERN)
+        {
+            correspondenceDBPattern pat;
+            if (p + sizeof(pat) > end)
+                break;
+            memcpy(&pat, p, sizeof(pat));
+            p += sizeof(pat);
+            if (pat.nPoints < 0 || pat.nPoints > maxPoints
+                    || p + pat.nPoints*(sizeof(int32_t) + sizeof(cv::Point3f)) > end)
+                break;
+            std::map<int, cv::Point3f> &objects = patterns[(int64_t)pos];
+            const unsigned char *objectData = p + pat.nPoints*sizeof(int32_t);
+            for (int i = 0; i < pat.nPoints; i++)
+            {
+                int32_t key;
+                cv::Point3f object;
+                memcpy(&key, p + i*sizeof(key), sizeof(key));
+                memcpy(&object, objectData + i*sizeof(object), sizeof(object));
+                objects[key] = object;
+            }
+        }
+        else if (r.kind == IMAGE)
+        {
+            correspondenceDBImage im;
+            if (p + sizeof(im) > end)
+                break;
+            memcpy(&im, p, sizeof(im));
+            p += sizeof(im);
+            if (im.nPoints < 0 || im.nPoints > maxPoints || im.cameraBytes < 0 || im.nameBytes < 0 || im.keyBytes < 0
+                    || p + (int64_t)im.cameraBytes + im.nameBytes + im.keyBytes + im.nPoints*sizeof(cv::Point2f) > end
+                    || (im.nPoints > 0 && !patterns.count(im.pattern)))
+                break;
+            entry e;
+            e.camera.assign((const char *)p, im.cameraBytes);
+            e.name.assign((const char *)p + im.cameraBytes, im.nameBytes);
+            e.session = im.session;
+            e.view = im.view;
+            e.index = im.camera;
+            e.nCameras = im.nCameras;
+            e.size = cv::Size(im.width, im.height);
+            e.detector = im.detector;
+            e.nPoints = im.nPoints;
+            e.offset = (int64_t)pos;
+            images.push_back(e);
+        }
+        pos += r.bytes;
+    }
+    valid = (int64_t)pos;
+    mapping = map;
+    return true;
+}
+
+bool correspondenceDB::points(const entry &e, vector<cv::Point2f> &imagePoints, vector<cv::Point3f> &objectPoints,
+                              vector<int> &pointKeys) const
+{
+    imagePoints.clear();
+    objectPoints.clear();
+    pointKeys.clear();
+    if (!isOpened() || e.offset < 0 || e.offset >= (int64_t)length)
+        return false;
+    const unsigned char *p = mapping.get() + e.offset + sizeof(correspondenceDBRecord);
+    correspondenceDBImage im;
+    memcpy(&im, p, sizeof(im));
+    if (im.nPoints == 0)
+        return true;
+    auto pattern = patterns.find(im.pattern);
+    if (pattern == patterns.end())
+        return false;
+    p += sizeof(im) + im.cameraBytes + im.nameBytes;
+    const unsigned char *keyEnd = p + im.keyBytes;
+
+    imagePoints.resize(im.nPoints);
+    objectPoints.resize(im.nPoints);
+    pointKeys.resize(im.nPoints);
+    int key = 0;
+    for (int i = 0; i < im.nPoints; i++)
+    {
+        if (!getKey(p, keyEnd, key))
+            return false;
+        auto object = pattern->second.find(key);
+        if (object == pattern->second.end())
+            return false;
+        pointKeys[i] = key;
+        objectPoints[i] = object->second;
+    }
+    memcpy(&imagePoints[0], keyEnd, im.nPoints*sizeof(cv::Point2f));
+    if (im.flags & INDEX_KEYS)
+        pointKeys.clear();
+    return true;
+}
+
+string correspondenceDB::sessionTime(int64_t session)
+{
+    time_t t = (time_t)session;
+    struct tm local;
+    char buf[32];
+    localtime_r(&t, &local);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+    return buf;
+}
+
+bool correspondenceDBWriter::open(const string &filename, int64_t session)
+{
+    close();
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    // A new file gets its header, an existing one must be a database. The records appended after an incomplete
+    // one could not be read, so it is cut off
+    flock(fd, LOCK_EX);
+    bool ok;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size == 0)
+    {
+        correspondenceDBHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "CCDB", 4);
+        header.version = correspondenceDBVersion;
+        ok = ::write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+    }
+    else
+    {
+        correspondenceDB db;
+        ok = db.open(filename) && (db.validBytes() == (int64_t)size || ftruncate(fd, (off_t)db.validBytes()) == 0);
+    }
+    flock(fd, LOCK_UN);
+    if (!ok)
+    {
+        close();
+        return false;
+    }
+    this->session = session;
+    pattern = -1;
+    objects.clear();
+    return true;
+}
+
+bool correspondenceDBWriter::write(const vector<char> &buf, int64_t &offset)
+{
+    // The lock keeps the records of other runs out of this one, and gives its position in the file
+    flock(fd, LOCK_EX);
+    offset = (int64_t)lseek(fd, 0, SEEK_END);
+    bool ok = offset >= 0 && ::write(fd, &buf[0], buf.size()) == (ssize_t)buf.size();
+    flock(fd, LOCK_UN);
+    return ok;
+}
+
+bool correspondenceDBWriter::append(const string &camera, int view, int index, int nCameras, cv::Size size,
+                                    unsigned long long detector, const string &name,
+                                    const vector<cv::Point2f> &imagePoints, const vector<cv::Point3f> &objectPoints,
+                                    const vector<int> &pointKeys)
+{
+    int n = (int)imagePoints.size();
+    if (fd < 0 || objectPoints.size() != imagePoints.size() || (!pointKeys.empty() && (int)pointKeys.size() != n))
+        return false;
+    vector<int> keys(pointKeys);
+    if (keys.empty())
+        for (int i = 0; i < n; i++) keys.push_back(i);
+
+    // The object points are looked up in the last pattern. A view with new keys extends it, and one whose
+    // object points differ for the same keys starts a new one
+    bool found = pattern >= 0, same = true;
+    for (int i = 0; i < n && same; i++)
+    {
+        auto it = objects.find(keys[i]);
+        if (it == objects.end())
+            found = false;
+        else if (it->second != objectPoints[i])
+            same = found = false;
+    }
+    if (n > 0 && !found)
+    {
+        if (!same)
+            objects.clear();
+        for (int i = 0; i < n; i++) objects[keys[i]] = objectPoints[i];
+        vector<char> buf(sizeof(correspondenceDBRecord), 0);
+        correspondenceDBRecord r = { correspondenceDB::PATTERN, 0 };
+        memcpy(&buf[0], &r, sizeof(r));
+        correspondenceDBPattern pat = { (int32_t)objects.size(), 0 };
+        appendBytes(buf, &pat, sizeof(pat));
+        for (auto &o:objects)
+        {
+            int32_t key = o.first;
+            appendBytes(buf, &key, sizeof(key));
+        }
+        for (auto &o:objects) appendBytes(buf, &o.second, sizeof(o.second));
+        finishRecord(buf);
+        if (!write(buf, pattern))
+        {
+            close();
+            return false;
+        }
+    }
+
+    correspondenceDBImage im;
+    memset(&im, 0, sizeof(im));
+    im.session = session;
+    im.pattern = pattern;
+    im.detector = detector;
+    im.view = view;
+    im.camera = index;
+    im.nCameras = nCameras;
+    im.width = size.width;
+    im.height = size.height;
+    im.nPoints = n;
+    im.cameraBytes = (int32_t)camera.size();
+    im.nameBytes = (int32_t)name.size();
+    im.flags = pointKeys.empty() ? correspondenceDB::INDEX_KEYS : 0;
+    vector<char> keyBytes;
+    int previous = 0;
+    for (int k:keys) putKey(keyBytes, k, previous);
+    im.keyBytes = (int32_t)keyBytes.size();
+
+    vector<char> buf(sizeof(correspondenceDBRecord), 0);
+    correspondenceDBRecord r = { correspondenceDB::IMAGE, 0 };
+    memcpy(&buf[0], &r, sizeof(r));
+    appendBytes(buf, &im, sizeof(im));
+    appendBytes(buf, camera.data(), camera.size());
+    appendBytes(buf, name.data(), name.size());
+    appendBytes(buf, keyBytes.data(), keyBytes.size());
+    appendBytes(buf, imagePoints.data(), n*sizeof(cv::Point2f));
+    finishRecord(buf);
+    int64_t offset;
+    if (!write(buf, offset))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void correspondenceDBWriter::close()
+{
+    if (fd < 0)
+        return;
+    fsync(fd);
+    ::close(fd);
+    fd = -1;
+}
@@ -0,0 +1,141 @@
+/*
+Correspondence database of the detections of many calibration runs.
+
+The points detected on the images of a run are usually gone once it is calibrated. A correspondence database
+keeps them, so that the calibration of a camera can be solved again over any slice of its history without
+decoding and detecting the images again (see CorrespondenceDB_File). The file is append only: each run appends
+the records of its images, indexed by camera, session and view, and the file is memory mapped read only to be
+read back. A record that was not completely written, by a run that was interrupted, ends the valid part of the file.
+
+Each image record holds its camera name, session (the start time of the run), the index of the view and of the
+image in the view, the image name and size, the hash of the detection settings it was detected with (the detector
+version, see detectionConfigHash), and its points. The points are compressed: a record holds the image points and
+the keys of its points (the ArUco marker and corner, see arucoPointKey, or the corner index of a chessboard), delta
+coded, while their object points are looked up by key in a pattern record, which is only written again when a view
+has a key that is not in the last one. Values are stored in native byte order.
+*/
+
+#ifndef _correspondenceDB_H
+#define _correspondenceDB_H
+
+#include "opencv2/core/core.hpp"
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+const int correspondenceDBVersion = 1;
+
+struct correspondenceDBHeader {
+    char magic[4];          // "CCDB"
+    int32_t version;        // correspondenceDBVersion
+};
+
+// Every record starts with its kind and size, and ends with the checksum of the bytes before it
+struct correspondenceDBRecord {
+    int32_t kind;           // correspondenceDB::PATTERN or correspondenceDB::IMAGE
+    int32_t bytes;          // Size of the record, checksum included, a multiple of 8
+};
+
+// A pattern record is followed by the keys and object points of the pattern
+struct correspondenceDBPattern {
+    int32_t nPoints;
+    int32_t reserved;
+};
+
+// An image record is followed by the camera name, the image name, the delta coded keys and the image points
+struct correspondenceDBImage {
+    int64_t session;        // Start time of the run, in seconds since the epoch
+    int64_t pattern;        // Position of the pattern record of its object points
+    uint64_t detector;      // Hash of the detection settings
+    int32_t view;           // Index of the view in the run
+    int32_t camera;         // Index of the image in the view (the camera of a stereo pair or rig)
+    int32_t nCameras;       // Images per view in the run
+    int32_t width, height;  // Image size, 0 if it could not be read
+    int32_t nPoints;
+    int32_t cameraBytes, nameBytes, keyBytes;
+    int32_t flags;          // correspondenceDB::INDEX_KEYS if the caller gave no keys
+};
+
+// The image records of a database file. Copies share the same mapping, which is released with the last one
+class correspondenceDB
+{
+public:
+    enum Kind { PATTERN = 1, IMAGE = 2 };
+    enum Flags { INDEX_KEYS = 1 };
+
+    // An image record of the file
+    struct entry {
+        std::string camera;
+        int64_t session;
+        int view, index, nCameras;
+        cv::Size size;
+        unsigned long long detector;
+        std::string name;
+        int nPoints;
+        int64_t offset;     // Position of the record
+    };
+
+    correspondenceDB() : length(0), valid(0) {}
+
+    // Maps a database file, and indexes its complete records. Returns false if the file is not a database
+    bool open(const std::string &filename);
+    void close() { mapping.reset(); images.clear(); patterns.clear(); }
+    bool isOpened() const { return (bool)mapping; }
+
+    // The image records, in the order they were appended
+    const std::vector<entry> &entries() const { return images; }
+
+    // Size of the file up to the end of its last complete record
+    int64_t validBytes() const { return valid; }
+
+    // Decodes the points of an entry. Safe to call from any thread
+    bool points(const entry &e, std::vector<cv::Point2f> &imagePoints, std::vector<cv::Point3f> &objectPoints,
+                std::vector<int> &pointKeys) const;
+
+    // The session of a record as local time, "YYYY-MM-DD HH:MM:SS"
+    static std::string sessionTime(int64_t session);
+
+private:
+    std::shared_ptr<unsigned char> mapping;
+    size_t length;
+    int64_t valid;
+    std::vector<entry> images;
+    std::map<int64_t, std::map<int, cv::Point3f> > patterns;   // Object points of each pattern record, by key
+};
+
+// Appends the image records of a run to a database file, which is created if needed. Not thread safe
+class correspondenceDBWriter
+{
+public:
+    correspondenceDBWriter() : fd(-1), session(0), pattern(-1) {}
+    ~correspondenceDBWriter() { close(); }
+
+    // Opens the file for the records of a session, dropping a record that an interrupted run did not complete.
+    // Returns false if it can not be written, or if it is not a database
+    bool open(const std::string &filename, int64_t session);
+    bool isOpened() const { return fd >= 0; }
+
+    // Appends the record of an image. pointKeys may be empty if the object points are the same in every view,
+    // as with a chessboard, and are then keyed by their index. Each record is written at once, so that runs
+    // appending to the same file at the same time do not mix their records
+    bool append(const std::string &camera, int view, int index, int nCameras, cv::Size size,
+                unsigned long long detector, const std::string &name, const std::vector<cv::Point2f> &imagePoints,
+                const std::vector<cv::Point3f> &objectPoints, const std::vector<int> &pointKeys);
+
+    void close();
+
+private:
+    correspondenceDBWriter(const correspondenceDBWriter &);
+    correspondenceDBWriter &operator=(const correspondenceDBWriter &);
+
+    bool write(const std::vector<char> &buf, int64_t &offset);
+
+    int fd;
+    int64_t session;
+    int64_t pattern;                        // Position of the last pattern record of the run, -1 before the first
+    std::map<int, cv::Point3f> objects;     // Object points of the last pattern, by key
+};
+
+#endif
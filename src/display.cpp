@@ -0,0 +1,64 @@
+#include "display.h"
+#ifndef WITHOUT_HIGHGUI
+#include "opencv2/highgui/highgui.hpp"
+#endif
+
+using namespace std;
+using namespace cv;
+
+namespace display {
+
+#ifndef WITHOUT_HIGHGUI
+
+bool available()
+{
+    return true;
+}
+
+void open(const string &window)
+{
+    namedWindow(window, CV_WINDOW_AUTOSIZE);
+}
+
+void show(const string &window, const Mat &img)
+{
+    imshow(window, img);
+}
+
+int waitKey(int delayMs)
+{
+    return cv::waitKey(delayMs);
+}
+
+void close(const string &window)
+{
+    destroyWindow(window);
+}
+
+#else
+
+bool available()
+{
+    return false;
+}
+
+void open(const string &)
+{
+}
+
+void show(const string &, const Mat &)
+{
+}
+
+int waitKey(int)
+{
+    return -1;
+}
+
+void close(const string &)
+{
+}
+
+#endif
+
+}
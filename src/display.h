@@ -0,0 +1,35 @@
+/*
+Windows of the calibration: the detected, undistorted and rectified images and the live previews.
+
+The calibration shows images and reads keys only through these functions, so the detection, the solve and the
+batch and server modes can be built without HighGUI. With WITHOUT_HIGHGUI defined (the headless targets of the
+Makefile), nothing is shown: available() is false, the settings are then always headless, and PREVIEW mode is
+rejected. The image files and the cameras are read with imgcodecs and videoio, which OpenCV 3 and later have
+apart from HighGUI.
+*/
+
+#ifndef _display_H
+#define _display_H
+
+#include "opencv2/core/core.hpp"
+#include <string>
+
+namespace display {
+
+// Whether windows can be shown (built with HighGUI)
+bool available();
+
+// Opens a window sized to its images
+void open(const std::string &window);
+
+void show(const std::string &window, const cv::Mat &img);
+
+// Waits for a key for delayMs, or until one is pressed with 0, and handles the window events meanwhile.
+// Returns -1 when no key was pressed
+int waitKey(int delayMs = 0);
+
+void close(const std::string &window);
+
+}
+
+#endif
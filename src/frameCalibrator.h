@@ -0,0 +1,56 @@
+#ifndef _frameCalibrator_H
+#define _frameCalibrator_H
+
+#include "opencv2/core/core.hpp"
+#include <string>
+#include <vector>
+
+// Results of an in-memory calibration. The second camera and the extrinsics are only set in STEREO mode
+struct frameCalibrationResult {
+    cv::Mat cameraMatrix[2], distCoeffs[2];     // Intrinsics of each camera
+    double avgError[2] = {0, 0};                // Average reprojection error of each camera
+    std::vector<cv::Mat> rvecs, tvecs;          // Pose of the pattern in each view of the first camera
+    int nViews = 0;                             // Views used by the calibration
+    cv::Mat R, T, E, F;                         // Extrinsics (rotation, translation, essential, fundamental)
+    cv::Mat R1, R2, P1, P2, Q;                  // Rectification transformations, projections and disparity-to-depth matrix
+    cv::Rect validRoi[2];                       // Valid area of each rectified image
+};
+
+// Calibration for programs that capture the images themselves. The settings are given as the text of a
+// settings file, and the frames are handed over one by one as they are captured: each one is detected when it
+// is added, and only its points are kept. Nothing is read from or written to disk, except the ArUco and
+// intrinsic input files that the settings name.
+//
+// Frames from a camera buffer can be passed without a copy as a Mat header around the buffer, for example
+// cv::Mat(height, width, CV_8UC1, data, stride). The buffer only has to stay valid during addFrame
+class FrameCalibrator
+{
+public:
+    FrameCalibrator();
+    ~FrameCalibrator();
+
+    // Reads the settings from the YAML or XML text of a settings file, in INTRINSIC or STEREO mode. The input
+    // image list and every output of the settings are ignored. Returns false if they are not valid
+    bool open(const std::string &settings);
+    bool isOpened() const;
+
+    // Detects the pattern on a frame (INTRINSIC mode) or on a stereo pair (STEREO mode), and keeps its points.
+    // Frames must all have the size of the first one. Returns the number of points found, or -1 on an error
+    int addFrame(const cv::Mat &frame);
+    int addFrame(const cv::Mat &left, const cv::Mat &right);
+    int nFrames() const;
+
+    // Calibrates from the points of the frames added so far. Returns false if the calibration failed.
+    // More frames can be added afterwards and the calibration run again
+    bool calibrate(frameCalibrationResult &result);
+
+private:
+    FrameCalibrator(const FrameCalibrator &);
+    FrameCalibrator &operator=(const FrameCalibrator &);
+
+    struct state;
+    state *st;
+    int detect(const cv::Mat &frame, int camera);
+};
+
+#endif
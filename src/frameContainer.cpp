@@ -0,0 +1,179 @@
+/*
+Container of raw frames for calibration image lists. See frameContainer.h
+*/
+
+#include "frameContainer.h"
+
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+bool frameContainer::open(const string &filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(frameContainerHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    length = (size_t)st.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);        // The mapping keeps the file open
+    if (data == MAP_FAILED)
+        return false;
+    size_t n = length;
+    shared_ptr<unsigned char> map((unsigned char *)data, [n](unsigned char *p) { munmap(p, n); });
+
+    // Check that the header is valid and that every frame and name is inside the file. Version 1 headers end
+    // before matsOffset, and have no matrices
+    memcpy(&header, data, sizeof(header));
+    size_t headerSize = header.version == 1 ? offsetof(frameContainerHeader, matsOffset) : sizeof(header);
+    if (header.version == 1)
+        header.matsOffset = header.nMats = header.reserved = 0;
+    int64_t frameData = (int64_t)header.stride * header.height;
+    if (memcmp(header.magic, "CFRM", 4) != 0 || header.version < 1 || header.version > frameContainerVersion
+            || header.width <= 0 || header.height <= 0 || header.nFrames < 0
+            || (header.type != CV_8UC1 && header.type != CV_8UC3)
+            || header.stride < (int64_t)header.width * CV_ELEM_SIZE(header.type) || header.frameBytes < frameData
+            || header.framesOffset % frameContainerAlignment != 0 || header.namesOffset < (int64_t)headerSize
+            || header.framesOffset + header.frameBytes * header.nFrames > (int64_t)length
+            || header.nMats < 0 || (header.nMats > 0 && (header.matsOffset < header.namesOffset
+            || header.matsOffset + (int64_t)sizeof(frameContainerMatrix) * header.nMats > header.framesOffset)))
+        return false;
+    const frameContainerMatrix *mats = (const frameContainerMatrix *)((const char *)data + header.matsOffset);
+    for (int i = 0; i < header.nMats; i++)
+        if (mats[i].rows < 0 || mats[i].cols < 0 || mats[i].offset < 0 || memchr(mats[i].name, 0, sizeof(mats[i].name)) == NULL
+                || mats[i].offset + (int64_t)mats[i].rows * mats[i].cols * CV_ELEM_SIZE(mats[i].type) > header.framesOffset)
+            return false;
+
+    const char *name = (const char *)data + header.namesOffset;
+    const char *end = (const char *)data + (header.nMats > 0 ? header.matsOffset : header.framesOffset);
+    frameNames.clear();
+    for (int i = 0; i < header.nFrames; i++)
+    {
+        const char *zero = (const char *)memchr(name, 0, end - name);
+        if (!zero)
+        {
+            frameNames.clear();
+            return false;
+        }
+        frameNames.push_back(string(name, zero));
+        name = zero + 1;
+    }
+    mapping = map;
+    return true;
+}
+
+cv::Mat frameContainer::frame(int index) const
+{
+    if (!isOpened() || index < 0 || index >= header.nFrames)
+        return cv::Mat();
+    unsigned char *data = mapping.get() + header.framesOffset + header.frameBytes * index;
+    return cv::Mat(header.height, header.width, header.type, data, (size_t)header.stride);
+}
+
+cv::Mat frameContainer::matrix(const string &name) const
+{
+    if (!isOpened())
+        return cv::Mat();
+    const frameContainerMatrix *mats = (const frameContainerMatrix *)(mapping.get() + header.matsOffset);
+    for (int i = 0; i < header.nMats; i++)
+        if (name == mats[i].name)
+            return cv::Mat(mats[i].rows, mats[i].cols, mats[i].type, mapping.get() + mats[i].offset);
+    return cv::Mat();
+}
+
+bool frameContainerWriter::open(const string &filename, const vector<string> &names, cv::Size size, int type,
+                                const vector<pair<string, cv::Mat> > &mats)
+{
+    file.open(filename.c_str(), ios::binary);
+    if (!file)
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CFRM", 4);
+    header.version = frameContainerVersion;
+    header.width = size.width;
+    header.height = size.height;
+    header.type = type;
+    header.nFrames = (int32_t)names.size();
+    header.stride = ((int64_t)size.width * CV_ELEM_SIZE(type) + 15) & ~(int64_t)15;
+    header.frameBytes = (header.stride * size.height + frameContainerAlignment - 1) & ~(frameContainerAlignment - 1);
+    header.namesOffset = sizeof(header);
+    int64_t pos = header.namesOffset;
+    for (size_t i = 0; i < names.size(); i++) pos += names[i].size() + 1;
+
+    // The table of matrices, then their data, each at 16 bytes
+    header.nMats = (int32_t)mats.size();
+    header.matsOffset = (pos + 15) & ~(int64_t)15;
+    vector<frameContainerMatrix> entries(mats.size());
+    pos = header.matsOffset + sizeof(frameContainerMatrix) * mats.size();
+    for (size_t i = 0; i < mats.size(); i++)
+    {
+        memset(&entries[i], 0, sizeof(frameContainerMatrix));
+        strncpy(entries[i].name, mats[i].first.c_str(), sizeof(entries[i].name) - 1);
+        entries[i].rows = mats[i].second.rows;
+        entries[i].cols = mats[i].second.cols;
+        entries[i].type = mats[i].second.type();
+        pos = (pos + 15) & ~(int64_t)15;
+        entries[i].offset = pos;
+        pos += mats[i].second.total() * mats[i].second.elemSize();
+    }
+    header.framesOffset = (pos + frameContainerAlignment - 1) & ~(frameContainerAlignment - 1);
+    written.assign(names.size(), false);
+    next = 0;
+
+    file.write((const char *)&header, sizeof(header));
+    for (size_t i = 0; i < names.size(); i++) file.write(names[i].c_str(), names[i].size() + 1);
+    while ((int64_t)file.tellp() < header.matsOffset) file.put(0);
+    if (!entries.empty())
+        file.write((const char *)&entries[0], sizeof(frameContainerMatrix) * entries.size());
+    for (size_t i = 0; i < mats.size(); i++)
+    {
+        cv::Mat m = mats[i].second.isContinuous() ? mats[i].second : mats[i].second.clone();
+        while ((int64_t)file.tellp() < entries[i].offset) file.put(0);
+        file.write((const char *)m.data, m.total() * m.elemSize());
+    }
+    while ((int64_t)file.tellp() < header.framesOffset) file.put(0);
+    return (bool)file;
+}
+
+bool frameContainerWriter::write(const cv::Mat &img)
+{
+    return write(next, img);
+}
+
+bool frameContainerWriter::write(int index, const cv::Mat &img)
+{
+    if (img.cols != header.width || img.rows != header.height || img.type() != header.type
+            || index < 0 || index >= header.nFrames)
+        return false;
+    file.seekp(header.framesOffset + header.frameBytes * index);
+    vector<char> padding(header.stride - img.cols * img.elemSize(), 0);
+    for (int r = 0; r < img.rows; r++)
+    {
+        file.write((const char *)img.ptr(r), img.cols * img.elemSize());
+        if (!padding.empty()) file.write(&padding[0], padding.size());
+    }
+    for (int64_t p = header.stride * img.rows; p < header.frameBytes; p++) file.put(0);
+    written[index] = true;
+    next = index + 1;
+    return (bool)file;
+}
+
+bool frameContainerWriter::close()
+{
+    bool ok = (bool)file && find(written.begin(), written.end(), false) == written.end();
+    file.close();
+    return ok;
+}
@@ -0,0 +1,113 @@
+/*
+Container of raw frames for calibration image lists.
+
+Decoding the images dominates the detection of large datasets. A frame container holds the decoded
+images of an image list in a single file: a header, the source filename of each frame, and the frames
+at a fixed stride, in the order of the list (so the views of stereo pairs and rigs stay interleaved).
+The file is memory mapped read only, and each frame is a Mat that points into the mapping, so nothing
+is decoded or copied. Frames must be cloned before they are drawn on (see owns).
+
+Containers are created from an image list with utils/packImages, and the rectified pairs of STEREO mode can be
+exported to one (see RectifiedImages_Container). Version 2 adds named matrices, stored after the filenames,
+such as the disparity-to-depth matrix of the rectified pairs. Values are stored in native byte order.
+*/
+
+#ifndef _frameContainer_H
+#define _frameContainer_H
+
+#include "opencv2/core/core.hpp"
+#include <stdint.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+const int frameContainerVersion = 2;
+const int64_t frameContainerAlignment = 4096;  // Frames start at page boundaries, for the memory mapping
+
+struct frameContainerHeader {
+    char magic[4];          // "CFRM"
+    int32_t version;        // frameContainerVersion
+    int32_t width, height;  // Size of every frame
+    int32_t type;           // OpenCV type of every frame (CV_8UC1 or CV_8UC3)
+    int32_t nFrames;        // Number of frames
+    int64_t namesOffset;    // Position of the source filenames, zero terminated, one per frame
+    int64_t framesOffset;   // Position of the first frame
+    int64_t stride;         // Bytes between the rows of a frame
+    int64_t frameBytes;     // Bytes between frames, a multiple of frameContainerAlignment
+    // Version 2
+    int64_t matsOffset;     // Position of the table of named matrices
+    int32_t nMats;          // Number of named matrices
+    int32_t reserved;
+};
+
+// Entry of a named matrix. Its data is continuous and row major
+struct frameContainerMatrix {
+    char name[48];          // Zero terminated
+    int32_t rows, cols, type, reserved;
+    int64_t offset;         // Position of the data
+};
+
+// The frames of a container file. Copies share the same mapping, which is released with the last one
+class frameContainer
+{
+public:
+    frameContainer() : header(), length(0) {}
+
+    // Maps a container file. Returns false if the file is not a valid container
+    bool open(const std::string &filename);
+    void close() { mapping.reset(); frameNames.clear(); }
+    bool isOpened() const { return (bool)mapping; }
+
+    int size() const { return isOpened() ? header.nFrames : 0; }
+    cv::Size frameSize() const { return cv::Size(header.width, header.height); }
+
+    // The frame at a list index, pointing into the mapping. Safe to call from any thread
+    cv::Mat frame(int index) const;
+
+    // True if the image points into the mapping, so it is read only
+    bool owns(const cv::Mat &img) const
+    {
+        return isOpened() && img.datastart >= mapping.get() && img.datastart < mapping.get() + length;
+    }
+
+    // Source filename of each frame
+    const std::vector<std::string> &names() const { return frameNames; }
+
+    // A named matrix, pointing into the mapping, or an empty Mat if there is none of that name
+    cv::Mat matrix(const std::string &name) const;
+
+private:
+    frameContainerHeader header;
+    std::shared_ptr<unsigned char> mapping;
+    size_t length;
+    std::vector<std::string> frameNames;
+};
+
+// Writes the frames of a container one after the other. Every frame must have the size and type given to open
+class frameContainerWriter
+{
+public:
+    frameContainerWriter() : header(), next(0) {}
+
+    // Creates the file with the source filenames of the frames that will be written, and the named matrices
+    bool open(const std::string &filename, const std::vector<std::string> &names, cv::Size size, int type,
+              const std::vector<std::pair<std::string, cv::Mat> > &mats = std::vector<std::pair<std::string, cv::Mat> >());
+
+    // Appends the next frame. Returns false if its size or type differs, or if it can not be written
+    bool write(const cv::Mat &img);
+    // Writes the frame of a list index, in any order, since the frames are at a fixed stride. Not thread safe
+    bool write(int index, const cv::Mat &img);
+
+    // Returns false if a frame of a name was not written
+    bool close();
+
+private:
+    frameContainerHeader header;
+    std::ofstream file;
+    std::vector<bool> written;
+    int next;
+};
+
+#endif
@@ -0,0 +1,190 @@
+/*
+Ring of frames in shared memory. See frameRing.h
+*/
+
+#include "frameRing.h"
+
+#include <new>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+bool frameRingWriter::open(const string &name, cv::Size size, int type, int nImages, int nSlots)
+{
+    close();
+    if (size.area() <= 0 || nImages < 1 || nSlots < 2)
+        return false;
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t stride = ((int64_t)size.width * CV_ELEM_SIZE(type) + 63) & ~(int64_t)63;
+    int64_t imageBytes = (stride * size.height + 63) & ~(int64_t)63;
+    int64_t slotsOffset = (sizeof(frameRingHeader) + page - 1) / page * page;
+    int64_t slotBytes = (frameRingImagesOffset + imageBytes * nImages + page - 1) / page * page;
+    length = (size_t)(slotsOffset + slotBytes * nSlots);
+
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return false;
+    void *data = MAP_FAILED;
+    if (ftruncate(fd, (off_t)length) == 0)
+        data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);        // The mapping keeps the object open
+    if (data == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // The object starts zeroed, so every slot is free. The magic is written last, once the header is complete
+    header = new (data) frameRingHeader;
+    header->version = frameRingVersion;
+    header->width = size.width;
+    header->height = size.height;
+    header->type = type;
+    header->nImages = nImages;
+    header->nSlots = nSlots;
+    header->reserved = 0;
+    header->stride = stride;
+    header->imageBytes = imageBytes;
+    header->slotsOffset = slotsOffset;
+    header->slotBytes = slotBytes;
+    header->published.store(0);
+    for (int k = 0; k < nSlots; k++)
+        new (slot(k)) frameRingSlot;
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, "CRNG", 4);
+    objectName = name;
+    next = 1;
+    return true;
+}
+
+frameRingSlot *frameRingWriter::slot(uint64_t number) const
+{
+    return (frameRingSlot *)((char *)header + header->slotsOffset + header->slotBytes * (int64_t)(number % header->nSlots));
+}
+
+vector<cv::Mat> frameRingWriter::begin()
+{
+    vector<cv::Mat> images;
+    if (!header)
+        return images;
+    frameRingSlot *s = slot(next);
+    s->sequence.store(2*next - 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);      // Readers see the odd sequence before the new pixels
+    char *data = (char *)s + frameRingImagesOffset;
+    for (int k = 0; k < header->nImages; k++)
+        images.push_back(cv::Mat(header->height, header->width, header->type, data + header->imageBytes * k,
+                                 (size_t)header->stride));
+    return images;
+}
+
+void frameRingWriter::publish(int64_t timestampNs, double skewMs)
+{
+    if (!header)
+        return;
+    frameRingSlot *s = slot(next);
+    s->timestampNs = timestampNs;
+    s->skewMs = skewMs;
+    s->sequence.store(2*next, memory_order_release);
+    header->published.store(next, memory_order_release);
+    next++;
+}
+
+void frameRingWriter::close()
+{
+    if (!header)
+        return;
+    munmap(header, length);
+    shm_unlink(objectName.c_str());
+    header = NULL;
+}
+
+bool frameRingReader::open(const string &name)
+{
+    close();
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(frameRingHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    size_t n = (size_t)st.st_size;
+    void *data = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    const frameRingHeader *h = (const frameRingHeader *)data;
+    atomic_thread_fence(memory_order_acquire);
+    if (memcmp(h->magic, "CRNG", 4) != 0 || h->version != frameRingVersion || h->nImages < 1 || h->nSlots < 2
+            || h->slotsOffset + h->slotBytes * h->nSlots > (int64_t)n
+            || frameRingImagesOffset + h->imageBytes * h->nImages > h->slotBytes
+            || h->stride * h->height > h->imageBytes)
+    {
+        munmap(data, n);
+        return false;
+    }
+    header = h;
+    length = n;
+    return true;
+}
+
+bool frameRingReader::get(uint64_t number, frameRingFrame &frame) const
+{
+    if (!header || number == 0)
+        return false;
+    const frameRingSlot *s = (const frameRingSlot *)((const char *)header + header->slotsOffset
+                                                     + header->slotBytes * (int64_t)(number % header->nSlots));
+    if (s->sequence.load(memory_order_acquire) != 2*number)
+        return false;
+    frame.number = number;
+    frame.timestampNs = s->timestampNs;
+    frame.skewMs = s->skewMs;
+    frame.images.clear();
+    const char *data = (const char *)s + frameRingImagesOffset;
+    for (int k = 0; k < header->nImages; k++)
+        frame.images.push_back(cv::Mat(header->height, header->width, header->type,
+                                       (void *)(data + header->imageBytes * k), (size_t)header->stride));
+    return valid(frame);
+}
+
+bool frameRingReader::latest(frameRingFrame &frame) const
+{
+    return header && get(header->published.load(memory_order_acquire), frame);
+}
+
+bool frameRingReader::after(uint64_t number, frameRingFrame &frame) const
+{
+    if (!header)
+        return false;
+    uint64_t last = header->published.load(memory_order_acquire);
+    if (last <= number)
+        return false;
+    // Frames that have already been overwritten are skipped
+    uint64_t first = last >= (uint64_t)header->nSlots ? last - header->nSlots + 1 : 1;
+    return get(max(number + 1, first), frame);
+}
+
+bool frameRingReader::valid(const frameRingFrame &frame) const
+{
+    if (!header)
+        return false;
+    atomic_thread_fence(memory_order_acquire);      // The pixels are read before the sequence is checked again
+    const frameRingSlot *s = (const frameRingSlot *)((const char *)header + header->slotsOffset
+                                                     + header->slotBytes * (int64_t)(frame.number % header->nSlots));
+    return s->sequence.load(memory_order_relaxed) == 2*frame.number;
+}
+
+void frameRingReader::close()
+{
+    if (!header)
+        return;
+    munmap((void *)header, length);
+    header = NULL;
+}
@@ -0,0 +1,124 @@
+/*
+Ring of frames in shared memory, to hand the rectified pairs of the live stereo preview to other processes.
+
+The ring is a POSIX shared memory object (see LiveStereo_SharedMemory) holding a header and a fixed number of
+slots. Each slot holds the images of one frame (the left and right images of a pair) at a fixed stride, its
+sequence number, and the time it was grabbed. The writer remaps the frames straight into the next slot, and
+readers map the object read only and use the images in place, so a frame is neither copied nor encoded on its
+way to another process.
+
+The ring is never locked. The sequence of a slot is odd while the writer fills it, and twice the number of the
+frame once it is published. A reader takes the latest frame, or the one after the last it used, and checks that
+the sequence of its slot is unchanged once it is done with the images: if the writer has come round to the slot
+meanwhile, the frame must be dropped. With more slots, a slow reader has more time before its frame is reused.
+The sequences are 64 bit atomics, lock free on the 64 bit platforms the program runs on.
+*/
+
+#ifndef _frameRing_H
+#define _frameRing_H
+
+#include "opencv2/core/core.hpp"
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+const int frameRingVersion = 1;
+const int64_t frameRingImagesOffset = 64;   // Position of the images in a slot, after its frameRingSlot
+
+struct frameRingHeader {
+    char magic[4];              // "CRNG"
+    int32_t version;            // frameRingVersion
+    int32_t width, height;      // Size of every image
+    int32_t type;               // OpenCV type of every image
+    int32_t nImages;            // Images per frame (2 for a stereo pair)
+    int32_t nSlots;
+    int32_t reserved;
+    int64_t stride;             // Bytes between the rows of an image
+    int64_t imageBytes;         // Bytes between the images of a slot
+    int64_t slotsOffset;        // Position of the first slot, a multiple of the page size
+    int64_t slotBytes;          // Bytes between slots, a multiple of the page size
+    std::atomic<uint64_t> published;    // Number of the last frame published, 0 before the first
+};
+
+// The start of each slot, followed by its images from frameRingImagesOffset on
+struct frameRingSlot {
+    std::atomic<uint64_t> sequence;     // 2*number of its frame once published, odd while it is written
+    int64_t timestampNs;        // Grab time of the frame, on the monotonic clock
+    double skewMs;              // Time between the grabs of the images of the frame
+};
+
+// A frame of the ring, whose images point into the shared memory
+struct frameRingFrame {
+    uint64_t number;
+    int64_t timestampNs;
+    double skewMs;
+    std::vector<cv::Mat> images;
+};
+
+// Creates the shared memory object and publishes frames to it. Not thread safe
+class frameRingWriter
+{
+public:
+    frameRingWriter() : header(NULL), length(0), next(1) {}
+    ~frameRingWriter() { close(); }
+
+    // Creates the object of a name ("/name"), replacing an object of the name. Returns false if it can not be created
+    bool open(const std::string &name, cv::Size size, int type, int nImages, int nSlots);
+    bool isOpened() const { return header != NULL; }
+    bool fits(cv::Size size, int type) const
+    {
+        return header && header->width == size.width && header->height == size.height && header->type == type;
+    }
+
+    // The images of the next slot, to be written in place, then published with publish
+    std::vector<cv::Mat> begin();
+    void publish(int64_t timestampNs, double skewMs);
+
+    // Unmaps the object and removes its name. Readers keep their mappings
+    void close();
+
+private:
+    frameRingWriter(const frameRingWriter &);
+    frameRingWriter &operator=(const frameRingWriter &);
+
+    frameRingSlot *slot(uint64_t number) const;
+
+    frameRingHeader *header;
+    size_t length;
+    std::string objectName;
+    uint64_t next;          // Number of the frame being written
+};
+
+// Maps the object of a writer in another process
+class frameRingReader
+{
+public:
+    frameRingReader() : header(NULL), length(0) {}
+    ~frameRingReader() { close(); }
+
+    // Maps the object of a name read only. Returns false if there is none, or if it is not a ring
+    bool open(const std::string &name);
+    bool isOpened() const { return header != NULL; }
+
+    // The latest frame published, or the first one after a number. Returns false if there is none yet, or if the
+    // writer came round to its slot while it was read
+    bool latest(frameRingFrame &frame) const;
+    bool after(uint64_t number, frameRingFrame &frame) const;
+
+    // Whether the images of a frame are still those of the frame: false once the writer has started to reuse its slot
+    bool valid(const frameRingFrame &frame) const;
+
+    void close();
+
+private:
+    frameRingReader(const frameRingReader &);
+    frameRingReader &operator=(const frameRingReader &);
+
+    bool get(uint64_t number, frameRingFrame &frame) const;
+
+    const frameRingHeader *header;
+    size_t length;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "matPool.h"
+#include "threadAffinity.h"
+#include "opencv2/core/core.hpp"
+#include <map>
+#include <mutex>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+#if CV_MAJOR_VERSION >= 3
+namespace {
+
+const size_t minPooled = 64 << 10, pageSize = 4096, hugePageSize = 2 << 20;
+
+// The blocks are kept by their capacity and the NUMA node of the thread that mapped them, which is where their
+// pages are (see threadAffinity). The capacity is a multiple of the page size, so the node fits in its low bits
+size_t blockKey(size_t capacity, int node) { return capacity | (size_t)(node & (pageSize - 1)); }
+size_t keyCapacity(size_t key) { return key & ~(pageSize - 1); }
+
+// The Mats of the standard allocator and those of the pool are each freed by their own allocator, since the
+// allocator that created a Mat is kept with its data
+class poolAllocator : public cv::MatAllocator
+{
+public:
+    poolAllocator() : base(cv::Mat::getDefaultAllocator()), maxBytes(0), hugePages(false), keptBytes(0), hits(0), misses(0) {}
+
+    void setLimits(size_t max, bool huge)
+    {
+        lock_guard<mutex> lock(m);
+        maxBytes = max;
+        hugePages = huge;
+        for (auto &f:freeBlocks)
+            while (keptBytes > maxBytes && !f.second.empty())
+            {
+                unmapBlock(f.second.back(), keyCapacity(f.first));
+                f.second.pop_back();
+                keptBytes -= keyCapacity(f.first);
+            }
+    }
+
+    void stats(long long &h, long long &ms) const
+    {
+        lock_guard<mutex> lock(m);
+        h = hits;
+        ms = misses;
+    }
+
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, int flags,
+                           cv::UMatUsageFlags usageFlags) const
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = 0; i < dims; i++)
+            total *= sizes[i];
+        if (data || total < minPooled)
+            return base->allocate(dims, sizes, type, data, step, flags, usageFlags);
+
+        // The rows are continuous, as with the standard allocator
+        if (step)
+        {
+            size_t s = CV_ELEM_SIZE(type);
+            for (int i = dims - 1; i >= 0; i--)
+            {
+                step[i] = s;
+                s *= sizes[i];
+            }
+        }
+        size_t key;
+        void *block = takeBlock(total, key);
+        cv::UMatData *u = new cv::UMatData(this);
+        u->data = u->origdata = (uchar *)block;
+        u->size = total;
+        u->userdata = reinterpret_cast<void *>(key);
+        return u;
+    }
+
+    bool allocate(cv::UMatData *u, int, cv::UMatUsageFlags) const { return u != NULL; }
+
+    void deallocate(cv::UMatData *u) const
+    {
+        if (!u)
+            return;
+        CV_Assert(u->urefcount == 0 && u->refcount == 0);
+        releaseBlock(u->origdata, reinterpret_cast<size_t>(u->userdata));
+        u->origdata = 0;
+        delete u;
+    }
+
+private:
+    // A kept block of the size class of size on the node of the calling thread, or else a new one
+    void *takeBlock(size_t size, size_t &key) const
+    {
+        size_t capacity;
+        {
+            lock_guard<mutex> lock(m);
+            size_t unit = hugePages && size >= hugePageSize ? hugePageSize : pageSize;
+            capacity = (size + unit - 1)/unit*unit;
+            key = blockKey(capacity, threadAffinity::currentNode());
+            auto f = freeBlocks.find(key);
+            if (f != freeBlocks.end() && !f->second.empty())
+            {
+                void *p = f->second.back();
+                f->second.pop_back();
+                keptBytes -= capacity;
+                hits++;
+                return p;
+            }
+            misses++;
+        }
+        return mapBlock(capacity);
+    }
+
+    void releaseBlock(void *p, size_t key) const
+    {
+        size_t capacity = keyCapacity(key);
+        {
+            lock_guard<mutex> lock(m);
+            if (keptBytes + capacity <= maxBytes)
+            {
+                freeBlocks[key].push_back(p);
+                keptBytes += capacity;
+                return;
+            }
+        }
+        unmapBlock(p, capacity);
+    }
+
+    void *mapBlock(size_t capacity) const
+    {
+#ifdef __linux__
+        void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        // Only succeeds if huge pages are reserved (vm.nr_hugepages)
+        if (hugePages && capacity % hugePageSize == 0)
+            p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED)
+        {
+            p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                CV_Error(cv::Error::StsNoMem, "Failed to map a pooled Mat buffer");
+#ifdef MADV_HUGEPAGE
+            if (hugePages && capacity >= hugePageSize)
+                madvise(p, capacity, MADV_HUGEPAGE);
+#endif
+        }
+        return p;
+#else
+        return cv::fastMalloc(capacity);
+#endif
+    }
+
+    static void unmapBlock(void *p, size_t capacity)
+    {
+#ifdef __linux__
+        munmap(p, capacity);
+#else
+        (void)capacity;
+        cv::fastFree(p);
+#endif
+    }
+
+    cv::MatAllocator *base;
+    mutable mutex m;
+    mutable map<size_t, vector<void *> > freeBlocks;    // Kept blocks by blockKey
+    size_t maxBytes;
+    bool hugePages;
+    mutable size_t keptBytes;
+    mutable long long hits, misses;
+};
+
+// Never freed, since Mats of the pool may be released by static objects at exit
+poolAllocator *pool = NULL;
+mutex installMutex;
+
+}
+#endif
+
+bool matPool::install(size_t maxBytes, bool hugePages)
+{
+#if CV_MAJOR_VERSION >= 3
+    lock_guard<mutex> lock(installMutex);
+    if (!pool)
+    {
+        pool = new poolAllocator;
+        cv::Mat::setDefaultAllocator(pool);
+    }
+    pool->setLimits(maxBytes, hugePages);
+    return true;
+#else
+    (void)maxBytes;
+    (void)hugePages;
+    return false;
+#endif
+}
+
+void matPool::stats(long long &hits, long long &misses)
+{
+    hits = misses = 0;
+#if CV_MAJOR_VERSION >= 3
+    lock_guard<mutex> lock(installMutex);
+    if (pool)
+        pool->stats(hits, misses);
+#endif
+}
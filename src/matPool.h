@@ -0,0 +1,32 @@
+/*
+Pool of the large Mat buffers of the pipeline (see the Memory_PoolMB setting).
+
+Each frame allocates and frees the same buffers: the decoded and grayscale images, the pyramid levels, the
+threshold images, the undistorted and rectified outputs and the preview canvas. The pool is installed as the
+default Mat allocator, since most of these are created inside OpenCV (imread, cvtColor, pyrDown, remap). The
+freed buffers of at least 64 KB are kept, by their size rounded up to a page, and handed to the next Mat of
+that size class, which skips malloc and free and the page faults of fresh memory. Smaller buffers go to the
+standard allocator.
+
+On Linux, the pooled buffers are mapped directly, and with huge pages they are backed by 2 MB pages when the
+system has them reserved, and otherwise advised to become transparent huge pages. Needs OpenCV 3 or later.
+*/
+
+#ifndef _matPool_H
+#define _matPool_H
+
+#include <cstddef>
+
+class matPool
+{
+public:
+    // Installs the pool as the default Mat allocator, keeping at most maxBytes of freed buffers. The pool stays
+    // installed until the process exits, and a later call only changes its limits. Returns false if the OpenCV
+    // version has no default allocator
+    static bool install(size_t maxBytes, bool hugePages);
+
+    // Allocations served from the kept buffers, and allocations that needed new memory
+    static void stats(long long &hits, long long &misses);
+};
+
+#endif
@@ -0,0 +1,342 @@
+#include "objectStore.h"
+#ifdef WITH_OBJECT_STORE
+#include <curl/curl.h>
+#endif
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+bool objectFetcher::isUrl(const string &name)
+{
+    return !name.compare(0, 7, "http://") || !name.compare(0, 8, "https://");
+}
+
+#ifdef WITH_OBJECT_STORE
+
+namespace {
+
+const int maxAttempts = 3;      // Attempts of an object, the store may fail a request now and then
+
+// libcurl is set up once for the process, before any transfer
+void initCurl()
+{
+    static once_flag once;
+    call_once(once, []{ curl_global_init(CURL_GLOBAL_DEFAULT); });
+}
+
+// The bytes of a transfer, and the count of bytes held by its fetcher
+struct download
+{
+    vector<unsigned char> bytes;
+    atomic<size_t> *held;
+};
+
+size_t writeBytes(char *data, size_t size, size_t n, void *p)
+{
+    download *d = (download *)p;
+    d->bytes.insert(d->bytes.end(), data, data + size*n);
+    if (d->held) *d->held += size*n;
+    return size*n;
+}
+
+CURL *newHandle(const string &url, download *d)
+{
+    CURL *easy = curl_easy_init();
+    curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, writeBytes);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, d);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);      // Transfers run on a thread, without alarms
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1L);     // A stalled transfer fails after a minute
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, 60L);
+    return easy;
+}
+
+// Whether a finished transfer got the object
+bool succeeded(CURL *easy, CURLcode result)
+{
+    long code = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+    return result == CURLE_OK && code >= 200 && code < 300;
+}
+
+}
+
+struct objectFetcher::state
+{
+    enum Status { PENDING, ACTIVE, DONE, FAILED, TAKEN };
+
+    // A transfer of the multi handle
+    struct transfer
+    {
+        int index;
+        int attempts;
+        download d;
+        CURL *easy;
+    };
+
+    vector<string> urls;
+    int maxTransfers;
+    size_t maxBytes;
+    vector<Status> status;
+    vector<char> skipped;           // skipped while active, released when done
+    map<int, vector<unsigned char> > done;
+    deque<int> wanted;              // taken before their turn, fetched first
+    int next;                       // next index of the list to fetch in order
+    atomic<size_t> held;            // bytes received and not taken
+    bool stop;
+    thread worker;
+    mutex m;
+    condition_variable doneCond, wakeCond;
+
+    // Picks the next object to fetch: a wanted one, or else the next of the list if the bytes held allow it
+    int pick()
+    {
+        while (!wanted.empty())
+        {
+            int i = wanted.front();
+            wanted.pop_front();
+            if (status[i] == PENDING)
+                return i;
+        }
+        while (next < (int)urls.size() && status[next] != PENDING)
+            next++;
+        if (next < (int)urls.size() && (maxBytes == 0 || held < maxBytes))
+            return next++;
+        return -1;
+    }
+
+    void work()
+    {
+        CURLM *multi = curl_multi_init();
+        map<CURL *, transfer *> active;
+        for (;;)
+        {
+            vector<int> toStart;
+            {
+                unique_lock<mutex> lock(m);
+                if (stop)
+                    break;
+                while ((int)(active.size() + toStart.size()) < maxTransfers)
+                {
+                    int i = pick();
+                    if (i < 0)
+                        break;
+                    status[i] = ACTIVE;
+                    toStart.push_back(i);
+                }
+                if (active.empty() && toStart.empty())
+                {
+                    // Every object has been started, or the bytes held are over the limit until some are taken
+                    bool finished = next >= (int)urls.size() && wanted.empty();
+                    if (finished)
+                        break;
+                    wakeCond.wait_for(lock, chrono::milliseconds(50));
+                    continue;
+                }
+            }
+            for (int i:toStart)
+            {
+                transfer *t = new transfer;
+                t->index = i;
+                t->attempts = 1;
+                t->d.held = &held;
+                t->easy = newHandle(urls[i], &t->d);
+                active[t->easy] = t;
+                curl_multi_add_handle(multi, t->easy);
+            }
+
+            int running;
+            curl_multi_perform(multi, &running);
+            CURLMsg *msg;
+            int left;
+            while ((msg = curl_multi_info_read(multi, &left)))
+            {
+                if (msg->msg != CURLMSG_DONE)
+                    continue;
+                CURL *easy = msg->easy_handle;
+                transfer *t = active[easy];
+                bool ok = succeeded(easy, msg->data.result);
+                curl_multi_remove_handle(multi, easy);
+                size_t size = t->d.bytes.size();
+                if (!ok && t->attempts < maxAttempts)
+                {
+                    held -= size;
+                    t->d.bytes.clear();
+                    t->attempts++;
+                    curl_multi_add_handle(multi, easy);
+                    continue;
+                }
+                {
+                    lock_guard<mutex> lock(m);
+                    if (!ok || skipped[t->index])
+                        held -= size;
+                    if (skipped[t->index])
+                        status[t->index] = TAKEN;
+                    else if (ok)
+                    {
+                        done[t->index].swap(t->d.bytes);
+                        status[t->index] = DONE;
+                    }
+                    else
+                        status[t->index] = FAILED;
+                }
+                doneCond.notify_all();
+                active.erase(easy);
+                curl_easy_cleanup(easy);
+                delete t;
+            }
+            // The wanted objects wait for the next round, so it is short
+            curl_multi_wait(multi, NULL, 0, 20, NULL);
+        }
+        for (auto &a:active)
+        {
+            curl_multi_remove_handle(multi, a.first);
+            curl_easy_cleanup(a.first);
+            delete a.second;
+        }
+        curl_multi_cleanup(multi);
+    }
+};
+
+objectFetcher::objectFetcher(const vector<string> &urls, int maxTransfers, size_t maxBytes) : st(new state)
+{
+    st->urls = urls;
+    st->maxTransfers = max(1, maxTransfers);
+    st->maxBytes = maxBytes;
+    st->status.assign(urls.size(), state::PENDING);
+    st->skipped.assign(urls.size(), 0);
+    st->next = 0;
+    st->held = 0;
+    st->stop = false;
+}
+
+objectFetcher::~objectFetcher()
+{
+    {
+        lock_guard<mutex> lock(st->m);
+        st->stop = true;
+    }
+    st->wakeCond.notify_all();
+    st->doneCond.notify_all();
+    if (st->worker.joinable())
+        st->worker.join();
+}
+
+bool objectFetcher::take(int index, vector<unsigned char> &bytes)
+{
+    unique_lock<mutex> lock(st->m);
+    if (index < 0 || index >= (int)st->urls.size())
+        return false;
+    if (!st->worker.joinable())
+    {
+        initCurl();
+        st->worker = thread(&state::work, st.get());
+    }
+    if (st->status[index] == state::PENDING)
+    {
+        st->wanted.push_back(index);
+        st->wakeCond.notify_all();
+    }
+    st->doneCond.wait(lock, [&]{ return st->stop || (st->status[index] != state::PENDING
+                                                     && st->status[index] != state::ACTIVE); });
+    if (st->status[index] != state::DONE)
+        return false;
+    bytes.swap(st->done[index]);
+    st->done.erase(index);
+    st->held -= bytes.size();
+    st->status[index] = state::TAKEN;
+    st->wakeCond.notify_all();
+    return true;
+}
+
+void objectFetcher::skip(int index)
+{
+    lock_guard<mutex> lock(st->m);
+    if (index < 0 || index >= (int)st->urls.size())
+        return;
+    if (st->status[index] == state::ACTIVE)
+        st->skipped[index] = 1;
+    else if (st->status[index] == state::DONE)
+    {
+        st->held -= st->done[index].size();
+        st->done.erase(index);
+    }
+    if (st->status[index] != state::ACTIVE)
+        st->status[index] = state::TAKEN;
+    st->wakeCond.notify_all();
+}
+
+bool objectFetcher::available()
+{
+    return true;
+}
+
+bool objectFetcher::fetch(const string &url, vector<unsigned char> &bytes)
+{
+    initCurl();
+    download d;
+    d.held = NULL;
+    CURL *easy = newHandle(url, &d);
+    bool ok = false;
+    CURLcode result = CURLE_OK;
+    for (int attempt = 0; attempt < maxAttempts && !ok; attempt++)
+    {
+        d.bytes.clear();
+        result = curl_easy_perform(easy);
+        ok = succeeded(easy, result);
+    }
+    if (!ok)
+    {
+        long code = 0;
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+        fprintf(stderr, "Could not fetch %s: %s (HTTP %ld)\n", url.c_str(), curl_easy_strerror(result), code);
+    }
+    curl_easy_cleanup(easy);
+    bytes.swap(d.bytes);
+    return ok;
+}
+
+#else
+
+struct objectFetcher::state
+{
+};
+
+objectFetcher::objectFetcher(const vector<string> &, int, size_t) : st(new state)
+{
+}
+
+objectFetcher::~objectFetcher()
+{
+}
+
+bool objectFetcher::take(int, vector<unsigned char> &)
+{
+    return false;
+}
+
+void objectFetcher::skip(int)
+{
+}
+
+bool objectFetcher::available()
+{
+    return false;
+}
+
+bool objectFetcher::fetch(const string &url, vector<unsigned char> &)
+{
+    fprintf(stderr, "Could not fetch %s: the object store needs a build with OBJECT_STORE=1\n", url.c_str());
+    return false;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+Images of an image list read from an object store.
+
+The entries of an image list can be http:// or https:// URLs, such as the public or presigned URLs of the objects
+of an S3 compatible store, instead of files synced to the local disk first. The objects are fetched by a single
+background thread with the multi interface of libcurl, many at once with non-blocking I/O, in the order of the
+list. Their bytes are kept in memory until the detection takes them, and are decoded then, so the first image is
+detected after the latency of one object rather than after the copy of the whole list. New transfers are only
+started while the bytes held, received and not yet taken, are below a limit (see Remote_MaxMemory).
+
+An image that is taken before its turn is fetched next, and the images skipped by the detection are released,
+so reading the list out of order or a shard of it does not stall. An image taken a second time is fetched again.
+
+Only built with OBJECT_STORE=1 (see the Makefile), since it needs libcurl. Without it, URLs are rejected.
+*/
+
+#ifndef _objectStore_H
+#define _objectStore_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+class objectFetcher
+{
+public:
+    // Fetches the objects of urls in order, at most maxTransfers at once, and starts no new transfer while
+    // maxBytes are held (0 for no limit). The transfers start with the first take
+    objectFetcher(const std::vector<std::string> &urls, int maxTransfers, size_t maxBytes);
+    ~objectFetcher();
+
+    // Waits for the object of the list index and hands its bytes over. Returns false if it could not be
+    // fetched, or if it was already taken or skipped
+    bool take(int index, std::vector<unsigned char> &bytes);
+
+    // The object of the list index will not be taken: it is not fetched, or its bytes are released
+    void skip(int index);
+
+    // Whether a name of an image list is the URL of an object
+    static bool isUrl(const std::string &name);
+
+    // Whether the fetcher was built (OBJECT_STORE=1)
+    static bool available();
+
+    // Fetches a single object, waiting for it. Prints the error and returns false if it fails
+    static bool fetch(const std::string &url, std::vector<unsigned char> &bytes);
+
+private:
+    objectFetcher(const objectFetcher &);
+    objectFetcher &operator=(const objectFetcher &);
+
+    struct state;
+    std::unique_ptr<state> st;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "pipelineTrace.h"
+#include "opencv2/core/core.hpp"
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct traceEvent {
+    const char *name;
+    int64 start, end;   // Tick counts
+    int frame, level;
+};
+
+// Events of a thread. The buffers are kept for the whole process, since pooled threads record again in the next trace
+struct threadBuffer {
+    int tid;
+    vector<traceEvent> events;      // Ended stages
+    vector<traceEvent> open;        // Stages begun and not ended yet, innermost last
+    mutex m;                        // Taken by write, so a thread may end a stage while the trace is written
+};
+
+mutex buffersMutex;
+vector<threadBuffer*> buffers;
+int64 origin = 0;
+thread_local threadBuffer *local = NULL;
+
+threadBuffer &localBuffer()
+{
+    if (!local)
+    {
+        local = new threadBuffer;
+        lock_guard<mutex> lock(buffersMutex);
+        local->tid = (int)buffers.size();
+        buffers.push_back(local);
+    }
+    return *local;
+}
+
+}
+
+atomic<bool> pipelineTrace::recording(false);
+
+void pipelineTrace::open()
+{
+    lock_guard<mutex> lock(buffersMutex);
+    for (auto b:buffers)
+    {
+        lock_guard<mutex> bufferLock(b->m);
+        b->events.clear();
+    }
+    origin = cv::getTickCount();
+    recording = true;
+}
+
+void pipelineTrace::begin(const char *name, int frame, int level)
+{
+    threadBuffer &b = localBuffer();
+    if (frame < 0 && !b.open.empty())
+        frame = b.open.back().frame;
+    traceEvent e = { name, cv::getTickCount(), 0, frame, level };
+    b.open.push_back(e);
+}
+
+void pipelineTrace::end()
+{
+    threadBuffer &b = localBuffer();
+    if (b.open.empty())
+        return;
+    traceEvent e = b.open.back();
+    b.open.pop_back();
+    if (!isOpened())
+        return;
+    e.end = cv::getTickCount();
+    lock_guard<mutex> lock(b.m);
+    b.events.push_back(e);
+}
+
+bool pipelineTrace::write(const string &filename)
+{
+    recording = false;
+    FILE *file = fopen(filename.c_str(), "w");
+    if (!file)
+        return false;
+    // Complete events ("X") in microseconds from the start of the trace, and the name of each thread
+    double usPerTick = 1e6/cv::getTickFrequency();
+    lock_guard<mutex> lock(buffersMutex);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (auto b:buffers)
+    {
+        lock_guard<mutex> bufferLock(b->m);
+        if (b->events.empty())
+            continue;
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}}",
+                first ? "" : ",\n", b->tid, b->tid);
+        first = false;
+        for (auto &e:b->events)
+        {
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"frame\":%d",
+                    e.name, b->tid, (e.start - origin)*usPerTick, (e.end - e.start)*usPerTick, e.frame);
+            if (e.level >= 0)
+                fprintf(file, ",\"level\":%d", e.level);
+            fprintf(file, "}}");
+        }
+        b->events.clear();
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
@@ -0,0 +1,52 @@
+/*
+Trace of the calibration pipeline, written as Chrome trace JSON (see the Save_Trace setting).
+
+Each stage of the processing of an image records an event with its start and duration, the thread that ran
+it and the index of the image. The file opens in chrome://tracing or https://ui.perfetto.dev, where the
+threads of the batch detection, the OpenMP threads of the ArUco detector and the background image writers
+are shown side by side, so idle threads and oversubscribed regions can be seen.
+
+Events are kept in a buffer of each thread, and only merged when the trace is written. When no trace is
+recorded, a scope costs the test of a flag.
+*/
+
+#ifndef _pipelineTrace_H
+#define _pipelineTrace_H
+
+#include <atomic>
+#include <string>
+
+class pipelineTrace
+{
+public:
+    // Records the stage of a scope. Stages nest, and the name must be a string literal
+    class scope
+    {
+    public:
+        explicit scope(const char *name, int frame = -1) : active(isOpened()) { if (active) begin(name, frame); }
+        ~scope() { if (active) end(); }
+    private:
+        scope(const scope &);
+        scope &operator=(const scope &);
+        bool active;
+    };
+
+    // Starts recording, discarding the events of a previous trace
+    static void open();
+    static bool isOpened() { return recording.load(std::memory_order_relaxed); }
+
+    // Stops recording and writes the events. The threads should be done with their stages, since the events
+    // of the stages still open are not written. Returns false if the file could not be written
+    static bool write(const std::string &filename);
+
+    // Begins a stage of the calling thread, which ends at the next end(). The frame is the index of the image,
+    // or -1 for the frame of the enclosing stage. The level, if not -1, is written with it (a pyramid or
+    // threshold level)
+    static void begin(const char *name, int frame = -1, int level = -1);
+    static void end();
+
+private:
+    static std::atomic<bool> recording;
+};
+
+#endif
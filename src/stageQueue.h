@@ -0,0 +1,326 @@
+/*
+Bounded queues between the threads of the pipeline stages: the stream decoder, the detection loop and the
+image writers.
+
+A queue holds at most its capacity of items, and the items of every queue that shares a memoryBudget hold at
+most its bytes, so a stage that falls behind (a slow disk under the writers) blocks the stages that feed it
+instead of letting the frames pile up. The rings are lock free: spscQueue for a single producer and a
+single consumer, and mpmcQueue (a ring of sequenced cells) for several of each. A thread only takes a lock to
+sleep when its queue is full or empty, and the other side only takes it to wake a sleeping thread.
+
+Each queue keeps its occupancy and the time its threads waited on it, for the run report (see queueStats).
+*/
+
+#ifndef _stageQueue_H
+#define _stageQueue_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Bytes held by the items of the queues that share it. With a limit of 0 only the capacities bound the queues
+class memoryBudget
+{
+public:
+    explicit memoryBudget(size_t maxBytes = 0) : limit(maxBytes), used(0), peak(0) {}
+
+    void setLimit(size_t maxBytes)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        limit = maxBytes;
+        cond.notify_all();
+    }
+
+    // Waits until the bytes fit, or until stop becomes true (then returns false). An item larger than the limit
+    // is let through when nothing else is held, so it never waits forever
+    bool acquire(size_t bytes, const std::atomic<bool> &stop)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        while (!stop && limit > 0 && used > 0 && used + bytes > limit)
+            cond.wait_for(lock, std::chrono::milliseconds(10));
+        if (stop)
+            return false;
+        used += bytes;
+        if (used > peak) peak = used;
+        return true;
+    }
+
+    void release(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        used -= bytes;
+        cond.notify_all();
+    }
+
+    size_t peakBytes() const { std::lock_guard<std::mutex> lock(m); return peak; }
+
+private:
+    size_t limit, used, peak;
+    mutable std::mutex m;
+    std::condition_variable cond;
+};
+
+// Occupancy of a queue, and the time its producers waited for space and its consumers waited for items
+struct queueStats {
+    size_t capacity = 0;
+    long long pushes = 0;
+    size_t maxItems = 0;        // Most items held at once
+    double meanItems = 0;       // Items held when an item was pushed, on average
+    size_t maxBytes = 0;        // Most bytes held at once
+    double pushWaitMs = 0, popWaitMs = 0;
+};
+
+// Lock free ring of a single producer and a single consumer. The positions only grow, so the ring is full when
+// they are capacity apart
+template <class T>
+class spscRing
+{
+public:
+    explicit spscRing(size_t capacity) : slots(capacity), head(0), tail(0) {}
+    size_t capacity() const { return slots.size(); }
+    size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+    bool tryPush(T &item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= slots.size())
+            return false;
+        slots[t % slots.size()] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        T &slot = slots[h % slots.size()];
+        item = std::move(slot);
+        slot = T();         // The image data is released now, not when the slot is reused
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head;   // Next position to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail;   // Next position to push, written by the producer
+};
+
+// Lock free ring of several producers and consumers. Each cell has a sequence number that tells whether it is
+// free for the push of a position, or holds the item of a position to pop
+template <class T>
+class mpmcRing
+{
+public:
+    explicit mpmcRing(size_t capacity) : cells(capacity), enqueuePos(0), dequeuePos(0)
+    {
+        for (size_t i = 0; i < capacity; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    size_t capacity() const { return cells.size(); }
+    size_t size() const
+    {
+        size_t e = enqueuePos.load(std::memory_order_acquire), d = dequeuePos.load(std::memory_order_acquire);
+        return e > d ? e - d : 0;
+    }
+
+    bool tryPush(T &item)
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;)
+        {
+            c = &cells[pos % cells.size()];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+            if (diff == 0 && enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+            if (diff < 0)
+                return false;       // Full
+            if (diff > 0)
+                pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+        c->data = std::move(item);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &item)
+    {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;)
+        {
+            c = &cells[pos % cells.size()];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+            if (diff == 0 && dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+            if (diff < 0)
+                return false;       // Empty
+            if (diff > 0)
+                pos = dequeuePos.load(std::memory_order_relaxed);
+        }
+        item = std::move(c->data);
+        c->data = T();
+        c->seq.store(pos + cells.size(), std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+        cell() : seq(0) {}
+        cell(const cell &) : seq(0) {}      // Only for the construction of the vector
+    };
+    std::vector<cell> cells;
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+};
+
+// Blocking queue over a ring, with the bytes of each item taken from a memoryBudget. push waits while the queue
+// is full or the budget is spent, and pop waits while the queue is empty. After close, push fails and pop
+// returns the items left, then fails
+template <class T, class Ring>
+class stageQueue
+{
+public:
+    explicit stageQueue(size_t capacity, memoryBudget *budget = NULL)
+        : ring(capacity > 0 ? capacity : 1), budget(budget), closed(false), waiting(0), pushes(0), itemsSum(0),
+          maxItems(0), bytes(0), maxBytes(0), pushWaitNs(0), popWaitNs(0) {}
+
+    // Pushes an item that holds the bytes. Returns false if the queue was closed
+    bool push(T item, size_t itemBytes = 0)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool waited = false;
+        if (budget && !budget->acquire(itemBytes, closed))
+            return false;
+        entry e(std::move(item), itemBytes);
+        // The bytes are counted before the item is published, since a consumer may pop it at once
+        size_t held;
+        for (;;)
+        {
+            held = bytes += itemBytes;
+            if (ring.tryPush(e))
+                break;
+            bytes -= itemBytes;
+            waited = true;
+            if (!wait([this]{ return closed.load() || ring.size() < ring.capacity(); }) || closed)
+            {
+                if (budget) budget->release(itemBytes);
+                return false;
+            }
+        }
+        if (waited || budget)
+            pushWaitNs += elapsedNs(start);
+        size_t n = ring.size();
+        pushes++;
+        itemsSum += n;
+        update(maxItems, n);
+        update(maxBytes, held);
+        wake();
+        return true;
+    }
+
+    // Pops the next item. Returns false once the queue is closed and empty
+    bool pop(T &item)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool waited = false;
+        entry e;
+        while (!ring.tryPop(e))
+        {
+            if (closed && ring.size() == 0)
+                return false;
+            waited = true;
+            wait([this]{ return closed.load() || ring.size() > 0; });
+        }
+        if (waited)
+            popWaitNs += elapsedNs(start);
+        bytes -= e.second;
+        if (budget) budget->release(e.second);
+        item = std::move(e.first);
+        wake();
+        return true;
+    }
+
+    void close()
+    {
+        closed = true;
+        std::lock_guard<std::mutex> lock(m);
+        cond.notify_all();
+    }
+    bool isClosed() const { return closed; }
+    size_t size() const { return ring.size(); }
+
+    queueStats stats() const
+    {
+        queueStats st;
+        st.capacity = ring.capacity();
+        st.pushes = pushes;
+        st.maxItems = maxItems;
+        st.meanItems = pushes > 0 ? (double)itemsSum/pushes : 0.;
+        st.maxBytes = maxBytes;
+        st.pushWaitMs = pushWaitNs*1e-6;
+        st.popWaitMs = popWaitNs*1e-6;
+        return st;
+    }
+
+private:
+    typedef std::pair<T, size_t> entry;
+
+    // Sleeps until the condition holds. The waiting count is raised before the condition is checked, and the
+    // other side reads it after changing the ring, so a wakeup is never missed. Returns false if closed
+    template <class Condition>
+    bool wait(Condition ready)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        waiting++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!ready())
+            cond.wait(lock);
+        waiting--;
+        return !closed;
+    }
+    void wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(m);
+            cond.notify_all();
+        }
+    }
+
+    static void update(std::atomic<size_t> &maximum, size_t value)
+    {
+        size_t current = maximum.load(std::memory_order_relaxed);
+        while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+    static long long elapsedNs(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    Ring ring;
+    memoryBudget *budget;
+    std::atomic<bool> closed;
+    std::atomic<int> waiting;       // Threads sleeping in wait
+    std::mutex m;
+    std::condition_variable cond;
+    std::atomic<long long> pushes, itemsSum;
+    std::atomic<size_t> maxItems, bytes, maxBytes;
+    std::atomic<long long> pushWaitNs, popWaitNs;
+};
+
+template <class T> using spscQueue = stageQueue<T, spscRing<std::pair<T, size_t> > >;
+template <class T> using mpmcQueue = stageQueue<T, mpmcRing<std::pair<T, size_t> > >;
+
+#endif
@@ -0,0 +1,175 @@
+#include "threadAffinity.h"
+#ifdef _OPENMP
+#include <omp.h>
+#else
+inline int omp_get_thread_num() { return 0; }
+#endif
+#include <algorithm>
+#include <vector>
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#endif
+
+using namespace std;
+
+namespace {
+
+bool pinning = false, ioReserved = false;
+vector<int> workerCores;    // Core of each compute thread index, in the order of the policy
+vector<int> ioCoreList;     // Reserved for the I/O threads
+vector<int> nodeOfCore;     // NUMA node by core number
+int nNodes = 1;
+thread_local bool pinned = false;
+
+#ifdef __linux__
+// Cores of a sysfs list like "0-7,16-23"
+vector<int> parseCpuList(const string &list)
+{
+    vector<int> cores;
+    stringstream ss(list);
+    string range;
+    while (getline(ss, range, ','))
+    {
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str()), last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+        for (int c = first; c <= last; c++)
+            cores.push_back(c);
+    }
+    return cores;
+}
+
+void setCores(const vector<int> &cores)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c:cores)
+        CPU_SET(c, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+#endif
+
+}
+
+bool threadAffinity::configure(const string &policy, int ioCores)
+{
+    pinning = ioReserved = false;
+    workerCores.clear();
+    ioCoreList.clear();
+    if (policy == "none" && ioCores <= 0)
+        return true;
+#ifdef __linux__
+    // Only the cores this process may run on
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return false;
+    vector<vector<int> > byNode;
+    nodeOfCore.assign(CPU_SETSIZE, 0);
+    if (DIR *dir = opendir("/sys/devices/system/node"))
+    {
+        while (struct dirent *e = readdir(dir))
+        {
+            string name = e->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() < 5 || !isdigit((unsigned char)name[4]))
+                continue;
+            int node = atoi(name.c_str() + 4);
+            ifstream f("/sys/devices/system/node/" + name + "/cpulist");
+            string list;
+            if (!getline(f, list))
+                continue;
+            if ((int)byNode.size() <= node)
+                byNode.resize(node + 1);
+            for (int c:parseCpuList(list))
+                if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+                {
+                    byNode[node].push_back(c);
+                    nodeOfCore[c] = node;
+                }
+        }
+        closedir(dir);
+    }
+    if (byNode.empty())     // No NUMA information, a single node
+    {
+        byNode.resize(1);
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed)) byNode[0].push_back(c);
+    }
+    nNodes = (int)byNode.size();
+
+    // The I/O cores are taken from the end of the last nodes
+    for (int n = nNodes - 1; n >= 0 && (int)ioCoreList.size() < ioCores; n--)
+        while (!byNode[n].empty() && (int)ioCoreList.size() < ioCores)
+        {
+            ioCoreList.push_back(byNode[n].back());
+            byNode[n].pop_back();
+        }
+    // spread takes the k-th core of each node in turn, compact every core of a node in turn
+    size_t most = 0;
+    for (auto &cores:byNode) most = max(most, cores.size());
+    if (policy == "spread")
+    {
+        for (size_t k = 0; k < most; k++)
+            for (auto &cores:byNode)
+                if (k < cores.size()) workerCores.push_back(cores[k]);
+    }
+    else
+        for (auto &cores:byNode)
+            workerCores.insert(workerCores.end(), cores.begin(), cores.end());
+    if (workerCores.empty())
+        return false;
+    pinning = policy != "none";
+    ioReserved = !ioCoreList.empty();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void threadAffinity::pinWorker(int index)
+{
+    if (pinned || (!pinning && !ioReserved))
+        return;
+    pinned = true;
+#ifdef __linux__
+    // Without a policy, the compute threads only stay off the I/O cores
+    setCores(pinning ? vector<int>(1, workerCores[index % workerCores.size()]) : workerCores);
+#else
+    (void)index;
+#endif
+}
+
+void threadAffinity::pinTeam(int n)
+{
+    if (!pinning && !ioReserved)
+        return;
+#ifndef _OPENMP
+    (void)n;
+#endif
+    #pragma omp parallel num_threads(n)
+    pinWorker(omp_get_thread_num());
+}
+
+void threadAffinity::pinIO()
+{
+#ifdef __linux__
+    if (ioReserved)
+        setCores(ioCoreList);
+#endif
+}
+
+int threadAffinity::currentNode()
+{
+#ifdef __linux__
+    int core = sched_getcpu();
+    return core >= 0 && core < (int)nodeOfCore.size() ? nodeOfCore[core] : 0;
+#else
+    return 0;
+#endif
+}
+
+int threadAffinity::nodes() { return nNodes; }
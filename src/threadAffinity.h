@@ -0,0 +1,42 @@
+/*
+Placement of the pipeline threads on the cores and NUMA nodes (see the Threads_Affinity setting).
+
+The compute threads, the OpenMP threads of the detection and the main thread, are pinned each to one core:
+"compact" fills the cores of a node before the next node, so the threads of a small team share their caches
+and memory controller, and "spread" deals the threads out over the nodes, for the most memory bandwidth.
+Since a thread keeps its core, the buffers it allocates for an image come from its node (Linux allocates a
+page on the node of the thread that first touches it), and its detection of the image reads them there. With
+I/O cores reserved, the decoding and writing threads run on the last cores of the machine, and the compute
+threads on the others.
+
+The topology is read from /sys/devices/system/node, so no NUMA library is needed. Elsewhere than Linux,
+nothing is pinned and every thread is on node 0.
+*/
+
+#ifndef _threadAffinity_H
+#define _threadAffinity_H
+
+#include <string>
+
+class threadAffinity
+{
+public:
+    // Reads the topology and sets the policy: "none", "compact" or "spread", with ioCores reserved for the I/O
+    // threads (and then left to no compute thread, even with "none"). Returns false if the cores cannot be
+    // set on this system, or if no core would be left to the compute threads
+    static bool configure(const std::string &policy, int ioCores);
+
+    // Pins the calling compute thread, the index-th of its team (the main thread is 0). A thread is only
+    // pinned once, so this can be called for every task of a parallel loop
+    static void pinWorker(int index);
+    // Pins the threads of an OpenMP team of n threads, and the calling thread as its first
+    static void pinTeam(int n);
+    // Moves the calling decoding or writing thread to the reserved I/O cores, if there are any
+    static void pinIO();
+
+    // NUMA node of the core that runs the calling thread, and the number of nodes
+    static int currentNode();
+    static int nodes();
+};
+
+#endif
@@ -0,0 +1,283 @@
+/* benchmarkArucoKernels.cpp - times the per candidate kernels of the ArUco library
+ *
+ * Every input is synthetic: marker patches from Dictionary::getMarkerImage_id, poses projected with a known
+ * camera, and a marker map image from MarkerMap::getImage, so the times do not depend on any image file.
+ * Each kernel is called in a loop long enough to be timed, and the fastest of several runs is kept.
+ * The results are printed, and written as CSV (kernel, case, calls, ns per call) if a file is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <fstream>
+#include <random>
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+#include "aruco.h"
+#include "ippe.h"
+#include "checkrectcontour.h"
+#include "markerlabelers/dictionary_based.h"
+
+using namespace cv;
+using namespace std;
+using namespace aruco;
+
+#if CV_VERSION_MAJOR == 2
+namespace aruco {
+// Pose refinement of the pose tracker (posetracker.cpp), only built with OpenCV 2
+double __aruco_solve_pnp(const std::vector<cv::Point3f> &p3d, const std::vector<cv::Point2f> &p2d,
+                         const cv::Mat &cam_matrix, const cv::Mat &dist, cv::Mat &r_io, cv::Mat &t_io);
+}
+#endif
+
+static volatile int sink;       // Results are added here, so the calls are not optimized away
+static int nRuns = 3;
+static ofstream csv;
+
+// Times f(i) for i = 0, 1, ... and reports the fastest time per call. The number of calls is doubled
+// until a run takes at least 20 ms
+template<class F> static void timeKernel(const string &kernel, const string &name, F f)
+{
+    int n = 1;
+    double best = DBL_MAX;
+    for (;;)
+    {
+        int64 start = getTickCount();
+        for (int i = 0; i < n; i++) f(i);
+        double ms = 1000.*(getTickCount() - start)/getTickFrequency();
+        if (ms >= 20 || n >= (1 << 24))
+        {
+            best = ms;
+            break;
+        }
+        n *= 2;
+    }
+    for (int r = 1; r < nRuns; r++)
+    {
+        int64 start = getTickCount();
+        for (int i = 0; i < n; i++) f(i);
+        best = min(best, 1000.*(getTickCount() - start)/getTickFrequency());
+    }
+    double ns = 1e6*best/n;
+    printf("%-34s %-18s %10.1f ns\n", kernel.c_str(), name.c_str(), ns);
+    if (csv.is_open())
+        csv << kernel << "," << name << "," << n << "," << ns << "\n";
+}
+
+// Patches of the size the detector warps the candidates to
+const int patchSize = 56;
+
+// Marker patch of a dictionary, rotated nRotations times 90 degrees
+static Mat markerPatch(Dictionary &dict, int id, int nRotations)
+{
+    int cells = (int)sqrt((double)dict.nbits()) + 2;
+    Mat img = dict.getMarkerImage_id(id, max(1, patchSize/cells), false), patch;
+    if (img.empty())
+        return img;
+    resize(img, patch, Size(patchSize, patchSize), 0, 0, INTER_NEAREST);
+    for (int r = 0; r < nRotations; r++)
+    {
+        transpose(patch, patch);
+        flip(patch, patch, 1);
+    }
+    return patch;
+}
+
+// Inverts one inner cell of a patch, so it can only be identified with error correction
+static void flipCell(Mat &patch, int nbits, int cell)
+{
+    int bs = (int)sqrt((double)nbits), cells = bs + 2;
+    int x = 1 + cell%bs, y = 1 + (cell/bs)%bs;
+    Rect r(x*patchSize/cells, y*patchSize/cells, patchSize/cells, patchSize/cells);
+    Mat c = patch(r);
+    bitwise_not(c, c);
+}
+
+static void benchmarkDictionary(const string &type, mt19937 &rng)
+{
+    Dictionary dict = Dictionary::loadPredefined(type);
+    shared_ptr<const Dictionary> shared = Dictionary::getPredefined(type);
+
+    // Lookups of every code, and of random codes, which are almost never in the dictionary
+    vector<uint64_t> codes, randomCodes;
+    for (auto &c:dict.getMapCode()) codes.push_back(c.first);
+    uint64_t mask = dict.nbits() >= 64 ? ~uint64_t(0) : (uint64_t(1) << dict.nbits()) - 1;
+    for (size_t i = 0; i < codes.size(); i++) randomCodes.push_back((uint64_t(rng()) << 32 | rng()) & mask);
+    timeKernel("Dictionary::find hit", type, [&](int i) { sink += dict.find(codes[i % codes.size()]); });
+    timeKernel("Dictionary::find random", type, [&](int i) { sink += dict.find(randomCodes[i % codes.size()]); });
+
+    // Patches of at most 256 markers in every rotation, the same with one wrong cell, and random cells
+    int nIds = min(256, (int)codes.size());
+    vector<Mat> patches, wrongCell, randomPatches;
+    for (int k = 0; k < nIds; k++)
+    {
+        int id = dict.getMapCode().at(codes[k]);
+        Mat p = markerPatch(dict, id, k % 4);
+        if (p.empty()) continue;
+        patches.push_back(p);
+        wrongCell.push_back(p.clone());
+        flipCell(wrongCell.back(), dict.nbits(), rng());
+        Mat noise = p.clone();
+        for (int c = 0; c < (int)dict.nbits(); c++)
+            if (rng() & 1) flipCell(noise, dict.nbits(), c);
+        randomPatches.push_back(noise);
+    }
+    if (patches.empty())
+        return;
+
+    // The labeler thresholds the patch in place, which leaves these binary patches unchanged
+    DictionaryBased exact, correcting;
+    exact.setParams(shared, 0);
+    correcting.setParams(shared, 0.5);
+    int id, nRotations;
+    timeKernel("DictionaryBased::detect", type, [&](int i) {
+        sink += exact.detect(patches[i % patches.size()], id, nRotations); });
+    timeKernel("DictionaryBased::detect miss", type, [&](int i) {
+        sink += exact.detect(randomPatches[i % patches.size()], id, nRotations); });
+    timeKernel("DictionaryBased::detect corrected", type, [&](int i) {
+        sink += correcting.detect(wrongCell[i % patches.size()], id, nRotations); });
+}
+
+int main(int argc, char **argv)
+{
+    int a = 1;
+    if (a + 1 < argc && !strcmp(argv[a], "-r"))
+    {
+        nRuns = atoi(argv[a + 1]);
+        a += 2;
+    }
+    if (nRuns < 1 || argc - a > 1)
+    {
+        fprintf(stderr, "Usage: %s [-r runs] [results.csv]\n", argv[0]);
+        return -1;
+    }
+    if (a < argc)
+    {
+        csv.open(argv[a]);
+        if (!csv)
+        {
+            fprintf(stderr, "Could not create %s\n", argv[a]);
+            return -1;
+        }
+        csv << "kernel,case,calls,ns" << endl;
+    }
+
+    mt19937 rng(1);
+    vector<string> types = Dictionary::getDicTypes();
+    types.push_back("ARTAG");   // Not listed by getDicTypes
+    for (auto &t:types)
+        benchmarkDictionary(t, rng);
+
+    // Pose of a single marker and of a marker map, seen by a known camera
+    Mat K = (Mat_<double>(3, 3) << 800, 0, 320, 0, 800, 240, 0, 0, 1), dist = Mat::zeros(5, 1, CV_64F);
+    Mat rvec = (Mat_<double>(3, 1) << 0.3, -0.2, 0.1), tvec = (Mat_<double>(3, 1) << 0.02, -0.01, 0.5);
+    float markerSize = 0.05;
+    vector<Point3f> square = Marker::get3DPoints(markerSize);
+    vector<Point2f> corners;
+    projectPoints(square, rvec, tvec, K, dist, corners);
+    timeKernel("IPPE::solvePnP_", "marker", [&](int) {
+        sink += (int)IPPE::solvePnP_(square, corners, K, dist).size(); });
+#if CV_VERSION_MAJOR == 2
+    Mat r32, t32;
+    rvec.convertTo(r32, CV_32F);
+    tvec.convertTo(t32, CV_32F);
+    timeKernel("__aruco_solve_pnp", "marker", [&](int) {
+        Mat r = r32.clone(), t = t32.clone();
+        sink += (int)__aruco_solve_pnp(square, corners, K, dist, r, t); });
+#endif
+
+    Dictionary mip = Dictionary::loadPredefined("ARUCO_MIP_36h12");
+    vector<int> ids;
+    for (int i = 0; i < 16; i++) ids.push_back(i);
+    MarkerMap pixMap = mip.createMarkerMap(Size(4, 4), 100, 20, ids), map = pixMap.convertToMeters(markerSize);
+    vector<Marker> markers;
+    for (auto &m:map)
+    {
+        vector<Point2f> p;
+        projectPoints(m, rvec, tvec, K, dist, p);
+        markers.push_back(Marker(p, m.id));
+    }
+    timeKernel("MarkerMap::calculateExtrinsics", "4x4 map", [&](int) {
+        sink += map.calculateExtrinsics(markers, markerSize, K, dist).first.rows; });
+    Mat rWarm = rvec.clone(), tWarm = tvec.clone();
+    timeKernel("MarkerMap::calculateExtrinsics", "4x4 map, warm", [&](int) {
+        sink += map.calculateExtrinsics(markers, markerSize, K, dist, rWarm, tWarm); });
+
+    // Undistortion of the 64 samples of a side of the LINES refinement, and distortion of the 4 refined corners,
+    // with the distortion model and by table lookup
+    Mat lens = (Mat_<double>(1, 5) << -0.28, 0.09, 0.001, -0.0005, 0);
+    vector<Point2f> samples, refined(4), out;
+    for (int i = 0; i < 64; i++) samples.push_back(Point2f(100 + 7*i, 60 + 2.5f*i));
+    for (int i = 0; i < 4; i++) refined[i] = corners[i];
+    UndistortLookup lookup;
+    lookup.create(K, lens, Size(640, 480));
+    timeKernel("undistortPoints", "64 points", [&](int) {
+        undistortPoints(samples, out, K, lens, noArray(), K);
+        sink += (int)out.size(); });
+    timeKernel("UndistortLookup::undistort", "64 points, step 8", [&](int) {
+        lookup.undistort(samples, out);
+        sink += (int)out.size(); });
+    timeKernel("UndistortLookup::distort", "4 points, step 8", [&](int) {
+        lookup.distort(refined, out);
+        sink += (int)out.size(); });
+    timeKernel("UndistortLookup::create", "640x480, step 8", [&](int) {
+        UndistortLookup l;
+        l.create(K, lens, Size(640, 480));
+        sink += l.canDistort(); });
+
+    // Corner refinement of the detected markers of a map image, from the stage times of the detector
+    Mat mapImage = pixMap.getImage(), gray;
+    copyMakeBorder(mapImage, gray, 100, 100, 100, 100, BORDER_CONSTANT, Scalar::all(255));
+    resize(gray, gray, Size(1280, gray.rows*1280/gray.cols), 0, 0, INTER_AREA);
+    GaussianBlur(gray, gray, Size(3, 3), 0);
+    // Polygon fit of the contours of the threshold image of the map, the markers and the cells within them
+    Mat thres;
+    adaptiveThreshold(gray, thres, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, 7, 7);
+    vector<vector<Point> > contours;
+    findContours(thres, contours, CV_RETR_LIST, CV_CHAIN_APPROX_NONE);
+    vector<vector<Point> > fitted;
+    for (auto &c:contours)
+        if (c.size() > 40) fitted.push_back(c);
+    string contourCase = to_string(fitted.size()) + " contours";
+    vector<Point> approx;
+    timeKernel("approxPolyDP+isContourConvex", contourCase, [&](int) {
+        for (auto &c:fitted)
+        {
+            approxPolyDP(c, approx, double(c.size())*0.05, true);
+            sink += approx.size() == 4 && isContourConvex(approx);
+        }});
+    timeKernel("CheckRectContour::fitQuad", contourCase, [&](int) {
+        int idx[4];
+        for (auto &c:fitted)
+            sink += CheckRectContour::fitQuad(c, float(c.size())*0.05f, idx);
+        });
+
+    // (LINES refines the candidates while they are identified, so it is not a separate stage)
+    const char *methods[] = { "HARRIS", "SUBPIX" };
+    MarkerDetector::CornerRefinementMethod methodIds[] = { MarkerDetector::HARRIS, MarkerDetector::SUBPIX };
+    for (int m = 0; m < 2; m++)
+    {
+        MarkerDetector detector;
+        detector.setDictionary("ARUCO_MIP_36h12");
+        MarkerDetector::Params params = detector.getParams();
+        params._cornerMethod = methodIds[m];
+        detector.setParams(params);
+        vector<Marker> detected;
+        detector.detect(gray, detected);
+        string name = string(methods[m]) + " " + to_string(detected.size()) + " markers";
+        timeKernel("MarkerDetector::detect", name, [&](int) {
+            detector.detect(gray, detected);
+            sink += (int)detected.size(); });
+        // HARRIS is findCornerMaxima. The stage times are in milliseconds
+        detector.resetStats();
+        for (int i = 0; i < 50; i++) detector.detect(gray, detected);
+        const MarkerDetector::Stats &stats = detector.getTotalStats();
+        double ns = 1e6*stats.refineTime/stats.nCalls;
+        printf("%-34s %-18s %10.1f ns\n", "MarkerDetector refinement", name.c_str(), ns);
+        if (csv.is_open())
+            csv << "MarkerDetector refinement," << name << "," << stats.nCalls << "," << ns << "\n";
+    }
+    return 0;
+}
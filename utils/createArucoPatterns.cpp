@@ -32,6 +32,9 @@ or implied, of Rafael Muñoz Salinas.
 #include <string>
 #include "markermap.h"
 #include <cstdio>
+#include <fstream>
+#include <thread>
+#include <stdint.h>
 #include "dictionary.h"
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -41,19 +44,96 @@ using namespace std;
 using namespace cv;
 using namespace aruco;
 
+// Writes an 8 bit grayscale image strip by strip as an uncompressed baseline TIFF, so that images larger
+// than the memory can be written. The rows follow the header, and the directory follows the rows
+class tiffStripWriter {
+public:
+    bool open(const string &filename, int width, int height) {
+        uint64_t bytes = (uint64_t)width*height;
+        if (bytes > 0xFFFF0000ULL)      // The offsets of a baseline TIFF have 32 bits
+            return false;
+        w = width; h = height; rowsWritten = 0;
+        file.open(filename.c_str(), ios::binary);
+        file.write("II", 2);
+        put16(42);
+        put32(8 + (uint32_t)bytes + (bytes & 1));      // The directory starts at a word boundary
+        return (bool)file;
+    }
+    bool write(const Mat &rows) {
+        if (rows.type() != CV_8UC1 || rows.cols != w || rowsWritten + rows.rows > h)
+            return false;
+        for (int r = 0; r < rows.rows; r++)
+            file.write((const char *)rows.ptr(r), w);
+        rowsWritten += rows.rows;
+        return (bool)file;
+    }
+    bool close() {
+        if (rowsWritten != h)
+            return false;
+        uint32_t bytes = (uint32_t)w*h;
+        if (bytes & 1) file.put(0);
+        // 12 entries, sorted by tag, and the two resolutions (300 dpi) after them
+        uint32_t resolution = 8 + bytes + (bytes & 1) + 2 + 12*12 + 4;
+        put16(12);
+        entry(256, 4, w);               // ImageWidth
+        entry(257, 4, h);               // ImageLength
+        entry(258, 3, 8);               // BitsPerSample
+        entry(259, 3, 1);               // Compression: none
+        entry(262, 3, 1);               // PhotometricInterpretation: black is zero
+        entry(273, 4, 8);               // StripOffsets
+        entry(277, 3, 1);               // SamplesPerPixel
+        entry(278, 4, h);               // RowsPerStrip
+        entry(279, 4, bytes);           // StripByteCounts
+        entry(282, 5, resolution);      // XResolution
+        entry(283, 5, resolution);      // YResolution
+        entry(296, 3, 2);               // ResolutionUnit: inch
+        put32(0);                       // No other directory
+        put32(300); put32(1);
+        file.close();
+        return !file.fail();
+    }
+private:
+    void put16(uint16_t v) { char b[2] = { (char)(v & 255), (char)(v >> 8) }; file.write(b, 2); }
+    void put32(uint32_t v) { put16(v & 0xFFFF); put16(v >> 16); }
+    // Type 3 is SHORT, 4 LONG and 5 RATIONAL, whose value is the offset of its two LONGs
+    void entry(uint16_t tag, uint16_t type, uint32_t value) {
+        put16(tag); put16(type); put32(1);
+        if (type == 3) { put16((uint16_t)value); put16(0); }
+        else put32(value);
+    }
+    ofstream file;
+    int w, h, rowsWritten;
+};
+
+// Rows [y0, y0 + out.rows) of the printed image of a map. With a border, the map image is cropped to crop,
+// so that just the white/black of the edge markers is showing, and extended by bSize replicated pixels
+static void printedRows(const MarkerMap &map, Mat &out, int y0, Rect crop, int bSize) {
+    int first = min(max(y0 - bSize, 0), crop.height - 1), last = min(max(y0 + out.rows - 1 - bSize, 0), crop.height - 1);
+    Mat rows(last - first + 1, map.getImageSize().width, CV_8UC1);
+    map.getImageRows(rows, crop.y + first);
+    for (int k = 0; k < out.rows; k++) {
+        int r = min(max(y0 + k - bSize, 0), crop.height - 1) - first;
+        Mat dst = out.row(k);
+        copyMakeBorder(rows.row(r).colRange(crop.x, crop.x + crop.width), dst, 0, 0, bSize, bSize, BORDER_REPLICATE);
+    }
+}
+
 int main(int argc, char **argv) {
     try {
         CmdLineParser cml(argc,argv);
         if (argc < 2 || cml["-h"]) {
             cerr << "Usage: X:Y (# of markers per row:column)\n"
-            "   [-d <dict>]          #dictionary name (ARUCO_MIP_36h12 default)\n"
+            "   [-d <dict>]          #dictionary name or custom dictionary file (ARUCO_MIP_36h12 default)\n"
             "   [-n <numOfMaps>]    #number of unique marker maps to create (1 default)\n"
             "   [-s <pixelSize>]     #size of each marker in pixels (250 default)\n"
             "   [-t <patternType>]   #0: panel, 1: chessboard (1 default)\n"
             "   [-r <randSeed>]    #seed to randomize markers\n"
             "   [-b <border>         #1: save maps with border, 0: no border (1 default)\n"
             "   [-bf <borderFactor>]  #Width of border by factor of marker size (2: half of border, 2 default)\n"
-            "   [-i <interMarkerDist>]  #Distance between markers (range=[0,1], 0.2 default)\n" << endl;
+            "   [-i <interMarkerDist>]  #Distance between markers (range=[0,1], 0.2 default)\n"
+            "   [-j <threads>]       #number of maps created at once (the number of cores default)\n"
+            "   [-strip <rows>]      #render and write each map strip by strip, this many rows at a time, as an\n"
+            "                        #uncompressed TIFF (markerMapN.tif) instead of a PNG. For large prints (0 default)\n" << endl;
 
             cerr<<"\tDictionaries: "; for(auto dict:Dictionary::getDicTypes())  cerr<<dict<<" ";cerr<<endl;
             return -1;
@@ -65,7 +145,7 @@ int main(int argc, char **argv) {
             return -1;
         }
 
-        auto Dict=Dictionary::loadPredefined(cml("-d","ARUCO_MIP_36h12"));
+        auto Dict=Dictionary::load(cml("-d","ARUCO_MIP_36h12"));
         int numOfMaps = stoi(cml("-n","1"));
         float pixelSize = stoi(cml("-s","250"));
         int patternType = stoi(cml("-t","1"));
@@ -73,6 +153,9 @@ int main(int argc, char **argv) {
         int border = stoi(cml("-b","1"));
         float borderFactor = stof(cml("-bf","2"));
         float interMarkerDist = stof(cml("-i","0.2"));
+        int nThreads = stoi(cml("-j","0"));
+        int stripRows = stoi(cml("-strip","0"));
+        if (nThreads <= 0) nThreads = max(1, (int)thread::hardware_concurrency());
         //If border is true, add extra markers to become border
         if (border){
             XSize = XSize + 2;
@@ -99,56 +182,71 @@ int main(int argc, char **argv) {
         srand(randSeed);
         random_shuffle(allIds.begin(),allIds.end());
 
-        //Create a list to store pattern ids
-        vector<int> ids;
+        //The ids of each map are taken in order, so the maps do not depend on the number of threads
         int idsPerMap = XSize*YSize;
-
-        char imgName [50];
-        char configName [50];
-        for(int i=1; i<=numOfMaps; i++){
-            ids.clear();
+        if (numOfMaps*idsPerMap > (int)allIds.size()) {
+            cerr << "The dictionary has " << allIds.size() << " markers, not enough for " << numOfMaps << " maps" << endl;
+            return -1;
+        }
+        vector<vector<int> > mapIds(numOfMaps);
+        for(int i=0; i<numOfMaps; i++){
             for(int j=0; j<idsPerMap; j++){
-                ids.push_back(allIds.back());
+                mapIds[i].push_back(allIds.back());
                 allIds.pop_back();
             }
-            MarkerMap map = Dict.createMarkerMap(Size(XSize, YSize), pixelSize, pixelSize * interMarkerDist,ids,patternType==1);
-
-            //create a printable image to save
-            Mat MarkerMapImage=map.getImage();
-
-            //if border input is true, add a border to the image
-            if (border) {
-                float bSize = (pixelSize / borderFactor) - (pixelSize * .1);
-                // Crop so that just the white/black of the edge markers are showing, then extend this out
-                Mat cropped = MarkerMapImage(Rect((pixelSize * .9), (pixelSize * .9), float(XSize * pixelSize) - (pixelSize * 1.8),float(YSize * pixelSize) - (pixelSize * 1.8)));
-                cropped.copyTo(MarkerMapImage);
-                copyMakeBorder(MarkerMapImage, MarkerMapImage, bSize, bSize, bSize, bSize, BORDER_REPLICATE);
-            }
+            configList.push_back("config" + to_string(i + 1) + ".yml");
+            const char *planes[] = { "XY", "YZ", "XZ" };
+            planeList.push_back(i < 3 ? planes[i] : "XY");
+        }
+
+        //The maps are rendered and written in parallel, each one by a thread
+        vector<string> errors(numOfMaps);
+        #pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+        for(int i=0; i<numOfMaps; i++){
+            try {
+                MarkerMap map = Dict.createMarkerMap(Size(XSize, YSize), pixelSize, pixelSize * interMarkerDist,mapIds[i],patternType==1);
+                map.saveToFile(configList[i]);
 
-            // Save files
-            sprintf(configName, "config%d.yml", i);
-            sprintf(imgName, "markerMap%d.png", i);
-            map.saveToFile(configName);
-            imwrite(imgName, MarkerMapImage);
-
-            // Add info to arucoPattern struct
-            configList.push_back(configName);
-
-            switch (i) {
-                case 1:
-                    planeList.push_back("XY");
-                    break;
-                case 2:
-                    planeList.push_back("YZ");
-                    break;
-                case 3:
-                    planeList.push_back("XZ");
-                    break;
-                default:
-                    planeList.push_back("XY");
-                    break;
+                //if border input is true, the image is cropped so that just the white/black of the edge markers
+                //are showing, then extended out by a border
+                Size size = map.getImageSize();
+                Rect crop(0, 0, size.width, size.height);
+                int bSize = 0;
+                if (border) {
+                    bSize = (pixelSize / borderFactor) - (pixelSize * .1);
+                    crop = Rect((pixelSize * .9), (pixelSize * .9), float(XSize * pixelSize) - (pixelSize * 1.8),float(YSize * pixelSize) - (pixelSize * 1.8));
+                }
+                Size printed(crop.width + 2*bSize, crop.height + 2*bSize);
+
+                if (stripRows > 0) {
+                    // Only a strip of the image is in memory at a time
+                    string name = "markerMap" + to_string(i + 1) + ".tif";
+                    tiffStripWriter writer;
+                    bool ok = writer.open(name, printed.width, printed.height);
+                    Mat strip;
+                    for (int y = 0; ok && y < printed.height; y += stripRows) {
+                        strip.create(min(stripRows, printed.height - y), printed.width, CV_8UC1);
+                        printedRows(map, strip, y, crop, bSize);
+                        ok = writer.write(strip);
+                    }
+                    if (!ok || !writer.close())
+                        errors[i] = "Could not write " + name;
+                } else {
+                    Mat MarkerMapImage(printed, CV_8UC1);
+                    printedRows(map, MarkerMapImage, 0, crop, bSize);
+                    string name = "markerMap" + to_string(i + 1) + ".png";
+                    if (!imwrite(name, MarkerMapImage))
+                        errors[i] = "Could not write " + name;
+                }
+            } catch (exception &ex) {
+                errors[i] = ex.what();
             }
         }
+        for (auto &e:errors)
+            if (!e.empty()) {
+                cerr << e << endl;
+                return -1;
+            }
 
         // Calculate parameters for ArUco config, which will be used in calculation of 3D points
         denominator = pixelSize / borderFactor;
@@ -0,0 +1,64 @@
+/* createDictionary.cpp - generates a custom ArUco dictionary sized for a rig
+ *
+ * The codes are searched by Dictionary::generate, which tests random codes in parallel against the accepted
+ * ones and their rotations, and lowers the distance it asks for when it stops finding them. The dictionary
+ * is written in the format of Dictionary::loadFromFile, so its file name can be given to createArucoPatterns
+ * with -d and to the marker map configs. The same seed gives the same dictionary on any number of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "opencv2/core/core.hpp"
+#include "dictionary.h"
+
+using namespace cv;
+using namespace std;
+using namespace aruco;
+
+int main(int argc, char **argv)
+{
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <markers> <bits> <output> [-tau <max>] [-mintau <min>] [-misses <count>] [-s <seed>]\n"
+                "   <bits>              bits of each code, a square number up to 64 (36 for 6x6 markers)\n"
+                "   -tau <max>          distance the search starts with (half the bits default)\n"
+                "   -mintau <min>       lowest distance accepted, fails if the markers are not found with it (1 default)\n"
+                "   -misses <count>     codes rejected in a row before the distance is lowered (1048576 default)\n"
+                "   -s <seed>           seed of the random codes (0 default)\n", argv[0]);
+        return -1;
+    }
+    int nMarkers = atoi(argv[1]), nbits = atoi(argv[2]);
+    string output = argv[3];
+    int maxTau = 0, minTau = 1, maxMisses = 1 << 20;
+    unsigned long long seed = 0;
+    for (int i = 4; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-tau")) maxTau = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-mintau")) minTau = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-misses")) maxMisses = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-s")) seed = strtoull(argv[i + 1], NULL, 10);
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    try {
+        int64 start = getTickCount();
+        // The dictionary is named after its file, so the marker maps made with it refer to the file
+        Dictionary dict = Dictionary::generate(output, nMarkers, nbits, seed, maxTau, minTau, max(1, maxMisses));
+        double seconds = (getTickCount() - start)/getTickFrequency();
+        if ((int)dict.size() < nMarkers) {
+            fprintf(stderr, "Only %d markers found with a distance of %d or more in %.1f s\n", (int)dict.size(), minTau,
+                    seconds);
+            return -1;
+        }
+        dict.saveToFile(output);
+        printf("%d markers of %d bits with a distance of %d written to %s in %.1f s\n", nMarkers, nbits, (int)dict.tau(),
+               output.c_str(), seconds);
+    } catch (cv::Exception &ex) {
+        fprintf(stderr, "%s\n", ex.what());
+        return -1;
+    }
+    return 0;
+}
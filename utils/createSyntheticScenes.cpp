@@ -0,0 +1,408 @@
+/* createSyntheticScenes.cpp - renders calibration datasets with known ground truth
+ *
+ * The ArUco box of an arucoConfig file (each marker map on its plane, placed with the offsets and
+ * denominator of the config, so the object points match those of the calibration) or a chessboard
+ * is rendered under known intrinsics, distortion and random poses. Each image is written as soon as
+ * it is rendered, so datasets of any number of views and any resolution can be created. The
+ * output folder gets the images, an image list, and groundTruth.yml with the camera (readable as
+ * intrinsic input) and the pose of every view.
+ *
+ * With -stress, the views are made pathological for the detectors, to build the corpus of the stress
+ * benchmark: a dense texture or hundreds of decoy markers behind the pattern, strong motion blur, or
+ * overexposure.
+ */
+
+#include <stdio.h>
+#include <float.h>
+#include <string>
+#include <random>
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "markermap.h"
+#include "dictionary.h"
+
+using namespace std;
+using namespace cv;
+using namespace aruco;
+
+class CmdLineParser{int argc; char **argv; public: CmdLineParser(int _argc,char **_argv):argc(_argc),argv(_argv){}  bool operator[] ( string param ) {int idx=-1;  for ( int i=0; i<argc && idx==-1; i++ ) if ( string ( argv[i] ) ==param ) idx=i;    return ( idx!=-1 ) ;    } string operator()(string param,string defvalue="-1"){int idx=-1;    for ( int i=0; i<argc && idx==-1; i++ ) if ( string ( argv[i] ) ==param ) idx=i; if ( idx==-1 ) return defvalue;   else  return ( argv[  idx+1] ); }};
+
+// A planar face of the pattern: a texture, and the 3D point of each texture pixel (world = M*[u v 1])
+struct face {
+    Mat texture;        // CV_8UC1
+    Matx33d M;
+    Vec3d normal;       // Points away from the cameras that see the texture unmirrored
+};
+
+// Builds M from the 3D point of a texture pixel, a function of (u, v)
+template<class F> static void setFaceTransform(face &f, F point)
+{
+    Point3d o = point(0., 0.), du = point(1., 0.) - o, dv = point(0., 1.) - o;
+    f.M = Matx33d(du.x, dv.x, o.x, du.y, dv.y, o.y, du.z, dv.z, o.z);
+    Vec3d n = Vec3d(du.x, du.y, du.z).cross(Vec3d(dv.x, dv.y, dv.z));
+    f.normal = n*(1./norm(n));
+}
+
+// The faces of an ArUco pattern config, and the dictionary of its markers. The object points are computed as in
+// the calibration (toIntPoints)
+static bool boxFaces(const string &configFile, double markerPixels, vector<face> &faces, string &dictionary)
+{
+    FileStorage fs(configFile, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+    vector<string> configs, planes;
+    FileNode n = fs["MarkerMap_Configs"];
+    for (FileNodeIterator it = n.begin(); it != n.end(); ++it) configs.push_back((string)*it);
+    n = fs["Planes"];
+    for (FileNodeIterator it = n.begin(); it != n.end(); ++it) planes.push_back((string)*it);
+    int xOffset, yOffset, denom;
+    fs["xOffset"] >> xOffset;
+    fs["yOffset"] >> yOffset;
+    fs["Denominator"] >> denom;
+    if (configs.empty() || configs.size() != planes.size() || denom == 0)
+        return false;
+
+    for (size_t i = 0; i < configs.size(); i++)
+    {
+        MarkerMap map;
+        map.readFromFile(configs[i]);
+        if (map.empty() || !map.isExpressedInPixels())
+            return false;
+        Dictionary dict = Dictionary::load(map.getDictionary());
+        dictionary = map.getDictionary();
+
+        // Texture of the map, with a margin of half a marker. Texture pixels are s map units, y goes down
+        double side = map[0].getMarkerSize(), s = markerPixels/side;
+        double xmin = DBL_MAX, ymin = DBL_MAX, xmax = -DBL_MAX, ymax = -DBL_MAX;
+        for (auto &m:map)
+            for (auto &p:m)
+            {
+                xmin = min(xmin, (double)p.x); xmax = max(xmax, (double)p.x);
+                ymin = min(ymin, (double)p.y); ymax = max(ymax, (double)p.y);
+            }
+        xmin -= side/2; ymin -= side/2; xmax += side/2; ymax += side/2;
+        face f;
+        f.texture = Mat((int)ceil((ymax - ymin)*s), (int)ceil((xmax - xmin)*s), CV_8UC1, Scalar(255));
+        for (auto &m:map)
+        {
+            int size = cvRound(m.getMarkerSize()*s);
+            Mat marker = dict.getMarkerImage_id(m.id, max(1, size/((int)sqrt((double)dict.nbits()) + 2)), false), scaled;
+            if (marker.empty())
+                return false;
+            resize(marker, scaled, Size(size, size), 0, 0, INTER_NEAREST);
+            Rect r(cvRound((m[0].x - xmin)*s), cvRound((ymax - m[0].y)*s), size, size);
+            scaled.copyTo(f.texture(r & Rect(0, 0, f.texture.cols, f.texture.rows)));
+        }
+
+        const string &plane = planes[i];
+        setFaceTransform(f, [&](double u, double v) {
+            double x = xmin + u/s, y = ymax - v/s;
+            if (plane == "YZ") return Point3d(0, (y + yOffset)/denom, (-x + xOffset)/denom);
+            if (plane == "XZ") return Point3d((x + xOffset)/denom, 0, (-y + yOffset)/denom);
+            return Point3d((x + xOffset)/denom, (y + yOffset)/denom, 0);
+        });
+        faces.push_back(f);
+    }
+    return true;
+}
+
+// A chessboard of width x height inner corners, with a white margin of a square. Corner (j, i) is at
+// (j*squareSize, i*squareSize, 0), as in the calibration
+static void chessboardFace(Size boardSize, double squareSize, int squarePixels, vector<face> &faces)
+{
+    face f;
+    int cols = boardSize.width + 1, rows = boardSize.height + 1;
+    f.texture = Mat((rows + 2)*squarePixels, (cols + 2)*squarePixels, CV_8UC1, Scalar(255));
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+            if ((r + c)%2 == 0)
+                f.texture(Rect((c + 1)*squarePixels, (r + 1)*squarePixels, squarePixels, squarePixels)).setTo(0);
+    double s = squarePixels/squareSize;
+    setFaceTransform(f, [&](double u, double v) { return Point3d(u/s - 2*squareSize, v/s - 2*squareSize, 0); });
+    faces.push_back(f);
+}
+
+// Bilinear sample of a texture. Returns false outside of it
+static inline bool sample(const Mat &t, double u, double v, double &value)
+{
+    if (u < 0 || v < 0 || u >= t.cols - 1 || v >= t.rows - 1)
+        return false;
+    int x = (int)u, y = (int)v;
+    double a = u - x, b = v - y;
+    const uchar *p = t.ptr<uchar>(y) + x, *q = p + t.step;
+    value = (1 - b)*((1 - a)*p[0] + a*p[1]) + b*((1 - a)*q[0] + a*q[1]);
+    return true;
+}
+
+// Normalized ray of each node of a grid over the image (every gridStep pixels), from the distortion model
+const int gridStep = 4;
+static Mat rayGrid(Size size, const Mat &K, const Mat &dist)
+{
+    int gw = size.width/gridStep + 2, gh = size.height/gridStep + 2;
+    vector<Point2f> pixels, rays;
+    for (int y = 0; y < gh; y++)
+        for (int x = 0; x < gw; x++)
+            pixels.push_back(Point2f(x*gridStep, y*gridStep));
+    undistortPoints(pixels, rays, K, dist);
+    return Mat(rays, true).reshape(2, gh);
+}
+
+// Renders a view of the faces. R and t take world points to the camera. The pixels that no face covers are
+// those of the background image, or a uniform gray if it is empty
+static void renderView(const vector<face> &faces, const Mat &rays, const Matx33d &R, const Vec3d &t,
+                       int superSampling, const Mat &backgroundImg, Mat &img)
+{
+    // Texture coordinates from a ray: q = (R*M + t*e3')^-1 * ray, and the depth is 1/q[2]
+    vector<Matx33d> H;
+    for (auto &f:faces)
+    {
+        Matx33d G = R*f.M;
+        for (int r = 0; r < 3; r++) G(r, 2) += t[r];
+        H.push_back(G.inv());
+    }
+    const double background = 160;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int y = 0; y < img.rows; y++)
+    {
+        uchar *out = img.ptr<uchar>(y);
+        const uchar *back = backgroundImg.empty() ? NULL : backgroundImg.ptr<uchar>(y);
+        for (int x = 0; x < img.cols; x++)
+        {
+            double sum = 0;
+            for (int sy = 0; sy < superSampling; sy++)
+                for (int sx = 0; sx < superSampling; sx++)
+                {
+                    double px = x + (sx + 0.5)/superSampling - 0.5, py = y + (sy + 0.5)/superSampling - 0.5;
+                    double gx = max(0., px)/gridStep, gy = max(0., py)/gridStep;
+                    int ix = (int)gx, iy = (int)gy;
+                    double a = gx - ix, b = gy - iy;
+                    const Vec2f *r0 = rays.ptr<Vec2f>(iy) + ix, *r1 = rays.ptr<Vec2f>(iy + 1) + ix;
+                    Vec2f r = (1 - b)*((1 - a)*r0[0] + a*r0[1]) + b*((1 - a)*r1[0] + a*r1[1]);
+                    Vec3d ray(r[0], r[1], 1);
+
+                    double value = back ? back[x] : background, nearest = 0;
+                    for (size_t f = 0; f < faces.size(); f++)
+                    {
+                        Vec3d q = H[f]*ray;
+                        double v;
+                        if (q[2] > nearest && sample(faces[f].texture, q[0]/q[2], q[1]/q[2], v))
+                        {
+                            nearest = q[2];
+                            value = v;
+                        }
+                    }
+                    sum += value;
+                }
+            out[x] = saturate_cast<uchar>(sum/(superSampling*superSampling));
+        }
+    }
+}
+
+// Background of the stressed views: "texture" is a dense binary noise of 4 pixel blocks, which gives the
+// thresholds tens of thousands of contours, and "markers" a grid of hundreds of random markers of the dictionary,
+// decoys that go through every stage of the detector. Empty for the other kinds
+static Mat stressBackground(const string &kind, Size size, const string &dictionary, mt19937 &rng)
+{
+    Mat back;
+    if (kind == "texture") {
+        Mat blocks((size.height + 3)/4, (size.width + 3)/4, CV_8UC1);
+        for (int y = 0; y < blocks.rows; y++)
+            for (int x = 0; x < blocks.cols; x++)
+                blocks.at<uchar>(y, x) = (rng() & 1) ? 230 : 25;
+        resize(blocks, back, Size(blocks.cols*4, blocks.rows*4), 0, 0, INTER_NEAREST);
+        back = back(Rect(0, 0, size.width, size.height)).clone();
+    }
+    else if (kind == "markers") {
+        Dictionary dict = Dictionary::load(dictionary);
+        int cell = max(24, size.width/32), side = cell*4/5, bits = (int)sqrt((double)dict.nbits()) + 2;
+        back = Mat(size, CV_8UC1, Scalar(200));
+        for (int y = 0; y + cell <= size.height; y += cell)
+            for (int x = 0; x + cell <= size.width; x += cell) {
+                Mat marker = dict.getMarkerImage_id((int)(rng() % dict.size()), max(1, side/bits), false), scaled;
+                resize(marker, scaled, Size(side, side), 0, 0, INTER_NEAREST);
+                scaled.copyTo(back(Rect(x + (cell - side)/2, y + (cell - side)/2, side, side)));
+            }
+    }
+    return back;
+}
+
+// Degrades a rendered view: "blur" is a motion blur along a random direction over 1% of the width, and
+// "overexposure" a gain that clips the white of the pattern and lifts its black
+static void stressView(const string &kind, Mat &img, mt19937 &rng)
+{
+    if (kind == "blur") {
+        int length = max(3, img.cols/100) | 1;
+        double angle = (rng() % 180)*CV_PI/180;
+        Mat kernel = Mat::zeros(length, length, CV_32F);
+        Point2d c(length/2, length/2), d(cos(angle)*length/2, sin(angle)*length/2);
+        line(kernel, Point(cvRound(c.x - d.x), cvRound(c.y - d.y)), Point(cvRound(c.x + d.x), cvRound(c.y + d.y)),
+             Scalar(1));
+        kernel /= sum(kernel)[0];
+        filter2D(img, img, -1, kernel);
+    }
+    else if (kind == "overexposure")
+        img.convertTo(img, -1, 2.5, 40);
+}
+
+int main(int argc, char **argv) {
+    try {
+        CmdLineParser cml(argc,argv);
+        if (argc < 2 || cml["-h"]) {
+            cerr << "Usage: outputFolder (must exist)\n"
+            "   [-c <arucoConfig>]   #ArUco pattern config to render (the box of the input folder default)\n"
+            "   [-cb <W:H>]          #render a chessboard of W:H inner corners instead\n"
+            "   [-sq <squareSize>]   #chessboard square size, in the units of the settings (1 default)\n"
+            "   [-n <views>]         #number of views (100 default)\n"
+            "   [-size <W:H>]        #image size (3840:2160 default)\n"
+            "   [-f <focal>]         #focal length in pixels (0.8 times the width default)\n"
+            "   [-k <k1,k2,p1,p2,k3>] #distortion coefficients (-0.1,0.02,0,0,0 default)\n"
+            "   [-t <degrees>]       #maximum tilt of the views from the main view direction (35 default)\n"
+            "   [-b <baseline>]      #render stereo pairs, the right camera this far along x (0 default)\n"
+            "   [-ss <samples>]      #supersampling per pixel side (2 default)\n"
+            "   [-noise <sigma>]     #gaussian image noise (2 default)\n"
+            "   [-stress <kind>]     #pathological views: texture, markers (dense background), blur or overexposure\n"
+            "   [-e <ext>]           #image format (png default)\n"
+            "   [-r <randSeed>]      #seed of the poses\n" << endl;
+            return -1;
+        }
+        string folder = argv[1];
+        if (folder.back() != '/') folder += "/";
+
+        vector<face> faces;
+        string dictionary = "ARUCO_MIP_36h12";     // Of the decoy markers of a chessboard
+        Size boardSize;
+        bool chessboard = cml["-cb"];
+        if (chessboard) {
+            if (sscanf(cml("-cb").c_str(), "%d:%d", &boardSize.width, &boardSize.height) != 2 || boardSize.area() <= 0) {
+                cerr << "Incorrect chessboard size " << cml("-cb") << endl;
+                return -1;
+            }
+            chessboardFace(boardSize, stod(cml("-sq","1")), 200, faces);
+        }
+        else if (!boxFaces(cml("-c","../input/arucoPatternConfigs/boxConfig.yml"), 200, faces, dictionary)) {
+            cerr << "Invalid ArUco pattern config " << cml("-c","../input/arucoPatternConfigs/boxConfig.yml") << endl;
+            return -1;
+        }
+
+        Size size;
+        if (sscanf(cml("-size","3840:2160").c_str(), "%d:%d", &size.width, &size.height) != 2 || size.area() <= 0) {
+            cerr << "Incorrect image size " << cml("-size") << endl;
+            return -1;
+        }
+        double focal = stod(cml("-f", to_string(0.8*size.width)));
+        Mat K = (Mat_<double>(3, 3) << focal, 0, (size.width - 1)/2., 0, focal, (size.height - 1)/2., 0, 0, 1);
+        Mat dist = Mat::zeros(5, 1, CV_64F);
+        if (sscanf(cml("-k","-0.1,0.02,0,0,0").c_str(), "%lf,%lf,%lf,%lf,%lf", &dist.at<double>(0), &dist.at<double>(1),
+                   &dist.at<double>(2), &dist.at<double>(3), &dist.at<double>(4)) != 5) {
+            cerr << "Incorrect distortion coefficients " << cml("-k") << endl;
+            return -1;
+        }
+        int nViews = stoi(cml("-n","100"));
+        double maxTilt = stod(cml("-t","35"))*CV_PI/180;
+        double baseline = stod(cml("-b","0"));
+        int superSampling = max(1, stoi(cml("-ss","2")));
+        double noise = stod(cml("-noise","2"));
+        string ext = cml("-e","png");
+        string stress = cml("-stress","");
+        if (!stress.empty() && stress != "texture" && stress != "markers" && stress != "blur" && stress != "overexposure") {
+            cerr << "Unknown stress " << stress << endl;
+            return -1;
+        }
+        mt19937 rng(stoi(cml("-r","0")));
+        mt19937 stressRng(stoi(cml("-r","0")) + 1);      // Apart, so the poses are those of the unstressed views
+        uniform_real_distribution<double> uniform(0, 1);
+        normal_distribution<double> gauss(0, 1);
+
+        // The views look at the pattern from the side its textures are read from
+        Vec3d lo(DBL_MAX, DBL_MAX, DBL_MAX), hi(-DBL_MAX, -DBL_MAX, -DBL_MAX), mainDir(0, 0, 0);
+        for (auto &f:faces) {
+            for (int c = 0; c < 4; c++) {
+                Vec3d p = f.M*Vec3d((c & 1) ? f.texture.cols : 0, (c & 2) ? f.texture.rows : 0, 1);
+                for (int k = 0; k < 3; k++) { lo[k] = min(lo[k], p[k]); hi[k] = max(hi[k], p[k]); }
+            }
+            mainDir += f.normal;
+        }
+        mainDir *= 1./norm(mainDir);
+        Vec3d center = (lo + hi)*0.5;
+        double radius = norm(hi - lo)/2;
+
+        Mat rays = rayGrid(size, K, dist);
+        Mat img(size, CV_8UC1), poses(nViews, 6, CV_64F);
+        FileStorage list(folder + "images.yml", FileStorage::WRITE);
+        list << "images" << "[";
+        for (int v = 0; v < nViews; v++) {
+            // Direction tilted from the main one, a distance that fills 40 to 90% of the image, a random
+            // roll and a target near the pattern center
+            Vec3d axis(gauss(rng), gauss(rng), gauss(rng));
+            axis -= mainDir*axis.dot(mainDir);
+            Mat Rtilt;
+            Rodrigues(Mat(axis*(maxTilt*sqrt(uniform(rng))/norm(axis))), Rtilt);
+            Vec3d z = Matx33d((double*)Rtilt.data)*mainDir;
+            double fill = 0.4 + 0.5*uniform(rng);
+            double distance = radius*focal/(fill*min(size.width, size.height)/2);
+            Vec3d target = center + Vec3d(gauss(rng), gauss(rng), gauss(rng))*(0.1*radius);
+            Vec3d C = target - z*distance;
+            Vec3d up = fabs(z[1]) < 0.9 ? Vec3d(0, 1, 0) : Vec3d(1, 0, 0);
+            Vec3d x = up.cross(z);
+            x *= 1./norm(x);
+            Vec3d y = z.cross(x);
+            double roll = (uniform(rng) - 0.5)*CV_PI/2;
+            Vec3d xr = x*cos(roll) + y*sin(roll), yr = z.cross(xr);
+            Matx33d R(xr[0], xr[1], xr[2], yr[0], yr[1], yr[2], z[0], z[1], z[2]);
+            Vec3d t = -(R*C);
+
+            Mat rvec;
+            Rodrigues(Mat(R), rvec);
+            for (int k = 0; k < 3; k++) {
+                poses.at<double>(v, k) = rvec.at<double>(k);
+                poses.at<double>(v, 3 + k) = t[k];
+            }
+
+            for (int cam = 0; cam < (baseline != 0 ? 2 : 1); cam++) {
+                renderView(faces, rays, R, cam == 0 ? t : t - Vec3d(baseline, 0, 0), superSampling,
+                           stressBackground(stress, size, dictionary, stressRng), img);
+                stressView(stress, img, stressRng);
+                if (noise > 0) {
+                    Mat n(size, CV_16S);
+                    randn(n, 0, noise);
+                    add(img, n, img, noArray(), CV_8U);
+                }
+                char name[64];
+                sprintf(name, "view%05d%s.%s", v, baseline != 0 ? (cam == 0 ? "_l" : "_r") : "", ext.c_str());
+                if (!imwrite(folder + name, img)) {
+                    cerr << "Could not write " << folder + name << endl;
+                    return -1;
+                }
+                list << folder + name;
+            }
+            printf("\rView %d of %d", v + 1, nViews);
+            fflush(stdout);
+        }
+        list << "]";
+        list.release();
+
+        FileStorage fs(folder + "groundTruth.yml", FileStorage::WRITE);
+        fs << "Image_Width" << size.width;
+        fs << "Image_Height" << size.height;
+        fs << "Calibration_Pattern" << (chessboard ? "CHESSBOARD" : "ARUCO_BOX");
+        if (!stress.empty())
+            fs << "Stress" << stress;
+        if (chessboard) {
+            fs << "Board_Width" << boardSize.width;
+            fs << "Board_Height" << boardSize.height;
+        }
+        fs << "Camera_Matrix" << K;
+        fs << "Distortion_Coefficients" << dist;
+        // Rotation vector and translation of each view, from the pattern to the (left) camera
+        fs << "Extrinsic_Parameters" << poses;
+        if (baseline != 0)
+            fs << "Stereo_Parameters" << "{" << "Rotation_Matrix" << Mat::eye(3, 3, CV_64F)
+               << "Translation_Vector" << (Mat_<double>(3, 1) << -baseline, 0, 0) << "}";
+        printf("\n%d views written to %s\n", nViews, folder.c_str());
+
+    } catch (exception &ex) {
+        cout << ex.what() << endl;
+    }
+}
@@ -1,15 +1,24 @@
 /* imdiff.cpp - visual alignment of two images
  *
  * CS 453 openCV demo
+ *
+ * While the image is dragged, the difference is drawn from copies of the images at the width of the display,
+ * and it is computed at full resolution, then shown at that width, once the mouse button is released. The
+ * key 'p' (or -a without a window) aligns the images by phase correlation, coarse to fine in a pyramid, and
+ * prints the sub-pixel dx and dy. On rectified pairs, dy is the vertical misalignment.
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include "opencv2/opencv.hpp"
 
 using namespace cv;
 using namespace std;
 
 Mat im0, im1;
+Mat im0s, im1s; // images at the display width
+float scale = 1; // display width / image width
 Mat im1t; // transformed image 1
 Mat imd; // "difference" image
 const char *win = "imdiff";
@@ -19,16 +28,78 @@ float dy = 0;
 float startx = 9999;
 float starty = 9999;
 
-void imdiff()
+// Difference of a and b moved by (dx, dy) * s, with the shift written on it
+void drawDiff(const Mat &a, const Mat &b, float s, Mat &out)
+{
+    Mat T1 = (Mat_<float>(2,3) << 1, 0, dx*s, 0, 1, dy*s);
+    warpAffine(b, im1t, T1, b.size());
+    addWeighted(a, 1, im1t, -1, 128, out);
+}
+
+void showDiff(Mat &d)
 {
-    float s = 1;
-    Mat T1 = (Mat_<float>(2,3) << s, 0, dx, 0, s, dy); 
-    warpAffine(im1, im1t, T1, im1.size());
-    addWeighted(im0, 1, im1t, -1, 128, imd);
     char txt[100];
     sprintf(txt, "dx=%g  dy=%g", dx, dy);
-    putText(imd, txt, Point(5, 10), FONT_HERSHEY_PLAIN, 0.8, Scalar(255, 255, 255));
-    imshow(win, imd);
+    putText(d, txt, Point(5, 10), FONT_HERSHEY_PLAIN, 0.8, Scalar(255, 255, 255));
+    imshow(win, d);
+}
+
+// Live view while dragging: the difference of the images at the display width
+void imdiffPreview()
+{
+    drawDiff(im0s, im1s, scale, imd);
+    showDiff(imd);
+}
+
+// Final view: the difference at full resolution, reduced to the display width
+void imdiff()
+{
+    Mat full;
+    drawDiff(im0, im1, 1, full);
+    if (scale < 1)
+        resize(full, imd, im0s.size(), 0, 0, INTER_AREA);
+    else
+        imd = full;
+    showDiff(imd);
+}
+
+// Shift that moves b onto a, by phase correlation of the levels of a pyramid. The coarsest level, at most
+// 512 pixels wide, gives the shift, and each finer level corrects it after moving b by it
+Point2d align(const Mat &a, const Mat &b, double &response)
+{
+    vector<Mat> pa(1), pb(1);
+    cvtColor(a, pa[0], COLOR_BGR2GRAY);
+    cvtColor(b, pb[0], COLOR_BGR2GRAY);
+    pa[0].convertTo(pa[0], CV_32F);
+    pb[0].convertTo(pb[0], CV_32F);
+    while (pa.back().cols > 512 && pa.back().rows > 64) {
+        pa.push_back(Mat());
+        pb.push_back(Mat());
+        pyrDown(pa[pa.size()-2], pa.back());
+        pyrDown(pb[pb.size()-2], pb.back());
+    }
+
+    Point2d shift(0, 0);
+    for (int l = (int)pa.size()-1; l >= 0; l--) {
+        if (l < (int)pa.size()-1)
+            shift *= 2;
+        Mat moved, window;
+        Mat T = (Mat_<double>(2,3) << 1, 0, shift.x, 0, 1, shift.y);
+        warpAffine(pb[l], moved, T, pb[l].size(), INTER_LINEAR, BORDER_REPLICATE);
+        createHanningWindow(window, pa[l].size(), CV_32F);
+        Point2d d = phaseCorrelate(moved, pa[l], window, &response);
+        shift += d;
+    }
+    return shift;
+}
+
+void autoAlign()
+{
+    double response;
+    Point2d shift = align(im0, im1, response);
+    dx = (float)shift.x;
+    dy = (float)shift.y;
+    printf("phase correlation: dx=%.3f dy=%.3f (response %.3f)\n", shift.x, shift.y, response);
 }
 
 void changedx(int, void *)
@@ -39,11 +110,11 @@ void changedx(int, void *)
 
 static void onMouse( int event, int x, int y, int, void* )
 {
-    //printf("x=%d y=%d    ", x, y);
-    //printf("dx=%g dy=%g\n", dx, dy);
+    // The window shows the images at the display width, so the mouse moves them by 1/scale pixels
+    float fx = x/scale, fy = y/scale;
     if (event == CV_EVENT_LBUTTONDOWN) {
-	startx = x-dx;
-	starty = y-dy;
+	startx = fx-dx;
+	starty = fy-dy;
     } else if (event == CV_EVENT_LBUTTONUP) {
 	startx = 9999;
 	starty = 9999;
@@ -51,33 +122,55 @@ static void onMouse( int event, int x, int y, int, void* )
 	waitKey(1);
 	imdiff();
     } else if (event == CV_EVENT_MOUSEMOVE && startx < 9999) {
-	dx = x - startx;
-	dy = y - starty;
-	imdiff();
+	dx = fx - startx;
+	dy = fy - starty;
+	imdiffPreview();
     }
 }
 
 int main(int argc, char ** argv)
 {
     if (argc < 3) {
-	fprintf(stderr, "usage: %s im1 im2\n", argv[0]);
+	fprintf(stderr, "usage: %s im1 im2 [-w <displayWidth>] [-a]\n"
+	        "   -w   width at which the images are shown and dragged (1280 default, 0 for full resolution)\n"
+	        "   -a   print the alignment of the images by phase correlation and exit, without a window\n", argv[0]);
 	exit(1);
     }
+    int displayWidth = 1280;
+    bool alignOnly = false;
+    for (int i = 3; i < argc; i++) {
+	if (!strcmp(argv[i], "-w") && i+1 < argc)
+	    displayWidth = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-a"))
+	    alignOnly = true;
+    }
 
     im0 = imread(argv[1], 1);
-    if (!im0.data) { 
-	fprintf(stderr, "cannot read image %s\n", argv[1]); 
-	exit(1); 
+    if (!im0.data) {
+	fprintf(stderr, "cannot read image %s\n", argv[1]);
+	exit(1);
     }
     im1 = imread(argv[2], 1);
-    if (!im1.data) { 
-	fprintf(stderr, "cannot read image %s\n", argv[2]); 
-	exit(1); 
+    if (!im1.data) {
+	fprintf(stderr, "cannot read image %s\n", argv[2]);
+	exit(1);
+    }
+    if (im0.size() != im1.size()) {
+	fprintf(stderr, "the images must have the same size\n");
+	exit(1);
+    }
+    if (alignOnly) {
+	autoAlign();
+	return 0;
     }
 
-    // convert to gray
-    //cvtColor(im0, im0bw, CV_RGB2GRAY );  
-    //cvtColor(im1, im1bw, CV_RGB2GRAY );  
+    im0s = im0;
+    im1s = im1;
+    if (displayWidth > 0 && im0.cols > displayWidth) {
+	scale = (float)displayWidth/im0.cols;
+	resize(im0, im0s, Size(), scale, scale, INTER_AREA);
+	resize(im1, im1s, Size(), scale, scale, INTER_AREA);
+    }
 
     namedWindow(win, CV_WINDOW_AUTOSIZE);
     createTrackbar("dx", win, &dxval, 100, changedx);
@@ -100,15 +193,22 @@ int main(int argc, char ** argv)
 	case '.': // small step to the right
 	    dx += step; imdiff(); break;
 	case 2490368: case 65362: // up arrow
-	    dy -= step; imdiff(); break; 
+	    dy -= step; imdiff(); break;
 	case 2621440: case 65364: // down arrow
 	    dy += step; imdiff(); break;
 	case ' ': // reset
 	    dx = 0; dy = 0; imdiff(); break;
+	case 'p': // align automatically
+	    autoAlign(); imdiff(); break;
 	case 'a': // show original left image
-	    imshow(win, im0); break;
+	    imshow(win, im0s); break;
 	case 's': // show original right image
-	    imshow(win, im1t); break;
+	    {
+		Mat T1 = (Mat_<float>(2,3) << 1, 0, dx*scale, 0, 1, dy*scale);
+		warpAffine(im1s, im1t, T1, im1s.size());
+		imshow(win, im1t);
+	    }
+	    break;
 	default:
 	    printf("key %d (%c %d) pressed\n", c, (char)c, (char)c);
 	}
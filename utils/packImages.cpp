@@ -0,0 +1,58 @@
+/* packImages.cpp - packs the images of an image list into a frame container
+ *
+ * The container can be used as ImageList_Filename, so the images are not decoded
+ * again at each run (see src/frameContainer.h). Every image must have the same size.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "frameContainer.h"
+
+using namespace cv;
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    bool gray = argc == 4 && strcmp(argv[3], "-g") == 0;
+    if (argc < 3 || argc > 4 || (argc == 4 && !gray)) {
+        fprintf(stderr, "Usage: %s imageList.yml output.frames [-g]\n"
+                "   -g   store grayscale frames (enough unless undistorted or detected color images are saved)\n", argv[0]);
+        return -1;
+    }
+
+    // Same list format as the image list of the settings: the first top level sequence
+    vector<string> names;
+    FileStorage fs(argv[1], FileStorage::READ);
+    FileNode n = fs.isOpened() ? fs.getFirstTopLevelNode() : FileNode();
+    if (n.type() != FileNode::SEQ) {
+        fprintf(stderr, "Invalid image list: %s\n", argv[1]);
+        return -1;
+    }
+    for (FileNodeIterator it = n.begin(); it != n.end(); ++it)
+        names.push_back((string)*it);
+
+    frameContainerWriter writer;
+    for (size_t i = 0; i < names.size(); i++) {
+        Mat img = imread(names[i], gray ? CV_LOAD_IMAGE_GRAYSCALE : CV_LOAD_IMAGE_COLOR);
+        if (!img.data) {
+            fprintf(stderr, "Could not read image: %s\n", names[i].c_str());
+            return -1;
+        }
+        if (i == 0 && !writer.open(argv[2], names, img.size(), img.type())) {
+            fprintf(stderr, "Could not create %s\n", argv[2]);
+            return -1;
+        }
+        if (!writer.write(img)) {
+            fprintf(stderr, "Could not write %s: every image must have the size of the first one\n", names[i].c_str());
+            return -1;
+        }
+    }
+    if (names.empty() || !writer.close()) {
+        fprintf(stderr, "Could not write %s\n", argv[2]);
+        return -1;
+    }
+    printf("%d frames written to %s\n", (int)names.size(), argv[2]);
+    return 0;
+}